@@ -84,7 +84,7 @@ private:
 
     static unsigned const timer_frequency = 3579545;
 
-    static Paddr dmar, facs, fadt, madt, mcfg, rsdt, xsdt;
+    static Paddr dmar, facs, fadt, madt, mcfg, rsdt, srat, xsdt;
 
     static Acpi_gas pm1a_sts;
     static Acpi_gas pm1b_sts;
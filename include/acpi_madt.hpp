@@ -39,6 +39,7 @@ public:
         LAPIC = 0,
         IOAPIC = 1,
         INTR = 2,
+        X2APIC = 9,
     };
 };
 
@@ -53,6 +54,18 @@ public:
     uint32 flags;
 };
 
+/*
+ * Processor Local x2APIC (5.2.12.12)
+ */
+class Acpi_x2apic : public Acpi_apic
+{
+public:
+    uint16 reserved;
+    uint32 x2apic_id;
+    uint32 flags;
+    uint32 acpi_uid;
+};
+
 /*
  * Multiple APIC Description Table
  */
@@ -60,6 +73,7 @@ class Acpi_table_madt : public Acpi_table
 {
 private:
     static void parse_lapic(Acpi_apic const*);
+    static void parse_x2apic(Acpi_apic const*);
 
     void parse_entry(Acpi_apic::Type, void (*)(Acpi_apic const*)) const;
 
@@ -0,0 +1,84 @@
+/*
+ * Advanced Configuration and Power Interface (ACPI)
+ *
+ * This file is part of the Hedron hypervisor.
+ *
+ * Hedron is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Hedron is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License version 2 for more details.
+ */
+
+#pragma once
+
+#include "acpi_table.hpp"
+
+#pragma pack(1)
+
+/*
+ * Static Resource Affinity Structure (5.2.16)
+ */
+class Acpi_affinity
+{
+public:
+    uint8 type;
+    uint8 length;
+
+    enum Type
+    {
+        LAPIC = 0,
+        MEMORY = 1,
+        X2APIC = 2,
+    };
+};
+
+/*
+ * Processor Local APIC/SAPIC Affinity Structure (5.2.16.1)
+ */
+class Acpi_affinity_lapic : public Acpi_affinity
+{
+public:
+    uint8 domain_lo;
+    uint8 apic_id;
+    uint32 flags;
+    uint8 sapic_eid;
+    uint8 domain_hi[3];
+    uint32 clock_domain;
+};
+
+/*
+ * Processor Local x2APIC Affinity Structure (5.2.16.3)
+ */
+class Acpi_affinity_x2apic : public Acpi_affinity
+{
+public:
+    uint16 reserved;
+    uint32 domain;
+    uint32 x2apic_id;
+    uint32 flags;
+    uint32 clock_domain;
+};
+
+/*
+ * System Resource Affinity Table
+ */
+class Acpi_table_srat : public Acpi_table
+{
+private:
+    // Record the proximity domain of the CPU with the given APIC ID.
+    static void set_domain(uint32 apic_id, uint32 domain);
+
+public:
+    uint32 reserved0;
+    uint64 reserved1;
+    Acpi_affinity affinity[];
+
+    // Find the proximity domains of the CPUs that Acpi_table_madt::parse found. Disabled entries are ignored.
+    void parse() const;
+};
+
+#pragma pack()
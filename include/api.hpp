@@ -41,4 +41,7 @@ enum class hypercall_id
     HC_KP_CTRL = 17,
     HC_CREATE_VCPU = 19,
     HC_VCPU_CTRL = 20,
+    HC_BATCH = 21,
+    HC_VCPU_MIGRATE = 22,
+    HC_VCPU_EPT_VIEWS = 23,
 };
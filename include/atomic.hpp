@@ -66,6 +66,11 @@ public:
         return __atomic_sub_fetch(&ptr, v, O);
     }
 
+    template <typename T, Memory_order O = SEQ_CST> static inline T fetch_or(T& ptr, T v)
+    {
+        return __atomic_fetch_or(&ptr, v, O);
+    }
+
     template <typename T, Memory_order O = SEQ_CST> static inline void set_mask(T& ptr, T v)
     {
         __atomic_fetch_or(&ptr, v, O);
@@ -76,6 +81,9 @@ public:
         __atomic_fetch_and(&ptr, ~v, O);
     }
 
+    // Orders the memory accesses around the fence according to O without accessing memory itself.
+    template <Memory_order O = SEQ_CST> static inline void fence() { __atomic_thread_fence(O); }
+
     template <typename T, Memory_order O = SEQ_CST> static inline bool test_set_bit(T& val, unsigned long bit)
     {
         auto const bitmask{static_cast<T>(1) << bit};
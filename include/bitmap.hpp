@@ -146,6 +146,51 @@ public:
         return bitmap_[word_index(i)] & bit_mask(i);
     }
 
+    /// Return the index of the highest set bit or -1, if no bit is set.
+    ///
+    /// This only scans the backing words from the top and does not depend on the number of set bits.
+    long find_last_set() const
+    {
+        static_assert(sizeof(T) <= sizeof(mword), "Backing type too large for bit scanning");
+
+        for (size_t w = WORDS; w-- > 0;) {
+            mword word{static_cast<mword>(bitmap_[w])};
+
+            // Bits beyond NUMBER_OF_BITS may be set by the constructor, but are not part of the bitmap.
+            if (w == WORDS - 1 and NUMBER_OF_BITS % BITS_PER_WORD != 0) {
+                word &= (static_cast<mword>(1) << (NUMBER_OF_BITS % BITS_PER_WORD)) - 1;
+            }
+
+            if (word) {
+                return static_cast<long>(w * BITS_PER_WORD) + bit_scan_reverse(word);
+            }
+        }
+
+        return -1;
+    }
+
+    /// Call fn with the index of each set bit in ascending order.
+    ///
+    /// This scans the backing words and skips over clear bits, so its cost depends on the number of set bits.
+    /// Each backing word is read atomically once. Bits that are set concurrently may be missed.
+    template <typename FN> void for_each_set(FN fn) const
+    {
+        static_assert(sizeof(T) <= sizeof(mword), "Backing type too large for bit scanning");
+
+        for (size_t w = 0; w < WORDS; w++) {
+            mword word{static_cast<mword>(Atomic::load(bitmap_[w]))};
+
+            // Bits beyond NUMBER_OF_BITS may be set by the constructor, but are not part of the bitmap.
+            if (w == WORDS - 1 and NUMBER_OF_BITS % BITS_PER_WORD != 0) {
+                word &= (static_cast<mword>(1) << (NUMBER_OF_BITS % BITS_PER_WORD)) - 1;
+            }
+
+            for (; word; word &= word - 1) {
+                fn(w * BITS_PER_WORD + static_cast<size_t>(bit_scan_forward(word)));
+            }
+        }
+    }
+
     /// Atomically set a bit in the bitmap and return its old value.
     bool atomic_fetch(size_t i) const
     {
@@ -0,0 +1,47 @@
+/*
+ * Boot Profile
+ *
+ * This file is part of the Hedron hypervisor.
+ *
+ * Hedron is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Hedron is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License version 2 for more details.
+ */
+
+#pragma once
+
+#include "types.hpp"
+#include "x86.hpp"
+
+// TSC timestamps of the phases of the initial boot.
+//
+// Each phase is marked on the BSP when it ends. The table is printed with TRACE_BOOT right before the
+// roottask starts. Resume from ACPI sleep states is not profiled.
+class Boot_profile
+{
+public:
+    enum Phase : unsigned
+    {
+        START,    // Entry into init().
+        CTORS,    // Global constructors, including the memory map of the kernel PD (Space_mem::insert_root).
+        ACPI,     // Parsing the ACPI tables.
+        HIP,      // Hip::build.
+        BSP,      // Cpu::init on the BSP.
+        APS,      // Starting and initializing the APs until all CPUs reach the boot barrier.
+        ROOTTASK, // Loading the roottask ELF image in Ec::root_invoke.
+
+        NUM_PHASES,
+    };
+
+    static void mark(Phase phase) { tsc[phase] = rdtsc(); }
+
+    static void print();
+
+private:
+    static inline uint64 tsc[NUM_PHASES];
+};
@@ -26,7 +26,7 @@
 /// See docs/implementation.md for a general overview of the boot flow.
 class Bootstrap
 {
-    /// A spinlock that serializes CPU initialization.
+    /// A spinlock that serializes the use of the shared boot stack.
     static inline mword boot_lock asm("boot_lock");
 
     static void release_next_cpu() { Atomic::store(boot_lock, static_cast<mword>(1)); }
@@ -0,0 +1,438 @@
+/*
+ * B+ Tree
+ *
+ * This file is part of the Hedron hypervisor.
+ *
+ * Hedron is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Hedron is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License version 2 for more details.
+ */
+
+#pragma once
+
+#include "assert.hpp"
+#include "types.hpp"
+
+// A B+ tree that maps unique keys to pointers to T.
+//
+// Each node holds up to KEYS keys in one array, so a lookup scans a few cache lines per level instead of
+// chasing one pointer per comparison like a binary tree. The values live in the leaves. The leaves are not
+// linked, because finding a neighbor only needs to remember the last subtree that the lookup passed by.
+//
+// Insertions and removals rebalance on the way down, so they never have to walk back up. ALLOC provides the
+// memory for nodes with static alloc and free functions. alloc must return at least sizeof(Btree::Node)
+// bytes, which need not be initialized, because the tree only reads the entries below the count that
+// new_node sets. The tree does no locking of its own.
+template <typename T, typename ALLOC> class Btree
+{
+public:
+    static constexpr unsigned KEYS{15};
+
+    struct Node {
+        mword keys[KEYS];
+
+        // Inner nodes have one child more than keys. All keys in child i are at least keys[i - 1] and less
+        // than keys[i]. Leaves use the first KEYS entries for the values that belong to the keys.
+        void* ptrs[KEYS + 1];
+
+        unsigned cnt;
+        bool leaf;
+    };
+
+private:
+    // Nodes other than the root never have less keys than this, so two of them fit into one node.
+    static constexpr unsigned MIN_KEYS{KEYS / 2};
+
+    Node* root{nullptr};
+
+    static Node* child(Node* n, unsigned i) { return static_cast<Node*>(n->ptrs[i]); }
+
+    // The number of keys in the node that are not larger than key.
+    static unsigned upper_bound(Node const* n, mword key)
+    {
+        unsigned i{0};
+
+        while (i < n->cnt and n->keys[i] <= key) {
+            i++;
+        }
+
+        return i;
+    }
+
+    static Node* new_node(bool leaf)
+    {
+        Node* const n{static_cast<Node*>(ALLOC::alloc())};
+
+        n->cnt = 0;
+        n->leaf = leaf;
+
+        return n;
+    }
+
+    static T* first(Node* n)
+    {
+        while (not n->leaf) {
+            n = child(n, 0);
+        }
+
+        return static_cast<T*>(n->ptrs[0]);
+    }
+
+    static T* last(Node* n)
+    {
+        while (not n->leaf) {
+            n = child(n, n->cnt);
+        }
+
+        return static_cast<T*>(n->ptrs[n->cnt - 1]);
+    }
+
+    static void free_subtree(Node* n)
+    {
+        if (not n->leaf) {
+            for (unsigned i{0}; i <= n->cnt; i++) {
+                free_subtree(child(n, i));
+            }
+        }
+
+        ALLOC::free(n);
+    }
+
+    // Split the full child i of the given node, which must not be full itself.
+    static void split_child(Node* n, unsigned i)
+    {
+        Node* const left{child(n, i)};
+        Node* const right{new_node(left->leaf)};
+
+        assert(n->cnt < KEYS and left->cnt == KEYS);
+
+        unsigned const half{KEYS / 2};
+        mword separator;
+
+        if (left->leaf) {
+            // Leaves keep all their keys. The first key of the right half also separates the two.
+            right->cnt = KEYS - half;
+
+            for (unsigned j{0}; j < right->cnt; j++) {
+                right->keys[j] = left->keys[half + j];
+                right->ptrs[j] = left->ptrs[half + j];
+            }
+
+            separator = right->keys[0];
+        } else {
+            // The middle key moves up into the parent.
+            right->cnt = KEYS - half - 1;
+
+            for (unsigned j{0}; j < right->cnt; j++) {
+                right->keys[j] = left->keys[half + 1 + j];
+            }
+
+            for (unsigned j{0}; j <= right->cnt; j++) {
+                right->ptrs[j] = left->ptrs[half + 1 + j];
+            }
+
+            separator = left->keys[half];
+        }
+
+        left->cnt = half;
+
+        for (unsigned j{n->cnt}; j > i; j--) {
+            n->keys[j] = n->keys[j - 1];
+            n->ptrs[j + 1] = n->ptrs[j];
+        }
+
+        n->keys[i] = separator;
+        n->ptrs[i + 1] = right;
+        n->cnt++;
+    }
+
+    // Merge child i + 1 of the given node into child i.
+    static void merge_children(Node* n, unsigned i)
+    {
+        Node* const left{child(n, i)};
+        Node* const right{child(n, i + 1)};
+
+        if (left->leaf) {
+            for (unsigned j{0}; j < right->cnt; j++) {
+                left->keys[left->cnt + j] = right->keys[j];
+                left->ptrs[left->cnt + j] = right->ptrs[j];
+            }
+
+            left->cnt += right->cnt;
+        } else {
+            left->keys[left->cnt] = n->keys[i];
+
+            for (unsigned j{0}; j < right->cnt; j++) {
+                left->keys[left->cnt + 1 + j] = right->keys[j];
+            }
+
+            for (unsigned j{0}; j <= right->cnt; j++) {
+                left->ptrs[left->cnt + 1 + j] = right->ptrs[j];
+            }
+
+            left->cnt += right->cnt + 1;
+        }
+
+        assert(left->cnt <= KEYS);
+
+        for (unsigned j{i}; j + 1 < n->cnt; j++) {
+            n->keys[j] = n->keys[j + 1];
+            n->ptrs[j + 1] = n->ptrs[j + 2];
+        }
+
+        n->cnt--;
+
+        ALLOC::free(right);
+    }
+
+    // Move the last key of child i - 1 to the front of child i.
+    static void borrow_from_left(Node* n, unsigned i)
+    {
+        Node* const left{child(n, i - 1)};
+        Node* const c{child(n, i)};
+
+        for (unsigned j{c->cnt}; j > 0; j--) {
+            c->keys[j] = c->keys[j - 1];
+        }
+
+        for (unsigned j{c->cnt + (c->leaf ? 0 : 1)}; j > 0; j--) {
+            c->ptrs[j] = c->ptrs[j - 1];
+        }
+
+        if (c->leaf) {
+            c->keys[0] = left->keys[left->cnt - 1];
+            c->ptrs[0] = left->ptrs[left->cnt - 1];
+            n->keys[i - 1] = c->keys[0];
+        } else {
+            c->keys[0] = n->keys[i - 1];
+            c->ptrs[0] = left->ptrs[left->cnt];
+            n->keys[i - 1] = left->keys[left->cnt - 1];
+        }
+
+        left->cnt--;
+        c->cnt++;
+    }
+
+    // Move the first key of child i + 1 to the end of child i.
+    static void borrow_from_right(Node* n, unsigned i)
+    {
+        Node* const c{child(n, i)};
+        Node* const right{child(n, i + 1)};
+
+        if (c->leaf) {
+            c->keys[c->cnt] = right->keys[0];
+            c->ptrs[c->cnt] = right->ptrs[0];
+        } else {
+            c->keys[c->cnt] = n->keys[i];
+            c->ptrs[c->cnt + 1] = right->ptrs[0];
+            n->keys[i] = right->keys[0];
+        }
+
+        c->cnt++;
+
+        for (unsigned j{0}; j + 1 < right->cnt; j++) {
+            right->keys[j] = right->keys[j + 1];
+        }
+
+        for (unsigned j{0}; j + (right->leaf ? 1 : 0) < right->cnt; j++) {
+            right->ptrs[j] = right->ptrs[j + 1];
+        }
+
+        right->cnt--;
+
+        if (c->leaf) {
+            n->keys[i] = right->keys[0];
+        }
+    }
+
+    // Make sure that child i of the given node has more than MIN_KEYS keys, so we can remove a key from
+    // it. Returns the index of the child that now covers the keys of child i.
+    static unsigned fill_child(Node* n, unsigned i)
+    {
+        if (child(n, i)->cnt > MIN_KEYS) {
+            return i;
+        }
+
+        if (i > 0 and child(n, i - 1)->cnt > MIN_KEYS) {
+            borrow_from_left(n, i);
+            return i;
+        }
+
+        if (i < n->cnt and child(n, i + 1)->cnt > MIN_KEYS) {
+            borrow_from_right(n, i);
+            return i;
+        }
+
+        if (i < n->cnt) {
+            merge_children(n, i);
+            return i;
+        }
+
+        merge_children(n, i - 1);
+        return i - 1;
+    }
+
+public:
+    Btree() = default;
+
+    ~Btree() { clear(); }
+
+    Btree(Btree const&) = delete;
+    Btree& operator=(Btree const&) = delete;
+
+    bool empty() const { return not root or root->cnt == 0; }
+
+    // Returns the value with the largest key that is not larger than the given key, or a nullptr.
+    T* floor(mword key) const
+    {
+        Node* n{root};
+        Node* left{nullptr};
+
+        if (not n) {
+            return nullptr;
+        }
+
+        while (not n->leaf) {
+            unsigned const i{upper_bound(n, key)};
+
+            if (i > 0) {
+                left = child(n, i - 1);
+            }
+
+            n = child(n, i);
+        }
+
+        unsigned const i{upper_bound(n, key)};
+
+        if (i > 0) {
+            return static_cast<T*>(n->ptrs[i - 1]);
+        }
+
+        return left ? last(left) : nullptr;
+    }
+
+    // Returns the value with the smallest key that is larger than the given key, or a nullptr.
+    T* above(mword key) const
+    {
+        Node* n{root};
+        Node* right{nullptr};
+
+        if (not n) {
+            return nullptr;
+        }
+
+        while (not n->leaf) {
+            unsigned const i{upper_bound(n, key)};
+
+            if (i < n->cnt) {
+                right = child(n, i + 1);
+            }
+
+            n = child(n, i);
+        }
+
+        unsigned const i{upper_bound(n, key)};
+
+        if (i < n->cnt) {
+            return static_cast<T*>(n->ptrs[i]);
+        }
+
+        return right ? first(right) : nullptr;
+    }
+
+    // Insert a value with a key that is not in the tree yet.
+    void insert(mword key, T* value)
+    {
+        if (not root) {
+            root = new_node(true);
+        }
+
+        if (root->cnt == KEYS) {
+            Node* const r{new_node(false)};
+
+            r->ptrs[0] = root;
+            root = r;
+
+            split_child(r, 0);
+        }
+
+        Node* n{root};
+
+        while (not n->leaf) {
+            unsigned i{upper_bound(n, key)};
+
+            if (child(n, i)->cnt == KEYS) {
+                split_child(n, i);
+                i = upper_bound(n, key);
+            }
+
+            n = child(n, i);
+        }
+
+        unsigned const i{upper_bound(n, key)};
+
+        assert(i == 0 or n->keys[i - 1] != key);
+
+        for (unsigned j{n->cnt}; j > i; j--) {
+            n->keys[j] = n->keys[j - 1];
+            n->ptrs[j] = n->ptrs[j - 1];
+        }
+
+        n->keys[i] = key;
+        n->ptrs[i] = value;
+        n->cnt++;
+    }
+
+    // Remove the given value with the given key. Returns false if the tree doesn't map the key to this
+    // value.
+    bool remove(mword key, T* value)
+    {
+        if (not root) {
+            return false;
+        }
+
+        Node* n{root};
+
+        while (not n->leaf) {
+            unsigned const i{fill_child(n, upper_bound(n, key))};
+            Node* const c{child(n, i)};
+
+            // A merge may have taken the last key of the root.
+            if (n == root and n->cnt == 0) {
+                root = c;
+                ALLOC::free(n);
+            }
+
+            n = c;
+        }
+
+        unsigned const i{upper_bound(n, key)};
+
+        if (i == 0 or n->keys[i - 1] != key or n->ptrs[i - 1] != value) {
+            return false;
+        }
+
+        for (unsigned j{i}; j < n->cnt; j++) {
+            n->keys[j - 1] = n->keys[j];
+            n->ptrs[j - 1] = n->ptrs[j];
+        }
+
+        n->cnt--;
+
+        return true;
+    }
+
+    // Remove all values. The values themselves are not touched.
+    void clear()
+    {
+        if (root) {
+            free_subtree(root);
+            root = nullptr;
+        }
+    }
+};
@@ -23,7 +23,18 @@
 #include "alloc_result.hpp"
 #include "extern.hpp"
 #include "memory.hpp"
-#include "spinlock.hpp"
+#include "mcs_lock.hpp"
+
+// A CPU-local stack of free single pages in front of the buddy allocator. See Buddy::try_alloc and
+// Buddy::zero_idle.
+struct Buddy_page_cache {
+    // The virtual address of the top page. Each page in the cache holds the address of the next one in its
+    // first word.
+    mword head;
+
+    // The number of pages in the cache.
+    unsigned long cnt;
+};
 
 class Buddy
 {
@@ -43,7 +54,7 @@ private:
         };
     };
 
-    Spinlock lock;
+    Mcs_lock lock;
     signed long max_idx;
     signed long min_idx;
     mword base;
@@ -51,6 +62,9 @@ private:
     Block* index;
     Block* head;
 
+    // The number of free blocks of each order. Protected by the lock.
+    unsigned long free_blocks[sizeof(mword) * 8]{};
+
     inline signed long block_to_index(Block* b) { return b - index; }
 
     inline Block* index_to_block(signed long i) { return index + i; }
@@ -63,6 +77,38 @@ private:
 
     inline mword phys_to_virt(mword phys) { return PHYS_TO_VIRT_NORELOC(phys - PHYS_RELOCATION); }
 
+    // Log the page sizes that the kernel uses to map the memory of the allocator. See Buddy::Buddy.
+    static void report_direct_map(mword virt, size_t size);
+
+    // True once CPU-local memory can be used. Before, all pages come directly from the buddy allocator.
+    static bool page_caches_enabled;
+
+    // Counts whether another CPU holds the lock. This is called right before taking the lock.
+    void count_contention();
+
+    // Allocates a block of the given order or returns nullptr. The caller has to hold the lock.
+    void* alloc_block(unsigned short ord);
+
+    // Frees a block and merges it with its buddies. The caller has to hold the lock.
+    void free_block(Block* block);
+
+    // Allocates a single page from the page cache of the current CPU.
+    void* alloc_cached();
+
+    // Frees a single page into the page cache of the current CPU.
+    void free_cached(mword virt);
+
+    // Allocates a single page from the zeroed pages of the current CPU. The page is completely zero.
+    void* alloc_zeroed();
+
+    // Returns all pages in the page caches of the current CPU to the buddy allocator. Returns the number of
+    // pages.
+    unsigned long drain_page_caches();
+
+    // Releases memory that the slab caches and the page caches of the current CPU hold, when an allocation
+    // fails. Returns the number of pages.
+    unsigned long reclaim();
+
 public:
     enum Fill
     {
@@ -73,6 +119,50 @@ public:
 
     static Buddy allocator;
 
+    // The number of pages that move between a page cache and the buddy allocator at once. Page caches hold at
+    // most twice as many pages.
+    static constexpr unsigned long PAGE_CACHE_BATCH{32};
+
+    // Enables the CPU-local page caches during single-page allocations. This has to be called once CPU-local
+    // memory is set up on the boot CPU.
+    static void enable_page_caches() { page_caches_enabled = true; }
+
+    // The number of zeroed pages that each CPU keeps for FILL_0 allocations at most.
+    static constexpr unsigned long ZERO_CACHE_PAGES{64};
+
+    // Zero one free page for later FILL_0 allocations on the current CPU. This is called from Ec::idle, so
+    // zeroing pages doesn't add to the latency of the system calls that allocate them. Returns false, if
+    // there is nothing to do.
+    bool zero_idle();
+
+    // The number of freed page table pages that each CPU keeps for new page tables at most.
+    static constexpr unsigned long PT_CACHE_PAGES{32};
+
+    // Allocates a zeroed page for a page table. Page tables that the current CPU freed recently are reused
+    // first. They are likely still in the cache of the CPU and don't go through the buddy allocator or the
+    // page cache in front of it. See Tlb_cleanup.
+    Alloc_result<void*> try_alloc_page_table();
+
+    // Frees a page table page that no CPU walks anymore, not even in software. It goes to the page table
+    // cache of the current CPU, if there is room.
+    void free_page_table(mword virt);
+
+    // Chains used pages into a list without touching their content. The link lives in the metadata of the
+    // block, which is otherwise unused while the block is allocated. Tlb_cleanup uses this for page tables
+    // that the hardware may still walk. A next address of 0 ends the list.
+    void set_next_used(mword virt, mword next);
+
+    // Returns the page that follows the given used page in its list or 0. See set_next_used.
+    mword next_used(mword virt);
+
+    // Copies the number of free blocks of each order into counts and returns the number of orders, but at
+    // most max. Long-running systems use this to watch the fragmentation of the kernel memory.
+    //
+    // If drain is true, the page caches of the current CPU go back to the buddy allocator first. The pages in
+    // the page caches don't look free to the buddy allocator and can keep their buddies from merging into
+    // larger blocks. drained is set to the number of pages this returned.
+    unsigned long free_stats(unsigned long* counts, unsigned long max, bool drain, unsigned long& drained);
+
     Buddy(mword virt, mword f_addr, size_t size);
 
     static void fill(void* dst, Fill fill_mem, size_t size);
@@ -93,6 +183,12 @@ public:
     //
     // ord is the order of pages to allocate. Passing n allocates 2^n pages. The allocated memory will be
     // initialized according to fill_mem.
+    //
+    // Single pages come from a CPU-local page cache that is refilled and drained in batches, so most of them
+    // don't need the lock. Single FILL_0 pages come from the pages that the CPU zeroed while idle first. The
+    // pages in the caches of other CPUs are not available to the current CPU. If a larger allocation fails,
+    // the current CPU returns its page caches and tries again, because the cached pages might complete a
+    // block of the requested order.
     Alloc_result<void*> try_alloc(unsigned short ord, Fill fill_mem);
 
     void free(mword addr);
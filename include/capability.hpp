@@ -20,6 +20,7 @@
 
 #pragma once
 
+#include "atomic.hpp"
 #include "kobject.hpp"
 
 class Capability
@@ -37,6 +38,21 @@ public:
     inline Kobject* obj() const { return reinterpret_cast<Kobject*>(val & ~perm); }
 
     inline unsigned prm() const { return val & perm; }
+
+    // A placeholder that occupies a capability slot without referring to an object. Lookups treat it like a
+    // null capability.
+    static Capability reserved()
+    {
+        Capability c;
+        c.val = perm;
+        return c;
+    }
+
+    // Atomically replace the capability in slot with n, if it is still o.
+    static bool cmp_swap(Capability& slot, Capability o, Capability n)
+    {
+        return Atomic::cmp_swap(slot.val, o.val, n.val);
+    }
 };
 
 // Cast a capability to a specific Kobject type with dynamic type checking.
@@ -39,9 +39,13 @@ private:
 public:
     static inline bool serial;
     static inline bool nodl;
+    static inline bool nodeepidle;
     static inline bool nopcid;
     static inline bool novga;
     static inline bool novpid;
+    static inline bool synclog;
+    static inline bool coresched;
+    static inline bool x2apic;
 
     static void init(char const*);
 };
@@ -36,9 +36,19 @@
 /// is backwards compatible and requires a minor version bump.
 ///
 /// Do not forget to update the CHANGELOG.md in the repository.
-#define CFG_VER 13002
+#define CFG_VER 14003
 
+// The maximum number of CPUs. The build system can raise it, see NUM_CPU in src/CMakeLists.txt.
+#ifndef NUM_CPU
 #define NUM_CPU 128
+#endif
+
+// The longest chain of busy ECs that a calling SC helps. Beyond it, the SC blocks until the called EC
+// replies. The build system can change it, see HELP_DEPTH_LIMIT in src/CMakeLists.txt.
+#ifndef HELP_DEPTH_LIMIT
+#define HELP_DEPTH_LIMIT 16
+#endif
+
 #define NUM_EXC 32
 #define NUM_VMI 256
 
@@ -48,10 +48,17 @@ private:
     void print_num(uint64, unsigned, unsigned, unsigned);
     void print_str(char const*, unsigned, unsigned);
 
+protected:
     FORMAT(2, 0)
     void vprintf(char const*, va_list);
 
-protected:
+    // Write raw characters to all configured consoles.
+    static void write(char const* s, size_t len);
+
+    // Write raw characters to all configured consoles, unless another CPU is writing. Stops early once stop
+    // returns true, which is checked before each character. Returns the number of characters written.
+    static size_t try_write(char const* s, size_t len, bool (*stop)());
+
     NOINLINE
     void enable()
     {
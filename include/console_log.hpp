@@ -0,0 +1,93 @@
+/*
+ * Console Log
+ *
+ * This file is part of the Hedron hypervisor.
+ *
+ * Hedron is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Hedron is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License version 2 for more details.
+ */
+
+#pragma once
+
+#include "console.hpp"
+#include "cpulocal.hpp"
+#include "memory.hpp"
+#include "types.hpp"
+
+// The log ring of one CPU. The layout is part of the ABI.
+struct Console_log_ring {
+    static constexpr size_t HEADER_SIZE{64};
+    static constexpr size_t SIZE{PAGE_SIZE - HEADER_SIZE};
+
+    // The number of bytes that were ever written to the ring. Byte i of the log lives at data[i % SIZE].
+    // The head is only advanced after a complete message was written.
+    uint64 head;
+
+    uint64 res_[HEADER_SIZE / sizeof(uint64) - 1];
+
+    char data[SIZE];
+};
+
+static_assert(sizeof(Console_log_ring) == PAGE_SIZE, "The console log ring must fill a page");
+
+// Asynchronous logging into a per-CPU ring.
+//
+// Writing to the serial console takes milliseconds per line and serializes all CPUs on the console lock.
+// Once its ring is allocated, a CPU instead formats log messages into its own ring without taking any lock.
+// Idle CPUs drain the rings to the consoles in small pieces (see Ec::idle). They start with their own ring
+// and then help with the rings of CPUs that are too busy to become idle. Only one idle CPU prints at a time
+// and it stops as soon as it has other work, so idle CPUs neither wait for the console nor for each other.
+// If a ring overflows before it is drained, the oldest messages are lost.
+//
+// User space can map the ring of a CPU read-only via a log KP (see Ec::sys_create_kp). Messages are printed
+// synchronously before the rings are allocated, when the "synclog" command-line parameter is given and
+// after a panic.
+class Console_log : public Console
+{
+    CPULOCAL_REMOTE_ACCESSOR(console_log, ring);
+    CPULOCAL_ACCESSOR(console_log, pos);
+    CPULOCAL_REMOTE_ACCESSOR(console_log, drained);
+    CPULOCAL_ACCESSOR(console_log, busy);
+    CPULOCAL_REMOTE_ACCESSOR(console_log, draining);
+
+    // The number of bytes that a CPU drains at once. The serial console needs roughly 1.5ms for them.
+    static constexpr size_t DRAIN_CHUNK{16};
+
+    static inline bool synchronous{false};
+
+    void putc(int c) override;
+
+    // Print the next piece of the log of the given CPU, unless another CPU is already printing it. With
+    // wait unset, we also give up if another CPU uses the consoles and stop early when this CPU has hazards.
+    // Returns true, if we printed something.
+    static bool drain(unsigned cpu, bool wait);
+
+    // Print the next piece of the log of the current CPU or, if it is drained, of the first other CPU that
+    // has something to print. See drain(unsigned, bool).
+    static bool drain_any(bool wait);
+
+public:
+    // Returns the log ring of the given CPU. The ring is allocated on first use. Returns nullptr if we ran
+    // out of memory.
+    static Console_log_ring* get_ring(unsigned cpu);
+
+    // Append a message to the ring of the current CPU. Returns false, if the message has to be printed
+    // synchronously instead.
+    FORMAT(1, 0)
+    static bool vprint(char const* format, va_list ap);
+
+    // Print the next piece of the log of the current CPU to the consoles or, if it is drained, of the first
+    // other CPU that has something to print. This neither waits for the consoles nor delays hazards. Returns
+    // true, if we printed something.
+    static bool drain() { return drain_any(false); }
+
+    // Print the whole log of all CPUs and print all further messages synchronously. This is used when we are
+    // about to stop the system.
+    static void flush_and_stop();
+};
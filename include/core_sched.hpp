@@ -0,0 +1,66 @@
+/*
+ * Core Scheduling
+ *
+ * This file is part of the Hedron hypervisor.
+ *
+ * Hedron is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Hedron is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License version 2 for more details.
+ */
+
+#pragma once
+
+#include "atomic.hpp"
+#include "cpulocal.hpp"
+#include "types.hpp"
+
+class Pd;
+
+// Keeps SMT siblings from executing user code of different security domains at the same time (see
+// Pd::domain). This closes the side channels between hyperthreads, so SMT can stay enabled.
+//
+// Each CPU publishes the security domain of the user code it is about to execute. A CPU may only publish a
+// domain if no sibling has published a different one. Otherwise, it executes the idle EC until a sibling
+// leaves its domain and wakes it up. Sc::schedule checks this for the SC it picks and Ec::return_to_user for
+// switches between domains via IPC.
+//
+// The domain of the core stays with the sibling that published it first as long as it has work in this
+// domain. Priorities don't take over a core. Core scheduling is off unless the coresched command-line
+// parameter is given.
+class Core_sched
+{
+    // The security domain plus one of the user code that this CPU executes or zero. Only changes with the
+    // lock of the sibling with the lowest CPU number held.
+    CPULOCAL_REMOTE_ACCESSOR(core, domain);
+
+    // True while this CPU idles, because a sibling executes another security domain.
+    CPULOCAL_REMOTE_ACCESSOR(core, waiting);
+
+    CPULOCAL_REMOTE_ACCESSOR(core, lock);
+
+    // Publishes want as the domain of this CPU, if no sibling has published another one. Publishes zero
+    // otherwise.
+    static bool publish(uint32 want);
+
+public:
+    // Returns whether this CPU may execute user code of the given PD. Pd::kern stands for the idle EC and is
+    // always admitted.
+    static bool admit(Pd const* pd)
+    {
+        uint32 const want{domain_of(pd)};
+
+        // Nothing changes, if we stay in our domain or remain outside of all domains.
+        if (EXPECT_TRUE(want == Atomic::load(domain()))) {
+            return true;
+        }
+
+        return publish(want);
+    }
+
+    static uint32 domain_of(Pd const* pd);
+};
@@ -26,11 +26,36 @@
 
 class Counter
 {
+    // The generation of TLB shootdowns. Each shootdown starts a new generation after it has marked the CPUs
+    // it needs to flush. See Space_mem::shootdown.
+    static inline mword tlb_gen{0};
+
 public:
-    CPULOCAL_ACCESSOR(counter, tlb_shootdown);
+    CPULOCAL_REMOTE_ACCESSOR(counter, tlb_ack_gen);
+    CPULOCAL_REMOTE_ACCESSOR(counter, tlb_nmi_gen);
+
+    // Start a new TLB shootdown generation and return it.
+    static mword next_tlb_gen() { return Atomic::add(tlb_gen, mword{1}); }
+
+    // Acknowledge all TLB shootdown generations up to the current one. The caller promises to flush the TLB
+    // before it executes any user/guest code, if HZD_TLB is set.
+    //
+    // Only the CPU itself writes its acknowledged generation and tlb_gen only grows, so a plain store keeps
+    // the acknowledged generation monotonic. This is safe to call in the NMI handler.
+    static void ack_tlb_shootdown() { Atomic::store(tlb_ack_gen(), Atomic::load(tlb_gen)); }
 
-    static inline uint16 remote_tlb_shootdown(unsigned cpu)
+    // Claim the NMI that makes the given CPU acknowledge generation gen. Returns false, if another CPU has
+    // already claimed an NMI for this or a later generation. Its NMI will also acknowledge our generation.
+    static bool claim_tlb_nmi(unsigned cpu, mword gen)
     {
-        return Atomic::load(Cpulocal::get_remote(cpu).counter_tlb_shootdown);
+        mword& nmi_gen{remote_ref_tlb_nmi_gen(cpu)};
+
+        for (mword cur{Atomic::load(nmi_gen)}; cur < gen; cur = Atomic::load(nmi_gen)) {
+            if (Atomic::cmp_swap(nmi_gen, cur, gen)) {
+                return true;
+            }
+        }
+
+        return false;
     }
 };
@@ -53,15 +53,26 @@ public:
         FEAT_MONITOR = 35,
         FEAT_VMX = 37,
         FEAT_PCID = 49,
+        FEAT_X2APIC = 53,
         FEAT_TSC_DEADLINE = 56,
         FEAT_XSAVE = 58,
+        FEAT_ARAT = 66,
+        FEAT_HWP = 71,
+        FEAT_HWP_ACT_WINDOW = 73,
+        FEAT_HWP_EPP = 74,
         FEAT_FSGSBASE = 96,
         FEAT_SMEP = 103,
+        FEAT_RDT_M = 108,
+        FEAT_ERMS = 105,
+        FEAT_RDT_A = 111,
         FEAT_SMAP = 116,
         FEAT_1GB_PAGES = 154,
         FEAT_CMP_LEGACY = 161,
         FEAT_XSAVEOPT = 192,
+        FEAT_XSAVEC = 193,
+        FEAT_XSAVES = 195,
 
+        FEAT_FSRM = 7 * 32 + 4,
         FEAT_IBRS_IBPB = 7 * 32 + 26,
         FEAT_STIBP = 7 * 32 + 27,
         FEAT_L1D_FLUSH = 7 * 32 + 28,
@@ -126,6 +137,8 @@ public:
         XCR0_AVX512_OP = 1UL << 5,
         XCR0_AVX512_LO = 1UL << 6,
         XCR0_AVX512_HI = 1UL << 7,
+        XCR0_AMX_CFG = 1UL << 17,
+        XCR0_AMX_DATA = 1UL << 18,
     };
 
     enum
@@ -157,8 +170,13 @@ public:
     };
 
     static inline unsigned online;
-    static inline uint8 acpi_id[NUM_CPU];
-    static inline uint8 apic_id[NUM_CPU];
+
+    // The ACPI processor UID and APIC ID of each CPU. Both can be larger than 255 with x2APIC.
+    static inline uint32 acpi_id[NUM_CPU];
+    static inline uint32 apic_id[NUM_CPU];
+
+    // The ACPI proximity domain of each CPU or zero, if the platform has no SRAT. See Acpi_table_srat.
+    static inline uint32 numa_node[NUM_CPU];
 
     CPULOCAL_CONST_ACCESSOR(cpu, id);
     CPULOCAL_REMOTE_ACCESSOR(cpu, hazard);
@@ -167,17 +185,32 @@ public:
     static unsigned& hazard(unsigned cpu) { return remote_ref_hazard(cpu); }
 
     CPULOCAL_REMOTE_ACCESSOR(cpu, might_lose_nmis);
+    CPULOCAL_REMOTE_ACCESSOR(cpu, idle_waiting);
+    CPULOCAL_REMOTE_ACCESSOR(cpu, isolated);
+    CPULOCAL_REMOTE_ACCESSOR(cpu, isolated_guest);
 
     CPULOCAL_ACCESSOR(cpu, features);
     CPULOCAL_ACCESSOR(cpu, bsp);
     CPULOCAL_ACCESSOR(cpu, maxphyaddr_ord);
     CPULOCAL_ACCESSOR(cpu, seen_spurious_nmi);
 
-    static Cpu_info init();
+    // The MWAIT hint of the deepest C-state that CPUID leaf 5 enumerates. 0 (C1) if there is none.
+    CPULOCAL_ACCESSOR(cpu, mwait_hint_deep);
+
+    // A moving average of the recent idle periods of this CPU in TSC ticks.
+    CPULOCAL_ACCESSOR(cpu, idle_avg);
+
+    // What Cpu::init found out about this CPU at boot.
+    CPULOCAL_ACCESSOR(cpu, info);
+
+    // Initialize the current CPU. On resume from a sleep state, the features that were probed at boot are
+    // still valid and are not probed again.
+    static Cpu_info init(bool resume);
 
     // Partially update CPU features. This is useful after a microcode
-    // change that may have added features.
-    static void update_features();
+    // change that may have added features. The new features apply to the
+    // siblings of the current CPU or, if all_cpus is set, to all CPUs.
+    static void update_features(bool all_cpus = false);
 
     static inline bool feature(Feature f) { return features()[f / 32] & 1U << f % 32; }
 
@@ -0,0 +1,48 @@
+/*
+ * CPU Load
+ *
+ * This file is part of the Hedron hypervisor.
+ *
+ * Hedron is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Hedron is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License version 2 for more details.
+ */
+
+#pragma once
+
+#include "config.hpp"
+#include "memory.hpp"
+#include "types.hpp"
+
+// The current load of all CPUs.
+//
+// The load fills one page that user space can map read-only via a load KP (see Ec::sys_create_kp), so it
+// can place new work without asking the kernel. Each CPU publishes its load in one 64-bit word after each
+// scheduling decision and whenever SCs join or leave its ready queue. The layout of this word is part of the
+// ABI:
+//
+//  - bits 31:0: The number of SCs that run or wait on the CPU, not counting the idle SC.
+//  - bits 39:32: The highest priority of these SCs.
+//  - bit 63: Set, if the CPU runs its idle loop.
+//
+// CPUs write their word with a single store and only if it changes, because eight CPUs share a cache line.
+class Cpu_load
+{
+public:
+    static constexpr uint64 READY_MASK{0xffffffff};
+    static constexpr unsigned PRIO_SHIFT{32};
+    static constexpr uint64 IDLE{1ULL << 63};
+
+    // Allocates the load page. Returns nullptr if we ran out of memory. The page is allocated during boot,
+    // before any CPU makes its first scheduling decision, so all online CPUs have published their load
+    // once user space can see it.
+    static uint64* get_table();
+
+    // Publishes the load of the current CPU. Does nothing, if there is no load page.
+    static void update(bool idle, size_t ready, unsigned top_prio);
+};
@@ -25,9 +25,13 @@ enum class Cpu_vendor : unsigned
 
 struct Cpu_info {
     unsigned package;
+    unsigned die;
     unsigned core;
     unsigned thread;
 
+    // The ID of the last level cache that this CPU uses. CPUs with the same ID share it.
+    unsigned llc;
+
     Cpu_vendor vendor;
     unsigned platform;
     unsigned family;
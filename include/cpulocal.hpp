@@ -17,24 +17,40 @@
 
 #pragma once
 
+#include "bitmap.hpp"
+#include "buddy.hpp"
 #include "compiler.hpp"
 #include "config.hpp"
+#include "cpuinfo.hpp"
 #include "gdt.hpp"
 #include "memory.hpp"
 #include "rcu_list.hpp"
+#include "ready_queue.hpp"
 #include "rq.hpp"
+#include "slab.hpp"
+#include "spinlock.hpp"
+#include "tlb_tag_alloc.hpp"
 #include "types.hpp"
 #include "vmx_types.hpp"
+#include "work_queue.hpp"
 
 class Ec;
 class Pd;
 class Sc;
+class Vcpu;
 class Vmcs;
+struct Parallel_job;
+struct Sched_stats;
+struct Event_trace_entry;
+struct Console_log_ring;
+struct Pmu_ring;
+class Kp;
 
 // This struct defines the layout of CPU-local memory. It's designed to make it
 // convenient to use %gs:0 to restore the stack pointer and to get a normal
 // pointer to CPU-local variables. The first members in the Per_cpu struct are
-// frequently accessed and are deliberately placed on a single cache line.
+// frequently accessed and are deliberately placed on a single cache line. The
+// members that other CPUs write follow on a cache line of their own.
 //
 //                 +---------------------+
 //                 | ... other vars ...  |
@@ -62,37 +78,110 @@ struct alignas(PAGE_SIZE) Per_cpu {
     // The APIC ID of the current CPU.
     unsigned cpu_id;
 
-    // Any special conditions that need to be checked on kernel entry/exit
-    // paths. See hazards.hpp. Has to be accessed using atomic ops!
-    unsigned cpu_hazard;
-
-    // A CPU can set this to true to prevent other CPUs from sending NMIs.
-    bool cpu_might_lose_nmis;
-
     // The current execution context.
     Ec* ec_current;
 
     // The current protection domain.
     Pd* pd_current;
 
+    // The PD that was current before pd_current. This CPU keeps its reference, so switching back and forth
+    // between two PDs doesn't touch their shared reference counts. See Pd::make_current.
+    Pd* pd_retained;
+
+    // The security domain of the PD that last ran on this CPU. See Pd::switch_domain.
+    uint32 pd_cpu_domain;
+
     // The current scheduling context.
     Sc* sc_current;
 
+    // Other CPUs write the following members to signal this CPU. They are on a cache line of their own, so
+    // these writes don't invalidate the line with the members above, which every system call uses.
+
+    // Any special conditions that need to be checked on kernel entry/exit
+    // paths. See hazards.hpp. Has to be accessed using atomic ops!
+    alignas(CACHE_LINE_SIZE) unsigned cpu_hazard;
+
+    // A CPU can set this to true to prevent other CPUs from sending NMIs.
+    bool cpu_might_lose_nmis;
+
+    // True while the CPU waits for hazards in Ec::idle. Setting a hazard is enough to wake it up, so other
+    // CPUs don't need to send an NMI. Has to be accessed using atomic ops!
+    bool cpu_idle_waiting;
+
+    // Isolated CPUs don't receive NMIs for kernel work of other CPUs while they execute a guest. The latter
+    // flag is true while they do. See Vcpu::run. Both have to be accessed using atomic ops!
+    bool cpu_isolated;
+    bool cpu_isolated_guest;
+
+    // The CPU number plus one of an idle CPU that asked for a migratable SC or zero.
+    unsigned sc_steal_req;
+
+    // The last batch for which this CPU was counted as quiet. Other CPUs claim isolated CPUs. See Rcu::claim.
+    mword rcu_q_batch;
+
+    // The last generation for which another CPU sent this CPU a TLB shootdown NMI. See Space_mem::shootdown.
+    mword counter_tlb_nmi_gen;
+
     // The current virtual machine control structure.
-    Vmcs* vmcs_current;
+    alignas(CACHE_LINE_SIZE) Vmcs* vmcs_current;
 
     // Ec-related variables;
     Ec* ec_idle_ec;
 
+    // The EC whose FPU state is loaded, if the FPU is switched lazily. See Ec::handle_exc_nm.
+    Ec* ec_fpu_owner;
+
+    // The value of IA32_XFD. See Fpu::set_xfd.
+    uint64 fpu_xfd;
+
     // Scheduling-related variables
     Rq sc_rq;
-    Sc* sc_list[NUM_PRIORITIES];
-    unsigned sc_prio_top;
+
+    // The ready SCs with fixed priorities and the reservations with budget left. See Sc::ready_enqueue.
+    Ready_queue<Sc, NUM_PRIORITIES> sc_ready;
+
+    // The number of migratable SCs in sc_ready. Read by other CPUs to find victims for Sc::steal.
+    unsigned sc_migratable_ready;
+
     unsigned sc_ctr_link;
     unsigned sc_ctr_loop;
 
+    // The SC that left this CPU with Sc::follow and its new CPU. It is handed over once this CPU switched
+    // away from its EC.
+    Sc* sc_follower;
+    unsigned sc_follower_cpu;
+
+    // The scheduling statistics page of this CPU. See Sched_stats.
+    Sched_stats* sc_stats;
+
+    // The counter that the time since the last kernel entry is charged to, if any, and the TSC of that entry.
+    // See Sched_stats::enter_kernel.
+    uint64* sc_kernel_counter;
+    uint64 sc_kernel_entry_tsc;
+
+    // The event trace ring of this CPU. See Event_trace.
+    Event_trace_entry* event_trace_ring;
+    unsigned event_trace_cnt;
+
+    // The log ring of this CPU, the end of the message that is currently written, how much of the ring is
+    // already printed, whether we are writing a message and whether some CPU is printing from the ring. See
+    // Console_log.
+    Console_log_ring* console_log_ring;
+    uint64 console_log_pos;
+    uint64 console_log_drained;
+    bool console_log_busy;
+    bool console_log_draining;
+
+    // The PMU sample ring of this CPU, the KP that holds it, the number of samples so far, the counters in
+    // IA32_PERF_GLOBAL_CTRL and the value each counter restarts from after an overflow. See Pmu.
+    Pmu_ring* pmu_ring;
+    Kp* pmu_ring_kp;
+    unsigned pmu_cnt;
+    uint64 pmu_enabled;
+    uint64 pmu_reload[7];
+
     // VMX-related variables
-    unsigned vmcs_vpid_ctr;
+    Vpid_alloc vmcs_vpid_alloc;
     vmx_basic vmcs_basic;
     vmx_ept_vpid vmcs_ept_vpid;
     vmx_ctrl_pin vmcs_ctrl_pin;
@@ -108,41 +197,100 @@ struct alignas(PAGE_SIZE) Per_cpu {
     mword vmcs_fix_cr4_clr;
     mword vmcs_fix_cr4_mon;
 
+    // The control fields of the current VMCS that the kernel rewrites on most VM entries and a bit for each
+    // of them that is set when the value is known. See Vmcs::write.
+    mword vmcs_cached[7];
+    unsigned vmcs_cached_valid;
+
     uint8 vmx_timer_shift;
 
     // vCPU-related variables
     mword vcpu_host_dr[5];
+    Vcpu* vcpu_guest_msrs;
+    bool vcpu_host_msrs_stale;
+    uint64 vcpu_spec_ctrl;
+    bool vcpu_l1d_flush;
+    Vcpu* vcpu_pmu_owner;
+
+    // The RDT class of service and monitoring ID that this CPU uses. See Rdt.
+    uint64 rdt_pqr;
+
+    // The performance request of the current SC and the one of the CPU. See Hwp.
+    uint64 hwp_request;
+    uint64 hwp_fallback;
+    bool hwp_enabled;
+
+    // The job that another CPU offered to this CPU. See Parallel::for_each.
+    Parallel_job* parallel_job;
+
+    // The kernel work that waits for this CPU to become idle. See Deferred_work.
+    Work_queue deferred_work_wq;
+
+    // The security domain that this CPU executes, whether it waits for its siblings to leave theirs and the
+    // lock that serializes domain changes on the core. See Core_sched.
+    uint32 core_domain;
+    bool core_waiting;
+    Spinlock core_lock;
+
+    // The queue nodes of the queued spinlocks that this CPU waits for. See Cpulocal_mcs_nodes.
+    Mcs_node mcs_nodes[Cpulocal_mcs_nodes::MAX_NESTING];
+    unsigned mcs_depth;
 
     // Statistics
 
-    uint16 counter_tlb_shootdown;
-    static_assert((1 << 16) > NUM_CPU,
-                  "The TLB shootdown counter must hold more values than the number of CPUs we support");
+    // The last TLB shootdown generation this CPU has acknowledged. See Space_mem::shootdown.
+    mword counter_tlb_ack_gen;
 
     // CPU-related variables (that are not performance critical)
+    Cpu_info cpu_info;
     uint32 cpu_features[9];
     bool cpu_bsp;
     uint8 cpu_maxphyaddr_ord;
     bool cpu_seen_spurious_nmi;
 
+    // Idle-related variables. See Ec::idle.
+    uint32 cpu_mwait_hint_deep;
+    uint64 cpu_idle_avg;
+
     // Machine-check variables
     unsigned mca_banks;
 
     // Read-copy update
     mword rcu_l_batch;
     mword rcu_c_batch;
+    uint64 rcu_c_tsc;
     Rcu_list rcu_next;
     Rcu_list rcu_curr;
     Rcu_list rcu_done;
 
-    // Space_mem shootdown table.
-    uint16 space_mem_tlb_shootdown[NUM_CPU];
+    // Free single pages of the buddy allocator. See Buddy::try_alloc.
+    Buddy_page_cache buddy_page_cache;
+
+    // Free single pages that this CPU zeroed while it was idle. See Buddy::zero_idle.
+    Buddy_page_cache buddy_zero_cache;
+
+    // Page table pages that this CPU freed after their grace period. See Buddy::try_alloc_page_table.
+    Buddy_page_cache buddy_pt_cache;
+
+    // Free elements of the slab caches. See Slab_cache.
+    Slab_magazine slab_magazine[Slab_cache::MAX_CACHES];
+
+    // The addresses with stale host TLB entries on this CPU. See Space_mem::mark_stale_host_tlb.
+    mword space_mem_tlb_range;
+
+    // The PCIDs of this CPU. See Space_mem::assign_pcid.
+    Pcid_alloc space_mem_pcid_alloc;
 };
 
 static_assert(OFFSETOF(Per_cpu, self) == STACK_SIZE,
               "This offset is used in assembly, grep Per_cpu::self to find them");
 static_assert(OFFSETOF(Per_cpu, sys_entry_stack) == STACK_SIZE + 8,
               "This offset is used in assembly, grep Per_cpu::sys_entry_stack to find them");
+static_assert(OFFSETOF(Per_cpu, sc_current) / CACHE_LINE_SIZE == OFFSETOF(Per_cpu, self) / CACHE_LINE_SIZE,
+              "The frequently accessed members must share a cache line");
+static_assert(OFFSETOF(Per_cpu, counter_tlb_nmi_gen) / CACHE_LINE_SIZE ==
+                  OFFSETOF(Per_cpu, cpu_hazard) / CACHE_LINE_SIZE,
+              "The members that other CPUs write must share a cache line");
 
 // The alternative exception handling stack.
 struct alignas(PAGE_SIZE) Alt_stack {
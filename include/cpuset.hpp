@@ -41,4 +41,13 @@ public:
     /// See the note at Bitmap::atomic_union for the properties of this
     /// function with respect to concurrency.
     void merge(Cpuset const& s) { bits.atomic_union(s.bits); }
+
+    /// Call fn with each CPU in this set in ascending order.
+    ///
+    /// This only visits the CPUs in the set. See Bitmap::for_each_set for
+    /// the properties of this function with respect to concurrency.
+    template <typename FN> void for_each(FN fn) const
+    {
+        bits.for_each_set([&fn](size_t cpu) { fn(static_cast<unsigned>(cpu)); });
+    }
 };
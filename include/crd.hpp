@@ -96,4 +96,9 @@ public:
     //
     // See "hypervisor" flag in Delegate Flags in the specification.
     inline bool from_kern() const { return flags() & 0x800; }
+
+    // If true, guest memory is delegated copy-on-write.
+    //
+    // See "CoW" flag in Delegate Flags in the specification.
+    inline bool cow() const { return flags() & 0x80; }
 };
@@ -0,0 +1,56 @@
+/*
+ * Deferred Kernel Work
+ *
+ * This file is part of the Hedron hypervisor.
+ *
+ * Hedron is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Hedron is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License version 2 for more details.
+ */
+
+#pragma once
+
+#include "cpulocal.hpp"
+#include "types.hpp"
+#include "work_queue.hpp"
+
+// Kernel work that doesn't have to happen in the path that causes it.
+//
+// Expensive cleanup, such as tearing down a large address space, can be queued here instead of delaying the
+// system call that triggered it. The items of a CPU run one at a time, so they must not block and should be
+// short. Longer work queues itself again to continue later.
+//
+// Items run in two places:
+//
+// - An idle CPU runs its items back to back in Ec::idle.
+// - A busy CPU runs one item whenever it handles HZD_WORK in Ec::handle_hazards, i.e. on its way back to
+//   user space or into a guest. Queueing an item sets HZD_WORK on its CPU and running an item sets it again
+//   while items are left (see Work_queue). Each item therefore runs at the latest after as many kernel exits
+//   as there are items before it.
+//
+// HZD_WORK also offers jobs of Parallel::for_each to idle CPUs. Its handler always looks for both kinds of
+// work, so neither can consume the notification of the other. A CPU that doesn't enter the kernel at all,
+// e.g. an isolated CPU that runs a guest without exits, doesn't run its items until it does.
+//
+// An item runs on the CPU that it was queued for with no locks held. It must not be queued again before it
+// has started to run.
+class Deferred_work
+{
+    CPULOCAL_REMOTE_ACCESSOR(deferred_work, wq);
+
+public:
+    // Queue the item on the current CPU.
+    static void queue(Work_item* item);
+
+    // Queue the item on the given CPU. The CPU notices the item via HZD_WORK.
+    static void queue(Work_item* item, unsigned cpu);
+
+    // Run the oldest item of the current CPU. Returns true, if there was one. If more items are left, this
+    // sets HZD_WORK again.
+    static bool run();
+};
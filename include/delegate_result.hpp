@@ -41,6 +41,9 @@ struct Delegate_error {
 
     // A delegation failed because the source or destination addresses are invalid.
     static Delegate_error invalid_mapping() { return type::INVALID_MAPPING; }
+
+    // A delegation failed because the destination reached its kernel memory limit.
+    static Delegate_error out_of_memory() { return type::OUT_OF_MEMORY; }
 };
 
 template <typename T> using Delegate_result = Result<T, Delegate_error>;
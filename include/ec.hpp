@@ -26,6 +26,7 @@
 
 #pragma once
 
+#include "atomic.hpp"
 #include "cpulocal.hpp"
 #include "fpu.hpp"
 #include "lock_guard.hpp"
@@ -46,6 +47,7 @@
 // exception the first time a scheduling context is bound to them.
 #define EXC_STARTUP (NUM_EXC - 2)
 
+class Pt;
 class Sm;
 class Utcb;
 
@@ -56,22 +58,21 @@ class Ec : public Typed_kobject<Kobject::Type::EC>, public Refcount, public Queu
     // Needs access to NMI handling functions.
     friend class Vcpu;
 
+    // Orders its waiters by Ec::wait_prio.
+    friend class Sm;
+
 private:
-    void (*cont)() ALIGNED(16);
-    Cpu_regs regs;
+    // The fields up to evt are what the IPC path touches besides the registers. They share one cache line
+    // (see the layout checks in Ec::Ec). Use tools/struct-layout to see the layout.
+    alignas(CACHE_LINE_SIZE) void (*cont)();
     Ec* rcap{nullptr};
+    Ec* partner{nullptr};
 
     Unique_ptr<Utcb> utcb;
 
     // The protection domain the EC will run in.
     Refptr<Pd> pd;
 
-    // The protection domain that holds the UTCB or vLAPIC page.
-    Refptr<Pd> pd_user_page;
-
-    Ec* partner{nullptr};
-    Ec* prev{nullptr};
-    Ec* next{nullptr};
     union {
         struct {
             uint16 cpu;
@@ -81,9 +82,41 @@ private:
     };
     unsigned const evt{0};
 
+    // The registers start on a cache line of their own.
+    alignas(CACHE_LINE_SIZE) Cpu_regs regs;
+
+    static inline uint32 id_cnt;
+
+    // The protection domain that holds the UTCB or vLAPIC page.
+    Refptr<Pd> pd_user_page;
+
+    Ec* prev{nullptr};
+    Ec* next{nullptr};
+
+    // The priority of the SC that blocked this EC on a semaphore. Semaphores wake their waiters in the order
+    // of this priority. See Sm::enqueue_waiter.
+    unsigned wait_prio{0};
+
+    // How SCs are bound to this EC. A migratable SC moves its EC to other CPUs, so an EC with a migratable SC
+    // cannot have any other SC. See Ec::bind_sc.
+    enum
+    {
+        SC_UNBOUND,
+        SC_PINNED,
+        SC_MIGRATABLE,
+    };
+    unsigned sc_binding{SC_UNBOUND};
+
     // Virtual Address of the UTCB in userspace.
     mword user_utcb{0};
 
+    // Progress of an in-flight HC_BATCH. A batch is active when batch_cnt is not zero.
+    mword batch_idx{0};
+    mword batch_cnt{0};
+
+    // A repeated batch executes its single entry batch_cnt times with consecutive selectors.
+    bool batch_repeat{false};
+
     Fpu fpu;
 
     // Ec::run_vcpu needs a way to find the right vcpu when the continuation points to it. Having a cpu-local
@@ -117,6 +150,13 @@ private:
     static bool handle_exc_gp(Exc_regs*);
     static bool handle_exc_pf(Exc_regs*);
 
+    // Load the FPU state of the current EC, when it uses the FPU the first time after an EC switch. Returns
+    // false, if the FPU is not switched lazily.
+    static bool handle_exc_nm();
+
+    // Save the state of the FPU owner and release the ownership. This leaves the FPU usable by the kernel.
+    static void save_fpu_owner();
+
     // Try to fixup a #GP in the kernel. See FIXUP_CALL for when this may be
     // appropriate.
     //
@@ -210,6 +250,10 @@ public:
 
     CPULOCAL_REMOTE_ACCESSOR(ec, current);
     CPULOCAL_ACCESSOR(ec, idle_ec);
+    CPULOCAL_ACCESSOR(ec, fpu_owner);
+
+    // A unique number that identifies this EC in PMU samples. See Pmu.
+    uint32 const id{Atomic::add(id_cnt, 1U)};
 
     // Special constructor for the idle thread.
     Ec(Pd* own, unsigned c);
@@ -228,29 +272,71 @@ public:
 
     inline bool blocked() const { return next || !cont; }
 
-    inline void save_fsgs_base()
+    // Record that an SC is bound to this EC. Returns false, if the binding conflicts with an existing one.
+    bool bind_sc(bool migratable)
     {
-        // The kernel switched GS_BASE and KERNEL_GS_BASE on kernel entry.
-        // Thus, the user applications GS_BASE value currently resides in
-        // KERNEL_GS_BASE and the values will be switched again on kernel
-        // exit. Therefore, we must wrap rdgsbase with swapgs in order to
-        // get the correct value. This is still faster than using rdmsr
-        // with KERNEL_GS_BASE directly.
-        swapgs();
-        regs.gs_base = rdgsbase();
-        swapgs();
+        unsigned const binding{migratable ? SC_MIGRATABLE : SC_PINNED};
+
+        if (Atomic::cmp_swap(sc_binding, static_cast<unsigned>(SC_UNBOUND), binding)) {
+            return true;
+        }
+
+        return not migratable and Atomic::load(sc_binding) == SC_PINNED;
+    }
+
+    bool is_migratable() const { return Atomic::load(sc_binding) == SC_MIGRATABLE; }
 
-        regs.fs_base = rdfsbase();
+    // Whether this EC can be moved to another CPU by its migratable SC.
+    //
+    // The EC must be a global EC that is not in a portal call, because portals are CPU-local. It also must
+    // not run a vCPU, because the vCPU state is loaded on this CPU. Only ECs that are about to return to user
+    // space have no CPU-local state in the kernel. Portals and vCPUs that stay on the old CPU don't prevent
+    // the migration, because the EC follows them back when it uses them. See Ec::follow.
+    bool can_migrate() const
+    {
+        return glb and not partner and not vcpu and (cont == ret_user_sysexit or cont == ret_user_iret);
     }
 
-    inline void load_fsgs_base()
+    // Move the current EC together with its migratable SC to the given CPU and continue at c there. This
+    // lets a migrated EC use the portals and vCPUs of the CPU it came from. Returns if the EC cannot move.
+    static void follow(unsigned to, void (*c)());
+
+    // Move this EC to another CPU. The EC must not run while it is migrated.
+    void migrate(unsigned to)
     {
-        // See documentation of save_fsgs_base().
+        // The PD has to know that it has ECs on the new CPU before they run there. Otherwise, TLB shootdowns
+        // would miss the new CPU.
+        pd->Space_mem::init(to);
+        cpu = static_cast<uint16>(to);
+
+        if (EXPECT_FALSE(fpu_owner() == this)) {
+            flush_fpu();
+        }
+    }
+
+    // Saves the FS and GS base of the EC we switch away from and loads ours.
+    inline void switch_fsgs_base(Ec* from)
+    {
+        // The kernel switched GS_BASE and KERNEL_GS_BASE on kernel entry.
+        // Thus, the user applications GS_BASE value currently resides in
+        // KERNEL_GS_BASE and the values will be switched again on kernel
+        // exit. Therefore, we must wrap rdgsbase and wrgsbase with swapgs in
+        // order to access the correct value. This is still faster than using
+        // rdmsr and wrmsr with KERNEL_GS_BASE directly.
+        //
+        // ECs of the same process often share their GS base, so we only
+        // write it if it changes. FS base is handled the same way.
         swapgs();
-        wrgsbase(regs.gs_base);
+        from->regs.gs_base = rdgsbase();
+        if (regs.gs_base != from->regs.gs_base) {
+            wrgsbase(regs.gs_base);
+        }
         swapgs();
 
-        wrfsbase(regs.fs_base);
+        from->regs.fs_base = rdfsbase();
+        if (regs.fs_base != from->regs.fs_base) {
+            wrfsbase(regs.fs_base);
+        }
     }
 
     // We have to make load_fpu and save_fpu public becaue the vCPU has to save and restore the FPU content of
@@ -258,11 +344,14 @@ public:
     void load_fpu();
     void save_fpu();
 
+    // Write the FPU state that is lazily kept in the FPU of this CPU back to its EC. This must happen before
+    // the EC can run on another CPU or the FPU state gets lost. It does nothing for eager FPU switching.
+    static void flush_fpu();
+
     inline void make_current()
     {
         if (current() != this) {
-            current()->save_fsgs_base();
-            load_fsgs_base();
+            switch_fsgs_base(current());
         }
 
         transfer_fpu(current());
@@ -278,6 +367,21 @@ public:
         pd->make_current();
     }
 
+    // The EC at the end of the partner chain, which executes when the SC of this EC is scheduled.
+    Ec* chain_end()
+    {
+        Ec* ec{this};
+
+        while (ec->partner) {
+            ec = ec->partner;
+        }
+
+        return ec;
+    }
+
+    // The PD of the EC that executes when the SC of this EC is scheduled.
+    Pd* chain_pd() { return chain_end()->pd; }
+
     // Return to user via the current continuation.
     //
     // This function also resets the kernel stack.
@@ -289,19 +393,13 @@ public:
     // userspace.
     static Ec* remote(unsigned cpu) { return remote_load_current(cpu); }
 
+    // Donates the current SC to this busy EC and the chain of ECs it called. The current EC continues at c
+    // once the SC comes back. Returns if this EC is dead.
     NOINLINE
-    void help(void (*c)())
-    {
-        if (EXPECT_TRUE(cont != dead)) {
-
-            current()->cont = c;
-
-            if (EXPECT_TRUE(++Sc::ctr_loop() < 100))
-                activate();
+    void help(void (*c)());
 
-            die("Livelock");
-        }
-    }
+    // Blocks the current SC until this EC replies to its caller. See Ec::help.
+    [[noreturn]] void block_until_reply();
 
     NOINLINE
     void block_sc()
@@ -357,10 +455,24 @@ public:
     // Ec::sys_finish clears Ec::vcpu again.
     [[noreturn]] static void resume_vcpu();
 
+    // Calls the given portal on behalf of the guest of Ec::vcpu, which executed VMCALL. The guest RBX, RCX,
+    // RDX and RSI are the message words ARG2 to ARG5. Returns, if the handler EC cannot take the call.
+    static void call_vmcall_portal(Pt* pt, Cpu_regs const& guest);
+
+    // The continuation of an EC whose vCPU waits for the reply of a VMCALL portal.
+    [[noreturn]] static void ret_vmcall();
+
     [[noreturn]] HOT static void ret_user_sysexit();
 
     [[noreturn]] HOT static void ret_user_iret() asm("ret_user_iret");
 
+    // Return to user space with SYSRET, if the register state allows it, or IRET otherwise. The callers have
+    // handled all hazards. This must not be inlined, because it defines assembler labels.
+    [[noreturn]] NOINLINE static void ret_user();
+
+    // Return to user space with SYSRET. Falls back to IRET, if an NMI asked us to trap on the way out.
+    [[noreturn]] NOINLINE static void ret_user_sysret();
+
     [[noreturn]] static void sys_finish(Sys_regs::Status status);
     [[noreturn]] static void sys_finish(Result_void<Sys_regs::Status> result);
 
@@ -400,14 +512,27 @@ public:
     [[noreturn]] static void sys_pd_ctrl();
 
     [[noreturn]] static void sys_pd_ctrl_lookup();
+    [[noreturn]] static void sys_pd_ctrl_lookup_range();
+    [[noreturn]] static void sys_pd_ctrl_kmem();
 
     [[noreturn]] static void sys_pd_ctrl_map_access_page();
 
     [[noreturn]] static void sys_pd_ctrl_delegate();
 
+    [[noreturn]] static void sys_pd_ctrl_delegate_vector(Pd* src_pd, Pd* dst_pd);
+
+    [[noreturn]] static void sys_pd_ctrl_delegate_broadcast(Pd* src_pd);
+
     [[noreturn]] static void sys_pd_ctrl_msr_access();
 
+    [[noreturn]] static void sys_pd_ctrl_msr_access_vector();
+
+    [[noreturn]] static void sys_pd_ctrl_ept_fill();
+
+    [[noreturn]] static void sys_pd_ctrl_teardown_sm();
+
     [[noreturn]] static void sys_ec_ctrl();
+    [[noreturn]] static void sys_ec_ctrl_yield_to();
 
     [[noreturn]] static void sys_sc_ctrl();
 
@@ -415,6 +540,9 @@ public:
 
     [[noreturn]] static void sys_sm_ctrl();
 
+    static void sys_sm_ctrl_check_word();
+    [[noreturn]] static void sys_sm_ctrl_notification(Sm* sm);
+
     [[noreturn]] static void sys_kp_ctrl();
 
     [[noreturn]] static void sys_kp_ctrl_map();
@@ -427,12 +555,58 @@ public:
 
     [[noreturn]] static void sys_vcpu_ctrl_poke();
 
+    [[noreturn]] static void sys_vcpu_ctrl_poke_batch();
+    [[noreturn]] static void sys_vcpu_ctrl_pmu();
+
+    [[noreturn]] static void sys_vcpu_ctrl_exit_policy();
+
+    [[noreturn]] static void sys_vcpu_ctrl_mtd_profile();
+
+    [[noreturn]] static void sys_vcpu_ctrl_pml();
+
+    [[noreturn]] static void sys_vcpu_ctrl_harvest_dirty();
+
+    [[noreturn]] static void sys_vcpu_ctrl_post_intr();
+
+    [[noreturn]] static void sys_vcpu_ctrl_exit_stats();
+
+    [[noreturn]] static void sys_vcpu_ctrl_vmcs_shadow();
+
+    [[noreturn]] static void sys_vcpu_ctrl_vmcs_shadow_access();
+
+    [[noreturn]] static void sys_vcpu_ctrl_snapshot();
+
+    [[noreturn]] static void sys_vcpu_ctrl_ioevent();
+
+    [[noreturn]] static void sys_vcpu_ctrl_io_ring();
+    [[noreturn]] static void sys_vcpu_ctrl_vmcall_portal();
+
+    [[noreturn]] static void sys_vcpu_migrate();
+
+    [[noreturn]] static void sys_vcpu_ept_views();
+
     [[noreturn]] static void sys_machine_ctrl();
 
     [[noreturn]] static void sys_machine_ctrl_suspend();
+    [[noreturn]] static void sys_machine_ctrl_kexec();
 
     [[noreturn]] static void sys_machine_ctrl_update_microcode();
 
+    [[noreturn]] static void sys_machine_ctrl_mem_stats();
+    [[noreturn]] static void sys_machine_ctrl_stats();
+    [[noreturn]] static void sys_machine_ctrl_trace();
+    [[noreturn]] static void sys_machine_ctrl_pmu();
+    [[noreturn]] static void sys_machine_ctrl_isolate();
+    [[noreturn]] static void sys_machine_ctrl_rdt();
+
+    [[noreturn]] static void sys_batch();
+
+    // Executes the current entry of an in-flight HC_BATCH.
+    [[noreturn]] static void sys_batch_dispatch();
+
+    // Records the result of the current HC_BATCH entry and continues with the next one.
+    [[noreturn]] static void sys_batch_next();
+
     [[noreturn]] static void root_invoke();
 
     template <bool> static Delegate_result_void delegate();
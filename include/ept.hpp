@@ -33,10 +33,14 @@ private:
     // set_supported_leaf_levels.
     static level_t supported_leaf_levels;
 
+    // False if one of the CPUs cannot invalidate the mappings of a single EPT. We invalidate all EPTs then.
+    static bool single_context_invept;
+
     // EPT invalidation types
     enum : mword
     {
         INVEPT_SINGLE_CONTEXT = 1,
+        INVEPT_ALL_CONTEXT = 2,
     };
 
     // EPTP constants
@@ -44,6 +48,7 @@ private:
     {
         EPTP_WB = 6,
         EPTP_WALK_LENGTH_SHIFT = 3,
+        EPTP_AD = 1U << 6,
     };
 
 public:
@@ -71,40 +76,65 @@ public:
 
         PTE_I = 1UL << 6,
         PTE_S = 1UL << 7,
+
+        // The CPU only sets these bits for vCPUs that have accessed and dirty flags enabled in their EPTP.
+        PTE_A = 1UL << 8,
+        PTE_D = 1UL << 9,
+
+        // Ignored by the CPU. Marks read-only mappings that were delegated copy-on-write.
+        PTE_COW = 1UL << 11,
+
+        // EPT entries have no PAT bits. The memory type is in PTE_MT_MASK.
+        PTE_PAT2 = 0,
+        PTE_PAT2_S = 0,
     };
 
-    static constexpr pte_t mask{PTE_R | PTE_W | PTE_X | PTE_I | PTE_MT_MASK};
+    static constexpr pte_t mask{PTE_R | PTE_W | PTE_X | PTE_I | PTE_MT_MASK | PTE_A | PTE_D | PTE_COW};
     static constexpr pte_t all_rights{PTE_R | PTE_W | PTE_X};
 
     // Adjust the number of leaf levels to the given value.
     static void set_supported_leaf_levels(level_t level);
 
+    // The number of levels of guest page tables. PDs with a large guest space have five levels and a 57-bit
+    // guest-physical address space, if all CPUs support it. See Hip::FEAT_EPT_5_LEVEL.
+    static constexpr level_t DEFAULT_LEVELS{4};
+    static constexpr level_t LARGE_LEVELS{5};
+
     // Create a page table from scratch.
-    Ept() : Ept_page_table(4, supported_leaf_levels) {}
+    explicit Ept(level_t levels = DEFAULT_LEVELS) : Ept_page_table(levels, supported_leaf_levels) {}
 
     // Convert a HPT mapping into a mapping for the EPT.
     static Mapping convert_mapping(Hpt::Mapping const& hpt_mapping);
 
+    // Turn a mapping into its copy-on-write version. It is read-only and writes to it cause EPT violations
+    // that Vcpu::handle_vmx reports to the VMM as Vmcs::VMX_COW_WRITE exits.
+    static Mapping cow_mapping(Mapping const& mapping)
+    {
+        if (not mapping.present()) {
+            return mapping;
+        }
+
+        return {mapping.vaddr, mapping.paddr, (mapping.attr & ~PTE_W) | PTE_COW, mapping.order};
+    }
+
     // Invalidate TLB entries derived from this EPT using invept.
     //
     // This function must be called when the EPT paging structures are
     // changed. It does a single-context invalidation of guest-physical
-    // mappings for this EPT.
-    void invalidate()
-    {
-        struct {
-            uint64 eptp, rsvd;
-        } const desc{vmcs_eptp(), 0};
-        static_assert(sizeof(desc) == 16, "INVEPT descriptor layout is broken");
-
-        bool ret;
-        asm volatile("invept %1, %2" : "=@cca"(ret) : "m"(desc), "r"(INVEPT_SINGLE_CONTEXT) : "cc", "memory");
-        assert(ret);
-    }
+    // mappings for this EPT, if all CPUs support it. Otherwise, it
+    // invalidates the mappings of all EPTs.
+    void invalidate();
+
+    // Record whether the current CPU supports single-context invalidation. See invalidate.
+    static void set_single_context_invept(bool supported);
+
+    static bool has_single_context_invept() { return Atomic::load(single_context_invept); }
 
-    // Return a VMCS EPT pointer to this EPT.
-    uint64 vmcs_eptp() const
+    // Return a VMCS EPT pointer to this EPT. With accessed_dirty set, the CPU sets the accessed and dirty
+    // bits in the EPT entries it uses. This is required for page-modification logging.
+    uint64 vmcs_eptp(bool accessed_dirty = false) const
     {
-        return static_cast<uint64>(root()) | (max_levels() - 1) << EPTP_WALK_LENGTH_SHIFT | EPTP_WB;
+        return static_cast<uint64>(root()) | (max_levels() - 1) << EPTP_WALK_LENGTH_SHIFT | EPTP_WB |
+               (accessed_dirty ? EPTP_AD : 0);
     }
 };
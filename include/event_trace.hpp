@@ -0,0 +1,148 @@
+/*
+ * Event Trace
+ *
+ * This file is part of the Hedron hypervisor.
+ *
+ * Hedron is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Hedron is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License version 2 for more details.
+ */
+
+#pragma once
+
+#include "atomic.hpp"
+#include "barrier.hpp"
+#include "compiler.hpp"
+#include "cpulocal.hpp"
+#include "memory.hpp"
+#include "types.hpp"
+#include "x86.hpp"
+
+// One event in the event trace ring. The layout is part of the ABI. See tools/decode-trace.
+struct Event_trace_entry {
+    uint64 tsc;
+
+    // The meaning of the arguments depends on the event. See Event_trace::Event.
+    uint32 arg[4];
+
+    uint16 event;
+
+    // The CPU that recorded the event. It never changes, so it is filled in when the ring is allocated.
+    uint16 cpu;
+
+    // The lower 32 bits of the number of events that this CPU recorded before, plus one. Zero marks an
+    // unused entry. The sequence number is written last, so user space can detect entries that are being
+    // overwritten by reading it before and after the other fields.
+    uint32 seq;
+};
+
+static_assert(sizeof(Event_trace_entry) == 32, "Event trace entries must not change their size");
+
+// A per-CPU ring of binary kernel events with TSC timestamps.
+//
+// Unlike trace(), recording an event doesn't format anything. It copies a few words into the ring and
+// leaves the decoding to user space. The ring fills exactly one page that user space can map read-only via
+// a trace KP (see Ec::sys_create_kp). Events are only recorded on a CPU after a trace KP for it was
+// created. Hedron can be built without the event trace with ENABLE_EVENT_TRACE=OFF, which turns
+// Event_trace::record into a no-op. With ENABLE_SYSCALL_TRACE=ON, system calls are recorded with all their
+// arguments, so user space can replay them.
+class Event_trace
+{
+    CPULOCAL_REMOTE_ACCESSOR(event_trace, ring);
+    CPULOCAL_ACCESSOR(event_trace, cnt);
+
+public:
+    static constexpr unsigned ENTRIES{PAGE_SIZE / sizeof(Event_trace_entry)};
+
+    // The events and their arguments. New events are only added at the end.
+    enum Event : uint16
+    {
+        // An SC became ready: SC ID, priority.
+        SC_ENQUEUE = 1,
+
+        // An SC left the ready queue: SC ID, priority.
+        SC_DEQUEUE = 2,
+
+        // The CPU switched to an SC: SC ID, priority.
+        SC_SWITCH = 3,
+
+        // A system call: the lower 32 bits of ARG1. With syscall_args(), ARG1 and ARG2 as pairs of lower and
+        // upper 32 bits.
+        SYSCALL = 4,
+
+        // A VM exit: the exit reason.
+        VM_EXIT = 5,
+
+        // A grace period ended: the lower 32 bits of the batch number, the TSC ticks the batch waited for.
+        RCU_BATCH = 6,
+
+        // Deferred reclamation callbacks ran: the number of callbacks.
+        RCU_INVOKE = 7,
+
+        // Follows SYSCALL with syscall_args(): ARG3 and ARG4 as pairs of lower and upper 32 bits.
+        SYSCALL_ARG3 = 8,
+
+        // Follows SYSCALL_ARG3: the lower and upper 32 bits of ARG5.
+        SYSCALL_ARG5 = 9,
+    };
+
+    static constexpr bool enabled()
+    {
+#ifdef EVENT_TRACE
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    // Returns true if system calls are recorded with all their arguments.
+    static constexpr bool syscall_args()
+    {
+#ifdef SYSCALL_TRACE
+        return enabled();
+#else
+        return false;
+#endif
+    }
+
+    // Returns the trace ring of the given CPU. The ring is allocated on first use. Returns nullptr if we ran
+    // out of memory.
+    static Event_trace_entry* get_ring(unsigned cpu);
+
+    static void record(Event event, uint32 a0 = 0, uint32 a1 = 0, uint32 a2 = 0, uint32 a3 = 0)
+    {
+        if constexpr (not enabled()) {
+            return;
+        }
+
+        Event_trace_entry* const r{Atomic::load<Event_trace_entry*, Atomic::RELAXED>(ring())};
+
+        if (EXPECT_TRUE(not r)) {
+            return;
+        }
+
+        unsigned const n{cnt()++};
+        Event_trace_entry& e{r[n % ENTRIES]};
+
+        // Invalidate the entry before we change it.
+        Atomic::store<uint32, Atomic::RELAXED>(e.seq, 0);
+        barrier();
+
+        e.tsc = rdtsc();
+        e.arg[0] = a0;
+        e.arg[1] = a1;
+        e.arg[2] = a2;
+        e.arg[3] = a3;
+        e.event = event;
+
+        uint32 const seq{n + 1};
+
+        barrier();
+        Atomic::store<uint32, Atomic::RELAXED>(e.seq, seq ? seq : uint32{1});
+    }
+};
@@ -27,7 +27,7 @@ extern char GIT_VER;
 
 extern char PAGE_0[PAGE_SIZE];
 extern char PAGE_1[PAGE_SIZE];
-extern char PAGE_H[PAGE_SIZE];
+extern char PAGE_H[HIP_SIZE];
 
 extern char PDBRV;
 extern char PDBR;
@@ -49,6 +49,7 @@ extern mword hwdev_addr;
 
 extern "C" char __start_all[];
 extern "C" char __resume_bsp[];
+extern "C" char __kexec[];
 
 extern "C" char __start_cpu[];
 extern "C" char __start_cpu_end[];
@@ -60,3 +61,9 @@ extern "C" uint32 const __start_cpu_patch_rel_end[];
 // There is a label before the "iretq" in Ec::ret_user_iret. Check Ec::maybe_handle_deferred_nmi_work to see
 // why we need it.
 extern "C" uint8 iret_to_user;
+
+// Ec::ret_user_sysret checks whether an NMI wants us to trap on the exit to user space at sysret_window. NMIs
+// that arrive between this label and sysret_to_user do their deferred work right away. See
+// Ec::handle_exc_altstack.
+extern "C" uint8 sysret_window;
+extern "C" uint8 sysret_to_user;
@@ -21,6 +21,7 @@
 
 #pragma once
 
+#include "cpulocal.hpp"
 #include "memory.hpp"
 #include "refptr.hpp"
 #include "types.hpp"
@@ -50,17 +51,46 @@ private:
         uint8 fpu_data[FXSAVE_AREA_SIZE - FXSAVE_HEADER_SIZE];
     };
 
+    // Intel SDM Vol. 1 Chap. 13.4.2
+    struct XsaveHdr {
+        uint64 xstate_bv;
+        uint64 xcomp_bv;
+        uint64 res_[6];
+    };
+
+    // XCOMP_BV[63] marks an XSAVE area in compacted format.
+    static constexpr uint64 XCOMP_BV_COMPACTED{1ull << 63};
+
     struct FpuCtx {
         FxsaveHdr legacy_hdr;
         FxsaveData legacy_data;
+        XsaveHdr xsave_hdr;
     };
     static_assert(sizeof(FpuCtx) <= PAGE_SIZE, "FpuCtx has to fit into a kernel page.");
 
     Refptr<Kp> data_;
+
+    // The XSAVE area with room for the AMX tile data. Contexts only get one when they use AMX. See grow.
+    FpuCtx* large_{nullptr};
+
     FpuCtx* data();
 
+    // The state components that save and load handle for this context. Contexts without room for the tile
+    // data leave it out and run with XFD armed for it.
+    uint64 xsave_mask() const;
+
+    // The value of IA32_XFD on this CPU.
+    CPULOCAL_ACCESSOR(fpu, xfd);
+
+    static void set_xfd(uint64 value);
+
     enum class Mode : uint8
     {
+        // Compacted format that only saves components that are in use or modified.
+        XSAVES,
+        XSAVEC,
+
+        // Standard format.
         XSAVEOPT,
         XSAVE,
     };
@@ -68,12 +98,63 @@ private:
     struct FpuConfig {
         uint64 xsave_scb; // State-Component Bitmap
         size_t context_size;
-        Mode mode;
+
+        // The size of contexts that include the AMX tile data. Zero, if Hedron doesn't enable AMX.
+        size_t large_context_size;
+
+        // The modes for contexts in compacted format and in standard format. The compacted mode falls back to
+        // the standard mode, if the CPU cannot save contexts in compacted format.
+        Mode compacted_mode;
+        Mode standard_mode;
     };
 
+    Mode mode_;
+
+#ifdef FPU_FIXED_MODE
+    // The configuration is fixed at build time for binaries that only run on one CPU generation. Fpu::probe
+    // checks that the CPU matches. See FPU_FIXED_MODE in src/CMakeLists.txt.
+    static constexpr FpuConfig config{FPU_FIXED_XCR0, FPU_FIXED_CONTEXT_SIZE, 0, Mode::FPU_FIXED_MODE,
+                                      Mode::FPU_FIXED_MODE == Mode::XSAVE ? Mode::XSAVE : Mode::XSAVEOPT};
+    static_assert(config.context_size <= PAGE_SIZE, "Context size is too large for a kernel-page.");
+#else
     static FpuConfig config;
+#endif
+
+    // Hedron only enables AMX on CPUs with extended feature disable (XFD), so contexts only grow when they
+    // actually use the tile data.
+    static bool amx() { return config.large_context_size != 0; }
+
+    template <Mode M> void save_as();
+    template <Mode M> void load_as();
 
 public:
+    // The layout of the FPU context in its KP. User space only understands the standard format, so contexts
+    // that user space can access must use it. Kernel-only contexts use the compacted format, if the CPU
+    // supports it.
+    enum class Format : uint8
+    {
+        STANDARD,
+        COMPACTED,
+    };
+
+    // With lazy switching, ECs only switch the FPU state when they actually use the FPU. All other ECs
+    // run with CR0.TS set and the first FPU instruction traps with #NM (see Ec::handle_exc_nm).
+    //
+    // This is off by default. ENABLE_LAZY_FPU=ON enables it. While an EC runs with CR0.TS set, the CPU may
+    // still speculatively execute FPU instructions with the state of another EC (LazyFP, CVE-2018-3665).
+    // Only enable lazy switching on CPUs that are not affected. vCPUs always switch their FPU state eagerly.
+    static constexpr bool lazy_switching()
+    {
+#ifdef LAZY_FPU
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    // Make FPU instructions trap (or not) by setting (or clearing) CR0.TS.
+    static void trap_on_use(bool trap);
+
     static void probe();
     static void init();
 
@@ -84,12 +165,23 @@ public:
     // succeeded, returns false if it resulted in a #GP.
     //
     // This function has to be used in situation where the user space has access to the FPU state and thus may
-    // provide a faulty state.
+    // provide a faulty state. Such contexts are always in standard format.
     bool load_from_user();
 
+    // Returns true if this CPU raised the last #NM, because XFD disables the AMX tile data of the current
+    // context.
+    static bool xfd_fault();
+
+    // Makes room for the AMX tile data in this context, which must be the one that is loaded. The tile data
+    // starts in its initial state. Returns false if there is no memory for the larger context.
+    bool grow();
+
+    // Returns true if the given value is a valid XCR0 value for guests on this system.
+    static bool is_valid_xcr0(uint64 xcr0);
+
     static bool load_xcr0(uint64 xcr0);
     static void restore_xcr0();
 
-    explicit Fpu(Kp* data_kp);
-    ~Fpu() = default;
+    Fpu(Kp* data_kp, Format format);
+    ~Fpu();
 };
@@ -61,49 +61,50 @@ private:
 
     unsigned default_type;
 
-    uint64 read(size_t index) { return MSR::read(typename MSR::Register(index)); }
-
-public:
-    void init()
-    {
-        size_t const count{read(MSR::IA32_MTRR_CAP) & 0xff};
+    // The fixed-range MTRRs in ascending order of the ranges they cover: one for 64K ranges, two for 16K
+    // ranges and eight for 4K ranges. They are read once, because memtype is called for each of their
+    // ranges.
+    uint64 fixed[11];
+
+    // The memory types of the whole physical address space as a sorted table of ranges. Each range ends
+    // where the next one starts, the last one at the end of the address space. The table is built once in
+    // init, so memtype does not have to scan the MTRRs for each range that is mapped.
+    struct Range {
+        uint64 start;
+        unsigned type;
+    };
 
-        default_type = read(MSR::IA32_MTRR_DEF_TYPE) & 0xff;
+    // 88 fixed ranges and at most two boundaries per variable-range MTRR.
+    static constexpr size_t MAX_RANGES{128};
+    Static_vector<Range, MAX_RANGES> ranges;
 
-        for (size_t i = 0; i < count; i++) {
-            Mtrr const mtrr{read(MSR::IA32_MTRR_PHYS_BASE + 2 * i), read(MSR::IA32_MTRR_PHYS_MASK + 2 * i)};
+    // The table is unusable if it ran out of space or the MTRRs use non-contiguous masks. We fall back to
+    // scanning the MTRRs then.
+    bool ranges_valid{false};
 
-            if (mtrr.valid()) {
-                var_mtrr.emplace_back(mtrr);
-            }
-        }
-    }
+    uint64 read(size_t index) { return MSR::read(typename MSR::Register(index)); }
 
-    unsigned memtype(uint64 phys, uint64& next)
+    unsigned scan_memtype(uint64 phys, uint64& next) const
     {
         if (phys < 0x80000) {
             next = 1 + (phys | 0xffff);
-            return static_cast<unsigned>(read(MSR::IA32_MTRR_FIX64K_BASE) >> (phys >> 13 & 0x38)) & 0xff;
+            return static_cast<unsigned>(fixed[0] >> (phys >> 13 & 0x38)) & 0xff;
         }
 
         if (phys < 0xc0000) {
             next = 1 + (phys | 0x3fff);
-            return static_cast<unsigned>(read(MSR::IA32_MTRR_FIX16K_BASE + (phys >> 17 & 0x1)) >>
-                                         (phys >> 11 & 0x38)) &
-                   0xff;
+            return static_cast<unsigned>(fixed[1 + (phys >> 17 & 0x1)] >> (phys >> 11 & 0x38)) & 0xff;
         }
 
         if (phys < 0x100000) {
             next = 1 + (phys | 0xfff);
-            return static_cast<unsigned>(read(MSR::IA32_MTRR_FIX4K_BASE + (phys >> 15 & 0x7)) >>
-                                         (phys >> 9 & 0x38)) &
-                   0xff;
+            return static_cast<unsigned>(fixed[3 + (phys >> 15 & 0x7)] >> (phys >> 9 & 0x38)) & 0xff;
         }
 
         unsigned type = ~0U;
         next = ~0ULL;
 
-        for (Mtrr& mtrr : var_mtrr) {
+        for (Mtrr const& mtrr : var_mtrr) {
             uint64 base = mtrr.base & ~PAGE_MASK;
 
             if (phys < base)
@@ -117,4 +118,116 @@ public:
 
         return type == ~0U ? default_type : type;
     }
+
+    void build_ranges()
+    {
+        ranges.reset();
+        ranges_valid = false;
+
+        for (uint64 phys{0}, next;; phys = next) {
+            if (ranges.size() == ranges.max_size()) {
+                return;
+            }
+
+            ranges.push_back({phys, scan_memtype(phys, next)});
+
+            if (next == ~0ULL) {
+                break;
+            }
+
+            if (next <= phys) {
+                return;
+            }
+        }
+
+        ranges_valid = true;
+    }
+
+    // Returns the index of the range that contains phys.
+    size_t find_range(uint64 phys) const
+    {
+        size_t lo{0}, hi{ranges.size()};
+
+        while (hi - lo > 1) {
+            size_t const mid{lo + (hi - lo) / 2};
+
+            if (ranges[mid].start <= phys) {
+                lo = mid;
+            } else {
+                hi = mid;
+            }
+        }
+
+        return lo;
+    }
+
+    uint64 range_end(size_t i) const { return i + 1 < ranges.size() ? ranges[i + 1].start : ~0ULL; }
+
+public:
+    void init()
+    {
+        size_t const count{read(MSR::IA32_MTRR_CAP) & 0xff};
+
+        default_type = read(MSR::IA32_MTRR_DEF_TYPE) & 0xff;
+
+        fixed[0] = read(MSR::IA32_MTRR_FIX64K_BASE);
+
+        for (size_t i = 0; i < 2; i++) {
+            fixed[1 + i] = read(MSR::IA32_MTRR_FIX16K_BASE + i);
+        }
+
+        for (size_t i = 0; i < 8; i++) {
+            fixed[3 + i] = read(MSR::IA32_MTRR_FIX4K_BASE + i);
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            Mtrr const mtrr{read(MSR::IA32_MTRR_PHYS_BASE + 2 * i), read(MSR::IA32_MTRR_PHYS_MASK + 2 * i)};
+
+            if (mtrr.valid()) {
+                var_mtrr.emplace_back(mtrr);
+            }
+        }
+
+        build_ranges();
+    }
+
+    // Returns the memory type at phys. next is set to the end of the MTRR range that contains phys.
+    unsigned memtype(uint64 phys, uint64& next) const
+    {
+        if (not ranges_valid) {
+            return scan_memtype(phys, next);
+        }
+
+        size_t const i{find_range(phys)};
+
+        next = range_end(i);
+        return ranges[i].type;
+    }
+
+    // Returns the memory type at phys like memtype, but next points behind all consecutive ranges with the
+    // same memory type. Ranges that start at or above limit are not considered. Mapping memory with the same
+    // type in one go allows larger pages.
+    unsigned memtype_range(uint64 phys, uint64 limit, uint64& next) const
+    {
+        if (not ranges_valid) {
+            unsigned const type{scan_memtype(phys, next)};
+            uint64 following;
+
+            while (next < limit and scan_memtype(next, following) == type) {
+                next = following;
+            }
+
+            return type;
+        }
+
+        size_t i{find_range(phys)};
+        unsigned const type{ranges[i].type};
+
+        while (range_end(i) < limit and ranges[i + 1].type == type) {
+            i++;
+        }
+
+        next = range_end(i);
+        return type;
+    }
 };
@@ -19,6 +19,7 @@
 
 #include "alloc_result.hpp"
 #include "assert.hpp"
+#include "atomic.hpp"
 #include "compiler.hpp"
 #include "math.hpp"
 #include "memory.hpp"
@@ -133,6 +134,12 @@ private:
     // The root of the page table hierarchy.
     pte_pointer_t root_;
 
+    // The number of page table pages that this page table allocated and not yet released, including the
+    // root. See pages().
+    long pages_{0};
+
+    void count_pages(long delta) { Atomic::add(pages_, delta); }
+
     // Return the order that an entry at a specific page table level has.
     ord_t level_order(level_t level) const { return level * BITS_PER_LEVEL + PAGE_BITS; }
 
@@ -173,21 +180,205 @@ private:
         return lookup(vaddr, page_alloc_.phys_to_pointer(phys), cur_level - 1);
     }
 
+    // See the description of the public version of this function below.
+    template <typename FN>
+    void test_and_clear_leaves(pte_pointer_t table, level_t cur_level, virt_t start, virt_t end, pte_t bits,
+                               bool clear, FN& fn)
+    {
+        assert_slow(cur_level >= 0 and cur_level < max_levels_);
+
+        ord_t const entry_order{level_order(cur_level)};
+        ENTRY const entry_mask{(static_cast<ENTRY>(1) << entry_order) - 1};
+
+        for (virt_t vaddr{start}; vaddr < end;) {
+            pte_pointer_t const pte_p{table + virt_to_index(cur_level, vaddr)};
+            virt_t const entry_base{vaddr & ~entry_mask};
+            virt_t const entry_end{entry_base + entry_mask + 1};
+
+        retry:
+            pte_t const entry{memory_.read(pte_p)};
+
+            if (not(entry & ATTR::PTE_P)) {
+                // Nothing to do.
+            } else if (is_leaf(cur_level, entry)) {
+                // A superpage that is only partially inside the range keeps its bits.
+                bool const covered{vaddr == entry_base and entry_end != 0 and entry_end <= end};
+
+                if (entry & bits) {
+                    if (clear and covered and not memory_.cmp_swap(pte_p, entry, entry & ~bits)) {
+                        goto retry;
+                    }
+
+                    fn(entry_base, entry_order);
+                }
+            } else {
+                virt_t const sub_end{entry_end == 0 ? end : min(end, entry_end)};
+
+                test_and_clear_leaves(page_alloc_.phys_to_pointer(entry & ~ATTR::mask), cur_level - 1, vaddr,
+                                      sub_end, bits, clear, fn);
+            }
+
+            // The last entry of a page table that covers the whole address space ends at zero.
+            if (entry_end == 0) {
+                break;
+            }
+
+            vaddr = entry_end;
+        }
+    }
+
+    // See the description of the public version of this function below.
+    template <typename FN>
+    bool for_each_mapping(pte_pointer_t table, level_t cur_level, virt_t start, virt_t end, FN& fn)
+    {
+        assert_slow(cur_level >= 0 and cur_level < max_levels_);
+
+        ord_t const entry_order{level_order(cur_level)};
+        ENTRY const entry_mask{(static_cast<ENTRY>(1) << entry_order) - 1};
+
+        for (virt_t vaddr{start}; vaddr < end;) {
+            pte_t const entry{memory_.read(table + virt_to_index(cur_level, vaddr))};
+            virt_t const entry_base{vaddr & ~entry_mask};
+            virt_t const entry_end{entry_base + entry_mask + 1};
+
+            if (not(entry & ATTR::PTE_P)) {
+                // Nothing is mapped here.
+            } else if (is_leaf(cur_level, entry)) {
+                phys_t const phys{entry & ~ATTR::mask & ~entry_mask};
+
+                if (not fn(Mapping{entry_base, phys, entry & ATTR::mask, entry_order})) {
+                    return false;
+                }
+            } else {
+                virt_t const sub_end{entry_end == 0 ? end : min(end, entry_end)};
+                pte_pointer_t const sub_table{page_alloc_.phys_to_pointer(entry & ~ATTR::mask)};
+
+                if (not for_each_mapping(sub_table, cur_level - 1, vaddr, sub_end, fn)) {
+                    return false;
+                }
+            }
+
+            // The last entry of a page table that covers the whole address space ends at zero.
+            if (entry_end == 0) {
+                break;
+            }
+
+            vaddr = entry_end;
+        }
+
+        return true;
+    }
+
+    // See the description of the public version of this function below.
+    void count_superpages(pte_pointer_t table, level_t cur_level, size_t* counts)
+    {
+        for (size_t i{0}; i < (static_cast<size_t>(1) << BITS_PER_LEVEL); i++) {
+            pte_t const entry{memory_.read(table + i)};
+
+            if (is_superpage(cur_level, entry)) {
+                counts[cur_level - 1]++;
+            } else if ((entry & ATTR::PTE_P) and cur_level > 1) {
+                count_superpages(page_alloc_.phys_to_pointer(entry & ~ATTR::mask), cur_level - 1, counts);
+            }
+        }
+    }
+
     // Use a superpage from the given level to fill out a new page table one
     // hierarchy deeper with the same mappings.
     void fill_from_superpage(pte_pointer_t new_table, pte_t superpage_pte, level_t cur_level)
     {
         assert_slow(is_superpage(cur_level, superpage_pte));
 
-        pte_t attr_mask{cur_level == 1 ? static_cast<pte_t>(ATTR::PTE_S) : 0};
+        pte_t const entry{cur_level == 1 ? to_small_pat(superpage_pte & ~ATTR::PTE_S) : superpage_pte};
 
         for (size_t i{0}; i < static_cast<size_t>(1) << BITS_PER_LEVEL; i++) {
             pte_t offset{i << (PAGE_BITS + (cur_level - 1) * BITS_PER_LEVEL)};
 
-            memory_.write(new_table + i, (superpage_pte & ~attr_mask) | offset);
+            memory_.write(new_table + i, entry | offset);
         }
     }
 
+    // 4K entries keep the highest PAT bit (ATTR::PTE_PAT2) where superpages have PTE_S. Superpages keep it in
+    // the lowest address bit instead (ATTR::PTE_PAT2_S). These move it between both positions.
+    static pte_t to_large_pat(pte_t entry)
+    {
+        return entry & ATTR::PTE_PAT2 ? (entry & ~ATTR::PTE_PAT2) | ATTR::PTE_PAT2_S : entry;
+    }
+
+    static pte_t to_small_pat(pte_t entry)
+    {
+        return entry & ATTR::PTE_PAT2_S ? (entry & ~ATTR::PTE_PAT2_S) | ATTR::PTE_PAT2 : entry;
+    }
+
+    // Return a pointer to the entry at the given level that translates
+    // vaddr. Returns nullptr, if there is no page table at this level.
+    //
+    // In contrast to walk_down_and_split, this never modifies the page
+    // table.
+    pte_pointer_t find_entry(virt_t vaddr, level_t level)
+    {
+        pte_pointer_t table{root_};
+
+        for (level_t cur_level{max_levels_ - 1}; cur_level > level; cur_level--) {
+            pte_t const entry{memory_.read(table + virt_to_index(cur_level, vaddr))};
+
+            if (is_leaf(cur_level, entry)) {
+                return nullptr;
+            }
+
+            table = page_alloc_.phys_to_pointer(entry & ~ATTR::mask);
+        }
+
+        return table + virt_to_index(level, vaddr);
+    }
+
+    // The accessed and dirty bits, which the hardware sets in leaf entries
+    // on its own.
+    static constexpr pte_t ad_bits{ATTR::PTE_A | ATTR::PTE_D};
+
+    // Returns the accessed and dirty bits of all entries of the given page
+    // table combined.
+    pte_t collect_ad_bits(pte_pointer_t table) const
+    {
+        pte_t bits{0};
+
+        for (size_t i{0}; i < static_cast<size_t>(1) << BITS_PER_LEVEL; i++) {
+            bits |= memory_.read(table + i) & ad_bits;
+        }
+
+        return bits;
+    }
+
+    // Returns true, if the page table with entries at the given level can
+    // be replaced by a single superpage. first is the first entry of the
+    // page table. The accessed and dirty bits are not compared, because
+    // the hardware sets them at any time.
+    bool is_promotable(pte_pointer_t table, level_t cur_level, pte_t first) const
+    {
+        ord_t const entry_order{level_order(cur_level)};
+        ENTRY const superpage_mask{(static_cast<ENTRY>(1) << level_order(cur_level + 1)) - 1};
+
+        // Superpages at lower levels carry PTE_S. Besides that, all bits that are not attributes or the
+        // PAT bit must be address bits of a naturally aligned superpage.
+        pte_t const expected_s{cur_level > 0 ? static_cast<pte_t>(ATTR::PTE_S) : 0};
+        pte_t const pat{cur_level > 0 ? static_cast<pte_t>(ATTR::PTE_PAT2_S)
+                                      : static_cast<pte_t>(ATTR::PTE_PAT2)};
+
+        if (not(first & ATTR::PTE_P) or not is_leaf(cur_level, first) or
+            (first & ~ATTR::mask & ~pat & superpage_mask) != expected_s) {
+            return false;
+        }
+
+        for (size_t i{1}; i < static_cast<size_t>(1) << BITS_PER_LEVEL; i++) {
+            if ((memory_.read(table + i) & ~ad_bits) !=
+                (first & ~ad_bits) + (static_cast<pte_t>(i) << entry_order)) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
     // See the description of the public version of this function below.
     Alloc_result<pte_pointer_t> walk_down_and_split(DEFERRED_CLEANUP& cleanup, virt_t vaddr, level_t to_level,
                                                     pte_pointer_t pte_p, level_t cur_level, bool create)
@@ -223,9 +414,11 @@ private:
 
             // Initialize the new page table with content from the former
             // superpage.
+            // Invalidating any address of a superpage invalidates all TLB entries of
+            // the superpage.
             if (is_superpage(cur_level, entry)) {
                 fill_from_superpage(new_page, entry, cur_level);
-                cleanup.flush_tlb_later();
+                cleanup.flush_tlb_later(vaddr, PAGE_SIZE);
             }
 
             // If we fail to install a pointer to the new page, we can
@@ -236,6 +429,8 @@ private:
                 goto retry;
             }
 
+            count_pages(1);
+
             entry = new_entry;
             phys = new_phys;
         }
@@ -245,34 +440,67 @@ private:
                                    create);
     }
 
-    // Free any page tables referenced from a page table entry.
+    // Free any page tables referenced from a page table entry that
+    // translated vaddr.
     //
     // Assumes that the given page table entry is already removed from the
     // page table.
-    NOINLINE void cleanup(DEFERRED_CLEANUP& cleanup_state, pte_t pte, level_t cur_level)
+    NOINLINE void cleanup(DEFERRED_CLEANUP& cleanup_state, pte_t pte, level_t cur_level, virt_t vaddr)
     {
         assert_slow(cur_level >= 0 and cur_level < max_levels_);
 
+        // Invalidating any address of a page invalidates all TLB entries of
+        // the page, even if it is a superpage.
         if (is_leaf(cur_level, pte)) {
             if (pte & ATTR::PTE_P) {
-                cleanup_state.flush_tlb_later();
+                cleanup_state.flush_tlb_later(vaddr, PAGE_SIZE);
             }
         } else {
-            cleanup_table(cleanup_state, page_alloc_.phys_to_pointer(pte & ~ATTR::mask), cur_level);
+            cleanup_table(cleanup_state, page_alloc_.phys_to_pointer(pte & ~ATTR::mask), cur_level, vaddr);
         }
     }
 
     // Free any page tables referenced from the given page table including
-    // itself. Companion function to cleanup().
-    void cleanup_table(DEFERRED_CLEANUP& cleanup_state, pte_pointer_t table, level_t cur_level)
+    // itself. The page table starts at vaddr. Companion function to
+    // cleanup().
+    void cleanup_table(DEFERRED_CLEANUP& cleanup_state, pte_pointer_t table, level_t cur_level, virt_t vaddr)
     {
         assert_slow(cur_level > 0 and cur_level <= max_levels_);
 
         for (size_t i{0}; i < static_cast<size_t>(1) << BITS_PER_LEVEL; i++) {
-            cleanup(cleanup_state, memory_.read(table + i), cur_level - 1);
+            cleanup(cleanup_state, memory_.read(table + i), cur_level - 1,
+                    vaddr + (static_cast<virt_t>(i) << level_order(cur_level - 1)));
         }
 
         cleanup_state.free_later(table);
+        count_pages(-1);
+    }
+
+    // Free the page tables below the first entry of the given table that either translates at most 2MB or
+    // has nothing left below it. Returns false, if the table is empty. Companion function to destroy_step().
+    bool destroy_step(DEFERRED_CLEANUP& cleanup_state, pte_pointer_t table, level_t cur_level, virt_t vaddr)
+    {
+        for (size_t i{0}; i < static_cast<size_t>(1) << BITS_PER_LEVEL; i++) {
+            pte_t const pte{memory_.read(table + i)};
+
+            if (pte == 0) {
+                continue;
+            }
+
+            virt_t const entry_vaddr{vaddr + (static_cast<virt_t>(i) << level_order(cur_level - 1))};
+
+            if (cur_level - 1 > 1 and not is_leaf(cur_level - 1, pte) and
+                destroy_step(cleanup_state, page_alloc_.phys_to_pointer(pte & ~ATTR::mask), cur_level - 1,
+                             entry_vaddr)) {
+                return true;
+            }
+
+            memory_.write(table + i, 0);
+            cleanup(cleanup_state, pte, cur_level - 1, entry_vaddr);
+            return true;
+        }
+
+        return false;
     }
 
     // Recursively update page table structures with new mappings.
@@ -310,7 +538,7 @@ private:
                 pte_t const new_attr{map.attr | (create_superpages ? static_cast<pte_t>(ATTR::PTE_S) : 0)};
                 pte_t const new_pte{clear_mappings ? 0 : (map.paddr | addr_offset | new_attr)};
 
-                cleanup(cleanup_state, memory_.exchange(pte_p, new_pte), cur_level);
+                cleanup(cleanup_state, memory_.exchange(pte_p, new_pte), cur_level, map.vaddr + addr_offset);
             } else {
             retry:
 
@@ -328,7 +556,9 @@ private:
                         goto retry;
                     }
 
-                    cleanup(cleanup_state, old_pte, cur_level);
+                    count_pages(1);
+
+                    cleanup(cleanup_state, old_pte, cur_level, map.vaddr + addr_offset);
                     old_pte = new_pte;
                 }
 
@@ -364,6 +594,12 @@ public:
     // the Page Directory Base Register (PDBR / CR3).
     phys_t root() const { return page_alloc_.pointer_to_phys(root_); }
 
+    // Returns the number of page table pages that this page table
+    // allocated and still references. Pages that were linked in with
+    // share are not included. The value is only a snapshot, if the page
+    // table is modified concurrently.
+    long pages() const { return Atomic::load(pages_); }
+
     // Return the mapping at the given virtual address.
     //
     // In case, the given virtual address corresponds to no mapping in the
@@ -408,9 +644,31 @@ public:
         return walk_down_and_split(cleanup, vaddr, to_level, root_, max_levels_ - 1, create);
     }
 
+    // Remembers the page table that the last update through this cursor
+    // modified. See update below.
+    class Update_cursor
+    {
+        friend this_t;
+
+        level_t level_{-1};
+        virt_t region_{0};
+        pte_pointer_t table_{nullptr};
+
+    public:
+        // Forget the remembered page table. This is necessary, if it may
+        // have been replaced by other means than an update with this
+        // cursor, such as promote.
+        void reset() { level_ = -1; }
+    };
+
     // Creates mappings in the page table. Returns true, if a TLB shootdown
     // is necessary.
-    NOINLINE Alloc_result_void update(DEFERRED_CLEANUP& cleanup, Mapping const& map)
+    //
+    // If the page table that has to be modified is the same one that the
+    // last update with the same cursor modified, the walk down from the
+    // root is skipped. Updates of neighbouring mappings thus only walk
+    // down the page table once per page table they modify.
+    NOINLINE Alloc_result_void update(DEFERRED_CLEANUP& cleanup, Update_cursor& cursor, Mapping const& map)
     {
         assert_slow(root_ != nullptr);
         assert_slow(map.order >= PAGE_BITS and map.order <= max_order());
@@ -424,23 +682,128 @@ public:
         level_t modified_level{(map.order - PAGE_BITS) / BITS_PER_LEVEL};
         assert_slow(modified_level < max_levels_);
 
-        // Walk down the page table to find the relevant page table to
-        // modify. If we encounter superpages on the way, split
-        // them. Missing structures are only created, if we actually have
-        // something to map.
-        bool const do_create{map.present()};
-
-        return walk_down_and_split(cleanup, map.vaddr, modified_level, do_create)
-            .and_then([this, &cleanup, modified_level, map](pte_pointer_t table) -> Alloc_result_void {
-                // We skip filling in new entries when walk_down_and_split has already finished the job. This
-                // happens when we remove mappings and the walk down step did not find page tables to recurse
-                // into.
-                if (table != nullptr) {
-                    fill_entries(cleanup, table, modified_level, map);
-                }
+        // The root needs no walk and covers the whole address space.
+        if (modified_level == max_levels_ - 1) {
+            fill_entries(cleanup, root_, modified_level, map);
+            return Ok_void({});
+        }
+
+        virt_t const region{map.vaddr >> level_order(modified_level + 1)};
+        pte_pointer_t table{cursor.table_};
+
+        if (cursor.level_ != modified_level or cursor.region_ != region) {
+            // Walk down the page table to find the relevant page table to
+            // modify. If we encounter superpages on the way, split
+            // them. Missing structures are only created, if we actually have
+            // something to map.
+            table = TRY_OR_RETURN(walk_down_and_split(cleanup, map.vaddr, modified_level, map.present()));
 
+            // We skip filling in new entries when walk_down_and_split has already finished the job. This
+            // happens when we remove mappings and the walk down step did not find page tables to recurse
+            // into.
+            if (table == nullptr) {
                 return Ok_void({});
-            });
+            }
+
+            cursor.level_ = modified_level;
+            cursor.region_ = region;
+            cursor.table_ = table;
+        }
+
+        fill_entries(cleanup, table, modified_level, map);
+        return Ok_void({});
+    }
+
+    // Convenience version of the above method for a single mapping.
+    Alloc_result_void update(DEFERRED_CLEANUP& cleanup, Mapping const& map)
+    {
+        Update_cursor cursor;
+        return update(cleanup, cursor, map);
+    }
+
+    // Creates all mappings from begin to end in this order. Sorting them by
+    // virtual address minimizes the number of page table walks.
+    template <typename IT> Alloc_result_void update(DEFERRED_CLEANUP& cleanup, IT begin, IT end)
+    {
+        Update_cursor cursor;
+
+        for (; begin != end; ++begin) {
+            TRY_OR_RETURN(update(cleanup, cursor, *begin));
+        }
+
+        return Ok_void({});
+    }
+
+    // Replace page tables that translate vaddr by superpages, if all their
+    // entries are present leaves that map physically contiguous and
+    // naturally aligned memory with identical attributes. This starts with
+    // the lowest page table and continues upwards as long as page tables
+    // are replaced. The replaced page tables are freed via cleanup.
+    //
+    // In contrast to all other modifications, this must not run
+    // concurrently with other modifications of the page tables that
+    // translate vaddr. A concurrent update may write into a page table
+    // after it was checked and its change would be lost.
+    //
+    // Returns true, if at least one page table was replaced.
+    bool promote(DEFERRED_CLEANUP& cleanup, virt_t vaddr)
+    {
+        assert_slow(root_ != nullptr);
+
+        bool promoted{false};
+
+        for (level_t level{1}; level < leaf_levels_; level++) {
+            pte_pointer_t const entry_p{find_entry(vaddr, level)};
+
+            if (entry_p == nullptr) {
+                return promoted;
+            }
+
+            pte_t const entry{memory_.read(entry_p)};
+
+            // We can only continue upwards once this level is a superpage.
+            if (is_leaf(level, entry)) {
+                if (is_superpage(level, entry)) {
+                    continue;
+                }
+
+                return promoted;
+            }
+
+            pte_pointer_t const table{page_alloc_.phys_to_pointer(entry & ~ATTR::mask)};
+            pte_t const first{memory_.read(table)};
+
+            if (not is_promotable(table, level - 1, first)) {
+                return promoted;
+            }
+
+            pte_t const first_large{level == 1 ? to_large_pat(first) : first};
+            pte_t const superpage{(first_large & ~ad_bits) | collect_ad_bits(table) | ATTR::PTE_S};
+
+            if (not memory_.cmp_swap(entry_p, entry, superpage)) {
+                return promoted;
+            }
+
+            // The hardware may have set accessed or dirty bits in the old page table after we collected
+            // them. Losing a dirty bit would hide a modification from anyone who harvests them, so merge
+            // the late ones into the superpage, which the hardware may update concurrently as well.
+            pte_t const late_bits{collect_ad_bits(table) & ~superpage};
+
+            for (pte_t cur{superpage}; (cur & late_bits) != late_bits; cur = memory_.read(entry_p)) {
+                if (memory_.cmp_swap(entry_p, cur, cur | late_bits)) {
+                    break;
+                }
+            }
+
+            // Invalidating any address also drops the paging-structure caches that may still point to the
+            // old page table.
+            cleanup.flush_tlb_later(vaddr, PAGE_SIZE);
+            cleanup.free_later(table);
+            count_pages(-1);
+            promoted = true;
+        }
+
+        return promoted;
     }
 
     // Convenience version of the above method when batching of TLB
@@ -456,6 +819,47 @@ public:
         return cleanup;
     }
 
+    // Link the page table that src uses for the entry at the given level
+    // that translates vaddr into this page table. Both page tables then use
+    // the same page table structures below this entry, so later changes in
+    // this region are visible in both.
+    //
+    // The entry in src must point to a page table. The shared page tables
+    // remain owned by src and have to be unlinked with unshare before this
+    // page table is destroyed.
+    Alloc_result_void share(DEFERRED_CLEANUP& cleanup, this_t& src, virt_t vaddr, level_t level)
+    {
+        assert_slow(root_ != nullptr);
+        assert(level > 0 and level < max_levels_);
+
+        pte_pointer_t const src_entry_p{src.find_entry(vaddr, level)};
+        assert(src_entry_p != nullptr);
+
+        pte_t const entry{src.memory_.read(src_entry_p)};
+        assert(not is_leaf(level, entry));
+
+        pte_pointer_t const table{TRY_OR_RETURN(walk_down_and_split(cleanup, vaddr, level))};
+        [[maybe_unused]] pte_t const old_entry{memory_.exchange(table + virt_to_index(level, vaddr), entry)};
+
+        // We don't know whether the old entry was also shared, so we cannot clean it up.
+        assert(old_entry == 0);
+
+        return Ok_void({});
+    }
+
+    // Unlink page tables that were linked into this page table with share.
+    //
+    // This does not invalidate any TLB entries and is meant to be used
+    // just before the page table is destroyed.
+    void unshare(virt_t vaddr, level_t level)
+    {
+        pte_pointer_t const entry_p{find_entry(vaddr, level)};
+
+        if (entry_p != nullptr) {
+            memory_.exchange(entry_p, 0);
+        }
+    }
+
     // Replace a single non-existing or read-only page at the lowest page
     // table level with a new mapping.
     //
@@ -492,15 +896,69 @@ public:
         return old_pte & ~ATTR::mask;
     }
 
+    // Atomically clear the given bits in all present leaf entries that translate addresses in the range
+    // [vaddr, vaddr + size).
+    //
+    // For each leaf entry in the range that had any of these bits set, fn is called with the base address and
+    // the order of the whole entry. Superpages that are only partially inside the range are reported, but
+    // their bits are not cleared. With clear set to false, the entries are only reported. This is used to
+    // harvest accessed or dirty bits that the hardware sets. The caller is responsible for invalidating TLB
+    // entries that still cache the cleared bits.
+    template <typename FN>
+    void test_and_clear_leaves(virt_t vaddr, virt_t size, pte_t bits, FN fn, bool clear = true)
+    {
+        assert_slow(root_ != nullptr);
+        assert_slow((bits & ~ATTR::mask) == 0 and (bits & ATTR::PTE_P) == 0);
+
+        if (size == 0) {
+            return;
+        }
+
+        test_and_clear_leaves(root_, max_levels_ - 1, vaddr, vaddr + size, bits, clear, fn);
+    }
+
+    // Call fn with each present mapping that overlaps the range from vaddr
+    // to vaddr + size in ascending order. This walks the page table only
+    // once and skips unmapped regions without descending into them.
+    //
+    // Mappings are reported as a whole, so the first and last mapping may
+    // extend beyond the range. fn returns false to stop the walk early. In
+    // that case, this function also returns false.
+    template <typename FN> bool for_each_mapping(virt_t vaddr, virt_t size, FN fn)
+    {
+        assert_slow(root_ != nullptr);
+
+        if (size == 0) {
+            return true;
+        }
+
+        return for_each_mapping(root_, max_levels_ - 1, vaddr, vaddr + size, fn);
+    }
+
+    // Add the number of superpages on each level to counts. counts[n] receives
+    // the superpages on level n + 1, i.e. counts[0] the 2 MB pages on x86_64.
+    //
+    // The walk does not visit the page tables on level 0, so it only takes
+    // time proportional to the number of page tables above them.
+    template <size_t N> void count_superpages(size_t (&counts)[N])
+    {
+        assert(static_cast<size_t>(leaf_levels_) <= N + 1);
+
+        if (root_ != nullptr) {
+            count_superpages(root_, max_levels_ - 1, counts);
+        }
+    }
+
     // Prevent copying, but allow moving the page tables around.
     this_t& operator=(this_t const& rhs) = delete;
     Generic_page_table(this_t const& rhs) = delete;
 
     Generic_page_table(this_t&& rhs)
         : memory_{rhs.memory_}, page_alloc_{rhs.page_alloc_}, max_levels_{rhs.max_levels_},
-          leaf_levels_{rhs.leaf_levels_}, root_{rhs.root_}
+          leaf_levels_{rhs.leaf_levels_}, root_{rhs.root_}, pages_{rhs.pages_}
     {
         rhs.root_ = nullptr;
+        rhs.pages_ = 0;
     }
 
     // Create a new page table with a pre-existing root page table pointer.
@@ -516,6 +974,27 @@ public:
         : Generic_page_table(max_levels, leaf_levels, {}, {})
     {
         root_ = page_alloc_.alloc_zeroed_page().unwrap("Failed to allocate page table root");
+        pages_ = 1;
+    }
+
+    // Free a bounded part of a page table that is not in use anymore. Each
+    // step frees at most one page table below the root. Returns false, if
+    // only the root is left.
+    //
+    // This splits the work of the destructor for large page tables.
+    bool destroy_step()
+    {
+        if (root_ == nullptr) {
+            return false;
+        }
+
+        DEFERRED_CLEANUP cleanup_state;
+        bool const freed{destroy_step(cleanup_state, root_, max_levels_, 0)};
+
+        cleanup_state.ignore_tlb_flush();
+        cleanup_state.free_pages_now();
+
+        return freed;
     }
 
     // The destructor assumes that the page table is not in use anymore and
@@ -527,7 +1006,7 @@ public:
         }
 
         DEFERRED_CLEANUP cleanup_state;
-        cleanup_table(cleanup_state, root_, max_levels_);
+        cleanup_table(cleanup_state, root_, max_levels_, 0);
 
         cleanup_state.ignore_tlb_flush();
         cleanup_state.free_pages_now();
@@ -0,0 +1,275 @@
+/*
+ * Read-Copy Update (RCU)
+ *
+ * Copyright (C) 2009-2011 Udo Steinberg <udo@hypervisor.org>
+ * Economic rights: Technische Universitaet Dresden (Germany)
+ *
+ * Copyright (C) 2012 Udo Steinberg, Intel Corporation.
+ *
+ * This file is part of the Hedron hypervisor.
+ *
+ * Hedron is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Hedron is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License version 2 for more details.
+ */
+
+#pragma once
+
+#include "atomic.hpp"
+#include "barrier.hpp"
+#include "hazards.hpp"
+#include "rcu_list.hpp"
+#include "types.hpp"
+
+/// The central Read-Copy-Update implementation.
+///
+/// See docs/implementation.md for a longer description of how RCU works in
+/// Hedron.
+///
+/// CPU provides everything that depends on the CPU the code runs on, so the
+/// state machine can also run on host threads (see test/unit/rcu.cpp):
+///
+/// - id(), online() and for_each_online_cpu(fn) describe the CPUs,
+/// - l_batch(), c_batch(), c_tsc(), next(), curr() and done() return the
+///   RCU state of the current CPU and remote_ref_q_batch(cpu) the quiet
+///   batch of any CPU,
+/// - hazard() returns the hazards of the current CPU and
+///   isolated_guest(cpu) whether a CPU executes a guest in isolated mode,
+/// - kick() makes all CPUs handle HZD_IDL,
+/// - tsc() returns the time and count_call(), count_invoke(n, tsc) and
+///   count_batch(b, wait_tsc) account RCU work in the statistics.
+template <typename CPU> class Generic_rcu
+{
+private:
+    enum State
+    {
+        RCU_CMP = 1UL << 0,
+        RCU_PND = 1UL << 1,
+    };
+
+    static inline mword count;
+    static inline mword state{RCU_CMP};
+
+    // The last batch of an expedited grace period or zero if no grace period is expedited.
+    static inline mword expedited;
+
+    // The number of callbacks that invoke_batch calls at once. The remaining ones are left for the next time
+    // the CPU leaves the kernel, so a large batch doesn't block the CPU for a long time.
+    static constexpr unsigned MAX_CALLBACKS{64};
+
+    static inline mword batch() { return state >> 2; }
+
+    static inline bool complete(mword b)
+    {
+        return static_cast<signed long>((state & ~RCU_PND) - (b << 2)) > 0;
+    }
+
+    static void start_batch(State);
+
+    // Returns true if the given CPU has not been counted as quiet for batch b yet. Afterwards, it is. Each
+    // CPU is counted once per batch, either by itself or, while it executes a guest in isolated mode, by the
+    // CPU that starts the batch.
+    static bool claim(unsigned cpu, mword b);
+
+    static void invoke_batch();
+
+public:
+    /// Declare the passed object ready for reclamation.
+    ///
+    /// This will immediately call its pre_func callback. Once the
+    /// hypervisor has gone through quiescent states on all CPUs, the free
+    /// callback of the object is called.
+    static bool call(Rcu_elem* e);
+
+    static void quiet();
+    static void update();
+
+    /// Speed up the reclamation of the objects that this CPU handed to RCU.
+    ///
+    /// Instead of waiting for all CPUs to pass through quiescent states on their own, this sends an NMI to
+    /// all CPUs. Each CPU passes through a quiescent state and advances its batches when it handles the
+    /// resulting HZD_IDL. This repeats for each batch until the objects are reclaimed. This is costly for
+    /// all CPUs and should only be used if memory has to be reclaimed quickly.
+    static void expedite();
+
+    /// Pass through a quiescent state for an expedited grace period. Called for HZD_IDL.
+    ///
+    /// This doesn't invoke any callbacks, so it is safe to call in the NMI handler.
+    static void quiet_expedited();
+
+    /// Pass through a quiescent state for an expedited grace period and advance the batches of this CPU.
+    /// Called for HZD_IDL when the CPU leaves the kernel.
+    static void update_expedited();
+
+    /// Returns true if this CPU has callbacks that wait for a grace period.
+    static inline bool pending() { return not CPU::next().empty() or not CPU::curr().empty(); }
+};
+
+template <typename CPU> bool Generic_rcu<CPU>::call(Rcu_elem* e)
+{
+    if (e->pre_func)
+        e->pre_func(e);
+
+    if (!CPU::next().enqueue(e))
+        return false;
+
+    CPU::count_call();
+    return true;
+}
+
+template <typename CPU> void Generic_rcu<CPU>::invoke_batch()
+{
+    unsigned n = 0;
+    uint64 const start{CPU::tsc()};
+
+    for (; n < MAX_CALLBACKS && !CPU::done().empty(); n++) {
+        Rcu_elem* const e = CPU::done().dequeue();
+        (e->func)(e);
+    }
+
+    CPU::count_invoke(n, CPU::tsc() - start);
+
+    // Come back for the rest when we leave the kernel.
+    if (!CPU::done().empty())
+        Atomic::set_mask(CPU::hazard(), HZD_IDL);
+}
+
+template <typename CPU> bool Generic_rcu<CPU>::claim(unsigned cpu, mword b)
+{
+    mword q;
+
+    do {
+        q = Atomic::load(CPU::remote_ref_q_batch(cpu));
+
+        if (static_cast<signed long>(b - q) <= 0) {
+            return false;
+        }
+    } while (not Atomic::cmp_swap(CPU::remote_ref_q_batch(cpu), q, b));
+
+    return true;
+}
+
+template <typename CPU> void Generic_rcu<CPU>::start_batch(State s)
+{
+    mword v, m = RCU_CMP | RCU_PND;
+
+    do
+        if ((v = state) >> 2 != CPU::l_batch())
+            return;
+    while (!(v & s) && !Atomic::cmp_swap(state, v, v | s));
+
+    if ((v ^ ~s) & m)
+        return;
+
+    count = CPU::online();
+
+    barrier();
+
+    // This is a full barrier, so either we see that an isolated CPU executes a guest below or it sees the new
+    // batch before it enters the guest. See Vcpu::run.
+    Atomic::add(state, 1UL);
+
+    // Isolated CPUs that execute a guest hold no references, so they are quiet right away. Counting them
+    // here spares them the NMI and us the wait for their next VM exit. We are not quiet yet ourselves, so
+    // this never completes the batch.
+    mword const b{batch()};
+
+    CPU::for_each_online_cpu([b](unsigned cpu) {
+        if (cpu != CPU::id() and CPU::isolated_guest(cpu) and claim(cpu, b)) {
+            Atomic::sub(count, 1UL);
+        }
+    });
+}
+
+template <typename CPU> void Generic_rcu<CPU>::quiet()
+{
+    if (not claim(CPU::id(), CPU::l_batch()) or Atomic::sub(count, 1UL) != 0)
+        return;
+
+    start_batch(RCU_CMP);
+
+    // The CPUs need another kick to notice the next batch or invoke the callbacks of the completed one.
+    if (mword const b{Atomic::load(expedited)}; b) {
+        if (complete(b))
+            Atomic::cmp_swap(expedited, b, 0UL);
+
+        CPU::kick();
+    }
+}
+
+template <typename CPU> void Generic_rcu<CPU>::expedite()
+{
+    update();
+
+    if (CPU::curr().empty())
+        return;
+
+    // Other CPUs may expedite an earlier batch at the same time. We keep the later one.
+    for (mword b = Atomic::load(expedited); !b || static_cast<signed long>(CPU::c_batch() - b) > 0;
+         b = Atomic::load(expedited))
+        if (Atomic::cmp_swap(expedited, b, CPU::c_batch()))
+            break;
+
+    CPU::kick();
+}
+
+template <typename CPU> void Generic_rcu<CPU>::quiet_expedited()
+{
+    if (CPU::l_batch() != batch()) {
+        CPU::l_batch() = batch();
+        Atomic::set_mask(CPU::hazard(), HZD_RCU);
+    }
+
+    // We are in a quiescent state, so there is no need to wait for the next one.
+    if (Atomic::load(CPU::hazard()) & HZD_RCU) {
+        Atomic::clr_mask(CPU::hazard(), HZD_RCU);
+        quiet();
+    }
+}
+
+template <typename CPU> void Generic_rcu<CPU>::update_expedited()
+{
+    quiet_expedited();
+    update();
+
+    // Batches started by this CPU are expedited as well, so they don't delay the reclamation of objects that
+    // other CPUs wait for.
+    mword const b = Atomic::load(expedited);
+
+    if (b && !CPU::curr().empty() && static_cast<signed long>(CPU::c_batch() - b) > 0)
+        Atomic::cmp_swap(expedited, b, CPU::c_batch());
+}
+
+template <typename CPU> void Generic_rcu<CPU>::update()
+{
+    if (CPU::l_batch() != batch()) {
+        CPU::l_batch() = batch();
+        Atomic::set_mask(CPU::hazard(), HZD_RCU);
+    }
+
+    if (!CPU::curr().empty() && complete(CPU::c_batch())) {
+        CPU::done().append(&CPU::curr());
+        CPU::count_batch(CPU::c_batch(), CPU::tsc() - CPU::c_tsc());
+    }
+
+    if (CPU::curr().empty() && !CPU::next().empty()) {
+        CPU::curr().append(&CPU::next());
+
+        CPU::c_batch() = CPU::l_batch() + 1;
+        CPU::c_tsc() = CPU::tsc();
+
+        start_batch(RCU_PND);
+    }
+
+    if (!CPU::curr().empty() && !CPU::next().empty() &&
+        (CPU::next().count > 2000 || CPU::curr().count > 2000) && !Atomic::load(expedited))
+        CPU::kick();
+
+    if (!CPU::done().empty())
+        invoke_batch();
+}
@@ -22,6 +22,17 @@ inline constexpr unsigned HZD_SCHED{1u << 0};
 inline constexpr unsigned HZD_RCU{1u << 1};
 inline constexpr unsigned HZD_TLB{1u << 2}; // The TLB has to be flushed.
 inline constexpr unsigned HZD_PRK{1u << 3}; // The CPU should be parked (call Lapic::park_function).
-inline constexpr unsigned HZD_IDL{1u << 4}; // RCU acceleration.
+inline constexpr unsigned HZD_IDL{1u << 4}; // RCU acceleration (see Rcu::expedite).
 inline constexpr unsigned HZD_RRQ{1u << 5}; // There are SCs in the ready queue and Sc::ready_enqueue has
                                             // to be called.
+inline constexpr unsigned HZD_STEAL{1u << 6}; // An idle CPU asks for a migratable SC (see Sc::steal).
+inline constexpr unsigned HZD_WORK{1u << 7};  // Another CPU offers work items (see Parallel::for_each) or
+                                              // deferred work is queued (see Deferred_work). The handler
+                                              // looks for both.
+
+// Hazards that may stay set for a long time on busy CPUs and are never sent with an NMI. They neither cut
+// halt polling short nor make an NMI look like a kick. See Vcpu::poll_halt and Vcpu::handle_exception.
+inline constexpr unsigned HZD_LAZY{HZD_WORK};
+
+// The number of hazard bits. See Sched_stats::hazard_cnt.
+inline constexpr unsigned NUM_HZD{8};
@@ -41,11 +41,27 @@ public:
     uint8 thread;
     uint8 core;
     uint8 package;
+
+    // The lower 8 bits of acpi_uid and x2apic_id.
     uint8 acpi_id;
     uint8 apic_id;
 
-    // We add reserved fields here to avoid padding by the compiler.
-    uint8 reserved[2];
+    // The lower 8 bits of the ACPI proximity domain (NUMA node) of the CPU. It is zero, if the platform
+    // doesn't describe its NUMA topology.
+    uint8 numa_node;
+
+    // The die number of the CPU within its package. It is zero, if the CPU doesn't enumerate dies.
+    uint8 die;
+
+    // The full ACPI processor UID and APIC ID, which can be larger than 255 on systems with x2APIC.
+    uint32 acpi_uid;
+    uint32 x2apic_id;
+
+    // CPUs with the same llc_id share their last level cache.
+    uint32 llc_id;
+
+    // The full ACPI proximity domain of the CPU.
+    uint32 proximity_domain;
 };
 
 // A memory area that is in use when the kernel passes control to the roottask.
@@ -126,6 +142,11 @@ public:
         FEAT_IOMMU = 1U << 0,
         FEAT_VMX = 1U << 1,
         FEAT_UEFI = 1U << 3,
+        FEAT_INVEPT_SINGLE = 1U << 4,
+        FEAT_INVVPID_SINGLE = 1U << 5,
+        FEAT_EPT_1G = 1U << 6,
+        FEAT_HPT_1G = 1U << 7,
+        FEAT_EPT_5_LEVEL = 1U << 8,
     };
 
     static mword root_addr;
@@ -147,6 +168,19 @@ public:
 
     static bool cpu_online(unsigned long cpu) { return cpu < NUM_CPU && hip()->cpu_desc[cpu].flags & 1; }
 
+    // Call fn with the ID of each online CPU in ascending order.
+    //
+    // The CPUs in the MADT get the IDs below Cpu::online, so this never looks at the NUM_CPU - Cpu::online
+    // IDs of CPUs that don't exist. Loops over all CPUs should use this instead of going up to NUM_CPU.
+    template <typename FN> static void for_each_online_cpu(FN fn)
+    {
+        for (unsigned cpu{0}; cpu < Cpu::online; cpu++) {
+            if (cpu_online(cpu)) {
+                fn(cpu);
+            }
+        }
+    }
+
     static void set_secondary_vmx_caps(uint64 caps) { Atomic::store(hip()->cap_vmx_sec_exec, caps); }
 
     static void build(mword, mword);
@@ -162,7 +196,7 @@ public:
     template <typename FN> static void for_each_sibling(unsigned long cpu_id, FN func)
     {
         if (cpu_id < array_size(hip()->cpu_desc)) {
-            for (size_t i{0u}; i < array_size(hip()->cpu_desc); ++i) {
+            for (size_t i{0u}; i < Cpu::online; ++i) {
                 if (cpu_online(i) and hip()->cpu_desc[cpu_id].package == hip()->cpu_desc[i].package and
                     hip()->cpu_desc[cpu_id].core == hip()->cpu_desc[i].core and
                     hip()->cpu_desc[cpu_id].thread != hip()->cpu_desc[i].thread) {
@@ -198,4 +232,6 @@ public:
     // modifications to the HIP are not possible after finalizing it.
     static void finalize();
 };
-static_assert(sizeof(Hip) <= PAGE_SIZE, "HIP cannot be larger than one page");
+static_assert(sizeof(Hip) <= HIP_SIZE, "HIP cannot be larger than the memory reserved for it");
+static_assert(sizeof(Hip_cpu) <= 24, "HIP_SIZE only reserves 24 bytes for each CPU descriptor");
+static_assert(HIP_SIZE < 65536, "The length field of the HIP is too small for this many CPUs");
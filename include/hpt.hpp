@@ -37,6 +37,9 @@ private:
     // The number of leaf levels we support.
     static level_t supported_leaf_levels;
 
+    // The page table level of the entry that translates all kernel mappings. See share_kernel.
+    static constexpr level_t KERNEL_LEVEL{2};
+
     using Hpt_page_table::Hpt_page_table;
 
 public:
@@ -99,6 +102,7 @@ public:
         PTE_PAT0 = 1ULL << 3,
         PTE_PAT1 = 1ULL << 4,
         PTE_PAT2 = 1ULL << 7, // Only valid in leaf level (otherwise it's bit 12)
+        PTE_PAT2_S = 1ULL << 12,
 
         // Prevent pages from being delegated. This is useful for pages that
         // the kernel needs to be able to reclaim from userspace (e.g. UTCBs,
@@ -120,9 +124,16 @@ public:
     // Adjust the number of leaf levels to the given value.
     static void set_supported_leaf_levels(level_t level);
 
-    // Return a structural copy of this page table for the given virtual
-    // address range.
-    Hpt deep_copy(mword vaddr_start, mword vaddr_end);
+    // Return a new page table that shares the page tables for the kernel
+    // mappings between LINK_ADDR and SPC_LOCAL with this page table. Only
+    // the root and the page tables of the space-local area are allocated.
+    //
+    // The shared page tables stay owned by this page table, which must
+    // outlive the new one. Call unshare_kernel before destroying it.
+    Hpt share_kernel();
+
+    // Unlink the kernel page tables that share_kernel linked into this page table.
+    void unshare_kernel() { unshare(LINK_ADDR, KERNEL_LEVEL); }
 
     void make_current(mword pcid)
     {
@@ -140,26 +151,25 @@ public:
     // Temporarily map the given physical memory.
     //
     // Establish a temporary mapping for the given physical address in a
-    // special kernel virtual address region reserved for this
-    // usecase. Return a pointer to access this memory. phys does not need
-    // to be aligned.
+    // kernel virtual address window that only the current CPU uses. Return
+    // a pointer to access this memory. phys does not need to be aligned.
     //
     // If use_boot_hpt is true, the mapping is established in the boot page
     // tables. If not, use the current Pd's kernel address space.
     //
-    // The returned pointer is valid until the next remap call (on any core).
+    // The returned pointer is valid on the current CPU until its next remap
+    // call or until it switches to another address space.
     static void* remap(Paddr phys, bool use_boot_hpt = true);
 
     // Unmap a page from the kernel address space.
     //
-    // This function only allows to modify boot_hpt to keep the kernel address space identical everywhere.
-    // The kernel portion of the address space is replicated from the boot_hpt into all other host page
-    // tables. If we allow modifying other page tables beyond boot_hpt, we risk a non-uniform kernel address
-    // space.
+    // This function only allows to modify boot_hpt, because it owns the kernel portion of the address
+    // space. All other host page tables share these page tables with the boot_hpt (see share_kernel).
     //
-    // This function also demands that boot_hpt is currently active. Because the boot_hpt is copied into
-    // newly created address spaces, we have to make sure to only call it before new address spaces are
-    // created. This time frame largely coincides with the time the boot_hpt is active.
+    // This function also demands that boot_hpt is currently active. It only invalidates the TLB of the
+    // current CPU, so we have to make sure to only call it before new address spaces are created and
+    // other CPUs use the kernel mappings. This time frame largely coincides with the time the boot_hpt is
+    // active.
     static void unmap_kernel_page(void* kernel_page);
 
     // Atomically change a 4K page mapping to point to a new frame. Return
@@ -0,0 +1,64 @@
+/*
+ * Hardware-Controlled Performance States (HWP)
+ *
+ * This file is part of the Hedron hypervisor.
+ *
+ * Hedron is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Hedron is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License version 2 for more details.
+ */
+
+#pragma once
+
+#include "compiler.hpp"
+#include "cpulocal.hpp"
+#include "types.hpp"
+
+// Per-SC performance hints.
+//
+// SCs can carry a value for IA32_HWP_REQUEST, i.e. a minimum, maximum and desired performance level, an
+// energy/performance preference (EPP) and an activity window. CPUs load it when they switch to the SC. SCs
+// without a hint run with the request that was in effect when the CPU first needed HWP.
+//
+// CPUs only enable HWP once an SC with a hint runs on them. Until then, they keep the frequency policy of
+// the firmware. HWP can't be disabled again without a reset, so they keep it enabled until suspend.
+class Hwp
+{
+    // The IA32_HWP_REQUEST value of the current SC or zero, if the CPU runs with its default request.
+    CPULOCAL_ACCESSOR(hwp, request);
+
+    // The IA32_HWP_REQUEST value of the CPU before it switched to the first SC with a hint.
+    CPULOCAL_ACCESSOR(hwp, fallback);
+
+    // Whether this CPU has HWP enabled and hwp_fallback is valid.
+    CPULOCAL_ACCESSOR(hwp, enabled);
+
+    static void update(uint64 value);
+
+public:
+    // Whether this CPU supports HWP.
+    static bool supported();
+
+    // Whether the CPU accepts the value as IA32_HWP_REQUEST. Zero is valid and removes a hint.
+    static bool valid(uint64 value);
+
+    // Loads the performance hint of the SC that runs next.
+    static void switch_request(uint64 value)
+    {
+        if (EXPECT_FALSE(value != request())) {
+            update(value);
+        }
+    }
+
+    // Suspend and INIT disable HWP.
+    static void init()
+    {
+        request() = 0;
+        enabled() = false;
+    }
+};
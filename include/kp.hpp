@@ -21,12 +21,14 @@
 #include "memory.hpp"
 #include "slab.hpp"
 #include "spinlock.hpp"
+#include "tlb_cleanup.hpp"
 
 class Pd;
 
 // Kernel Page
 //
-// A kernel page represents a page of hypervisor memory shared with user space.
+// A kernel page represents a page of hypervisor memory shared with user space. Kernel pages that user space
+// creates can also span a power-of-two number of physically contiguous pages.
 class Kp : public Typed_kobject<Kobject::Type::KP>, public Refcount
 {
 private:
@@ -49,21 +51,29 @@ private:
 
     // The kernel memory of this kernel page.
     void* data;
-    // The pd that has a user space mapping for this kernel page.
-    Pd* pd_user_page{nullptr};
-    // The address of this kernel page in user space. If this value is greater
-    // or equals INVALID_USER_ADDR, the kernel page is not mapped. Otherwise it
-    // is mapped.
-    mword addr_in_user_space{INVALID_USER_ADDR};
-
-    // Checks if a valid user mapping for this kernel page exists.
-    bool has_user_mapping() const;
+    // The kernel memory spans 2^order pages.
+    unsigned const order{0};
+    // Kernel pages that expose kernel-owned memory don't free it and are mapped read-only.
+    bool const kernel_owned{false};
+    // The pd that has a user space mapping for this kernel page in each mapping slot.
+    Pd* pd_user_page[2]{nullptr, nullptr};
+    // The address of this kernel page in user space in each mapping slot. If
+    // this value is greater or equals INVALID_USER_ADDR, the slot is not
+    // mapped. Otherwise it is mapped.
+    mword addr_in_user_space[2]{INVALID_USER_ADDR, INVALID_USER_ADDR};
+
+    // Checks if a valid user mapping for this kernel page exists in the given slot.
+    bool has_user_mapping(unsigned slot) const;
 
     // The kernel virtual address of the page represented by this object.
     mword kernel_address() const { return reinterpret_cast<mword>(data); }
 
-    // The user virtual address of the page represented by this object.
-    mword user_address() const { return addr_in_user_space; }
+    // The user virtual address of the page represented by this object in the given slot.
+    mword user_address(unsigned slot) const { return addr_in_user_space[slot]; }
+
+    // Maps the whole kernel memory at the given user address with the given attributes or removes the
+    // mapping if attr is zero. Uses the largest pages that the alignment of both addresses allows.
+    Tlb_cleanup update_user_mapping(Pd* pd, mword addr, mword attr);
 
 public:
     // Capability permission bitmask.
@@ -80,7 +90,17 @@ public:
     // little to no sense.
     Kp(Pd* own);
 
-    Kp(Pd* own, mword sel);
+    // The largest order of kernel memory that user space can create a kernel page with.
+    static constexpr unsigned MAX_ORDER{9};
+
+    // Creates a kernel page with 2^ord pages of fresh memory. If the memory cannot be allocated,
+    // data_page() returns nullptr.
+    Kp(Pd* own, mword sel, unsigned ord = 0);
+
+    // Creates a kernel page that user space can map read-only to observe the given kernel memory. The page
+    // must stay valid forever.
+    Kp(Pd* own, mword sel, void* page);
+
     ~Kp();
 
     // The data page that is shared with userspace.
@@ -89,16 +109,32 @@ public:
     // same memory concurrently.
     void* data_page() const { return data; }
 
-    // Adds a user space mapping for this kernel page. This includes adding a
-    // RCU reference to the destination PD and mapping the memory at the given
-    // address.
-    // Returns true if the mapping was successful, i.e. if no mapping
-    // existed and if the given address is valid. Otherwise returns false.
-    bool add_user_mapping(Pd* pd, mword addr);
+    // The size of the kernel memory in bytes.
+    mword size() const { return PAGE_SIZE << order; }
 
-    // Removes the current user space mapping. If no user space mapping exists,
-    // this function does nothing and returns false. Returns true otherwise.
-    bool remove_user_mapping();
+    // Returns true if this kernel page exposes kernel-owned memory that user space can only read.
+    bool is_kernel_owned() const { return kernel_owned; }
+
+    // A kernel page can be mapped once in each slot. The second slot lets two PDs share the page, e.g. the
+    // producer and the consumer of a ring channel (see docs/user-documentation/data-structures.md).
+    enum Mapping_slot : unsigned
+    {
+        OWN_MAPPING = 0,
+        PEER_MAPPING = 1,
+    };
+
+    // Adds a user space mapping for this kernel page in the given slot. This
+    // includes adding a RCU reference to the destination PD and mapping the
+    // memory at the given address.
+    // Returns true if the mapping was successful, i.e. if no mapping
+    // existed in the slot and if the given address is valid for the whole
+    // kernel memory. Otherwise returns false.
+    bool add_user_mapping(Pd* pd, mword addr, Mapping_slot slot = OWN_MAPPING);
+
+    // Removes the user space mapping in the given slot. If no user space
+    // mapping exists there, this function does nothing and returns false.
+    // Returns true otherwise.
+    bool remove_user_mapping(Mapping_slot slot = OWN_MAPPING);
 
     static inline void* operator new(size_t) { return cache.alloc(); }
     static inline void operator delete(void* ptr) { cache.free(ptr); }
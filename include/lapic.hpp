@@ -25,6 +25,7 @@
 
 #include "assert.hpp"
 #include "compiler.hpp"
+#include "cpuset.hpp"
 #include "memory.hpp"
 #include "msr.hpp"
 #include "x86.hpp"
@@ -69,6 +70,9 @@ private:
         DLV_EXTINT = 7U << 8,
     };
 
+    // ICR destination mode
+    static constexpr uint32 DST_LOGICAL{1U << 11};
+
     enum Shorthand
     {
         DSH_NONE = 0U << 18,
@@ -81,16 +85,44 @@ private:
         MASKED = 1U << 16,
     };
 
+    // IA32_APIC_BASE
+    static constexpr uint64 APIC_BASE_BSP{1U << 8};
+    static constexpr uint64 APIC_BASE_EXTD{1U << 10};
+    static constexpr uint64 APIC_BASE_EN{1U << 11};
+
+    // In x2APIC mode, each register is an MSR at this base plus the register index.
+    static constexpr unsigned X2APIC_MSR_BASE{0x800};
+
+    // Whether all LAPICs run in x2APIC mode. The BSP decides this for all CPUs. See init.
+    static inline bool x2apic;
+
     static inline uint32 read(Register reg)
     {
+        if (x2apic) {
+            return static_cast<uint32>(Msr::read(static_cast<Msr::Register>(X2APIC_MSR_BASE + reg)));
+        }
+
         return *reinterpret_cast<uint32 volatile*>(CPU_LOCAL_APIC + (reg << 4));
     }
 
     static inline void write(Register reg, uint32 val)
     {
+        if (x2apic) {
+            Msr::write(static_cast<Msr::Register>(X2APIC_MSR_BASE + reg), val);
+            return;
+        }
+
         *reinterpret_cast<uint32 volatile*>(CPU_LOCAL_APIC + (reg << 4)) = val;
     }
 
+    // In x2APIC mode, the LAPIC derives its logical ID from the APIC ID: Bits 31 to 16 are the cluster and
+    // bits 15 to 0 select one of 16 CPUs in the cluster. See Intel SDM Vol. 3 Chap. 10.12.10.2.
+    static constexpr uint32 x2apic_cluster(uint32 apic_id) { return apic_id >> 4; }
+    static constexpr uint32 x2apic_logical_id(uint32 apic_id)
+    {
+        return x2apic_cluster(apic_id) << 16 | 1U << (apic_id & 0xf);
+    }
+
     static inline void wait_for_idle()
     {
         while (EXPECT_FALSE(read(LAPIC_ICR_LO) & 1U << 12)) {
@@ -116,24 +148,62 @@ public:
     // Prepares a CPU to be parked and parks it.
     [[noreturn]] static void park_handler();
 
-    static inline unsigned id() { return read(LAPIC_IDR) >> 24 & 0xff; }
+    // In x2APIC mode, the ID register holds the full 32-bit APIC ID.
+    static inline unsigned id() { return x2apic ? read(LAPIC_IDR) : read(LAPIC_IDR) >> 24 & 0xff; }
 
     // This is a special version of id() that already works when the LAPIC
     // is not mapped yet.
     static inline unsigned early_id()
     {
-        uint32 ebx, dummy;
+        uint32 eax, ebx, ecx, edx;
+
+        cpuid(0, eax, ebx, ecx, edx);
+
+        // The topology leaf reports the full x2APIC ID, which also works for IDs above 255. It has the same
+        // value as the 8-bit APIC ID on smaller systems.
+        if (eax >= 0xb) {
+            cpuid(0xb, 0, eax, ebx, ecx, edx);
 
-        cpuid(1, dummy, ebx, dummy, dummy);
+            if (ebx) {
+                return edx;
+            }
+        }
+
+        cpuid(1, eax, ebx, ecx, edx);
 
         return ebx >> 24; // APIC ID is encoded in bits 31 to 24.
     }
 
+    // Whether this is the bootstrap processor. Unlike Cpu::bsp, this already works before Lapic::init.
+    static bool early_bsp() { return Msr::read(Msr::IA32_APIC_BASE) & APIC_BASE_BSP; }
+
     static inline unsigned version() { return read(LAPIC_LVR) & 0xff; }
 
     static inline unsigned lvt_max() { return read(LAPIC_LVR) >> 16 & 0xff; }
 
-    static void init();
+    // Deliver performance counter overflows as NMI or mask them. The LAPIC masks the entry again each time
+    // it delivers one. See Pmu.
+    static inline void set_pmi_delivery(bool enable) 
+    {
+        write(LAPIC_LVT_PERFM, enable ? uint32{DLV_NMI} : uint32{MASKED});
+    }
+
+    // Returns true if an interrupt waits in the IRR, because the CPU runs with interrupts disabled. Vectors
+    // below 32 are never requested.
+    static inline bool interrupt_pending()
+    {
+        for (unsigned i = 1; i < 8; i++) {
+            if (read(static_cast<Register>(LAPIC_IRR + i))) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    // Enable the LAPIC. On the BSP, this also starts the APs. The TSC frequency is only measured at boot,
+    // because it doesn't change across sleep states.
+    static void init(bool resume);
 
     static void setup();
 
@@ -163,6 +233,12 @@ public:
     // not send an NMI and return false. Otherwise returns true.
     static bool send_nmi(unsigned cpu);
 
+    // Send an NMI to each CPU in the set except those with the might_lose_nmis flag set.
+    //
+    // In x2APIC mode, one ICR write reaches all CPUs of a logical cluster, i.e. up to 16 CPUs. In xAPIC mode,
+    // the destination register is only saved and restored once for the whole set.
+    static void send_nmi(Cpuset const& cpus);
+
     // Stop all CPUs except the current one.
     //
     // Parked CPUs execute the passed function and all but the calling CPU
@@ -22,6 +22,7 @@
 
 #include "compiler.hpp"
 #include "cpu.hpp"
+#include "lock_stat.hpp"
 
 template <typename T> class Lock_guard
 {
@@ -29,12 +30,19 @@ private:
     T& _lock;
 
 public:
-    inline Lock_guard(T& l) : _lock(l)
+    // The call site is only used for lock statistics. See Lock_stat.
+    inline Lock_guard(T& l, [[maybe_unused]] char const* file = __builtin_FILE(),
+                      [[maybe_unused]] unsigned line = __builtin_LINE())
+        : _lock(l)
     {
         // Attempting to grab a lock while preemptible. This is a bug.
         assert(!Cpu::preemptible());
 
-        _lock.lock();
+        if constexpr (Lock_stat::enabled()) {
+            Lock_stat::lock(_lock, file, line);
+        } else {
+            _lock.lock();
+        }
     }
 
     inline ~Lock_guard() { _lock.unlock(); }
@@ -0,0 +1,84 @@
+/*
+ * Lock Statistics
+ *
+ * This file is part of the Hedron hypervisor.
+ *
+ * Hedron is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Hedron is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License version 2 for more details.
+ */
+
+#pragma once
+
+#include "atomic.hpp"
+#include "compiler.hpp"
+#include "memory.hpp"
+#include "types.hpp"
+#include "x86.hpp"
+
+// The statistics of one call site that takes a lock. The layout is part of the ABI.
+struct Lock_stat_entry {
+    // The number of times the lock was taken at this call site.
+    uint64 acquisitions;
+
+    // The number of these acquisitions that found the lock already taken.
+    uint64 contended;
+
+    // The TSC ticks spent waiting for the lock in contended acquisitions.
+    uint64 spin_tsc;
+
+    // The source line of the call site. Zero marks an entry that is not (yet) in use. The line is written
+    // after the file name.
+    uint32 line;
+
+    // The NUL-terminated file name of the call site. Long names are truncated.
+    char file[36];
+};
+
+static_assert(sizeof(Lock_stat_entry) == 64, "Lock statistics entries must not change their size");
+
+// Contention statistics for every lock that is taken via Lock_guard, keyed by call site.
+//
+// The statistics fill exactly one page that user space can map read-only via a lock statistics KP (see
+// Ec::sys_create_kp). Acquisitions are only recorded after the first such KP was created. Hedron is built
+// without lock statistics by default. ENABLE_LOCK_STAT=ON enables them at the price of an atomic update of
+// a shared cache line for each lock acquisition.
+class Lock_stat
+{
+    // Returns the entry of the given call site or nullptr if the table is full.
+    static Lock_stat_entry* lookup(Lock_stat_entry* table, char const* file, unsigned line);
+
+    static void record(char const* file, unsigned line, bool contended, uint64 spin_tsc);
+
+public:
+    static constexpr unsigned ENTRIES{PAGE_SIZE / sizeof(Lock_stat_entry)};
+
+    static constexpr bool enabled()
+    {
+#ifdef LOCK_STAT
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    // Returns the statistics table. The table is allocated on first use. Returns nullptr if we ran out of
+    // memory.
+    static Lock_stat_entry* get_table();
+
+    // Take the lock and account the acquisition to the given call site.
+    template <typename T> static void lock(T& l, char const* file, unsigned line)
+    {
+        bool const contended{l.is_locked()};
+        uint64 const start{contended ? rdtsc() : 0};
+
+        l.lock();
+
+        record(file, line, contended, contended ? rdtsc() - start : 0);
+    }
+};
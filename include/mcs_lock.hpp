@@ -0,0 +1,141 @@
+/*
+ * Queued Spinlock
+ *
+ * This file is part of the Hedron hypervisor.
+ *
+ * Hedron is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Hedron is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License version 2 for more details.
+ */
+
+#pragma once
+
+#include "assert.hpp"
+#include "atomic.hpp"
+#include "compiler.hpp"
+#include "types.hpp"
+#include "x86.hpp"
+
+// A waiter in the queue of a Generic_mcs_lock.
+struct alignas(64) Mcs_node {
+    // The waiter that queued up behind this one.
+    Mcs_node* next;
+
+    // True until the previous waiter makes this one the head of the queue.
+    bool waiting;
+};
+
+// A spinlock that queues contending CPUs (an MCS lock).
+//
+// Each waiter spins on a flag in its own node instead of a shared ticket counter, so a lock handover only
+// touches the cache lines of the old and the new lock holder. The lock is a single word that holds the tail
+// of the queue and a locked bit. Uncontended locking is a single compare-and-swap and doesn't need a node.
+//
+// NODES provides the nodes for contended locking:
+//
+// - Mcs_node* NODES::get() returns an unused node of the current CPU,
+// - void NODES::put(Mcs_node*) returns it.
+//
+// A CPU may hold or wait for several locks at once, but has to release them in reverse order. Lock_guard
+// takes care of that.
+template <typename NODES> class Generic_mcs_lock
+{
+private:
+    static constexpr mword LOCKED{1};
+
+    static_assert(alignof(Mcs_node) > LOCKED, "The locked bit must not overlap with node pointers");
+
+    // The locked bit and the waiter at the tail of the queue.
+    mword val{0};
+
+    static Mcs_node* tail(mword v) { return reinterpret_cast<Mcs_node*>(v & ~LOCKED); }
+
+    NOINLINE void lock_contended()
+    {
+        Mcs_node* const node{NODES::get()};
+
+        node->next = nullptr;
+        node->waiting = true;
+
+        // Make us the tail of the queue, but keep the locked bit.
+        mword old{Atomic::load<mword, Atomic::RELAXED>(val)};
+
+        while (not Atomic::cmp_swap(val, old, reinterpret_cast<mword>(node) | (old & LOCKED))) {
+            old = Atomic::load<mword, Atomic::RELAXED>(val);
+        }
+
+        if (Mcs_node* const prev{tail(old)}; prev) {
+            Atomic::store<Mcs_node*, Atomic::RELEASE>(prev->next, node);
+
+            while (Atomic::load<bool, Atomic::ACQUIRE>(node->waiting)) {
+                relax();
+            }
+        }
+
+        // We are the head of the queue. Only the lock holder is ahead of us.
+        mword cur;
+
+        while ((cur = Atomic::load<mword, Atomic::ACQUIRE>(val)) & LOCKED) {
+            relax();
+        }
+
+        // If nobody queued up behind us, the queue becomes empty.
+        if (not(tail(cur) == node and Atomic::cmp_swap(val, cur, LOCKED))) {
+            Atomic::set_mask(val, LOCKED);
+
+            // Our successor has already swapped itself in as tail, but may not have linked itself to us yet.
+            Mcs_node* next;
+
+            while (not(next = Atomic::load<Mcs_node*, Atomic::ACQUIRE>(node->next))) {
+                relax();
+            }
+
+            Atomic::store<bool, Atomic::RELEASE>(next->waiting, false);
+        }
+
+        NODES::put(node);
+    }
+
+public:
+    void lock()
+    {
+        bool const acquired{Atomic::cmp_swap<mword, Atomic::ACQUIRE>(val, 0, LOCKED)};
+
+        if (EXPECT_FALSE(not acquired)) {
+            lock_contended();
+        }
+    }
+
+    // Take the lock only if nobody holds it. Returns true, if the lock was acquired. This never waits, so it
+    // can be used where the current CPU may already hold the lock.
+    bool try_lock() { return Atomic::cmp_swap<mword, Atomic::ACQUIRE>(val, 0, LOCKED); }
+
+    void unlock()
+    {
+        assert_slow(is_locked());
+
+        Atomic::clr_mask<mword, Atomic::RELEASE>(val, LOCKED);
+    }
+
+    // Check whether the lock is currently locked.
+    //
+    // This method is _only_ useful for positive assertions, i.e. to check whether a spinlock is currently
+    // held.
+    bool is_locked() const { return Atomic::load(val) & LOCKED; }
+};
+
+// The nodes of the current CPU for its queued spinlocks. See Per_cpu::mcs_nodes.
+struct Cpulocal_mcs_nodes {
+    // The number of queued spinlocks that a CPU can wait for at the same time.
+    static constexpr unsigned MAX_NESTING{4};
+
+    static Mcs_node* get();
+    static void put(Mcs_node* node);
+};
+
+using Mcs_lock = Generic_mcs_lock<Cpulocal_mcs_nodes>;
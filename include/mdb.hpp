@@ -20,21 +20,40 @@
 
 #pragma once
 
-#include "avl.hpp"
+#include "atomic.hpp"
+#include "lock_guard.hpp"
 #include "math.hpp"
 #include "rcu_list.hpp"
 #include "slab.hpp"
+#include "spinlock.hpp"
 
 class Space;
 
-class Mdb : public Avl, public Rcu_elem
+class Mdb : public Rcu_elem
 {
 private:
     static Slab_cache cache;
-    static Spinlock lock;
+
+    // The locks that protect the derivation trees. Each tree uses the lock that belongs to the address of its
+    // root node, so operations on unrelated trees rarely contend.
+    static constexpr unsigned LOCK_STRIPES{64};
+    static Mcs_lock locks[LOCK_STRIPES];
+
+    static uint8 lock_stripe_of(Mdb const* root)
+    {
+        return static_cast<uint8>(reinterpret_cast<mword>(root) / sizeof(Mdb) % LOCK_STRIPES);
+    }
+
+    Mcs_lock& tree_lock() const { return locks[lock_stripe]; }
+
+    // Returns the lock of the derivation tree of this node, after counting whether another CPU holds it.
+    Mcs_lock& contended_tree_lock() const;
 
     bool alive() const { return prev->next == this && next->prev == this; }
 
+    // See remove_node. The caller must hold the tree lock.
+    bool remove_node_locked();
+
     static void free(Rcu_elem* e)
     {
         Mdb* m = static_cast<Mdb*>(e);
@@ -42,19 +61,25 @@ private:
     }
 
 public:
-    Spinlock node_lock;
-    uint16 dpth;
+    // Millions of delegations each need a node, so the small fields are packed behind the pointers.
     Mdb* prev;
     Mdb* next;
     Mdb* prnt;
     Space* const space;
     mword const node_phys;
     mword const node_base;
-    mword const node_order;
-    mword node_attr;
-    mword const node_type;
-    mword const node_sub;
+    Spinlock node_lock;
+    uint16 dpth;
+    uint8 const node_order;
+    uint8 node_attr;
+    uint8 const node_type;
+    uint8 const node_sub;
+
+private:
+    // The lock of the derivation tree of this node. See tree_lock.
+    uint8 lock_stripe;
 
+public:
     enum Mdb_mem_attr
     {
         MEM_R = 1U << 0,
@@ -62,8 +87,6 @@ public:
         MEM_X = 1U << 2,
     };
 
-    inline bool larger(Mdb* x) const { return node_base > x->node_base; }
-
     inline bool equal(Mdb* x) const
     {
         return (node_base ^ x->node_base) >> max(node_order, x->node_order) == 0;
@@ -71,39 +94,55 @@ public:
 
     NOINLINE
     explicit Mdb(Space* s, mword p, mword b, mword a, void (*f)(Rcu_elem*), void (*pf)(Rcu_elem*) = nullptr)
-        : Rcu_elem(f, pf), dpth(0), prev(this), next(this), prnt(nullptr), space(s), node_phys(p),
-          node_base(b), node_order(0), node_attr(a), node_type(0), node_sub(0)
+        : Rcu_elem(f, pf), prev(this), next(this), prnt(nullptr), space(s), node_phys(p), node_base(b),
+          dpth(0), node_order(0), node_attr(static_cast<uint8>(a)), node_type(0), node_sub(0),
+          lock_stripe(lock_stripe_of(this))
     {
     }
 
     NOINLINE
     explicit Mdb(Space* s, mword p, mword b, mword o = 0, mword a = 0, mword t = 0, mword sub = 0)
-        : Rcu_elem(free), dpth(0), prev(this), next(this), prnt(nullptr), space(s), node_phys(p),
-          node_base(b), node_order(o), node_attr(a), node_type(t), node_sub(sub)
+        : Rcu_elem(free), prev(this), next(this), prnt(nullptr), space(s), node_phys(p), node_base(b),
+          dpth(0), node_order(static_cast<uint8>(o)), node_attr(static_cast<uint8>(a)),
+          node_type(static_cast<uint8>(t)), node_sub(static_cast<uint8>(sub)),
+          lock_stripe(lock_stripe_of(this))
     {
     }
 
-    static Mdb* lookup(Avl* tree, mword base, bool next)
+    bool insert_node(Mdb*, mword);
+    void demote_node(mword);
+    bool remove_node();
+
+    // The number of nodes that remove_nodes removes with one acquisition of the tree lock.
+    static constexpr unsigned REMOVE_BATCH{16};
+
+    // Try to remove the given node and its predecessors up to and including the first node with a depth of
+    // at most d. This is what calling remove_node for each of these nodes does, except that the tree lock is
+    // only taken once per REMOVE_BATCH nodes. fn is called with the tree lock held for each removed node.
+    //
+    // All these nodes must belong to the same derivation tree. Returns the last node that was visited.
+    template <typename FN> static Mdb* remove_nodes(Mdb* node, unsigned d, FN fn)
     {
-        Mdb* n = nullptr;
-        bool d;
+        Mcs_lock& tree{node->tree_lock()};
 
-        for (Mdb* m = static_cast<Mdb*>(tree); m; m = static_cast<Mdb*>(m->lnk[d])) {
+        for (;;) {
+            Lock_guard<Mcs_lock> guard(node->contended_tree_lock());
+            assert(&node->tree_lock() == &tree);
 
-            if ((m->node_base ^ base) >> m->node_order == 0)
-                return m;
+            for (unsigned i = 0; i < REMOVE_BATCH; i++) {
+                if (node->remove_node_locked()) {
+                    fn(node);
+                }
 
-            if ((d = base > m->node_base) == 0 && next)
-                n = m;
-        }
+                if (node->dpth <= d) {
+                    return node;
+                }
 
-        return n;
+                node = Atomic::load(node->prev);
+            }
+        }
     }
 
-    bool insert_node(Mdb*, mword);
-    void demote_node(mword);
-    bool remove_node();
-
     static inline void* operator new(size_t) { return cache.alloc(); }
 
     static inline void operator delete(void* ptr) { cache.free(ptr); }
@@ -23,25 +23,32 @@
 
 #pragma once
 
+#include "config.hpp"
+
 // Current virtual memory layout in the kernel:
 //
 // 0xffff_ffff_ffff_ffff END_SPACE_LIM - 1
 // 0xffff_ffff_e000_0000 SPC_LOCAL_OBJ
-// 0xffff_ffff_df00_0000 SPC_LOCAL_REMAP
 
 // 0xffff_ffff_c000_2000 SPC_LOCAL_IOP_E
 // 0xffff_ffff_c000_0000 SPC_LOCAL / SPC_LOCAL_IOP
-// 0xffff_ffff_bfff_c000 TSS_AREA
+// 0xffff_ffff_bfff_c000 TSS_AREA (with 128 CPUs, see TSS_AREA_PAGES)
 // 0xffff_ffff_bfff_a000 CPU_LOCAL_APIC
 // 0xffff_ffff_bfe0_0000 CPU_LOCAL
 // 0xffff_ffff_bfdf_f000 HV_GLOBAL_FBUF
 
 // 0xffff_ffff_8800_0000 LINK_ADDR
 
+// 0xffff_ffff_8000_0000 SPC_LOCAL_REMAP_E
+// 0xffff_ffff_6000_0000 SPC_LOCAL_REMAP (with 128 CPUs, see REMAP_SLOT_SIZE)
+
 #define PAGE_BITS 12
 #define PAGE_SIZE (1 << PAGE_BITS)
 #define PAGE_MASK (PAGE_SIZE - 1)
 
+// The cache line size of all CPUs that we run on. Hot fields of kernel objects are grouped by it.
+#define CACHE_LINE_SIZE 64
+
 // The address at which the hypervisor is linked at.
 #define LOAD_ADDR 0x0000000006600000
 
@@ -67,20 +74,32 @@ static_assert(LOAD_ADDR % LOAD_ADDR_ALIGN == 0, "Link-time alignment is broken")
 // Ec::ret_user_exit.
 #define USER_ADDR 0x00007ffffffff000
 
+// The size of the HIP, which Hedron maps right below USER_ADDR into the roottask. Besides the header and the
+// memory descriptors, it needs 24 bytes for the descriptor of each possible CPU. See Hip.
+#define HIP_SIZE ((NUM_CPU * 24 / PAGE_SIZE + 2) * PAGE_SIZE)
+
 #define LINK_ADDR 0xffffffff88000000
 #define CPU_LOCAL 0xffffffffbfe00000
 #define SPC_LOCAL 0xffffffffc0000000
 
 #define HV_GLOBAL_FBUF (CPU_LOCAL - PAGE_SIZE * 1)
 
-#define CPU_LOCAL_APIC (SPC_LOCAL - PAGE_SIZE * 6)
+#define CPU_LOCAL_APIC (TSS_AREA - PAGE_SIZE * 2)
 
-#define TSS_AREA (SPC_LOCAL - PAGE_SIZE * 4)
+// The TSSs of all CPUs. A TSS takes 104 bytes, so we reserve 128 bytes for each CPU.
+#define TSS_AREA_PAGES ((NUM_CPU * 128 + PAGE_SIZE - 1) / PAGE_SIZE)
+#define TSS_AREA (SPC_LOCAL - PAGE_SIZE * TSS_AREA_PAGES)
 #define TSS_AREA_E (SPC_LOCAL)
 
 #define SPC_LOCAL_IOP (SPC_LOCAL)
 #define SPC_LOCAL_IOP_E (SPC_LOCAL_IOP + PAGE_SIZE * 2)
-#define SPC_LOCAL_REMAP (SPC_LOCAL_OBJ - 0x1000000)
+
+// Each CPU has its own window for Hpt::remap in every address space. The windows lie right below the 1 GiB of
+// kernel mappings that all address spaces share (see Hpt::share_kernel).
+#define REMAP_SLOT_SIZE 0x400000
+#define SPC_LOCAL_REMAP_E 0xffffffff80000000
+#define SPC_LOCAL_REMAP (SPC_LOCAL_REMAP_E - NUM_CPU * REMAP_SLOT_SIZE)
+
 #define SPC_LOCAL_OBJ (END_SPACE_LIM - 0x20000000)
 
 #define END_SPACE_LIM (~0UL + 1)
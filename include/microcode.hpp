@@ -0,0 +1,49 @@
+/*
+ * Microcode Updates
+ *
+ * This file is part of the Hedron hypervisor.
+ *
+ * Hedron is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Hedron is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License version 2 for more details.
+ */
+
+#pragma once
+
+#include "types.hpp"
+
+// Loads microcode updates on the current CPU or on all CPUs at once.
+//
+// A machine-wide update gathers all other CPUs in their NMI handler, like stop_machine in Linux. Once every
+// CPU has arrived, the first online thread of each core loads the update while its siblings wait, because a
+// core only needs to load an update once (Intel SDM Vol. 3 "Update in a System Supporting Intel
+// Hyper-Threading Technology"). All cores load the update at the same time, so they run with mixed
+// revisions only for the duration of a single load. The CPUs don't touch anything but the state of the
+// update while they wait, so they cannot deadlock on locks that the other CPUs hold.
+class Microcode
+{
+public:
+    // Apply the update whose payload starts at the given kernel address on the current CPU.
+    static void load(mword payload);
+
+    // Apply the update on all online CPUs at once. The payload must be accessible from all CPUs. Returns
+    // false without loading anything if another update is in progress or if not all CPUs could be gathered.
+    static bool load_all(mword payload);
+
+    // The revision that the given CPU reported after the last machine-wide update.
+    static uint32 loaded_revision(unsigned cpu);
+
+    // Returns the microcode revision of the current CPU.
+    static uint32 revision();
+
+    // Take part in a machine-wide update. Called for every NMI. Returns true if the NMI was sent for an
+    // update.
+    //
+    // This runs in NMI context and must not take locks.
+    static bool handle_nmi();
+};
@@ -43,6 +43,7 @@ public:
         IA32_BIOS_UPDT_TRIG = 0x79,
         IA32_BIOS_SIGN_ID = 0x8b,
         IA32_SMM_MONITOR_CTL = 0x9b,
+        IA32_PMC0 = 0xc1,
         IA32_APERF = 0xe7,
         IA32_MPERF = 0xe8,
         IA32_MTRR_CAP = 0xfe,
@@ -54,9 +55,12 @@ public:
         IA32_MCG_CAP = 0x179,
         IA32_MCG_STATUS = 0x17a,
         IA32_MCG_CTL = 0x17b,
+        IA32_PERFEVTSEL0 = 0x186,
         IA32_THERM_INTERRUPT = 0x19b,
         IA32_THERM_STATUS = 0x19c,
         IA32_MISC_ENABLE = 0x1a0,
+        IA32_XFD = 0x1c4,
+        IA32_XFD_ERR = 0x1c5,
         IA32_DEBUG_CTL = 0x1d9,
         IA32_MTRR_PHYS_BASE = 0x200,
         IA32_MTRR_PHYS_MASK = 0x201,
@@ -66,6 +70,12 @@ public:
         IA32_MTRR_FIX4K_F8000 = 0x26f,
         IA32_CR_PAT = 0x277,
         IA32_MTRR_DEF_TYPE = 0x2ff,
+        IA32_FIXED_CTR0 = 0x309,
+        IA32_FIXED_CTR_CTRL = 0x38d,
+        IA32_PERF_GLOBAL_STATUS = 0x38e,
+        IA32_PERF_GLOBAL_CTRL = 0x38f,
+        IA32_PERF_GLOBAL_OVF_CTRL = 0x390,
+        IA32_PERF_GLOBAL_STATUS_SET = 0x391,
 
         IA32_MCI_CTL = 0x400,
         IA32_MCI_STATUS = 0x401,
@@ -92,8 +102,21 @@ public:
 
         IA32_DS_AREA = 0x600,
         IA32_TSC_DEADLINE = 0x6e0,
+        IA32_PM_ENABLE = 0x770,
+        IA32_HWP_REQUEST = 0x774,
         IA32_EXT_XAPIC = 0x800,
+        IA32_X2APIC_TPR = 0x808,
+        IA32_X2APIC_EOI = 0x80b,
+        IA32_X2APIC_SELF_IPI = 0x83f,
         IA32_EXT_XAPIC_END = 0x8ff,
+        IA32_L3_QOS_CFG = 0xc81,
+        IA32_QM_EVTSEL = 0xc8d,
+        IA32_QM_CTR = 0xc8e,
+        IA32_PQR_ASSOC = 0xc8f,
+        IA32_L3_QOS_MASK0 = 0xc90,
+        IA32_L2_QOS_MASK0 = 0xd10,
+        IA32_MBA_THRTL0 = 0xd50,
+        IA32_XSS = 0xda0,
         IA32_EFER = 0xc0000080,
         IA32_STAR = 0xc0000081,
         IA32_LSTAR = 0xc0000082,
@@ -0,0 +1,151 @@
+/*
+ * User Space MSR Access Filter
+ *
+ * This file is part of the Hedron hypervisor.
+ *
+ * Hedron is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Hedron is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License version 2 for more details.
+ */
+
+#pragma once
+
+#include "msr.hpp"
+#include "types.hpp"
+
+// A set of MSRs as a bitmap of the low (0 - 0x1FFF) and high (0xC0000000 - 0xC0001FFF) MSR ranges, the same
+// ranges that the VMX MSR bitmap covers. MSRs outside of these ranges are never in the set.
+class Msr_set
+{
+    static constexpr uint32 RANGE_MSRS{0x2000};
+    static constexpr uint32 HIGH_BASE{0xc0000000};
+    static constexpr uint32 WORD_BITS{64};
+
+    uint64 low[RANGE_MSRS / WORD_BITS]{};
+    uint64 high[RANGE_MSRS / WORD_BITS]{};
+
+    constexpr uint64* word(uint32 msr)
+    {
+        uint32 const idx{(msr >= HIGH_BASE ? msr - HIGH_BASE : msr) / WORD_BITS};
+
+        return msr >= HIGH_BASE ? &high[idx] : &low[idx];
+    }
+
+public:
+    static constexpr bool in_range(uint32 msr)
+    {
+        return msr < RANGE_MSRS or (msr >= HIGH_BASE and msr - HIGH_BASE < RANGE_MSRS);
+    }
+
+    // Adds the MSRs from first to last, including both. Both must be in the same range.
+    constexpr Msr_set& add(uint32 first, uint32 last)
+    {
+        for (uint32 msr{first}; msr <= last; msr++) {
+            *word(msr) |= 1ULL << (msr % WORD_BITS);
+        }
+
+        return *this;
+    }
+
+    constexpr Msr_set& add(uint32 msr) { return add(msr, msr); }
+
+    constexpr Msr_set& add(Msr_set const& other)
+    {
+        for (uint32 i{0}; i < RANGE_MSRS / WORD_BITS; i++) {
+            low[i] |= other.low[i];
+            high[i] |= other.high[i];
+        }
+
+        return *this;
+    }
+
+    constexpr bool contains(uint32 msr) const
+    {
+        if (not in_range(msr)) {
+            return false;
+        }
+
+        uint32 const idx{(msr >= HIGH_BASE ? msr - HIGH_BASE : msr) / WORD_BITS};
+
+        return ((msr >= HIGH_BASE ? high[idx] : low[idx]) >> (msr % WORD_BITS)) & 1;
+    }
+};
+
+// The MSRs that passthrough PDs must not access via pd_ctrl_msr_access.
+//
+// MSR access is mostly used for platform thermal and power management, but also for platform discovery and
+// other purposes. Due to the vast amount of MSRs it's impractical to devise safe and generic kernel
+// abstractions and instead we rely on trusted userspace components (PDs with passthrough permissions) to do
+// the right thing and give them direct access to MSRs.
+//
+// That being said, we do not blindly allow access to all MSRs, but make exceptions for MSRs where we know
+// that:
+//
+// - the hypervisor wholly owns them and needs them for correct functionality,
+//
+// - they leak private information about the hypervisor, such as its address space layout,
+//
+// - have a correct way to get their information from userspace already.
+//
+// The lists below are not complete and will never be. They are expected to change over time (as is our
+// rationale which MSRs to exclude).
+//
+// Most importantly this filtering is not a security boundary and no untrusted component should have access
+// to this API.
+//
+// The lists are turned into bitmaps at compile time, so each check is a single bit test.
+class Msr_filter
+{
+    static constexpr Msr_set make_read_denied()
+    {
+        // Allowing read access to an MSR might currently imply granting write access as well. Check
+        // make_write_denied when modifying this list.
+        //
+        // Userspace discovers whether SGX is available via the relevant feature bits in the
+        // IA32_FEATURE_CONTROL MSR, so it stays readable, as do the SGX Launch Control MSRs.
+        return Msr_set{}
+            .add(Msr::IA32_DS_AREA)
+            .add(Msr::IA32_EFER)
+            .add(Msr::IA32_GS_BASE)
+            .add(Msr::IA32_KERNEL_GS_BASE)
+            .add(Msr::IA32_SYSENTER_CS)
+            .add(Msr::IA32_SYSENTER_EIP)
+            .add(Msr::IA32_SYSENTER_ESP)
+            .add(Msr::IA32_TSC_AUX)
+            .add(Msr::IA32_EXT_XAPIC, Msr::IA32_EXT_XAPIC_END)
+            .add(Msr::IA32_VMX_BASIC, Msr::IA32_VMX_VMFUNC);
+    }
+
+    static constexpr Msr_set make_write_denied()
+    {
+        // If we don't know anything better and we can't read a MSR, we shouldn't be able to write it either.
+        // The SGX Launch Control MSRs remain writable to allow their runtime modification.
+        return Msr_set{}
+            .add(make_read_denied())
+
+            // Feature control is locked in try_enable_vmx, so writes are not permitted.
+            .add(Msr::IA32_FEATURE_CONTROL)
+
+            // The MTRR MSRs are mostly in a convenient block in MSR space. We allow reading them to pass on
+            // the configuration to guests (if so desired), but writing them would mess up our paging.
+            .add(Msr::IA32_MTRR_PHYS_BASE, Msr::IA32_MTRR_FIX4K_F8000)
+            .add(Msr::IA32_CR_PAT)
+            .add(Msr::IA32_MTRR_DEF_TYPE);
+    }
+
+    // These can only be defined once the class is complete.
+    static Msr_set const read_denied;
+    static Msr_set const write_denied;
+
+public:
+    static constexpr bool may_read(Msr::Register msr) { return not read_denied.contains(msr); }
+    static constexpr bool may_write(Msr::Register msr) { return not write_denied.contains(msr); }
+};
+
+inline constexpr Msr_set Msr_filter::read_denied{make_read_denied()};
+inline constexpr Msr_set Msr_filter::write_denied{make_write_denied()};
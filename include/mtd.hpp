@@ -57,14 +57,20 @@ public:
         GPR_R8_R15 = 1UL << 22,
         SYSCALL_SWAPGS = 1UL << 23,
         TSC_TIMEOUT = 1UL << 24,
+        TSC_SCALE = 1UL << 25,
 
         VINTR = 1UL << 26,
         EOI = 1UL << 27,
         TPR = 1UL << 28,
+        EPT_VIEW = 1UL << 29,
 
         TLB = 1UL << 30,
         FPU = 1UL << 31,
     };
 
+    // The state that vCPU exits transfer without an MTD profile: All of it, except for the fields that only
+    // the VMM modifies and the FPU, which vCPUs keep in their KP. See Vcpu::return_to_vmm.
+    static constexpr mword VMX_EXIT_STATE{~0UL & ~(EOI | TPR | TSC_SCALE | TLB | FPU)};
+
     inline explicit Mtd(mword v) : val(v) {}
 };
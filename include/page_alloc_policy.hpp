@@ -31,11 +31,13 @@ public:
     static pointer phys_to_pointer(entry e) { return static_cast<pointer>(Buddy::phys_to_ptr(e)); }
     static entry pointer_to_phys(pointer p) { return Buddy::ptr_to_phys(p); }
 
+    // Page tables are allocated and freed in bursts when mappings change, so they have their own cache. See
+    // Buddy::try_alloc_page_table.
     static Alloc_result<pointer> alloc_zeroed_page()
     {
-        return Buddy::allocator.try_alloc(0, Buddy::FILL_0).map([](void* p) -> pointer {
+        return Buddy::allocator.try_alloc_page_table().map([](void* p) -> pointer {
             return static_cast<pointer>(p);
         });
     }
-    static void free_page(pointer ptr) { Buddy::allocator.free(reinterpret_cast<mword>(ptr)); }
+    static void free_page(pointer ptr) { Buddy::allocator.free_page_table(reinterpret_cast<mword>(ptr)); }
 };
@@ -0,0 +1,56 @@
+/*
+ * Parallel Work Items
+ *
+ * This file is part of the Hedron hypervisor.
+ *
+ * Hedron is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Hedron is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License version 2 for more details.
+ */
+
+#pragma once
+
+#include "cpulocal.hpp"
+#include "types.hpp"
+
+// A job of Parallel::for_each. It lives on the stack of the CPU that offers it.
+struct Parallel_job {
+    void (*fn)(void* ctx, mword item);
+    void* ctx;
+    mword items;
+
+    // The next item that is not claimed by any CPU.
+    mword next;
+
+    // The number of CPUs that can still access this job.
+    unsigned users;
+};
+
+// Process independent work items on the current CPU with help from idle CPUs.
+//
+// The current CPU offers the work to CPUs that wait in Ec::idle via HZD_WORK. These pick up items in
+// Ec::handle_hazards until none are left. The current CPU processes items as well and only returns when
+// every item is done. CPUs that didn't find the time to help just see their offer withdrawn, so the work
+// never waits for a busy CPU.
+//
+// Work items can run on any CPU and concurrently to each other. They must not block on anything the caller
+// of for_each might hold.
+class Parallel
+{
+    CPULOCAL_REMOTE_ACCESSOR(parallel, job);
+
+    // Claim and process items until none are left.
+    static void work(Parallel_job& job);
+
+public:
+    // Call fn(ctx, i) for each i in [0, items) and return once all calls have finished.
+    static void for_each(mword items, decltype(Parallel_job::fn) fn, void* ctx);
+
+    // Help with the job that another CPU offered to us. Called for HZD_WORK.
+    static void help();
+};
@@ -20,14 +20,21 @@
 
 #pragma once
 
+#include "atomic.hpp"
 #include "cpulocal.hpp"
 #include "crd.hpp"
+#include "deferred_work.hpp"
 #include "delegate_result.hpp"
 #include "nodestruct.hpp"
+#include "rdt.hpp"
+#include "spinlock.hpp"
 #include "space_mem.hpp"
 #include "space_obj.hpp"
 #include "space_pio.hpp"
 
+class Sm;
+class Vcpu;
+
 class Pd : public Typed_kobject<Kobject::Type::PD>,
            public Refcount,
            public Space_mem,
@@ -40,15 +47,103 @@ private:
     WARN_UNUSED_RESULT
     mword clamp(mword, mword&, mword, mword);
 
+    // Revoke memory from this PD. The caller has to invalidate the TLBs as cleanup demands.
+    void revoke_mem(Tlb_cleanup& cleanup, mword base, mword ord, mword attr, bool self);
+
+    // Revoke one capability range and collect the TLB invalidations in cleanup. See rev_crds.
+    void rev_crd(Tlb_cleanup& cleanup, Crd crd, bool self);
+
     WARN_UNUSED_RESULT
     mword clamp(mword&, mword&, mword, mword, mword);
 
     void* apic_access_page{nullptr};
 
+    static inline uint32 id_cnt;
+
+    // A window of guest-physical memory that Vcpu::handle_vmx fills from the host memory of this PD, when the
+    // guest accesses unmapped parts of it. A size of zero disables the window. See set_ept_fill.
+    struct Ept_fill_window {
+        mword guest_base;
+        mword host_base;
+        mword size;
+        mword order;
+        mword attr;
+    };
+
+    Spinlock ept_fill_lock;
+    Ept_fill_window ept_fill{};
+
+    // The vCPUs that run in this PD, indexed by the number that the guest uses for them in paravirtual TLB
+    // flushes. See Vcpu::EXIT_POLICY_PV_TLB_FLUSH. A vCPU removes itself before it is destroyed.
+    static constexpr unsigned MAX_PV_VCPUS{64};
+    Spinlock pv_vcpu_lock;
+    Vcpu* pv_vcpus[MAX_PV_VCPUS]{};
+
+    // Returns true if the host memory at hva is completely mapped and delegatable and the guest-physical
+    // memory at gpa is completely unmapped. Both regions have the size 2^ord bytes.
+    bool ept_fill_possible(mword gpa, mword hva, mword ord);
+
+    // Set once the PD is handed to RCU for destruction. CPUs don't retain references to dying PDs.
+    bool dying{false};
+
+    CPULOCAL_REMOTE_ACCESSOR(pd, retained);
+
+    // Drops a reference that this CPU held for Pd::current or retained.
+    void drop_ref()
+    {
+        if (del_rcu()) {
+            Rcu::call(this);
+        }
+    }
+
+    // Takes the reference that this CPU retained to this PD for Pd::current and retains the reference of
+    // previous instead. Other CPUs only take references out of the retained slot, so we use atomics as well.
+    HOT void switch_retained(Pd* previous)
+    {
+        if (not Atomic::cmp_swap(retained(), this, previous)) {
+            bool ok = add_ref();
+            assert(ok);
+
+            if (Pd* const old{Atomic::exchange(retained(), previous)}; old) {
+                old->drop_ref();
+            }
+        }
+
+        // The previous PD may have started to die after drop_retained_refs looked at this CPU. Whoever takes
+        // it out of the slot drops the reference.
+        if (EXPECT_FALSE(Atomic::load(previous->dying)) and
+            Atomic::cmp_swap(retained(), previous, static_cast<Pd*>(nullptr))) {
+            previous->drop_ref();
+        }
+    }
+
+    CPULOCAL_ACCESSOR(pd, cpu_domain);
+
+    // Separates the security domain of this PD from the one that ran before on this CPU.
+    NOINLINE void switch_domain();
+
+    // Freeing the page tables of a large PD takes milliseconds, so a dead PD frees them in pieces as
+    // deferred work. The semaphore is signalled once all memory of the PD went back to the kernel. See
+    // teardown and Deferred_work.
+    Work_item teardown_work{teardown, this};
+    Sm* teardown_sm{nullptr};
+
+    // The number of page tables that teardown frees at once.
+    static constexpr unsigned TEARDOWN_STEPS{32};
+
+    // Frees a part of the page tables of a dead PD, or the PD itself once only the roots are left.
+    static void teardown(void* ctx);
+
+    // Drops the references that CPUs retained to this PD. RCU calls this once all CPUs have passed through
+    // a quiescent state after the PD started to die, so no CPU retains it afterwards.
+    void drop_retained_refs();
+
     static void pre_free(Rcu_elem* a)
     {
         Pd* pd = static_cast<Pd*>(a);
 
+        Atomic::store(pd->dying, true);
+
         Crd crd(Crd::PIO);
         pd->revoke<Space_pio>(crd.base(), crd.order(), crd.attr(), true);
 
@@ -60,9 +155,12 @@ private:
     {
         Pd* pd = static_cast<Pd*>(a);
 
+        pd->drop_retained_refs();
+
         if (pd->del_ref()) {
             assert(pd != Pd::current());
-            delete pd;
+            pd->hpt.unshare_kernel();
+            Deferred_work::queue(&pd->teardown_work);
         }
     }
 
@@ -79,6 +177,18 @@ public:
     // grants partial MSR access.
     bool const is_passthrough = false;
 
+    // A unique number that identifies this PD in PMU samples. See Pmu.
+    uint32 const id{Atomic::add(id_cnt, 1U)};
+
+    // PDs that trust each other, e.g. a VMM and its device backends, share a security domain. Hedron only
+    // flushes branch predictions and restores IA32_SPEC_CTRL when a CPU switches between PDs of different
+    // security domains. The roottask and all PDs that don't ask for their own domain are in domain 0.
+    uint32 const domain{0};
+
+    // The RDT class of service and monitoring ID of the user code and guests of this PD. See Rdt.
+    uint32 rdt_cos{0};
+    uint32 rdt_rmid{0};
+
     void* get_access_page();
 
     Pd();
@@ -88,47 +198,68 @@ public:
     enum
     {
         PERM_OBJ_CREATION = 1U << 0,
+        PERM_KMEM_LIMIT = 1U << 1,
     };
 
     enum pd_creation_flags
     {
         IS_PRIVILEGED = 1 << 0,
         IS_PASSTHROUGH = 1 << 1,
+        NEW_SECURITY_DOMAIN = 1 << 2,
+
+        // The guest page table has five levels. See Space_mem::guest_addr_limit.
+        LARGE_GUEST_SPACE = 1 << 3,
     };
 
     // Construct a protection domain.
     //
-    // creation_flags is a bit field of pd_creation_flags.
-    Pd(Pd* own, mword sel, mword a, int creation_flags);
+    // creation_flags is a bit field of pd_creation_flags. The PD joins the given security domain, unless it
+    // gets its own with NEW_SECURITY_DOMAIN.
+    Pd(Pd* own, mword sel, mword a, int creation_flags, uint32 parent_domain = 0);
 
     HOT inline void make_current()
     {
-        mword pcid = did;
+        bool flush{false};
 
-        if (EXPECT_FALSE(stale_host_tlb.chk(Cpu::id())))
+        if (EXPECT_FALSE(stale_host_tlb.chk(Cpu::id()))) {
             stale_host_tlb.clr(Cpu::id());
+            flush = true;
+        } else if (EXPECT_TRUE(current() == this)) {
+            return;
+        }
 
-        else {
-
-            if (EXPECT_TRUE(current() == this))
-                return;
+        mword pcid{0};
 
-            pcid |= static_cast<mword>(1ULL << 63);
+        // Loading CR3 only invalidates the TLB entries of the new PCID, unless we set the no-flush bit.
+        if (Cpu::feature(Cpu::FEAT_PCID)) {
+            flush |= assign_pcid();
+            pcid = Space_mem::pcid() | (flush ? 0 : static_cast<mword>(1ULL << 63));
         }
 
-        if (current()->del_rcu())
-            Rcu::call(current());
+        Pd* const previous{current()};
 
         current() = this;
 
-        bool ok = current()->add_ref();
-        assert(ok);
+        // Many CPUs switch between the same few PDs, e.g. a VMM and its guest. Keeping the reference of the
+        // previous PD avoids bouncing the cache lines of their reference counts between CPUs.
+        if (previous != this) {
+            switch_retained(previous);
+        }
+
+        // The idle EC runs in Pd::kern and doesn't belong to any security domain or class of service.
+        if (EXPECT_TRUE(this != &Pd::kern)) {
+            if (EXPECT_FALSE(domain != cpu_domain())) {
+                switch_domain();
+            }
+
+            Rdt::switch_pqr(Atomic::load(rdt_cos), Atomic::load(rdt_rmid));
+        }
 
         // When we schedule the idle EC, we switch to Pd::kern. Pd::kern's
         // host page table is actually all the physical memory that
         // userspace can use, so we cannot use it as a page table here.
         Hpt& target_hpt{EXPECT_FALSE(this == &Pd::kern) ? Hpt::boot_hpt() : hpt};
-        target_hpt.make_current(Cpu::feature(Cpu::FEAT_PCID) ? pcid : 0);
+        target_hpt.make_current(pcid);
     }
 
     // Access the current PD on a remote core.
@@ -159,25 +290,73 @@ public:
 
     template <typename> void revoke(mword, mword, mword, bool);
 
+    // Transfer a single item. The necessary TLB invalidation is only recorded in cleanup. The caller has to
+    // call finish_delegation with the same cleanup object once it has transferred all items.
+    Delegate_result<Xfer> xfer_item(Tlb_cleanup& cleanup, Pd* src_pd, Crd xlt, Crd del, Xfer s_ti);
+
+    // Transfer a single item and perform the TLB shootdown immediately.
     Delegate_result<Xfer> xfer_item(Pd* src_pd, Crd xlt, Crd del, Xfer s_ti);
 
     // Bulk version of xfer_item that is used during IPC.
     //
-    // When this function fails, items will be partially transferred.
+    // All items share a single TLB shootdown. When this function fails, items will be partially transferred.
     Delegate_result_void xfer_items(Pd* src_pd, Crd xlt, Crd del, Xfer* s_ti, Xfer* d_ti,
                                     unsigned long num_typed);
 
     void xlt_crd(Pd*, Crd, Crd&);
+    Delegate_result_void del_crd(Tlb_cleanup& cleanup, Pd* pd, Crd del, Crd& crd, mword sub = 0,
+                                 mword hot = 0);
     Delegate_result_void del_crd(Pd* pd, Crd del, Crd& crd, mword sub = 0, mword hot = 0);
+
+    // Larger fill orders make Vcpu::handle_vmx look at too many mappings per EPT violation.
+    static constexpr mword EPT_FILL_MAX_ORDER{9};
+
+    // Sets the EPT fill window of this PD. The guest-physical memory [guest_base, guest_base + size)
+    // corresponds to the host memory at host_base. Each EPT violation in the window maps the naturally
+    // aligned region of 2^order pages around the fault with the given rights, or smaller regions if that
+    // one does not fit. Returns false for invalid parameters.
+    bool set_ept_fill(mword guest_base, mword host_base, mword size, mword order, mword attr);
+
+    // Resolves an EPT violation on unmapped guest-physical memory at gpa with the EPT fill window. Returns
+    // true if the guest can access gpa now.
+    bool fill_ept(mword gpa);
+
+    // Sets the semaphore that is signalled once the PD is destroyed and all of its memory went back to the
+    // kernel. A null semaphore removes it. Returns false if the semaphore is being destroyed.
+    bool set_teardown_sm(Sm* sm);
+
+    // Replaces the vCPU with the given paravirtual index, if it is old. Returns false otherwise or if the
+    // index is too large.
+    bool replace_pv_vcpu(mword index, Vcpu* old, Vcpu* vcpu);
+
+    // Returns the vCPU with the given paravirtual index with an additional reference, or nullptr if there is
+    // none or it is being destroyed. The caller has to drop the reference.
+    Vcpu* get_pv_vcpu(mword index);
+
+    // Perform the TLB shootdown that is pending in cleanup after delegating into this PD.
+    void finish_delegation(Tlb_cleanup& cleanup);
     void rev_crd(Crd, bool);
 
+    // Revoke the count capability ranges that crd(i) returns. Memory revocations only invalidate the TLBs
+    // once at the end, so revoking many small ranges is not much more expensive than revoking one.
+    template <typename FN> void rev_crds(mword count, bool self, FN crd)
+    {
+        Tlb_cleanup cleanup;
+
+        for (mword i{0}; i < count; i++) {
+            rev_crd(cleanup, crd(i), self);
+        }
+
+        finish_delegation(cleanup);
+    }
+
     // Returns true if the current PCID is valid. This can also mean that PCID is not enabled. Returns false
     // if PCID is enabled and the PCID has an invalid value.
     //
     // This function should be used before returning to user space to avoid #65 in the future.
     static inline bool is_pcid_valid()
     {
-        return !Cpu::feature(Cpu::Feature::FEAT_PCID) or Hpt::current_pcid() == Pd::current()->did;
+        return !Cpu::feature(Cpu::Feature::FEAT_PCID) or Hpt::current_pcid() == Pd::current()->pcid();
     }
 
     static inline void* operator new(size_t) { return cache.alloc(); }
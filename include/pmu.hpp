@@ -0,0 +1,153 @@
+/*
+ * Performance Monitoring Unit Sampling
+ *
+ * This file is part of the Hedron hypervisor.
+ *
+ * Hedron is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Hedron is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License version 2 for more details.
+ */
+
+#pragma once
+
+#include "compiler.hpp"
+#include "cpulocal.hpp"
+#include "memory.hpp"
+#include "types.hpp"
+
+class Kp;
+
+// The counter configuration at the start of a PMU sample ring. User space writes it before it starts
+// sampling. The layout is part of the ABI.
+struct Pmu_config {
+    // IA32_PERFEVTSELx of the general-purpose counters without the enable and interrupt bits. Zero leaves a
+    // counter unused.
+    uint64 evtsel[4];
+
+    // The number of events between two samples of each general-purpose counter.
+    uint64 gp_period[4];
+
+    // IA32_FIXED_CTR_CTRL with only the enable bits (OS and USR) of each fixed counter.
+    uint64 fixed_ctrl;
+
+    // The number of events between two samples of each fixed counter.
+    uint64 fixed_period[3];
+
+    uint64 reserved[4];
+};
+
+// One sample in a PMU sample ring. The layout is part of the ABI. See tools/pmu-fold.
+struct Pmu_sample {
+    uint64 tsc;
+
+    // The instruction pointer that the PMI interrupted. For guests, this is the guest RIP.
+    uint64 rip;
+
+    // The IDs of the EC and PD that ran. For guests, the EC is the one that runs the vCPU.
+    uint32 ec;
+    uint32 pd;
+
+    uint16 cpu;
+
+    // The counter that overflowed: 0-3 are the general-purpose counters, 4-6 the fixed counters.
+    uint8 counter;
+
+    // Where the PMI hit. See Pmu::Mode.
+    uint8 mode;
+
+    // The lower 32 bits of the number of samples that this CPU recorded before, plus one. Zero marks an
+    // unused entry. The sequence number is written last, like in Event_trace_entry.
+    uint32 seq;
+};
+
+static_assert(sizeof(Pmu_config) == 128, "The PMU configuration must not change its size");
+static_assert(sizeof(Pmu_sample) == 32, "PMU samples must not change their size");
+
+struct Pmu_ring {
+    static constexpr unsigned SAMPLES{(PAGE_SIZE - sizeof(Pmu_config)) / sizeof(Pmu_sample)};
+
+    Pmu_config config;
+    Pmu_sample samples[SAMPLES];
+};
+
+// The counter state of a guest that has direct access to the PMU. IA32_PERF_GLOBAL_CTRL is not part of it,
+// because VM entries and exits switch it. See Vcpu::set_pmu.
+struct Pmu_context {
+    uint64 evtsel[4];
+    uint64 pmc[4];
+    uint64 fixed_ctr[3];
+    uint64 fixed_ctrl;
+
+    // The overflow bits of IA32_PERF_GLOBAL_STATUS.
+    uint64 status;
+};
+
+// Samples the instruction pointer of a CPU when its performance counters overflow.
+//
+// The counters of each CPU are configured via machine_ctrl_pmu on that CPU. Overflows raise a PMI that the
+// LAPIC delivers as NMI, so samples also hit code that runs with interrupts disabled. Ec::handle_exc_altstack
+// and Vcpu::handle_exception pass each NMI to handle_nmi, which tells PMIs apart from the NMIs that Hedron
+// sends itself by looking at the overflow status of the counters. Both kinds can arrive at the same time, so
+// the other NMI work is always done.
+//
+// Samples go into a ring in a KP that user space provides and can map. Hedron only needs the architectural
+// PMU version 2 or later. It owns the counters of a CPU while it samples there, so user space must not
+// program them via MSR access at the same time.
+class Pmu
+{
+    CPULOCAL_ACCESSOR(pmu, ring);
+    CPULOCAL_ACCESSOR(pmu, ring_kp);
+    CPULOCAL_ACCESSOR(pmu, cnt);
+    CPULOCAL_ACCESSOR(pmu, enabled);
+    CPULOCAL_ACCESSOR(pmu, reload);
+
+public:
+    static constexpr unsigned GP_COUNTERS{4};
+    static constexpr unsigned FIXED_COUNTERS{3};
+
+    // Shorter periods would flood the CPU with NMIs.
+    static constexpr uint64 MIN_PERIOD{10000};
+
+    // Writes to general-purpose counters sign-extend bit 31, so this is the longest period we can program.
+    static constexpr uint64 MAX_PERIOD{1ULL << 31};
+
+    enum Mode : uint8
+    {
+        KERNEL = 0,
+        USER = 1,
+        GUEST = 2,
+    };
+
+    // Returns true if this CPU has an architectural PMU that we can sample with.
+    static bool available();
+
+    // Start sampling on the current CPU with the configuration in the given KP, which also receives the
+    // samples. This replaces an earlier configuration. Returns false if the configuration is invalid.
+    static bool start(Kp* kp);
+
+    // Stop sampling on the current CPU and release the KP.
+    static void stop();
+
+    // Returns true if Hedron samples on the current CPU.
+    static bool sampling() { return ring(); }
+
+    // Save the counter state of the current CPU and clear the counters, so nothing leaks to the next user.
+    static void save(Pmu_context& ctx);
+
+    // Load the counter state of the current CPU.
+    static void load(Pmu_context const& ctx);
+
+    // Returns true if one of the given counters in IA32_PERF_GLOBAL_CTRL layout has overflowed.
+    static bool overflowed(uint64 counters);
+
+    // Record a sample if the current NMI is a PMI. The instruction pointer is the one that the NMI
+    // interrupted. Returns true if it was a PMI.
+    //
+    // This runs in NMI context and must not take locks.
+    static bool handle_nmi(mword rip, Mode mode);
+};
@@ -29,7 +29,5 @@ private:
 public:
     inline explicit Qpd(mword v) : val(v) {}
 
-    inline unsigned quantum() const { return static_cast<unsigned>(val >> 12); }
-
     inline unsigned prio() const { return static_cast<unsigned>(val & 0xff); }
 };
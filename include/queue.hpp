@@ -44,6 +44,32 @@ public:
         }
     }
 
+    // Inserts t before the first element that t has to precede according to before(t, element). Elements
+    // that compare equal stay in FIFO order.
+    template <typename BEFORE> inline void enqueue_sorted(T* t, BEFORE before)
+    {
+        if (!headptr) {
+            enqueue(t);
+            return;
+        }
+
+        T* pos = headptr;
+
+        while (!before(t, pos)) {
+            if ((pos = pos->next) == headptr) {
+                enqueue(t);
+                return;
+            }
+        }
+
+        t->next = pos;
+        t->prev = pos->prev;
+        t->next->prev = t->prev->next = t;
+
+        if (pos == headptr)
+            headptr = t;
+    }
+
     inline bool dequeue(T* t)
     {
         if (!t || !t->next || !t->prev)
@@ -19,55 +19,40 @@
 #pragma once
 
 #include "cpulocal.hpp"
-#include "rcu_list.hpp"
-
-/// The central Read-Copy-Update implementation.
-///
-/// See docs/implementation.md for a longer description of how RCU works in
-/// Hedron.
-class Rcu
-{
-private:
-    static mword count;
-    static mword state;
+#include "generic_rcu.hpp"
 
+// The CPU-local RCU state of the kernel and the parts of the kernel that RCU depends on. See Generic_rcu.
+struct Cpulocal_rcu {
     CPULOCAL_ACCESSOR(rcu, l_batch);
+
+    // The last batch for which this CPU was counted as quiet. See Generic_rcu::claim.
+    CPULOCAL_REMOTE_ACCESSOR(rcu, q_batch);
     CPULOCAL_ACCESSOR(rcu, c_batch);
+    CPULOCAL_ACCESSOR(rcu, c_tsc);
 
     CPULOCAL_ACCESSOR(rcu, next);
     CPULOCAL_ACCESSOR(rcu, curr);
     CPULOCAL_ACCESSOR(rcu, done);
 
-    enum State
-    {
-        RCU_CMP = 1UL << 0,
-        RCU_PND = 1UL << 1,
-    };
+    static unsigned id();
+    static mword online();
+    template <typename FN> static void for_each_online_cpu(FN fn);
+    static bool isolated_guest(unsigned cpu);
 
-    static inline mword batch() { return state >> 2; }
+    static unsigned& hazard();
 
-    static inline bool complete(mword b)
-    {
-        return static_cast<signed long>((state & ~RCU_PND) - (b << 2)) > 0;
-    }
+    // Make all CPUs handle HZD_IDL. Isolated CPUs that execute a guest are already quiet and don't get an
+    // NMI.
+    static void kick();
 
-    static void start_batch(State);
-    static void invoke_batch();
+    static uint64 tsc();
 
-public:
-    /// Declare the passed object ready for reclamation.
-    ///
-    /// This will immediately call its pre_func callback. Once the
-    /// hypervisor has gone through quiescent states on all CPUs, the free
-    /// callback of the object is called.
-    static inline bool call(Rcu_elem* e)
-    {
-        if (e->pre_func)
-            e->pre_func(e);
+    static void count_call();
+    static void count_invoke(unsigned n, uint64 tsc);
+    static void count_batch(mword b, uint64 wait_tsc);
+};
 
-        return next().enqueue(e);
-    }
+// The state machine is only instantiated in rcu.cpp, which knows the rest of the kernel.
+extern template class Generic_rcu<Cpulocal_rcu>;
 
-    static void quiet();
-    static void update();
-};
+using Rcu = Generic_rcu<Cpulocal_rcu>;
@@ -68,6 +68,24 @@ public:
         l->clear();
     }
 
+    /// Remove the first element. The list must not be empty.
+    inline Rcu_elem* dequeue()
+    {
+        Rcu_elem* const e = head;
+
+        if (tail == &e->next) {
+            clear();
+        } else {
+            head = e->next;
+            *tail = head;
+            count--;
+        }
+
+        e->next = nullptr;
+
+        return e;
+    }
+
     inline bool enqueue(Rcu_elem* e)
     {
         Rcu_elem* const unused = nullptr;
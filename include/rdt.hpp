@@ -0,0 +1,92 @@
+/*
+ * Resource Director Technology (RDT) Allocation
+ *
+ * This file is part of the Hedron hypervisor.
+ *
+ * Hedron is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Hedron is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License version 2 for more details.
+ */
+
+#pragma once
+
+#include "compiler.hpp"
+#include "cpulocal.hpp"
+#include "msr.hpp"
+#include "types.hpp"
+
+// Cache allocation (CAT), its code and data prioritization (CDP) and memory bandwidth allocation (MBA) as
+// well as cache occupancy (CMT) and memory bandwidth monitoring (MBM).
+//
+// Each PD has a class of service (COS) and a resource monitoring ID (RMID). CPUs load both into
+// IA32_PQR_ASSOC when they switch to the PD and before they enter a guest of the PD. The user code and the
+// guests of the PD then only fill the parts of the caches and only use the memory bandwidth that its COS
+// allows. Their cache occupancy and memory traffic is counted for its RMID.
+//
+// The capacity masks and throttling values of each COS belong to an L3 cache, an L2 cache or a memory
+// controller and apply to all CPUs that share it. Userspace programs them on a CPU of each of these with
+// machine_ctrl_rdt. They are lost on suspend. The monitoring counters also belong to the L3 cache.
+class Rdt
+{
+    // The value of IA32_PQR_ASSOC of this CPU.
+    CPULOCAL_ACCESSOR(rdt, pqr);
+
+public:
+    enum Resource : unsigned
+    {
+        // The L3 capacity mask. With CDP enabled, this is the mask for data.
+        L3 = 0,
+
+        // The L3 capacity mask for code. Needs CDP.
+        L3_CODE = 1,
+
+        // The L2 capacity mask.
+        L2 = 2,
+
+        // The memory bandwidth throttling delay.
+        MBA = 3,
+
+        // Enables (1) or disables (0) L3 CDP. This halves the number of classes for the L3 cache and
+        // ignores the COS.
+        L3_CDP = 4,
+
+        // The monitoring events of the L3 cache. These are only read. See read_counters.
+        MON_L3_OCCUPANCY = 5,
+        MON_MBM_TOTAL = 6,
+        MON_MBM_LOCAL = 7,
+    };
+
+    // The number of classes of service of this CPU. Zero, if it doesn't support any RDT allocation.
+    static unsigned num_cos();
+
+    // The number of RMIDs of this CPU. Zero, if it doesn't support L3 monitoring.
+    static unsigned num_rmid();
+
+    // Reads the IA32_QM_CTR values of a monitoring event for the RMIDs from first on into out, but at most
+    // limit of them. Returns the number of counters or -1, if the CPU doesn't support the event or first is
+    // not a valid RMID.
+    static long read_counters(Resource event, unsigned first, mword* out, size_t limit);
+
+    // Programs the value of the given resource for a COS on the current CPU. Returns false, if the CPU
+    // doesn't support the resource or if the COS or the value are invalid.
+    static bool configure(Resource res, unsigned cos, uint64 value);
+
+    // Loads the COS and RMID of the code that runs next.
+    static void switch_pqr(uint32 cos, uint32 rmid)
+    {
+        uint64 const value{static_cast<uint64>(cos) << 32 | rmid};
+
+        if (EXPECT_FALSE(value != pqr())) {
+            pqr() = value;
+            Msr::write(Msr::IA32_PQR_ASSOC, value);
+        }
+    }
+
+    // INIT resets IA32_PQR_ASSOC to COS 0 and RMID 0.
+    static void init() { pqr() = 0; }
+};
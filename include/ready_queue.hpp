@@ -0,0 +1,131 @@
+/*
+ * Ready Queue
+ *
+ * This file is part of the Hedron hypervisor.
+ *
+ * Hedron is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Hedron is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License version 2 for more details.
+ */
+
+#pragma once
+
+#include "assert.hpp"
+#include "bitmap.hpp"
+#include "math.hpp"
+#include "types.hpp"
+
+// The ready queue of a CPU.
+//
+// Ready elements with a fixed priority are kept in one circular list per priority. Elements with the same
+// priority are picked in FIFO order. Reservations with budget left are kept in a separate list sorted by
+// deadline and are picked before all fixed priorities.
+//
+// The queue only links elements. T needs prev and next pointers, a prio below PRIOS and a deadline. It is
+// independent of the rest of the kernel, so the scheduling policy can be exercised by host tests.
+template <typename T, size_t PRIOS> class Ready_queue
+{
+    T* list_[PRIOS]{};
+
+    // Bit n is set, if list_[n] is not empty.
+    Bitmap<mword, PRIOS> prio_ready_{false};
+
+    // Ready reservations, sorted by deadline.
+    T* res_list_{nullptr};
+
+    // The number of elements in the queue.
+    size_t size_{0};
+
+    static void link_before(T* t, T* pos)
+    {
+        t->next = pos;
+        t->prev = pos->prev;
+        t->next->prev = t->prev->next = t;
+    }
+
+public:
+    // The highest priority with a ready element. Returns 0 if no element is ready.
+    unsigned top() const { return static_cast<unsigned>(max(prio_ready_.find_last_set(), 0L)); }
+
+    // The first element with the given priority.
+    T* head(unsigned prio) const { return list_[prio]; }
+
+    // The reservation with the earliest deadline.
+    T* res_head() const { return res_list_; }
+
+    // The number of elements in the queue, including reservations.
+    size_t size() const { return size_; }
+
+    // The element that should run next: The reservation with the earliest deadline or else the first element
+    // with the highest priority.
+    T* pick() const { return res_list_ ? res_list_ : list_[top()]; }
+
+    // Appends t to the elements with its priority.
+    void enqueue(T* t)
+    {
+        assert(t->prio < PRIOS);
+
+        T*& head{list_[t->prio]};
+        size_++;
+
+        if (!head) {
+            head = t->prev = t->next = t;
+            prio_ready_.set(t->prio, true);
+        } else {
+            link_before(t, head);
+        }
+    }
+
+    // Inserts t behind all reservations with the same or an earlier deadline.
+    void enqueue_reserved(T* t)
+    {
+        T*& head{res_list_};
+        size_++;
+
+        if (!head) {
+            head = t->prev = t->next = t;
+            return;
+        }
+
+        T* succ{head};
+
+        while (succ->deadline <= t->deadline and (succ = succ->next) != head) {
+        }
+
+        link_before(t, succ);
+
+        if (t->deadline < head->deadline) {
+            head = t;
+        }
+    }
+
+    // Removes t from the queue. Reserved must match how t was enqueued.
+    void dequeue(T* t, bool reserved)
+    {
+        assert(t->prev and t->next);
+        assert(size_ > 0);
+
+        size_--;
+
+        if (reserved) {
+            if (res_list_ == t) {
+                res_list_ = t->next == t ? nullptr : t->next;
+            }
+        } else if (list_[t->prio] == t) {
+            list_[t->prio] = t->next == t ? nullptr : t->next;
+
+            if (!list_[t->prio]) {
+                prio_ready_.set(t->prio, false);
+            }
+        }
+
+        t->next->prev = t->prev;
+        t->prev->next = t->next;
+        t->prev = t->next = nullptr;
+    }
+};
@@ -103,6 +103,32 @@ public:
     inline void set_ip(mword ip) { ARG_IP = ip; }
 
     inline void set_sp(mword sp) { ARG_SP = sp; }
+
+    // Copy the given number of message words (1 to 4) of a register-only IPC, starting with ARG2.
+    inline void copy_msg_regs(Sys_regs const& src, unsigned words)
+    {
+        switch (words) {
+        case 4:
+            ARG_5 = src.ARG_5;
+            [[fallthrough]];
+        case 3:
+            ARG_4 = src.ARG_4;
+            [[fallthrough]];
+        case 2:
+            ARG_3 = src.ARG_3;
+            [[fallthrough]];
+        default:
+            ARG_2 = src.ARG_2;
+        }
+    }
+
+protected:
+    // The number of words of a register-only IPC message. ARG1[10:9] holds it modulo 4, so 0 means four.
+    inline unsigned msg_words() const
+    {
+        unsigned const words{flags() >> 1 & 0x3};
+        return words ? words : 4;
+    }
 };
 static_assert(OFFSETOF(Sys_regs, cr2) == OFS_CR2);
 
@@ -140,6 +166,9 @@ public:
             mword spec_ctrl;
             uint32 exc_bitmap;
 
+            // The guest executes HLT, MONITOR and MWAIT without exits. See Vcpu::EXIT_POLICY_NATIVE_IDLE.
+            bool native_idle;
+
             // Debug Registers. DR7 is stored in the VMCS.
             mword dr0;
             mword dr1;
@@ -22,11 +22,47 @@
 
 #pragma once
 
-#include "spinlock.hpp"
+#include "atomic.hpp"
 
 class Sc;
 
-struct Rq {
-    Spinlock lock;
-    Sc* queue;
+// The remote run queue of a CPU.
+//
+// Any CPU can push elements with a compare-and-swap. The elements are linked via T::next with the most
+// recently pushed element first. Only the owning CPU takes elements off the queue and it always takes the
+// whole queue with a single atomic exchange. This makes the queue ABA-safe without a lock.
+template <typename T> struct Remote_queue {
+    T* queue;
+
+    // Pushes t. Returns true, if the queue was empty before. Only then the owning CPU needs a notification.
+    bool push(T* t)
+    {
+        T* head;
+
+        do {
+            head = Atomic::load(queue);
+            t->next = head;
+        } while (not Atomic::cmp_swap(queue, head, t));
+
+        return !head;
+    }
+
+    // Takes all elements off the queue. They remain linked via T::next in the order they were pushed.
+    T* drain()
+    {
+        // The queue is in LIFO order. Reverse it.
+        T* fifo{nullptr};
+
+        for (T* ptr = Atomic::exchange(queue, static_cast<T*>(nullptr)); ptr;) {
+            T* const t{ptr};
+
+            ptr = ptr->next;
+            t->next = fifo;
+            fifo = t;
+        }
+
+        return fifo;
+    }
 };
+
+using Rq = Remote_queue<Sc>;
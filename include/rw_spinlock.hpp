@@ -0,0 +1,105 @@
+/*
+ * Reader-Writer Spinlock
+ *
+ * This file is part of the Hedron hypervisor.
+ *
+ * Hedron is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Hedron is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License version 2 for more details.
+ */
+
+#pragma once
+
+#include "assert.hpp"
+#include "atomic.hpp"
+#include "config.hpp"
+#include "types.hpp"
+#include "x86.hpp"
+
+// A spinlock that readers can hold concurrently.
+//
+// Writers have precedence: Once a writer waits for the lock, new readers wait until it is done, so a steady
+// stream of readers cannot starve writers. Readers still share the cache line of the lock, so read sections
+// should not be tiny. For small data that is read much more often than written, Seqlock scales better.
+//
+// Writers use lock and unlock, so they are best used via the Lock_guard class. Readers use lock_shared and
+// unlock_shared via Shared_lock_guard.
+class Rw_spinlock
+{
+private:
+    // Set while a writer holds or waits for the lock. The other bits count the readers.
+    static constexpr uint32 WRITER{1U << 31};
+
+    static_assert(NUM_CPU < WRITER, "Reader counter can overflow");
+
+    uint32 val{0};
+
+public:
+    void lock()
+    {
+        // Announce ourselves, so no new readers come in.
+        while (Atomic::fetch_or<uint32, Atomic::ACQUIRE>(val, WRITER) & WRITER) {
+            while (Atomic::load<uint32, Atomic::RELAXED>(val) & WRITER) {
+                relax();
+            }
+        }
+
+        // Wait for the readers that came before us.
+        while (Atomic::load<uint32, Atomic::ACQUIRE>(val) != WRITER) {
+            relax();
+        }
+    }
+
+    void unlock()
+    {
+        assert_slow(is_locked());
+
+        Atomic::clr_mask<uint32, Atomic::RELEASE>(val, WRITER);
+    }
+
+    void lock_shared()
+    {
+        for (;;) {
+            while (Atomic::load<uint32, Atomic::RELAXED>(val) & WRITER) {
+                relax();
+            }
+
+            if (not(Atomic::add<uint32, Atomic::ACQUIRE>(val, 1) & WRITER)) {
+                return;
+            }
+
+            // A writer came in between. Let it go first.
+            Atomic::sub<uint32, Atomic::RELAXED>(val, 1);
+        }
+    }
+
+    void unlock_shared()
+    {
+        assert_slow(is_locked_shared());
+
+        Atomic::sub<uint32, Atomic::RELEASE>(val, 1);
+    }
+
+    // Check whether a writer holds or waits for the lock. See Spinlock::is_locked.
+    bool is_locked() const { return Atomic::load(val) & WRITER; }
+
+    // Check whether any reader holds the lock.
+    bool is_locked_shared() const { return Atomic::load(val) & ~WRITER; }
+};
+
+// The counterpart of Lock_guard for readers of a Rw_spinlock.
+template <typename T> class Shared_lock_guard
+{
+private:
+    T& _lock;
+
+public:
+    inline Shared_lock_guard(T& l) : _lock(l) { _lock.lock_shared(); }
+
+    inline ~Shared_lock_guard() { _lock.unlock_shared(); }
+};
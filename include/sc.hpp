@@ -25,33 +25,98 @@
 #include "cpulocal.hpp"
 #include "kobject.hpp"
 #include "queue.hpp"
+#include "x86.hpp"
 
 class Ec;
 
 class Sc : public Typed_kobject<Kobject::Type::SC>, public Refcount
 {
     friend class Queue<Sc>;
+    friend class Ready_queue<Sc, NUM_PRIORITIES>;
+    friend struct Remote_queue<Sc>;
 
 public:
-    Refptr<Ec> const ec;
-    unsigned const cpu;
+    // The fields up to reserved are what scheduling touches. They share one cache line (see the layout checks
+    // in Sc::Sc).
+    alignas(CACHE_LINE_SIZE) Refptr<Ec> const ec;
+
+    // The CPU this SC is scheduled on. It only changes for migratable SCs and only while the SC is in the
+    // ready queue of its CPU or is handed over by Sc::follow. See Sc::steal_handler. Other CPUs read it to
+    // wake up the SC, so it is only accessed atomically.
+    unsigned cpu;
+
     unsigned const prio;
-    uint64 time;
 
 private:
     Sc *prev, *next;
     uint64 tsc;
 
+public:
+    uint64 time;
+
+    // Migratable SCs can be moved to idle CPUs. See Sc::steal.
+    bool const migratable;
+
+private:
+    // True if this SC is in the reservation list or was last picked from it.
+    bool reserved{false};
+
+    // The state of a reservation. See budget and period below.
+    uint64 budget_left{0};
+    uint64 deadline{0};
+
+public:
+    // Reservation parameters in TSC ticks. An SC with a non-zero period is a reservation: Whenever it becomes
+    // ready after its deadline, it gets budget ticks until a new deadline one period later. While it has
+    // budget left, it is scheduled by earliest deadline before all SCs with fixed priorities. Without budget,
+    // it is scheduled with its fixed priority.
+    uint64 const budget;
+    uint64 const period;
+
+    // The TSC ticks this SC was ready, but waited in a ready queue for its CPU. This is only updated when the
+    // SC leaves the ready queue.
+    uint64 wait{0};
+
+    // A unique number that identifies this SC in the event trace. See Event_trace.
+    uint32 const id;
+
+    // The IA32_HWP_REQUEST value that CPUs use while they run this SC or zero for no hint. See Hwp.
+    uint64 hwp_request{0};
+
+private:
     static Slab_cache cache;
 
     CPULOCAL_REMOTE_ACCESSOR(sc, rq);
-    CPULOCAL_ACCESSOR(sc, list);
-    CPULOCAL_ACCESSOR(sc, prio_top);
+    CPULOCAL_ACCESSOR(sc, ready);
+    CPULOCAL_REMOTE_ACCESSOR(sc, migratable_ready);
+    CPULOCAL_REMOTE_ACCESSOR(sc, steal_req);
+    CPULOCAL_ACCESSOR(sc, follower);
+    CPULOCAL_ACCESSOR(sc, follower_cpu);
+
+    static inline uint32 id_cnt;
+
+    // The number of migratable SCs that were ever created. CPUs only try to steal SCs if this is not zero.
+    static inline unsigned migratable_cnt;
 
     void ready_enqueue(uint64, bool);
 
     void ready_dequeue(uint64);
 
+    // Publishes the load of the current CPU. See Cpu_load.
+    static void publish_load();
+
+    // Whether this ready SC can be moved to another CPU right now.
+    bool can_migrate() const;
+
+    // Move this ready SC to the ready queue of another CPU.
+    void migrate(unsigned);
+
+    // Hands the SC that left with follow to its new CPU.
+    static void hand_over_follower();
+
+    // Switch to the next SC in the ready queue. The current SC must already be queued or gone.
+    [[noreturn]] static void switch_to_next(uint64 t);
+
     static void free(Rcu_elem* a)
     {
         Sc* s = static_cast<Sc*>(a);
@@ -74,11 +139,29 @@ public:
     CPULOCAL_ACCESSOR(sc, current);
     CPULOCAL_ACCESSOR(sc, ctr_link);
     CPULOCAL_ACCESSOR(sc, ctr_loop);
+    CPULOCAL_REMOTE_ACCESSOR(sc, stats);
 
     static unsigned const default_prio = 1;
 
     Sc(Pd*, mword, Ec*);
-    Sc(Pd*, mword, Ec*, unsigned, unsigned);
+    Sc(Pd*, mword, Ec*, unsigned, unsigned, bool = false, uint64 = 0, uint64 = 0);
+
+    bool is_reservation() const { return period != 0; }
+
+    // The TSC ticks this SC may still run before its budget is exhausted. Only valid for the current SC.
+    // Returns ~0 if the SC does not run on a budget right now.
+    uint64 budget_remaining(uint64 t) const
+    {
+        if (not reserved) {
+            return ~0ULL;
+        }
+
+        uint64 const used{t - tsc};
+        return budget_left > used ? budget_left - used : 0;
+    }
+
+    // Only valid for the current SC.
+    bool budget_exhausted() const { return reserved and budget_remaining(rdtsc()) == 0; }
 
     // Access the runqueue on a remote core.
     //
@@ -90,6 +173,28 @@ public:
 
     static void rrq_handler();
 
+    // Ask a busy CPU to hand over one of its ready migratable SCs to the current CPU.
+    //
+    // This is called by idle CPUs. Victims are chosen by topology: CPUs whose APIC IDs differ in fewer low
+    // bits share more caches with us and are preferred.
+    static void steal();
+
+    // Answer a steal request from an idle CPU. This must only be called for HZD_STEAL.
+    static void steal_handler();
+
+    // Move the current migratable SC to the given CPU and switch to the next SC here. Its EC continues with
+    // its continuation on the new CPU. The new CPU only gets the SC once this CPU has switched to the EC of
+    // the next SC, because the state of the EC is only saved then. See Ec::follow.
+    [[noreturn]] static void follow(unsigned to);
+
+    // Called right after the current CPU switched to another EC. See follow.
+    static void switched_ec()
+    {
+        if (EXPECT_FALSE(follower() != nullptr)) {
+            hand_over_follower();
+        }
+    }
+
     [[noreturn]] static void schedule(bool suspend = false);
 
     static inline void* operator new(size_t) { return cache.alloc(); }
@@ -0,0 +1,186 @@
+/*
+ * Scheduling Statistics
+ *
+ * This file is part of the Hedron hypervisor.
+ *
+ * Hedron is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Hedron is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License version 2 for more details.
+ */
+
+#pragma once
+
+#include "atomic.hpp"
+#include "compiler.hpp"
+#include "cpulocal.hpp"
+#include "hazards.hpp"
+#include "memory.hpp"
+#include "types.hpp"
+#include "x86.hpp"
+
+// The scheduling statistics of one CPU.
+//
+// Each CPU has one page with these statistics that user space can map read-only via a statistics KP (see
+// Ec::sys_create_kp). Only the owning CPU writes the counters. All counters only increase and user space
+// samples them without any synchronization, so it may see an update of one counter before an earlier update
+// of another.
+//
+// The layout of this structure is part of the ABI. New counters are only added at the end.
+struct Sched_stats {
+    // The number of calls to Sc::schedule.
+    uint64 schedule_cnt;
+
+    // The number of times Sc::schedule switched to a different SC.
+    uint64 switch_cnt;
+
+    // The number of SCs that became ready on this CPU, excluding preempted SCs that went back to the ready
+    // queue.
+    uint64 wakeup_cnt;
+
+    // The number of SCs that other CPUs made ready on this CPU via the remote run queue. These are also
+    // counted in wakeup_cnt.
+    uint64 remote_wakeup_cnt;
+
+    // The TSC ticks this CPU spent waiting for work in its idle loop.
+    uint64 idle_tsc;
+
+    // The part of idle_tsc that this CPU spent in C-states deeper than C1.
+    uint64 deep_idle_tsc;
+
+    // The number of single-page allocations that this CPU served from its page cache in front of the buddy
+    // allocator, and the number of these allocations that had to refill the page cache first.
+    uint64 page_cache_hit_cnt;
+    uint64 page_cache_miss_cnt;
+
+    // The number of times this CPU found the lock of the buddy allocator held by another CPU.
+    uint64 buddy_contended_cnt;
+
+    // The number of times this CPU found the lock of a derivation tree in the mapping database held by
+    // another CPU.
+    uint64 mdb_contended_cnt;
+
+    // The number of objects that this CPU handed to RCU and the number of their callbacks that it invoked
+    // after their grace period. The difference is the number of objects that wait for reclamation.
+    uint64 rcu_call_cnt;
+    uint64 rcu_invoke_cnt;
+
+    // The number of RCU batches of this CPU that completed their grace period and the TSC ticks from the
+    // start of each of these batches to the time when this CPU noticed their completion.
+    uint64 rcu_batch_cnt;
+    uint64 rcu_wait_tsc;
+
+    // The number of times this CPU handled each hazard, indexed by the bit number of the hazard.
+    uint64 hazard_cnt[NUM_HZD];
+
+    // The number of system calls, VM exits and NMIs that this CPU handled.
+    uint64 syscall_cnt;
+    uint64 vm_exit_cnt;
+    uint64 nmi_cnt;
+
+    // The number of TLB shootdown NMIs that this CPU sent.
+    uint64 tlb_shootdown_cnt;
+
+    // The number of blocks that this CPU allocated from the kernel page allocator, including the ones served
+    // from its page cache.
+    uint64 page_alloc_cnt;
+
+    // The number of INVEPT and INVVPID instructions that this CPU executed, split into those that only
+    // invalidated the mappings of one EPT or VPID and those that invalidated all of them.
+    uint64 invept_single_cnt;
+    uint64 invept_all_cnt;
+    uint64 invvpid_single_cnt;
+    uint64 invvpid_all_cnt;
+
+    // The number of HLT exits after which this CPU woke up the guest itself while polling, those after which
+    // it returned to the VMM because the polling window expired, and the TSC ticks it spent polling. See
+    // Vcpu::poll_halt.
+    uint64 halt_poll_hit_cnt;
+    uint64 halt_poll_miss_cnt;
+    uint64 halt_poll_tsc;
+
+    // The number of deferred work items that this CPU ran and the TSC ticks it spent in them. See
+    // Deferred_work.
+    uint64 deferred_work_cnt;
+    uint64 deferred_work_tsc;
+
+    // The number of TLB shootdown NMIs that this CPU did not send to isolated CPUs, because they executed a
+    // guest that could not use the stale entries, and the number of NMIs that this CPU received while it
+    // executed a guest in isolated mode. See Vcpu::run.
+    uint64 isolated_nmi_skip_cnt;
+    uint64 isolated_nmi_cnt;
+
+    // The number of times an SC helped a busy EC, the sum of the lengths of the call chains behind these
+    // ECs and the number of times the SC blocked instead, because the chain was too long. See Ec::help.
+    uint64 help_cnt;
+    uint64 help_depth;
+    uint64 help_block_cnt;
+
+    // The number of VMREADs of VM-exit information fields that this CPU avoided, because an earlier part of
+    // the same VM exit had read them already. See Vmx_exit_cache.
+    uint64 vmread_cached_cnt;
+
+    // The TSC ticks this CPU spent in the kernel for system calls and for VM exits, from the kernel entry
+    // until it returned to user space or a guest or went idle. This includes the work that the counters
+    // below, halt_poll_tsc and deferred_work_tsc account, if it happened on these paths. See enter_kernel.
+    uint64 syscall_tsc;
+    uint64 vm_exit_tsc;
+
+    // The TSC ticks this CPU spent waiting for other CPUs to acknowledge its TLB shootdowns. See
+    // Space_mem::shootdown.
+    uint64 shootdown_wait_tsc;
+
+    // The TSC ticks this CPU spent in RCU callbacks.
+    uint64 rcu_invoke_tsc;
+
+    static void inc(uint64& counter, uint64 val = 1)
+    {
+        Atomic::store<uint64, Atomic::RELAXED>(counter, counter + val);
+    }
+
+    // Count an event in the statistics of the current CPU. Events before the CPU has its statistics are
+    // not counted.
+    //
+    // Only the owning CPU writes its counters, so this needs no atomic read-modify-write. An NMI may
+    // interrupt the update of a counter, so counters updated in NMI context must not be updated elsewhere.
+    static void count(uint64 Sched_stats::*counter, uint64 val = 1)
+    {
+        if (Sched_stats* const stats{Cpulocal::get().sc_stats}; EXPECT_TRUE(stats)) {
+            inc(stats->*counter, val);
+        }
+    }
+
+    // Charge the time in the kernel from now on to the given counter. This is called when the CPU enters the
+    // kernel for a system call or a VM exit. Time spent in the kernel for other reasons, e.g. interrupts of
+    // user ECs, is not accounted.
+    static void enter_kernel(uint64 Sched_stats::*counter)
+    {
+        Per_cpu& local{Cpulocal::get()};
+
+        if (EXPECT_TRUE(local.sc_stats)) {
+            local.sc_kernel_counter = &(local.sc_stats->*counter);
+            local.sc_kernel_entry_tsc = rdtsc();
+        }
+    }
+
+    // Charge the time since the last enter_kernel. This is called when the CPU returns to user space or to a
+    // guest and before it goes idle.
+    static void leave_kernel()
+    {
+        Per_cpu& local{Cpulocal::get()};
+
+        if (uint64* const counter{local.sc_kernel_counter}; counter) {
+            inc(*counter, rdtsc() - local.sc_kernel_entry_tsc);
+            local.sc_kernel_counter = nullptr;
+        }
+    }
+};
+
+// The statistics of several CPUs are summed up as arrays of counters. See Ec::sys_machine_ctrl_stats.
+static_assert(sizeof(Sched_stats) % sizeof(uint64) == 0, "Scheduling statistics must only hold counters");
+
+static_assert(sizeof(Sched_stats) <= PAGE_SIZE, "Scheduling statistics must fit into a KP");
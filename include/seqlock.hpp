@@ -0,0 +1,97 @@
+/*
+ * Sequence Lock
+ *
+ * This file is part of the Hedron hypervisor.
+ *
+ * Hedron is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Hedron is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License version 2 for more details.
+ */
+
+#pragma once
+
+#include "atomic.hpp"
+#include "spinlock.hpp"
+#include "types.hpp"
+#include "x86.hpp"
+
+// A sequence lock for small read-mostly data.
+//
+// Writers exclude each other and increment a sequence counter before and after they modify the data. Readers
+// don't write to the lock at all. They read the data optimistically and retry, if the sequence counter shows
+// that a writer was active in the meantime. Readers thus never slow down each other or the writers, but may
+// see inconsistent data that they have to discard. They must read the protected data with atomic accesses and
+// must not follow pointers from it.
+//
+//   Lock_guard<Seqlock> guard{lock};          // Writer
+//   auto const v{lock.read([&] { ... })};     // Reader
+//
+// Writers are best used via the Lock_guard class to avoid mismatched lock/unlock calls.
+class Seqlock
+{
+private:
+    Spinlock writer;
+
+    // Odd while a writer modifies the data.
+    unsigned seq{0};
+
+public:
+    void lock()
+    {
+        writer.lock();
+
+        Atomic::store<unsigned, Atomic::RELAXED>(seq, seq + 1);
+
+        // Readers must not see any of our modifications without the odd sequence count.
+        Atomic::fence<Atomic::RELEASE>();
+    }
+
+    void unlock()
+    {
+        Atomic::store<unsigned, Atomic::RELEASE>(seq, seq + 1);
+
+        writer.unlock();
+    }
+
+    // Check whether a writer holds the lock. See Spinlock::is_locked.
+    bool is_locked() const { return writer.is_locked(); }
+
+    // Starts a read section and returns the sequence count to check it with read_retry.
+    unsigned read_begin() const
+    {
+        unsigned s;
+
+        while ((s = Atomic::load<unsigned const, Atomic::ACQUIRE>(seq)) & 1) {
+            relax();
+        }
+
+        return s;
+    }
+
+    // Returns true, if a writer was active since read_begin returned start. The data that was read in the
+    // meantime must be discarded in this case.
+    bool read_retry(unsigned start) const
+    {
+        Atomic::fence<Atomic::ACQUIRE>();
+
+        return Atomic::load<unsigned const, Atomic::RELAXED>(seq) != start;
+    }
+
+    // Calls fn until it ran without a concurrent writer and returns its last result.
+    template <typename FN> auto read(FN fn) const
+    {
+        for (;;) {
+            unsigned const start{read_begin()};
+            auto const result{fn()};
+
+            if (not read_retry(start)) {
+                return result;
+            }
+        }
+    }
+};
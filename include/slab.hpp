@@ -22,35 +22,99 @@
 
 #include "buddy.hpp"
 #include "initprio.hpp"
+#include "math.hpp"
+#include "slab_geometry.hpp"
 
 class Slab;
 
+// A CPU-local stack of free elements of one slab cache. See Slab_cache.
+struct Slab_magazine {
+    // The top element. Each element in the magazine points to the next one with its first word.
+    void* head;
+
+    // The number of elements in the magazine.
+    unsigned long cnt;
+};
+
 /**
  * The slab cache is an allocator for fixed size objects that are smaller than a page. The slab cache holds a
  * list of slabs. If the slab cache is full, i.e. all elements are allocated, it allocates a new, empty slab.
- * The slab cache holds at most one completely free slab and returns further ones as they become empty.
+ * The slab cache holds at most one completely free slab and returns further ones as they become empty. When
+ * the buddy allocator runs out of memory, all slab caches give back their free slab (see shrink_all).
+ *
+ * Large objects get slabs of multiple pages, if this wastes less memory. Consecutive slabs place their
+ * elements at different cache line offsets (see Slab_geometry).
+ *
+ * In front of the slabs, each CPU has a magazine of free elements for each slab cache. Allocations and frees
+ * only touch the magazine of the current CPU and don't need the lock or atomic operations. The magazine is
+ * refilled from and drained to the slabs in batches. For the slabs, elements in a magazine are allocated.
  */
 class Slab_cache
 {
 private:
-    Spinlock lock;
+    Mcs_lock lock;
+
+    // The index of the magazines of this cache in Per_cpu::slab_magazine.
+    unsigned const id;
+
+    // The number of slab caches that were constructed so far.
+    static unsigned count;
+
+    // True once CPU-local memory can be used. Before, all elements come directly from the slabs.
+    static bool magazines_enabled;
+
+    Slab_magazine& magazine();
+
+    // The number of elements that move between the magazines and the slabs at once. Magazines hold at most
+    // twice as many elements.
+    unsigned long batch() const { return min(MAGAZINE_BATCH, geometry.elem); }
 
     // The slab that will be used for the next allocation, or a nullptr if the the slab cache is full.
     Slab* curr;
     Slab* head; // The head of our list of slabs.
 
+    // The color of the next slab in multiples of Slab_geometry::COLOR_ALIGN.
+    unsigned long next_color{0};
+
+    // The number of slabs and of the elements that are allocated from them, including the elements in
+    // magazines.
+    unsigned long slabs{0};
+    unsigned long used{0};
+
     /*
      * Back end allocator
      */
     void grow();
 
+    // Allocates and frees elements in the slabs. The caller has to hold the lock.
+    void* alloc_slab();
+    void free_slab(void* ptr);
+
+public:
+    // The number of slab caches that can have magazines.
+    static constexpr unsigned MAX_CACHES{16};
+
+    // The number of elements that move between a magazine and the slabs at once, unless one slab holds
+    // less.
+    static constexpr unsigned long MAGAZINE_BATCH{16};
+
+    // The number of words that all_stats writes for each slab cache.
+    static constexpr unsigned long STATS_WORDS{4};
+
+private:
+    // All slab caches by their id. See shrink_all.
+    static Slab_cache* caches[MAX_CACHES];
+
 public:
-    unsigned long size; // Size of an element
-    unsigned long buff; // Size of an element buffer (includes link field)
-    unsigned long elem; // Number of elements that one slab can hold
+
+    Slab_geometry const geometry;
 
     Slab_cache(unsigned long elem_size, unsigned elem_align);
 
+    // Create the slab cache for objects of type T. This checks at compile time that the slabs don't waste
+    // too much memory.
+    template <typename T, unsigned ALIGN> static Slab_cache create();
+
     /*
      * Front end allocator
      */
@@ -60,10 +124,27 @@ public:
      * Front end deallocator
      */
     void free(void* ptr);
+
+    // Enables the magazines on all CPUs. This has to be called once CPU-local memory is set up on the boot
+    // CPU.
+    static void enable_magazines() { magazines_enabled = true; }
+
+    // Returns the elements in the magazine of the current CPU to the slabs and frees the empty slab of this
+    // cache. Does nothing, if the cache is locked, because the current CPU might hold the lock. Returns the
+    // number of pages that went back to the buddy allocator.
+    unsigned long shrink();
+
+    // Shrinks all slab caches. The buddy allocator calls this when it runs out of memory.
+    static unsigned long shrink_all();
+
+    // Writes STATS_WORDS words for each slab cache into words, as long as max words are left: the element
+    // size, the pages in slabs, the number of elements these slabs hold and how many of them are allocated.
+    // Returns the number of slab caches.
+    static unsigned long all_stats(unsigned long* words, unsigned long max);
 };
 
 /**
- * A slab is one page of memory that is split up into a number of fixed size elements. As long as an
+ * A slab is 2^order pages of memory that are split up into a number of fixed size elements. As long as an
  * element is not used, it holds a pointer to another unused element, i.e. this implementation uses a free
  * list to find unallocated elements.
  */
@@ -76,19 +157,20 @@ public:
     Slab* next; // Next slab in cache
     char* head; // A pointer to the start of this slab's free list
 
-    static inline void* operator new(size_t)
+    static inline void* operator new(size_t, unsigned short order)
     {
         // The front-end allocator will initialize memory.
-        return Buddy::allocator.alloc(0, Buddy::NOFILL);
+        return Buddy::allocator.alloc(order, Buddy::NOFILL);
     }
 
     static inline void operator delete(void* ptr) { Buddy::allocator.free(reinterpret_cast<mword>(ptr)); }
 
-    Slab(Slab_cache* slab_cache);
+    // Create a slab whose elements are shifted by color bytes towards the slab header.
+    Slab(Slab_cache* slab_cache, unsigned long color);
 
     inline bool full() const { return !avail; }
 
-    inline bool empty() const { return avail == cache->elem; }
+    inline bool empty() const { return avail == cache->geometry.elem; }
 
     // Enqueues this slab between new_prev and new_next. Panics if new_prev and new_next are not adjacent.
     void enqueue(Slab* new_prev, Slab* new_next);
@@ -101,3 +183,16 @@ public:
 
     inline void free(void* ptr);
 };
+
+// The slab geometry of a slab cache for elements of the given size and alignment.
+constexpr Slab_geometry slab_geometry(unsigned long elem_size, unsigned elem_align)
+{
+    return Slab_geometry::of(elem_size, elem_align, sizeof(Slab));
+}
+
+template <typename T, unsigned ALIGN> Slab_cache Slab_cache::create()
+{
+    static_assert(slab_geometry(sizeof(T), ALIGN).efficient(), "Slabs of this type waste too much memory");
+
+    return Slab_cache(sizeof(T), ALIGN);
+}
@@ -0,0 +1,97 @@
+/*
+ * Slab Geometry
+ *
+ * This file is part of the Hedron hypervisor.
+ *
+ * Hedron is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Hedron is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License version 2 for more details.
+ */
+
+#pragma once
+
+#include "math.hpp"
+#include "memory.hpp"
+#include "types.hpp"
+
+// The layout of the slabs of one slab cache. See Slab_cache.
+//
+// A slab is 2^order pages and starts with the slab header. Elements fill the slab from its end. The slack
+// between the header and the elements is used to shift the elements of different slabs by multiples of a
+// cache line (cache coloring), so the elements of different slabs don't all compete for the same cache
+// sets.
+//
+// All functions are constexpr, so the geometry of a slab cache can be checked at compile time:
+//
+// static_assert(slab_geometry(sizeof(Ec), 32).efficient(), "...");
+struct Slab_geometry {
+    // Slabs are at most 2^MAX_ORDER pages, so large slabs don't fragment the buddy allocator.
+    static constexpr unsigned short MAX_ORDER{2};
+
+    // The part of a slab that may be wasted before we try a larger slab.
+    static constexpr unsigned long MAX_WASTE_DIV{8};
+
+    // The granularity of cache coloring.
+    static constexpr unsigned long COLOR_ALIGN{64};
+
+    unsigned short order;
+
+    // The size of the slab header.
+    unsigned long header;
+
+    // The size of an element.
+    unsigned long size;
+
+    // The size of an element buffer (includes the free list link).
+    unsigned long buff;
+
+    // The number of elements in a slab.
+    unsigned long elem;
+
+    constexpr unsigned long bytes() const { return static_cast<unsigned long>(PAGE_SIZE) << order; }
+
+    // The bytes of a slab that hold neither the header nor an element.
+    constexpr unsigned long slack() const { return bytes() - header - elem * buff; }
+
+    // The percentage of a slab that holds elements.
+    constexpr unsigned long utilization() const { return elem * buff * 100 / bytes(); }
+
+    // True, if at most 1/MAX_WASTE_DIV of a slab is wasted.
+    constexpr bool efficient() const { return slack() * MAX_WASTE_DIV <= bytes(); }
+
+    // The number of different color offsets that slabs can use.
+    constexpr unsigned long colors() const { return slack() / COLOR_ALIGN + 1; }
+
+    // The geometry for elements of the given size and alignment with a slab header of the given size. This
+    // picks the smallest slab that is efficient or the one that wastes the least space, if none is.
+    static constexpr Slab_geometry of(unsigned long elem_size, unsigned long elem_align, unsigned long header)
+    {
+        unsigned long const size{align_up(elem_size, sizeof(mword))};
+        unsigned long const buff{align_up(size + sizeof(mword), elem_align)};
+
+        Slab_geometry best{0, header, size, buff, 0};
+
+        for (unsigned short order{0}; order <= MAX_ORDER; order++) {
+            Slab_geometry const g{order, header, size, buff, ((PAGE_SIZE << order) - header) / buff};
+
+            if (g.elem == 0) {
+                continue;
+            }
+
+            if (g.efficient()) {
+                return g;
+            }
+
+            if (best.elem == 0 or g.slack() * best.bytes() < best.slack() * g.bytes()) {
+                best = g;
+            }
+        }
+
+        return best;
+    }
+};
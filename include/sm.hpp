@@ -27,8 +27,34 @@
 class Sm : public Typed_kobject<Kobject::Type::SM>, public Refcount, public Queue<Ec>
 {
 private:
+    // For semaphores, this is the semaphore counter. For notifications, these are the pending signal bits.
+    // Both also hold WAITING.
     mword counter;
 
+    bool const notification;
+
+    // A semaphore can be bound to a notification. Each "up" that does not wake a waiting EC then also sets
+    // the given signal bits in this notification. This allows a single EC to wait for many semaphores.
+    Refptr<Sm> const bound_notification;
+    mword const bound_signals;
+
+    // A semaphore can also be bound to an interrupt vector of a vCPU. Each "up" that does not wake a waiting
+    // EC then posts the interrupt to the vCPU. See Vcpu::post_interrupt.
+    Refptr<Vcpu> const bound_vcpu;
+    unsigned const bound_vector;
+
+    // Tell the notification or vCPU that this semaphore is bound to about an "up" that did not wake an EC.
+    void signal_bound()
+    {
+        if (bound_notification) {
+            bound_notification->signal(bound_signals);
+        }
+
+        if (bound_vcpu) {
+            bound_vcpu->post_interrupt(bound_vector);
+        }
+    }
+
     static Slab_cache cache;
 
     static void free(Rcu_elem* a)
@@ -37,11 +63,91 @@ private:
 
         if (sm->del_ref())
             delete sm;
-        else {
+        else if (sm->notification) {
+            sm->wake_notification_waiter();
+        } else {
             sm->up();
         }
     }
 
+    // Wake up one EC that waits for a notification. Returns false, if there was no waiter.
+    //
+    // The woken EC continues at the given continuation. Without a continuation, it re-executes its system
+    // call and thus collects the pending signal bits itself.
+    bool wake_notification_waiter(void (*c)() = nullptr)
+    {
+        Ec* ec = nullptr;
+
+        do {
+            if (ec)
+                Rcu::call(ec);
+
+            {
+                Lock_guard<Spinlock> guard(lock);
+
+                if (!Queue<Ec>::dequeue(ec = Queue<Ec>::head())) {
+                    Atomic::clr_mask(counter, WAITING);
+                    return false;
+                }
+
+                if (!Queue<Ec>::head()) {
+                    Atomic::clr_mask(counter, WAITING);
+                }
+            }
+
+            ec->release(c);
+
+        } while (EXPECT_FALSE(ec->del_rcu()));
+
+        return true;
+    }
+
+    // Queue an EC that blocks on this semaphore. ECs are woken in the order of the priority of the SC that
+    // blocked them and in FIFO order within one priority, so a high-priority waiter doesn't wait behind
+    // low-priority ones. The caller must hold the lock.
+    void enqueue_waiter(Ec* ec)
+    {
+        ec->wait_prio = Sc::current()->prio;
+        enqueue_sorted(ec, [](Ec const* a, Ec const* b) { return a->wait_prio > b->wait_prio; });
+    }
+
+    // Atomically take all pending signal bits and leave WAITING untouched.
+    mword take_signals()
+    {
+        mword old{Atomic::load(counter)};
+
+        while ((old & ~WAITING) and not Atomic::cmp_swap(counter, old, old & WAITING)) {
+            old = Atomic::load(counter);
+        }
+
+        return old & ~WAITING;
+    }
+
+    // Decrement (or zero) a semaphore counter without the lock. Returns false if the counter is zero.
+    bool try_dn(bool zero)
+    {
+        // WAITING is only set if the counter is zero.
+        for (mword old{Atomic::load(counter)}; old and not(old & WAITING); old = Atomic::load(counter)) {
+            if (Atomic::cmp_swap(counter, old, zero ? 0 : old - 1)) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    // Increment a semaphore counter without the lock. Returns false if ECs are waiting.
+    bool try_up()
+    {
+        for (mword old{Atomic::load(counter)}; not(old & WAITING); old = Atomic::load(counter)) {
+            if (Atomic::cmp_swap(counter, old, (old + 1) & COUNTER_MAX)) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
 public:
     // Capability permission bitmask.
     enum
@@ -52,31 +158,132 @@ public:
         PERM_ALL = PERM_UP | PERM_DOWN,
     };
 
-    Sm(Pd*, mword, mword = 0);
+    // Set in the counter while ECs are blocked on the SM. It is only changed with the lock held. Signallers
+    // and semaphore "up" only need to take the lock if this bit is set. The semaphore counter is zero while
+    // the bit is set.
+    static constexpr mword WAITING{1UL << 63};
+
+    // The largest semaphore counter.
+    static constexpr mword COUNTER_MAX{~WAITING};
+
+    // The signal bits that can be used with a notification.
+    static constexpr mword NOTIFY_SIGNALS{~WAITING};
+
+    Sm(Pd*, mword, mword = 0, bool = false, Sm* = nullptr, mword = 0, Vcpu* = nullptr, unsigned = 0);
     ~Sm()
     {
-        while (!counter)
+        if (notification) {
+            while (wake_notification_waiter(Ec::sys_finish<Sys_regs::BAD_CAP>))
+                ;
+            return;
+        }
+
+        while (!(counter & COUNTER_MAX))
             up(Ec::sys_finish<Sys_regs::BAD_CAP>);
     }
 
+    inline bool is_notification() const { return notification; }
+
+    // Returns true if this semaphore posts interrupts to a vCPU.
+    inline bool is_vcpu_bound() const { return bound_vcpu; }
+
+    // Set signal bits in a notification. This does not take the lock unless an EC is waiting.
+    inline void signal(mword bits)
+    {
+        assert(notification);
+
+        if (EXPECT_TRUE(not(Atomic::fetch_or(counter, bits & NOTIFY_SIGNALS) & WAITING))) {
+            return;
+        }
+
+        wake_notification_waiter();
+    }
+
+    // Return all pending signal bits of a notification or block the EC, if there are none.
+    //
+    // A blocked EC is woken up by signal and continues at its continuation. The continuation is expected to
+    // call wait again to collect the signal bits.
+    inline mword wait(Ec* ec = Ec::current())
+    {
+        assert(notification);
+
+        for (;;) {
+            if (mword const bits{take_signals()}; EXPECT_TRUE(bits)) {
+                return bits;
+            }
+
+            bool dying{false};
+
+            {
+                Lock_guard<Spinlock> guard(lock);
+
+                Atomic::set_mask(counter, WAITING);
+
+                // Signals that arrived before we set WAITING did not see the waiting flag and did not
+                // take the lock.
+                if (mword const bits{take_signals()}; bits) {
+                    if (!Queue<Ec>::head()) {
+                        Atomic::clr_mask(counter, WAITING);
+                    }
+
+                    return bits;
+                }
+
+                if (!ec->add_ref()) {
+                    if (!Queue<Ec>::head()) {
+                        Atomic::clr_mask(counter, WAITING);
+                    }
+
+                    dying = true;
+                } else {
+                    enqueue_waiter(ec);
+                }
+            }
+
+            // Sc::schedule doesn't return, so we must not hold the lock.
+            if (dying) {
+                Sc::schedule(true);
+            }
+
+            // This only returns, if the EC was woken up before it could block. Someone else might have taken
+            // the signals in the meantime, so we have to check again.
+            ec->block_sc();
+        }
+    }
+
     inline void dn(bool zero, Ec* ec = Ec::current(), bool block = true)
     {
+        if (EXPECT_TRUE(try_dn(zero))) {
+            return;
+        }
+
+        bool dying{false};
+
         {
             Lock_guard<Spinlock> guard(lock);
 
-            if (counter) {
-                counter = zero ? 0 : counter - 1;
+            // From here on, up takes the lock. An up that came before may still have left us a count. The
+            // queue is empty in this case.
+            if (mword const old{Atomic::fetch_or(counter, WAITING)}; old & COUNTER_MAX) {
+                Atomic::store(counter, zero ? 0 : (old & COUNTER_MAX) - 1);
                 return;
             }
 
             if (!ec->add_ref()) {
-                Sc::schedule(block);
-                return;
-            }
+                if (!Queue<Ec>::head()) {
+                    Atomic::clr_mask(counter, WAITING);
+                }
 
-            enqueue(ec);
+                dying = true;
+            } else {
+                enqueue_waiter(ec);
+            }
         }
 
+        // Sc::schedule doesn't return, so we must not hold the lock.
+        if (dying)
+            Sc::schedule(block);
+
         if (!block)
             Sc::schedule(false);
 
@@ -87,6 +294,11 @@ public:
     {
         Ec* ec = nullptr;
 
+        if (EXPECT_TRUE(try_up())) {
+            signal_bound();
+            return;
+        }
+
         do {
             if (ec)
                 Rcu::call(ec);
@@ -95,11 +307,23 @@ public:
                 Lock_guard<Spinlock> guard(lock);
 
                 if (!Queue<Ec>::dequeue(ec = Queue<Ec>::head())) {
-                    counter++;
-                    return;
+                    // Nobody waits anymore, so nobody can set WAITING again while we hold the lock.
+                    Atomic::clr_mask(counter, WAITING);
+
+                    [[maybe_unused]] bool const counted{try_up()};
+                    assert(counted);
+
+                    ec = nullptr;
+                } else if (!Queue<Ec>::head()) {
+                    Atomic::clr_mask(counter, WAITING);
                 }
             }
 
+            if (!ec) {
+                signal_bound();
+                return;
+            }
+
             ec->release(c);
 
         } while (EXPECT_FALSE(ec->del_rcu()));
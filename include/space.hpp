@@ -20,26 +20,64 @@
 
 #pragma once
 
+#include "btree.hpp"
+#include "lock_guard.hpp"
+#include "mdb.hpp"
 #include "spinlock.hpp"
 
-class Avl;
 class Mdb;
 
+// Allocates the nodes of the mapping trees of all spaces.
+struct Space_tree_alloc {
+    static void* alloc();
+    static void free(void* node);
+};
+
 class Space
 {
 private:
     Spinlock lock;
-    Avl* tree{nullptr};
+
+    // The mapping nodes of this space by their base. Nodes don't overlap.
+    Btree<Mdb, Space_tree_alloc> tree;
+
+    // Returns the node that contains idx or, with next, the first node after idx. The caller must hold the
+    // lock.
+    Mdb* tree_lookup_locked(mword idx, bool next) const;
+
+    // Inserts a node if it doesn't overlap another one. The caller must hold the lock.
+    bool tree_insert_locked(Mdb* node);
 
 public:
     enum Subspace : mword
     {
         SUBSPACE_HOST = 1U << 0,
         SUBSPACE_GUEST = 1U << 2,
+
+        // Not a subspace of its own. Guest mappings are made read-only and writes to them are reported to
+        // the VMM as Vmcs::VMX_COW_WRITE exits. See Ept::cow_mapping.
+        SUBSPACE_COW = 1U << 3,
     };
 
     Mdb* tree_lookup(mword idx, bool next = false);
 
+    // Calls fn for the nodes that overlap [idx, limit) in ascending order. The first node may start below
+    // idx. Stops early when fn returns false for a node and returns where a later call has to resume, which
+    // is the base of that node or limit. The lock is held only once for all nodes.
+    template <typename FN> mword tree_lookup_range(mword idx, mword limit, FN fn)
+    {
+        Lock_guard<Spinlock> guard(lock);
+
+        for (Mdb* m; idx < limit and (m = tree_lookup_locked(idx, true)) and m->node_base < limit;
+             idx = m->node_base + (1UL << m->node_order)) {
+            if (not fn(m)) {
+                return max(idx, m->node_base);
+            }
+        }
+
+        return limit;
+    }
+
     static bool tree_insert(Mdb* node);
     static bool tree_remove(Mdb* node);
 
@@ -26,50 +26,212 @@
 #include "delegate_result.hpp"
 #include "ept.hpp"
 #include "hpt.hpp"
+#include "lock_guard.hpp"
+#include "slab.hpp"
 #include "space.hpp"
+#include "spinlock.hpp"
 #include "tlb_cleanup.hpp"
+#include "tlb_tag_alloc.hpp"
 
 class Space_mem
 {
-    CPULOCAL_ACCESSOR(space_mem, tlb_shootdown);
+    CPULOCAL_REMOTE_ACCESSOR(space_mem, tlb_range);
+    CPULOCAL_ACCESSOR(space_mem, pcid_alloc);
 
-public:
-    Hpt hpt;
+    // Delegations of at least 2^PARALLEL_ORD bytes are split into chunks of 2^CHUNK_ORD bytes that idle
+    // CPUs help to populate (see Parallel::for_each). Each chunk covers one 1GB page table entry, so
+    // promoting superpages in one chunk never touches the page tables of another.
+    static constexpr mword PARALLEL_ORD{32};
+    static constexpr mword CHUNK_ORD{30};
 
-    Ept ept;
+    // Transfer the source mappings of the naturally aligned window at snd_base to rcv_base. This is the
+    // part of delegate that runs after the arguments were checked and the caller owns the window, either
+    // with mapping_lock or as busy window.
+    Delegate_result_void delegate_window(Tlb_cleanup& cleanup, Space_mem* snd, mword snd_base, mword rcv_base,
+                                         mword ord, Hpt::pte_t hw_attr, mword sub);
 
-    mword did;
+    // Split delegate_window into chunks and populate them in parallel. The caller holds mapping_lock, which
+    // this drops while the chunks are populated. The window is marked busy in the meantime, so only
+    // modifications of other regions proceed. See Mapping_guard.
+    Delegate_result_void delegate_parallel(Tlb_cleanup& cleanup, Space_mem* snd, mword snd_base,
+                                           mword rcv_base, mword ord, Hpt::pte_t hw_attr, mword sub);
 
-    // A bitmask of CPUs that have at least one EC in this PD.
-    Cpuset cpus;
+public:
+    // hpt and stale_host_tlb are what Pd::make_current looks at on every
+    // address space switch, so they come first and start a cache line.
+    alignas(CACHE_LINE_SIZE) Hpt hpt;
 
     // A bitmask of all CPUs that may have stale host page table mappings of
     // this Space_mem's Hpt cached in their TLB.
+    //
+    // Use mark_stale_host_tlb to add CPUs, because each CPU also needs to
+    // know which addresses are stale.
     Cpuset stale_host_tlb;
 
+    // A bitmask of CPUs that have at least one EC in this PD.
+    Cpuset cpus;
+
+    Ept ept;
+
+    // Whether vCPUs let the CPU set the accessed and dirty flags in ept. The CPU treats the accesses of guest
+    // page walks as writes then, so guests fault on read-only and copy-on-write guest memory that holds
+    // their page tables. Only PDs that harvest accessed or dirty flags or use page-modification logging turn
+    // them on. It is only set with Vmcs::has_ept_ad and never cleared. Has to be accessed using atomic ops!
+    bool ept_ad{false};
+
     // A bitmask of all CPUs that may have stale guest page table mappings
     // of this Space_mem's ept cached in their TLB.
     Cpuset stale_guest_tlb;
 
-    static unsigned did_ctr;
+    // A bitmask of CPUs that execute vCPUs of other PDs with this
+    // Space_mem's ept as an additional EPT view. See Vcpu::set_ept_views.
+    // These CPUs don't run this PD, so shootdowns have to kick them anyway.
+    // A vCPU clears its CPU when it drops the view and Vcpu::run sets it
+    // again for every view before VM entry.
+    Cpuset ept_view_cpus;
+
+    // The number of page table pages that hpt and ept may use or zero, if
+    // there is no limit. Delegations that need more memory fail. See
+    // Ec::sys_pd_ctrl_kmem. Has to be accessed using atomic ops!
+    mword kmem_limit{0};
+
+    // Serializes modifications of the user part of hpt and ept. Delegations
+    // promote page tables to superpages, which is not safe against
+    // concurrent modifications of the same region. See
+    // Generic_page_table::promote. Take it with Mapping_guard.
+    Spinlock mapping_lock;
+
+private:
+    // The window that a parallel delegation populates after it dropped mapping_lock. It is empty, if there
+    // is none. Host and guest addresses are not told apart. Only accessed with mapping_lock held. See
+    // delegate_parallel.
+    mword busy_base{0};
+    mword busy_end{0};
+
+    // Returns true, if [base, base + size) overlaps the busy window.
+    bool is_busy(mword base, mword size) const
+    {
+        return base >= busy_base ? base < busy_end : busy_base - base < size;
+    }
 
+public:
+    // Holds mapping_lock to modify the region [base, base + size). It waits until no parallel delegation
+    // populates any part of this region. Readers that walk the page tables pass the whole address space,
+    // because promotion frees page tables.
+    class Mapping_guard
+    {
+        Space_mem& space;
+
+    public:
+        Mapping_guard(Space_mem& s, mword base, mword size) : space(s)
+        {
+            assert(!Cpu::preemptible());
+
+            for (space.mapping_lock.lock(); space.is_busy(base, size); space.mapping_lock.lock()) {
+                space.mapping_lock.unlock();
+                relax();
+            }
+        }
+
+        ~Mapping_guard() { space.mapping_lock.unlock(); }
+    };
+
+private:
+    // The PCID of this memory space on each CPU. Only the respective CPU accesses its entry. The array grows
+    // with NUM_CPU and would make Pd objects too large for small slabs with many CPUs, so it has its own
+    // slab cache.
+    //
+    // This costs every PD NUM_CPU * 8 bytes, e.g. 1 KiB with the default of 128 CPUs, no matter how many
+    // CPUs are online. The slab cache is created before the CPUs are known, so the size is fixed at build
+    // time. Builds for large machines should keep NUM_CPU close to the real number of CPUs.
+    struct Pcid_tags {
+        Pcid_alloc::tag_t tags[NUM_CPU];
+    };
+
+    static Slab_cache pcid_tags_cache;
+
+    // The PCID tags of the kernel memory space, which exists before slab caches are available.
+    static inline Pcid_tags kern_pcid_tags;
+
+    Pcid_tags* const pcid_tags;
+
+public:
     // Constructor for the initial kernel memory space. The HPT doubles as
     // database, which memory is safe to give to userspace.
-    Space_mem() : hpt(Hpt::make_golden_hpt()), did(Atomic::add(did_ctr, 1U)) {}
+    Space_mem() : hpt(Hpt::make_golden_hpt()), pcid_tags(&kern_pcid_tags) {}
 
     // Constructor for normal memory spaces. The hpt parameter is the source
-    // page table to populate kernel mappings.
-    explicit Space_mem(Hpt& src) : hpt(src.deep_copy(LINK_ADDR, SPC_LOCAL)), did(Atomic::add(did_ctr, 1U)) {}
+    // page table that provides the kernel mappings. Its kernel page tables
+    // are shared and not copied. The guest page table has ept_levels
+    // levels.
+    explicit Space_mem(Hpt& src, Ept::level_t ept_levels = Ept::DEFAULT_LEVELS)
+        : hpt(src.share_kernel()), ept(ept_levels),
+          pcid_tags(static_cast<Pcid_tags*>(pcid_tags_cache.alloc()))
+    {
+    }
+
+    // The shared kernel page tables belong to the source page table and
+    // must not be freed with ours.
+    ~Space_mem()
+    {
+        hpt.unshare_kernel();
+
+        if (pcid_tags != &kern_pcid_tags) {
+            pcid_tags_cache.free(pcid_tags);
+        }
+    }
 
     NONNULL inline bool lookup(mword virt, Paddr* phys) { return hpt.lookup_phys(virt, phys); }
 
     inline Tlb_cleanup insert(mword virt, unsigned o, mword attr, Paddr phys)
     {
+        Mapping_guard guard{*this, virt, 1UL << (o + PAGE_BITS)};
+
         return hpt.update({virt, phys, attr, static_cast<Hpt::ord_t>(o + PAGE_BITS)});
     }
 
     inline Paddr replace(mword v, Paddr p) { return hpt.replace(v, p); }
 
+    // Free a bounded part of the page tables of this memory space, which is not in use anymore. Returns false
+    // once only the roots are left. The kernel page tables have to be unshared before.
+    bool destroy_step() { return hpt.destroy_step() or ept.destroy_step(); }
+
+    // Guest-physical addresses have at most 52 bits, the largest MAXPHYADDR that CPUs report.
+    static constexpr mword GUEST_ADDR_LIMIT{1UL << 52};
+
+    // The end of the guest-physical addresses that delegations into the guest subspace alone may map.
+    // Delegations that include the host subspace are limited to host user addresses below USER_ADDR.
+    mword guest_addr_limit() const
+    {
+        return ept.max_levels() > Ept::DEFAULT_LEVELS ? GUEST_ADDR_LIMIT : USER_ADDR;
+    }
+
+    // Returns the number of kernel pages that the page tables of this memory space use.
+    mword kmem_pages() const { return static_cast<mword>(hpt.pages() + ept.pages()); }
+
+    // Adds the number of 2 MB and 1 GB pages in the guest page table to counts.
+    void count_guest_superpages(size_t (&counts)[2])
+    {
+        Mapping_guard guard{*this, 0, ~0UL};
+
+        ept.count_superpages(counts);
+    }
+
+    // Returns true, if this memory space must not allocate more page tables.
+    bool kmem_exhausted() const
+    {
+        mword const limit{Atomic::load(kmem_limit)};
+
+        return limit != 0 and kmem_pages() >= limit;
+    }
+
+    // Returns the PCID of this memory space on the current CPU.
+    mword pcid() const { return Pcid_alloc::id(pcid_tags->tags[Cpu::id()]); }
+
+    // Make sure that this memory space has a PCID on the current CPU. Returns true, if it got a new PCID.
+    // The TLB may still hold entries of the previous owner of a new PCID, so they have to be flushed.
+    bool assign_pcid() { return pcid_alloc().assign(pcid_tags->tags[Cpu::id()]); }
+
     void insert_root(uint64, uint64, mword = 0x7);
 
     // Claim a page for kernel use.
@@ -86,13 +248,77 @@ public:
     //
     // This function will take care of flushing DPT TLBs on its own. Host and guest page tables will be marked
     // dirty in stale_{host,guest}_tlb, but the actual TLB flushing must be taken care of by the caller.
+    //
+    // Page tables that end up fully populated with contiguous memory of identical attributes are replaced by
+    // superpages. Large delegations are populated in parallel with the help of idle CPUs.
     Delegate_result_void delegate(Tlb_cleanup& cleanup, Space_mem* snd, mword snd_base, mword rcv_base,
                                   mword ord, mword attr, mword sub);
 
     // Revoke specific rights from a region of memory.
     void revoke(Tlb_cleanup& cleanup, mword vaddr, mword ord, mword attr);
 
-    static void shootdown();
+    // Collect and optionally clear the accessed or dirty bits of the guest mappings of the pages [gpa, gpa +
+    // pages * PAGE_SIZE).
+    //
+    // Bit i of the bitmap is set if the page at gpa + i * PAGE_SIZE was accessed (or written, if dirty is
+    // set) since the bits were cleared last time. The bitmap must be zeroed and have room for the given
+    // number of pages. The CPU only sets these bits if ept_ad is set. Superpages are only accessed or
+    // dirty as a whole. The bits of superpages that extend beyond the range are not cleared.
+    void harvest(mword gpa, mword pages, bool dirty, bool clear, mword* bitmap);
+
+    // Clear the dirty bits of the guest mappings that translate the given guest-physical addresses, so the
+    // CPU logs writes to them again with page-modification logging. gpa(i) returns the i-th of the count
+    // addresses. Superpages are cleared as a whole, because the CPU only logs the first write to them.
+    // Addresses outside of the guest-physical address space are ignored. All cleared entries are invalidated
+    // with a single shootdown.
+    template <typename FN> void clear_dirty(mword count, FN gpa)
+    {
+        mword const limit{1UL << ept.max_order()};
+        bool cleared{false};
+
+        for (mword i{0}; i < count; i++) {
+            mword const addr{gpa(i)};
+
+            if (addr >= limit) {
+                continue;
+            }
+
+            Ept::Mapping const mapping{ept.lookup(addr)};
+
+            if (mapping.present()) {
+                ept.test_and_clear_leaves(mapping.vaddr, mapping.size(), Ept::PTE_D,
+                                          [&cleared](mword, Ept::ord_t) { cleared = true; });
+            }
+        }
+
+        if (cleared) {
+            stale_guest_tlb.merge(cpus);
+            shootdown();
+        }
+    }
+
+    // Mark the host TLB entries of the given range as stale on all CPUs
+    // that run ECs of this Space_mem.
+    //
+    // Each CPU collects the stale ranges of all memory spaces in one
+    // range. It uses this range for the next TLB flush of whatever memory
+    // space is current, because memory spaces that are not current do a
+    // full TLB flush when they are activated (see Pd::make_current).
+    void mark_stale_host_tlb(Tlb_range range);
+
+    // Invalidate stale host TLB entries on the current CPU, if this memory
+    // space has any. Only small ranges are invalidated page by page. All
+    // other cases flush the whole TLB.
+    //
+    // This Space_mem must be the current one.
+    void flush_stale_host_tlb();
+
+    // Make sure that no CPU uses stale TLB entries of this memory space
+    // anymore when it executes user or guest code.
+    //
+    // Only CPUs that are marked in stale_host_tlb or stale_guest_tlb are
+    // considered.
+    void shootdown();
 
     void init(unsigned);
 };
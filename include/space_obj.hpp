@@ -38,9 +38,24 @@ private:
 
     Tlb_cleanup update(mword, Capability);
 
+    // The capability slot of the given selector. Populates the capability table if needed.
+    Capability& slot(mword idx);
+
+    // Occupy an empty capability slot with Capability::reserved. Returns false if the slot is in use.
+    bool reserve(mword idx);
+
+    // Undo reserve, unless the slot was filled in the meantime.
+    void unreserve(mword idx);
+
 public:
     static unsigned const caps = (END_SPACE_LIM - SPC_LOCAL_OBJ) / sizeof(Capability);
 
+    // Look up a capability in the object space of the current PD.
+    //
+    // The capability table of each PD is mapped at SPC_LOCAL_OBJ, so this is a single memory load.
+    // Unpopulated parts of the table are backed by PAGE_0 and read as null capabilities. There is no software
+    // walk that a lookup cache could avoid: repeated lookups of the same selector hit in the TLB, and
+    // revocation only has to invalidate the TLB, which it already does.
     static inline Capability lookup(unsigned long idx)
     {
         return *reinterpret_cast<Capability*>(idx_to_virt(idx));
@@ -54,5 +69,13 @@ public:
 
     static void page_fault(mword, mword);
 
+    // Insert a newly created object into the object space and the capability derivation tree of its PD.
+    //
+    // The capability slot is claimed with a single compare-and-swap before the object goes into the tree, so
+    // CPUs that race for the same selector fail without taking the lock of the tree. Successful insertions
+    // still take the tree lock of the PD, so creating objects in one PD from several CPUs remains serialized
+    // there. The object only becomes visible in the slot once it is in the tree. Returns false if the
+    // selector is in use. The object was never visible to anyone else in this case and can be deleted right
+    // away.
     static bool insert_root(Kobject*);
 };
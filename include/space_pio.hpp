@@ -30,14 +30,23 @@ class Space_pio : public Space
 private:
     Paddr hbmp, gbmp;
 
+    // The guest bitmap that denies access to all ports. It is shared by all PDs until their guest bitmap
+    // changes or a vCPU needs its address. Only then a PD gets its own copy. See own_gbmp.
+    static Paddr deny_all_gbmp;
+
+    static constexpr mword BITS_PER_WORD{8 * sizeof(mword)};
+
     static inline mword idx_to_virt(mword idx)
     {
-        return SPC_LOCAL_IOP + (idx / 8 / sizeof(mword)) * sizeof(mword);
+        return SPC_LOCAL_IOP + (idx / BITS_PER_WORD) * sizeof(mword);
     }
 
-    static inline mword idx_to_mask(mword idx) { return 1UL << (idx % (8 * sizeof(mword))); }
+    // Returns the guest bitmap of this PD after replacing the shared one with a copy.
+    Paddr own_gbmp();
 
-    void update(bool, mword, mword);
+    // Allows (attr != 0) or denies access to cnt ports starting at idx. Whole words of the bitmap are updated
+    // at once.
+    void update(bool host, mword idx, mword cnt, mword attr);
 
 public:
     /// Construct a new Port I/O space.
@@ -26,15 +26,17 @@
 
 // A spinlock implementation based on a ticket lock.
 //
+// All waiters spin on the same cache line, so locks that many CPUs contend for should use Mcs_lock instead.
+//
 // The spinlock is best used via the Lock_guard class to avoid mismatched lock/unlock calls.
 class Spinlock
 {
 private:
-    using Ticket = uint8;
+    using Ticket = uint16;
 
-    // We use 8-bits for the individual ticket counts in val. If we ever need more CPUs, we need to use larger
+    // We use 16-bits for the individual ticket counts. If we ever need more CPUs, we need to use larger
     // integer types, because in the worst case each CPU can request one ticket.
-    static_assert(NUM_CPU < 256, "Ticket counter can overflow");
+    static_assert(NUM_CPU < 65536, "Ticket counter can overflow");
 
     // The next ticket that we will give out.
     Ticket next_ticket{0};
@@ -53,6 +55,15 @@ public:
         }
     }
 
+    // Take the lock, if it is free. Returns false without waiting otherwise.
+    bool try_lock()
+    {
+        Ticket const served{Atomic::load<Ticket, Atomic::ACQUIRE>(served_ticket)};
+
+        // The served ticket cannot move while the lock is free, so we own the lock if we get this ticket.
+        return Atomic::cmp_swap(next_ticket, served, static_cast<Ticket>(served + 1));
+    }
+
     void unlock()
     {
         assert_slow(is_locked());
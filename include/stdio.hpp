@@ -20,6 +20,7 @@
 
 #pragma once
 
+#include "atomic.hpp"
 #include "console.hpp"
 #include "string.hpp"
 
@@ -31,10 +32,11 @@ int trace_id();
 // Emit a log message to all configured consoles.
 //
 // The first parameter is one of the TRACE_ values defined below. Messages will only be printed, if the trace
-// value is included in trace_mask.
+// value is included in trace_mask. Disabled trace points cost a load of trace_mask and a branch that is
+// predicted as not taken.
 #define trace(T, format, ...)                                                                                \
     do {                                                                                                     \
-        if (EXPECT_FALSE((trace_mask & (T)) == (T))) {                                                       \
+        if (EXPECT_FALSE((Atomic::load<unsigned, Atomic::RELAXED>(trace_mask) & (T)) == (T))) {              \
             Console::print("[%3d][%s:%d] " format, trace_id(), FILENAME, __LINE__, ##__VA_ARGS__);           \
         }                                                                                                    \
     } while (0)
@@ -43,6 +45,7 @@ int trace_id();
 enum
 {
     TRACE_CPU = 1UL << 0,
+    TRACE_BOOT = 1UL << 1,
     TRACE_APIC = 1UL << 2,
     TRACE_VMX = 1UL << 4,
     TRACE_ACPI = 1UL << 8,
@@ -56,9 +59,12 @@ enum
     TRACE_ERROR = 1UL << 31,
 };
 
-// Enabled trace events.
-constexpr unsigned trace_mask =
+// The trace events that are enabled at boot.
+constexpr unsigned trace_default =
 #ifdef DEBUG
     TRACE_VMX |
 #endif
-    TRACE_CPU | TRACE_ERROR;
+    TRACE_CPU | TRACE_BOOT | TRACE_ERROR;
+
+// Enabled trace events. User space can change them at runtime via machine_ctrl_trace.
+inline unsigned trace_mask{trace_default};
@@ -32,6 +32,10 @@ extern "C" NONNULL void* memset(void* d, int c, size_t n);
 
 #endif // __STDC_HOSTED__
 
+// Select rep movsb and rep stosb for memcpy and memset. Only CPUs with Enhanced REP MOVSB/STOSB (ERMS) or
+// Fast Short REP MOV (FSRM) run them as fast as copying whole words. See Cpu::init.
+void set_fast_strings(bool on);
+
 /// Check whether the first n bytes in two strings match.
 bool strnmatch(char const* s1, char const* s2, size_t n);
 
@@ -29,6 +29,19 @@ inline void* impl_memcpy(void* d, void const* s, size_t n)
     return d;
 }
 
+// Copies whole words first. Without ERMS, rep movsb moves one byte per iteration and is slower than this.
+inline void* impl_memcpy_words(void* d, void const* s, size_t n)
+{
+    void* dummy;
+    size_t words{n / sizeof(long)}, bytes{n % sizeof(long)};
+
+    asm volatile("rep; movsq; mov %3, %2; rep; movsb"
+                 : "=D"(dummy), "+S"(s), "+c"(words)
+                 : "r"(bytes), "0"(d)
+                 : "memory");
+    return d;
+}
+
 inline void* impl_memmove(void* d, void const* s, size_t n)
 {
     if (d < s) {
@@ -50,6 +63,19 @@ inline void* impl_memset(void* d, int c, size_t n)
     return d;
 }
 
+inline void* impl_memset_words(void* d, int c, size_t n)
+{
+    void* dummy;
+    size_t words{n / sizeof(long)}, bytes{n % sizeof(long)};
+    unsigned long pattern{0x0101010101010101UL * static_cast<unsigned char>(c)};
+
+    asm volatile("rep; stosq; mov %2, %1; rep; stosb"
+                 : "=D"(dummy), "+c"(words)
+                 : "r"(bytes), "0"(d), "a"(pattern)
+                 : "memory");
+    return d;
+}
+
 inline bool impl_strnmatch(char const* s1, char const* s2, size_t n)
 {
     while (n && *s1 == *s2)
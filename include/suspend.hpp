@@ -53,6 +53,16 @@ public:
     // On a successful suspend this function will not return.
     static void suspend(uint8 slp_typa, uint8 slp_typb);
 
+    // Boot another Multiboot2 kernel without going through the firmware
+    //
+    // Userspace has to load the new kernel and its modules at their final
+    // location and prepare the Multiboot information structure. This
+    // function parks all application processors, leaves long mode and
+    // jumps to the entry point of the new kernel.
+    //
+    // On success this function will not return.
+    static void kexec(mword entry, mword mbi);
+
     // Clean up any state that was modified during suspend.
     static void resume_bsp() asm("resume_bsp");
 };
@@ -37,11 +37,14 @@ public:
     enum
     {
         DISABLE_BLOCKING = 1ul << 0,
-        DISABLE_DONATION = 1ul << 1,
-        DISABLE_REPLYCAP = 1ul << 2
+        REGISTER_MSG = 1ul << 3,
     };
 
     inline unsigned long pt() const { return ARG_1 >> ARG1_VALUE_SHIFT; }
+
+    inline bool register_msg() const { return flags() & REGISTER_MSG; }
+
+    using Sys_regs::msg_words;
 };
 
 class Sys_create_pd : public Sys_regs
@@ -54,6 +57,10 @@ public:
     inline Crd crd() const { return Crd(ARG_3); }
 
     inline bool is_passthrough() const { return flags() & 0x1; }
+
+    inline bool new_security_domain() const { return flags() & 0x2; }
+
+    inline bool large_guest_space() const { return flags() & 0x4; }
 };
 
 class Sys_create_ec : public Sys_regs
@@ -88,6 +95,14 @@ public:
     inline unsigned long ec() const { return ARG_3; }
 
     inline Qpd qpd() const { return Qpd(ARG_4); }
+
+    inline bool is_migratable() const { return flags() & 0x1; }
+
+    inline bool is_reservation() const { return flags() & 0x2; }
+
+    inline uint32 budget_us() const { return static_cast<uint32>(ARG_5); }
+
+    inline uint32 period_us() const { return static_cast<uint32>(ARG_5 >> 32); }
 };
 
 class Sys_create_pt : public Sys_regs
@@ -112,6 +127,20 @@ public:
     inline unsigned long pd() const { return ARG_2; }
 
     inline mword cnt() const { return ARG_3; }
+
+    inline bool is_notification() const { return flags() & 0x1; }
+
+    inline bool is_bound() const { return flags() & 0x2; }
+
+    inline bool is_vcpu_bound() const { return flags() & 0x4; }
+
+    inline unsigned long notification() const { return ARG_4; }
+
+    inline mword signals() const { return ARG_5; }
+
+    inline unsigned long vcpu() const { return ARG_4; }
+
+    inline mword vector() const { return ARG_5; }
 };
 
 class Sys_create_kp : public Sys_regs
@@ -120,6 +149,21 @@ public:
     inline unsigned long sel() const { return ARG_1 >> ARG1_VALUE_SHIFT; }
 
     inline unsigned long pd() const { return ARG_2; }
+
+    inline bool is_sched_stats() const { return flags() & 0x1; }
+
+    inline bool is_event_trace() const { return flags() & 0x2; }
+
+    inline bool is_lock_stat() const { return flags() & 0x4; }
+
+    inline bool is_console_log() const { return flags() & 0x8; }
+
+    // A statistics KP for all CPUs refers to their load instead. See Cpu_load.
+    inline bool is_cpu_load() const { return is_sched_stats() and ARG_3 == ~0UL; }
+
+    inline unsigned cpu() const { return static_cast<unsigned>(ARG_3); }
+
+    inline mword order() const { return ARG_3; }
 };
 
 class Sys_create_vcpu : public Sys_regs
@@ -147,6 +191,13 @@ public:
 
     inline bool remote() const { return flags() & 0x2; }
 
+    inline bool expedite() const { return flags() & 0x4; }
+
+    // A vectored revocation reads its CRDs from the UTCB instead of ARG2, which holds their number.
+    inline bool is_vectored() const { return flags() & 0x8; }
+
+    inline mword num_entries() const { return ARG_2; }
+
     inline mword pd() const { return ARG_3; }
 };
 
@@ -159,15 +210,33 @@ public:
         MAP_ACCESS_PAGE,
         DELEGATE,
         MSR_ACCESS,
+        KMEM,
+        MSR_ACCESS_VECTOR,
+        EPT_FILL,
+        TEARDOWN_SM,
     };
 
-    ctrl_op op() const { return static_cast<ctrl_op>(flags() & 0x3); }
+    // The sub-operation is in ARG1[9:8] with ARG1[11] as its upper bit. ARG1[10] is a flag of the
+    // individual sub-operations.
+    ctrl_op op() const { return static_cast<ctrl_op>((flags() & 0x3) | (flags() & 0x8) >> 1); }
 };
 
 class Sys_pd_ctrl_lookup : public Sys_regs
 {
 public:
     inline Crd& crd() { return reinterpret_cast<Crd&>(ARG_2); }
+
+    // A range lookup stores the CRDs of all mappings from the base of the CRD in ARG2 up to the limit in ARG3
+    // in the UTCB instead of returning a single one.
+    inline bool is_range() const { return flags() & 0x4; }
+
+    inline mword limit() const { return ARG_3; }
+
+    inline void set_result(mword num, mword resume)
+    {
+        ARG_2 = num;
+        ARG_3 = resume;
+    }
 };
 
 class Sys_pd_ctrl_map_access_page : public Sys_regs
@@ -192,6 +261,22 @@ public:
     }
 
     inline Crd dst_crd() const { return Crd{ARG_5}; }
+
+    // A vectored delegation reads its items from the UTCB instead of ARG3 to ARG5. Each entry consists of the
+    // source CRD, the delegate flags and the destination CRD.
+    static constexpr mword VECTOR_ENTRY_WORDS{3};
+
+    inline bool is_vectored() const { return flags() & 0x4; }
+
+    // A broadcast delegation is a vectored delegation without a destination PD. The UTCB holds one entry
+    // followed by the capability selectors of the destination PDs.
+    static constexpr mword BROADCAST{~0UL};
+
+    inline bool is_broadcast() const { return is_vectored() and dst_pd() == BROADCAST; }
+
+    inline mword num_entries() const { return ARG_3; }
+
+    inline void set_num_done(mword n) { ARG_2 = n; }
 };
 
 class Sys_pd_ctrl_msr_access : public Sys_regs
@@ -204,10 +289,70 @@ public:
     inline void set_msr_value(uint64 v) { ARG_2 = v; }
 };
 
+class Sys_pd_ctrl_msr_access_vector : public Sys_regs
+{
+public:
+    // Each entry in the UTCB consists of the MSR index with the write flag in bit 32 and the MSR value.
+    static constexpr mword VECTOR_ENTRY_WORDS{2};
+    static constexpr mword ENTRY_WRITE{1UL << 32};
+
+    inline mword num_entries() const { return ARG_1 >> ARG1_VALUE_SHIFT; }
+
+    inline void set_num_done(mword n) { ARG_2 = n; }
+};
+
+class Sys_pd_ctrl_kmem : public Sys_regs
+{
+public:
+    inline mword pd() const { return ARG_1 >> ARG1_VALUE_SHIFT; }
+    inline bool is_set_limit() const { return flags() & 4; }
+    inline mword limit() const { return ARG_2; }
+
+    inline void set_usage(mword pages, mword limit)
+    {
+        ARG_2 = pages;
+        ARG_3 = limit;
+    }
+
+    inline void set_guest_superpages(mword twomb, mword onegb)
+    {
+        ARG_4 = twomb;
+        ARG_5 = onegb;
+    }
+};
+
+class Sys_pd_ctrl_ept_fill : public Sys_regs
+{
+public:
+    inline mword pd() const { return ARG_1 >> ARG1_VALUE_SHIFT; }
+    inline mword guest_base() const { return ARG_2; }
+    inline mword host_base() const { return ARG_3; }
+    inline mword size() const { return ARG_4; }
+    inline mword attr() const { return ARG_5 & 0x1f; }
+    inline mword order() const { return (ARG_5 >> 8) & 0xff; }
+};
+
+class Sys_pd_ctrl_teardown_sm : public Sys_regs
+{
+public:
+    inline mword pd() const { return ARG_1 >> ARG1_VALUE_SHIFT; }
+    inline bool is_remove() const { return flags() & 4; }
+    inline mword sm() const { return ARG_2; }
+};
+
 class Sys_reply : public Sys_regs
 {
 public:
+    enum
+    {
+        REGISTER_MSG = 1ul << 0,
+    };
+
     inline unsigned long sm() const { return ARG_1 >> ARG1_VALUE_SHIFT; }
+
+    inline bool register_msg() const { return flags() & REGISTER_MSG; }
+
+    using Sys_regs::msg_words;
 };
 
 class Sys_ec_ctrl : public Sys_regs
@@ -216,6 +361,7 @@ public:
     enum ctrl_op : unsigned
     {
         YIELD = 1,
+        YIELD_TO = 2,
     };
 
     inline unsigned long ec() const { return ARG_1 >> ARG1_VALUE_SHIFT; }
@@ -228,6 +374,10 @@ class Sys_sc_ctrl : public Sys_regs
 public:
     inline unsigned long sc() const { return ARG_1 >> ARG1_VALUE_SHIFT; }
 
+    inline bool set_hwp_request() const { return flags() & 0x1; }
+
+    inline uint64 hwp_request() const { return ARG_2; }
+
     inline void set_time(uint64 val)
     {
         ARG_2 = static_cast<mword>(val >> 32);
@@ -259,7 +409,21 @@ public:
 
     inline unsigned zc() const { return flags() & 0x2; }
 
+    // A conditional "down" only blocks if a word in a kernel page still has the expected value. This lets
+    // user space keep the semaphore counter in shared memory and only enter the kernel to block or wake.
+    inline bool is_conditional() const { return flags() & 0x4; }
+
+    inline unsigned long kp() const { return ARG_2; }
+
+    inline mword offset() const { return ARG_3; }
+
+    inline uint64 expected() const { return ARG_4; }
+
     inline uint64 time() const { return static_cast<uint64>(ARG_2) << 32 | ARG_3; }
+
+    inline mword signals() const { return ARG_2; }
+
+    inline void set_signals(mword s) { ARG_2 = s; }
 };
 
 class Sys_kp_ctrl : public Sys_regs
@@ -284,12 +448,16 @@ public:
     inline mword dst_pd() const { return ARG_2; }
 
     inline mword dst_addr() const { return ARG_3; }
+
+    inline bool peer() const { return flags() & 0x4; }
 };
 
 class Sys_kp_ctrl_unmap : public Sys_regs
 {
 public:
     inline mword kp() const { return ARG_1 >> ARG1_VALUE_SHIFT; }
+
+    inline bool peer() const { return flags() & 0x4; }
 };
 
 class Sys_machine_ctrl : public Sys_regs
@@ -299,9 +467,17 @@ public:
     {
         SUSPEND = 0,
         UPDATE_MICROCODE = 1,
+        MEM_STATS = 2,
+        STATS = 3,
+        TRACE = 4,
+        PMU = 5,
+        ISOLATE = 6,
+        RDT = 7,
     };
 
-    inline ctrl_op op() const { return static_cast<ctrl_op>(flags() & 0x3); }
+    // The sub-operation is in ARG1[9:8] with ARG1[11] as its upper bit. ARG1[10] is a flag of the
+    // individual sub-operations.
+    inline ctrl_op op() const { return static_cast<ctrl_op>((flags() & 0x3) | (flags() & 0x8) >> 1); }
 };
 
 class Sys_machine_ctrl_suspend : public Sys_machine_ctrl
@@ -316,6 +492,8 @@ public:
         REAL_MODE = 0,
     };
 
+    inline bool kexec() const { return flags() & 0x4; }
+
     inline uint8 slp_typa() const { return (ARG_1 >> SLP_TYPA_SHIFT) & 0xFF; }
     inline uint8 slp_typb() const { return (ARG_1 >> SLP_TYPB_SHIFT) & 0xFF; }
 
@@ -325,11 +503,85 @@ public:
     }
 };
 
+class Sys_machine_ctrl_kexec : public Sys_machine_ctrl
+{
+public:
+    inline mword entry() const { return ARG_2; }
+    inline mword mbi() const { return ARG_3; }
+};
+
 class Sys_machine_ctrl_update_microcode : public Sys_machine_ctrl
 {
 public:
     inline unsigned size() const { return static_cast<unsigned>(ARG_1) >> ARG1_VALUE_SHIFT; }
     inline mword update_address() const { return static_cast<mword>(ARG_2); }
+    inline bool all_cpus() const { return flags() & 0x4; }
+
+    inline void set_revision(uint32 revision) { ARG_2 = revision; }
+};
+
+class Sys_machine_ctrl_mem_stats : public Sys_machine_ctrl
+{
+public:
+    inline bool drain() const { return flags() & 0x4; }
+
+    inline void set_result(mword orders, mword drained, mword caches)
+    {
+        ARG_2 = orders;
+        ARG_3 = drained;
+        ARG_4 = caches;
+    }
+};
+
+class Sys_machine_ctrl_trace : public Sys_machine_ctrl
+{
+public:
+    inline unsigned enable() const { return static_cast<unsigned>(ARG_2); }
+    inline unsigned disable() const { return static_cast<unsigned>(ARG_3); }
+
+    inline void set_result(unsigned mask) { ARG_2 = mask; }
+};
+
+class Sys_machine_ctrl_pmu : public Sys_machine_ctrl
+{
+public:
+    inline bool stop() const { return flags() & 0x4; }
+    inline mword kp() const { return ARG_2; }
+};
+
+class Sys_machine_ctrl_isolate : public Sys_machine_ctrl
+{
+public:
+    inline bool disable() const { return flags() & 0x4; }
+    inline unsigned cpu() const { return static_cast<unsigned>(ARG_2); }
+};
+
+class Sys_machine_ctrl_rdt : public Sys_machine_ctrl
+{
+public:
+    // Assign a class of service to a PD instead of programming a resource.
+    inline bool assign() const { return flags() & 0x4; }
+
+    inline mword pd() const { return ARG_2; }
+    inline unsigned resource() const { return static_cast<unsigned>(ARG_2); }
+    inline unsigned cos() const { return static_cast<unsigned>(ARG_3); }
+    inline uint64 value() const { return ARG_4; }
+    inline unsigned rmid() const { return static_cast<unsigned>(ARG_4); }
+
+    // Monitoring events are read for the RMIDs from the one in ARG3 on.
+    inline unsigned first_rmid() const { return static_cast<unsigned>(ARG_3); }
+
+    inline void set_result(mword counters) { ARG_2 = counters; }
+};
+
+class Sys_machine_ctrl_stats : public Sys_machine_ctrl
+{
+public:
+    inline void set_result(mword bytes, mword cpus)
+    {
+        ARG_2 = bytes;
+        ARG_3 = cpus;
+    }
 };
 
 class Sys_vcpu_ctrl : public Sys_regs
@@ -339,9 +591,23 @@ public:
     {
         RUN = 0,
         POKE = 1,
+        EXIT_POLICY = 2,
+        MTD_PROFILE = 3,
+        PML = 4,
+        HARVEST_DIRTY = 5,
+        POST_INTR = 6,
+        EXIT_STATS = 7,
+        VMCS_SHADOW = 8,
+        VMCS_SHADOW_ACCESS = 9,
+        POKE_BATCH = 10,
+        PMU = 11,
+        SNAPSHOT = 12,
+        IOEVENT = 13,
+        IO_RING = 14,
+        VMCALL_PORTAL = 15,
     };
 
-    inline ctrl_op op() const { return static_cast<ctrl_op>(flags() & 0x3u); }
+    inline ctrl_op op() const { return static_cast<ctrl_op>(flags() & 0xfu); }
 };
 
 class Sys_vcpu_ctrl_run : public Sys_vcpu_ctrl
@@ -355,4 +621,211 @@ class Sys_vcpu_ctrl_poke : public Sys_vcpu_ctrl
 {
 public:
     inline unsigned long sel() const { return ARG_1 >> ARG1_VALUE_SHIFT; }
+
+    // Only make the guest notice the interrupts in the virtual-APIC page instead of exiting.
+    inline bool soft() const { return ARG_2 & 0x1; }
+};
+
+class Sys_vcpu_ctrl_poke_batch : public Sys_vcpu_ctrl
+{
+public:
+    inline mword count() const { return ARG_2; }
+
+    inline void set_poked(mword vcpus) { ARG_2 = vcpus; }
+};
+
+class Sys_vcpu_ctrl_exit_policy : public Sys_vcpu_ctrl
+{
+public:
+    inline unsigned long sel() const { return ARG_1 >> ARG1_VALUE_SHIFT; }
+    inline mword policy() const { return ARG_2; }
+    inline unsigned long cpuid_kp() const { return ARG_3; }
+    inline mword pv_index() const { return ARG_4; }
+    inline unsigned long steal_time_kp() const { return ARG_5; }
+};
+
+class Sys_vcpu_ctrl_mtd_profile : public Sys_vcpu_ctrl
+{
+public:
+    inline unsigned long sel() const { return ARG_1 >> ARG1_VALUE_SHIFT; }
+    inline unsigned long profile_kp() const { return ARG_2; }
+    inline bool enable() const { return ARG_3 & 0x1; }
+};
+
+class Sys_vcpu_ctrl_pml : public Sys_vcpu_ctrl
+{
+public:
+    inline unsigned long sel() const { return ARG_1 >> ARG1_VALUE_SHIFT; }
+    inline unsigned long buffer_kp() const { return ARG_2; }
+    inline bool enable() const { return ARG_3 & 0x1; }
+    inline bool dirty_ring() const { return ARG_3 & 0x2; }
+    inline unsigned long dirty_ring_kp() const { return ARG_4; }
+
+    inline void set_logged(mword entries) { ARG_2 = entries; }
+};
+
+class Sys_vcpu_ctrl_harvest_dirty : public Sys_vcpu_ctrl
+{
+public:
+    inline unsigned long sel() const { return ARG_1 >> ARG1_VALUE_SHIFT; }
+    inline mword page() const { return ARG_2; }
+    inline mword count() const { return ARG_3; }
+
+    // Collect accessed instead of dirty flags.
+    inline bool accessed() const { return ARG_4 & 0x1; }
+
+    // Leave the flags set.
+    inline bool keep() const { return ARG_4 & 0x2; }
+
+    // Reset the consumed entries of the dirty ring in the KP in ARG2 instead of a range.
+    inline bool ring() const { return ARG_4 & 0x4; }
+    inline unsigned long ring_kp() const { return ARG_2; }
+
+    inline void set_reset(mword entries) { ARG_2 = entries; }
+};
+
+class Sys_vcpu_ctrl_post_intr : public Sys_vcpu_ctrl
+{
+public:
+    inline unsigned long sel() const { return ARG_1 >> ARG1_VALUE_SHIFT; }
+    inline mword vector() const { return ARG_2; }
+};
+
+class Sys_vcpu_ctrl_exit_stats : public Sys_vcpu_ctrl
+{
+public:
+    inline unsigned long sel() const { return ARG_1 >> ARG1_VALUE_SHIFT; }
+    inline unsigned long stats_kp() const { return ARG_2; }
+    inline bool enable() const { return ARG_3 & 0x1; }
+};
+
+class Sys_vcpu_ctrl_pmu : public Sys_vcpu_ctrl
+{
+public:
+    inline unsigned long sel() const { return ARG_1 >> ARG1_VALUE_SHIFT; }
+    inline bool enable() const { return ARG_2 & 0x1; }
+};
+
+class Sys_vcpu_ctrl_snapshot : public Sys_vcpu_ctrl
+{
+public:
+    inline unsigned long sel() const { return ARG_1 >> ARG1_VALUE_SHIFT; }
+    inline unsigned long snapshot_kp() const { return ARG_2; }
+    inline bool restore() const { return ARG_3 & 0x1; }
+};
+
+class Sys_vcpu_ctrl_ioevent : public Sys_vcpu_ctrl
+{
+public:
+    inline unsigned long sel() const { return ARG_1 >> ARG1_VALUE_SHIFT; }
+    inline unsigned long sm() const { return ARG_2; }
+    inline mword slot() const { return ARG_3 & 0xff; }
+    inline bool enable() const { return ARG_3 & 0x100; }
+    inline bool match_value() const { return ARG_3 & 0x200; }
+    inline uint16 port() const { return static_cast<uint16>(ARG_4); }
+    inline mword size() const { return (ARG_4 >> 16) & 0xff; }
+    inline uint32 value() const { return static_cast<uint32>(ARG_5); }
+};
+
+class Sys_vcpu_ctrl_io_ring : public Sys_vcpu_ctrl
+{
+public:
+    inline unsigned long sel() const { return ARG_1 >> ARG1_VALUE_SHIFT; }
+    inline unsigned long ring_kp() const { return ARG_2; }
+    inline bool enable() const { return ARG_3 & 0x1; }
+};
+
+class Sys_vcpu_ctrl_vmcall_portal : public Sys_vcpu_ctrl
+{
+public:
+    inline unsigned long sel() const { return ARG_1 >> ARG1_VALUE_SHIFT; }
+    inline unsigned long pt() const { return ARG_2; }
+    inline mword nr() const { return ARG_3 & 0xff; }
+    inline bool enable() const { return ARG_3 & 0x100; }
+};
+
+class Sys_vcpu_ctrl_vmcs_shadow : public Sys_vcpu_ctrl
+{
+public:
+    inline unsigned long sel() const { return ARG_1 >> ARG1_VALUE_SHIFT; }
+    inline unsigned long vmread_bitmap_kp() const { return ARG_2; }
+    inline unsigned long vmwrite_bitmap_kp() const { return ARG_3; }
+    inline bool enable() const { return ARG_4 & 0x1; }
+};
+
+class Sys_vcpu_ctrl_vmcs_shadow_access : public Sys_vcpu_ctrl
+{
+public:
+    // Each field in the UTCB consists of its encoding and its value.
+    static constexpr mword FIELD_WORDS{2};
+
+    inline unsigned long sel() const { return ARG_1 >> ARG1_VALUE_SHIFT; }
+    inline mword count() const { return ARG_2; }
+    inline bool write() const { return ARG_3 & 0x1; }
+
+    inline void set_accessed(mword fields) { ARG_2 = fields; }
+};
+
+class Sys_vcpu_migrate : public Sys_regs
+{
+public:
+    inline unsigned long sel() const { return ARG_1 >> ARG1_VALUE_SHIFT; }
+
+    inline unsigned cpu() const { return ARG_2 & 0xfff; }
+};
+
+class Sys_vcpu_ept_views : public Sys_regs
+{
+public:
+    inline unsigned long sel() const { return ARG_1 >> ARG1_VALUE_SHIFT; }
+
+    // The PD selectors of the views are in the UTCB.
+    inline mword count() const { return ARG_2; }
+};
+
+class Sys_batch : public Sys_regs
+{
+public:
+    // Each batch entry in the UTCB consists of the ARG1 to ARG5 values of one hypercall.
+    static constexpr mword ENTRY_WORDS{5};
+
+    inline unsigned long count() const { return ARG_1 >> ARG1_VALUE_SHIFT; }
+
+    inline bool repeat() const { return flags() & 0x1; }
+
+    inline void load_entry(mword const* entry)
+    {
+        ARG_1 = entry[0];
+        ARG_2 = entry[1];
+        ARG_3 = entry[2];
+        ARG_4 = entry[3];
+        ARG_5 = entry[4];
+    }
+
+    // Only OUT1 and OUT2 are defined as output registers, so only these are written back.
+    inline void store_entry(mword* entry) const
+    {
+        entry[0] = ARG_1;
+        entry[1] = ARG_2;
+    }
+
+    // Whether ARG1[63:12] of the loaded entry is the destination selector of a new object.
+    inline bool creates_object() const
+    {
+        switch (id()) {
+        case hypercall_id::HC_CREATE_EC:
+        case hypercall_id::HC_CREATE_SC:
+        case hypercall_id::HC_CREATE_PT:
+        case hypercall_id::HC_CREATE_SM:
+        case hypercall_id::HC_CREATE_KP:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    // The destination selector of the n-th execution of a repeated entry. See creates_object.
+    inline void offset_selector(mword n) { ARG_1 += n << ARG1_VALUE_SHIFT; }
+
+    inline void set_result(Status s, mword completed) { ARG_1 = completed << ARG1_VALUE_SHIFT | s; }
 };
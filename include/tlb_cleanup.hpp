@@ -18,55 +18,164 @@
 #pragma once
 
 #include "assert.hpp"
-#include "buddy.hpp"
 #include "compiler.hpp"
+#include "math.hpp"
+#include "memory.hpp"
 #include "types.hpp"
 #include "util.hpp"
 
+// A range of virtual addresses with stale TLB entries.
+//
+// The range is encoded in a single word, so it can be updated atomically for
+// other CPUs. Ranges that cover more than MAX_PAGES pages degrade into a
+// full TLB flush, because invalidating them page by page is more expensive
+// than refilling the TLB.
+class Tlb_range
+{
+    // Either EMPTY, FULL or the page-aligned start address combined with the
+    // number of pages in the lower bits.
+    mword val_;
+
+    static constexpr mword EMPTY{0};
+    static constexpr mword FULL{~0UL};
+
+public:
+    static constexpr mword MAX_PAGES{32};
+    static_assert(MAX_PAGES < PAGE_SIZE, "The page count must fit into the page offset");
+
+    explicit Tlb_range(mword val = EMPTY) : val_{val} {}
+
+    // A range that requires flushing the whole TLB.
+    static Tlb_range full() { return Tlb_range{FULL}; }
+
+    // The range [vaddr, vaddr + size).
+    static Tlb_range of(mword vaddr, mword size)
+    {
+        if (size > MAX_PAGES * PAGE_SIZE) {
+            return full();
+        }
+
+        mword const start{align_dn(vaddr, PAGE_SIZE)};
+        mword const pages{(align_up(vaddr + size, PAGE_SIZE) - start) >> PAGE_BITS};
+
+        return Tlb_range{pages == 0 or pages > MAX_PAGES ? FULL : start | pages};
+    }
+
+    mword raw() const { return val_; }
+
+    bool empty() const { return val_ == EMPTY; }
+    bool is_full() const { return val_ == FULL; }
+
+    mword start() const { return val_ & ~PAGE_MASK; }
+    mword pages() const { return val_ & PAGE_MASK; }
+
+    // Return the smallest range that covers both ranges.
+    Tlb_range join(Tlb_range const& rhs) const
+    {
+        if (empty() or rhs.is_full()) {
+            return rhs;
+        }
+
+        if (rhs.empty() or is_full()) {
+            return *this;
+        }
+
+        mword const lo{min(start(), rhs.start())};
+        mword const hi{max(start() + (pages() << PAGE_BITS), rhs.start() + (rhs.pages() << PAGE_BITS))};
+
+        return of(lo, hi - lo);
+    }
+};
+
 // Deferred cleanup of page table structures and TLB flush tracking.
 //
 // This class does not implement the TLB flushing logic itself as this is
 // specific to the page table in question.
+//
+// Page table pages that are marked for reclamation are collected in a
+// list that is linked through their Buddy metadata, because the hardware
+// may still walk them until the TLB flush. When the object is destroyed,
+// the TLB flush must have happened and the pages are handed to RCU,
+// because other CPUs may still walk them in software. They are freed in
+// one batch after the grace period, first into the page table cache of
+// the CPU. See Buddy::try_alloc_page_table.
 class Tlb_cleanup
 {
+public:
+    using pointer = mword*;
+
+private:
     bool tlb_flush_{false};
 
+    // The addresses that need a TLB flush. This is only meaningful if
+    // tlb_flush_ is set.
+    Tlb_range range_;
+
+    // The first and last page that wait for reclamation. See
+    // Buddy::set_next_used.
+    pointer pages_{nullptr};
+    pointer pages_last_{nullptr};
+
+    // Append the list from first to last.
+    void append(pointer first, pointer last);
+
+    // Hand all pending pages to RCU.
+    void free_pages_deferred();
+
 public:
-    using pointer = mword*;
 
     // Returns true, if a TLB flush is scheduled.
     WARN_UNUSED_RESULT bool need_tlb_flush() const { return tlb_flush_; }
 
+    // Returns the addresses that need to be flushed, if need_tlb_flush()
+    // is true.
+    Tlb_range tlb_range() const { return range_; }
+
     // Discard a scheduled TLB flush.
     //
     // This should be done with care as wrong usage will end up in TLB
     // invalidation bugs.
-    void ignore_tlb_flush() { tlb_flush_ = false; }
+    void ignore_tlb_flush()
+    {
+        tlb_flush_ = false;
+        range_ = Tlb_range{};
+    }
 
-    // Schedule a TLB flush.
-    void flush_tlb_later() { tlb_flush_ = true; }
+    // Schedule a flush of the whole TLB.
+    void flush_tlb_later() { flush_tlb_later(Tlb_range::full()); }
 
-    // Free all pages that were marked for deferred reclamation immediately.
-    void free_pages_now()
-    {
-        assert(not tlb_flush_);
+    // Schedule a TLB flush for [vaddr, vaddr + size).
+    void flush_tlb_later(mword vaddr, mword size) { flush_tlb_later(Tlb_range::of(vaddr, size)); }
 
-        // Not implemented yet.
+    void flush_tlb_later(Tlb_range const& range)
+    {
+        tlb_flush_ = true;
+        range_ = range_.join(range);
     }
 
+    // Free all pages that were marked for deferred reclamation immediately.
+    //
+    // This is only safe if nothing can reference the pages anymore, not
+    // even concurrent page table walks in software.
+    void free_pages_now();
+
     // Mark a page as to-be-freed after the next TLB flush.
     //
     // It is safe to be read from and written to until the TLB flush
     // actually happens.
+    //
+    // The content of the page stays untouched, because the hardware may
+    // still walk it until the TLB flush and the accessed and dirty bits it
+    // sets there must not corrupt the list.
+    //
+    // Freed page tables do not widen the range of the TLB flush, because
+    // invalidating any address also invalidates the paging-structure
+    // caches.
     void free_later(pointer page)
     {
         tlb_flush_ = true;
 
-        // This is not correct, because we need to defer freeing this page
-        // until the TLB flush has happened. As the broken behavior was
-        // already in the kernel, continue to live in the danger zone until
-        // we fix this issue for good.
-        Buddy::allocator.free(reinterpret_cast<mword>(page));
+        append(page, page);
     }
 
     // Merge two Tlb_cleanup objects.
@@ -76,13 +185,23 @@ public:
     // deferred action pending.
     template <typename CLEANUP> void merge(CLEANUP&& rhs)
     {
-        tlb_flush_ |= rhs.tlb_flush_;
+        if (rhs.tlb_flush_) {
+            flush_tlb_later(rhs.range_);
+        }
+
         rhs.ignore_tlb_flush();
+
+        if (rhs.pages_) {
+            append(rhs.pages_, rhs.pages_last_);
+
+            rhs.pages_ = nullptr;
+            rhs.pages_last_ = nullptr;
+        }
     }
 
     Tlb_cleanup& operator=(Tlb_cleanup&& rhs)
     {
-        assert(not tlb_flush_);
+        assert(not tlb_flush_ and not pages_);
 
         merge(rhs);
         return *this;
@@ -94,16 +213,20 @@ public:
     Tlb_cleanup(Tlb_cleanup const& rhs) = delete;
 
     Tlb_cleanup() = default;
-    explicit Tlb_cleanup(bool tlb_flush) : tlb_flush_{tlb_flush} {}
+    explicit Tlb_cleanup(bool tlb_flush)
+        : tlb_flush_{tlb_flush}, range_{tlb_flush ? Tlb_range::full() : Tlb_range{}}
+    {
+    }
 
     // A named convenience constructor for readable code.
     static Tlb_cleanup tlb_flush(bool tlb_flush) { return Tlb_cleanup{tlb_flush}; }
 
+    // Not all callers discard the scheduled TLB flush after they have
+    // flushed, so we cannot assert that no TLB flush is pending here.
     ~Tlb_cleanup()
     {
-        // Once we fully implement this class, at destruction time there
-        // should be no TLB flush pending and all pages can be freed.
-        //
-        // assert (not tlb_flush_);
+        if (EXPECT_FALSE(pages_)) {
+            free_pages_deferred();
+        }
     }
 };
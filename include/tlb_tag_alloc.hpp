@@ -0,0 +1,68 @@
+/*
+ * TLB tag allocation
+ *
+ * This file is part of the Hedron hypervisor.
+ *
+ * Hedron is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Hedron is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License version 2 for more details.
+ */
+
+#pragma once
+
+#include "compiler.hpp"
+#include "types.hpp"
+
+// Allocates the identifiers that tag TLB entries on one CPU, such as PCIDs or VPIDs. BITS is the width of
+// an identifier.
+//
+// There are far fewer identifiers than address spaces, so identifiers are handed out in generations. An
+// address space keeps its identifier as long as the generation it got it in is current. Once all
+// identifiers of a generation are handed out, the next generation starts and address spaces lazily get a new
+// identifier when they are used the next time.
+//
+// Identifier zero is never handed out. A zero-initialized allocator is ready for use.
+template <unsigned BITS> class Tlb_tag_alloc
+{
+    static constexpr mword MAX_ID{(static_cast<mword>(1) << BITS) - 1};
+
+    uint64 generation_{0};
+
+    // The identifier that was handed out last in the current generation.
+    mword last_{0};
+
+public:
+    // An identifier in the lower BITS bits and the generation it was handed out in above. Zero is a tag that
+    // never has a valid identifier.
+    using tag_t = uint64;
+
+    static mword id(tag_t tag) { return tag & MAX_ID; }
+
+    // Make sure that the tag has an identifier of the current generation.
+    //
+    // Returns true, if the tag got a new identifier. The TLB may still hold entries of the previous owner
+    // of this identifier, so the caller has to flush the TLB entries of the identifier before it uses it.
+    bool assign(tag_t& tag)
+    {
+        if (EXPECT_TRUE(tag != 0 and tag >> BITS == generation_)) {
+            return false;
+        }
+
+        if (EXPECT_FALSE(last_ == MAX_ID)) {
+            generation_++;
+            last_ = 0;
+        }
+
+        tag = generation_ << BITS | ++last_;
+        return true;
+    }
+};
+
+// PCIDs are 12 bits wide, VPIDs 16 bits.
+using Pcid_alloc = Tlb_tag_alloc<12>;
+using Vpid_alloc = Tlb_tag_alloc<16>;
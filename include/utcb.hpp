@@ -24,9 +24,12 @@
 
 #pragma once
 
+#include "barrier.hpp"
 #include "buddy.hpp"
+#include "cpu.hpp"
 #include "crd.hpp"
 #include "math.hpp"
+#include "mtd.hpp"
 
 class Cpu_regs;
 
@@ -53,6 +56,10 @@ enum Utcb_exit_flags
     //
     // This is only set for passthrough vCPUs.
     NMI_PENDING = 1 << 0,
+
+    // A performance counter of the guest overflowed. The VMM should deliver the interrupt that the guest
+    // configured in the performance counter LVT entry of its LAPIC. See Vcpu::set_pmu.
+    PMI_PENDING = 1 << 1,
 };
 
 class Utcb_head
@@ -111,6 +118,21 @@ protected:
             // 32 bits in size, because a VMX_ENTRY_FAILURE needs 32 bits.
             uint32 exit_reason;
             uint32 exit_flags; // See Utcb_exit_flags above.
+
+            // The TSC multiplier of a vCPU with TSC scaling (Mtd::TSC_SCALE). The guest TSC is the host TSC
+            // times this fixed-point number with 48 fractional bits plus tsc_off.
+            uint64 tsc_multiplier;
+
+            // The in-service vectors of the emulated LAPIC (see vcpu_ctrl_exit_policy). The hypervisor sets
+            // the bits of posted interrupts that it injects, the VMM clears them when the guest ends them.
+            uint64 injected_vectors[4];
+
+            // The EPT view that the guest uses (Mtd::EPT_VIEW). See vcpu_ept_views.
+            uint64 ept_view;
+
+            // The TSC deadline that the guest armed in guest TSC ticks, or zero. The hypervisor writes it on
+            // each exit to the VMM with EXIT_POLICY_TSC_DEADLINE (see vcpu_ctrl_exit_policy).
+            uint64 tsc_deadline;
         };
 
         mword data_begin;
@@ -118,22 +140,33 @@ protected:
 };
 
 class Vcpu;
+class Vmx_exit_cache;
 
 class Utcb : public Utcb_head, private Utcb_data
 {
+    // The field transfers of load_vmx and save_vmx. PROFILE is either zero or the value of the MTD. See
+    // Utcb::load_vmx.
+    template <mword PROFILE> void load_vmx_fields(Cpu_regs*, mword, Vmx_exit_cache&);
+    template <mword PROFILE> void save_vmx_fields(Cpu_regs*, mword, const bool);
+
     // TODO: the Vcpu class needs direct access to some members of this class. Making the Vcpu a friend of
     // the Utcb is just a workaround! We should decouple the vCPU-State and the UTCB in the near future. See
     // hedron#252.
     friend class Vcpu;
 
-private:
+public:
+    // The number of message words in the UTCB.
     static mword const words = (PAGE_SIZE - sizeof(Utcb_head)) / sizeof(mword);
 
-public:
-    WARN_UNUSED_RESULT bool load_exc(Cpu_regs*);
-    WARN_UNUSED_RESULT bool save_exc(Cpu_regs*);
+    // Transfers the exception state of an EC. They return true, if the MTD includes the FPU.
+    //
+    // REGS is Cpu_regs in the kernel. The transfers only touch the MTD and the general-purpose registers, so
+    // they also build for the host with a stand-in (see test/bench/utcb.cpp).
+    template <typename REGS> WARN_UNUSED_RESULT bool load_exc(REGS*);
+    template <typename REGS> WARN_UNUSED_RESULT bool save_exc(REGS*);
 
-    void load_vmx(Cpu_regs*);
+    // Transfers the vCPU state from the VMCS. The VM-exit information comes from the cache of the vCPU.
+    void load_vmx(Cpu_regs*, Vmx_exit_cache&);
     void save_vmx(Cpu_regs* regs, const bool passthrough_vcpu);
 
     inline mword ucnt() const { return static_cast<uint16>(items); }
@@ -161,3 +194,92 @@ public:
 
     static inline void operator delete(void* ptr) { Buddy::allocator.free(reinterpret_cast<mword>(ptr)); }
 };
+
+template <typename REGS> bool Utcb::load_exc(REGS* regs)
+{
+    mword m = regs->mtd;
+
+    if (m & Mtd::GPR_ACDB) {
+        rax = regs->rax;
+        rcx = regs->rcx;
+        rdx = regs->rdx;
+        rbx = regs->rbx;
+    }
+
+    if (m & Mtd::GPR_BSD) {
+        rbp = regs->rbp;
+        rsi = regs->rsi;
+        rdi = regs->rdi;
+    }
+
+    if (m & Mtd::GPR_R8_R15) {
+        r8 = regs->r8;
+        r9 = regs->r9;
+        r10 = regs->r10;
+        r11 = regs->r11;
+        r12 = regs->r12;
+        r13 = regs->r13;
+        r14 = regs->r14;
+        r15 = regs->r15;
+    }
+
+    if (m & Mtd::RSP)
+        rsp = regs->rsp;
+
+    if (m & Mtd::RIP_LEN)
+        rip = regs->rip;
+
+    if (m & Mtd::RFLAGS)
+        rflags = regs->rfl;
+
+    if (m & Mtd::QUAL) {
+        qual[0] = regs->err;
+        qual[1] = regs->cr2;
+    }
+
+    barrier();
+    mtd = m;
+    items = sizeof(Utcb_data) / sizeof(mword);
+
+    return m & Mtd::FPU;
+}
+
+// Only the register groups in the MTD the handler leaves in the UTCB are written back. This is how handlers
+// avoid the cost of copying state they did not modify.
+template <typename REGS> bool Utcb::save_exc(REGS* regs)
+{
+    if (mtd & Mtd::GPR_ACDB) {
+        regs->rax = rax;
+        regs->rcx = rcx;
+        regs->rdx = rdx;
+        regs->rbx = rbx;
+    }
+
+    if (mtd & Mtd::GPR_BSD) {
+        regs->rbp = rbp;
+        regs->rsi = rsi;
+        regs->rdi = rdi;
+    }
+
+    if (mtd & Mtd::GPR_R8_R15) {
+        regs->r8 = r8;
+        regs->r9 = r9;
+        regs->r10 = r10;
+        regs->r11 = r11;
+        regs->r12 = r12;
+        regs->r13 = r13;
+        regs->r14 = r14;
+        regs->r15 = r15;
+    }
+
+    if (mtd & Mtd::RSP)
+        regs->rsp = rsp;
+
+    if (mtd & Mtd::RIP_LEN)
+        regs->rip = rip;
+
+    if (mtd & Mtd::RFLAGS)
+        regs->rfl = rflags & ~(Cpu::EFL_VIP | Cpu::EFL_VIF | Cpu::EFL_VM | Cpu::EFL_RF | Cpu::EFL_IOPL);
+
+    return mtd & Mtd::FPU;
+}
@@ -17,19 +17,25 @@
 
 #pragma once
 
+#include "atomic.hpp"
+#include "cpu.hpp"
+#include "cpuset.hpp"
 #include "fpu.hpp"
 #include "kobject.hpp"
 #include "kp.hpp"
 #include "mtd.hpp"
 #include "optional.hpp"
 #include "pd.hpp"
+#include "pmu.hpp"
 #include "refptr.hpp"
 #include "regs.hpp"
 #include "slab.hpp"
+#include "tlb_tag_alloc.hpp"
 #include "unique_ptr.hpp"
 #include "utcb.hpp"
 #include "vlapic.hpp"
 #include "vmx.hpp"
+#include "vmx_exit_cache.hpp"
 #include "vmx_msr_bitmap.hpp"
 
 // A struct that is passed to the vCPU's constructor.
@@ -64,10 +70,161 @@ struct Vcpu_acquire_error {
 
 using Vcpu_acquire_result = Result_void<Vcpu_acquire_error>;
 
+// One entry of the CPUID table that a VMM can supply with vcpu_ctrl_exit_policy. The layout is part of the
+// ABI.
+struct Vcpu_cpuid_entry {
+    enum : uint32
+    {
+        VALID = 1U << 0,
+        // The entry only matches if the subleaf (ECX) matches as well.
+        SUBLEAF = 1U << 1,
+    };
+
+    uint32 leaf, subleaf, flags, reserved;
+    uint32 eax, ebx, ecx, edx;
+};
+
+static_assert(sizeof(Vcpu_cpuid_entry) == 32, "CPUID table entries must not change their size");
+
+// The statistics of one basic exit reason that a VMM can request with vcpu_ctrl_exit_stats. The layout is
+// part of the ABI.
+struct Vcpu_exit_stats {
+    // The number of VM exits with this reason.
+    uint64 count;
+
+    // The TSC ticks from these VM exits until the following VM entries. This includes the time the VMM
+    // spent handling the exits.
+    uint64 tsc;
+
+    static void inc(uint64& counter, uint64 val = 1)
+    {
+        Atomic::store<uint64, Atomic::RELAXED>(counter, counter + val);
+    }
+};
+
+static_assert(sizeof(Vcpu_exit_stats) * NUM_VMI <= PAGE_SIZE, "Exit statistics must fit into a KP");
+
+// The complete state of a vCPU in the KP of vcpu_ctrl_snapshot. The layout is part of the ABI.
+struct Vcpu_snapshot {
+    // The state in the layout of the vCPU state page. The MTD word says which parts are valid.
+    char state[2048];
+
+    // The debug registers that the vCPU state page does not contain.
+    uint64 dr0, dr1, dr2, dr3, dr6;
+};
+
+static_assert(sizeof(Utcb_head) + sizeof(Utcb_data) <= sizeof(Vcpu_snapshot::state),
+              "The vCPU state must fit into a snapshot");
+static_assert(sizeof(Vcpu_snapshot) <= PAGE_SIZE, "A vCPU snapshot must fit into a KP");
+
+// A guest write to an I/O port that Vcpu::handle_vmx recorded in a Vcpu_io_ring. The layout is part of the
+// ABI.
+struct Vcpu_io_write {
+    uint16 port;
+
+    // The width of the access in bytes.
+    uint8 size;
+    uint8 reserved;
+
+    uint32 value;
+};
+
+// The ring of I/O port writes that the VMM only needs to see eventually. See vcpu_ctrl_io_ring. The layout
+// is part of the ABI.
+struct Vcpu_io_ring {
+    struct Range {
+        uint16 base;
+        uint16 count;
+    };
+
+    static constexpr unsigned RANGES{4};
+    static constexpr unsigned ENTRIES{(PAGE_SIZE - 64) / sizeof(Vcpu_io_write)};
+
+    // The index of the next entry that Hedron writes. Only Hedron modifies it.
+    uint32 head;
+
+    // The index of the next entry that the VMM reads. Only the VMM modifies it. The ring is full if head is
+    // just before tail.
+    uint32 tail;
+
+    // Writes to the ports in these ranges go into the ring. The VMM can change them at any time.
+    Range ranges[RANGES];
+
+    uint32 reserved[10];
+
+    Vcpu_io_write entries[ENTRIES];
+};
+
+static_assert(sizeof(Vcpu_io_write) == 8, "I/O ring entries must not change their size");
+static_assert(sizeof(Vcpu_io_ring) == PAGE_SIZE, "The I/O ring must fill a page");
+
+// The ring of guest-physical addresses of pages that the guest wrote to. Vcpu::handle_vmx fills it from the
+// PML buffer on "PML log full" exits instead of exiting to the VMM. See vcpu_ctrl_pml. The header is followed
+// by the 64-bit entries up to the end of the KP. The layout is part of the ABI.
+struct Vcpu_dirty_ring {
+    // The index of the next entry that Hedron writes. Only Hedron modifies it.
+    uint32 head;
+
+    // The index of the next entry that the VMM reads. Only the VMM modifies it.
+    uint32 tail;
+
+    // The index of the first entry whose dirty flag vcpu_ctrl_harvest_dirty has not cleared yet. Hedron only
+    // overwrites entries behind it, so the ring is full if head is just before reset. Only Hedron modifies
+    // it.
+    uint32 reset;
+
+    uint32 reserved[13];
+
+    // The number of entries of a ring in a KP of the given size.
+    static mword entries(mword size) { return (size - sizeof(Vcpu_dirty_ring)) / sizeof(uint64); }
+
+    uint64* gpas() { return reinterpret_cast<uint64*>(this + 1); }
+};
+
+static_assert(sizeof(Vcpu_dirty_ring) == 64, "The dirty ring header must not change its size");
+
+// The steal time record that a VMM can supply with vcpu_ctrl_exit_policy. The layout matches the steal time
+// structure of KVM, so guests can use their existing support for it. The layout is part of the ABI.
+struct Vcpu_steal_time {
+    // The nanoseconds that the vCPU was ready to execute, but another SC ran on its CPU.
+    uint64 steal;
+
+    // The hypervisor makes the version odd while it updates the record.
+    uint32 version;
+    uint32 flags;
+
+    // Bit 0 is set while the vCPU was preempted.
+    uint8 preempted;
+    uint8 reserved0[3];
+    uint32 reserved1[11];
+};
+
+static_assert(sizeof(Vcpu_steal_time) == 64, "The steal time record must not change its size");
+
+class Pt;
+class Sm;
+
+// A guest write to an I/O port that Vcpu::handle_vmx handles by signaling a semaphore. See
+// vcpu_ctrl_ioevent.
+struct Vcpu_ioevent {
+    uint16 port;
+
+    // The width of the access in bytes.
+    uint8 size;
+
+    // If true, only writes of this value match.
+    bool match_value;
+    uint32 value;
+};
+
 // A virtual CPU. Objects of this class are passive objects, i.e. they have no associated SC and can only run
 // when user space executes a `vcpu_ctrl_run` system call.
 class Vcpu : public Typed_kobject<Kobject::Type::VCPU>, public Refcount
 {
+public:
+    // The number of EPTs that the guest can switch between with VMFUNC, including the EPT of its own PD.
+    static constexpr unsigned MAX_EPT_VIEWS{16};
+
 private:
     static Slab_cache cache;
 
@@ -75,7 +232,11 @@ private:
     static void free(Rcu_elem* a)
     {
         Vcpu* vcpu{static_cast<Vcpu*>(a)};
-        delete vcpu;
+
+        // The vCPU that owns the PMU of a CPU keeps a reference. See pmu_owner.
+        if (vcpu->del_ref()) {
+            delete vcpu;
+        }
     }
 
     const Refptr<Pd> pd; // The protection domain the vCPU will run in.
@@ -86,11 +247,27 @@ private:
 
     Utcb* utcb() { return reinterpret_cast<Utcb*>(kp_vcpu_state.get()->data_page()); }
 
-    const unsigned cpu_id; // The ID of the CPU this vCPU is running on.
+    // The ID of the CPU this vCPU is running on. It only changes in Vcpu::migrate, while the vCPU has an
+    // owner. Other CPUs have to access it using atomic ops!
+    unsigned cpu_id;
+
+    // True if the VMCS still has the host state of the CPU that the vCPU ran on before Vcpu::migrate.
+    bool host_state_stale{false};
     Unique_ptr<Vmcs> vmcs;
     Unique_ptr<Msr_area> guest_msr_area;
     Unique_ptr<Vmx_msr_bitmap> msr_bitmap;
 
+    // True if the MSR bitmap lets the guest access the x2APIC registers that the CPU virtualizes. See
+    // EXIT_POLICY_X2APIC.
+    bool x2apic_virtualized{false};
+
+    // True if the exit policy changed and Vcpu::run has to update the MSR bitmap.
+    bool msr_exits_stale{false};
+
+    // True if the exit policy changed and Vcpu::run has to update the HLT, MONITOR and MWAIT exits. See
+    // EXIT_POLICY_NATIVE_IDLE.
+    bool idle_exits_stale{false};
+
     // The VMCS does not contain general-purpose register content, so we have to save them separately.
     //
     // TODO: When we decouple the vCPU-State and the UTCB in the future, the VM exit path can store the
@@ -104,6 +281,14 @@ private:
 
     Fpu fpu;
 
+    // True if the FPU registers hold the guest FPU state. The FPU state of the EC that runs this vCPU is in
+    // memory in this case.
+    //
+    // We keep the guest FPU state loaded across VM exits and only save it when we return to the VMM or when
+    // another EC needs the FPU (see Ec::save_fpu). This way, VM exits that the kernel handles by itself don't
+    // pay for XSAVE and XRSTOR. The kernel itself never uses the FPU.
+    bool fpu_live{false};
+
     // The EC this vCPU is currently executing on. This variable has to be set prior to any modifications to
     // the vCPUs state and cleared before returning to the VMM. If a EC tries to modify the vCPUs state
     // without being the owner, this is a bug!
@@ -127,11 +312,104 @@ private:
     // We force-enabled MTF for the vCPU, because we have a poke event pending.
     bool has_pending_mtf_trap{false};
 
+    // If the budget of a reservation SC or the guest TSC deadline ends before the preemption timer that the
+    // VMM programmed, we shorten the timer. This is the remaining part of the VMM timeout behind our timeout.
+    Optional<uint64> vmm_timer_rest{};
+
+    // The value that the guest wrote into IA32_TSC_DEADLINE in guest TSC ticks, or zero if the timer is not
+    // armed. This is only used with EXIT_POLICY_TSC_DEADLINE.
+    uint64 tsc_deadline{0};
+
+    // The time in TSC ticks that Vcpu::poll_halt waits for an interrupt of a halted guest. It adapts to the
+    // wake-up times of the guest. This is only used with EXIT_POLICY_HLT_POLL.
+    uint64 halt_poll_window{0};
+
+    // The TSC when we last returned a HLT exit to the VMM after the polling window expired, or zero. The
+    // next Vcpu::run uses it to adapt halt_poll_window.
+    uint64 halt_exit_tsc{0};
+
+    // The bounds of halt_poll_window in microseconds.
+    static constexpr uint32 HALT_POLL_MIN_US{10};
+    static constexpr uint32 HALT_POLL_MAX_US{200};
+
     // True if the vCPU has been poked and must return to user space as soon as possible.
     //
     // This bool must be accessed using atomic ops!
     bool poked{false};
 
+    // Interrupt vectors that were posted with Vcpu::post_interrupt, but are not in the virtual-APIC page yet.
+    // The layout matches the posted-interrupt requests of a VMX posted-interrupt descriptor.
+    //
+    // This bitmap must be accessed using atomic ops!
+    mword posted_pir[NUM_INT_VECTORS / (sizeof(mword) * 8)]{};
+
+    // True if posted_pir may have bits set that the vCPU did not look at yet. Whoever sets this flag is
+    // responsible for kicking the vCPU.
+    //
+    // This bool must be accessed using atomic ops!
+    bool posted_pending{false};
+
+    // True if the VMM changed the IRR of the virtual-APIC page and asked with Vcpu::soft_poke that the guest
+    // sees its interrupts. Whoever sets this flag is responsible for kicking the vCPU.
+    //
+    // This bool must be accessed using atomic ops!
+    bool vapic_irr_stale{false};
+
+    // True if Vcpu::inject_posted_interrupt enabled interrupt-window exiting, so the interrupt-window exit is
+    // not meant for the VMM.
+    bool inject_window{false};
+
+    // The TPR threshold of the VMM, while Vcpu::inject_posted_interrupt raised the threshold to learn when
+    // the guest lowers its TPR below a posted interrupt. The TPR-below-threshold exit is only meant for the
+    // VMM, if the TPR is below this value as well.
+    Optional<uint32> inject_tpr_threshold{};
+
+    // Sends an NMI to the CPU of this vCPU, if the vCPU executes there right now.
+    void kick();
+
+    // The steal time record of this vCPU, or nullptr. Only the owner of the vCPU modifies it. See
+    // EXIT_POLICY_STEAL_TIME.
+    Refptr<Kp> kp_steal_time;
+
+    // The SC that ran this vCPU last and its Sc::wait at that time. Only the ready time of the SC that runs
+    // the vCPU is stolen. The time that the VMM handles exits or is blocked is not.
+    uint32 steal_sc_id{0};
+    uint64 steal_sc_wait{0};
+
+    // The steal time that we reported so far in TSC ticks and our copy of the version of the record. The VMM
+    // and the guest could modify the one in the record.
+    uint64 steal_tsc{0};
+    uint32 steal_version{0};
+
+    // True if we marked the steal time record as preempted.
+    bool steal_preempted{false};
+
+    // Adds the time that the SC of this vCPU waited since the last VM entry to the steal time record and
+    // clears the preempted flag.
+    void update_steal_time();
+
+    // The index under which the other vCPUs of the guest address this vCPU in paravirtual TLB flushes, if
+    // this vCPU is registered with its PD. See EXIT_POLICY_PV_TLB_FLUSH.
+    Optional<unsigned> pv_tlb_index{};
+
+    // True if another vCPU asked this vCPU to invalidate its guest TLB entries. Vcpu::run does this before
+    // the next VM entry. Whoever sets this flag is responsible for kicking the vCPU.
+    //
+    // This bool must be accessed using atomic ops!
+    bool pv_tlb_flush_pending{false};
+
+    // The offset of the task priority register (TPR) in the virtual-APIC page.
+    static constexpr mword VAPIC_TPR{0x80};
+
+    // The offset of the interrupt request register (IRR) in the virtual-APIC page.
+    static constexpr mword VAPIC_IRR{0x200};
+
+    // The offset of the LVT timer register in the virtual-APIC page and its fields.
+    static constexpr mword VAPIC_LVT_TIMER{0x320};
+    static constexpr uint32 LVT_MASKED{1U << 16};
+    static constexpr uint32 LVT_TIMER_MODE{3U << 17};
+    static constexpr uint32 LVT_TSC_DEADLINE{2U << 17};
+
     // A synthetic exit reason that is set when the exit reason in the VMCS is stale. Use exit_reason() to
     // always get the correct exit reason.
     //
@@ -140,6 +418,9 @@ private:
     // this shadow instead. The VM exit path then has to use this value instead of the one inside the VMCS.
     Optional<uint32> exit_reason_shadow{};
 
+    // The VM-exit information fields of the current VM exit.
+    Vmx_exit_cache exit_info;
+
     // Returns the current exit reason. See comment above in exit_reason_shadow for an explanation why this
     // exists.
     uint32 exit_reason()
@@ -176,18 +457,301 @@ private:
     // Restores debug registers DR0-3 and DR6.
     void load_dr();
 
-    // Saves debug registers DR0-3 and DR6.
+    // Saves debug registers DR0-3 and DR6. DR0-3 are only read if the guest could modify them, see
+    // dr_passthrough.
     void save_dr();
 
+    // True if the guest accesses the debug registers without VM exits.
+    //
+    // Guests rarely use the debug registers, so the CPU exits on MOV DR by default and the guest cannot
+    // modify DR0-3 behind our back. This saves reading them on every VM exit. When the guest accesses a debug
+    // register, we stop intercepting these accesses until the next VM exit. Vcpu::save_dr then saves the
+    // registers and turns interception on again.
+    bool dr_passthrough{false};
+
+    // Sets the processor-based VM-execution controls to the given controls of the VMM plus the controls that
+    // the kernel needs for itself.
+    void set_cpu_ctrl0(mword ctrl0);
+
+    // The vCPU whose guest MSRs (see Msr_area) are still loaded on this CPU. The CPU does not restore the
+    // host MSRs on VM exits and Vcpu::run skips loading the guest MSRs again if they are still in place.
+    // This pointer is only compared and never dereferenced.
+    CPULOCAL_REMOTE_ACCESSOR(vcpu, guest_msrs);
+
+    // True if this CPU may not have the host values of the MSRs in the MSR area loaded. See
+    // Vcpu::restore_host_msrs.
+    CPULOCAL_ACCESSOR(vcpu, host_msrs_stale);
+
+    // The value of IA32_SPEC_CTRL on this CPU. VM exits leave the value of the guest in place until the CPU
+    // switches to another security domain. See Pd::switch_domain.
+    CPULOCAL_ACCESSOR(vcpu, spec_ctrl);
+
+    // True if the L1D cache may hold data of another security domain than the next guest.
+    CPULOCAL_ACCESSOR(vcpu, l1d_flush);
+
+    // The vCPU whose counter state (see pmu_ctx) is loaded in the PMU of this CPU. It stays there until
+    // another vCPU runs on this CPU or Hedron starts sampling. The owner keeps a reference, because this can
+    // take long after it stopped running.
+    CPULOCAL_ACCESSOR(vcpu, pmu_owner);
+
+    // True if the guest has direct access to the performance counters. See set_pmu.
+    bool pmu_access{false};
+
+    // The counter state of the guest while it is not loaded. See pmu_owner.
+    Pmu_context pmu_ctx{};
+
+    // Loads the counter state of this vCPU or, without PMU access, makes sure that the PMU holds no counter
+    // state of another vCPU.
+    void switch_pmu();
+
+    // The number of MSRs that the CPU loads from the MSR area on VM entry. This is the current value of
+    // ENT_MSR_LD_CNT in the VMCS.
+    mword guest_msr_load_cnt{Msr_area::MSR_COUNT};
+
+    // The VPID of this vCPU on cpu_id. VPIDs are recycled, so the vCPU gets a new one, if it was not used for
+    // a while. See Vcpu::run.
+    Vpid_alloc::tag_t vpid_tag{0};
+
     // Returns true when the vCPU state indicates that we try to inject an event.
     bool injecting_event();
 
+    // Marks this vCPU as poked. Returns true if the caller has to send an NMI to the CPU of this vCPU to
+    // force a VM exit.
+    bool set_poked();
+
     // Make sure the next exit is reported as VMX_POKED.
     void synthesize_poked_exit();
 
+    // Resolves the current EPT violation with the EPT fill window of the PD. Returns false if the VMM has to
+    // handle it. See Pd::fill_ept.
+    bool fill_ept();
+
+    // Returns true if the current EPT violation is a write to guest memory that was delegated copy-on-write.
+    bool is_cow_write();
+
+    // Returns true if the VMM enabled virtual-interrupt delivery for this vCPU.
+    bool vint_delivery_enabled();
+
+    // Moves posted interrupts into the IRR of the virtual-APIC page and updates the requesting virtual
+    // interrupt (RVI), so the guest receives them via virtual-interrupt delivery. Returns false if there was
+    // nothing to deliver.
+    bool deliver_posted_interrupts();
+
+    // Updates RVI to the highest vector in the IRR of the virtual-APIC page after a soft poke. Returns false
+    // if there was no soft poke or virtual-interrupt delivery is disabled.
+    bool sync_virtual_interrupts();
+
+    // Returns true if posted interrupts wait for Vcpu::inject_posted_interrupt and the highest of them has
+    // a higher priority class than the guest accepts. See EXIT_POLICY_INJECT.
+    bool injection_pending();
+
+    // The highest posted interrupt, if any. more is set if there are others.
+    Optional<unsigned> highest_posted_interrupt(bool& more);
+
+    // The TPR of the guest in the virtual-APIC page. Without TPR shadow, the guest only accesses its TPR
+    // with exits to the VMM and we assume zero.
+    unsigned injection_tpr();
+
+    // The processor priority of the guest for injected interrupts: the priority class of the TPR or of the
+    // highest vector in injected_vectors in the UTCB, whichever is higher. A posted interrupt needs a higher
+    // priority class to be injected.
+    unsigned injection_priority();
+
+    // Injects the highest posted interrupt as an external interrupt, if the guest can take it and its
+    // processor priority allows it, and asks for an interrupt-window exit for the rest. A TPR that holds the
+    // interrupt back raises the TPR threshold instead. This is the fallback of deliver_posted_interrupts for
+    // vCPUs without virtual-interrupt delivery. See EXIT_POLICY_INJECT.
+    void inject_posted_interrupt();
+
+    // Sets the given vector in the IRR of the virtual-APIC page and updates RVI.
+    void request_virtual_interrupt(unsigned vector);
+
+    // Returns the LVT timer register of the virtual-APIC page.
+    uint32 lvt_timer();
+
+    // Returns the value that the guest reads from the TSC, minus the host TSC.
+    uint64 guest_tsc_offset();
+
+    // Returns the multiplier of the guest TSC as fixed-point number with 48 fractional bits.
+    uint64 guest_tsc_multiplier();
+
+    // Returns the guest TSC deadline in host TSC ticks. Deadlines that the host TSC does not reach are
+    // rounded to the maximum.
+    uint64 host_tsc_deadline();
+
+    // Injects the timer interrupt and disarms the timer, if the guest TSC deadline has passed.
+    void deliver_tsc_deadline();
+
+    // Returns true if the guest executes with CPL 0.
+    bool guest_in_kernel();
+
+    // Invalidates the guest TLB entries of this vCPU, if another vCPU asked for it. This vCPU must be the
+    // last one that ran on the current CPU.
+    void flush_pv_tlb();
+
+    // Asks this vCPU to invalidate its guest TLB entries. Returns true if the vCPU executes on another CPU
+    // right now. The caller then has to send an NMI to the CPU that it adds to kick and wait until
+    // pv_tlb_flushing returns false.
+    bool request_pv_tlb_flush(Cpuset& kick);
+
+    // Returns true if this vCPU still executes with the TLB entries that another vCPU asked it to flush.
+    bool pv_tlb_flushing();
+
+    // Invalidates the guest TLB entries of the vCPUs of this guest with the given paravirtual indices. It
+    // returns once none of them can use the old entries anymore.
+    void pv_tlb_flush(mword mask);
+
+    // Returns true if virtual-interrupt delivery would deliver an interrupt to the guest right now, because
+    // the priority of RVI is above the virtual processor priority.
+    bool virtual_interrupt_deliverable();
+
+    // Waits for an interrupt of a guest that executed HLT for up to halt_poll_window. Returns true if the
+    // guest received an interrupt and can continue behind the HLT. See EXIT_POLICY_HLT_POLL.
+    bool poll_halt();
+
+    // Adapts halt_poll_window to the time that the guest waited for its wake-up after a HLT exit.
+    void adapt_halt_poll_window();
+
     // Signals whether this vCPU is part of a passthrough VM.
     const bool passthrough_vcpu;
 
+    // The VM exits that Vcpu::handle_vmx handles without returning to the VMM. See Exit_policy below.
+    //
+    // This and kp_cpuid_table are only modified by the owner of the vCPU.
+    unsigned exit_policy{0};
+
+    // The CPUID table for EXIT_POLICY_CPUID. This KP contains an array of Vcpu_cpuid_entry that ends with the
+    // first entry that is not valid.
+    Refptr<Kp> kp_cpuid_table;
+
+    // The I/O port writes that only signal a semaphore instead of exiting to the VMM. Slot i is in use if
+    // ioevent_sms[i] is set.
+    //
+    // These are only modified by the owner of the vCPU.
+    static constexpr unsigned MAX_IOEVENTS{16};
+    Vcpu_ioevent ioevents[MAX_IOEVENTS]{};
+    Refptr<Sm> ioevent_sms[MAX_IOEVENTS];
+
+    // The number of slots up to and including the last one that is in use. I/O exits without ioevents don't
+    // look at the slots.
+    unsigned ioevent_cnt{0};
+
+    // The ring that coalesces I/O port writes, or nullptr. Only the owner of the vCPU modifies it.
+    Refptr<Kp> kp_io_ring;
+
+    // Our copy of the head of the I/O ring. The VMM could modify the one in the ring.
+    uint32 io_ring_head{0};
+
+    // The selectors of the portals that receive the VMCALLs of the guest kernel with the number in RAX equal
+    // to their index. Slot i is in use if bit i of vmcall_pt_mask is set. See vcpu_ctrl_vmcall_portal.
+    //
+    // Like event portals, we look up the portal in the PD that runs the vCPU on each VMCALL. See
+    // Space_obj::lookup.
+    //
+    // These are only modified by the owner of the vCPU.
+    static constexpr unsigned MAX_VMCALL_PORTALS{16};
+    mword vmcall_pt_sels[MAX_VMCALL_PORTALS]{};
+    uint16 vmcall_pt_mask{0};
+
+    // True if the portal of the VMCALL in progress replied. See Vcpu::finish_vmcall.
+    bool vmcall_replied{false};
+
+    // Returns the portal for the VMCALL of the current exit, or nullptr if the VMM has to handle it.
+    Pt* vmcall_portal();
+
+    // Signals the semaphore of the ioevent that matches the current I/O exit or records the write in the I/O
+    // ring. Returns false, if the VMM has to handle the exit.
+    bool handle_io_write();
+
+    // The MTD profile of this vCPU, or nullptr if Vcpu::return_to_vmm transfers the whole vCPU state. The KP
+    // holds one MTD bitfield for each basic exit reason that limits the state that is transferred for VM
+    // exits with this reason. VMREAD is slow, so a VMM that only needs a few fields for most exits saves a
+    // lot of time on each exit.
+    //
+    // This pointer is only modified by the owner of the vCPU.
+    Refptr<Kp> kp_mtd_profile;
+
+    // The page-modification log of this vCPU, or nullptr if the VMM did not provide one. The CPU writes the
+    // guest-physical address of each page that the guest dirties into this KP, if the VMM enables
+    // page-modification logging in the secondary processor-based VM-execution controls.
+    //
+    // This pointer is only modified by the owner of the vCPU.
+    Refptr<Kp> kp_pml_buffer;
+
+    // The ring that receives the entries of full PML buffers, or nullptr. See Vcpu_dirty_ring.
+    //
+    // This pointer is only modified by the owner of the vCPU.
+    Refptr<Kp> kp_dirty_ring;
+
+    // Our copy of the head of the dirty ring. The VMM could modify the one in the ring.
+    uint32 dirty_ring_head{0};
+
+    // Moves the entries of the full PML buffer into the dirty ring and restarts logging. Returns false if
+    // there is no dirty ring or it has no room, so the VMM has to handle the exit.
+    bool drain_pml_buffer();
+
+    // The shadow VMCS of this vCPU, or nullptr if the VMM never enabled VMCS shadowing. With VMCS shadowing,
+    // the guest accesses this VMCS with VMREAD and VMWRITE instead of exiting to the VMM, unless the VMREAD
+    // and VMWRITE bitmaps select the field. Except during Vcpu::access_shadow_vmcs, it is always in the clear
+    // state.
+    Unique_ptr<Vmcs> shadow_vmcs;
+
+    // The VMREAD and VMWRITE bitmaps of this vCPU, or nullptr if the VMM did not enable VMCS shadowing. A set
+    // bit makes the guest exit when it reads or writes the field with this encoding.
+    //
+    // These pointers are only modified by the owner of the vCPU.
+    Refptr<Kp> kp_vmread_bitmap;
+    Refptr<Kp> kp_vmwrite_bitmap;
+
+    // The PDs whose EPTs the guest switches between with VMFUNC leaf 0, or none if the VMM did not give the
+    // vCPU additional views. View 0 is always pd. The EPTP list holds their EPTPs at the same indices.
+    //
+    // These are only modified by the owner of the vCPU.
+    Refptr<Pd> ept_views[MAX_EPT_VIEWS];
+    unsigned num_ept_views{0};
+    Unique_ptr<Eptp_list> eptp_list;
+
+    // The views whose EPTP has accessed and dirty flags enabled, one bit per view. Vcpu::run updates the
+    // EPTPs when the PDs of the views ask for different flags. See Space_mem::ept_ad.
+    //
+    // This is only modified by the owner of the vCPU.
+    uint32 ept_ad_views{0};
+
+    // The exit statistics of this vCPU, or nullptr if the VMM did not ask for them. This KP holds one
+    // Vcpu_exit_stats for each basic exit reason. Only the owner of the vCPU writes to it, but user space may
+    // read it at any time.
+    //
+    // This pointer is only modified by the owner of the vCPU.
+    Refptr<Kp> kp_exit_stats;
+
+    // The statistics of the last VM exit that still miss the time until the next VM entry, and the TSC value
+    // of this VM exit.
+    Vcpu_exit_stats* pending_exit_stats{nullptr};
+    uint64 pending_exit_tsc{0};
+
+    // Satisfies a CPUID exit from the CPUID table. Returns false if the table has no matching entry.
+    bool emulate_cpuid();
+
+    // Sets the guest XCR0 for a XSETBV exit. Returns false if the instruction would cause a #GP in the guest.
+    bool emulate_xsetbv();
+
+    // Lets the guest access the TPR, EOI and SELF_IPI registers of its x2APIC without exits, if the VMM asked
+    // for it and the CPU virtualizes these accesses with the current VM-execution controls. Otherwise the
+    // guest would access the LAPIC of the host.
+    void update_x2apic_msr_exits();
+
+    // Satisfies a RDMSR or WRMSR exit for IA32_TSC_DEADLINE. Returns false if it is a different MSR or the
+    // timer cannot be emulated, because the guest LAPIC timer is not in TSC-deadline mode or the VMM scales
+    // the TSC or does not use virtual-interrupt delivery.
+    bool emulate_tsc_deadline(bool write);
+
+    // Returns true if the kernel can skip the instruction that caused the current VM exit. This is not the
+    // case if the guest expects a single-step debug exception or the VMM expects a MTF exit after it.
+    bool can_skip_instruction();
+
+    // Advances the guest past the instruction that caused the current VM exit.
+    void skip_instruction();
+
 public:
     // Capability permission bitmask.
     enum
@@ -197,17 +761,70 @@ public:
         PERM_ALL = PERM_VCPU_CTRL,
     };
 
+    // VM exits that the kernel handles itself when the VMM asks for it via vcpu_ctrl_exit_policy. All other
+    // exits and exits that the kernel cannot satisfy are still reported to the VMM.
+    enum Exit_policy
+    {
+        EXIT_POLICY_CPUID = 1U << 0,
+        EXIT_POLICY_XSETBV = 1U << 1,
+        EXIT_POLICY_TSC_DEADLINE = 1U << 2,
+        EXIT_POLICY_X2APIC = 1U << 3,
+        EXIT_POLICY_HLT_POLL = 1U << 4,
+        EXIT_POLICY_PV_TLB_FLUSH = 1U << 5,
+        EXIT_POLICY_STEAL_TIME = 1U << 6,
+
+        // The guest idles with HLT, MONITOR and MWAIT on the physical CPU. This is only useful on CPUs that
+        // the vCPU has for itself, for example isolated CPUs. NMIs and host interrupts still exit. MONITOR and
+        // MWAIT still exit on CPUs without an always running APIC timer (Cpu::FEAT_ARAT).
+        EXIT_POLICY_NATIVE_IDLE = 1U << 7,
+
+        // Without virtual-interrupt delivery, posted interrupts are injected as external interrupts whenever
+        // the guest can take them.
+        EXIT_POLICY_INJECT = 1U << 8,
+
+        EXIT_POLICY_ALL = EXIT_POLICY_CPUID | EXIT_POLICY_XSETBV | EXIT_POLICY_TSC_DEADLINE |
+                          EXIT_POLICY_X2APIC | EXIT_POLICY_HLT_POLL | EXIT_POLICY_PV_TLB_FLUSH |
+                          EXIT_POLICY_STEAL_TIME | EXIT_POLICY_NATIVE_IDLE | EXIT_POLICY_INJECT,
+    };
+
     // Initializes debug register shadows. This function needs to be called once per (physical) CPU.
     static void init();
 
     explicit Vcpu(const Vcpu_init_config& init_cfg);
-    ~Vcpu() = default;
+    ~Vcpu();
+
+    // Loads the host values of the MSRs that VM exits leave in the guest state. This has to happen before we
+    // return to host user space.
+    static void restore_host_msrs()
+    {
+        if (EXPECT_FALSE(host_msrs_stale())) {
+            Cpu::setup_msrs();
+
+            host_msrs_stale() = false;
+            guest_msrs() = nullptr;
+        }
+    }
+
+    // Removes what guests of the previous security domain left behind on this CPU. Called by
+    // Pd::switch_domain.
+    static void switch_domain()
+    {
+        if (EXPECT_FALSE(spec_ctrl() != 0)) {
+            Msr::write(Msr::IA32_SPEC_CTRL, 0);
+            spec_ctrl() = 0;
+        }
+
+        l1d_flush() = true;
+    }
 
     // Tries to set the current EC as the new owner. ECs are only allowed to modify the vCPUs state or to run
     // it after a successful call to this function. The owner of a vCPU has the duty to release it, the vCPU
     // will never clear its owner by itself.
     Vcpu_acquire_result try_acquire();
 
+    // The CPU this vCPU runs on. See cpu_id.
+    unsigned cpu() const { return Atomic::load(cpu_id); }
+
     // Clears the owner of this vCPU. Only the owner of a vCPU is allowed to release the vCPU.
     void release();
 
@@ -215,6 +832,124 @@ public:
     // modifying its MTD bits!
     void mtd(Mtd mtd);
 
+    // The VMCALL number of the paravirtual TLB flush. See EXIT_POLICY_PV_TLB_FLUSH.
+    static constexpr mword PV_TLB_FLUSH_VMCALL{0x100};
+
+    // Sets the exit policy of this vCPU, see Exit_policy. The CPUID table is only used with
+    // EXIT_POLICY_CPUID, the paravirtual index is only used with EXIT_POLICY_PV_TLB_FLUSH and the steal time
+    // record is only used with EXIT_POLICY_STEAL_TIME. Returns false and leaves the policy untouched if
+    // another vCPU of the PD has this index or it is too large. An EC has to acquire this vCPU before
+    // modifying its exit policy!
+    bool set_exit_policy(unsigned policy, Kp* cpuid_table, mword pv_index, Kp* steal_time);
+
+    // Marks the steal time record of this vCPU as preempted, because its SC is about to be rescheduled.
+    void mark_preempted();
+
+    // Makes guest writes that match the given ioevent signal the semaphore instead of exiting to the VMM or
+    // frees the slot, if the semaphore is nullptr. Returns false if the slot does not exist. An EC has to
+    // acquire this vCPU before modifying its ioevents!
+    bool set_ioevent(mword slot, Vcpu_ioevent const& ioevent, Sm* sm);
+
+    // Makes guest VMCALLs with the given number call the portal with the given selector instead of exiting
+    // to the VMM or restores the exit, if enable is false. Returns false if the number is too large. An EC
+    // has to acquire this vCPU before modifying its VMCALL portals!
+    bool set_vmcall_portal(mword nr, mword pt_sel, bool enable);
+
+    // Passes the reply of a VMCALL portal to the guest. The message words ARG2 to ARG5 go into RAX, RBX, RCX
+    // and RDX.
+    void set_vmcall_reply(Sys_regs const& reply);
+
+    // Continues the guest behind the VMCALL, if its portal replied. Otherwise, the VMM handles the VMCALL
+    // exit as if there was no portal.
+    [[noreturn]] void finish_vmcall();
+
+    // Sets the MTD profile of this vCPU. See kp_mtd_profile. A nullptr restores the default of transferring
+    // the whole vCPU state. An EC has to acquire this vCPU before modifying its MTD profile!
+    void set_mtd_profile(Kp* profile);
+
+    // The number of guest-physical addresses that fit into a PML buffer.
+    static constexpr unsigned PML_ENTRIES{PAGE_SIZE / sizeof(uint64)};
+
+    // Sets the PML buffer of this vCPU (see kp_pml_buffer) and restarts logging at its last entry. A nullptr
+    // disables page-modification logging. The dirty ring (see Vcpu_dirty_ring) is optional and emptied, if it
+    // changes. It needs room for more than a full PML buffer. Returns the number of entries the CPU logged
+    // into the previous buffer. These are the last entries of the buffer. An EC has to acquire this vCPU
+    // before modifying its PML buffer!
+    unsigned set_pml_buffer(Kp* buffer, Kp* dirty_ring);
+
+    // Clears the dirty flags of the pages of the dirty ring entries that the VMM consumed since the last call
+    // and makes room for new entries. This does not need to acquire the vCPU, because Hedron only reads the
+    // reset index while it fills the ring. Returns the number of entries or nothing, if the indices in the
+    // ring are inconsistent.
+    Optional<mword> reset_dirty_ring(Kp* ring);
+
+    // The dirty ring that set_pml_buffer set last, or nullptr.
+    Kp* dirty_ring() const { return kp_dirty_ring.get(); }
+
+    // Sets the I/O ring of this vCPU and empties it. See Vcpu_io_ring. A nullptr stops coalescing writes. An
+    // EC has to acquire this vCPU before modifying its I/O ring!
+    void set_io_ring(Kp* ring);
+
+    // Sets the exit statistics KP of this vCPU. See kp_exit_stats. A nullptr stops collecting statistics.
+    // An EC has to acquire this vCPU before modifying its exit statistics!
+    void set_exit_stats(Kp* stats);
+
+    // Sets the VMREAD and VMWRITE bitmaps of this vCPU (see kp_vmread_bitmap) and links its shadow VMCS,
+    // which is allocated on first use. Either both bitmaps are given or none, which disables VMCS shadowing.
+    // The contents of the shadow VMCS survive disabling it. An EC has to acquire this vCPU before modifying
+    // its VMCS shadowing!
+    void set_vmcs_shadow(Kp* vmread_bitmap, Kp* vmwrite_bitmap);
+
+    // Lets the guest switch between the EPT of its own PD (view 0) and the EPTs of the given PDs (views 1 to
+    // count) with VMFUNC. The EPTP list is allocated on first use. Without views, the guest returns to the
+    // EPT of its own PD. An EC has to acquire this vCPU before modifying its EPT views!
+    void set_ept_views(Pd* const* views, unsigned count);
+
+    // The PD of the EPT that the guest currently uses. See ept_views.
+    Pd* active_ept_view_pd();
+
+    // The index of the EPT view that the guest currently uses or switches the guest to the given view.
+    // Indices without a view are ignored. See Mtd::EPT_VIEW.
+    unsigned active_ept_view();
+    void set_active_ept_view(uint64 view);
+
+    // The views whose PD asks for accessed and dirty flags. See ept_ad_views.
+    uint32 wanted_ept_ad_views() const;
+
+    // Rewrites the EPTPs of all views with the accessed and dirty flags that their PDs ask for. The guest
+    // stays in its current view. The VMCS of this vCPU must be current.
+    void update_eptps();
+
+    // Gives the guest direct access to the performance counters or takes it away. VM entries and exits
+    // switch IA32_PERF_GLOBAL_CTRL, so the counters only count in the guest. The other counter state is only
+    // switched when another vCPU runs on the same CPU. See pmu_owner. An EC has to acquire this vCPU before
+    // modifying its PMU access!
+    void set_pmu(bool enable);
+
+    // Saves the counter state of the vCPU that owns the PMU of the current CPU. See pmu_owner.
+    static void flush_pmu();
+
+    // Returns true if this vCPU has a shadow VMCS. See set_vmcs_shadow.
+    bool has_shadow_vmcs() const { return shadow_vmcs; }
+
+    // Reads or writes the given fields of the shadow VMCS. Each field is a pair of its encoding and its
+    // value. Returns the number of fields that were accessed before the first field that does not exist or
+    // is read-only. An EC has to acquire this vCPU before accessing its shadow VMCS!
+    mword access_shadow_vmcs(mword* fields, mword count, bool write);
+
+    // Writes the complete state of this vCPU into the given KP or makes the next run load it from there. See
+    // Vcpu_snapshot. Returns false if the KP is the vCPU state KP. An EC has to acquire this vCPU before
+    // taking or restoring a snapshot!
+    bool snapshot(Kp* kp, bool restore);
+
+    // The PD this vCPU executes in.
+    Pd* guest_pd() const { return pd; }
+
+    // Moves this vCPU to the given CPU. Afterwards, only ECs on that CPU can acquire it. The guest state
+    // that is still loaded on the current CPU, such as the VMCS, goes back to memory. This must happen on the
+    // CPU that the vCPU ran on so far. An EC has to acquire this vCPU before it migrates it!
+    void migrate(unsigned to);
+
     // Prepares this vCPU to be executed (e.g. transfers the modified vCPU state fields) and then enters this
     // vCPU. An EC has to acquire this vCPU before it is allowed to execute it.
     [[noreturn]] void run();
@@ -225,6 +960,23 @@ public:
     // Pokes this vCPU and forces a VM exit if necessary.
     void poke();
 
+    // Like poke, but adds the CPU that has to be kicked with an NMI to the given set instead of sending the
+    // NMI. When poking many vCPUs, the caller can then kick each CPU only once.
+    void poke(Cpuset& kick);
+
+    // Saves the guest FPU state if it is still loaded after a VM exit (see fpu_live). Returns false if the
+    // FPU registers don't hold the guest FPU state.
+    bool save_guest_fpu();
+
+    // Posts an interrupt with the given vector to this vCPU. The guest receives it with the next VM entry
+    // without involving the VMM. If the vCPU currently executes, it is kicked with an NMI that the kernel
+    // handles by itself. Unlike other operations, posting interrupts does not require to acquire the vCPU.
+    void post_interrupt(unsigned vector);
+
+    // Makes the guest notice the interrupts that the VMM has set in the IRR of the virtual-APIC page without
+    // an exit to the VMM. Like post_interrupt, this does not require to acquire the vCPU.
+    void soft_poke();
+
     static inline void* operator new(size_t) { return cache.alloc(); }
     static inline void operator delete(void* ptr) { cache.free(ptr); }
 };
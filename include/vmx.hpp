@@ -37,13 +37,13 @@ public:
     uint32 rev;
     uint32 abort;
 
-    CPULOCAL_ACCESSOR(vmcs, current);
+    // The VMCS that was last loaded on this CPU. Vcpu::~Vcpu resets it, because a new VMCS at the same
+    // address must be loaded, even if the CPU has the old one still cached.
+    CPULOCAL_REMOTE_ACCESSOR(vmcs, current);
 
-    // The VPID counter is used to generate VPIDs for new vCPUs.
-    //
-    // Because we allocate VPIDs from the CPU where it is created and not
-    // where it will run, we have to be able to access this value remotely.
-    CPULOCAL_REMOTE_ACCESSOR(vmcs, vpid_ctr);
+    // The VPIDs of this CPU. VPIDs are assigned on the CPU where a vCPU runs
+    // and not where it was created, because they are recycled per CPU.
+    CPULOCAL_ACCESSOR(vmcs, vpid_alloc);
 
     CPULOCAL_ACCESSOR(vmcs, basic);
     CPULOCAL_ACCESSOR(vmcs, ept_vpid);
@@ -75,6 +75,7 @@ public:
         GUEST_SEL_LDTR = 0x080cul,
         GUEST_SEL_TR = 0x080eul,
         GUEST_INTR_STS = 0x0810ul,
+        GUEST_PML_INDEX = 0x0812ul,
 
         // 16-Bit Host State Fields
         HOST_SEL_ES = 0x0c00ul,
@@ -93,10 +94,12 @@ public:
         EXI_MSR_LD_ADDR = 0x2008ul,
         ENT_MSR_LD_ADDR = 0x200aul,
         VMCS_EXEC_PTR = 0x200cul,
+        PML_ADDR = 0x200eul,
         TSC_OFFSET = 0x2010ul,
         TSC_OFFSET_HI = 0x2011ul,
         APIC_VIRT_ADDR = 0x2012ul,
         APIC_ACCS_ADDR = 0x2014ul,
+        VM_FUNC_CTRL = 0x2018ul,
         EPTP = 0x201aul,
         EPTP_HI = 0x201bul,
 
@@ -105,6 +108,11 @@ public:
         EOI_EXIT_BITMAP_2 = 0x2020ul,
         EOI_EXIT_BITMAP_3 = 0x2022ul,
 
+        EPTP_LIST_ADDR = 0x2024ul,
+        VMREAD_BITMAP = 0x2026ul,
+        VMWRITE_BITMAP = 0x2028ul,
+        TSC_MULTIPLIER = 0x2032ul,
+
         INFO_PHYS_ADDR = 0x2400ul,
 
         // 64-Bit Guest State
@@ -142,6 +150,8 @@ public:
         ENT_INST_LEN = 0x401aul,
         TPR_THRESHOLD = 0x401cul,
         CPU_EXEC_CTRL1 = 0x401eul,
+        PLE_GAP = 0x4020ul,
+        PLE_WINDOW = 0x4022ul,
 
         // 32-Bit R/O Data Fields
         VMX_INST_ERROR = 0x4400ul,
@@ -236,10 +246,39 @@ public:
         HOST_RIP = 0x6c16ul
     };
 
+private:
+    // The copies of these fields in Per_cpu::vmcs_cached belong to the current VMCS. make_current forgets
+    // them when it loads another one.
+    static constexpr Encoding cached_fields[]{
+        CPU_EXEC_CTRL0, CPU_EXEC_CTRL1, EXC_BITMAP, CR0_MASK, CR4_MASK, CR0_READ_SHADOW, CR4_READ_SHADOW,
+    };
+
+    static constexpr unsigned NUM_CACHED{sizeof(cached_fields) / sizeof(cached_fields[0])};
+
+    // The index of the field in cached_fields or NUM_CACHED, if it is not cached. Callers pass constant
+    // encodings, so this folds away.
+    static constexpr unsigned cached_index(Encoding enc)
+    {
+        unsigned i{0};
+
+        while (i < NUM_CACHED and cached_fields[i] != enc) {
+            i++;
+        }
+
+        return i;
+    }
+
+    CPULOCAL_ACCESSOR(vmcs, cached);
+    CPULOCAL_ACCESSOR(vmcs, cached_valid);
+
+    static_assert(NUM_CACHED == sizeof(Per_cpu::vmcs_cached) / sizeof(mword), "Per_cpu::vmcs_cached size");
+
+public:
     enum Ctrl_exi
     {
         EXI_SAVE_DR = 1UL << 2,
         EXI_HOST_64 = 1UL << 9,
+        EXI_LOAD_PERF_GLOBAL_CTRL = 1UL << 12,
         EXI_INTA = 1UL << 15,
         EXI_SAVE_PAT = 1UL << 18,
         EXI_LOAD_PAT = 1UL << 19,
@@ -252,6 +291,7 @@ public:
     {
         ENT_LOAD_DR = 1UL << 2,
         ENT_GUEST_64 = 1UL << 9,
+        ENT_LOAD_PERF_GLOBAL_CTRL = 1UL << 13,
         ENT_LOAD_PAT = 1UL << 14,
         ENT_LOAD_EFER = 1UL << 15,
     };
@@ -267,27 +307,43 @@ public:
     enum Ctrl0
     {
         CPU_INTR_WINDOW = 1ul << 2,
+        CPU_TSC_OFFSETTING = 1ul << 3,
         CPU_HLT = 1ul << 7,
         CPU_INVLPG = 1ul << 9,
+        CPU_MWAIT = 1ul << 10,
         CPU_CR3_LOAD = 1ul << 15,
         CPU_CR3_STORE = 1ul << 16,
         CPU_CR8_LOAD = 1ul << 19,
         CPU_CR8_STORE = 1ul << 20,
         CPU_TPR_SHADOW = 1ul << 21,
         CPU_NMI_WINDOW = 1ul << 22,
+        CPU_MOV_DR = 1ul << 23,
         CPU_IO = 1ul << 24,
         CPU_IO_BITMAP = 1ul << 25,
         CPU_MTF = 1ul << 27,
         CPU_MSR_BITMAP = 1ul << 28,
+        CPU_MONITOR = 1ul << 29,
+        CPU_PAUSE = 1ul << 30,
         CPU_SECONDARY = 1ul << 31,
     };
 
     enum Ctrl1
     {
         CPU_EPT = 1ul << 1,
+        CPU_VIRT_X2APIC = 1ul << 4,
         CPU_VPID = 1ul << 5,
         CPU_URG = 1ul << 7,
         CPU_VINT_DELIVERY = 1ul << 9,
+        CPU_PAUSE_LOOP = 1ul << 10,
+        CPU_VMFUNC = 1ul << 13,
+        CPU_VMCS_SHADOW = 1ul << 14,
+        CPU_PML = 1ul << 17,
+        CPU_TSC_SCALING = 1ul << 25,
+    };
+
+    enum Vm_func
+    {
+        VM_FUNC_EPTP_SWITCHING = 1ul << 0,
     };
 
     enum Reason
@@ -343,6 +399,8 @@ public:
         VMX_INVVPID = 53,
         VMX_WBINVD = 54,
         VMX_XSETBV = 55,
+        VMX_VMFUNC = 59,
+        VMX_PML_FULL = 62,
 
         // This is a Hedron-specific exit reason we use it to signal VM exits due to a poke.
         VMX_POKED = NUM_VMI - 1,
@@ -351,10 +409,17 @@ public:
         // failures.
         VMX_FAIL_VMENTRY = NUM_VMI - 3,
 
+        // This is a Hedron-specific exit reason for EPT violations that are writes to copy-on-write guest
+        // memory. See Vcpu::is_cow_write.
+        VMX_COW_WRITE = NUM_VMI - 4,
+
         // This bit is set when we never managed to enter the guest.
         VMX_ENTRY_FAILURE = 1U << 31,
     };
 
+    // Bit 31 of the revision identifier marks a shadow VMCS.
+    static constexpr uint32 SHADOW_INDICATOR{1U << 31};
+
     enum Event_injection
     {
         EVENT_VALID = 1u << 31,
@@ -366,9 +431,21 @@ public:
 
     Vmcs(mword, mword, mword, Pd*, unsigned);
 
+    /// Write the host state that differs between CPUs into the current VMCS. VM exits then return to the
+    /// given CPU. See Vcpu::migrate.
+    static void set_host_cpu(unsigned cpu);
+
     /// Construct a root VMCS.
     Vmcs() : rev(basic().revision) {}
 
+    // Tag type to construct a shadow VMCS.
+    struct Shadow {
+    };
+
+    /// Construct a shadow VMCS. The CPU refuses to launch it, but the guest can access it with VMREAD and
+    /// VMWRITE when it is linked to the current VMCS and VMCS shadowing is enabled.
+    explicit Vmcs(Shadow) : rev(basic().revision | SHADOW_INDICATOR) { clear(); }
+
     void vmxon()
     {
         uint64 phys = Buddy::ptr_to_phys(this);
@@ -407,27 +484,80 @@ public:
         bool ret;
         asm volatile("vmptrld %1" : "=@cca"(ret) : "m"(phys) : "cc");
         assert(ret);
+
+        cached_valid() = 0;
     }
 
     static inline mword read(Encoding enc)
     {
+        unsigned const i{cached_index(enc)};
+
+        if (i < NUM_CACHED and (cached_valid() & (1U << i))) {
+            return cached()[i];
+        }
+
         mword val;
         asm volatile("vmread %1, %0" : "=rm"(val) : "r"(static_cast<mword>(enc)) : "cc");
+
+        if (i < NUM_CACHED) {
+            cached()[i] = val;
+            cached_valid() |= 1U << i;
+        }
+
         return val;
     }
 
+    // Fields in cached_fields are only written, if their value changes. Most VM entries rewrite the controls
+    // with the values they already have.
     static inline void write(Encoding enc, mword val)
     {
+        unsigned const i{cached_index(enc)};
+
+        if (i < NUM_CACHED) {
+            if ((cached_valid() & (1U << i)) and cached()[i] == val) {
+                return;
+            }
+
+            cached()[i] = val;
+            cached_valid() |= 1U << i;
+        }
+
         asm volatile("vmwrite %0, %1" : : "rm"(val), "r"(static_cast<mword>(enc)) : "cc");
     }
 
+    // Like read and write, but these return false instead of silently failing if the field does not exist or
+    // is read-only. They bypass the cached fields and must not be used for them in the current VMCS.
+    static inline bool try_read(mword enc, mword& val)
+    {
+        bool ok;
+        asm volatile("vmread %2, %1" : "=@cca"(ok), "=rm"(val) : "r"(enc) : "cc");
+        return ok;
+    }
+
+    static inline bool try_write(mword enc, mword val)
+    {
+        bool ok;
+        asm volatile("vmwrite %1, %2" : "=@cca"(ok) : "rm"(val), "r"(enc) : "cc");
+        return ok;
+    }
+
     static inline unsigned long vpid() { return has_vpid() ? read(VPID) : 0; }
 
     static bool has_secondary() { return ctrl_cpu()[0].clr & CPU_SECONDARY; }
     static bool has_guest_pat() { return ctrl_exi().clr & (EXI_SAVE_PAT | EXI_LOAD_PAT); }
+    static bool has_perf_global_ctrl()
+    {
+        return (ctrl_exi().clr & EXI_LOAD_PERF_GLOBAL_CTRL) and (ctrl_ent().clr & ENT_LOAD_PERF_GLOBAL_CTRL);
+    }
     static bool has_ept() { return ctrl_cpu()[1].clr & CPU_EPT; }
     static bool has_vpid() { return ctrl_cpu()[1].clr & CPU_VPID; }
     static bool has_urg() { return ctrl_cpu()[1].clr & CPU_URG; }
+    static bool has_ple() { return ctrl_cpu()[1].clr & CPU_PAUSE_LOOP; }
+    static bool has_pml() { return ctrl_cpu()[1].clr & CPU_PML; }
+    static bool has_vmcs_shadow() { return ctrl_cpu()[1].clr & CPU_VMCS_SHADOW; }
+    static bool has_tsc_scaling() { return ctrl_cpu()[1].clr & CPU_TSC_SCALING; }
+    static bool has_eptp_switching() { return ctrl_cpu()[1].clr & CPU_VMFUNC; }
+    static bool has_ept_ad() { return ept_vpid().accessed_dirty; }
     static bool has_vnmi() { return ctrl_pin().clr & PIN_VIRT_NMI; }
     static bool has_msr_bmp() { return ctrl_cpu()[0].clr & CPU_MSR_BITMAP; }
     static bool has_vmx_preemption_timer() { return ctrl_pin().clr & PIN_PREEMPT_TIMER; }
@@ -437,7 +567,12 @@ public:
     /// Returns true, if successful.
     static bool try_enable_vmx();
 
-    static void init();
+    // Enter VMX root operation.
+    static void enable();
+
+    // Probe the VMX capabilities and enable VMX. On resume from a sleep state, the capabilities are known
+    // already and VMX is only enabled again.
+    static void init(bool resume);
 };
 
 // A single-entry in the MSR save/load area. See struct Msr_area below.
@@ -457,7 +592,11 @@ static_assert(sizeof(Msr_entry) == 16, "MSR area entry does not conform to speci
 struct Msr_area {
     enum
     {
-        MSR_COUNT = 5
+        // The MSRs that VM entries load and VM exits store.
+        MSR_COUNT = 5,
+
+        // VM exits of vCPUs with PMU access also store IA32_PERF_GLOBAL_CTRL. See Vcpu::set_pmu.
+        PMU_MSR_COUNT = 6,
     };
 
     Msr_entry ia32_star{Msr::IA32_STAR};
@@ -465,6 +604,7 @@ struct Msr_area {
     Msr_entry ia32_fmask{Msr::IA32_FMASK};
     Msr_entry ia32_kernel_gs_base{Msr::IA32_KERNEL_GS_BASE};
     Msr_entry ia32_tsc_aux{Msr::IA32_TSC_AUX};
+    Msr_entry ia32_perf_global_ctrl{Msr::IA32_PERF_GLOBAL_CTRL};
 
     static inline void* operator new(size_t)
     {
@@ -474,5 +614,19 @@ struct Msr_area {
 
     static inline void operator delete(void* ptr) { Buddy::allocator.free(reinterpret_cast<mword>(ptr)); }
 };
-static_assert(sizeof(Msr_area) == Msr_area::MSR_COUNT * sizeof(Msr_entry),
+static_assert(sizeof(Msr_area) == Msr_area::PMU_MSR_COUNT * sizeof(Msr_entry),
               "MSR area size does not match the MSR count.");
+
+// The EPTP list that VMFUNC leaf 0 (EPTP switching) selects the EPT of a vCPU from.
+//
+// See Intel SDM Vol. 3 Section 24.6.14 "VM-Function Controls". Entries that are zero are invalid, so the
+// guest exits with VMX_VMFUNC when it selects one of them.
+struct Eptp_list {
+    static constexpr unsigned ENTRIES{PAGE_SIZE / sizeof(uint64)};
+
+    uint64 eptp[ENTRIES];
+
+    static inline void* operator new(size_t) { return Buddy::allocator.alloc(0, Buddy::FILL_0); }
+    static inline void operator delete(void* ptr) { Buddy::allocator.free(reinterpret_cast<mword>(ptr)); }
+};
+static_assert(sizeof(Eptp_list) == PAGE_SIZE, "EPTP list must fill one page.");
@@ -0,0 +1,69 @@
+/*
+ * VM-Exit Information Cache
+ *
+ * This file is part of the Hedron hypervisor.
+ *
+ * Hedron is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Hedron is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License version 2 for more details.
+ */
+
+#pragma once
+
+#include "sched_stats.hpp"
+#include "types.hpp"
+#include "vmx.hpp"
+
+// The read-only VM-exit information fields of the VMCS of a vCPU.
+//
+// These fields only change with the next VM exit, but several parts of the exit path need the same ones.
+// The cache reads each of them at most once per VM exit. The exit reason has its own shadow (see
+// Vcpu::exit_reason). Guest state fields are not cached, because the exit path also writes them.
+class Vmx_exit_cache
+{
+    static constexpr Vmcs::Encoding fields[]{
+        Vmcs::EXI_QUALIFICATION, Vmcs::INFO_PHYS_ADDR, Vmcs::EXI_INTR_INFO, Vmcs::EXI_INTR_ERROR,
+        Vmcs::IDT_VECT_INFO,     Vmcs::IDT_VECT_ERROR, Vmcs::EXI_INST_LEN,
+    };
+
+    static constexpr unsigned NUM_FIELDS{sizeof(fields) / sizeof(fields[0])};
+
+    static constexpr unsigned index(Vmcs::Encoding enc)
+    {
+        unsigned i{0};
+
+        while (i < NUM_FIELDS and fields[i] != enc) {
+            i++;
+        }
+
+        return i;
+    }
+
+    mword values[NUM_FIELDS];
+
+    // Bit n is set, if values[n] holds the field of the current VM exit.
+    unsigned valid{0};
+
+public:
+    template <Vmcs::Encoding ENC> mword read()
+    {
+        constexpr unsigned i{index(ENC)};
+        static_assert(i < NUM_FIELDS, "This VMCS field is not cached");
+
+        if (valid & (1U << i)) {
+            Sched_stats::count(&Sched_stats::vmread_cached_cnt);
+            return values[i];
+        }
+
+        valid |= 1U << i;
+        return values[i] = Vmcs::read(ENC);
+    }
+
+    // Forgets the fields before the next VM entry.
+    void invalidate() { valid = 0; }
+};
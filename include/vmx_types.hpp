@@ -35,8 +35,11 @@ union vmx_basic {
 union vmx_ept_vpid {
     uint64 val;
     struct {
-        uint32 : 16, super : 2, : 2, invept : 1, : 11;
-        uint32 invvpid : 1;
+        uint32 : 7, walk_5 : 1, : 8, super : 2, : 2, invept : 1, accessed_dirty : 1, : 3, invept_single : 1,
+            invept_all : 1;
+        uint32 : 5;
+        uint32 invvpid : 1, : 7, invvpid_addr : 1, invvpid_single : 1, invvpid_all : 1;
+        uint32 invvpid_single_noglobal : 1;
     };
 };
 
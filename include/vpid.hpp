@@ -18,7 +18,9 @@
 
 #pragma once
 
+#include "atomic.hpp"
 #include "compiler.hpp"
+#include "sched_stats.hpp"
 
 class Invvpid
 {
@@ -32,11 +34,17 @@ public:
 
 class Vpid
 {
+private:
+    // The single-context INVVPID types that all CPUs support. Without them, we flush all VPIDs.
+    static inline bool single_context{true};
+    static inline bool single_context_noglobal{true};
+
 public:
     enum Type
     {
         ADDRESS = 0,
         CONTEXT_GLOBAL = 1,
+        ALL_CONTEXTS = 2,
         CONTEXT_NOGLOBAL = 3
     };
 
@@ -45,4 +53,35 @@ public:
         Invvpid desc{vpid, addr};
         asm volatile("invvpid %0, %1" : : "m"(desc), "r"(static_cast<mword>(t)) : "cc");
     }
+
+    // Record which single-context types the current CPU supports. All CPUs do this in parallel during boot,
+    // so one CPU without support is enough to fall back.
+    static void set_supported(bool single, bool single_noglobal)
+    {
+        if (not single) {
+            Atomic::store(single_context, false);
+        }
+
+        if (not single_noglobal) {
+            Atomic::store(single_context_noglobal, false);
+        }
+    }
+
+    static bool has_single_context() { return Atomic::load(single_context); }
+
+    // Invalidate the mappings of the given VPID. Global mappings are kept, if global is false and the CPU
+    // supports it. If the CPU cannot invalidate a single VPID, the mappings of all VPIDs are invalidated.
+    static void flush_context(bool global, unsigned long vpid)
+    {
+        if (not global and Atomic::load(single_context_noglobal)) {
+            Sched_stats::count(&Sched_stats::invvpid_single_cnt);
+            flush(CONTEXT_NOGLOBAL, vpid);
+        } else if (has_single_context()) {
+            Sched_stats::count(&Sched_stats::invvpid_single_cnt);
+            flush(CONTEXT_GLOBAL, vpid);
+        } else {
+            Sched_stats::count(&Sched_stats::invvpid_all_cnt);
+            flush(ALL_CONTEXTS, 0);
+        }
+    }
 };
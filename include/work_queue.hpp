@@ -0,0 +1,84 @@
+/*
+ * Deferred Work Queue
+ *
+ * This file is part of the Hedron hypervisor.
+ *
+ * Hedron is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Hedron is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License version 2 for more details.
+ */
+
+#pragma once
+
+#include "atomic.hpp"
+#include "types.hpp"
+
+// A piece of kernel work that runs later on some CPU. The item is usually embedded into the object that the
+// work is about. See Deferred_work.
+struct Work_item {
+    Work_item* next{nullptr};
+
+    void (*fn)(void* ctx);
+    void* ctx;
+
+    Work_item(void (*f)(void*), void* c) : fn(f), ctx(c) {}
+};
+
+// The queue of deferred work of a CPU.
+//
+// This works like the remote run queue (see Rq): Any CPU pushes items with a compare-and-swap and the owning
+// CPU takes the whole queue with a single atomic exchange. The owning CPU keeps the items that it took, but
+// hasn't run yet, in pending in the order they were queued.
+//
+// The owner only has to look at the queue when it was notified. push tells when to notify the owner and pop
+// tells when the owner has to notify itself, so an owner that takes one item per notification still takes
+// every item.
+struct Work_queue {
+    Work_item* queue;
+    Work_item* pending;
+
+    // Add an item from any CPU. Returns true, if the owner has to be notified, because the queue was empty.
+    bool push(Work_item* item)
+    {
+        Work_item* head;
+
+        do {
+            head = Atomic::load(queue);
+            item->next = head;
+        } while (not Atomic::cmp_swap(queue, head, item));
+
+        return head == nullptr;
+    }
+
+    // Take the oldest item or return nullptr, if there is none. Only the owner calls this. more is set, if
+    // items are left. The owner has to notify itself then, because the notification of an item that is still
+    // in the queue may have been consumed by a call that took an older item.
+    Work_item* pop(bool& more)
+    {
+        if (not pending) {
+            // The queue is in LIFO order. Reverse it to take the items in the order they were queued.
+            for (Work_item* ptr = Atomic::exchange(queue, static_cast<Work_item*>(nullptr)); ptr;) {
+                Work_item* const item{ptr};
+
+                ptr = ptr->next;
+                item->next = pending;
+                pending = item;
+            }
+        }
+
+        Work_item* const item{pending};
+
+        if (item) {
+            pending = item->next;
+            item->next = nullptr;
+        }
+
+        more = pending != nullptr or Atomic::load(queue) != nullptr;
+        return item;
+    }
+};
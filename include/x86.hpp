@@ -58,6 +58,15 @@ inline uint64 rdtsc()
     return static_cast<uint64>(h) << 32 | l;
 }
 
+// Divides the 128-bit value hi:lo by div and stores the remainder in rem. The quotient must fit into 64 bits,
+// i.e. hi must be below div. We have no compiler runtime for 128-bit division.
+inline uint64 div128(uint64 hi, uint64 lo, uint64 div, uint64& rem)
+{
+    uint64 quot;
+    asm("divq %4" : "=a"(quot), "=d"(rem) : "a"(lo), "d"(hi), "rm"(div));
+    return quot;
+}
+
 inline void cpuid(unsigned leaf, unsigned subleaf, uint32& eax, uint32& ebx, uint32& ecx, uint32& edx)
 {
     asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(leaf), "c"(subleaf));
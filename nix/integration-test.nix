@@ -17,6 +17,9 @@ stdenv.mkDerivation {
     echo "# Testing legacy direct kernel boot."
     qemu-boot ${hedron}/share/hedron/hypervisor.elf32 | tee output.log
 
+    echo "# Running the hypercall latency benchmark roottask."
+    qemu-boot ${hedron}/share/hedron/hypervisor.elf32 --roottask ${hedron}/share/hedron/bench-roottask | tee -a output.log
+
     tools/gen_usb.sh ${grub_image} ${hedron}/share/hedron/hypervisor.elf32 tools/grub.cfg.tmpl
 
     # Test whether Hedron deals with many CPUs. The goal is not to crash. The number of CPUs that we expect to see here should be
@@ -23,6 +23,7 @@
 #include "acpi_fadt.hpp"
 #include "acpi_madt.hpp"
 #include "acpi_mcfg.hpp"
+#include "acpi_srat.hpp"
 #include "acpi_rsdp.hpp"
 #include "acpi_rsdt.hpp"
 #include "hpt.hpp"
@@ -30,7 +31,7 @@
 #include "stdio.hpp"
 #include "x86.hpp"
 
-Paddr Acpi::dmar, Acpi::facs, Acpi::fadt, Acpi::madt, Acpi::mcfg, Acpi::rsdt, Acpi::xsdt;
+Paddr Acpi::dmar, Acpi::facs, Acpi::fadt, Acpi::madt, Acpi::mcfg, Acpi::rsdt, Acpi::srat, Acpi::xsdt;
 Acpi_gas Acpi::pm1a_sts, Acpi::pm1b_sts, Acpi::pm1a_ena, Acpi::pm1b_ena, Acpi::pm1a_cnt, Acpi::pm1b_cnt,
     Acpi::pm2_cnt, Acpi::pm_tmr;
 Acpi_gas Acpi::gpe0_sts, Acpi::gpe1_sts, Acpi::gpe0_ena, Acpi::gpe1_ena;
@@ -120,6 +121,10 @@ void Acpi::setup()
     if (mcfg)
         static_cast<Acpi_table_mcfg*>(Hpt::remap(mcfg))->parse();
 
+    // The SRAT refers to the CPUs that we found in the MADT.
+    if (srat)
+        static_cast<Acpi_table_srat*>(Hpt::remap(srat))->parse();
+
     if (facs) {
         // Without TRACE_ACPI the trace call below doesn't touch its arguments.
         [[maybe_unused]] Acpi_table_facs* const facsp = static_cast<Acpi_table_facs*>(Hpt::remap(facs));
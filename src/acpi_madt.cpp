@@ -26,7 +26,13 @@
 #include "io.hpp"
 #include "stdio.hpp"
 
-void Acpi_table_madt::parse() const { parse_entry(Acpi_apic::LAPIC, &parse_lapic); }
+void Acpi_table_madt::parse() const
+{
+    // Firmware lists CPUs with APIC IDs above 254 only as x2APIC entries. They come after the LAPIC
+    // entries, so CPU numbers stay the same on systems that have both kinds.
+    parse_entry(Acpi_apic::LAPIC, &parse_lapic);
+    parse_entry(Acpi_apic::X2APIC, &parse_x2apic);
+}
 
 void Acpi_table_madt::parse_entry(Acpi_apic::Type type, void (*handler)(Acpi_apic const*)) const
 {
@@ -46,3 +52,20 @@ void Acpi_table_madt::parse_lapic(Acpi_apic const* ptr)
         Cpu::apic_id[Cpu::online++] = p->apic_id;
     }
 }
+
+void Acpi_table_madt::parse_x2apic(Acpi_apic const* ptr)
+{
+    Acpi_x2apic const* p = static_cast<Acpi_x2apic const*>(ptr);
+
+    // Some firmware lists CPUs with small APIC IDs in both kinds of entries.
+    for (unsigned i = 0; i < Cpu::online; i++) {
+        if (Cpu::apic_id[i] == p->x2apic_id) {
+            return;
+        }
+    }
+
+    if (p->flags & 1 && Cpu::online < NUM_CPU) {
+        Cpu::acpi_id[Cpu::online] = p->acpi_uid;
+        Cpu::apic_id[Cpu::online++] = p->x2apic_id;
+    }
+}
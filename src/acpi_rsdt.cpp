@@ -27,6 +27,7 @@ struct Acpi_table_rsdt::table_map const Acpi_table_rsdt::map[] = {
     {SIG("DMAR"), &Acpi::dmar},
     {SIG("FACP"), &Acpi::fadt},
     {SIG("MCFG"), &Acpi::mcfg},
+    {SIG("SRAT"), &Acpi::srat},
 };
 
 void Acpi_table_rsdt::parse(Paddr addr, size_t size) const
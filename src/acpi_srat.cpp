@@ -0,0 +1,51 @@
+/*
+ * Advanced Configuration and Power Interface (ACPI)
+ *
+ * This file is part of the Hedron hypervisor.
+ *
+ * Hedron is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Hedron is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License version 2 for more details.
+ */
+
+#include "acpi_srat.hpp"
+#include "cpu.hpp"
+#include "stdio.hpp"
+
+void Acpi_table_srat::set_domain(uint32 apic_id, uint32 domain)
+{
+    for (unsigned i = 0; i < Cpu::online; i++) {
+        if (Cpu::apic_id[i] == apic_id) {
+            trace(TRACE_ACPI, "SRAT: APIC %#x in proximity domain %u", apic_id, domain);
+            Cpu::numa_node[i] = domain;
+        }
+    }
+}
+
+void Acpi_table_srat::parse() const
+{
+    for (Acpi_affinity const* ptr = affinity;
+         ptr < reinterpret_cast<Acpi_affinity*>(reinterpret_cast<mword>(this) + length) and ptr->length;
+         ptr = reinterpret_cast<Acpi_affinity*>(reinterpret_cast<mword>(ptr) + ptr->length)) {
+
+        if (ptr->type == Acpi_affinity::LAPIC) {
+            Acpi_affinity_lapic const* p = static_cast<Acpi_affinity_lapic const*>(ptr);
+
+            if (p->flags & 1) {
+                set_domain(p->apic_id, p->domain_lo | p->domain_hi[0] << 8 | p->domain_hi[1] << 16 |
+                                           static_cast<uint32>(p->domain_hi[2]) << 24);
+            }
+        } else if (ptr->type == Acpi_affinity::X2APIC) {
+            Acpi_affinity_x2apic const* p = static_cast<Acpi_affinity_x2apic const*>(ptr);
+
+            if (p->flags & 1) {
+                set_domain(p->x2apic_id, p->domain);
+            }
+        }
+    }
+}
@@ -0,0 +1,287 @@
+/*
+ * Hypercall Latency Benchmark Roottask
+ *
+ * This file is part of the Hedron hypervisor.
+ *
+ * Hedron is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Hedron is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License version 2 for more details.
+ */
+
+// This roottask measures the round-trip latency of common hypercalls with the TSC and reports the minimum,
+// median and 99th percentile in cycles on the serial port. It is meant to be booted by
+// test/integration/qemu-boot --roottask and runs on the boot CPU only.
+//
+// vcpu_ctrl_run is not covered, because it needs a complete guest setup.
+
+#include "api.hpp"
+#include "memory.hpp"
+#include "types.hpp"
+
+extern "C" char bench_reply_handler[], bench_reply_register_handler[], bench_handler_stack_top[];
+
+namespace
+{
+
+// Capability selectors that Hedron installs for the roottask.
+constexpr mword SEL_ROOT_PD{32};
+
+// Capability selectors that the benchmark allocates.
+constexpr mword SEL_HANDLER_EC{64};
+constexpr mword SEL_PT{65};
+constexpr mword SEL_PT_REGISTER{66};
+constexpr mword SEL_SM{67};
+constexpr mword SEL_SM_BLOCK{68};
+constexpr mword SEL_SM_SCRATCH{69};
+
+constexpr mword HANDLER_UTCB{0x10000000};
+constexpr mword DELEGATE_TARGET{0x20000000};
+constexpr mword ROOT_UTCB{USER_ADDR - 2 * PAGE_SIZE};
+
+// The first message word in a UTCB follows the four words of the UTCB header.
+constexpr mword UTCB_HEADER_WORDS{4};
+
+constexpr unsigned SAMPLES{1024};
+constexpr unsigned WARMUP{64};
+constexpr unsigned BATCH_ENTRIES{16};
+
+constexpr mword CRD_MEM{1}, CRD_OBJ{3};
+
+constexpr mword crd(mword type, mword base, mword order, mword attr)
+{
+    return base << 12 | order << 7 | attr << 2 | type;
+}
+
+constexpr mword hc(hypercall_id id, mword flags = 0, mword value = 0)
+{
+    return static_cast<mword>(id) | flags << 8 | value << 12;
+}
+
+// Perform a hypercall and return its status. Hedron may clobber all argument registers and RCX/R11.
+inline mword hypercall(mword a1, mword a2 = 0, mword a3 = 0, mword a4 = 0, mword a5 = 0)
+{
+    register mword r8 asm("r8") = a5;
+    asm volatile("syscall" : "+D"(a1), "+S"(a2), "+d"(a3), "+a"(a4), "+r"(r8) : : "rcx", "r11", "memory");
+
+    return a1 & 0xff;
+}
+
+inline uint64 tsc()
+{
+    mword h, l;
+    asm volatile("lfence; rdtsc; lfence" : "=a"(l), "=d"(h)::"memory");
+    return static_cast<uint64>(h) << 32 | l;
+}
+
+inline void outb(uint16 port, uint8 val) { asm volatile("outb %0, %1" : : "a"(val), "Nd"(port)); }
+
+inline uint8 inb(uint16 port)
+{
+    uint8 val;
+    asm volatile("inb %1, %0" : "=a"(val) : "Nd"(port));
+    return val;
+}
+
+// The roottask has access to all I/O ports, so we can talk to COM1 directly. Hedron has already
+// initialized the UART when booted with the "serial" command line parameter.
+constexpr uint16 COM1{0x3f8};
+
+void putc(char c)
+{
+    while (not(inb(COM1 + 5) & 0x20)) {
+        asm volatile("pause");
+    }
+
+    outb(COM1, static_cast<uint8>(c));
+}
+
+void puts(char const* s)
+{
+    while (*s) {
+        putc(*s++);
+    }
+}
+
+void putn(uint64 n)
+{
+    char buf[24];
+    unsigned i{0};
+
+    do {
+        buf[i++] = static_cast<char>('0' + n % 10);
+        n /= 10;
+    } while (n);
+
+    while (i) {
+        putc(buf[--i]);
+    }
+}
+
+uint64 samples[SAMPLES];
+
+void sort(uint64* v, unsigned n)
+{
+    for (unsigned i = 1; i < n; i++) {
+        uint64 const x{v[i]};
+        unsigned j{i};
+
+        for (; j > 0 and v[j - 1] > x; j--) {
+            v[j] = v[j - 1];
+        }
+
+        v[j] = x;
+    }
+}
+
+void report(char const* name, unsigned failures)
+{
+    sort(samples, SAMPLES);
+
+    puts("bench: ");
+    puts(name);
+    puts(" min ");
+    putn(samples[0]);
+    puts(" median ");
+    putn(samples[SAMPLES / 2]);
+    puts(" p99 ");
+    putn(samples[SAMPLES * 99 / 100]);
+
+    if (failures) {
+        puts(" FAILED ");
+        putn(failures);
+    }
+
+    puts("\n");
+}
+
+// Measure one hypercall sequence. The setup function runs outside of the measured interval.
+template <typename SETUP, typename BODY>
+void measure(char const* name, SETUP setup, BODY body)
+{
+    unsigned failures{0};
+
+    for (unsigned i = 0; i < WARMUP + SAMPLES; i++) {
+        setup();
+
+        uint64 const start{tsc()};
+        bool const ok{body()};
+        uint64 const end{tsc()};
+
+        if (i >= WARMUP) {
+            samples[i - WARMUP] = end - start;
+            failures += not ok;
+        }
+    }
+
+    report(name, failures);
+}
+
+template <typename BODY>
+void measure(char const* name, BODY body)
+{
+    measure(name, [] {}, body);
+}
+
+mword* utcb_mr(mword utcb) { return reinterpret_cast<mword*>(utcb) + UTCB_HEADER_WORDS; }
+
+// A page that the delegation benchmark maps a second time at DELEGATE_TARGET.
+alignas(PAGE_SIZE) char delegate_page[PAGE_SIZE] = {1};
+
+// Block forever on a semaphore nobody signals. If the semaphore could not be created, we spin instead.
+[[noreturn]] void stop()
+{
+    for (;;) {
+        hypercall(hc(hypercall_id::HC_SM_CTRL, 0x1, SEL_SM_BLOCK));
+        asm volatile("pause");
+    }
+}
+
+// Stop at the first setup step that fails. The benchmarks would only measure error paths with the objects
+// that are missing.
+void check_setup(mword status, char const* step)
+{
+    if (status) {
+        puts("bench: setup of ");
+        puts(step);
+        puts(" FAILED with status ");
+        putn(status);
+        puts("\n");
+
+        stop();
+    }
+}
+
+void create_objects(mword cpu)
+{
+    check_setup(hypercall(hc(hypercall_id::HC_CREATE_SM, 0, SEL_SM_BLOCK), SEL_ROOT_PD, 0), "blocking SM");
+    check_setup(hypercall(hc(hypercall_id::HC_CREATE_EC, 0, SEL_HANDLER_EC), SEL_ROOT_PD, HANDLER_UTCB | cpu,
+                          reinterpret_cast<mword>(bench_handler_stack_top)),
+                "handler EC");
+    check_setup(hypercall(hc(hypercall_id::HC_CREATE_PT, 0, SEL_PT), SEL_ROOT_PD, SEL_HANDLER_EC, 0,
+                          reinterpret_cast<mword>(bench_reply_handler)),
+                "portal");
+    check_setup(hypercall(hc(hypercall_id::HC_CREATE_PT, 0, SEL_PT_REGISTER), SEL_ROOT_PD, SEL_HANDLER_EC, 0,
+                          reinterpret_cast<mword>(bench_reply_register_handler)),
+                "register portal");
+    check_setup(hypercall(hc(hypercall_id::HC_CREATE_SM, 0, SEL_SM), SEL_ROOT_PD, 0), "SM");
+}
+
+} // namespace
+
+extern "C" [[noreturn]] void bench_main(mword cpu)
+{
+    puts("bench: hypercall latency benchmark on CPU ");
+    putn(cpu);
+    puts(" (cycles)\n");
+
+    create_objects(cpu);
+
+    measure("null", [] { return hypercall(0xff) == 3 /* BAD_HYP */; });
+
+    measure("sm_ctrl_up", [] { return hypercall(hc(hypercall_id::HC_SM_CTRL, 0, SEL_SM)) == 0; });
+
+    measure("pd_ctrl_lookup", [] {
+        return hypercall(hc(hypercall_id::HC_PD_CTRL, 0), crd(CRD_OBJ, SEL_ROOT_PD, 0, 0x1f)) == 0;
+    });
+
+    measure("call_reply", [] { return hypercall(hc(hypercall_id::HC_CALL, 0, SEL_PT)) == 0; });
+
+    measure("call_reply_register", [] {
+        return hypercall(hc(hypercall_id::HC_CALL, 0x8, SEL_PT_REGISTER), 1, 2, 3, 4) == 0;
+    });
+
+    measure("create_sm_revoke", [] {
+        return (hypercall(hc(hypercall_id::HC_CREATE_SM, 0, SEL_SM_SCRATCH), SEL_ROOT_PD, 0) |
+                hypercall(hc(hypercall_id::HC_REVOKE, 0x1), crd(CRD_OBJ, SEL_SM_SCRATCH, 0, 0x1f))) == 0;
+    });
+
+    measure("delegate_revoke", [] {
+        mword const src{reinterpret_cast<mword>(delegate_page) >> PAGE_BITS};
+        mword const dst{DELEGATE_TARGET >> PAGE_BITS};
+
+        return (hypercall(hc(hypercall_id::HC_PD_CTRL, 2, SEL_ROOT_PD), SEL_ROOT_PD,
+                          crd(CRD_MEM, src, 0, 0x3), 1 /* DELEGATE to host */, crd(CRD_MEM, dst, 0, 0x3)) |
+                hypercall(hc(hypercall_id::HC_REVOKE, 0x1), crd(CRD_MEM, dst, 0, 0x3))) == 0;
+    });
+
+    measure(
+        "batch_sm_ctrl_up_x16",
+        [] {
+            mword* mr{utcb_mr(ROOT_UTCB)};
+
+            for (unsigned i = 0; i < BATCH_ENTRIES; i++, mr += 5) {
+                mr[0] = hc(hypercall_id::HC_SM_CTRL, 0, SEL_SM);
+            }
+        },
+        [] { return hypercall(hc(hypercall_id::HC_BATCH, 0, BATCH_ENTRIES)) == 0; });
+
+    puts("bench: done\n");
+
+    // There is nothing left to do.
+    stop();
+}
@@ -0,0 +1,44 @@
+/*
+ * Boot Profile
+ *
+ * This file is part of the Hedron hypervisor.
+ *
+ * Hedron is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Hedron is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License version 2 for more details.
+ */
+
+#include "boot_profile.hpp"
+#include "lapic.hpp"
+#include "stdio.hpp"
+
+namespace
+{
+
+char const* const phase_names[Boot_profile::NUM_PHASES]{
+    "start", "ctors", "acpi", "hip", "bsp", "aps", "roottask",
+};
+
+// Lapic::freq_tsc is in kHz.
+uint64 tsc_to_us(uint64 ticks) { return ticks * 1000 / Lapic::freq_tsc; }
+
+} // namespace
+
+void Boot_profile::print()
+{
+    // The TSC frequency is only known after the BSP has initialized its LAPIC.
+    if (not Lapic::freq_tsc) {
+        return;
+    }
+
+    // Console::vprintf has no '-' flag, but pads strings on the right anyway.
+    for (unsigned p{START + 1}; p < NUM_PHASES; p++) {
+        trace(TRACE_BOOT, "BOOT: %8s %8llu us (at %8llu us)", phase_names[p], tsc_to_us(tsc[p] - tsc[p - 1]),
+              tsc_to_us(tsc[p] - tsc[START]));
+    }
+}
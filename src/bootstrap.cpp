@@ -21,11 +21,15 @@
  */
 
 #include "bootstrap.hpp"
+#include "boot_profile.hpp"
 #include "compiler.hpp"
+#include "console_log.hpp"
+#include "cpu_load.hpp"
 #include "ec.hpp"
 #include "hip.hpp"
 #include "lapic.hpp"
 #include "msr.hpp"
+#include "sched_stats.hpp"
 #include "stdio.hpp"
 
 void Bootstrap::bootstrap()
@@ -34,16 +38,42 @@ void Bootstrap::bootstrap()
     // through here as part of resume from ACPI sleep states.
     bool const is_initial_boot = not Ec::idle_ec();
 
-    if (Cpu_info cpu_info = Cpu::init(); is_initial_boot) {
+    // CPU-local memory is set up now, so the allocators can use their CPU-local caches.
+    Buddy::enable_page_caches();
+    Slab_cache::enable_magazines();
+
+    // The APs only shared the boot stack, which we have left by now. Their
+    // initialization only touches CPU-local data and data that the BSP has
+    // set up before, so all APs initialize themselves in parallel.
+    //
+    // The BSP initializes itself completely before it releases the first AP,
+    // because the APs depend on what it probes (e.g. the FPU configuration).
+    bool const bsp{Lapic::early_bsp()};
+
+    if (not bsp) {
+        release_next_cpu();
+    }
+
+    // Each CPU fills its own HIP entry, so this needs no ordering between
+    // the CPUs. Hip::finalize runs after the barrier below.
+    if (Cpu_info cpu_info = Cpu::init(not is_initial_boot); is_initial_boot) {
         Hip::add_cpu(cpu_info);
     }
 
-    // Let the next CPU initialize itself. From now one, we can only touch
-    // CPU-local data.
-    release_next_cpu();
+    if (bsp) {
+        if (is_initial_boot) {
+            Boot_profile::mark(Boot_profile::BSP);
+        }
+
+        release_next_cpu();
+    }
 
     if (is_initial_boot) {
         create_idle_ec();
+
+        // From now on, log messages of this CPU don't stall it. If allocating the ring fails, we just keep
+        // printing synchronously.
+        Console_log::get_ring(Cpu::id());
     }
 
     wait_for_all_cpus();
@@ -54,6 +84,8 @@ void Bootstrap::bootstrap()
         Lapic::restore_low_memory();
 
         if (is_initial_boot) {
+            Boot_profile::mark(Boot_profile::APS);
+
             Hip::finalize();
             create_roottask();
         }
@@ -75,6 +107,11 @@ void Bootstrap::wait_for_all_cpus()
 
 void Bootstrap::create_idle_ec()
 {
+    Sc::stats() = static_cast<Sched_stats*>(Buddy::allocator.alloc(0, Buddy::FILL_0));
+
+    // The first CPU allocates the load page. Without it, CPUs just don't publish their load.
+    Cpu_load::get_table();
+
     Ec::idle_ec() = new Ec(Pd::current() = &Pd::kern, Cpu::id());
     Ec::current() = Ec::idle_ec();
 
@@ -86,10 +123,14 @@ void Bootstrap::create_idle_ec()
 
 void Bootstrap::create_roottask()
 {
-    ALIGNED(32) static No_destruct<Pd> root(&root, NUM_EXC, 0x1, Pd::IS_PRIVILEGED | Pd::IS_PASSTHROUGH);
+    ALIGNED(CACHE_LINE_SIZE)
+    static No_destruct<Pd> root(&root, NUM_EXC, 0x1, Pd::IS_PRIVILEGED | Pd::IS_PASSTHROUGH);
 
     Ec* root_ec =
         new Ec(&root, NUM_EXC + 1, &root, Ec::root_invoke, Cpu::id(), 0, USER_ADDR - 2 * PAGE_SIZE, 0, 0);
+    bool const bound{root_ec->bind_sc(false)};
+    assert(bound);
+
     Sc* root_sc = new Sc(&root, NUM_EXC + 2, root_ec, Cpu::id(), Sc::default_prio);
     root_sc->remote_enqueue();
 }
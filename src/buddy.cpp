@@ -20,9 +20,13 @@
 
 #include "buddy.hpp"
 #include "assert.hpp"
+#include "cpulocal.hpp"
+#include "hpt.hpp"
 #include "initprio.hpp"
 #include "lock_guard.hpp"
 #include "math.hpp"
+#include "sched_stats.hpp"
+#include "slab.hpp"
 #include "stdio.hpp"
 #include "string.hpp"
 
@@ -50,6 +54,7 @@ Buddy::Buddy(mword virt, mword f_addr, size_t size)
     order = bit + 1 - PAGE_BITS;
 
     trace(TRACE_MEMORY, "POOL: %#010lx-%#010lx O:%lu", phys, phys + size, order);
+    report_direct_map(virt, size);
 
     // Allocate block-list heads
     size -= order * sizeof *head;
@@ -65,26 +70,93 @@ Buddy::Buddy(mword virt, mword f_addr, size_t size)
     for (unsigned i = 0; i < order; i++)
         head[i].next = head[i].prev = head + i;
 
-    for (mword i = f_addr; i < virt + size; i += PAGE_SIZE)
-        free(i);
+    Lock_guard<Mcs_lock> guard(lock);
+
+    // Free the pool in the largest blocks that are aligned and fit instead of page by page. Each block then
+    // goes into its free list once, instead of every page being merged with its buddies. Index entries inside
+    // these blocks are never looked at.
+    for (signed long i = page_to_index(f_addr); i < max_idx;) {
+        unsigned short ord{0};
+
+        while (ord + 1UL < order and (i & ((2L << ord) - 1)) == 0 and i + (2L << ord) <= max_idx) {
+            ord++;
+        }
+
+        Block* const block{index_to_block(i)};
+
+        block->ord = ord;
+        free_block(block);
+
+        i += 1L << ord;
+    }
+}
+
+void Buddy::report_direct_map(mword virt, size_t size)
+{
+    // The pool is part of the kernel image, which the boot code maps with 2 MiB pages (see start.S). 1 GiB
+    // pages are not possible, because the kernel image shares its 1 GiB region with the CPU-local memory.
+    // phys_to_ptr and ptr_to_phys don't walk page tables at all, but every kernel access to page tables,
+    // kernel objects and other pool memory needs a TLB entry for it. Anything smaller than 2 MiB pages
+    // here costs a lot of TLB misses and is worth noticing.
+    unsigned long pages_1g{0}, pages_2m{0}, pages_4k{0};
+
+    Hpt::boot_hpt().for_each_mapping(virt, size, [&](Hpt::Mapping const& m) {
+        (m.order >= 30 ? pages_1g : m.order >= 21 ? pages_2m : pages_4k)++;
+        return true;
+    });
+
+    trace(TRACE_MEMORY, "POOL: mapped with %lu 1G, %lu 2M and %lu 4K pages", pages_1g, pages_2m, pages_4k);
 }
 
+namespace
+{
+
+// Fills of at least this size don't fit into the caches anyway, so they go around them.
+constexpr size_t NT_FILL_SIZE{64 * PAGE_SIZE};
+
+// Fill memory with non-temporal stores, so filling doesn't evict the working set from the caches. The size
+// must be a multiple of the word size.
+void fill_nt(void* dst, mword value, size_t size)
+{
+    mword* const words{static_cast<mword*>(dst)};
+
+    for (size_t i{0}; i < size / sizeof(mword); i++) {
+        asm volatile("movnti %1, %0" : "=m"(words[i]) : "r"(value));
+    }
+
+    // Non-temporal stores are weakly ordered. Make them visible before anyone can get the memory.
+    asm volatile("sfence" ::: "memory");
+}
+
+void zero_page_nt(void* page) { fill_nt(page, 0, PAGE_SIZE); }
+
+} // namespace
+
 void Buddy::fill(void* dst, Fill fill_mem, size_t size)
 {
-    if (fill_mem != NOFILL) {
+    if (fill_mem == NOFILL) {
+        return;
+    }
+
+    if (size >= NT_FILL_SIZE and size % sizeof(mword) == 0) {
+        fill_nt(dst, fill_mem == FILL_0 ? 0 : ~0UL, size);
+    } else {
         memset(dst, fill_mem == FILL_0 ? 0 : -1, size);
     }
 }
 
-/*
- * Allocate physically contiguous memory region.
- * @param ord       Block order (2^ord pages)
- * @param fill      Initialization mode of allocated memory
- * @return          Pointer to linear memory region
- */
-Alloc_result<void*> Buddy::try_alloc(unsigned short ord, Fill fill_mem)
+bool Buddy::page_caches_enabled;
+
+void Buddy::count_contention()
+{
+    if (EXPECT_FALSE(lock.is_locked()) and page_caches_enabled) {
+        Sched_stats::count(&Sched_stats::buddy_contended_cnt);
+    }
+}
+
+void* Buddy::alloc_block(unsigned short ord)
 {
-    Lock_guard<Spinlock> guard(lock);
+    assert(lock.is_locked());
 
     for (unsigned short j = ord; j < order; j++) {
 
@@ -96,6 +168,7 @@ Alloc_result<void*> Buddy::try_alloc(unsigned short ord, Fill fill_mem)
         block->next->prev = block->prev;
         block->ord = ord;
         block->tag = Block::Used;
+        free_blocks[j]--;
 
         while (j-- != ord) {
             Block* buddy = block + (1ul << j);
@@ -103,6 +176,7 @@ Alloc_result<void*> Buddy::try_alloc(unsigned short ord, Fill fill_mem)
             buddy->ord = j;
             buddy->tag = Block::Free;
             head[j].next = head[j].prev = buddy;
+            free_blocks[j]++;
         }
 
         mword virt = index_to_page(block_to_index(block));
@@ -110,16 +184,206 @@ Alloc_result<void*> Buddy::try_alloc(unsigned short ord, Fill fill_mem)
         // Ensure corresponding physical block is order-aligned
         assert((virt_to_phys(virt) & ((1ul << (block->ord + PAGE_BITS)) - 1)) == 0);
 
-        fill(reinterpret_cast<void*>(virt), fill_mem, 1ul << (block->ord + PAGE_BITS));
-
         // We should never hand out a nullptr.
         assert(virt != 0);
 
-        return Ok(reinterpret_cast<void*>(virt));
+        return reinterpret_cast<void*>(virt);
+    }
+
+    return nullptr;
+}
+
+void* Buddy::alloc_cached()
+{
+    Buddy_page_cache& cache{Cpulocal::get().buddy_page_cache};
+
+    if (EXPECT_FALSE(cache.cnt == 0)) {
+        Sched_stats::count(&Sched_stats::page_cache_miss_cnt);
+        count_contention();
+
+        {
+            Lock_guard<Mcs_lock> guard(lock);
+
+            for (; cache.cnt < PAGE_CACHE_BATCH; cache.cnt++) {
+                void* const page{alloc_block(0)};
+
+                if (EXPECT_FALSE(not page)) {
+                    break;
+                }
+
+                *static_cast<mword*>(page) = cache.head;
+                cache.head = reinterpret_cast<mword>(page);
+            }
+        }
+
+        // Zeroed pages are free pages as well.
+        if (EXPECT_FALSE(cache.cnt == 0)) {
+            return alloc_zeroed();
+        }
+    } else {
+        Sched_stats::count(&Sched_stats::page_cache_hit_cnt);
+    }
+
+    void* const page{reinterpret_cast<void*>(cache.head)};
+
+    cache.head = *static_cast<mword*>(page);
+    cache.cnt--;
+
+    return page;
+}
+
+void* Buddy::alloc_zeroed()
+{
+    Buddy_page_cache& cache{Cpulocal::get().buddy_zero_cache};
+
+    if (cache.cnt == 0) {
+        return nullptr;
+    }
+
+    mword* const page{reinterpret_cast<mword*>(cache.head)};
+
+    cache.head = *page;
+    cache.cnt--;
+
+    // The link to the next page was the only word that was not zero.
+    *page = 0;
+
+    return page;
+}
+
+bool Buddy::zero_idle()
+{
+    Buddy_page_cache& zero{Cpulocal::get().buddy_zero_cache};
+
+    if (not page_caches_enabled or zero.cnt >= ZERO_CACHE_PAGES) {
+        return false;
+    }
+
+    // Take the page from our page cache or directly from the buddy allocator. This bypasses alloc_cached,
+    // because allocations for the zeroed pages should not show up in the page cache statistics.
+    Buddy_page_cache& cache{Cpulocal::get().buddy_page_cache};
+    void* page;
+
+    if (cache.cnt != 0) {
+        page = reinterpret_cast<void*>(cache.head);
+        cache.head = *static_cast<mword*>(page);
+        cache.cnt--;
+    } else {
+        Lock_guard<Mcs_lock> guard(lock);
+
+        if (not(page = alloc_block(0))) {
+            return false;
+        }
+    }
+
+    zero_page_nt(page);
+
+    *static_cast<mword*>(page) = zero.head;
+    zero.head = reinterpret_cast<mword>(page);
+    zero.cnt++;
+
+    return true;
+}
+
+/*
+ * Allocate physically contiguous memory region.
+ * @param ord       Block order (2^ord pages)
+ * @param fill      Initialization mode of allocated memory
+ * @return          Pointer to linear memory region
+ */
+Alloc_result<void*> Buddy::try_alloc(unsigned short ord, Fill fill_mem)
+{
+    void* block;
+
+    Sched_stats::count(&Sched_stats::page_alloc_cnt);
+
+    if (ord == 0 and page_caches_enabled) {
+        if (fill_mem == FILL_0) {
+            if (void* const page{alloc_zeroed()}; EXPECT_TRUE(page)) {
+                Sched_stats::count(&Sched_stats::page_cache_hit_cnt);
+                return Ok(page);
+            }
+        }
+
+        block = alloc_cached();
+    } else {
+        count_contention();
+
+        Lock_guard<Mcs_lock> guard(lock);
+        block = alloc_block(ord);
     }
 
-    trace(TRACE_ERROR, "Failed allocating %u pages from %p", 1U << ord, __builtin_return_address(0));
-    return Err(Out_of_memory_error());
+    if (EXPECT_FALSE(not block and reclaim() != 0)) {
+        Lock_guard<Mcs_lock> guard(lock);
+        block = alloc_block(ord);
+    }
+
+    if (EXPECT_FALSE(not block)) {
+        trace(TRACE_ERROR, "Failed allocating %u pages from %p", 1U << ord, __builtin_return_address(0));
+        return Err(Out_of_memory_error());
+    }
+
+    // Filling the memory doesn't need the lock.
+    fill(block, fill_mem, 1ul << (ord + PAGE_BITS));
+
+    return Ok(block);
+}
+
+Alloc_result<void*> Buddy::try_alloc_page_table()
+{
+    if (page_caches_enabled) {
+        Buddy_page_cache& cache{Cpulocal::get().buddy_pt_cache};
+
+        if (cache.cnt != 0) {
+            void* const page{reinterpret_cast<void*>(cache.head)};
+
+            cache.head = *static_cast<mword*>(page);
+            cache.cnt--;
+
+            Sched_stats::count(&Sched_stats::page_alloc_cnt);
+            Sched_stats::count(&Sched_stats::page_cache_hit_cnt);
+
+            // The page still holds the entries of its old page table.
+            memset(page, 0, PAGE_SIZE);
+            return Ok(page);
+        }
+    }
+
+    return try_alloc(0, FILL_0);
+}
+
+void Buddy::free_page_table(mword virt)
+{
+    if (page_caches_enabled) {
+        Buddy_page_cache& cache{Cpulocal::get().buddy_pt_cache};
+
+        if (cache.cnt < PT_CACHE_PAGES) {
+            assert(index_to_block(page_to_index(virt))->ord == 0);
+
+            *reinterpret_cast<mword*>(virt) = cache.head;
+            cache.head = virt;
+            cache.cnt++;
+            return;
+        }
+    }
+
+    free(virt);
+}
+
+void Buddy::set_next_used(mword virt, mword next)
+{
+    Block* const block{index_to_block(page_to_index(virt))};
+
+    assert(block->tag == Block::Used);
+
+    block->next = next ? index_to_block(page_to_index(next)) : nullptr;
+}
+
+mword Buddy::next_used(mword virt)
+{
+    Block* const next{index_to_block(page_to_index(virt))->next};
+
+    return next ? index_to_page(block_to_index(next)) : 0;
 }
 
 void* Buddy::alloc(unsigned short ord, Fill fill_mem)
@@ -127,6 +391,28 @@ void* Buddy::alloc(unsigned short ord, Fill fill_mem)
     return try_alloc(ord, fill_mem).unwrap("Failed to allocate memory");
 }
 
+void Buddy::free_cached(mword virt)
+{
+    Buddy_page_cache& cache{Cpulocal::get().buddy_page_cache};
+
+    if (EXPECT_FALSE(cache.cnt == 2 * PAGE_CACHE_BATCH)) {
+        count_contention();
+
+        Lock_guard<Mcs_lock> guard(lock);
+
+        for (; cache.cnt > PAGE_CACHE_BATCH; cache.cnt--) {
+            mword const page{cache.head};
+
+            cache.head = *reinterpret_cast<mword*>(page);
+            free_block(index_to_block(page_to_index(page)));
+        }
+    }
+
+    *reinterpret_cast<mword*>(virt) = cache.head;
+    cache.head = virt;
+    cache.cnt++;
+}
+
 /*
  * Free physically contiguous memory region.
  * @param virt     Linear block base address
@@ -146,7 +432,21 @@ void Buddy::free(mword virt)
     // Ensure corresponding physical block is order-aligned
     assert((virt_to_phys(virt) & ((1ul << (block->ord + PAGE_BITS)) - 1)) == 0);
 
-    Lock_guard<Spinlock> guard(lock);
+    // Pages stay allocated from the point of view of the buddy allocator while they are in a page cache.
+    if (block->ord == 0 and page_caches_enabled) {
+        free_cached(virt);
+        return;
+    }
+
+    count_contention();
+
+    Lock_guard<Mcs_lock> guard(lock);
+    free_block(block);
+}
+
+void Buddy::free_block(Block* block)
+{
+    assert(lock.is_locked());
 
     unsigned short ord;
     for (ord = block->ord; ord < order - 1; ord++) {
@@ -168,6 +468,7 @@ void Buddy::free(mword virt)
         // Dequeue buddy from block list
         buddy->prev->next = buddy->next;
         buddy->next->prev = buddy->prev;
+        free_blocks[ord]--;
 
         // Merge block with buddy
         if (buddy < block)
@@ -182,4 +483,50 @@ void Buddy::free(mword virt)
     block->prev = h;
     block->next = h->next;
     block->next->prev = h->next = block;
+    free_blocks[ord]++;
+}
+
+unsigned long Buddy::drain_page_caches()
+{
+    Buddy_page_cache* const caches[]{&Cpulocal::get().buddy_page_cache, &Cpulocal::get().buddy_zero_cache,
+                                     &Cpulocal::get().buddy_pt_cache};
+    unsigned long drained{0};
+
+    count_contention();
+
+    Lock_guard<Mcs_lock> guard(lock);
+
+    for (Buddy_page_cache* cache : caches) {
+        for (; cache->cnt != 0; cache->cnt--, drained++) {
+            mword const page{cache->head};
+
+            cache->head = *reinterpret_cast<mword*>(page);
+            free_block(index_to_block(page_to_index(page)));
+        }
+    }
+
+    return drained;
+}
+
+unsigned long Buddy::reclaim()
+{
+    // Slabs that become free may end up in the page caches, so they are shrunk first.
+    unsigned long const pages{Slab_cache::shrink_all()};
+
+    return pages + (page_caches_enabled ? drain_page_caches() : 0);
+}
+
+unsigned long Buddy::free_stats(unsigned long* counts, unsigned long max, bool drain, unsigned long& drained)
+{
+    drained = drain and page_caches_enabled ? drain_page_caches() : 0;
+
+    Lock_guard<Mcs_lock> guard(lock);
+
+    unsigned long const orders{min<unsigned long>(order, max)};
+
+    for (unsigned long i{0}; i < orders; i++) {
+        counts[i] = free_blocks[i];
+    }
+
+    return orders;
 }
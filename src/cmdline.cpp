@@ -23,8 +23,9 @@
 #include "string.hpp"
 
 struct Cmdline::param_map const Cmdline::map[] = {
-    {"serial", &Cmdline::serial}, {"nodl", &Cmdline::nodl},     {"nopcid", &Cmdline::nopcid},
-    {"novga", &Cmdline::novga},   {"novpid", &Cmdline::novpid},
+    {"serial", &Cmdline::serial}, {"nodl", &Cmdline::nodl},     {"nodeepidle", &Cmdline::nodeepidle},
+    {"nopcid", &Cmdline::nopcid}, {"novga", &Cmdline::novga},   {"novpid", &Cmdline::novpid},
+    {"synclog", &Cmdline::synclog}, {"x2apic", &Cmdline::x2apic}, {"coresched", &Cmdline::coresched},
 };
 
 char const* Cmdline::get_arg(char const** line, unsigned& len)
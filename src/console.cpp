@@ -21,7 +21,9 @@
  */
 
 #include "console.hpp"
+#include "console_log.hpp"
 #include "lock_guard.hpp"
+#include "spinlock.hpp"
 #include "x86.hpp"
 
 Console* Console::list;
@@ -202,6 +204,18 @@ void Console::print(char const* format, ...)
 
 void Console::vprint(const char* format, va_list ap)
 {
+    {
+        va_list copy;
+
+        va_copy(copy, ap);
+        bool const logged{Console_log::vprint(format, copy)};
+        va_end(copy);
+
+        if (EXPECT_TRUE(logged)) {
+            return;
+        }
+    }
+
     Lock_guard<Spinlock> guard(lock);
 
     for (Console* c = list; c; c = c->next) {
@@ -217,4 +231,34 @@ void Console::vprint(const char* format, va_list ap)
     }
 }
 
+void Console::write(char const* s, size_t len)
+{
+    Lock_guard<Spinlock> guard(lock);
+
+    for (Console* c = list; c; c = c->next) {
+        for (size_t i{0}; i < len; i++) {
+            c->putc(s[i]);
+        }
+    }
+}
+
+size_t Console::try_write(char const* s, size_t len, bool (*stop)())
+{
+    if (not lock.try_lock()) {
+        return 0;
+    }
+
+    size_t i{0};
+
+    for (; i < len and not stop(); i++) {
+        for (Console* c = list; c; c = c->next) {
+            c->putc(s[i]);
+        }
+    }
+
+    lock.unlock();
+
+    return i;
+}
+
 extern "C" [[noreturn]] void __cxa_pure_virtual() { UNREACHED; }
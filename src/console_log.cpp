@@ -0,0 +1,151 @@
+/*
+ * Console Log
+ *
+ * This file is part of the Hedron hypervisor.
+ *
+ * Hedron is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Hedron is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License version 2 for more details.
+ */
+
+#include "console_log.hpp"
+#include "atomic.hpp"
+#include "buddy.hpp"
+#include "cmdline.hpp"
+#include "cpu.hpp"
+#include "hip.hpp"
+#include "math.hpp"
+
+namespace
+{
+
+// This console is never enabled. We only use it to format messages into the log ring.
+Console_log log_console;
+
+} // namespace
+
+void Console_log::putc(int c)
+{
+    Console_log_ring* const r{ring()};
+
+    r->data[pos()++ % Console_log_ring::SIZE] = static_cast<char>(c);
+}
+
+Console_log_ring* Console_log::get_ring(unsigned cpu)
+{
+    Console_log_ring*& ring_ref{remote_ref_ring(cpu)};
+
+    if (Console_log_ring* const r{Atomic::load(ring_ref)}; r) {
+        return r;
+    }
+
+    Alloc_result<void*> page{Buddy::allocator.try_alloc(0, Buddy::FILL_0)};
+
+    if (page.is_err()) {
+        return nullptr;
+    }
+
+    Console_log_ring* const r{static_cast<Console_log_ring*>(page.unwrap())};
+
+    // Someone else might have been faster. The ring must never change once it is set, because user space may
+    // have it mapped.
+    if (not Atomic::cmp_swap(ring_ref, static_cast<Console_log_ring*>(nullptr), r)) {
+        Buddy::allocator.free(reinterpret_cast<mword>(r));
+    }
+
+    return Atomic::load(ring_ref);
+}
+
+bool Console_log::vprint(char const* format, va_list ap)
+{
+    if (EXPECT_FALSE(Cmdline::synclog or Atomic::load(synchronous) or not Cpulocal::is_initialized())) {
+        return false;
+    }
+
+    Console_log_ring* const r{Atomic::load(ring())};
+
+    // A message that we print while we are writing another one (e.g. from an exception) would overwrite it.
+    if (EXPECT_FALSE(not r or busy())) {
+        return false;
+    }
+
+    busy() = true;
+    pos() = r->head;
+
+    log_console.vprintf(format, ap);
+
+    Atomic::store(r->head, pos());
+    busy() = false;
+
+    return true;
+}
+
+bool Console_log::drain(unsigned cpu, bool wait)
+{
+    Console_log_ring* const r{Atomic::load(remote_ref_ring(cpu))};
+
+    if (not r or not Atomic::cmp_swap(remote_ref_draining(cpu), false, true)) {
+        return false;
+    }
+
+    uint64 const head{Atomic::load(r->head)};
+    uint64& done{remote_ref_drained(cpu)};
+
+    // Skip what was already overwritten.
+    if (head - done > Console_log_ring::SIZE) {
+        done = head - Console_log_ring::SIZE;
+    }
+
+    bool printed{false};
+
+    if (done != head) {
+        size_t const offset{static_cast<size_t>(done % Console_log_ring::SIZE)};
+        size_t len{min(min(static_cast<size_t>(head - done), DRAIN_CHUNK), Console_log_ring::SIZE - offset)};
+
+        if (wait) {
+            write(r->data + offset, len);
+        } else {
+            len = try_write(r->data + offset, len, [] { return Atomic::load(Cpu::hazard()) != 0; });
+        }
+
+        done += len;
+        printed = len != 0;
+    }
+
+    Atomic::store(remote_ref_draining(cpu), false);
+
+    return printed;
+}
+
+bool Console_log::drain_any(bool wait)
+{
+    unsigned const self{Cpu::id()};
+
+    if (drain(self, wait)) {
+        return true;
+    }
+
+    // Busy CPUs don't get to drain their own rings, so we help them.
+    for (unsigned c{0}; c < Cpu::online; c++) {
+        if (c != self and Hip::cpu_online(c) and drain(c, wait)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void Console_log::flush_and_stop()
+{
+    Atomic::store(synchronous, true);
+
+    if (Cpulocal::is_initialized() and not busy()) {
+        while (drain_any(true)) {
+        }
+    }
+}
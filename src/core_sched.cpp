@@ -0,0 +1,70 @@
+/*
+ * Core Scheduling
+ *
+ * This file is part of the Hedron hypervisor.
+ *
+ * Hedron is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Hedron is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License version 2 for more details.
+ */
+
+#include "core_sched.hpp"
+#include "atomic.hpp"
+#include "cpu.hpp"
+#include "hazards.hpp"
+#include "hip.hpp"
+#include "lapic.hpp"
+#include "lock_guard.hpp"
+#include "pd.hpp"
+
+uint32 Core_sched::domain_of(Pd const* pd) { return pd == &Pd::kern ? 0 : pd->domain + 1; }
+
+bool Core_sched::publish(uint32 want)
+{
+    unsigned const self{Cpu::id()};
+    unsigned leader{self};
+
+    Hip::for_each_sibling(self, [&leader](unsigned long cpu, Hip_cpu const&) {
+        leader = min(leader, static_cast<unsigned>(cpu));
+    });
+
+    Lock_guard<Spinlock> guard(remote_ref_lock(leader));
+
+    bool admitted{true};
+
+    if (want) {
+        Hip::for_each_sibling(self, [want, &admitted](unsigned long cpu, Hip_cpu const&) {
+            uint32 const other{remote_load_domain(static_cast<unsigned>(cpu))};
+            admitted &= other == 0 or other == want;
+        });
+    }
+
+    uint32 const old{domain()};
+    uint32 const now{admitted ? want : 0};
+
+    Atomic::store(domain(), now);
+    Atomic::store(waiting(), not admitted);
+
+    // Siblings that wait for us to leave our domain try again.
+    if (old and old != now) {
+        Hip::for_each_sibling(self, [](unsigned long sibling, Hip_cpu const&) {
+            unsigned const cpu{static_cast<unsigned>(sibling)};
+
+            if (not remote_load_waiting(cpu)) {
+                return;
+            }
+
+            if (not(Atomic::fetch_or(Cpu::hazard(cpu), HZD_SCHED) & HZD_SCHED) and
+                not Cpu::remote_load_idle_waiting(cpu)) {
+                Lapic::send_nmi(cpu);
+            }
+        });
+    }
+
+    return admitted;
+}
@@ -33,12 +33,15 @@
 #include "fpu.hpp"
 #include "gdt.hpp"
 #include "hip.hpp"
+#include "hwp.hpp"
 #include "idt.hpp"
 #include "lapic.hpp"
 #include "mca.hpp"
 #include "msr.hpp"
 #include "pd.hpp"
+#include "rdt.hpp"
 #include "stdio.hpp"
+#include "string.hpp"
 #include "tss.hpp"
 #include "vcpu.hpp"
 #include "vmx.hpp"
@@ -57,6 +60,94 @@ static bool probe_spec_ctrl()
     return Msr::read_safe(Msr::IA32_SPEC_CTRL, ignore);
 }
 
+// Returns the MWAIT hint of the deepest C-state that is enumerated in CPUID leaf 5.
+static uint32 deepest_mwait_hint(uint32 ecx, uint32 edx)
+{
+    // Without the MWAIT extensions, we cannot rely on any hint but 0. Without an always running APIC timer,
+    // the timer stops in C-states deeper than C1 and we would miss our timeouts.
+    if (not(ecx & 1) or not Cpu::feature(Cpu::FEAT_ARAT)) {
+        return 0;
+    }
+
+    // EDX[4n+3:4n] is the number of sub C-states of C-state n. The hint for C-state n is (n - 1) << 4 plus
+    // the sub C-state.
+    for (unsigned n = 7; n > 1; n--) {
+        if (uint32 const sub{edx >> (4 * n) & 0xf}; sub) {
+            return (n - 1) << 4 | (sub - 1);
+        }
+    }
+
+    return 0;
+}
+
+// Decodes the x2APIC ID of the current CPU with the given extended topology leaf (0x1F or 0xB). Returns false
+// and leaves the CPU info alone, if the leaf doesn't enumerate any topology levels.
+static bool decode_extended_topology(uint32 leaf, Cpu_info& cpu_info, uint32& x2apic_id)
+{
+    uint32 eax, ebx, ecx, edx;
+    unsigned smt_shift{0}, core_shift{0}, die_shift{0};
+
+    for (uint32 sub{0};; sub++) {
+        cpuid(leaf, sub, eax, ebx, ecx, edx);
+
+        // ECX[15:8] is the level type: 1 is SMT, 2 is core, 3 and 4 are modules and tiles within the die, 5
+        // and 6 are dies and groups of dies. EAX[4:0] is the number of x2APIC ID bits below the next level.
+        unsigned const type{ecx >> 8 & 0xff};
+        unsigned const shift{eax & 0x1f};
+
+        if (type == 0) {
+            if (sub == 0) {
+                return false;
+            }
+            break;
+        }
+
+        x2apic_id = edx;
+
+        if (type == 1) {
+            smt_shift = shift;
+        }
+
+        // Modules and tiles are folded into the core number, so the (package, die, core) triple stays unique
+        // for each core.
+        if (type < 5) {
+            core_shift = shift;
+        }
+
+        die_shift = shift;
+    }
+
+    cpu_info.thread = x2apic_id & ((1u << smt_shift) - 1);
+    cpu_info.core = (x2apic_id >> smt_shift) & ((1u << (core_shift - smt_shift)) - 1);
+    cpu_info.die = (x2apic_id >> core_shift) & ((1u << (die_shift - core_shift)) - 1);
+    cpu_info.package = x2apic_id >> die_shift;
+
+    return true;
+}
+
+// Returns the number of low APIC ID bits that distinguish the CPUs that share the last level cache. See
+// CPUID leaf 4 in the Intel SDM.
+static unsigned llc_shift()
+{
+    uint32 eax, ebx, ecx, edx;
+    unsigned level{0}, sharing{1};
+
+    for (uint32 sub{0};; sub++) {
+        cpuid(0x4, sub, eax, ebx, ecx, edx);
+
+        if ((eax & 0x1f) == 0) {
+            break;
+        }
+
+        if ((eax >> 5 & 0x7) >= level) {
+            level = eax >> 5 & 0x7;
+            sharing = (eax >> 14 & 0xfff) + 1;
+        }
+    }
+
+    return sharing > 1 ? static_cast<unsigned>(bit_scan_reverse(sharing - 1) + 1) : 0;
+}
+
 Cpu_info Cpu::check_features()
 {
     Cpu_info cpu_info{};
@@ -66,6 +157,8 @@ Cpu_info Cpu::check_features()
 
     cpuid(0, eax, ebx, ecx, edx);
 
+    uint32 const max_leaf{eax};
+
     size_t v;
     for (v = sizeof(vendor_string) / sizeof(*vendor_string); --v;)
         if (*reinterpret_cast<uint32 const*>(vendor_string[v] + 0) == ebx &&
@@ -99,7 +192,11 @@ Cpu_info Cpu::check_features()
     case 0x6:
         cpuid(0x6, features()[2], ebx, ecx, edx);
         [[fallthrough]];
-    case 0x4 ... 0x5:
+    case 0x5:
+        cpuid(0x5, eax, ebx, ecx, edx);
+        mwait_hint_deep() = deepest_mwait_hint(ecx, edx);
+        [[fallthrough]];
+    case 0x4:
         cpuid(0x4, 0, eax, ebx, ecx, edx);
         cpp = (eax >> 26 & 0x3f) + 1;
         [[fallthrough]];
@@ -154,6 +251,16 @@ Cpu_info Cpu::check_features()
     cpu_info.core = top >> t_bits & ((1u << c_bits) - 1);
     cpu_info.package = top >> (t_bits + c_bits);
 
+    // The legacy topology from CPUID leaf 1 only sees the lower 8 bits of the APIC ID and knows nothing about
+    // dies. Prefer the extended topology leaves where the CPU has them.
+    uint32 x2apic_id{top};
+
+    if (not(max_leaf >= 0x1f and decode_extended_topology(0x1f, cpu_info, x2apic_id)) and max_leaf >= 0xb) {
+        decode_extended_topology(0xb, cpu_info, x2apic_id);
+    }
+
+    cpu_info.llc = max_leaf >= 0x4 ? x2apic_id >> llc_shift() : cpu_info.package;
+
     set_feature(FEAT_IA32_SPEC_CTRL, probe_spec_ctrl());
 
     // Disable features based on command line arguments
@@ -173,7 +280,7 @@ Cpu_info Cpu::check_features()
     return cpu_info;
 }
 
-void Cpu::update_features()
+void Cpu::update_features(bool all_cpus)
 {
     set_feature(FEAT_IA32_SPEC_CTRL, probe_spec_ctrl());
 
@@ -184,16 +291,29 @@ void Cpu::update_features()
     // that the user is free to load them from any hyperthread on the core. The effect of the update is
     // visible for all hyperthreads, though. This means, we need to update our feature bitmap on all sibling
     // cores as well.
-    auto set_sibling_features = [](unsigned long sibling_id, const Hip_cpu& cpu_desc) {
-        trace(TRACE_CPU, "CPU %u:%u:%u updated CPU features", cpu_desc.package, cpu_desc.core,
-              cpu_desc.thread);
+    auto copy_features = [](unsigned cpu) {
         for (size_t i{0u}; i < array_size(Cpu::features()); ++i) {
-            Atomic::store(Cpulocal::get_remote(static_cast<unsigned>(sibling_id)).cpu_features[i],
-                          Cpu::features()[i]);
+            Atomic::store(Cpulocal::get_remote(cpu).cpu_features[i], Cpu::features()[i]);
         }
     };
 
-    Hip::for_each_sibling(Cpu::id(), set_sibling_features);
+    auto set_sibling_features = [&copy_features](unsigned long sibling_id, const Hip_cpu& cpu_desc) {
+        trace(TRACE_CPU, "CPU %u:%u:%u updated CPU features", cpu_desc.package, cpu_desc.core,
+              cpu_desc.thread);
+        copy_features(static_cast<unsigned>(sibling_id));
+    };
+
+    if (not all_cpus) {
+        Hip::for_each_sibling(Cpu::id(), set_sibling_features);
+        return;
+    }
+
+    // A machine-wide update loaded the same microcode on all cores, so they all gained the same features.
+    Hip::for_each_online_cpu([&copy_features](unsigned cpu) {
+        if (cpu != Cpu::id()) {
+            copy_features(cpu);
+        }
+    });
 }
 
 void Cpu::setup_thermal() { Msr::write(Msr::IA32_THERM_INTERRUPT, 0x10); }
@@ -228,12 +348,8 @@ Optional<unsigned> Cpu::find_by_apic_id(unsigned id)
     return {};
 }
 
-Cpu_info Cpu::init()
+Cpu_info Cpu::init(bool resume)
 {
-    // We go through this function on resume as well. We could skip over certain
-    // initializations and probes, but for now it seems less error-prone to just
-    // rediscover everything.
-
     Tss::build();
     Gdt::load();
 
@@ -242,15 +358,29 @@ Cpu_info Cpu::init()
     Tss::load();
     Idt::load();
 
-    // Initialize CPU number and check features
-    Cpu_info const cpu_info{check_features()};
+    // The CPU is still the same after a sleep state, but the firmware has loaded its own microcode, which
+    // may lack IA32_SPEC_CTRL if user space had updated the microcode before. See Cpu::update_features.
+    if (resume) {
+        set_feature(FEAT_IA32_SPEC_CTRL, probe_spec_ctrl());
+    } else {
+        info() = check_features();
+    }
+
+    Cpu_info const& cpu_info{info()};
 
-    Lapic::init();
+    Lapic::init(resume);
 
-    if (Cpu::bsp()) {
+    if (Cpu::bsp() and not resume) {
         Fpu::probe();
 
         Hpt::set_supported_leaf_levels(feature(FEAT_1GB_PAGES) ? 3 : 2);
+
+        if (not feature(FEAT_1GB_PAGES)) {
+            Hip::clr_feature(Hip::FEAT_HPT_1G);
+        }
+
+        // All CPUs in a system are of the same kind, so the boot CPU can choose for everyone.
+        set_fast_strings(feature(FEAT_ERMS) or feature(FEAT_FSRM));
     }
 
     if (EXPECT_TRUE(feature(FEAT_ACPI)))
@@ -272,8 +402,10 @@ Cpu_info Cpu::init()
 
     set_cr4(cr4);
 
-    Vmcs::init();
+    Vmcs::init(resume);
     Vcpu::init();
+    Rdt::init();
+    Hwp::init();
 
     Mca::init(cpu_info);
 
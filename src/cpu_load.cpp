@@ -0,0 +1,68 @@
+/*
+ * CPU Load
+ *
+ * This file is part of the Hedron hypervisor.
+ *
+ * Hedron is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Hedron is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License version 2 for more details.
+ */
+
+#include "cpu_load.hpp"
+#include "atomic.hpp"
+#include "buddy.hpp"
+#include "cpu.hpp"
+#include "math.hpp"
+
+static_assert(NUM_CPU * sizeof(uint64) <= PAGE_SIZE, "The load of all CPUs must fit into a page");
+
+namespace
+{
+
+uint64* table;
+
+} // namespace
+
+uint64* Cpu_load::get_table()
+{
+    if (uint64* const t{Atomic::load(table)}; t) {
+        return t;
+    }
+
+    Alloc_result<void*> page{Buddy::allocator.try_alloc(0, Buddy::FILL_0)};
+
+    if (page.is_err()) {
+        return nullptr;
+    }
+
+    uint64* const t{static_cast<uint64*>(page.unwrap())};
+
+    // Someone else might have been faster. The table must never change once it is set, because user space
+    // may have it mapped.
+    if (not Atomic::cmp_swap(table, static_cast<uint64*>(nullptr), t)) {
+        Buddy::allocator.free(reinterpret_cast<mword>(t));
+    }
+
+    return Atomic::load(table);
+}
+
+void Cpu_load::update(bool idle, size_t ready, unsigned top_prio)
+{
+    uint64* const t{Atomic::load<uint64*, Atomic::RELAXED>(table)};
+
+    if (EXPECT_FALSE(not t)) {
+        return;
+    }
+
+    uint64 const load{(idle ? IDLE : 0) | uint64{top_prio} << PRIO_SHIFT | min<uint64>(ready, READY_MASK)};
+    uint64& entry{t[Cpu::id()]};
+
+    if (entry != load) {
+        Atomic::store<uint64, Atomic::RELAXED>(entry, load);
+    }
+}
@@ -0,0 +1,57 @@
+/*
+ * Deferred Kernel Work
+ *
+ * This file is part of the Hedron hypervisor.
+ *
+ * Hedron is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Hedron is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License version 2 for more details.
+ */
+
+#include "deferred_work.hpp"
+#include "atomic.hpp"
+#include "cpu.hpp"
+#include "hazards.hpp"
+#include "sched_stats.hpp"
+#include "x86.hpp"
+
+void Deferred_work::queue(Work_item* item) { queue(item, Cpu::id()); }
+
+void Deferred_work::queue(Work_item* item, unsigned cpu)
+{
+    // An idle CPU wakes up from the hazard, a busy CPU runs the item when it leaves the kernel the next time.
+    // This includes the current CPU. It doesn't need an NMI, because the work is not urgent.
+    if (remote_ref_wq(cpu).push(item)) {
+        Atomic::set_mask(Cpu::hazard(cpu), HZD_WORK);
+    }
+}
+
+bool Deferred_work::run()
+{
+    bool more;
+    Work_item* const item{wq().pop(more)};
+
+    if (not item) {
+        return false;
+    }
+
+    uint64 const start{rdtsc()};
+
+    // The item may free itself or queue itself again.
+    item->fn(item->ctx);
+
+    Sched_stats::count(&Sched_stats::deferred_work_cnt);
+    Sched_stats::count(&Sched_stats::deferred_work_tsc, rdtsc() - start);
+
+    // Continue with the remaining items on the next exit from the kernel.
+    if (more) {
+        Atomic::set_mask(Cpu::hazard(), HZD_WORK);
+    }
+
+    return true;
+}
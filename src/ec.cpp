@@ -22,12 +22,21 @@
  */
 
 #include "ec.hpp"
+#include "boot_profile.hpp"
+#include "buddy.hpp"
+#include "cmdline.hpp"
+#include "deferred_work.hpp"
+#include "console_log.hpp"
+#include "core_sched.hpp"
 #include "elf.hpp"
 #include "extern.hpp"
+#include "gdt.hpp"
 #include "hip.hpp"
 #include "kp.hpp"
 #include "lapic.hpp"
+#include "parallel.hpp"
 #include "rcu.hpp"
+#include "sched_stats.hpp"
 #include "sm.hpp"
 #include "stdio.hpp"
 #include "utcb.hpp"
@@ -35,11 +44,11 @@
 #include "vmx.hpp"
 
 INIT_PRIORITY(PRIO_SLAB)
-Slab_cache Ec::cache(sizeof(Ec), 32);
+Slab_cache Ec::cache{Slab_cache::create<Ec, CACHE_LINE_SIZE>()};
 
 Ec::Ec(Pd* own, unsigned c)
-    : Typed_kobject(static_cast<Space_obj*>(own)), cont(Ec::idle), pd(own), pd_user_page(own),
-      cpu(static_cast<uint16>(c)), glb(true), fpu(new Kp(own))
+    : Typed_kobject(static_cast<Space_obj*>(own)), cont(Ec::idle), pd(own), cpu(static_cast<uint16>(c)),
+      glb(true), pd_user_page(own), fpu(new Kp(own), Fpu::Format::COMPACTED)
 {
     // The idle EC gets a Fpu and a KP for the Fpu, as this has the least complexity of all alternatives (e.g.
     // using an optional<Fpu> or having an Fpu that handles a nullptr in the constructor).
@@ -50,9 +59,16 @@ Ec::Ec(Pd* own, unsigned c)
 
 Ec::Ec(Pd* own, mword sel, Pd* p, void (*f)(), unsigned c, unsigned e, mword u, mword s, int creation_flags)
     : Typed_kobject(static_cast<Space_obj*>(own), sel, Ec::PERM_ALL, free, pre_free), cont(f), pd(p),
-      pd_user_page((creation_flags & MAP_USER_PAGE_IN_OWNER) ? own : p), cpu(static_cast<uint16>(c)),
-      glb(!!f), evt(e), fpu(new Kp(own))
+      cpu(static_cast<uint16>(c)), glb(!!f), evt(e),
+      pd_user_page((creation_flags & MAP_USER_PAGE_IN_OWNER) ? own : p),
+      fpu(new Kp(own), Fpu::Format::COMPACTED)
 {
+    // Ec objects are cache-line aligned (see Ec::cache). The hot fields must stay in one line and the
+    // registers start on the next.
+    static_assert(OFFSETOF(Ec, cont) / CACHE_LINE_SIZE == OFFSETOF(Ec, evt) / CACHE_LINE_SIZE,
+                  "The hot EC fields don't fit into one cache line");
+    static_assert(OFFSETOF(Ec, regs) % CACHE_LINE_SIZE == 0, "The EC registers must start a cache line");
+
     assert(u < USER_ADDR);
     assert((u & PAGE_MASK) == 0);
 
@@ -87,8 +103,104 @@ Ec::Ec(Pd* own, mword sel, Pd* p, void (*f)(), unsigned c, unsigned e, mword u,
 // De-constructor
 Ec::~Ec() { pre_free(this); }
 
+void Ec::follow(unsigned to, void (*c)())
+{
+    Ec* const self{current()};
+
+    // Only an EC that runs on its own migratable SC and has no CPU-local state in the kernel can move.
+    if (not self->glb or not self->is_migratable() or self->partner or self->vcpu or
+        Sc::current()->ec != self or to == Cpu::id() or not Hip::cpu_online(to)) {
+        return;
+    }
+
+    self->cont = c;
+    Sc::follow(to);
+}
+
+void Ec::help(void (*c)())
+{
+    if (EXPECT_FALSE(cont == dead)) {
+        return;
+    }
+
+    current()->cont = c;
+
+    unsigned depth{0};
+
+    for (Ec* ec{this}; ec->partner and depth <= HELP_DEPTH_LIMIT; ec = ec->partner) {
+        depth++;
+    }
+
+    Sched_stats::count(&Sched_stats::help_cnt);
+    Sched_stats::count(&Sched_stats::help_depth, depth);
+
+    // Running the end of a deep chain burns the time of the helping SC far away from the EC it called. Such
+    // SCs wait until this EC replies instead.
+    if (EXPECT_FALSE(depth > HELP_DEPTH_LIMIT)) {
+        Sched_stats::count(&Sched_stats::help_block_cnt);
+        block_until_reply();
+    }
+
+    if (EXPECT_TRUE(++Sc::ctr_loop() < 100))
+        activate();
+
+    die("Livelock");
+}
+
+void Ec::block_until_reply()
+{
+    {
+        Lock_guard<Spinlock> guard(lock);
+
+        bool ok = Sc::current()->add_ref();
+        assert(ok);
+
+        enqueue(Sc::current());
+    }
+
+    Sc::schedule(true);
+}
+
+namespace
+{
+
+// The handlers of the hazards that return to the caller, indexed by the bit number of the hazard. HZD_PRK
+// and HZD_SCHED leave the current continuation, so Ec::handle_hazards deals with them itself.
+struct Hazard_handlers {
+    void (*fn[NUM_HZD])();
+};
+
+constexpr Hazard_handlers make_hazard_handlers()
+{
+    Hazard_handlers h{};
+
+    h.fn[bit_scan_forward(HZD_RCU)] = Rcu::quiet;
+    h.fn[bit_scan_forward(HZD_TLB)] = [] { Pd::current()->Space_mem::flush_stale_host_tlb(); };
+    h.fn[bit_scan_forward(HZD_IDL)] = Rcu::update_expedited;
+    h.fn[bit_scan_forward(HZD_RRQ)] = Sc::rrq_handler;
+    h.fn[bit_scan_forward(HZD_STEAL)] = Sc::steal_handler;
+    // HZD_WORK is shared. See Deferred_work.
+    h.fn[bit_scan_forward(HZD_WORK)] = [] {
+        Parallel::help();
+        Deferred_work::run();
+    };
+
+    return h;
+}
+
+constexpr Hazard_handlers hazard_handlers{make_hazard_handlers()};
+
+void count_hazard(unsigned hzd) { Sched_stats::inc(Sc::stats()->hazard_cnt[bit_scan_forward(hzd)]); }
+
+} // namespace
+
 void Ec::handle_hazards(void (*continuation)())
 {
+    // A reservation that has exhausted its budget gives up the CPU when it leaves the kernel.
+    if (EXPECT_FALSE(Sc::current()->budget_exhausted())) {
+        Atomic::set_mask(Cpu::hazard(), HZD_SCHED);
+    }
+
     if (EXPECT_TRUE(Atomic::load(Cpu::hazard()) == 0u)) {
         return;
     }
@@ -97,26 +209,21 @@ void Ec::handle_hazards(void (*continuation)())
 
     if (hzd & HZD_PRK) {
         assert_slow(Lapic::park_function != nullptr);
+        count_hazard(HZD_PRK);
         current()->cont = continuation;
         Lapic::park_handler();
     }
 
-    if (hzd & HZD_RCU or (hzd & HZD_IDL and Ec::current()->is_idle_ec())) {
-        Rcu::quiet();
-    }
-
-    if (hzd & HZD_TLB) {
-        if (Pd::current()->Space_mem::stale_host_tlb.chk(Cpu::id())) {
-            Pd::current()->Space_mem::stale_host_tlb.clr(Cpu::id());
-            Hpt::flush();
-        }
-    }
+    // Handle the remaining hazards in the order of their bits, so we only look at the ones that are set.
+    for (unsigned pending{hzd & ~(HZD_PRK | HZD_SCHED)}; pending; pending &= pending - 1) {
+        unsigned const bit{static_cast<unsigned>(bit_scan_forward(pending))};
 
-    if (hzd & HZD_RRQ) {
-        Sc::rrq_handler();
+        Sched_stats::inc(Sc::stats()->hazard_cnt[bit]);
+        hazard_handlers.fn[bit]();
     }
 
     if (hzd & HZD_SCHED) {
+        count_hazard(HZD_SCHED);
         current()->cont = continuation;
         Sc::schedule();
     }
@@ -126,22 +233,55 @@ void Ec::ret_user_sysexit()
 {
     handle_hazards(ret_user_sysexit);
 
-    // TODO Instead of exiting via sysret, which should trap due to the NMI handler, we just redirect
-    // everything to iret.
+    // We turn the system call state into an IRET frame that SYSRET can also return with, because RCX holds
+    // the instruction pointer and R11 the flags. See Ec::ret_user.
     current()->redirect_to_iret();
-    ret_user_iret();
+    current()->regs.r11 = current()->regs.rfl;
 
-    // TODO This is not reached right now.
-    assert_slow(Pd::is_pcid_valid());
+    ret_user();
+}
+
+// Check whether SYSRET can return to the given user state.
+//
+// SYSRET loads RIP from RCX and RFLAGS from R11, so these have to match the return frame. The selectors are
+// implied by IA32_STAR. SYSRET does not restore the flags that it cannot set (RF, VM) and we leave the rare
+// ones (TF, NT, IOPL, VIF, VIP) to IRET as well.
+static bool sysret_compatible(Cpu_regs const& regs)
+{
+    constexpr mword iret_only_flags{Cpu::EFL_TF | Cpu::EFL_IOPL | Cpu::EFL_NT | Cpu::EFL_RF | Cpu::EFL_VM |
+                                    Cpu::EFL_VIF | Cpu::EFL_VIP};
+
+    // Addresses at or above USER_ADDR are either non-canonical or close enough to the non-canonical hole to
+    // make SYSRET fault in Ring0. See Ec::ret_user_sysret.
+    return (regs.cs == SEL_USER_CODE or regs.cs == SEL_USER_CODE_L) and regs.ss == SEL_USER_DATA and
+           regs.rip < USER_ADDR and regs.rcx == regs.rip and regs.r11 == regs.rfl and
+           (regs.rfl & iret_only_flags) == 0;
+}
+
+void Ec::ret_user_sysret()
+{
+    Pseudo_descriptor gdtr{0, 0};
+
+    // An NMI that interrupted the kernel before sysret_window has loaded only the kernel part of the GDT to
+    // make the next IRET to user space fault. SYSRET ignores the GDT, so we take the IRET path in this case.
+    // NMIs that interrupt us inside the window do their deferred work right away. See
+    // Ec::handle_exc_altstack.
+    //
+    // RCX and R11 already hold RIP and RFLAGS from the return frame. See sysret_compatible.
 
     // clang-format off
-    asm volatile ("lea %[regs], %%rsp;"
+    asm volatile ("lea %[regs], %%rax;"
+                  ".globl sysret_window;"
+                  "sysret_window:"
+                  "sgdt %[gdtr];"
+                  "cmpw %[limit], %[gdtr];"
+                  "jne iret_regs_to_user;"
+
+                  "mov %%rax, %%rsp;"
                   EXPAND (LOAD_GPR)
 
-                  // Restore the user stack and RFLAGS. SYSRET loads RFLAGS from
-                  // R11. See entry_sysenter.
-                  "mov %%r11, %%rsp;"
-                  "mov $0, %%r11;"
+                  // RSP points to err in Exc_regs now.
+                  "mov %c[rsp_ofs](%%rsp), %%rsp;"
 
                   "swapgs;"
 
@@ -153,11 +293,16 @@ void Ec::ret_user_sysexit()
                   // See for example the Xen writeup about this problem:
                   // https://xenproject.org/2012/06/13/the-intel-sysret-privilege-escalation/
                   //
-                  // This issue is prevented by preventing user mappings at the
-                  // canonical boundary by setting USER_ADDR to one page before
-                  // the boundary and thus the RIP we return to cannot be
-                  // uncanonical.
-                  "sysretq;" : : [regs] "m" (current()->regs) : "memory");
+                  // This issue is prevented by only taking this path for
+                  // instruction pointers below USER_ADDR, which is one page
+                  // before the canonical boundary.
+                  ".globl sysret_to_user;"
+                  "sysret_to_user: sysretq;"
+                  : [gdtr] "=m" (gdtr)
+                  : [regs] "m" (current()->regs),
+                    [limit] "i" (Gdt::limit()),
+                    [rsp_ofs] "i" (OFFSETOF(Exc_regs, rsp) - OFFSETOF(Exc_regs, err))
+                  : "rax", "memory");
     // clang-format on
 
     UNREACHED;
@@ -166,6 +311,12 @@ void Ec::ret_user_sysexit()
 void Ec::return_to_user()
 {
     make_current();
+    Sc::switched_ec();
+
+    // A call or reply can enter another security domain than the one that the scheduler admitted.
+    if (EXPECT_FALSE(Cmdline::coresched) and not Core_sched::admit(pd)) {
+        Sc::schedule(false);
+    }
 
     // Set the stack behind the iret frame in Exc_regs for entry via
     // interrupts.
@@ -190,9 +341,24 @@ void Ec::return_to_user()
 void Ec::ret_user_iret()
 {
     handle_hazards(ret_user_iret);
+    ret_user();
+}
+
+void Ec::ret_user()
+{
+    Sched_stats::leave_kernel();
+
+    // A VM exit may have left guest MSRs loaded.
+    Vcpu::restore_host_msrs();
 
     assert_slow(Pd::is_pcid_valid());
 
+    // SYSRET is much cheaper than IRET, but can only return to some states. Exception and startup replies
+    // take this path as well, if the state allows it.
+    if (EXPECT_TRUE(sysret_compatible(current()->regs))) {
+        ret_user_sysret();
+    }
+
     // We cannot switch the stack here, because iret might fault and we will receive this exception with the
     // stack pointer pointing into the heap.
 
@@ -200,6 +366,9 @@ void Ec::ret_user_iret()
 
         ".globl iret_to_user\n"
 
+        // Ec::ret_user_sysret jumps here with RAX pointing to the registers, if it has to use IRET after all.
+        "iret_regs_to_user:\n"
+
         // We need to reset the stack, because otherwise subsequent NMIs might make us fault on iret
         // again and we have unbounded stack growth.
         "mov %%gs:0, %%rsp\n"
@@ -240,26 +409,76 @@ void Ec::ret_user_iret()
     UNREACHED;
 }
 
+// Pick the MWAIT hint for the next idle period.
+//
+// Deeper C-states take longer to enter and leave, so they only pay off if the CPU stays idle long enough. We
+// expect the next idle period to be as long as the recent ones. If this CPU waits for an RCU grace period, it
+// will have work again soon and we stay in C1.
+static uint32 idle_mwait_hint()
+{
+    // The shortest expected idle period in microseconds that we consider long enough for a deep C-state.
+    constexpr uint64 DEEP_IDLE_MIN_US{200};
+
+    if (Cmdline::nodeepidle or Cpu::mwait_hint_deep() == 0 or Rcu::pending()) {
+        return 0;
+    }
+
+    return Cpu::idle_avg() * 1000 >= DEEP_IDLE_MIN_US * Lapic::freq_tsc ? Cpu::mwait_hint_deep() : 0;
+}
+
 void Ec::idle()
 {
     for (;;) {
+        // We might be scheduled away when handling hazards, so we are only waiting for hazards after this
+        // point. Remote CPUs set hazards before checking this flag, so either they see that we are not
+        // waiting and send an NMI or we see their hazard.
+        Atomic::store(Cpu::idle_waiting(), false);
         handle_hazards(idle);
+        Atomic::store(Cpu::idle_waiting(), true);
+
+        // The work of the idle loop is accounted on its own.
+        Sched_stats::leave_kernel();
+
+        // We have nothing to do. Ask a busy CPU for work. A stolen SC arrives via our remote run queue and
+        // its hazard wakes us up.
+        Sc::steal();
+
+        // Run cleanup work that system calls left behind. One item at a time, like the work below.
+        if (Deferred_work::run()) {
+            continue;
+        }
+
+        // Prepare zeroed pages for later allocations. We zero one page at a time, so we notice new hazards
+        // quickly.
+        if (Buddy::allocator.zero_idle()) {
+            continue;
+        }
+
+        // Print the log messages of all CPUs, also piece by piece. See Console_log.
+        if (Console_log::drain()) {
+            continue;
+        }
 
         // In case the CPU doesn't support MONITOR/MWAIT, the idle loop is basically a busy loop. This is
         // fine, because the passthrough VM is expected to the case where the system is idle.
         //
         // We only end up here on systems with broken MONITOR/MWAIT during bootup and due to lock contention .
+        uint64 const idle_start{rdtsc()};
+
         if (EXPECT_FALSE(not Cpu::feature(Cpu::FEAT_MONITOR))) {
             relax();
+            Sched_stats::inc(Sc::stats()->idle_tsc, rdtsc() - idle_start);
             continue;
         }
 
+        uint32 const hint{idle_mwait_hint()};
+
         asm volatile(
             // Arm the monitor. The address in RAX will be monitored.
             "lea %[hazards], %%rax\n"
             "monitor\n"
-            // EAX contains a hint to mwait, thus we have to clear them.
-            "xor %%eax, %%eax\n"
+            // EAX contains the C-state hint for mwait.
+            "mov %[hint], %%eax\n"
             // We have to check whether Cpu::hazards is still zero, because we may have received an NMI after
             // checking the hazards and before arming the monitor
             "cmpl $0, %[hazards]\n"
@@ -268,8 +487,62 @@ void Ec::idle()
             "1:\n"
             :
             // Monitor will cause a #GP if RCX != 0.
-            : "c"(0), [hazards] "m"(Cpu::hazard())
+            : "c"(0), [hazards] "m"(Cpu::hazard()), [hint] "r"(hint)
             : "rax");
+
+        uint64 const idle_len{rdtsc() - idle_start};
+
+        // The average gives the last idle period a weight of 1/8.
+        Cpu::idle_avg() = Cpu::idle_avg() - Cpu::idle_avg() / 8 + idle_len / 8;
+
+        Sched_stats::inc(Sc::stats()->idle_tsc, idle_len);
+
+        if (hint) {
+            Sched_stats::inc(Sc::stats()->deep_idle_tsc, idle_len);
+        }
+    }
+}
+
+// Map the loadable segments of the roottask ELF image directly from the boot module. Nothing is copied and
+// each segment is mapped with the largest pages that the alignment of its physical and virtual addresses
+// allows, which matters for roottask images that are hundreds of megabytes large.
+static void map_root_segments(Tlb_cleanup& cleanup, ELF_PHDR const* p, unsigned count)
+{
+    for (unsigned i = 0; i < count; i++, p++) {
+
+        if (p->type != 1) {
+            continue;
+        }
+
+        unsigned attr = ((p->flags & 0x4) ? Mdb::MEM_R : 0) | ((p->flags & 0x2) ? Mdb::MEM_W : 0) |
+                        ((p->flags & 0x1) ? Mdb::MEM_X : 0);
+
+        if (p->f_size != p->m_size || p->v_addr % PAGE_SIZE != p->f_offs % PAGE_SIZE)
+            Ec::die("Bad ELF");
+
+        mword phys = align_dn(p->f_offs + Hip::root_addr, PAGE_SIZE);
+        mword virt = align_dn(p->v_addr, PAGE_SIZE);
+        mword size = align_up(p->f_size + (p->v_addr - virt), PAGE_SIZE);
+
+        for (unsigned long o; size; size -= 1UL << o, phys += 1UL << o, virt += 1UL << o) {
+            Pd::current()
+                ->delegate<Space_mem>(cleanup, &Pd::kern, phys >> PAGE_BITS, virt >> PAGE_BITS,
+                                      (o = min(max_order(phys, size), max_order(virt, size))) - PAGE_BITS,
+                                      attr, Space::SUBSPACE_HOST)
+                .unwrap("Failed to map roottask ELF image");
+        }
+    }
+}
+
+// The HIP spans more than one page with many CPUs, so we map it page by page.
+static void map_root_hip(Tlb_cleanup& cleanup)
+{
+    for (mword offset{0}; offset < HIP_SIZE; offset += PAGE_SIZE) {
+        Pd::current()
+            ->delegate<Space_mem>(cleanup, &Pd::kern, Buddy::ptr_to_phys(PAGE_H + offset) >> PAGE_BITS,
+                                  (USER_ADDR - HIP_SIZE + offset) >> PAGE_BITS, 0, Mdb::MEM_R,
+                                  Space::SUBSPACE_HOST)
+            .unwrap("Failed to map HIP");
     }
 }
 
@@ -283,53 +556,20 @@ void Ec::root_invoke()
     unsigned count = e->ph_count;
     current()->regs.set_pt(Cpu::id());
     current()->regs.set_ip(e->entry);
-    current()->regs.set_sp(USER_ADDR - PAGE_SIZE);
+    current()->regs.set_sp(USER_ADDR - HIP_SIZE);
 
     ELF_PHDR* p = static_cast<ELF_PHDR*>(Hpt::remap(Hip::root_addr + e->ph_offset, false));
 
-    for (unsigned i = 0; i < count; i++, p++) {
-
-        if (p->type == 1) {
-
-            unsigned attr = ((p->flags & 0x4) ? Mdb::MEM_R : 0) | ((p->flags & 0x2) ? Mdb::MEM_W : 0) |
-                            ((p->flags & 0x1) ? Mdb::MEM_X : 0);
-
-            if (p->f_size != p->m_size || p->v_addr % PAGE_SIZE != p->f_offs % PAGE_SIZE)
-                die("Bad ELF");
-
-            mword phys = align_dn(p->f_offs + Hip::root_addr, PAGE_SIZE);
-            mword virt = align_dn(p->v_addr, PAGE_SIZE);
-            mword size = align_up(p->f_size, PAGE_SIZE);
-
-            for (unsigned long o; size; size -= 1UL << o, phys += 1UL << o, virt += 1UL << o) {
-                Tlb_cleanup cleanup;
-
-                Pd::current()
-                    ->delegate<Space_mem>(cleanup, &Pd::kern, phys >> PAGE_BITS, virt >> PAGE_BITS,
-                                          (o = min(max_order(phys, size), max_order(virt, size))) - PAGE_BITS,
-                                          attr, Space::SUBSPACE_HOST)
-                    .unwrap("Failed to map roottask ELF image");
-
-                // This code maps the initial ELF segments into the roottask. This means it is by definition
-                // executed before the roottask had a chance to run. This means, we do not need to TLB flush
-                // here.
-                cleanup.ignore_tlb_flush();
-            }
-        }
-    }
-
-    // Map hypervisor information page
+    // Create the cleanup object in a separate scope, because ret_user_sysexit will not return. If we don't do
+    // this, the destructor doesn't run.
     {
-        // Create the cleanup object in a separate scope, because ret_user_sysexit will not return. If we
-        // don't do this, the destructor doesn't run.
+        // This code maps the initial ELF segments and the HIP into the roottask. This means it is by
+        // definition executed before the roottask had a chance to run, so we do not need to flush the TLB.
         Tlb_cleanup cleanup;
 
-        Pd::current()
-            ->delegate<Space_mem>(cleanup, &Pd::kern, Buddy::ptr_to_phys(&PAGE_H) >> PAGE_BITS,
-                                  (USER_ADDR - PAGE_SIZE) >> PAGE_BITS, 0, Mdb::MEM_R, Space::SUBSPACE_HOST)
-            .unwrap("Failed to map HIP");
+        map_root_segments(cleanup, p, count);
+        map_root_hip(cleanup);
 
-        // The PD is not used yet.
         cleanup.ignore_tlb_flush();
     }
 
@@ -337,6 +577,9 @@ void Ec::root_invoke()
     Space_obj::insert_root(Ec::current());
     Space_obj::insert_root(Sc::current());
 
+    Boot_profile::mark(Boot_profile::ROOTTASK);
+    Boot_profile::print();
+
     ret_user_sysexit();
 }
 
@@ -365,7 +608,9 @@ void Ec::die(char const* reason, Exc_regs* r)
 
     Ec* ec = current()->rcap;
 
-    if (ec)
+    // A caller that waits for the reply to a VMCALL of its vCPU survives. Without reply, Vcpu::finish_vmcall
+    // reports the VMCALL exit to the VMM.
+    if (ec and ec->cont != ret_vmcall)
         ec->cont =
             ec->cont == ret_user_sysexit ? static_cast<void (*)()>(sys_finish<Sys_regs::COM_ABT>) : dead;
 
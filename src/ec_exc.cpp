@@ -24,9 +24,18 @@
 #include "extern.hpp"
 #include "gdt.hpp"
 #include "mca.hpp"
+#include "microcode.hpp"
+#include "pmu.hpp"
+#include "sched_stats.hpp"
 
 void Ec::load_fpu()
 {
+    // With lazy switching, the state is loaded when we use the FPU. See Ec::handle_exc_nm.
+    if (Fpu::lazy_switching()) {
+        Fpu::trap_on_use(fpu_owner() != this);
+        return;
+    }
+
     // The idle EC never switches to user space and we do not use the FPU inside the kernel. Thus we can
     // skip loading or saving the FPU-state in case this EC is an idle EC to improve the performance.
     if (not is_idle_ec()) {
@@ -36,6 +45,19 @@ void Ec::load_fpu()
 
 void Ec::save_fpu()
 {
+    // A vCPU keeps its guest FPU state loaded across VM exits. Our own FPU state is already saved in this
+    // case, but we must not lose the state of the guest.
+    if (vcpu != nullptr and vcpu->save_guest_fpu()) {
+        return;
+    }
+
+    // With lazy switching, the FPU may hold the state of any EC. The caller wants to use the FPU, so it has
+    // to be saved, no matter whose it is.
+    if (Fpu::lazy_switching()) {
+        save_fpu_owner();
+        return;
+    }
+
     // See comment in Ec::load_fpu.
     if (not is_idle_ec()) {
         fpu.save();
@@ -48,10 +70,82 @@ void Ec::transfer_fpu(Ec* from_ec)
         return;
     }
 
+    // The FPU state of ECs stays in place until another EC uses the FPU, but the guest FPU state of a vCPU
+    // is still switched eagerly.
+    if (Fpu::lazy_switching()) {
+        if (from_ec->vcpu != nullptr) {
+            Fpu::trap_on_use(false);
+            from_ec->vcpu->save_guest_fpu();
+        }
+
+        load_fpu();
+        return;
+    }
+
     from_ec->save_fpu();
     load_fpu();
 }
 
+void Ec::save_fpu_owner()
+{
+    Ec* const owner{fpu_owner()};
+
+    Fpu::trap_on_use(false);
+
+    if (not owner) {
+        return;
+    }
+
+    owner->fpu.save();
+    fpu_owner() = nullptr;
+
+    // See Ec::handle_exc_nm.
+    if (owner->del_rcu()) {
+        Rcu::call(owner);
+    }
+}
+
+void Ec::flush_fpu()
+{
+    if (not Fpu::lazy_switching()) {
+        return;
+    }
+
+    save_fpu_owner();
+
+    // Nobody owns the FPU anymore, so the current EC has to trap when it uses it.
+    Fpu::trap_on_use(true);
+}
+
+bool Ec::handle_exc_nm()
+{
+    // The first AMX instruction of an EC traps, because its context has no room for the tile data yet. The
+    // EC sees the #NM, if there is no memory for a larger context.
+    if (Fpu::xfd_fault()) {
+        return current()->fpu.grow();
+    }
+
+    if (not Fpu::lazy_switching()) {
+        return false;
+    }
+
+    Ec* const self{current()};
+
+    if (fpu_owner() != self) {
+        save_fpu_owner();
+
+        // The owner keeps a reference, because its state may stay in the FPU long after it stopped running.
+        bool ok = self->add_ref();
+        assert(ok);
+
+        self->fpu.load();
+        fpu_owner() = self;
+    }
+
+    Fpu::trap_on_use(false);
+    return true;
+}
+
 bool Ec::handle_exc_gp(Exc_regs* r) { return fixup(r); }
 
 bool Ec::handle_exc_pf(Exc_regs* r)
@@ -100,7 +194,9 @@ void Ec::do_early_nmi_work()
 
     // Acknowledge the TLB invalidation request. We promise to flush the TLB before we execute any user/guest
     // code.
-    Atomic::add(Counter::tlb_shootdown(), static_cast<uint16>(1));
+    Counter::ack_tlb_shootdown();
+
+    Sched_stats::count(&Sched_stats::nmi_cnt);
 }
 
 void Ec::do_deferred_nmi_work()
@@ -118,10 +214,7 @@ void Ec::do_deferred_nmi_work()
 
     // Handle a stale TLB.
     if ((Atomic::load(Cpu::hazard()) & HZD_TLB) != 0) {
-        if (Pd::current()->Space_mem::stale_host_tlb.chk(Cpu::id())) {
-            Pd::current()->Space_mem::stale_host_tlb.clr(Cpu::id());
-            Hpt::flush();
-        }
+        Pd::current()->Space_mem::flush_stale_host_tlb();
         Atomic::clr_mask(Cpu::hazard(), HZD_TLB);
     }
 
@@ -130,10 +223,21 @@ void Ec::do_deferred_nmi_work()
         Atomic::clr_mask(Cpu::hazard(), HZD_RCU);
     }
 
+    // Callbacks may do anything, so we only pass through the quiescent state here and leave the hazard set.
+    // The callbacks run when we leave the kernel the next time.
+    if ((Atomic::load(Cpu::hazard()) & HZD_IDL) != 0) {
+        Rcu::quiet_expedited();
+    }
+
+    // Clear the hazard before draining the queue. Otherwise, an SC that is pushed into the then empty queue
+    // after the drain would be left behind without a hazard that reminds us to pick it up.
     if ((Atomic::load(Cpu::hazard()) & HZD_RRQ) != 0) {
-        Sc::rrq_handler();
         Atomic::clr_mask(Cpu::hazard(), HZD_RRQ);
+        Sc::rrq_handler();
     }
+
+    // HZD_STEAL stays set. Migrating an EC may save its FPU state, which we don't do on the NMI stack. The
+    // steal request is answered the next time we leave the kernel.
 }
 
 void Ec::maybe_handle_deferred_nmi_work(Exc_regs* r)
@@ -202,6 +306,11 @@ void Ec::handle_exc(Exc_regs* r)
             return;
         break;
 
+    case Cpu::EXC_NM:
+        if (r->user() and handle_exc_nm())
+            return;
+        break;
+
     case Cpu::EXC_MC:
         Mca::vector();
         break;
@@ -243,16 +352,33 @@ void Ec::handle_exc_altstack(Exc_regs* r)
     // different code paths, depending on whether we were interrupted in user space or kernel space.
     case Cpu::EXC_NMI:
         do_early_nmi_work();
+        Pmu::handle_nmi(r->rip, r->user() ? Pmu::USER : Pmu::KERNEL);
+        Microcode::handle_nmi();
 
         // If we were interrupted in user space, we know that we do not hold any locks and we are not
         // currently modifying any kernel data structure. Thus, after restoring our CPU-local memory, we
-        // can also do the deferred NMI work.
-        if (r->user() /* from userspace */) {
+        // can also do the deferred NMI work. The same holds for the last instructions of
+        // Ec::ret_user_sysret, because we have no way to make SYSRET trap for the deferred work.
+        if (bool const in_sysret_window{r->rip >= reinterpret_cast<mword>(&sysret_window) and
+                                        r->rip <= reinterpret_cast<mword>(&sysret_to_user)};
+            r->user() or in_sysret_window) {
+
+            // The SWAPGS before SYSRET has already happened, if we interrupted the SYSRET itself.
+            bool const user_gs{r->user() or r->rip == reinterpret_cast<mword>(&sysret_to_user)};
 
             // Cpulocal::restore_for_nmi has changed GS_BASE, thus we have to restore the old_gs_base and then
             // call swapgs() to make GS_BASE/GS_BASE_KERNEL look like the kernel.
             wrgsbase(old_gs_base);
-            swapgs();
+
+            if (user_gs) {
+                swapgs();
+            }
+
+            if (in_sysret_window) {
+                // An earlier NMI may have interrupted the kernel before the window. Ec::ret_user_sysret
+                // then either still checks the GDT or goes to IRET anyway, so we can undo the trap here.
+                fixup_nmi_user_trap();
+            }
 
             // If this assertion triggers, we exited to user space although we tried to prevent exactly that.
             assert_slow(Gdt::store().limit == Gdt::limit());
@@ -265,14 +391,16 @@ void Ec::handle_exc_altstack(Exc_regs* r)
             do_deferred_nmi_work();
 
             // We will go back to user space, thus we have to swapgs again.
-            swapgs();
+            if (user_gs) {
+                swapgs();
+            }
         }
 
         // If we interrupted the kernel we defer the NMI work until the next exit to user space, or until the
         // next vmresume. To do that, we
-        //   - load only the kernel part of the GDT, that way iret to user space will generate a #GP. We
-        //     currently redirect Ec::ret_user_sysret to Ec::ret_user_iret, thus this also handles the
-        //     sysret. (Check Ec::handle_exc for more information)
+        //   - load only the kernel part of the GDT, that way iret to user space will generate a #GP. SYSRET
+        //     does not use the GDT, thus Ec::ret_user_sysret checks the GDT limit and takes the IRET path
+        //     when it finds it reduced. (Check Ec::handle_exc for more information)
         //   - write a 0 into Vmcs::HOST_SEL_CS. This will make the host state checks during VM-entry
         //     fail. (Check Vcpu::maybe_handle_invalid_guest_state for more information)
         // That way we know that we do the deferred NMI work at safe places.
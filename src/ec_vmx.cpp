@@ -20,6 +20,7 @@
 
 #include "ec.hpp"
 #include "lapic.hpp"
+#include "pt.hpp"
 #include "vcpu.hpp"
 #include "vmx.hpp"
 #include "vmx_preemption_timer.hpp"
@@ -35,7 +36,7 @@ void Ec::handle_vmx()
     Gdt::unbusy_tss();
     Tss::load();
 
-    Cpu::setup_msrs();
+    // The host MSRs are only restored before we return to host user space. See Vcpu::restore_host_msrs.
 
     // A VM exit occured. We pass the control flow to the vCPU object and let it handle the exit.
     assert(current()->vcpu != nullptr);
@@ -73,7 +74,42 @@ void Ec::resume_vcpu()
 {
     assert(Ec::current()->vcpu != nullptr);
 
+    // The guest can see in its steal time record that we might run something else now.
+    if (EXPECT_FALSE(Atomic::load(Cpu::hazard()) & HZD_SCHED)) {
+        Ec::current()->vcpu->mark_preempted();
+    }
+
     handle_hazards(resume_vcpu);
 
     Ec::current()->vcpu->run();
 }
+
+void Ec::call_vmcall_portal(Pt* pt, Cpu_regs const& guest)
+{
+    Ec* const self{current()};
+    Ec* const ec{pt->ec.get()};
+
+    // Like a non-blocking call, we don't help a busy handler. The VMM handles the VMCALL instead.
+    if (EXPECT_FALSE(ec == self or self->cpu != ec->xcpu or ec->cont)) {
+        return;
+    }
+
+    self->cont = ret_vmcall;
+    self->set_partner(ec);
+
+    ec->regs.ARG_2 = guest.rbx;
+    ec->regs.ARG_3 = guest.rcx;
+    ec->regs.ARG_4 = guest.rdx;
+    ec->regs.ARG_5 = guest.rsi;
+    ec->cont = ret_user_sysexit;
+    ec->regs.set_pt(pt->id);
+    ec->regs.set_ip(pt->ip);
+    ec->return_to_user();
+}
+
+void Ec::ret_vmcall()
+{
+    assert(current()->vcpu != nullptr);
+
+    current()->vcpu->finish_vmcall();
+}
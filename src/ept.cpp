@@ -18,8 +18,10 @@
 #include "ept.hpp"
 #include "hpt.hpp"
 #include "mdb.hpp"
+#include "sched_stats.hpp"
 
 Ept::level_t Ept::supported_leaf_levels{1};
+bool Ept::single_context_invept{true};
 
 static Ept::pte_t attr_from_hpt(mword a)
 {
@@ -46,5 +48,34 @@ Ept::Mapping Ept::convert_mapping(Hpt::Mapping const& hpt_mapping)
 void Ept::set_supported_leaf_levels(Ept::level_t level)
 {
     assert(level > 0);
-    supported_leaf_levels = level;
+
+    // All CPUs set this in parallel during boot. See Bootstrap::bootstrap.
+    Atomic::store(supported_leaf_levels, level);
+}
+
+void Ept::set_single_context_invept(bool supported)
+{
+    // All CPUs set this in parallel during boot. One CPU without support is enough to fall back.
+    if (not supported) {
+        Atomic::store(single_context_invept, false);
+    }
+}
+
+void Ept::invalidate()
+{
+    struct {
+        uint64 eptp, rsvd;
+    } const desc{vmcs_eptp(), 0};
+    static_assert(sizeof(desc) == 16, "INVEPT descriptor layout is broken");
+
+    bool const single{has_single_context_invept()};
+
+    Sched_stats::count(single ? &Sched_stats::invept_single_cnt : &Sched_stats::invept_all_cnt);
+
+    bool ret;
+    asm volatile("invept %1, %2"
+                 : "=@cca"(ret)
+                 : "m"(desc), "r"(single ? INVEPT_SINGLE_CONTEXT : INVEPT_ALL_CONTEXT)
+                 : "cc", "memory");
+    assert(ret);
 }
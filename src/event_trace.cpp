@@ -0,0 +1,49 @@
+/*
+ * Event Trace
+ *
+ * This file is part of the Hedron hypervisor.
+ *
+ * Hedron is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Hedron is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License version 2 for more details.
+ */
+
+#include "event_trace.hpp"
+#include "buddy.hpp"
+
+static_assert(Event_trace::ENTRIES * sizeof(Event_trace_entry) == PAGE_SIZE,
+              "The event trace ring must fill a page");
+
+Event_trace_entry* Event_trace::get_ring(unsigned cpu)
+{
+    Event_trace_entry*& ring_ref{remote_ref_ring(cpu)};
+
+    if (Event_trace_entry* const r{Atomic::load(ring_ref)}; r) {
+        return r;
+    }
+
+    Alloc_result<void*> page{Buddy::allocator.try_alloc(0, Buddy::FILL_0)};
+
+    if (page.is_err()) {
+        return nullptr;
+    }
+
+    Event_trace_entry* const r{static_cast<Event_trace_entry*>(page.unwrap())};
+
+    for (unsigned i{0}; i < ENTRIES; i++) {
+        r[i].cpu = static_cast<uint16>(cpu);
+    }
+
+    // Someone else might have been faster. The ring must never change once it is set, because user space may
+    // have it mapped.
+    if (not Atomic::cmp_swap(ring_ref, static_cast<Event_trace_entry*>(nullptr), r)) {
+        Buddy::allocator.free(reinterpret_cast<mword>(r));
+    }
+
+    return Atomic::load(ring_ref);
+}
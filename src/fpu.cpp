@@ -19,23 +19,67 @@
  */
 
 #include "fpu.hpp"
+#include "buddy.hpp"
 #include "compiler.hpp"
 #include "cpu.hpp"
 #include "kp.hpp"
+#include "msr.hpp"
+#include "string.hpp"
 #include "x86.hpp"
 
+#ifndef FPU_FIXED_MODE
 Fpu::FpuConfig Fpu::config;
+#endif
 
 static const uint64 required_xsave_state{Cpu::XCR0_X87};
 static const uint64 supported_xsave_state{Cpu::XCR0_X87 | Cpu::XCR0_SSE | Cpu::XCR0_AVX |
                                           Cpu::XCR0_AVX512_OP | Cpu::XCR0_AVX512_LO | Cpu::XCR0_AVX512_HI};
 
+static constexpr uint64 amx_xsave_state{Cpu::XCR0_AMX_CFG | Cpu::XCR0_AMX_DATA};
+
 static void xsave_enable(uint64 xcr0)
 {
     set_cr4(get_cr4() | Cpu::CR4_OSXSAVE);
     set_xcr(0, xcr0);
 }
 
+#ifndef FPU_FIXED_MODE
+// Returns true if the CPU supports AMX and can disable its tile data with XFD.
+static bool amx_with_xfd(uint64 valid_xcr0)
+{
+    uint32 eax, ebx, ecx, edx;
+
+    if ((valid_xcr0 & amx_xsave_state) != amx_xsave_state) {
+        return false;
+    }
+
+    cpuid(0xD, 1, eax, ebx, ecx, edx);
+    bool const xfd{(eax & (1U << 4)) != 0};
+
+    cpuid(0xD, 18, eax, ebx, ecx, edx);
+    return xfd and (ecx & (1U << 2));
+}
+
+// The size of a standard-format XSAVE area for the components in xcr0 without the AMX tile data.
+static size_t context_size_without_tiles(uint64 xcr0)
+{
+    size_t size{512 + 64}; // Legacy region and XSAVE header
+
+    for (unsigned i{2}; i < 64; i++) {
+        if (i == 18 or not(xcr0 & (1ULL << i))) {
+            continue;
+        }
+
+        uint32 comp_size, comp_offset, discard;
+        cpuid(0xD, i, comp_size, comp_offset, discard, discard);
+
+        size = max(size, size_t{comp_offset} + comp_size);
+    }
+
+    return size;
+}
+#endif
+
 void Fpu::probe()
 {
     if (not Cpu::feature(Cpu::FEAT_XSAVE)) {
@@ -48,54 +92,195 @@ void Fpu::probe()
     cpuid(0xD, 0, valid_xcr0_lo, discard, discard, valid_xcr0_hi);
 
     xcr0 = static_cast<uint64>(valid_xcr0_lo) << 32 | valid_xcr0_lo;
+
+#ifndef FPU_FIXED_MODE
+    bool const amx{amx_with_xfd(xcr0)};
+#endif
+
     xcr0 &= supported_xsave_state;
+
+#ifndef FPU_FIXED_MODE
+    if (amx) {
+        xcr0 |= amx_xsave_state;
+    }
+#endif
+
     xsave_enable(xcr0);
 
     cpuid(0xD, 0, discard, current_context, discard, discard);
 
-    Fpu::config = {xcr0, current_context,
-                   Cpu::feature(Cpu::FEAT_XSAVEOPT) ? Fpu::Mode::XSAVEOPT : Fpu::Mode::XSAVE};
+    Mode const standard_mode{Cpu::feature(Cpu::FEAT_XSAVEOPT) ? Mode::XSAVEOPT : Mode::XSAVE};
+    Mode compacted_mode{standard_mode};
+
+    if (Cpu::feature(Cpu::FEAT_XSAVES)) {
+        compacted_mode = Mode::XSAVES;
+    } else if (Cpu::feature(Cpu::FEAT_XSAVEC)) {
+        compacted_mode = Mode::XSAVEC;
+    }
+
+#ifdef FPU_FIXED_MODE
+    if (xcr0 != config.xsave_scb or current_context != config.context_size or
+        compacted_mode != config.compacted_mode or standard_mode != config.standard_mode) {
+        panic("FPU does not match the build configuration (XCR0 %#llx, context size %u, mode %u)", xcr0,
+              current_context, static_cast<unsigned>(compacted_mode));
+    }
+#else
+    // Contexts only have room for the AMX tile data once they use it. See Fpu::grow.
+    if (amx) {
+        Fpu::config = {xcr0, context_size_without_tiles(xcr0), current_context, compacted_mode,
+                       standard_mode};
+    } else {
+        Fpu::config = {xcr0, current_context, 0, compacted_mode, standard_mode};
+    }
 
     if (Fpu::config.context_size > PAGE_SIZE) {
         panic("Context size is too large for a kernel-page.");
     }
+#endif
 }
 
-void Fpu::init() { xsave_enable(config.xsave_scb); }
+void Fpu::trap_on_use(bool trap)
+{
+    mword const cr0{get_cr0()};
+    mword const new_cr0{trap ? cr0 | Cpu::CR0_TS : cr0 & ~mword{Cpu::CR0_TS}};
+
+    // Writing CR0 is much more expensive than reading it.
+    if (new_cr0 != cr0) {
+        set_cr0(new_cr0);
+    }
+}
+
+void Fpu::init()
+{
+    xsave_enable(config.xsave_scb);
+
+    // Nobody owns the FPU yet. See Ec::handle_exc_nm.
+    if (lazy_switching()) {
+        trap_on_use(true);
+    }
+
+    // Contexts start without room for the AMX tile data, so the first AMX instruction traps. INIT clears
+    // IA32_XFD, so we also do this after a resume.
+    if (amx()) {
+        xfd() = Cpu::XCR0_AMX_DATA;
+        Msr::write(Msr::IA32_XFD, xfd());
+    }
+
+    // We don't manage any supervisor state components (yet), so XSAVES only saves user state components. We
+    // use it for its compacted format and its init and modified optimizations.
+    if (config.compacted_mode == Mode::XSAVES) {
+        Msr::write(Msr::IA32_XSS, 0);
+    }
+}
 
 Fpu::FpuCtx* Fpu::data()
 {
+    if (EXPECT_FALSE(large_)) {
+        return large_;
+    }
+
     assert_slow(data_);
     return reinterpret_cast<FpuCtx*>(data_->data_page());
 }
 
-void Fpu::save()
+uint64 Fpu::xsave_mask() const
 {
-    uint32 xsave_scb_hi{static_cast<uint32>(config.xsave_scb >> 32)};
-    uint32 xsave_scb_lo{static_cast<uint32>(config.xsave_scb)};
+    return EXPECT_FALSE(large_) ? config.xsave_scb : config.xsave_scb & ~uint64{Cpu::XCR0_AMX_DATA};
+}
 
-    switch (config.mode) {
-    case Mode::XSAVEOPT:
+void Fpu::set_xfd(uint64 value)
+{
+    if (EXPECT_FALSE(value != xfd())) {
+        xfd() = value;
+        Msr::write(Msr::IA32_XFD, value);
+    }
+}
+
+template <Fpu::Mode M> void Fpu::save_as()
+{
+    uint32 xsave_scb_hi{static_cast<uint32>(xsave_mask() >> 32)};
+    uint32 xsave_scb_lo{static_cast<uint32>(xsave_mask())};
+
+    if constexpr (M == Mode::XSAVES) {
+        asm volatile("xsaves %0" : "=m"(*data()) : "d"(xsave_scb_hi), "a"(xsave_scb_lo) : "memory");
+    } else if constexpr (M == Mode::XSAVEC) {
+        asm volatile("xsavec %0" : "=m"(*data()) : "d"(xsave_scb_hi), "a"(xsave_scb_lo) : "memory");
+    } else if constexpr (M == Mode::XSAVEOPT) {
         asm volatile("xsaveopt %0" : "=m"(*data()) : "d"(xsave_scb_hi), "a"(xsave_scb_lo) : "memory");
+    } else {
+        asm volatile("xsave %0" : "=m"(*data()) : "d"(xsave_scb_hi), "a"(xsave_scb_lo) : "memory");
+    }
+}
+
+template <Fpu::Mode M> void Fpu::load_as()
+{
+    uint32 xsave_scb_hi{static_cast<uint32>(xsave_mask() >> 32)};
+    uint32 xsave_scb_lo{static_cast<uint32>(xsave_mask())};
+
+    // XRSTOR handles both formats, but only XRSTORS restores what XSAVES saved.
+    if constexpr (M == Mode::XSAVES) {
+        asm volatile("xrstors %0" : : "m"(*data()), "d"(xsave_scb_hi), "a"(xsave_scb_lo) : "memory");
+    } else {
+        asm volatile("xrstor %0" : : "m"(*data()), "d"(xsave_scb_hi), "a"(xsave_scb_lo) : "memory");
+    }
+}
+
+void Fpu::save()
+{
+#ifdef FPU_FIXED_MODE
+    // Only the two modes of the fixed configuration are left.
+    if (mode_ == config.compacted_mode) {
+        save_as<config.compacted_mode>();
+    } else {
+        save_as<config.standard_mode>();
+    }
+#else
+    switch (mode_) {
+    case Mode::XSAVES:
+        save_as<Mode::XSAVES>();
+        break;
+    case Mode::XSAVEC:
+        save_as<Mode::XSAVEC>();
+        break;
+    case Mode::XSAVEOPT:
+        save_as<Mode::XSAVEOPT>();
         break;
     case Mode::XSAVE:
-        asm volatile("xsave %0" : "=m"(*data()) : "d"(xsave_scb_hi), "a"(xsave_scb_lo) : "memory");
+        save_as<Mode::XSAVE>();
         break;
     }
+#endif
 }
 
 void Fpu::load()
 {
-    uint32 xsave_scb_hi{static_cast<uint32>(config.xsave_scb >> 32)};
-    uint32 xsave_scb_lo{static_cast<uint32>(config.xsave_scb)};
+    // Only contexts with room for the tile data may use it.
+    if (amx()) {
+        set_xfd(large_ ? 0 : Cpu::XCR0_AMX_DATA);
+    }
 
-    asm volatile("xrstor %0" : : "m"(*data()), "d"(xsave_scb_hi), "a"(xsave_scb_lo) : "memory");
+#ifdef FPU_FIXED_MODE
+    if (mode_ == config.compacted_mode) {
+        load_as<config.compacted_mode>();
+    } else {
+        load_as<config.standard_mode>();
+    }
+#else
+    if (mode_ == Mode::XSAVES) {
+        load_as<Mode::XSAVES>();
+    } else {
+        load_as<Mode::XSAVE>();
+    }
+#endif
 }
 
 bool Fpu::load_from_user()
 {
-    uint32 xsave_scb_hi{static_cast<uint32>(config.xsave_scb >> 32)};
-    uint32 xsave_scb_lo{static_cast<uint32>(config.xsave_scb)};
+    uint32 xsave_scb_hi{static_cast<uint32>(xsave_mask() >> 32)};
+    uint32 xsave_scb_lo{static_cast<uint32>(xsave_mask())};
+
+    assert_slow(mode_ == config.standard_mode);
+    assert_slow(not large_);
 
     bool skipped{false};
     asm volatile(FIXUP_CALL("xrstor %[xsave_area]")
@@ -105,11 +290,59 @@ bool Fpu::load_from_user()
     return not skipped;
 }
 
-static bool is_valid_xcr0(uint64 xsave_scb, uint64 xcr0)
+bool Fpu::xfd_fault()
+{
+    if (not amx() or not Msr::read(Msr::IA32_XFD_ERR)) {
+        return false;
+    }
+
+    // The CPU sets IA32_XFD_ERR, but never clears it.
+    Msr::write(Msr::IA32_XFD_ERR, 0);
+    return true;
+}
+
+bool Fpu::grow()
+{
+    assert(not large_);
+
+    // Builds with a fixed FPU configuration don't enable AMX.
+    if (not amx()) {
+        return false;
+    }
+
+    unsigned short order{0};
+
+    while ((mword{PAGE_SIZE} << order) < config.large_context_size) {
+        order++;
+    }
+
+    Alloc_result<void*> area{Buddy::allocator.try_alloc(order, Buddy::NOFILL)};
+
+    if (EXPECT_FALSE(area.is_err())) {
+        return false;
+    }
+
+    // The tile data comes last in both formats, so the smaller context is the start of the larger one.
+    // XSTATE_BV marks the tile data as unused, so loading the larger context initializes it.
+    save();
+    memcpy(area.unwrap(), data(), config.context_size);
+
+    large_ = static_cast<FpuCtx*>(area.unwrap());
+
+    if (mode_ == Mode::XSAVES or mode_ == Mode::XSAVEC) {
+        large_->xsave_hdr.xcomp_bv |= Cpu::XCR0_AMX_DATA;
+    }
+
+    load();
+    return true;
+}
+
+bool Fpu::is_valid_xcr0(uint64 xcr0)
 {
     mword sanitized{xcr0};
 
-    sanitized &= xsave_scb;
+    // Guests would need their own IA32_XFD and IA32_XFD_ERR for AMX.
+    sanitized &= config.xsave_scb & ~amx_xsave_state;
     sanitized |= required_xsave_state;
 
     if (xcr0 & Cpu::XCR0_AVX) {
@@ -125,7 +358,7 @@ static bool is_valid_xcr0(uint64 xsave_scb, uint64 xcr0)
 
 bool Fpu::load_xcr0(uint64 xcr0)
 {
-    if (EXPECT_FALSE(not is_valid_xcr0(config.xsave_scb, xcr0))) {
+    if (EXPECT_FALSE(not is_valid_xcr0(xcr0))) {
         return false;
     }
 
@@ -135,9 +368,24 @@ bool Fpu::load_xcr0(uint64 xcr0)
 
 void Fpu::restore_xcr0() { set_xcr(0, config.xsave_scb); }
 
-Fpu::Fpu(Kp* data_kp) : data_(data_kp)
+Fpu::Fpu(Kp* data_kp, Format format)
+    : data_(data_kp), mode_(format == Format::COMPACTED ? config.compacted_mode : config.standard_mode)
 {
     // Mask exceptions by default according to SysV ABI spec.
     data()->legacy_hdr.fcw = 0x37f;
     data()->legacy_hdr.mxcsr = 0x1f80;
+
+    // Restoring a compacted context faults, if XCOMP_BV doesn't mark it as compacted. We also mark the x87
+    // and SSE state as in use, so the restore picks up the control words from above.
+    if (mode_ == Mode::XSAVES or mode_ == Mode::XSAVEC) {
+        data()->xsave_hdr.xstate_bv = Cpu::XCR0_X87 | Cpu::XCR0_SSE;
+        data()->xsave_hdr.xcomp_bv = XCOMP_BV_COMPACTED | xsave_mask();
+    }
+}
+
+Fpu::~Fpu()
+{
+    if (large_) {
+        Buddy::allocator.free(reinterpret_cast<mword>(large_));
+    }
 }
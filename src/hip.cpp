@@ -44,7 +44,7 @@ template <typename T> static void assert_in_hip(T const* ptr)
     void const* ptr_end{reinterpret_cast<char const*>(ptr) + sizeof(T)};
 
     assert(ptr_start >= PAGE_H);
-    assert(ptr_end <= &PAGE_H[PAGE_SIZE]);
+    assert(ptr_end <= &PAGE_H[HIP_SIZE]);
 }
 
 void Hip::build(mword magic, mword addr)
@@ -59,7 +59,8 @@ void Hip::build(mword magic, mword addr)
     // Other flags may have been added already earlier in the boot process, so
     // we preserve them. These flags will be modified again when the processor
     // initialization finds certain features to be missing/unusable.
-    h->api_flg |= FEAT_VMX;
+    h->api_flg |=
+        FEAT_VMX | FEAT_INVEPT_SINGLE | FEAT_INVVPID_SINGLE | FEAT_EPT_1G | FEAT_HPT_1G | FEAT_EPT_5_LEVEL;
     h->api_ver = CFG_VER;
     h->sel_num = Space_obj::caps;
     h->sel_exc = NUM_EXC;
@@ -176,11 +177,17 @@ void Hip::add_cpu(Cpu_info const& cpu_info)
 {
     Hip_cpu* cpu = hip()->cpu_desc + Cpu::id();
 
-    cpu->acpi_id = Cpu::acpi_id[Cpu::id()];
-    cpu->apic_id = Cpu::apic_id[Cpu::id()];
+    cpu->acpi_id = static_cast<uint8>(Cpu::acpi_id[Cpu::id()]);
+    cpu->apic_id = static_cast<uint8>(Cpu::apic_id[Cpu::id()]);
+    cpu->acpi_uid = Cpu::acpi_id[Cpu::id()];
+    cpu->x2apic_id = Cpu::apic_id[Cpu::id()];
+    cpu->numa_node = static_cast<uint8>(Cpu::numa_node[Cpu::id()]);
+    cpu->proximity_domain = Cpu::numa_node[Cpu::id()];
     cpu->package = static_cast<uint8>(cpu_info.package);
+    cpu->die = static_cast<uint8>(cpu_info.die);
     cpu->core = static_cast<uint8>(cpu_info.core);
     cpu->thread = static_cast<uint8>(cpu_info.thread);
+    cpu->llc_id = cpu_info.llc;
     cpu->flags = 1;
 }
 
@@ -22,25 +22,18 @@
 
 Hpt::level_t Hpt::supported_leaf_levels{2};
 
-Hpt Hpt::deep_copy(mword vaddr_start, mword vaddr_end)
+// All kernel mappings are translated by one entry at KERNEL_LEVEL. Everything above SPC_LOCAL is local to
+// each address space.
+static_assert(LINK_ADDR >> 30 == (SPC_LOCAL - 1) >> 30 and is_aligned_by_order(SPC_LOCAL, 30),
+              "Kernel mappings must fit into a single 1 GiB region");
+
+Hpt Hpt::share_kernel()
 {
-    Hpt::Mapping map;
     Hpt dst;
     Tlb_cleanup cleanup;
 
-    for (mword vaddr{vaddr_start}; vaddr < vaddr_end; vaddr += map.size()) {
-        map = lookup(vaddr);
-
-        if (not(map.present())) {
-            continue;
-        }
-
-        // We don't handle the case where vaddr_start and vaddr_end point into
-        // the middle mappings, but this case should also never happen.
-        assert(map.vaddr >= vaddr_start and map.vaddr + map.size() <= vaddr_end);
-
-        dst.update(cleanup, map).unwrap("Failed to allocate memory during deep copy");
-    }
+    dst.share(cleanup, *this, LINK_ADDR, KERNEL_LEVEL)
+        .unwrap("Failed to allocate memory when sharing kernel mappings");
 
     // We populate an empty page table that is also not yet used anywhere.
     assert(not cleanup.need_tlb_flush());
@@ -57,6 +50,10 @@ Hpt& Hpt::boot_hpt()
 
 const size_t Hpt::remap_guaranteed_size{0x200000};
 
+static_assert(SPC_LOCAL_REMAP_E == (LINK_ADDR & ~0x3fffffffUL),
+              "Remap windows must end at the shared kernel");
+static_assert(REMAP_SLOT_SIZE == 2 * Hpt::remap_guaranteed_size, "Remap windows hold two 2MB pages");
+
 void* Hpt::remap(Paddr phys, bool use_boot_hpt)
 {
     Tlb_cleanup cleanup;
@@ -78,15 +75,21 @@ void* Hpt::remap(Paddr phys, bool use_boot_hpt)
     Hpt& hpt{use_boot_hpt ? boot_hpt() : Pd::current()->hpt};
     assert_slow(hpt.is_active());
 
-    hpt.update(cleanup, {SPC_LOCAL_REMAP, phys, attr, order})
-        .unwrap("Failed to allocate memory when remapping");
-    hpt.update(cleanup, {SPC_LOCAL_REMAP + size, phys + size, attr, order})
+    // Only this CPU ever accesses its window, so no other CPU can have it in its TLB. Early during boot, we
+    // don't know our CPU number yet, but the boot CPU runs alone.
+    mword const window{SPC_LOCAL_REMAP + (Cpulocal::is_initialized() ? Cpu::id() : 0) * REMAP_SLOT_SIZE};
+
+    hpt.update(cleanup, {window, phys, attr, order}).unwrap("Failed to allocate memory when remapping");
+    hpt.update(cleanup, {window + size, phys + size, attr, order})
         .unwrap("Failed to allocate memory when remapping");
 
-    // We always need to flush the TLB.
-    hpt.flush();
+    // The window is only mapped in the current address space, so we invalidate it on this CPU for the
+    // current PCID. This also invalidates the paging-structure caches.
+    flush_one_page(reinterpret_cast<void*>(window));
+    flush_one_page(reinterpret_cast<void*>(window + size));
+    cleanup.ignore_tlb_flush();
 
-    return reinterpret_cast<void*>(SPC_LOCAL_REMAP + offset);
+    return reinterpret_cast<void*>(window + offset);
 }
 
 void Hpt::unmap_kernel_page(void* kernel_page)
@@ -0,0 +1,66 @@
+/*
+ * Hardware-Controlled Performance States (HWP)
+ *
+ * This file is part of the Hedron hypervisor.
+ *
+ * Hedron is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Hedron is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License version 2 for more details.
+ */
+
+#include "hwp.hpp"
+#include "cpu.hpp"
+#include "msr.hpp"
+
+namespace
+{
+
+// The fields of IA32_HWP_REQUEST.
+constexpr uint64 REQ_PERF{0xffffff};
+constexpr uint64 REQ_EPP{0xffULL << 24};
+constexpr uint64 REQ_WINDOW{0x3ffULL << 32};
+
+} // namespace
+
+bool Hwp::supported() { return Cpu::feature(Cpu::FEAT_HWP); }
+
+bool Hwp::valid(uint64 value)
+{
+    uint64 allowed{REQ_PERF};
+
+    if (Cpu::feature(Cpu::FEAT_HWP_EPP)) {
+        allowed |= REQ_EPP;
+    }
+
+    if (Cpu::feature(Cpu::FEAT_HWP_ACT_WINDOW)) {
+        allowed |= REQ_WINDOW;
+    }
+
+    return supported() and (value & ~allowed) == 0;
+}
+
+void Hwp::update(uint64 value)
+{
+    request() = value;
+
+    // Hints are only accepted with HWP support, but migratable SCs can carry theirs to CPUs without it.
+    if (EXPECT_FALSE(not supported())) {
+        return;
+    }
+
+    if (not enabled()) {
+        if (not(Msr::read(Msr::IA32_PM_ENABLE) & 1)) {
+            Msr::write(Msr::IA32_PM_ENABLE, 1);
+        }
+
+        fallback() = Msr::read(Msr::IA32_HWP_REQUEST);
+        enabled() = true;
+    }
+
+    Msr::write(Msr::IA32_HWP_REQUEST, value ? value : fallback());
+}
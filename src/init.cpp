@@ -22,6 +22,7 @@
 
 #include "acpi.hpp"
 #include "acpi_rsdp.hpp"
+#include "boot_profile.hpp"
 #include "cmdline.hpp"
 #include "compiler.hpp"
 #include "console_serial.hpp"
@@ -53,6 +54,8 @@ extern "C" void init(mword magic, mword mbi)
     // and return bogus values, if we don't actively prevent it.
     Cpulocal::prevent_accidental_access();
 
+    Boot_profile::mark(Boot_profile::START);
+
     // Setup 0-page and 1-page
     memset(PAGE_0, 0, PAGE_SIZE);
     memset(PAGE_1, ~0u, PAGE_SIZE);
@@ -60,6 +63,8 @@ extern "C" void init(mword magic, mword mbi)
     for (void (**func)() = &CTORS_G; func != &CTORS_E; (*func++)())
         ;
 
+    Boot_profile::mark(Boot_profile::CTORS);
+
     if (magic == Multiboot::MAGIC) {
         Multiboot* mbi_ = static_cast<Multiboot*>(Hpt::remap(mbi));
         if (mbi_->flags & Multiboot::CMDLINE)
@@ -100,7 +105,10 @@ extern "C" void init(mword magic, mword mbi)
     Gdt::build();
     Idt::build();
     Acpi::setup();
+    Boot_profile::mark(Boot_profile::ACPI);
+
     Tss::setup();
     Lapic::setup();
     Hip::build(magic, mbi);
+    Boot_profile::mark(Boot_profile::HIP);
 }
@@ -20,75 +20,108 @@
 #include "ec.hpp"
 #include "hpt.hpp"
 #include "lock_guard.hpp"
+#include "math.hpp"
 #include "pd.hpp"
 #include "stdio.hpp"
 
 INIT_PRIORITY(PRIO_SLAB)
-Slab_cache Kp::cache(sizeof(Kp), 32);
+Slab_cache Kp::cache{Slab_cache::create<Kp, 32>()};
 
 Kp::Kp(Pd* own) : Typed_kobject(static_cast<Space_obj*>(own)), data(Buddy::allocator.alloc(0, Buddy::FILL_0))
 {
     trace(TRACE_SYSCALL, "KP: %p without selector created (PD:%p, Data: %p)", this, own, data);
 }
 
-Kp::Kp(Pd* own, mword sel)
+Kp::Kp(Pd* own, mword sel, unsigned ord)
     : Typed_kobject(static_cast<Space_obj*>(own), sel, PERM_ALL, free),
-      data(Buddy::allocator.alloc(0, Buddy::FILL_0))
+      data(Buddy::allocator.try_alloc(static_cast<unsigned short>(ord), Buddy::FILL_0).unwrap_or_else([] {
+          return static_cast<void*>(nullptr);
+      })),
+      order(ord)
 {
-    trace(TRACE_SYSCALL, "KP: %p created (PD:%p, Data:%p)", this, own, data);
+    trace(TRACE_SYSCALL, "KP: %p created (PD:%p, Data:%p, Order:%u)", this, own, data, order);
+}
+
+Kp::Kp(Pd* own, mword sel, void* page)
+    : Typed_kobject(static_cast<Space_obj*>(own), sel, PERM_ALL, free), data(page), kernel_owned(true)
+{
+    trace(TRACE_SYSCALL, "KP: %p created (PD:%p, Data:%p read-only)", this, own, data);
 }
 
 Kp::~Kp()
 {
-    remove_user_mapping();
+    remove_user_mapping(OWN_MAPPING);
+    remove_user_mapping(PEER_MAPPING);
 
-    if (data != nullptr) {
+    if (data != nullptr and not kernel_owned) {
         Buddy::allocator.free(reinterpret_cast<mword>(data));
         data = nullptr;
     }
 }
 
-bool Kp::has_user_mapping() const { return pd_user_page and addr_in_user_space <= INVALID_USER_ADDR; }
+bool Kp::has_user_mapping(unsigned slot) const
+{
+    return pd_user_page[slot] and addr_in_user_space[slot] <= INVALID_USER_ADDR;
+}
+
+Tlb_cleanup Kp::update_user_mapping(Pd* pd, mword addr, mword attr)
+{
+    Tlb_cleanup cleanup;
+    Paddr const phys{Buddy::ptr_to_phys(data)};
+
+    // The kernel memory is naturally aligned, so mapping it at an aligned user address needs a single
+    // update. Otherwise the alignment of the user address limits the size of each chunk.
+    for (mword offset{0}, chunk; offset < size(); offset += chunk) {
+        mword const base{(addr + offset) | static_cast<mword>(phys + offset)};
+        unsigned const ord{static_cast<unsigned>(max_order(base, size() - offset))};
+
+        chunk = 1UL << ord;
+        cleanup.merge(pd->Space_mem::insert(addr + offset, ord - PAGE_BITS, attr, attr ? phys + offset : 0));
+    }
 
-bool Kp::add_user_mapping(Pd* pd, mword addr)
+    return cleanup;
+}
+
+bool Kp::add_user_mapping(Pd* pd, mword addr, Mapping_slot slot)
 {
     Tlb_cleanup cleanup;
 
     {
         Lock_guard<Spinlock> guard(lock);
 
-        if (has_user_mapping()) {
+        if (has_user_mapping(slot)) {
             return false;
         }
 
-        if ((addr & PAGE_MASK) != 0 or addr >= INVALID_USER_ADDR) {
+        if ((addr & PAGE_MASK) != 0 or addr >= INVALID_USER_ADDR or size() > INVALID_USER_ADDR - addr) {
             return false;
         }
 
-        pd_user_page = pd;
-        if (!pd_user_page->add_ref()) {
-            pd_user_page = nullptr;
+        pd_user_page[slot] = pd;
+        if (!pd_user_page[slot]->add_ref()) {
+            pd_user_page[slot] = nullptr;
             return false;
         }
 
-        addr_in_user_space = addr;
+        addr_in_user_space[slot] = addr;
+
+        mword const attr{Hpt::PTE_NODELEG | Hpt::PTE_NX | Hpt::PTE_U | Hpt::PTE_P};
 
-        cleanup = pd_user_page->Space_mem::insert(
-            user_address(), 0, Hpt::PTE_NODELEG | Hpt::PTE_NX | Hpt::PTE_U | Hpt::PTE_W | Hpt::PTE_P,
-            Buddy::ptr_to_phys(data));
+        cleanup = update_user_mapping(pd_user_page[slot], user_address(slot),
+                                      kernel_owned ? attr : attr | Hpt::PTE_W);
     }
 
     if (cleanup.need_tlb_flush()) {
         // We don't want to access pd_user_page in an unsynchronized scope, thus we use the pd variable for
         // the shootdown. At this point we already checked whether we can use the pd.
-        pd->stale_host_tlb.merge(pd->Space_mem::cpus);
+        pd->mark_stale_host_tlb(cleanup.tlb_range());
         pd->Space_mem::shootdown();
     }
 
     return true;
 }
 
-bool Kp::remove_user_mapping()
+bool Kp::remove_user_mapping(Mapping_slot slot)
 {
     // When we are doing the shootdown, pd_user_page will be a nullptr. Thus we capture the value of
     // pd_user_page inside the synchronized scope.
@@ -98,20 +131,21 @@ bool Kp::remove_user_mapping()
     {
         Lock_guard<Spinlock> guard(lock);
 
-        if (!has_user_mapping()) {
+        if (!has_user_mapping(slot)) {
             return false;
         }
 
-        if (pd_user_page->del_rcu()) {
-            Rcu::call(pd_user_page);
+        if (pd_user_page[slot]->del_rcu()) {
+            Rcu::call(pd_user_page[slot]);
         }
 
         // Check if the physical addresses of the kernel virtual address and the user virtual address are not
         // the same. If this is the case, the mapping of this kernel page has been overwritten using
         // Pd::delegate. In this case we only output a warning message.
         if (Paddr kernel_paddr, user_paddr;
-            pd_user_page->Space_mem::lookup(kernel_address(), &kernel_paddr) and
-            pd_user_page->Space_mem::lookup(user_address(), &user_paddr) and kernel_paddr != user_paddr) {
+            pd_user_page[slot]->Space_mem::lookup(kernel_address(), &kernel_paddr) and
+            pd_user_page[slot]->Space_mem::lookup(user_address(slot), &user_paddr) and
+            kernel_paddr != user_paddr) {
             trace(TRACE_ERROR,
                   "%s: User space mapping of KP has been overwritten prior to removing the mapping (CAP: %p)",
                   __func__, this);
@@ -119,15 +153,15 @@ bool Kp::remove_user_mapping()
 
         // We remove the user space mapping unconditionally to avoid race conditions. Specifically, user space
         // can overmap the kpage mapping between the check above and a conditional `insert`.
-        cleanup = pd_user_page->Space_mem::insert(user_address(), 0, 0, 0);
+        cleanup = update_user_mapping(pd_user_page[slot], user_address(slot), 0);
 
-        pd = pd_user_page;
-        pd_user_page = nullptr;
-        addr_in_user_space = INVALID_USER_ADDR;
+        pd = pd_user_page[slot];
+        pd_user_page[slot] = nullptr;
+        addr_in_user_space[slot] = INVALID_USER_ADDR;
     }
 
     if (cleanup.need_tlb_flush()) {
-        pd->stale_host_tlb.merge(pd->Space_mem::cpus);
+        pd->mark_stale_host_tlb(cleanup.tlb_range());
         pd->Space_mem::shootdown();
     }
 
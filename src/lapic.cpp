@@ -83,10 +83,18 @@ void Lapic::restore_low_memory()
     memcpy(Hpt::remap(CPUBOOT_ADDR), __start_cpu_backup, sizeof(__start_cpu_backup));
 }
 
-void Lapic::init()
+void Lapic::init(bool resume)
 {
     Paddr apic_base = Msr::read(Msr::IA32_APIC_BASE);
-    Msr::write(Msr::IA32_APIC_BASE, apic_base | 0x800);
+
+    // Only x2APIC mode can address APIC IDs above 255. Firmware enables it on such systems and we can't go
+    // back to xAPIC mode without disabling the LAPIC. Otherwise, we keep xAPIC mode unless asked, because
+    // passthrough guests may access the xAPIC page directly. The APs follow the decision of the BSP.
+    if (apic_base & APIC_BASE_BSP and not resume) {
+        x2apic = apic_base & APIC_BASE_EXTD or (Cmdline::x2apic and Cpu::feature(Cpu::FEAT_X2APIC));
+    }
+
+    Msr::write(Msr::IA32_APIC_BASE, apic_base | APIC_BASE_EN | (x2apic ? APIC_BASE_EXTD : 0));
 
     assert_slow(Cpu::find_by_apic_id(id()) == Optional{Cpu::id()});
 
@@ -94,20 +102,26 @@ void Lapic::init()
     if (!(svr & 0x100))
         write(LAPIC_SVR, svr | 0x100);
 
-    if ((Cpu::bsp() = apic_base & 0x100)) {
+    if ((Cpu::bsp() = apic_base & APIC_BASE_BSP)) {
         uint32 const boot_addr = prepare_cpu_boot(cpu_boot_type::AP);
 
         send_ipi(0, 0, DLV_INIT, DSH_EXC_SELF);
 
-        write(LAPIC_TMR_ICR, ~0U);
+        // The calibration doubles as the delay between INIT and SIPI. CPUs since the P6 family don't need
+        // this delay, so we only wait as long as between the SIPIs on resume.
+        if (resume) {
+            Acpi::delay(1);
+        } else {
+            write(LAPIC_TMR_ICR, ~0U);
 
-        uint32 t1 = static_cast<uint32>(rdtsc());
-        Acpi::delay(10);
-        uint32 t2 = static_cast<uint32>(rdtsc());
+            uint32 t1 = static_cast<uint32>(rdtsc());
+            Acpi::delay(10);
+            uint32 t2 = static_cast<uint32>(rdtsc());
 
-        freq_tsc = (t2 - t1) / 10;
+            freq_tsc = (t2 - t1) / 10;
 
-        trace(TRACE_APIC, "TSC:%u kHz", freq_tsc);
+            trace(TRACE_APIC, "TSC:%u kHz", freq_tsc);
+        }
 
         // The AP boot code needs to lie at a page boundary below 1 MB.
         assert((boot_addr & PAGE_MASK) == 0 and boot_addr < (1 << 20));
@@ -117,17 +131,28 @@ void Lapic::init()
         send_ipi(0, boot_addr >> PAGE_BITS, DLV_SIPI, DSH_EXC_SELF);
     }
 
-    trace(TRACE_APIC, "APIC:%#lx ID:%#x VER:%#x LVT:%#x", apic_base & ~PAGE_MASK, id(), version(), lvt_max());
+    trace(TRACE_APIC, "APIC:%#lx ID:%#x VER:%#x LVT:%#x%s", apic_base & ~PAGE_MASK, id(), version(),
+          lvt_max(), x2apic ? " x2APIC" : "");
 }
 
 void Lapic::send_ipi(unsigned cpu, unsigned vector, Delivery_mode dlv, Shorthand dsh)
 {
-    wait_for_idle();
-
     if (dlv != DLV_INIT and dlv != DLV_SIPI and dlv != DLV_NMI) {
         panic("Hedron does not support sending IPIs anymore, except for delivery modes INIT, SIPI and NMI.");
     }
 
+    // In x2APIC mode, a single MSR write sends the IPI with the full 32-bit destination. There is no
+    // delivery status to wait for and no destination register that we could clobber.
+    if (x2apic) {
+        uint64 const dest{dsh == DSH_NONE ? uint64{Cpu::apic_id[cpu]} << 32 : 0};
+
+        Msr::write(static_cast<Msr::Register>(X2APIC_MSR_BASE + LAPIC_ICR_LO),
+                   dest | dsh | 1U << 14 | dlv | vector);
+        return;
+    }
+
+    wait_for_idle();
+
     // We have to make sure that we do not trash anything that the guest already wrote into ICR_HI. Thus we
     // unconditionally read ICR_HI here and write the read value back after sending our IPI.
     const uint32 icr_hi_old{read(LAPIC_ICR_HI)};
@@ -158,6 +183,60 @@ bool Lapic::send_nmi(unsigned cpu)
     return true;
 }
 
+void Lapic::send_nmi(Cpuset const& cpus)
+{
+    if (x2apic) {
+        uint32 cluster{0};
+        uint32 dest{0};
+
+        // CPUs of the same cluster are usually adjacent in the MADT, so we collect them until the cluster
+        // changes. Otherwise, a cluster just gets more than one ICR write.
+        auto const flush{[&dest, &cluster] {
+            if (dest) {
+                Msr::write(static_cast<Msr::Register>(X2APIC_MSR_BASE + LAPIC_ICR_LO),
+                           uint64{cluster << 16 | dest} << 32 | DSH_NONE | 1U << 14 | DST_LOGICAL | DLV_NMI);
+            }
+
+            dest = 0;
+        }};
+
+        cpus.for_each([&dest, &cluster, &flush](unsigned cpu) {
+            if (EXPECT_FALSE(Cpu::remote_load_might_lose_nmis(cpu))) {
+                return;
+            }
+
+            uint32 const apic_id{Cpu::apic_id[cpu]};
+
+            if (x2apic_cluster(apic_id) != cluster) {
+                flush();
+                cluster = x2apic_cluster(apic_id);
+            }
+
+            dest |= x2apic_logical_id(apic_id) & 0xffff;
+        });
+
+        flush();
+        return;
+    }
+
+    wait_for_idle();
+
+    const uint32 icr_hi_old{read(LAPIC_ICR_HI)};
+
+    cpus.for_each([](unsigned cpu) {
+        if (EXPECT_FALSE(Cpu::remote_load_might_lose_nmis(cpu))) {
+            return;
+        }
+
+        // The next destination can only be written once the LAPIC has sent the previous IPI.
+        write(LAPIC_ICR_HI, Cpu::apic_id[cpu] << 24);
+        write(LAPIC_ICR_LO, DSH_NONE | 1U << 14 | DLV_NMI);
+        wait_for_idle();
+    });
+
+    write(LAPIC_ICR_HI, icr_hi_old);
+}
+
 void Lapic::park_all_but_self(park_fn fn)
 {
     assert(Atomic::load(cpu_park_count) == 0);
@@ -166,15 +245,19 @@ void Lapic::park_all_but_self(park_fn fn)
     Atomic::store(park_function, fn);
     Atomic::store(cpu_park_count, Cpu::online - 1);
 
+    Cpuset targets;
+
     for (unsigned cpu{0u}; cpu < Cpu::online; cpu++) {
         if (cpu == Cpu::id()) {
             continue;
         }
 
         Atomic::set_mask(Cpu::hazard(cpu), HZD_PRK);
-        Lapic::send_nmi(cpu);
+        targets.set(cpu);
     }
 
+    Lapic::send_nmi(targets);
+
     while (Atomic::load(cpu_park_count) != 0) {
         relax();
     }
@@ -0,0 +1,119 @@
+/*
+ * Lock Statistics
+ *
+ * This file is part of the Hedron hypervisor.
+ *
+ * Hedron is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Hedron is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License version 2 for more details.
+ */
+
+#include "lock_stat.hpp"
+#include "buddy.hpp"
+#include "string.hpp"
+
+static_assert(Lock_stat::ENTRIES * sizeof(Lock_stat_entry) == PAGE_SIZE,
+              "The lock statistics must fill a page");
+
+namespace
+{
+
+Lock_stat_entry* table;
+
+// The call sites of the entries in the table. Kernel addresses don't go to user space, so they are kept
+// here instead of in the table.
+mword keys[Lock_stat::ENTRIES];
+
+// File names are string literals in the kernel image. Their addresses are canonical kernel addresses, so
+// their lower 47 bits identify them and leave enough room for the line number.
+mword site_key(char const* file, unsigned line)
+{
+    return (reinterpret_cast<mword>(file) & ((1UL << 47) - 1)) | static_cast<mword>(line) << 47;
+}
+
+} // namespace
+
+Lock_stat_entry* Lock_stat::get_table()
+{
+    if (Lock_stat_entry* const t{Atomic::load(table)}; t) {
+        return t;
+    }
+
+    Alloc_result<void*> page{Buddy::allocator.try_alloc(0, Buddy::FILL_0)};
+
+    if (page.is_err()) {
+        return nullptr;
+    }
+
+    Lock_stat_entry* const t{static_cast<Lock_stat_entry*>(page.unwrap())};
+
+    // Someone else might have been faster. The table must never change once it is set, because user space
+    // may have it mapped.
+    if (not Atomic::cmp_swap(table, static_cast<Lock_stat_entry*>(nullptr), t)) {
+        Buddy::allocator.free(reinterpret_cast<mword>(t));
+    }
+
+    return Atomic::load(table);
+}
+
+Lock_stat_entry* Lock_stat::lookup(Lock_stat_entry* t, char const* file, unsigned line)
+{
+    mword const key{site_key(file, line)};
+
+    // Open addressing with linear probing. Entries are never removed.
+    for (unsigned i{0}, slot{static_cast<unsigned>(key * 0x9e3779b97f4a7c15UL >> 58)}; i < ENTRIES;
+         i++, slot = (slot + 1) % ENTRIES) {
+        mword cur{Atomic::load<mword, Atomic::RELAXED>(keys[slot])};
+
+        if (cur == 0) {
+            if (Atomic::cmp_swap(keys[slot], mword{0}, key)) {
+                Lock_stat_entry& e{t[slot]};
+                char const* const name{past_last_slash(file)};
+
+                for (size_t c{0}; c < sizeof(e.file) - 1 and name[c]; c++) {
+                    e.file[c] = name[c];
+                }
+
+                Atomic::store<uint32, Atomic::RELEASE>(e.line, line);
+
+                return &e;
+            }
+
+            // Another CPU claimed the slot in the meantime, maybe for the same call site.
+            cur = Atomic::load<mword, Atomic::RELAXED>(keys[slot]);
+        }
+
+        if (cur == key) {
+            return &t[slot];
+        }
+    }
+
+    return nullptr;
+}
+
+void Lock_stat::record(char const* file, unsigned line, bool contended, uint64 spin_tsc)
+{
+    Lock_stat_entry* const t{Atomic::load<Lock_stat_entry*, Atomic::RELAXED>(table)};
+
+    if (EXPECT_TRUE(not t)) {
+        return;
+    }
+
+    Lock_stat_entry* const e{lookup(t, file, line)};
+
+    if (EXPECT_FALSE(not e)) {
+        return;
+    }
+
+    Atomic::add<uint64, Atomic::RELAXED>(e->acquisitions, 1);
+
+    if (contended) {
+        Atomic::add<uint64, Atomic::RELAXED>(e->contended, 1);
+        Atomic::add<uint64, Atomic::RELAXED>(e->spin_tsc, spin_tsc);
+    }
+}
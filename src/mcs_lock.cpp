@@ -0,0 +1,36 @@
+/*
+ * Queued Spinlock
+ *
+ * This file is part of the Hedron hypervisor.
+ *
+ * Hedron is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Hedron is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License version 2 for more details.
+ */
+
+#include "mcs_lock.hpp"
+#include "cpulocal.hpp"
+
+// A lock can only be contended once other CPUs run, so nodes are never needed before CPU-local memory is set
+// up. The nodes are used in LIFO order, because locks are released in reverse order (see Generic_mcs_lock).
+
+Mcs_node* Cpulocal_mcs_nodes::get()
+{
+    Per_cpu& cpu{Cpulocal::get()};
+
+    assert(cpu.mcs_depth < MAX_NESTING);
+    return &cpu.mcs_nodes[cpu.mcs_depth++];
+}
+
+void Cpulocal_mcs_nodes::put([[maybe_unused]] Mcs_node* node)
+{
+    Per_cpu& cpu{Cpulocal::get()};
+
+    assert(cpu.mcs_depth != 0 and node == &cpu.mcs_nodes[cpu.mcs_depth - 1]);
+    cpu.mcs_depth--;
+}
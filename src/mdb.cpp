@@ -17,23 +17,44 @@
  */
 
 #include "mdb.hpp"
+#include "cpulocal.hpp"
 #include "lock_guard.hpp"
+#include "sched_stats.hpp"
 
 INIT_PRIORITY(PRIO_SLAB)
-Slab_cache Mdb::cache(sizeof(Mdb), 16);
+Slab_cache Mdb::cache{Slab_cache::create<Mdb, 8>()};
 
-Spinlock Mdb::lock;
+// Each delegation allocates a node. The packed layout keeps them at 11 words.
+static_assert(sizeof(Mdb) <= 11 * sizeof(mword), "Mdb nodes have grown");
+
+Mcs_lock Mdb::locks[LOCK_STRIPES];
+
+Mcs_lock& Mdb::contended_tree_lock() const
+{
+    Mcs_lock& l{tree_lock()};
+
+    // The lock can only be held by another CPU, which means that we are past the bootstrap and CPU-local
+    // memory is usable.
+    if (EXPECT_FALSE(l.is_locked())) {
+        if (Sched_stats* const stats{Cpulocal::get().sc_stats}; EXPECT_TRUE(stats)) {
+            Sched_stats::inc(stats->mdb_contended_cnt);
+        }
+    }
+
+    return l;
+}
 
 bool Mdb::insert_node(Mdb* p, mword a)
 {
-    Lock_guard<Spinlock> guard(lock);
+    Lock_guard<Mcs_lock> guard(p->contended_tree_lock());
 
     if (!p->alive())
         return false;
 
-    if (!(node_attr = p->node_attr & a))
+    if (!(node_attr = static_cast<uint8>(p->node_attr & a)))
         return false;
 
+    lock_stripe = p->lock_stripe;
     prev = prnt = p;
     next = p->next;
     dpth = static_cast<uint16>(p->dpth + 1);
@@ -44,9 +65,9 @@ bool Mdb::insert_node(Mdb* p, mword a)
 
 void Mdb::demote_node(mword a)
 {
-    Lock_guard<Spinlock> guard(lock);
+    Lock_guard<Mcs_lock> guard(contended_tree_lock());
 
-    node_attr &= ~a;
+    node_attr = static_cast<uint8>(node_attr & ~a);
 }
 
 bool Mdb::remove_node()
@@ -54,7 +75,17 @@ bool Mdb::remove_node()
     if (node_attr)
         return false;
 
-    Lock_guard<Spinlock> guard(lock);
+    Lock_guard<Mcs_lock> guard(contended_tree_lock());
+
+    return remove_node_locked();
+}
+
+bool Mdb::remove_node_locked()
+{
+    assert(tree_lock().is_locked());
+
+    if (node_attr)
+        return false;
 
     if (!alive())
         return false;
@@ -0,0 +1,199 @@
+/*
+ * Microcode Updates
+ *
+ * This file is part of the Hedron hypervisor.
+ *
+ * Hedron is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Hedron is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License version 2 for more details.
+ */
+
+#include "microcode.hpp"
+#include "atomic.hpp"
+#include "config.hpp"
+#include "cpu.hpp"
+#include "hip.hpp"
+#include "lapic.hpp"
+#include "math.hpp"
+#include "msr.hpp"
+#include "x86.hpp"
+
+namespace
+{
+
+// The phase of a machine-wide update is in the upper half of the state, the number of CPUs that take part
+// in the lower half. Both change together, so no CPU can join after the initiator has moved on.
+enum Phase : mword
+{
+    IDLE = 0,
+    GATHER = 1,
+    LOAD = 2,
+    ABORT = 3,
+};
+
+constexpr unsigned PHASE_SHIFT{32};
+
+// CPUs that don't arrive within this time are probably running a vCPU that blocks NMIs.
+constexpr uint64 GATHER_TIMEOUT_MS{100};
+
+mword state{IDLE};
+
+// The number of CPUs that have finished with the current update.
+unsigned done;
+
+mword update_payload;
+
+// The revision of each CPU after the last machine-wide update. Kernel stacks are not accessible from other
+// CPUs, so this cannot live on the stack of the initiator.
+uint32 revisions[NUM_CPU];
+
+// Whether the update was loaded on the core of each CPU. Only the flag of the first thread of each core is
+// used.
+bool core_loaded[NUM_CPU];
+
+Phase phase(mword s) { return Phase(s >> PHASE_SHIFT); }
+unsigned joined(mword s) { return static_cast<unsigned>(s); }
+mword make_state(Phase p, unsigned cpus) { return static_cast<mword>(p) << PHASE_SHIFT | cpus; }
+
+// Move to a new phase and return the number of CPUs that joined until then.
+unsigned leave_gather(Phase p)
+{
+    for (mword s{Atomic::load(state)};; s = Atomic::load(state)) {
+        if (Atomic::cmp_swap(state, s, make_state(p, joined(s)))) {
+            return joined(s);
+        }
+    }
+}
+
+// The first online thread of the core of the given CPU.
+unsigned first_thread(unsigned cpu)
+{
+    unsigned first{cpu};
+
+    Hip::for_each_sibling(cpu, [&first](unsigned long sibling, Hip_cpu const&) {
+        first = min(first, static_cast<unsigned>(sibling));
+    });
+
+    return first;
+}
+
+// The part of a machine-wide update that each CPU does, once all CPUs have arrived.
+void load_on_core()
+{
+    unsigned const self{Cpu::id()};
+    unsigned const first{first_thread(self)};
+
+    if (first == self) {
+        Microcode::load(Atomic::load(update_payload));
+        Atomic::store(core_loaded[self], true);
+    } else {
+        while (not Atomic::load(core_loaded[first])) {
+            relax();
+        }
+    }
+
+    Atomic::store(revisions[self], Microcode::revision());
+}
+
+} // namespace
+
+void Microcode::load(mword payload) { Msr::write_safe(Msr::IA32_BIOS_UPDT_TRIG, payload); }
+
+uint32 Microcode::revision()
+{
+    uint32 eax, ebx, ecx, edx;
+
+    // The revision is only updated by CPUID leaf 1.
+    Msr::write(Msr::IA32_BIOS_SIGN_ID, 0);
+    cpuid(1, eax, ebx, ecx, edx);
+
+    return static_cast<uint32>(Msr::read(Msr::IA32_BIOS_SIGN_ID) >> 32);
+}
+
+uint32 Microcode::loaded_revision(unsigned cpu) { return Atomic::load(revisions[cpu]); }
+
+bool Microcode::load_all(mword payload)
+{
+    if (not Atomic::cmp_swap(state, make_state(IDLE, 0), make_state(GATHER, 0))) {
+        return false;
+    }
+
+    for (bool& l : core_loaded) {
+        Atomic::store(l, false);
+    }
+
+    Atomic::store(done, 0U);
+    Atomic::store(update_payload, payload);
+
+    unsigned const self{Cpu::id()};
+    unsigned others{0};
+    bool sent{true};
+
+    Hip::for_each_online_cpu([&](unsigned cpu) {
+        if (cpu != self) {
+            others++;
+            sent = Lapic::send_nmi(cpu) and sent;
+        }
+    });
+
+    uint64 const deadline{rdtsc() + GATHER_TIMEOUT_MS * Lapic::freq_tsc};
+
+    while (sent and joined(Atomic::load(state)) != others and rdtsc() < deadline) {
+        relax();
+    }
+
+    // Every CPU that joined waits for the next phase, so their number cannot change afterwards.
+    bool const all{sent and joined(Atomic::load(state)) == others};
+    unsigned const cpus{leave_gather(all ? LOAD : ABORT)};
+
+    if (all) {
+        load_on_core();
+
+        // The features change for all cores.
+        Cpu::update_features(true);
+    }
+
+    while (Atomic::load(done) != cpus) {
+        relax();
+    }
+
+    Atomic::store(state, make_state(IDLE, 0));
+
+    return all;
+}
+
+bool Microcode::handle_nmi()
+{
+    mword s{Atomic::load(state)};
+
+    // Don't touch anything else in the common case that no update is in progress.
+    if (EXPECT_TRUE(phase(s) != GATHER)) {
+        return false;
+    }
+
+    while (not Atomic::cmp_swap(state, s, s + 1)) {
+        s = Atomic::load(state);
+
+        // The initiator gave up on us. A different NMI may still have been sent to us at the same time.
+        if (phase(s) != GATHER) {
+            return false;
+        }
+    }
+
+    while (phase(s = Atomic::load(state)) == GATHER) {
+        relax();
+    }
+
+    if (phase(s) == LOAD) {
+        load_on_core();
+    }
+
+    Atomic::add(done, 1U);
+
+    return true;
+}
@@ -16,6 +16,7 @@
  */
 
 #include "msr.hpp"
+#include "msr_filter.hpp"
 
 uint64 Msr::read(Register msr)
 {
@@ -51,87 +52,11 @@ bool Msr::write_safe(Register msr, uint64 val)
     return not skipped;
 }
 
-// Below is the code for userspace MSR access. It is mostly used for platform
-// thermal and power management, but also for platform discovery and other
-// purposes. Due to the vast amount of MSRs it's impractical to devise safe and
-// generic kernel abstractions and instead we rely on trusted userspace
-// components (PDs with passthrough permissions) to do the right thing and give
-// them direct access to MSRs.
-//
-// That being said, we do not blindly allow access to all MSRs, but make
-// exceptions for MSRs where we know that:
-//
-// - the hypervisor wholly owns them and needs them for correct functionality,
-//
-// - they leak private information about the hypervisor, such as its address
-//   space layout,
-//
-// - have a correct way to get their information from userspace already.
-//
-// The lists below are not complete and will never be. They are expected to
-// change over time (as is our rationale which MSRs to exclude).
-//
-// Most importantly this filtering is not a security boundary and no untrusted
-// component should have access to this API.
-
-static bool is_allowed_to_read(Msr::Register msr)
-{
-    // Allowing read access to an MSR might currently imply granting write
-    // access as well. Check is_allowed_to_write when modifying this list.
-    switch (msr) {
-    case Msr::IA32_DS_AREA:
-    case Msr::IA32_EFER:
-    case Msr::IA32_GS_BASE:
-    case Msr::IA32_KERNEL_GS_BASE:
-    case Msr::IA32_SYSENTER_CS:
-    case Msr::IA32_SYSENTER_EIP:
-    case Msr::IA32_SYSENTER_ESP:
-    case Msr::IA32_TSC_AUX:
-
-    case Msr::IA32_EXT_XAPIC... Msr::IA32_EXT_XAPIC_END:
-    case Msr::IA32_VMX_BASIC... Msr::IA32_VMX_VMFUNC:
-        return false;
-
-    // Userspace discovers whether SGX is available via the relevant
-    // feature bits in the IA32_FEATURE_CONTROL MSR.
-    case Msr::IA32_FEATURE_CONTROL:
-    // Allow runtime modification of SGX Launch Control.
-    case Msr::IA32_SGXLEPUBKEYHASH0:
-    case Msr::IA32_SGXLEPUBKEYHASH1:
-    case Msr::IA32_SGXLEPUBKEYHASH2:
-    case Msr::IA32_SGXLEPUBKEYHASH3:
-    default:
-        return true;
-    };
-}
-
-static bool is_allowed_to_write(Msr::Register msr)
-{
-    switch (msr) {
-    // Feature control is locked in try_enable_vmx, so writes are not permitted.
-    case Msr::IA32_FEATURE_CONTROL:
-    case Msr::IA32_MTRR_PHYS_BASE... Msr::IA32_MTRR_FIX4K_F8000:
-    case Msr::IA32_CR_PAT:
-    case Msr::IA32_MTRR_DEF_TYPE:
-        // The MTRR MSRs are mostly in a convenient block in MSR space. We allow
-        // reading them to pass on the configuration to guests (if so desired),
-        // but writing them would mess up our paging.
-        return false;
-
-    // Allow runtime modification of SGX Launch Control.
-    case Msr::IA32_SGXLEPUBKEYHASH0... Msr::IA32_SGXLEPUBKEYHASH3:
-        return true;
-
-    default:
-        // If we don't know anything better and we can't read a MSR, we
-        // shouldn't be able to write it either.
-        return is_allowed_to_read(msr);
-    }
-}
+// Userspace MSR access for passthrough PDs. See Msr_filter for which MSRs are excluded and why.
 
 bool Msr::user_write(Register msr, uint64 val)
 {
-    if (not is_allowed_to_write(msr)) {
+    if (not Msr_filter::may_write(msr)) {
         return false;
     }
 
@@ -140,7 +65,7 @@ bool Msr::user_write(Register msr, uint64 val)
 
 bool Msr::user_read(Register msr, uint64& val)
 {
-    if (not is_allowed_to_read(msr)) {
+    if (not Msr_filter::may_read(msr)) {
         val = 0;
         return false;
     }
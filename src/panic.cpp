@@ -18,6 +18,7 @@
 #include "panic.hpp"
 
 #include "console.hpp"
+#include "console_log.hpp"
 #include "x86.hpp"
 
 #include <stdarg.h>
@@ -28,6 +29,9 @@ void panic(char const* format, ...)
 
     va_start(ap, format);
 
+    // We are not going to be idle again to print the log.
+    Console_log::flush_and_stop();
+
     Console::print("PANIC: Hedron encountered an unrecoverable error near RIP %p:",
                    __builtin_return_address(0));
     Console::vprint(format, ap);
@@ -0,0 +1,78 @@
+/*
+ * Parallel Work Items
+ *
+ * This file is part of the Hedron hypervisor.
+ *
+ * Hedron is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Hedron is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License version 2 for more details.
+ */
+
+#include "parallel.hpp"
+#include "atomic.hpp"
+#include "cpu.hpp"
+#include "hazards.hpp"
+#include "hip.hpp"
+#include "x86.hpp"
+
+void Parallel::work(Parallel_job& j)
+{
+    for (mword item; (item = Atomic::fetch_add(j.next, mword{1})) < j.items;) {
+        j.fn(j.ctx, item);
+    }
+}
+
+void Parallel::for_each(mword items, decltype(Parallel_job::fn) fn, void* ctx)
+{
+    Parallel_job j{fn, ctx, items, 0, 0};
+    unsigned const self{Cpu::id()};
+
+    // Offer the job to idle CPUs. We process one item ourselves, so more helpers than items - 1 would only
+    // find nothing to do. Setting the hazard is enough to wake up an idle CPU.
+    for (unsigned c = 0; c < Cpu::online and Atomic::load(j.users) + 1 < items; c++) {
+        if (c == self or not Hip::cpu_online(c) or not Cpu::remote_load_idle_waiting(c)) {
+            continue;
+        }
+
+        Atomic::add(j.users, 1U);
+
+        if (not Atomic::cmp_swap(remote_ref_job(c), static_cast<Parallel_job*>(nullptr), &j)) {
+            Atomic::sub(j.users, 1U);
+            continue;
+        }
+
+        Atomic::set_mask(Cpu::hazard(c), HZD_WORK);
+    }
+
+    work(j);
+
+    // Withdraw the offers that no CPU has taken yet and wait for the helpers that did.
+    for (unsigned c = 0; c < Cpu::online; c++) {
+        if (Atomic::cmp_swap(remote_ref_job(c), &j, static_cast<Parallel_job*>(nullptr))) {
+            Atomic::sub(j.users, 1U);
+        }
+    }
+
+    while (Atomic::load(j.users) != 0) {
+        relax();
+    }
+}
+
+void Parallel::help()
+{
+    Parallel_job* const j{Atomic::exchange(job(), static_cast<Parallel_job*>(nullptr))};
+
+    if (not j) {
+        return;
+    }
+
+    work(*j);
+
+    // The job lives on the stack of the offering CPU. We must not touch it after this point.
+    Atomic::sub(j->users, 1U);
+}
@@ -20,14 +20,22 @@
 
 #include "pd.hpp"
 #include "hip.hpp"
+#include "lock_guard.hpp"
 #include "mtrr.hpp"
 #include "scope_guard.hpp"
+#include "sm.hpp"
 #include "stdio.hpp"
+#include "vcpu.hpp"
 
 INIT_PRIORITY(PRIO_SLAB)
-Slab_cache Pd::cache(sizeof(Pd), 32);
+Slab_cache Pd::cache{Slab_cache::create<Pd, CACHE_LINE_SIZE>()};
 
-ALIGNED(32) No_destruct<Pd> Pd::kern;
+ALIGNED(CACHE_LINE_SIZE) No_destruct<Pd> Pd::kern;
+
+// Pd objects are cache-line aligned (see Pd::cache). Address space switches should only touch one line of the
+// PD besides the PCID of the CPU.
+static_assert(OFFSETOF(Pd, hpt) / CACHE_LINE_SIZE == OFFSETOF(Pd, stale_host_tlb) / CACHE_LINE_SIZE,
+              "The fields of Pd::make_current don't fit into one cache line");
 
 // Constructor for the initial kernel PD.
 Pd::Pd() : Typed_kobject(static_cast<Space_obj*>(this)), Space_pio(this)
@@ -54,17 +62,34 @@ Pd::Pd() : Typed_kobject(static_cast<Space_obj*>(this)), Space_pio(this)
 
     // HIP
     Paddr frame_h = Buddy::ptr_to_phys(&PAGE_H);
-    mark_avail_phys(frame_h, frame_h + PAGE_SIZE, 1);
+    mark_avail_phys(frame_h, frame_h + HIP_SIZE, 1);
 
     // I/O Ports
     Space_pio::addreg(0, 1UL << 16, 7);
 }
 
-Pd::Pd(Pd* own, mword sel, mword a, int creation_flags)
-    : Typed_kobject(static_cast<Space_obj*>(own), sel, a, free, pre_free), Space_mem(Hpt::boot_hpt()),
+Pd::Pd(Pd* own, mword sel, mword a, int creation_flags, uint32 parent_domain)
+    : Typed_kobject(static_cast<Space_obj*>(own), sel, a, free, pre_free),
+      Space_mem(Hpt::boot_hpt(),
+                creation_flags & LARGE_GUEST_SPACE ? Ept::LARGE_LEVELS : Ept::DEFAULT_LEVELS),
       Space_pio(this), is_priv(creation_flags & IS_PRIVILEGED),
-      is_passthrough(creation_flags & IS_PASSTHROUGH)
+      is_passthrough(creation_flags & IS_PASSTHROUGH),
+      domain(creation_flags & NEW_SECURITY_DOMAIN ? id : parent_domain)
+{
+}
+
+void Pd::switch_domain()
 {
+    cpu_domain() = domain;
+
+    // The previous domain must not steer the indirect branches of this one.
+    if (Cpu::feature(Cpu::FEAT_IBRS_IBPB)) {
+        Msr::write(Msr::IA32_PRED_CMD, 1);
+    }
+
+    // A guest of the previous domain may have left its IA32_SPEC_CTRL settings and its data in the L1D
+    // cache behind. See Vcpu::handle_vmx and Vcpu::run.
+    Vcpu::switch_domain();
 }
 
 template <typename S>
@@ -154,31 +179,22 @@ template <typename S> void Pd::revoke(mword const base, mword const ord, mword c
                (!self && ((mdb == node) || (d + 1 == x->dpth) || !(x->node_attr & attr))));
         assert(x->dpth > node->dpth ? (x->dpth == node->dpth + 1) : true);
 
-        for (Mdb* ptr;; node = ptr) {
-            if (node->remove_node() && static_cast<S*>(node->space)->tree_remove(node))
-                Rcu::call(node);
-
-            ptr = Atomic::load(node->prev);
-
-            if (node->dpth <= d)
-                break;
-        }
+        node = Mdb::remove_nodes(node, d, [](Mdb* removed) {
+            if (static_cast<S*>(removed->space)->tree_remove(removed))
+                Rcu::call(removed);
+        });
 
         assert(node == mdb);
     }
 }
 
-template <> void Pd::revoke<Space_mem>(mword const base, mword const ord, mword const attr, bool self)
+void Pd::revoke_mem(Tlb_cleanup& cleanup, mword const base, mword const ord, mword const attr, bool self)
 {
     if (not self) {
         trace(TRACE_ERROR, "Non-self revocation is not supported: Revoking everything!");
     }
 
-    Tlb_cleanup cleanup;
     Space_mem::revoke(cleanup, base << PAGE_BITS, ord + PAGE_BITS, attr);
-
-    shootdown();
-    cleanup.ignore_tlb_flush(); // because it is done.
 }
 
 mword Pd::clamp(mword snd_base, mword& rcv_base, mword snd_ord, mword rcv_ord)
@@ -265,10 +281,144 @@ void Pd::xlt_crd(Pd* pd, Crd xlt, Crd& crd)
     crd = Crd(0);
 }
 
+bool Pd::set_ept_fill(mword guest_base, mword host_base, mword size, mword order, mword attr)
+{
+    mword const align{(1UL << (order + PAGE_BITS)) - 1};
+
+    // The host and guest regions must have the same alignment to get large mappings.
+    if (size and (order > EPT_FILL_MAX_ORDER or ((guest_base | host_base | size) & PAGE_MASK) or
+                  ((host_base - guest_base) & align) or not(attr & 0x7) or (attr & ~0x7UL) or
+                  guest_base + size < guest_base or host_base + size < host_base)) {
+        return false;
+    }
+
+    Lock_guard<Spinlock> guard{ept_fill_lock};
+
+    ept_fill = {guest_base, host_base, size, order, attr};
+    return true;
+}
+
+bool Pd::ept_fill_possible(mword gpa, mword hva, mword ord)
+{
+    mword const size{1UL << ord};
+
+    mword const gpa_limit{guest_addr_limit()};
+
+    if (hva >= USER_ADDR or USER_ADDR - hva < size or gpa >= gpa_limit or gpa_limit - gpa < size) {
+        return false;
+    }
+
+    // Space_mem::delegate does not delegate kernel mappings, such as the UTCB.
+    for (mword offset{0}; offset < size;) {
+        auto const m{hpt.lookup(hva + offset)};
+
+        if (not m.present() or not(m.attr & Hpt::PTE_U) or (m.attr & Hpt::PTE_NODELEG)) {
+            return false;
+        }
+
+        offset = m.vaddr + m.size() - hva;
+    }
+
+    for (mword offset{0}; offset < size;) {
+        auto const m{ept.lookup(gpa + offset)};
+
+        if (m.present()) {
+            return false;
+        }
+
+        offset = m.vaddr + m.size() - gpa;
+    }
+
+    return true;
+}
+
+bool Pd::replace_pv_vcpu(mword index, Vcpu* old, Vcpu* vcpu)
+{
+    if (index >= MAX_PV_VCPUS) {
+        return false;
+    }
+
+    Lock_guard<Spinlock> guard{pv_vcpu_lock};
+
+    if (pv_vcpus[index] != old) {
+        return false;
+    }
+
+    pv_vcpus[index] = vcpu;
+    return true;
+}
+
+Vcpu* Pd::get_pv_vcpu(mword index)
+{
+    if (index >= MAX_PV_VCPUS) {
+        return nullptr;
+    }
+
+    Lock_guard<Spinlock> guard{pv_vcpu_lock};
+    Vcpu* const vcpu{pv_vcpus[index]};
+
+    // The reference count of a vCPU that is being destroyed is already zero.
+    return vcpu and vcpu->add_ref() ? vcpu : nullptr;
+}
+
+bool Pd::fill_ept(mword gpa)
+{
+    Ept_fill_window w;
+
+    {
+        Lock_guard<Spinlock> guard{ept_fill_lock};
+        w = ept_fill;
+    }
+
+    if (gpa < w.guest_base or gpa - w.guest_base >= w.size) {
+        return false;
+    }
+
+    // Delegations replace existing mappings and remove the mappings behind holes in the source, so we only
+    // fill regions that would not touch anything that the VMM mapped.
+    for (mword ord{w.order + PAGE_BITS}; ord >= PAGE_BITS; ord--) {
+        mword const base{gpa & ~((1UL << ord) - 1)};
+
+        if (base < w.guest_base or base - w.guest_base + (1UL << ord) > w.size) {
+            continue;
+        }
+
+        mword const hva{base - w.guest_base + w.host_base};
+
+        if (not ept_fill_possible(base, hva, ord)) {
+            continue;
+        }
+
+        Tlb_cleanup cleanup;
+        bool const ok{
+            Space_mem::delegate(cleanup, this, hva, base, ord, w.attr, Space::SUBSPACE_GUEST).is_ok()};
+
+        finish_delegation(cleanup);
+        return ok;
+    }
+
+    return false;
+}
+
+void Pd::finish_delegation(Tlb_cleanup& cleanup)
+{
+    if (cleanup.need_tlb_flush()) {
+        shootdown();
+        cleanup.ignore_tlb_flush(); // because it is done.
+    }
+}
+
 Delegate_result_void Pd::del_crd(Pd* pd, Crd del, Crd& crd, mword sub, mword hot)
 {
-    Crd::Type st = crd.type(), rt = del.type();
     Tlb_cleanup cleanup;
+    auto guard{Scope_guard([this, &cleanup]() { finish_delegation(cleanup); })};
+
+    return del_crd(cleanup, pd, del, crd, sub, hot);
+}
+
+Delegate_result_void Pd::del_crd(Tlb_cleanup& cleanup, Pd* pd, Crd del, Crd& crd, mword sub, mword hot)
+{
+    Crd::Type st = crd.type(), rt = del.type();
 
     mword a = crd.attr() & del.attr(), sb = crd.base(), so = crd.order(), rb = del.base(), ro = del.order(),
           o = 0;
@@ -279,16 +429,11 @@ Delegate_result_void Pd::del_crd(Pd* pd, Crd del, Crd& crd, mword sub, mword hot
     }
 
     // Regardless of whether the delegate operations below fail or succeed, they might have done operations
-    // that require TLB flushing.
+    // that require TLB flushing. The flush itself is done by the caller via finish_delegation.
     auto guard{Scope_guard([this, &cleanup, rt]() {
         if (cleanup.need_tlb_flush() && rt == Crd::OBJ)
-            /* if FRAME_0 got replaced by real pages we have to tell all cpus, done below by shootdown */
-            this->stale_host_tlb.merge(cpus);
-
-        if (cleanup.need_tlb_flush()) {
-            shootdown();
-            cleanup.ignore_tlb_flush(); // because it is done.
-        }
+            /* if FRAME_0 got replaced by real pages we have to tell all cpus, done by the shootdown */
+            this->mark_stale_host_tlb(cleanup.tlb_range());
     })};
 
     switch (rt) {
@@ -317,14 +462,16 @@ Delegate_result_void Pd::del_crd(Pd* pd, Crd del, Crd& crd, mword sub, mword hot
     return Ok_void({});
 }
 
-void Pd::rev_crd(Crd crd, bool self)
+void Pd::rev_crd(Crd crd, bool self) { rev_crds(1, self, [crd](mword) { return crd; }); }
+
+void Pd::rev_crd(Tlb_cleanup& cleanup, Crd crd, bool self)
 {
     switch (crd.type()) {
 
     case Crd::MEM:
         trace(TRACE_REV, "REV MEM PD:%p B:%#010lx O:%#04x A:%#04x %s", this, crd.base(), crd.order(),
               crd.attr(), self ? "+" : "-");
-        revoke<Space_mem>(crd.base(), crd.order(), crd.attr(), self);
+        revoke_mem(cleanup, crd.base(), crd.order(), crd.attr(), self);
         break;
 
     case Crd::PIO:
@@ -342,6 +489,14 @@ void Pd::rev_crd(Crd crd, bool self)
 }
 
 Delegate_result<Xfer> Pd::xfer_item(Pd* src_pd, Crd xlt, Crd del, Xfer s_ti)
+{
+    Tlb_cleanup cleanup;
+    auto guard{Scope_guard([this, &cleanup]() { finish_delegation(cleanup); })};
+
+    return xfer_item(cleanup, src_pd, xlt, del, s_ti);
+}
+
+Delegate_result<Xfer> Pd::xfer_item(Tlb_cleanup& cleanup, Pd* src_pd, Crd xlt, Crd del, Xfer s_ti)
 {
     mword set_as_del = 0;
     Crd crd = s_ti.crd();
@@ -361,10 +516,13 @@ Delegate_result<Xfer> Pd::xfer_item(Pd* src_pd, Crd xlt, Crd del, Xfer s_ti)
         crd = s_ti.crd();
         set_as_del = 1;
         [[fallthrough]];
-    case Xfer::Kind::DELEGATE:
-        TRY_OR_RETURN(del_crd(src_pd->is_priv && s_ti.from_kern() ? &kern : src_pd, del, crd,
-                              s_ti.subspaces(), s_ti.hotspot()));
+    case Xfer::Kind::DELEGATE: {
+        mword const sub{s_ti.subspaces() | (s_ti.cow() ? mword{Space::SUBSPACE_COW} : 0)};
+
+        TRY_OR_RETURN(del_crd(cleanup, src_pd->is_priv && s_ti.from_kern() ? &kern : src_pd, del, crd, sub,
+                              s_ti.hotspot()));
         break;
+    }
 
     default:
         crd = Crd(0);
@@ -377,8 +535,11 @@ Delegate_result<Xfer> Pd::xfer_item(Pd* src_pd, Crd xlt, Crd del, Xfer s_ti)
 Delegate_result_void Pd::xfer_items(Pd* src_pd, Crd xlt, Crd del, Xfer* s_ti, Xfer* d_ti,
                                     unsigned long num_typed)
 {
+    Tlb_cleanup cleanup;
+    auto guard{Scope_guard([this, &cleanup]() { finish_delegation(cleanup); })};
+
     for (unsigned long cur = 0; cur < num_typed; cur++) {
-        Xfer res{TRY_OR_RETURN(xfer_item(src_pd, xlt, del, *(s_ti - cur)))};
+        Xfer res{TRY_OR_RETURN(xfer_item(cleanup, src_pd, xlt, del, *(s_ti - cur)))};
 
         if (d_ti) {
             *(d_ti - cur) = res;
@@ -405,6 +566,57 @@ void* Pd::get_access_page()
     return ret;
 }
 
+void Pd::drop_retained_refs()
+{
+    Hip::for_each_online_cpu([this](unsigned cpu) {
+        if (Atomic::cmp_swap(remote_ref_retained(cpu), this, static_cast<Pd*>(nullptr))) {
+            bool last = del_ref();
+            assert(!last);
+        }
+    });
+}
+
+void Pd::teardown(void* ctx)
+{
+    Pd* const pd{static_cast<Pd*>(ctx)};
+
+    for (unsigned i{0}; i < TEARDOWN_STEPS; i++) {
+        if (pd->Space_mem::destroy_step()) {
+            continue;
+        }
+
+        Sm* const sm{pd->teardown_sm};
+
+        delete pd;
+
+        if (sm) {
+            sm->up();
+
+            if (sm->del_rcu()) {
+                Rcu::call(sm);
+            }
+        }
+
+        return;
+    }
+
+    // Let other work run before we continue.
+    Deferred_work::queue(&pd->teardown_work);
+}
+
+bool Pd::set_teardown_sm(Sm* sm)
+{
+    if (sm and not sm->add_ref()) {
+        return false;
+    }
+
+    if (Sm* const old{Atomic::exchange(teardown_sm, sm)}; old and old->del_rcu()) {
+        Rcu::call(old);
+    }
+
+    return true;
+}
+
 Pd::~Pd()
 {
     pre_free(this);
@@ -0,0 +1,317 @@
+/*
+ * Performance Monitoring Unit Sampling
+ *
+ * This file is part of the Hedron hypervisor.
+ *
+ * Hedron is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Hedron is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License version 2 for more details.
+ */
+
+#include "pmu.hpp"
+#include "atomic.hpp"
+#include "barrier.hpp"
+#include "ec.hpp"
+#include "kp.hpp"
+#include "lapic.hpp"
+#include "math.hpp"
+#include "msr.hpp"
+#include "pd.hpp"
+#include "rcu.hpp"
+#include "vcpu.hpp"
+#include "x86.hpp"
+
+static_assert(sizeof(Pmu_ring) == PAGE_SIZE, "The PMU sample ring must fill a page");
+static_assert(sizeof(Per_cpu::pmu_reload) / sizeof(*Per_cpu::pmu_reload) ==
+                  Pmu::GP_COUNTERS + Pmu::FIXED_COUNTERS,
+              "Each counter needs a reload value");
+
+namespace
+{
+
+// IA32_PERFEVTSELx
+constexpr uint64 EVTSEL_INT{1ULL << 20};
+constexpr uint64 EVTSEL_EN{1ULL << 22};
+
+// The bits that user space may set: event select, unit mask, USR, OS, edge detect, invert and counter mask.
+constexpr uint64 EVTSEL_USER{0xff87ffffULL};
+constexpr uint64 EVTSEL_USR_OS{3ULL << 16};
+
+// IA32_FIXED_CTR_CTRL has four bits per counter. We let user space only set the enable bits.
+constexpr uint64 FIXED_EN{0x3};
+constexpr uint64 FIXED_PMI{0x8};
+
+// The bit of a fixed counter in IA32_PERF_GLOBAL_CTRL and IA32_PERF_GLOBAL_STATUS.
+constexpr unsigned FIXED_SHIFT{32};
+
+struct Pmu_caps {
+    unsigned version;
+    unsigned gp_counters;
+    unsigned fixed_counters;
+    unsigned fixed_width;
+};
+
+Pmu_caps caps()
+{
+    uint32 eax, ebx, ecx, edx;
+
+    cpuid(0, eax, ebx, ecx, edx);
+
+    if (eax < 0xa) {
+        return {};
+    }
+
+    cpuid(0xa, eax, ebx, ecx, edx);
+
+    // We don't use more counters than we have room for.
+    return {eax & 0xff, min(eax >> 8 & 0xff, Pmu::GP_COUNTERS), min(edx & 0x1f, Pmu::FIXED_COUNTERS),
+            edx >> 5 & 0xff};
+}
+
+Msr::Register evtsel_msr(unsigned i) { return Msr::Register(Msr::IA32_PERFEVTSEL0 + i); }
+Msr::Register pmc_msr(unsigned i) { return Msr::Register(Msr::IA32_PMC0 + i); }
+Msr::Register fixed_msr(unsigned i) { return Msr::Register(Msr::IA32_FIXED_CTR0 + i); }
+
+// The counters of this CPU in the layout of IA32_PERF_GLOBAL_CTRL.
+uint64 counter_mask(Pmu_caps const& c)
+{
+    return ((1ULL << c.gp_counters) - 1) | ((1ULL << c.fixed_counters) - 1) << FIXED_SHIFT;
+}
+
+bool valid_period(uint64 period) { return period >= Pmu::MIN_PERIOD and period <= Pmu::MAX_PERIOD; }
+
+} // namespace
+
+bool Pmu::available() { return caps().version >= 2; }
+
+bool Pmu::start(Kp* kp)
+{
+    stop();
+
+    // Sampling takes the counters away from the guest that may still have its state loaded.
+    Vcpu::flush_pmu();
+
+    Pmu_caps const c{caps()};
+    Pmu_ring* const r{static_cast<Pmu_ring*>(kp->data_page())};
+
+    // User space can change the configuration at any time, so we only look at this copy.
+    Pmu_config const config{r->config};
+
+    uint64 enable{0};
+
+    for (unsigned i{0}; i < GP_COUNTERS; i++) {
+        if (not config.evtsel[i] and not config.gp_period[i]) {
+            continue;
+        }
+
+        if (i >= c.gp_counters or (config.evtsel[i] & ~EVTSEL_USER) or
+            not(config.evtsel[i] & EVTSEL_USR_OS) or not valid_period(config.gp_period[i])) {
+            return false;
+        }
+
+        enable |= 1ULL << i;
+    }
+
+    for (unsigned i{0}; i < FIXED_COUNTERS; i++) {
+        uint64 const ctrl{config.fixed_ctrl >> (4 * i) & 0xf};
+
+        if (not ctrl and not config.fixed_period[i]) {
+            continue;
+        }
+
+        if (i >= c.fixed_counters or (ctrl & ~FIXED_EN) or not ctrl or
+            not valid_period(config.fixed_period[i])) {
+            return false;
+        }
+
+        enable |= 1ULL << (FIXED_SHIFT + i);
+    }
+
+    if (not enable or (config.fixed_ctrl >> (4 * FIXED_COUNTERS)) or not kp->add_ref()) {
+        return false;
+    }
+
+    for (Pmu_sample& s : r->samples) {
+        Atomic::store<uint32, Atomic::RELAXED>(s.seq, 0);
+    }
+
+    uint64 fixed_ctrl{0};
+
+    for (unsigned i{0}; i < GP_COUNTERS; i++) {
+        if (enable & 1ULL << i) {
+            reload()[i] = 0 - config.gp_period[i];
+
+            Msr::write(pmc_msr(i), reload()[i]);
+            Msr::write(evtsel_msr(i), config.evtsel[i] | EVTSEL_INT | EVTSEL_EN);
+        }
+    }
+
+    for (unsigned i{0}; i < FIXED_COUNTERS; i++) {
+        if (enable & 1ULL << (FIXED_SHIFT + i)) {
+            // Writes to fixed counters are not sign-extended.
+            reload()[GP_COUNTERS + i] = (0 - config.fixed_period[i]) & ((1ULL << c.fixed_width) - 1);
+            fixed_ctrl |= ((config.fixed_ctrl >> (4 * i) & FIXED_EN) | FIXED_PMI) << (4 * i);
+
+            Msr::write(fixed_msr(i), reload()[GP_COUNTERS + i]);
+        }
+    }
+
+    Msr::write(Msr::IA32_FIXED_CTR_CTRL, fixed_ctrl);
+    Msr::write(Msr::IA32_PERF_GLOBAL_OVF_CTRL, Msr::read(Msr::IA32_PERF_GLOBAL_STATUS));
+
+    cnt() = 0;
+    ring_kp() = kp;
+    enabled() = enable;
+
+    // The NMI handler must see the ring only after everything else is set up.
+    barrier();
+    ring() = r;
+
+    Lapic::set_pmi_delivery(true);
+    Msr::write(Msr::IA32_PERF_GLOBAL_CTRL, enable);
+
+    return true;
+}
+
+void Pmu::stop()
+{
+    Kp* const old{ring_kp()};
+
+    if (not old) {
+        return;
+    }
+
+    Msr::write(Msr::IA32_PERF_GLOBAL_CTRL, 0);
+    Lapic::set_pmi_delivery(false);
+
+    ring() = nullptr;
+    barrier();
+
+    Msr::write(Msr::IA32_FIXED_CTR_CTRL, 0);
+
+    for (unsigned i{0}; i < GP_COUNTERS; i++) {
+        if (enabled() & 1ULL << i) {
+            Msr::write(evtsel_msr(i), 0);
+        }
+    }
+
+    enabled() = 0;
+    ring_kp() = nullptr;
+
+    if (old->del_rcu()) {
+        Rcu::call(old);
+    }
+}
+
+void Pmu::save(Pmu_context& ctx)
+{
+    Pmu_caps const c{caps()};
+
+    ctx.status = Msr::read(Msr::IA32_PERF_GLOBAL_STATUS) & counter_mask(c);
+    ctx.fixed_ctrl = Msr::read(Msr::IA32_FIXED_CTR_CTRL);
+
+    Msr::write(Msr::IA32_FIXED_CTR_CTRL, 0);
+
+    for (unsigned i{0}; i < c.gp_counters; i++) {
+        ctx.evtsel[i] = Msr::read(evtsel_msr(i));
+        ctx.pmc[i] = Msr::read(pmc_msr(i));
+
+        Msr::write(evtsel_msr(i), 0);
+        Msr::write(pmc_msr(i), 0);
+    }
+
+    for (unsigned i{0}; i < c.fixed_counters; i++) {
+        ctx.fixed_ctr[i] = Msr::read(fixed_msr(i));
+
+        Msr::write(fixed_msr(i), 0);
+    }
+
+    Msr::write(Msr::IA32_PERF_GLOBAL_OVF_CTRL, ctx.status);
+}
+
+void Pmu::load(Pmu_context const& ctx)
+{
+    Pmu_caps const c{caps()};
+
+    for (unsigned i{0}; i < c.gp_counters; i++) {
+        Msr::write(pmc_msr(i), ctx.pmc[i]);
+        Msr::write(evtsel_msr(i), ctx.evtsel[i]);
+    }
+
+    for (unsigned i{0}; i < c.fixed_counters; i++) {
+        Msr::write(fixed_msr(i), ctx.fixed_ctr[i]);
+    }
+
+    Msr::write(Msr::IA32_FIXED_CTR_CTRL, ctx.fixed_ctrl);
+    Msr::write(Msr::IA32_PERF_GLOBAL_OVF_CTRL, counter_mask(c));
+
+    // Only version 4 and later can set overflow bits. Older PMUs lose pending overflows of the guest.
+    if (c.version >= 4 and ctx.status) {
+        Msr::write(Msr::IA32_PERF_GLOBAL_STATUS_SET, ctx.status);
+    }
+}
+
+bool Pmu::overflowed(uint64 counters) { return Msr::read(Msr::IA32_PERF_GLOBAL_STATUS) & counters; }
+
+bool Pmu::handle_nmi(mword rip, Mode mode)
+{
+    Pmu_ring* const r{ring()};
+
+    // Don't touch any MSRs in the common case that nobody samples.
+    if (EXPECT_TRUE(not r)) {
+        return false;
+    }
+
+    uint64 const overflowed{Msr::read(Msr::IA32_PERF_GLOBAL_STATUS) & enabled()};
+
+    if (not overflowed) {
+        return false;
+    }
+
+    Ec* const ec{Ec::current()};
+    Pd* const pd{Pd::current()};
+
+    for (unsigned i{0}; i < GP_COUNTERS + FIXED_COUNTERS; i++) {
+        bool const fixed{i >= GP_COUNTERS};
+        unsigned const bit{fixed ? FIXED_SHIFT + i - GP_COUNTERS : i};
+
+        if (not(overflowed & 1ULL << bit)) {
+            continue;
+        }
+
+        Msr::write(fixed ? fixed_msr(i - GP_COUNTERS) : pmc_msr(i), reload()[i]);
+
+        // NMIs don't nest and nothing else writes into the ring.
+        unsigned const n{cnt()++};
+        Pmu_sample& s{r->samples[n % Pmu_ring::SAMPLES]};
+
+        // Invalidate the entry before we change it.
+        Atomic::store<uint32, Atomic::RELAXED>(s.seq, 0);
+        barrier();
+
+        s.tsc = rdtsc();
+        s.rip = rip;
+        s.ec = ec ? ec->id : 0;
+        s.pd = pd ? pd->id : 0;
+        s.cpu = static_cast<uint16>(Cpu::id());
+        s.counter = static_cast<uint8>(i);
+        s.mode = mode;
+
+        uint32 const seq{n + 1};
+
+        barrier();
+        Atomic::store<uint32, Atomic::RELAXED>(s.seq, seq ? seq : uint32{1});
+    }
+
+    Msr::write(Msr::IA32_PERF_GLOBAL_OVF_CTRL, overflowed);
+
+    // The LAPIC masks the performance counter LVT entry when it delivers a PMI.
+    Lapic::set_pmi_delivery(true);
+
+    return true;
+}
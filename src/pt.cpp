@@ -23,7 +23,7 @@
 #include "stdio.hpp"
 
 INIT_PRIORITY(PRIO_SLAB)
-Slab_cache Pt::cache(sizeof(Pt), 32);
+Slab_cache Pt::cache{Slab_cache::create<Pt, 32>()};
 
 Pt::Pt(Pd* own, mword sel, Ec* e, Mtd m, mword addr)
     : Typed_kobject(static_cast<Space_obj*>(own), sel, PERM_CTRL | PERM_CALL, free), ec(e), mtd(m), ip(addr),
@@ -20,81 +20,58 @@
 
 #include "rcu.hpp"
 #include "atomic.hpp"
-#include "barrier.hpp"
 #include "cpu.hpp"
+#include "event_trace.hpp"
 #include "hazards.hpp"
 #include "hip.hpp"
 #include "initprio.hpp"
 #include "lapic.hpp"
+#include "math.hpp"
+#include "sched_stats.hpp"
 #include "stdio.hpp"
+#include "x86.hpp"
 
-mword Rcu::state = RCU_CMP;
-mword Rcu::count;
+unsigned Cpulocal_rcu::id() { return Cpu::id(); }
 
-void Rcu::invoke_batch()
-{
-    for (Rcu_elem *e = done().head, *n = nullptr; n != done().head; e = n) {
-        n = e->next;
-        e->next = nullptr;
-        (e->func)(e);
-    }
-
-    done().clear();
-}
+mword Cpulocal_rcu::online() { return Cpu::online; }
 
-void Rcu::start_batch(State s)
-{
-    mword v, m = RCU_CMP | RCU_PND;
+template <typename FN> void Cpulocal_rcu::for_each_online_cpu(FN fn) { Hip::for_each_online_cpu(fn); }
 
-    do
-        if ((v = state) >> 2 != l_batch())
-            return;
-    while (!(v & s) && !Atomic::cmp_swap(state, v, v | s));
+bool Cpulocal_rcu::isolated_guest(unsigned cpu) { return Cpu::remote_load_isolated_guest(cpu); }
 
-    if ((v ^ ~s) & m)
-        return;
+unsigned& Cpulocal_rcu::hazard() { return Cpu::hazard(); }
 
-    count = Cpu::online;
+uint64 Cpulocal_rcu::tsc() { return rdtsc(); }
 
-    barrier();
+void Cpulocal_rcu::count_call() { Sched_stats::count(&Sched_stats::rcu_call_cnt); }
 
-    state++;
+void Cpulocal_rcu::count_invoke(unsigned n, uint64 tsc)
+{
+    Sched_stats::count(&Sched_stats::rcu_invoke_cnt, n);
+    Sched_stats::count(&Sched_stats::rcu_invoke_tsc, tsc);
+    Event_trace::record(Event_trace::RCU_INVOKE, n);
 }
 
-void Rcu::quiet()
+void Cpulocal_rcu::count_batch(mword b, uint64 wait_tsc)
 {
-    if (Atomic::sub(count, 1UL) == 0)
-        start_batch(RCU_CMP);
+    Sched_stats::count(&Sched_stats::rcu_batch_cnt);
+    Sched_stats::count(&Sched_stats::rcu_wait_tsc, wait_tsc);
+    Event_trace::record(Event_trace::RCU_BATCH, static_cast<uint32>(b),
+                        static_cast<uint32>(min(wait_tsc, uint64{~0U})));
 }
 
-void Rcu::update()
+void Cpulocal_rcu::kick()
 {
-    if (l_batch() != batch()) {
-        l_batch() = batch();
-        Atomic::set_mask(Cpu::hazard(), HZD_RCU);
-    }
-
-    if (!curr().empty() && complete(c_batch()))
-        done().append(&curr());
+    Cpuset targets;
 
-    if (curr().empty() && !next().empty()) {
-        curr().append(&next());
+    Hip::for_each_online_cpu([&targets](unsigned cpu) {
+        Atomic::set_mask(Cpu::hazard(cpu), HZD_IDL);
 
-        c_batch() = l_batch() + 1;
+        if (Cpu::id() != cpu and not Cpu::remote_load_isolated_guest(cpu))
+            targets.set(cpu);
+    });
 
-        start_batch(RCU_PND);
-    }
-
-    if (!curr().empty() && !next().empty() && (next().count > 2000 || curr().count > 2000))
-        for (unsigned cpu = 0; cpu < NUM_CPU; cpu++) {
-
-            if (!Hip::cpu_online(cpu) || Cpu::id() == cpu)
-                continue;
-
-            Atomic::set_mask(Cpu::hazard(cpu), HZD_IDL);
-            Lapic::send_nmi(cpu);
-        }
-
-    if (!done().empty())
-        invoke_batch();
+    Lapic::send_nmi(targets);
 }
+
+template class Generic_rcu<Cpulocal_rcu>;
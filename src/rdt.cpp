@@ -0,0 +1,198 @@
+/*
+ * Resource Director Technology (RDT) Allocation
+ *
+ * This file is part of the Hedron hypervisor.
+ *
+ * Hedron is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Hedron is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License version 2 for more details.
+ */
+
+#include "rdt.hpp"
+#include "cpu.hpp"
+#include "math.hpp"
+#include "x86.hpp"
+
+namespace
+{
+
+// The resource IDs of CPUID leaf 0x10.
+enum : unsigned
+{
+    RES_L3 = 1,
+    RES_L2 = 2,
+    RES_MBA = 3,
+};
+
+struct Rdt_res {
+    // The number of classes of service of the resource. Zero if it is not supported.
+    unsigned cos;
+
+    // The length of the capacity bit masks or the highest throttling value for MBA.
+    unsigned limit;
+
+    // Whether the resource supports CDP (L3) or non-contiguous capacity masks.
+    bool cdp;
+    bool sparse;
+};
+
+Rdt_res res_caps(unsigned res)
+{
+    uint32 eax, ebx, ecx, edx;
+
+    cpuid(0, eax, ebx, ecx, edx);
+
+    if (eax < 0x10 or not Cpu::feature(Cpu::FEAT_RDT_A)) {
+        return {};
+    }
+
+    cpuid(0x10, 0, eax, ebx, ecx, edx);
+
+    if (not(ebx & (1U << res))) {
+        return {};
+    }
+
+    cpuid(0x10, res, eax, ebx, ecx, edx);
+
+    if (res == RES_MBA) {
+        return {(edx & 0xffff) + 1, (eax & 0xfff) + 1, false, false};
+    }
+
+    return {(edx & 0xffff) + 1, (eax & 0x1f) + 1, (ecx & 0x4) != 0, (ecx & 0x8) != 0};
+}
+
+bool valid_mask(Rdt_res const& r, uint64 mask)
+{
+    if (mask == 0 or mask >= (1ULL << r.limit)) {
+        return false;
+    }
+
+    // Without support for non-contiguous masks, the set bits must form a single run.
+    uint64 const run{mask >> bit_scan_forward(static_cast<mword>(mask))};
+
+    return r.sparse or ((run + 1) & run) == 0;
+}
+
+// The event IDs of IA32_QM_EVTSEL. Bit n-1 of CPUID.(EAX=0xF, ECX=1):EDX says whether event n is supported.
+constexpr unsigned event_id(Rdt::Resource event) { return event - Rdt::MON_L3_OCCUPANCY + 1; }
+
+bool l3_cdp_enabled() { return Msr::read(Msr::IA32_L3_QOS_CFG) & 0x1; }
+
+} // namespace
+
+unsigned Rdt::num_cos()
+{
+    return max(res_caps(RES_L3).cos, max(res_caps(RES_L2).cos, res_caps(RES_MBA).cos));
+}
+
+unsigned Rdt::num_rmid()
+{
+    uint32 eax, ebx, ecx, edx;
+
+    cpuid(0, eax, ebx, ecx, edx);
+
+    if (eax < 0xf or not Cpu::feature(Cpu::FEAT_RDT_M)) {
+        return 0;
+    }
+
+    // L3 monitoring is the only kind that the CPUs support.
+    cpuid(0xf, 0, eax, ebx, ecx, edx);
+
+    if (not(edx & 0x2)) {
+        return 0;
+    }
+
+    cpuid(0xf, 1, eax, ebx, ecx, edx);
+    return ecx + 1;
+}
+
+long Rdt::read_counters(Resource event, unsigned first, mword* out, size_t limit)
+{
+    unsigned const rmids{num_rmid()};
+
+    if (event < MON_L3_OCCUPANCY or event > MON_MBM_LOCAL or first >= rmids) {
+        return -1;
+    }
+
+    uint32 eax, ebx, ecx, edx;
+    cpuid(0xf, 1, eax, ebx, ecx, edx);
+
+    if (not(edx & (1U << (event_id(event) - 1)))) {
+        return -1;
+    }
+
+    size_t const cnt{min(size_t{rmids - first}, limit)};
+
+    for (size_t i{0}; i < cnt; i++) {
+        Msr::write(Msr::IA32_QM_EVTSEL, static_cast<uint64>(first + i) << 32 | event_id(event));
+        out[i] = Msr::read(Msr::IA32_QM_CTR);
+    }
+
+    return static_cast<long>(cnt);
+}
+
+bool Rdt::configure(Resource res, unsigned cos, uint64 value)
+{
+    switch (res) {
+    case L3:
+    case L3_CODE: {
+        Rdt_res const r{res_caps(RES_L3)};
+        bool const cdp{r.cos and r.cdp and l3_cdp_enabled()};
+
+        // With CDP, each class uses a pair of masks: the even one for data and the odd one for code.
+        if ((res == L3_CODE and not cdp) or cos >= (cdp ? r.cos / 2 : r.cos) or not valid_mask(r, value)) {
+            return false;
+        }
+
+        unsigned const idx{cdp ? 2 * cos + (res == L3_CODE) : cos};
+
+        Msr::write(Msr::Register(Msr::IA32_L3_QOS_MASK0 + idx), value);
+        return true;
+    }
+
+    case L2: {
+        Rdt_res const r{res_caps(RES_L2)};
+
+        if (cos >= r.cos or not valid_mask(r, value)) {
+            return false;
+        }
+
+        Msr::write(Msr::Register(Msr::IA32_L2_QOS_MASK0 + cos), value);
+        return true;
+    }
+
+    case MBA: {
+        Rdt_res const r{res_caps(RES_MBA)};
+
+        if (cos >= r.cos or value >= r.limit) {
+            return false;
+        }
+
+        Msr::write(Msr::Register(Msr::IA32_MBA_THRTL0 + cos), value);
+        return true;
+    }
+
+    case L3_CDP: {
+        Rdt_res const r{res_caps(RES_L3)};
+
+        if (not r.cos or not r.cdp or value > 1) {
+            return false;
+        }
+
+        Msr::write(Msr::IA32_L3_QOS_CFG, value);
+        return true;
+    }
+
+    case MON_L3_OCCUPANCY:
+    case MON_MBM_TOTAL:
+    case MON_MBM_LOCAL:
+        break;
+    }
+
+    return false;
+}
@@ -52,7 +52,7 @@ template <> void Exc_regs::tlb_flush<Vmcs>(bool full) const
     mword vpid = Vmcs::vpid();
 
     if (vpid)
-        Vpid::flush(full ? Vpid::CONTEXT_GLOBAL : Vpid::CONTEXT_NOGLOBAL, vpid);
+        Vpid::flush_context(full, vpid);
 }
 
 template <typename T> mword Exc_regs::cr0_set() const { return T::fix_cr0_set(); }
@@ -113,9 +113,21 @@ template <typename T> void Exc_regs::set_exc() const
 void Exc_regs::vmx_set_cpu_ctrl0(mword val, const bool passthrough_vcpu)
 {
     val |= Vmcs::ctrl_cpu()[0].set;
-    val |= passthrough_vcpu ? 0 : Vmcs::ctrl_cpu()[0].non_passthrough_set;
+    val |= passthrough_vcpu or native_idle ? 0 : Vmcs::ctrl_cpu()[0].non_passthrough_set;
     val &= Vmcs::ctrl_cpu()[0].clr;
 
+    if (native_idle) {
+        val &= ~Vmcs::Ctrl0::CPU_HLT;
+
+        // Deep C-states stop the LAPIC timer and the VMX-preemption timer of CPUs without an always running
+        // APIC timer. MWAIT keeps exiting there, so the VMM emulates it and we don't miss our deadlines.
+        if (Cpu::feature(Cpu::FEAT_ARAT)) {
+            val &= ~(Vmcs::Ctrl0::CPU_MWAIT | Vmcs::Ctrl0::CPU_MONITOR);
+        } else {
+            val |= Vmcs::Ctrl0::CPU_MWAIT | Vmcs::Ctrl0::CPU_MONITOR;
+        }
+    }
+
     bool tpr_shadow_active = val & Vmcs::Ctrl0::CPU_TPR_SHADOW;
 
     if (not tpr_shadow_active) {
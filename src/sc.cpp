@@ -20,33 +20,50 @@
  */
 
 #include "sc.hpp"
+#include "cmdline.hpp"
+#include "core_sched.hpp"
 #include "counter.hpp"
+#include "cpu_load.hpp"
 #include "ec.hpp"
+#include "hip.hpp"
+#include "hwp.hpp"
 #include "lapic.hpp"
+#include "sched_stats.hpp"
+#include "event_trace.hpp"
 #include "stdio.hpp"
 #include "time.hpp"
 
 INIT_PRIORITY(PRIO_SLAB)
-Slab_cache Sc::cache(sizeof(Sc), 32);
+Slab_cache Sc::cache{Slab_cache::create<Sc, CACHE_LINE_SIZE>()};
 
 Sc::Sc(Pd* own, mword sel, Ec* e)
     : Typed_kobject(static_cast<Space_obj*>(own), sel, Sc::PERM_ALL, free), ec(e),
-      cpu(static_cast<unsigned>(sel)), prio(0), prev(nullptr), next(nullptr)
+      cpu(static_cast<unsigned>(sel)), prio(0), prev(nullptr), next(nullptr), migratable(false), budget(0),
+      period(0), id(Atomic::add(id_cnt, 1U))
 {
     trace(TRACE_SYSCALL, "SC:%p created (PD:%p Kernel)", this, own);
 }
 
-Sc::Sc(Pd* own, mword sel, Ec* e, unsigned c, unsigned p)
+Sc::Sc(Pd* own, mword sel, Ec* e, unsigned c, unsigned p, bool m, uint64 b, uint64 per)
     : Typed_kobject(static_cast<Space_obj*>(own), sel, Sc::PERM_ALL, free), ec(e), cpu(c), prio(p),
-      prev(nullptr), next(nullptr)
+      prev(nullptr), next(nullptr), migratable(m), budget(b), period(per), id(Atomic::add(id_cnt, 1U))
 {
-    trace(TRACE_SYSCALL, "SC:%p created (EC:%p CPU:%#x P:%#x)", this, e, c, p);
+    // Sc objects are cache-line aligned (see Sc::cache). Scheduling should only touch one line.
+    static_assert(OFFSETOF(Sc, ec) / CACHE_LINE_SIZE == OFFSETOF(Sc, reserved) / CACHE_LINE_SIZE,
+                  "The hot SC fields don't fit into one cache line");
+
+    trace(TRACE_SYSCALL, "SC:%p created (EC:%p CPU:%#x P:%#x B:%#llx T:%#llx%s)", this, e, c, p, b, per,
+          m ? " migratable" : "");
+
+    if (m) {
+        Atomic::add(migratable_cnt, 1U);
+    }
 }
 
 void Sc::ready_enqueue(uint64 t, bool inc_ref)
 {
     assert(prio < NUM_PRIORITIES);
-    assert(cpu == Cpu::id());
+    assert(Atomic::load(cpu) == Cpu::id());
 
     if (inc_ref) {
         bool ok = add_ref();
@@ -55,45 +72,83 @@ void Sc::ready_enqueue(uint64 t, bool inc_ref)
             return;
     }
 
-    if (prio > prio_top())
-        prio_top() = prio;
+    tsc = t;
 
-    if (!list()[prio])
-        list()[prio] = prev = next = this;
-    else {
-        next = list()[prio];
-        prev = list()[prio]->prev;
-        next->prev = prev->next = this;
+    if (this != current()) {
+        Sched_stats::inc(stats()->wakeup_cnt);
     }
 
-    trace(TRACE_SCHEDULE, "ENQ:%p PRIO:%#x TOP:%#x %s", this, prio, prio_top(),
-          prio > current()->prio ? "reschedule" : "");
+    Event_trace::record(Event_trace::SC_ENQUEUE, id, prio);
 
-    if (prio > current()->prio) {
-        Atomic::set_mask(Cpu::hazard(), HZD_SCHED);
+    if (is_reservation()) {
+        if (t >= deadline) {
+            budget_left = budget;
+            deadline = t + period;
+        }
+
+        reserved = budget_left != 0;
     }
 
-    tsc = t;
+    if (reserved) {
+        ready().enqueue_reserved(this);
+
+        if (this != current()) {
+            publish_load();
+        }
+
+        bool const preempt{not current()->reserved or deadline < current()->deadline};
+
+        trace(TRACE_SCHEDULE, "ENQ:%p RES DL:%#llx %s", this, deadline, preempt ? "reschedule" : "");
+
+        if (preempt) {
+            Atomic::set_mask(Cpu::hazard(), HZD_SCHED);
+        }
+
+        return;
+    }
+
+    if (migratable) {
+        Atomic::add(migratable_ready(), 1U);
+    }
+
+    ready().enqueue(this);
+
+    // Sc::schedule publishes the load once it picked the next SC.
+    if (this != current()) {
+        publish_load();
+    }
+
+    bool const preempt{prio > current()->prio and not current()->reserved};
+
+    trace(TRACE_SCHEDULE, "ENQ:%p PRIO:%#x TOP:%#x %s", this, prio, ready().top(),
+          preempt ? "reschedule" : "");
+
+    if (preempt) {
+        Atomic::set_mask(Cpu::hazard(), HZD_SCHED);
+    }
 }
 
 void Sc::ready_dequeue(uint64 t)
 {
     assert(prio < NUM_PRIORITIES);
-    assert(cpu == Cpu::id());
+    assert(Atomic::load(cpu) == Cpu::id());
     assert(prev && next);
 
-    if (list()[prio] == this)
-        list()[prio] = next == this ? nullptr : next;
+    ready().dequeue(this, reserved);
 
-    next->prev = prev;
-    prev->next = next;
-    prev = next = nullptr;
+    if (migratable and not reserved) {
+        Atomic::sub(migratable_ready(), 1U);
+    }
 
-    while (!list()[prio_top()] && prio_top())
-        prio_top()--;
+    if (this != current()) {
+        publish_load();
+    }
 
-    trace(TRACE_SCHEDULE, "DEQ:%p PRIO:%#x TOP:%#x", this, prio, prio_top());
+    trace(TRACE_SCHEDULE, "DEQ:%p PRIO:%#x TOP:%#x%s", this, prio, ready().top(), reserved ? " RES" : "");
+    Event_trace::record(Event_trace::SC_DEQUEUE, id, prio);
 
+    // Sc::ready_enqueue has set tsc to the time when we entered the ready queue.
+    wait += t - tsc;
     tsc = t;
 }
 
@@ -105,24 +160,58 @@ void Sc::schedule(bool suspend)
     const uint64 t = rdtsc();
     current()->time += t - current()->tsc;
 
+    if (current()->reserved)
+        current()->budget_left = current()->budget_remaining(t);
+
     if (EXPECT_TRUE(!suspend))
         current()->ready_enqueue(t, false);
     else if (current()->del_rcu())
         Rcu::call(current());
 
-    Sc* sc = list()[prio_top()];
+    switch_to_next(t);
+}
+
+void Sc::switch_to_next(uint64 t)
+{
+    // Reservations with budget left take precedence over all fixed priorities.
+    Sc* sc = ready().pick();
     assert(sc);
 
+    // The idle SC stands in, while an SMT sibling executes another security domain. See Core_sched.
+    if (EXPECT_FALSE(Cmdline::coresched) and not Core_sched::admit(sc->ec->chain_pd())) {
+        sc = ready().head(0);
+        assert(sc);
+    }
+
+    Sched_stats::inc(stats()->schedule_cnt);
+    Sched_stats::inc(stats()->switch_cnt, sc != current());
+
+    if (sc != current()) {
+        Event_trace::record(Event_trace::SC_SWITCH, sc->id, sc->prio);
+        Hwp::switch_request(Atomic::load(sc->hwp_request));
+    }
+
     ctr_loop() = 0;
 
     current() = sc;
     sc->ready_dequeue(t);
+    publish_load();
+
     sc->ec->activate();
 }
 
+void Sc::publish_load()
+{
+    // The idle SC waits in the ready queue while another SC runs, so the queue holds as many SCs as want to
+    // run besides the idle SC.
+    Cpu_load::update(current()->ec == Ec::idle_ec(), ready().size(), max(current()->prio, ready().top()));
+}
+
 void Sc::remote_enqueue(bool inc_ref)
 {
-    if (Cpu::id() == cpu)
+    unsigned const target{Atomic::load(cpu)};
+
+    if (Cpu::id() == target)
         ready_enqueue(rdtsc(), inc_ref);
 
     else {
@@ -133,18 +222,18 @@ void Sc::remote_enqueue(bool inc_ref)
                 return;
         }
 
-        Rq* r = remote(cpu);
-
-        Lock_guard<Spinlock> guard(r->lock);
-
-        if (r->queue) {
-            next = r->queue;
-            prev = r->queue->prev;
-            next->prev = prev->next = this;
-        } else {
-            r->queue = prev = next = this;
-            Atomic::set_mask(Cpu::hazard(cpu), HZD_RRQ);
-            Lapic::send_nmi(cpu);
+        // Only the SC that makes the queue non-empty has to notify the remote CPU. The remote CPU picks up
+        // all SCs that are pushed until it drains the queue.
+        if (remote(target)->push(this)) {
+            unsigned const old_hzd{Atomic::fetch_or(Cpu::hazard(target), HZD_RRQ)};
+
+            // The remote CPU drains the queue without an NMI if the hazard was already pending or if it waits
+            // for hazards in Ec::idle. In the latter case, the hazard write itself wakes it up. An isolated
+            // CPU that executes a guest picks the SCs up after its next VM exit.
+            if (not(old_hzd & HZD_RRQ) and not Cpu::remote_load_idle_waiting(target) and
+                not Cpu::remote_load_isolated_guest(target)) {
+                Lapic::send_nmi(target);
+            }
         }
     }
 }
@@ -153,19 +242,131 @@ void Sc::rrq_handler()
 {
     uint64 t = rdtsc();
 
-    Lock_guard<Spinlock> guard(rq().lock);
+    for (Sc* ptr = rq().drain(); ptr;) {
+        Sc* sc = ptr;
+
+        ptr = ptr->next;
+        sc->ready_enqueue(t, false);
+        Sched_stats::inc(stats()->remote_wakeup_cnt);
+    }
+}
+
+void Sc::steal()
+{
+    if (EXPECT_TRUE(Atomic::load(migratable_cnt) == 0)) {
+        return;
+    }
+
+    unsigned const self{Cpu::id()};
+    unsigned victim{Cpu::online};
+    long victim_distance{0};
 
-    for (Sc* ptr = rq().queue; ptr;) {
+    Hip::for_each_online_cpu([&](unsigned c) {
+        if (c == self or Cpu::remote_load_idle_waiting(c) or Cpu::remote_load_isolated_guest(c) or
+            remote_load_migratable_ready(c) == 0) {
+            return;
+        }
 
-        ptr->next->prev = ptr->prev;
-        ptr->prev->next = ptr->next;
+        long const distance{bit_scan_reverse(static_cast<mword>(Cpu::apic_id[self] ^ Cpu::apic_id[c]))};
 
-        Sc* sc = ptr;
+        if (victim == Cpu::online or distance < victim_distance) {
+            victim = c;
+            victim_distance = distance;
+        }
+    });
 
-        ptr = ptr->next == ptr ? nullptr : ptr->next;
+    // Only one idle CPU can ask a victim at a time. If someone else was faster, there is no point in asking
+    // again.
+    if (victim == Cpu::online or not Atomic::cmp_swap(remote_ref_steal_req(victim), 0U, self + 1)) {
+        return;
+    }
 
-        sc->ready_enqueue(t, false);
+    // The victim answers when it leaves the kernel the next time, on its normal kernel stack. The NMI forces
+    // a guest out, an EC in user space answers with its next kernel entry.
+    if (not(Atomic::fetch_or(Cpu::hazard(victim), HZD_STEAL) & HZD_STEAL)) {
+        Lapic::send_nmi(victim);
+    }
+}
+
+bool Sc::can_migrate() const
+{
+    return migratable and ec->can_migrate();
+}
+
+void Sc::migrate(unsigned to)
+{
+    assert(Atomic::load(cpu) == Cpu::id());
+    assert(not prev and not next);
+
+    trace(TRACE_SCHEDULE, "MIGRATE:%p CPU:%#x->%#x", this, Cpu::id(), to);
+
+    ec->migrate(to);
+    Atomic::store(cpu, to);
+
+    // The SC keeps the reference it had in our ready queue.
+    remote_enqueue(false);
+}
+
+void Sc::follow(unsigned to)
+{
+    Sc* const sc{current()};
+
+    assert(sc->migratable and not sc->prev and not sc->next);
+    assert(follower() == nullptr);
+
+    uint64 const t{rdtsc()};
+    sc->time += t - sc->tsc;
+
+    trace(TRACE_SCHEDULE, "FOLLOW:%p CPU:%#x->%#x", sc, Cpu::id(), to);
+
+    // The SC keeps the reference it had as the current SC.
+    follower() = sc;
+    follower_cpu() = to;
+
+    switch_to_next(t);
+}
+
+void Sc::hand_over_follower()
+{
+    Sc* const sc{follower()};
+    unsigned const to{follower_cpu()};
+
+    follower() = nullptr;
+
+    assert(sc->ec != Ec::current());
+
+    sc->ec->migrate(to);
+    Atomic::store(sc->cpu, to);
+    sc->remote_enqueue(false);
+}
+
+void Sc::steal_handler()
+{
+    unsigned const req{Atomic::exchange(steal_req(), 0U)};
+
+    if (not req) {
+        return;
     }
 
-    rq().queue = nullptr;
+    uint64 const t = rdtsc();
+
+    for (unsigned p = ready().top() + 1; p-- > 0;) {
+        Sc* const head{ready().head(p)};
+
+        if (not head) {
+            continue;
+        }
+
+        Sc* sc{head};
+
+        do {
+            if (sc->can_migrate()) {
+                sc->ready_dequeue(t);
+                sc->migrate(req - 1);
+                return;
+            }
+
+            sc = sc->next;
+        } while (sc != head);
+    }
 }
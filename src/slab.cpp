@@ -20,16 +20,19 @@
 
 #include "slab.hpp"
 #include "assert.hpp"
+#include "cpulocal.hpp"
 #include "lock_guard.hpp"
 #include "math.hpp"
+#include "panic.hpp"
 #include "stdio.hpp"
 
-Slab::Slab(Slab_cache* slab_cache)
-    : avail(slab_cache->elem), cache(slab_cache), prev(nullptr), next(nullptr), head(nullptr)
+Slab::Slab(Slab_cache* slab_cache, unsigned long color)
+    : avail(slab_cache->geometry.elem), cache(slab_cache), prev(nullptr), next(nullptr), head(nullptr)
 {
-    char* link = reinterpret_cast<char*>(this) + PAGE_SIZE - cache->buff + cache->size;
+    Slab_geometry const& g{cache->geometry};
+    char* link = reinterpret_cast<char*>(this) + g.bytes() - color - g.buff + g.size;
 
-    for (unsigned long i = avail; i; i--, link -= cache->buff) {
+    for (unsigned long i = avail; i; i--, link -= g.buff) {
         *reinterpret_cast<char**>(link) = head;
         head = link;
     }
@@ -39,7 +42,7 @@ void* Slab::alloc()
 {
     avail--;
 
-    void* link = reinterpret_cast<void*>(head - cache->size);
+    void* link = reinterpret_cast<void*>(head - cache->geometry.size);
     head = *reinterpret_cast<char**>(head);
     return link;
 }
@@ -48,7 +51,7 @@ void Slab::free(void* ptr)
 {
     avail++;
 
-    char* link = reinterpret_cast<char*>(ptr) + cache->size;
+    char* link = reinterpret_cast<char*>(ptr) + cache->geometry.size;
     *reinterpret_cast<char**>(link) = head;
     head = link;
 }
@@ -83,55 +86,125 @@ void Slab::dequeue()
     }
 }
 
+unsigned Slab_cache::count;
+bool Slab_cache::magazines_enabled;
+Slab_cache* Slab_cache::caches[MAX_CACHES];
+
 Slab_cache::Slab_cache(unsigned long elem_size, unsigned elem_align)
-    : curr(nullptr), head(nullptr), size(align_up(elem_size, sizeof(mword))),
-      buff(align_up(size + sizeof(mword), elem_align)), elem((PAGE_SIZE - sizeof(Slab)) / buff)
+    : id(count++), curr(nullptr), head(nullptr), geometry(slab_geometry(elem_size, elem_align))
 {
-    trace(TRACE_MEMORY, "Slab Cache:%p (S:%lu A:%u)", this, elem_size, elem_align);
+    // The caches are registered by static constructors, which also run in release builds without asserts.
+    if (EXPECT_FALSE(id >= MAX_CACHES)) {
+        panic("Too many slab caches (%u), raise Slab_cache::MAX_CACHES", id + 1);
+    }
+
+    assert(geometry.elem != 0);
+
+    caches[id] = this;
+
+    trace(TRACE_MEMORY, "Slab Cache:%p (S:%lu A:%u) O:%u E:%lu U:%lu%% C:%lu", this, elem_size, elem_align,
+          geometry.order, geometry.elem, geometry.utilization(), geometry.colors());
 }
 
+Slab_magazine& Slab_cache::magazine() { return Cpulocal::get().slab_magazine[id]; }
+
 void Slab_cache::grow()
 {
-    Slab* slab = new Slab(this);
+    Slab* slab = new (geometry.order) Slab(this, next_color * Slab_geometry::COLOR_ALIGN);
     slab->enqueue(nullptr, head);
 
+    next_color = (next_color + 1) % geometry.colors();
+
     head = slab;
     curr = slab;
+    slabs++;
 }
 
 void* Slab_cache::alloc(Buddy::Fill fill_mem)
 {
     void* ret;
 
-    {
-        Lock_guard<Spinlock> guard(lock);
+    if (EXPECT_FALSE(not magazines_enabled)) {
+        Lock_guard<Mcs_lock> guard(lock);
+        ret = alloc_slab();
+    } else {
+        Slab_magazine& mag{magazine()};
+
+        if (EXPECT_FALSE(mag.cnt == 0)) {
+            Lock_guard<Mcs_lock> guard(lock);
 
-        if (EXPECT_FALSE(!curr)) {
-            grow();
+            for (; mag.cnt < batch(); mag.cnt++) {
+                void* const elem_ptr{alloc_slab()};
+
+                *static_cast<void**>(elem_ptr) = mag.head;
+                mag.head = elem_ptr;
+            }
         }
 
-        assert(!curr->full());
-        assert(!curr->next || curr->next->full());
+        ret = mag.head;
+        mag.head = *static_cast<void**>(ret);
+        mag.cnt--;
+    }
+
+    Buddy::fill(ret, fill_mem, geometry.size);
 
-        // Allocate from slab
-        ret = curr->alloc();
+    return ret;
+}
 
-        if (EXPECT_FALSE(curr->full())) {
-            // curr always points to the slab that will be used for the next allocation. If curr is full, we
-            // have to move it to curr-prev. If curr has no prev, curr will be a nullptr and the next
-            // allocation will call Slab_cache::grow, which makes curr and head point to an empty slab.
-            curr = curr->prev;
+void Slab_cache::free(void* ptr)
+{
+    if (EXPECT_FALSE(not magazines_enabled)) {
+        Lock_guard<Mcs_lock> guard(lock);
+        free_slab(ptr);
+        return;
+    }
+
+    Slab_magazine& mag{magazine()};
+
+    if (EXPECT_FALSE(mag.cnt == 2 * batch())) {
+        Lock_guard<Mcs_lock> guard(lock);
+
+        for (; mag.cnt > batch(); mag.cnt--) {
+            void* const elem_ptr{mag.head};
+
+            mag.head = *static_cast<void**>(elem_ptr);
+            free_slab(elem_ptr);
         }
     }
 
-    Buddy::fill(ret, fill_mem, size);
+    *static_cast<void**>(ptr) = mag.head;
+    mag.head = ptr;
+    mag.cnt++;
+}
+
+void* Slab_cache::alloc_slab()
+{
+    assert(lock.is_locked());
+
+    if (EXPECT_FALSE(!curr)) {
+        grow();
+    }
+
+    assert(!curr->full());
+    assert(!curr->next || curr->next->full());
+
+    // Allocate from slab
+    void* ret = curr->alloc();
+    used++;
+
+    if (EXPECT_FALSE(curr->full())) {
+        // curr always points to the slab that will be used for the next allocation. If curr is full, we have
+        // to move it to curr-prev. If curr has no prev, curr will be a nullptr and the next allocation will
+        // call Slab_cache::grow, which makes curr and head point to an empty slab.
+        curr = curr->prev;
+    }
 
     return ret;
 }
 
-void Slab_cache::free(void* ptr)
+void Slab_cache::free_slab(void* ptr)
 {
-    Lock_guard<Spinlock> guard(lock);
+    assert(lock.is_locked());
 
     // We can assert that head != nullptr here, because this can only happen if
     // someone calls free before calling alloc at least once, which is a bug.
@@ -139,11 +212,12 @@ void Slab_cache::free(void* ptr)
 
     // The slab that holds the element that will be free'd. In the following comments it will be refered to as
     // 'this slab'.
-    Slab* slab = reinterpret_cast<Slab*>(reinterpret_cast<mword>(ptr) & ~PAGE_MASK);
+    Slab* slab = reinterpret_cast<Slab*>(align_dn(reinterpret_cast<mword>(ptr), geometry.bytes()));
 
     const bool was_full = slab->full();
 
     slab->free(ptr); // Deallocate from slab
+    used--;
 
     // The list of slabs is ordered so that all full slabs come after curr, and all partial or free slabs
     // come before curr. We will reorder the list if necessary.
@@ -193,6 +267,7 @@ void Slab_cache::free(void* ptr)
             // There are already empty slabs, thus we delete this slab.
             assert(head != slab);
             delete slab;
+            slabs--;
         } else {
             // There is currently no empty slab, thus we enqueue this slab as the new head.
             slab->enqueue(nullptr, head);
@@ -200,3 +275,72 @@ void Slab_cache::free(void* ptr)
         }
     }
 }
+
+unsigned long Slab_cache::shrink()
+{
+    if (not lock.try_lock()) {
+        return 0;
+    }
+
+    if (magazines_enabled) {
+        Slab_magazine& mag{magazine()};
+
+        for (; mag.cnt > 0; mag.cnt--) {
+            void* const elem_ptr{mag.head};
+
+            mag.head = *static_cast<void**>(elem_ptr);
+            free_slab(elem_ptr);
+        }
+    }
+
+    unsigned long pages{0};
+
+    // Only the head can be empty. See free_slab.
+    if (head and head->empty()) {
+        Slab* const slab{head};
+
+        if (curr == slab) {
+            // All other slabs are full.
+            curr = nullptr;
+        }
+
+        head = slab->next;
+        slab->dequeue();
+
+        delete slab;
+        slabs--;
+        pages = 1UL << geometry.order;
+    }
+
+    lock.unlock();
+
+    return pages;
+}
+
+unsigned long Slab_cache::shrink_all()
+{
+    unsigned long pages{0};
+
+    for (unsigned i{0}; i < count; i++) {
+        pages += caches[i]->shrink();
+    }
+
+    trace(TRACE_MEMORY, "Slab caches released %lu pages", pages);
+
+    return pages;
+}
+
+unsigned long Slab_cache::all_stats(unsigned long* words, unsigned long max)
+{
+    for (unsigned i{0}; i < count and (i + 1) * STATS_WORDS <= max; i++) {
+        Slab_cache& c{*caches[i]};
+        Lock_guard<Mcs_lock> guard(c.lock);
+
+        words[i * STATS_WORDS + 0] = c.geometry.size;
+        words[i * STATS_WORDS + 1] = c.slabs << c.geometry.order;
+        words[i * STATS_WORDS + 2] = c.slabs * c.geometry.elem;
+        words[i * STATS_WORDS + 3] = c.used;
+    }
+
+    return count;
+}
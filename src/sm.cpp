@@ -22,10 +22,16 @@
 #include "stdio.hpp"
 
 INIT_PRIORITY(PRIO_SLAB)
-Slab_cache Sm::cache(sizeof(Sm), 32);
+Slab_cache Sm::cache{Slab_cache::create<Sm, 32>()};
 
-Sm::Sm(Pd* own, mword sel, mword cnt)
-    : Typed_kobject(static_cast<Space_obj*>(own), sel, Sm::PERM_ALL, free), counter(cnt)
+Sm::Sm(Pd* own, mword sel, mword cnt, bool notify, Sm* bound, mword bound_sig, Vcpu* vcpu, unsigned vector)
+    : Typed_kobject(static_cast<Space_obj*>(own), sel, Sm::PERM_ALL, free),
+      counter(notify ? cnt & NOTIFY_SIGNALS : cnt & COUNTER_MAX), notification(notify),
+      bound_notification(bound), bound_signals(bound_sig & NOTIFY_SIGNALS), bound_vcpu(vcpu),
+      bound_vector(vector)
 {
-    trace(TRACE_SYSCALL, "SM:%p created (CNT:%lu)", this, cnt);
+    assert(not bound or bound->is_notification());
+    assert(not vcpu or (not notify and vector < NUM_INT_VECTORS));
+
+    trace(TRACE_SYSCALL, "SM:%p created (CNT:%lu%s)", this, cnt, notify ? " NOTIFY" : "");
 }
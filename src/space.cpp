@@ -22,23 +22,55 @@
 #include "lock_guard.hpp"
 #include "math.hpp"
 #include "mdb.hpp"
+#include "slab.hpp"
+
+INIT_PRIORITY(PRIO_SLAB)
+static Slab_cache tree_cache{Slab_cache::create<Btree<Mdb, Space_tree_alloc>::Node, 64>()};
+
+void* Space_tree_alloc::alloc() { return tree_cache.alloc(); }
+void Space_tree_alloc::free(void* node) { tree_cache.free(node); }
+
+Mdb* Space::tree_lookup_locked(mword idx, bool next) const
+{
+    Mdb* const m{tree.floor(idx)};
+
+    if (m and (m->node_base ^ idx) >> m->node_order == 0) {
+        return m;
+    }
+
+    return next ? tree.above(idx) : nullptr;
+}
+
+bool Space::tree_insert_locked(Mdb* node)
+{
+    // Mappings are naturally aligned, so they overlap exactly if one contains the base of the other.
+    Mdb* const prev{tree.floor(node->node_base)};
+    Mdb* const next{tree.above(node->node_base)};
+
+    if ((prev and node->equal(prev)) or (next and node->equal(next))) {
+        return false;
+    }
+
+    tree.insert(node->node_base, node);
+    return true;
+}
 
 Mdb* Space::tree_lookup(mword idx, bool next)
 {
     Lock_guard<Spinlock> guard(lock);
-    return Mdb::lookup(tree, idx, next);
+    return tree_lookup_locked(idx, next);
 }
 
 bool Space::tree_insert(Mdb* node)
 {
     Lock_guard<Spinlock> guard(node->space->lock);
-    return Mdb::insert<Mdb>(&node->space->tree, node);
+    return node->space->tree_insert_locked(node);
 }
 
 bool Space::tree_remove(Mdb* node)
 {
     Lock_guard<Spinlock> guard(node->space->lock);
-    return Mdb::remove<Mdb>(&node->space->tree, node);
+    return node->space->tree.remove(node->node_base, node);
 }
 
 void Space::addreg(mword addr, size_t size, mword attr, mword type)
@@ -46,5 +78,5 @@ void Space::addreg(mword addr, size_t size, mword attr, mword type)
     Lock_guard<Spinlock> guard(lock);
 
     for (mword o; size; size -= 1UL << o, addr += 1UL << o)
-        Mdb::insert<Mdb>(&tree, new Mdb(nullptr, addr, addr, (o = max_order(addr, size)), attr, type));
+        tree_insert_locked(new Mdb(nullptr, addr, addr, (o = max_order(addr, size)), attr, type));
 }
@@ -24,32 +24,34 @@
 #include "lapic.hpp"
 #include "lock_guard.hpp"
 #include "mtrr.hpp"
+#include "optional.hpp"
+#include "parallel.hpp"
 #include "pd.hpp"
+#include "sched_stats.hpp"
 #include "scope_guard.hpp"
 #include "space.hpp"
 #include "stdio.hpp"
 
-unsigned Space_mem::did_ctr;
+INIT_PRIORITY(PRIO_SLAB)
+Slab_cache Space_mem::pcid_tags_cache{Slab_cache::create<Space_mem::Pcid_tags, CACHE_LINE_SIZE>()};
 
 void Space_mem::init(unsigned cpu) { cpus.set(cpu); }
 
-// Valid user mappings are below the canonical boundary and naturally aligned.
-static bool is_valid_user_mapping(mword vaddr, mword ord)
+// Valid mappings are below the given limit, e.g. the canonical boundary for user mappings, and naturally
+// aligned.
+static bool is_valid_mapping(mword vaddr, mword ord, mword limit)
 {
-    return vaddr < USER_ADDR and ord <= static_cast<mword>(max_order(vaddr, USER_ADDR)) and
+    return vaddr < limit and ord <= static_cast<mword>(max_order(vaddr, limit)) and
            (vaddr & ((1UL << ord) - 1)) == 0;
 }
 
-// Find the source mapping at snd_cur in the given position.
-static Hpt::Mapping lookup_and_adjust_rights(Space_mem* snd, mword snd_cur, mword snd_end, mword hw_attr)
+// Downgrade the rights of a source mapping to the rights given by hw_attr. Source mappings that must not be
+// delegated become empty mappings of the same size.
+static Hpt::Mapping adjust_rights(Hpt::Mapping mapping, mword hw_attr)
 {
-    bool const is_unmap{(hw_attr & Hpt::PTE_P) == 0};
-    Hpt::Mapping const empty_mapping{snd_cur, 0, 0, static_cast<Hpt::ord_t>(max_order(snd_cur, snd_end))};
-    Hpt::Mapping mapping{is_unmap ? empty_mapping : snd->Space_mem::hpt.lookup(snd_cur)};
-
     if (mapping.present() and ((mapping.attr & Hpt::PTE_NODELEG) or not(mapping.attr & Hpt::PTE_U))) {
         trace(TRACE_ERROR, "Refusing to map region %#016lx ord %d", mapping.vaddr, mapping.order);
-        mapping = empty_mapping;
+        mapping.attr = 0;
     }
 
     mapping.attr = Hpt::merge_hw_attr(mapping.attr, hw_attr);
@@ -62,7 +64,10 @@ Delegate_result_void Space_mem::delegate(Tlb_cleanup& cleanup, Space_mem* snd, m
 {
     assert(ord >= PAGE_BITS);
 
-    if (EXPECT_FALSE(not is_valid_user_mapping(snd_base, ord) or not is_valid_user_mapping(rcv_base, ord))) {
+    mword const rcv_limit{sub & Space::SUBSPACE_HOST ? USER_ADDR : guest_addr_limit()};
+
+    if (EXPECT_FALSE(not is_valid_mapping(snd_base, ord, USER_ADDR) or
+                     not is_valid_mapping(rcv_base, ord, rcv_limit))) {
         trace(TRACE_ERROR, "INVALID MEM SB:%#016lx RB:%#016lx O:%#04lx A:%#lx S:%#lx", snd_base, rcv_base,
               ord, attr, sub);
 
@@ -76,6 +81,8 @@ Delegate_result_void Space_mem::delegate(Tlb_cleanup& cleanup, Space_mem* snd, m
         return Ok_void({});
     }
 
+    Mapping_guard guard{*this, rcv_base, 1UL << ord};
+
     // Regardless of whether the operation was a success, we must take care of the TLB to not leave old
     // mappings around, even if we only managed a partial page table update.
     Scope_guard g{[this, &cleanup, sub] {
@@ -84,20 +91,86 @@ Delegate_result_void Space_mem::delegate(Tlb_cleanup& cleanup, Space_mem* snd, m
                 stale_guest_tlb.merge(cpus);
             }
             if (sub & Space::SUBSPACE_HOST) {
-                stale_host_tlb.merge(cpus);
+                mark_stale_host_tlb(cleanup.tlb_range());
             }
         }
     }};
 
     Hpt::pte_t const hw_attr{Hpt::hw_attr(attr)};
+
+    // There is only one busy window, so a second large delegation runs on its own CPU.
+    if (ord >= PARALLEL_ORD and busy_base == busy_end) {
+        return delegate_parallel(cleanup, snd, snd_base, rcv_base, ord, hw_attr, sub);
+    }
+
+    return delegate_window(cleanup, snd, snd_base, rcv_base, ord, hw_attr, sub);
+}
+
+Delegate_result_void Space_mem::delegate_parallel(Tlb_cleanup& cleanup, Space_mem* snd, mword snd_base,
+                                                  mword rcv_base, mword ord, Hpt::pte_t hw_attr, mword sub)
+{
+    struct Context {
+        Space_mem* rcv;
+        Space_mem* snd;
+        mword snd_base;
+        mword rcv_base;
+        Hpt::pte_t hw_attr;
+        mword sub;
+
+        // Protects the fields below, which collect the results of all chunks.
+        Spinlock lock;
+        Tlb_cleanup& cleanup;
+        Optional<Delegate_error> error;
+    } ctx{this, snd, snd_base, rcv_base, hw_attr, sub, {}, cleanup, {}};
+
+    // Other CPUs that wait for mapping_lock would spin for the whole population. Only those that modify
+    // this window have to.
+    busy_base = rcv_base;
+    busy_end = rcv_base + (1UL << ord);
+    mapping_lock.unlock();
+
+    Parallel::for_each(1UL << (ord - CHUNK_ORD), [](void* p, mword chunk) {
+        Context& c{*static_cast<Context*>(p)};
+        mword const offset{chunk << CHUNK_ORD};
+
+        Tlb_cleanup chunk_cleanup;
+        auto const result{c.rcv->delegate_window(chunk_cleanup, c.snd, c.snd_base + offset,
+                                                 c.rcv_base + offset, CHUNK_ORD, c.hw_attr, c.sub)};
+
+        Lock_guard<Spinlock> guard{c.lock};
+
+        c.cleanup.merge(chunk_cleanup);
+
+        if (result.is_err() and not c.error.has_value()) {
+            c.error = result.unwrap_err();
+        }
+    }, &ctx);
+
+    mapping_lock.lock();
+    busy_base = busy_end = 0;
+
+    if (ctx.error.has_value()) {
+        return Err(*ctx.error);
+    }
+
+    return Ok_void({});
+}
+
+Delegate_result_void Space_mem::delegate_window(Tlb_cleanup& cleanup, Space_mem* snd, mword snd_base,
+                                                mword rcv_base, mword ord, Hpt::pte_t hw_attr, mword sub)
+{
     mword const snd_end{snd_base + (1ULL << ord)};
 
-    for (mword snd_cur{snd_base}; snd_cur < snd_end;) {
-        // The source mapping with the correct downgraded rights.
-        auto const mapping{lookup_and_adjust_rights(snd, snd_cur, snd_end, hw_attr)};
+    // The source mappings come in ascending order, so consecutive updates mostly modify the same page table.
+    Ept::Update_cursor ept_cursor;
+    Hpt::Update_cursor hpt_cursor;
 
-        // The source mapping chopped down to fit in the send window.
-        auto const clamped{mapping.clamp(snd_base, static_cast<Hpt::ord_t>(ord))};
+    mword snd_cur{snd_base};
+
+    // Transfer the given source mapping at snd_cur and advance snd_cur behind it.
+    auto const transfer{[&](Hpt::Mapping const& mapping) -> Delegate_result_void {
+        // The source mapping with the correct downgraded rights chopped down to fit in the send window.
+        auto const clamped{adjust_rights(mapping, hw_attr).clamp(snd_base, static_cast<Hpt::ord_t>(ord))};
 
         // The mapping as we want to put it into the destination page tables.
         auto const target_mapping{clamped.move_by(rcv_base - snd_base)};
@@ -111,19 +184,76 @@ Delegate_result_void Space_mem::delegate(Tlb_cleanup& cleanup, Space_mem* snd, m
             return Err(Delegate_error::invalid_mapping());
         }
 
+        // Removing mappings never needs new page tables, so it is always allowed.
+        if (EXPECT_FALSE(target_mapping.present() and kmem_exhausted())) {
+            trace(TRACE_ERROR, "Declining to map %#lx+%#lx, because the kernel memory limit is reached",
+                  target_mapping.vaddr, target_mapping.size());
+            return Err(Delegate_error::out_of_memory());
+        }
+
         if (sub & Space::SUBSPACE_GUEST) {
-            TRY_OR_RETURN(ept.update(cleanup, Ept::convert_mapping(target_mapping)));
+            Ept::Mapping guest_mapping{Ept::convert_mapping(target_mapping)};
+
+            if (sub & Space::SUBSPACE_COW) {
+                guest_mapping = Ept::cow_mapping(guest_mapping);
+            }
+
+            TRY_OR_RETURN(ept.update(cleanup, ept_cursor, guest_mapping));
+
+            if (target_mapping.present() and ept.promote(cleanup, target_mapping.vaddr)) {
+                ept_cursor.reset();
+            }
         }
 
         if (sub & Space::SUBSPACE_HOST) {
-            TRY_OR_RETURN(hpt.update(cleanup, target_mapping));
+            TRY_OR_RETURN(hpt.update(cleanup, hpt_cursor, target_mapping));
+
+            if (target_mapping.present() and hpt.promote(cleanup, target_mapping.vaddr)) {
+                hpt_cursor.reset();
+            }
         }
 
         assert(clamped.size() >= target_mapping.size());
         snd_cur = clamped.vaddr + target_mapping.size();
+
+        return Ok_void({});
+    }};
+
+    // Transfer the region from snd_cur to end, where the source has nothing mapped. This removes the
+    // mappings at the destination.
+    auto const transfer_unmapped{[&](mword end) -> Delegate_result_void {
+        while (snd_cur < end) {
+            auto const order{static_cast<Hpt::ord_t>(max_order(snd_cur, end - snd_cur))};
+
+            TRY_OR_RETURN(transfer({snd_cur, 0, 0, order}));
+        }
+
+        return Ok_void({});
+    }};
+
+    // Revocations remove everything and don't need to look at the source mappings.
+    if (not(hw_attr & Hpt::PTE_P)) {
+        return transfer_unmapped(snd_end);
     }
 
-    return Ok_void({});
+    Optional<Delegate_error> error;
+
+    snd->hpt.for_each_mapping(snd_base, snd_end - snd_base, [&](Hpt::Mapping const& mapping) {
+        auto const result{transfer_unmapped(mapping.vaddr).and_then([&](auto) { return transfer(mapping); })};
+
+        if (result.is_err()) {
+            error = result.unwrap_err();
+            return false;
+        }
+
+        return true;
+    });
+
+    if (error.has_value()) {
+        return Err(*error);
+    }
+
+    return transfer_unmapped(snd_end);
 }
 
 void Space_mem::revoke(Tlb_cleanup& cleanup, mword vaddr, mword ord, mword attr)
@@ -140,15 +270,85 @@ void Space_mem::revoke(Tlb_cleanup& cleanup, mword vaddr, mword ord, mword attr)
         .unwrap("Failed to revoke memory");
 }
 
+void Space_mem::harvest(mword gpa, mword pages, bool dirty, bool clear, mword* bitmap)
+{
+    static constexpr mword BITS{sizeof(mword) * 8};
+
+    mword const end{gpa + pages * PAGE_SIZE};
+    bool cleared{false};
+
+    auto const collect{[&](mword base, Ept::ord_t order) {
+        cleared = true;
+
+        for (mword cur{max(base, gpa)}; cur < min(base + (1UL << order), end); cur += PAGE_SIZE) {
+            mword const idx{(cur - gpa) >> PAGE_BITS};
+
+            bitmap[idx / BITS] |= 1UL << (idx % BITS);
+        }
+    }};
+
+    ept.test_and_clear_leaves(gpa, pages * PAGE_SIZE, dirty ? Ept::PTE_D : Ept::PTE_A, collect, clear);
+
+    // The CPU does not set the bits again, as long as it caches the translation with the bits set. All
+    // cleared entries are invalidated with a single shootdown.
+    if (clear and cleared) {
+        stale_guest_tlb.merge(cpus);
+        shootdown();
+    }
+}
+
+void Space_mem::mark_stale_host_tlb(Tlb_range range)
+{
+    cpus.for_each([&](unsigned cpu) {
+        // The range has to be visible before the CPU is marked, because the CPU takes the range after it
+        // cleared its mark.
+        mword& remote_range{remote_ref_tlb_range(cpu)};
+
+        for (mword old{Atomic::load(remote_range)};
+             not Atomic::cmp_swap(remote_range, old, Tlb_range{old}.join(range).raw());
+             old = Atomic::load(remote_range)) {
+        }
+
+        stale_host_tlb.set(cpu);
+    });
+}
+
+void Space_mem::flush_stale_host_tlb()
+{
+    if (not stale_host_tlb.chk(Cpu::id())) {
+        return;
+    }
+
+    stale_host_tlb.clr(Cpu::id());
+
+    // An empty range means that the CPU was marked without knowing which addresses are stale. This happens
+    // when we took the range of an earlier mark that raced with this one.
+    Tlb_range const range{Atomic::exchange(tlb_range(), Tlb_range{}.raw())};
+
+    if (range.empty() or range.is_full()) {
+        Hpt::flush();
+        return;
+    }
+
+    for (mword i = 0; i < range.pages(); i++) {
+        Hpt::flush_one_page(reinterpret_cast<void*>(range.start() + i * PAGE_SIZE));
+    }
+}
+
 void Space_mem::shootdown()
 {
-    Bitmap<uint32, NUM_CPU> stale_cpus{false};
+    Cpuset stale_cpus;
+    Cpuset flush_cpus;
 
-    // Collect all the TLB shootdown counters and send NMIs. These counters are increased by each CPU when it
-    // receives the IPI. See Ec::do_early_nmi_work for more details.
-    for (unsigned cpu = 0; cpu < NUM_CPU; cpu++) {
+    // Other CPUs can only have stale TLB entries of this memory space, if they are marked. We take a snapshot
+    // of these CPUs, because concurrent changes to the page tables do their own shootdown.
+    stale_cpus.merge(stale_host_tlb);
+    stale_cpus.merge(stale_guest_tlb);
+
+    // Mark all CPUs that need to flush their TLB with HZD_TLB.
+    stale_cpus.for_each([this, &flush_cpus](unsigned cpu) {
         if (!Hip::cpu_online(cpu)) {
-            continue;
+            return;
         }
 
         // We check whatever PD is currently running on the remote CPU. This may be another PD than what we
@@ -158,52 +358,74 @@ void Space_mem::shootdown()
         // invalidate its TLB lazily when it is activated via Pd::make_current.
         Pd* pd = Pd::remote(cpu);
 
+        // An isolated CPU that executes a guest doesn't get an NMI unless it may use our stale entries, i.e.
+        // it runs our PD or a guest of ours ran on it. Everything else waits for Pd::make_current.
+        if (Cpu::remote_load_isolated_guest(cpu) and static_cast<Space_mem*>(pd) != this and
+            not stale_guest_tlb.chk(cpu)) {
+            Sched_stats::count(&Sched_stats::isolated_nmi_skip_cnt);
+            return;
+        }
+
         // We still send a shootdown NMI, if this PD that we find has stale TLBs on the given CPU. This
         // happens regardless of whether this is the intended PD. This is a left-over from the past, where
         // revoke could recursively unmap memory from multiple PDs.
-        if (!pd->stale_host_tlb.chk(cpu) && !pd->stale_guest_tlb.chk(cpu))
-            continue;
+        //
+        // vCPUs that use our EPT as an additional view invalidate it before their next VM entry, but they
+        // run in another PD.
+        bool const stale_view{ept_view_cpus.chk(cpu) and stale_guest_tlb.chk(cpu)};
+
+        if (!stale_view && !pd->stale_host_tlb.chk(cpu) && !pd->stale_guest_tlb.chk(cpu))
+            return;
+
+        Atomic::set_mask(Cpu::hazard(cpu), HZD_TLB);
 
         // There is a special case for the current CPU. We don't need to send an IPI, because before user code
         // executes again, it will check its hazards and do the TLB flush then.
-        if (Cpu::id() == cpu) {
-            Atomic::set_mask(Cpu::hazard(), HZD_TLB);
-            continue;
+        if (Cpu::id() != cpu) {
+            flush_cpus.set(cpu);
         }
+    });
+
+    // Each CPU acknowledges the newest shootdown generation it has seen when it receives an NMI. See
+    // Ec::do_early_nmi_work. Our generation starts only after we have set HZD_TLB. A CPU that acknowledges
+    // it thus either still has HZD_TLB set or has flushed its TLB after we set it.
+    mword const gen{Counter::next_tlb_gen()};
 
-        // If the remote core already has HZD_TLB set, it will invalidate the TLB before returning to user
-        // space anyways and we do not have to send another NMI.
-        if ((Atomic::load(Cpu::hazard(cpu)) & HZD_TLB) != 0) {
-            continue;
+    // Concurrent shootdowns piggy-back on each other: We don't need to send an NMI to a CPU that has already
+    // acknowledged our generation or that another CPU sends an NMI to for our or a later generation.
+    Cpuset nmi_cpus;
+
+    flush_cpus.for_each([gen, &nmi_cpus](unsigned cpu) {
+        if (Counter::remote_load_tlb_ack_gen(cpu) >= gen or not Counter::claim_tlb_nmi(cpu, gen)) {
+            return;
         }
 
-        // Take a snapshot of the shootdown NMI counter from the remote CPU and remember that we have to wait
-        // for this CPU to receive it. See the comment at the while loop below.
-        tlb_shootdown()[cpu] = Counter::remote_tlb_shootdown(cpu);
+        nmi_cpus.set(cpu);
 
-        // Set HZD_TLB on the remote core and send an NMI.
-        Atomic::set_mask(Cpu::hazard(cpu), HZD_TLB);
-        stale_cpus[cpu] = Lapic::send_nmi(cpu);
-    }
+        Sched_stats::count(&Sched_stats::tlb_shootdown_cnt);
+    });
 
-    // Wait for NMIs to arrive.
-    for (unsigned cpu = 0; cpu < NUM_CPU; cpu++) {
-        // Only CPUs to which we sent an NMI are interesting.
-        if (!stale_cpus[cpu]) {
-            continue;
-        }
+    Lapic::send_nmi(nmi_cpus);
+
+    // Wait for the CPUs to acknowledge our generation. We don't wait for CPUs that might not receive NMIs.
+    // They promise to look at their hazards before returning to user space.
+    uint64 const wait_start{rdtsc()};
+    bool waited{false};
 
-        // Once the remote CPU has received the NMI, we will break out of this loop. It doesn't matter whether
-        // the remote CPU receives the NMI we sent or whether another CPU is doing a shootdown as well and its
-        // NMI arrived first. We only need the other CPU to go through Ec::do_early_nmi_work.
-        while (Counter::remote_tlb_shootdown(cpu) == tlb_shootdown()[cpu] and
-               not Cpu::remote_load_might_lose_nmis(cpu)) {
+    flush_cpus.for_each([gen, &waited](unsigned cpu) {
+        while (Counter::remote_load_tlb_ack_gen(cpu) < gen and not Cpu::remote_load_might_lose_nmis(cpu)) {
+            waited = true;
             relax();
         }
+    });
+
+    if (waited) {
+        Sched_stats::count(&Sched_stats::shootdown_wait_tsc, rdtsc() - wait_start);
     }
 }
 
-static void map_typed_range(Hpt& hpt, Paddr start, Paddr end, Hpt::pte_t attr, unsigned t)
+static void map_typed_range(Hpt& hpt, Tlb_cleanup& cleanup, Hpt::Update_cursor& cursor, Paddr start,
+                            Paddr end, Hpt::pte_t attr, unsigned t)
 {
     assert((t & ~Hpt::MT_MASK) == 0);
     assert((attr & Hpt::PTE_MT_MASK) == 0);
@@ -217,7 +439,8 @@ static void map_typed_range(Hpt& hpt, Paddr start, Paddr end, Hpt::pte_t attr, u
 
         size = static_cast<Paddr>(1) << order;
 
-        hpt.update({cur, cur, combined_attr, order}).ignore_tlb_flush();
+        hpt.update(cleanup, cursor, {cur, cur, combined_attr, order})
+            .unwrap("Failed to allocate memory for the kernel memory map");
     }
 }
 
@@ -228,13 +451,20 @@ void Space_mem::insert_root(uint64 start, uint64 end, mword attr)
     start <<= PAGE_BITS;
     end <<= PAGE_BITS;
 
+    // The kernel PD is still being set up, so no TLB flush is needed. Consecutive updates mostly modify the
+    // same page table and share the walk.
+    Tlb_cleanup cleanup;
+    Hpt::Update_cursor cursor;
+
     for (Paddr cur{start}; cur < end;) {
         uint64 next;
-        unsigned t = Mtrr_state::get().memtype(cur, next);
+        unsigned t = Mtrr_state::get().memtype_range(cur, end, next);
 
-        map_typed_range(hpt, cur, min<uint64>(next, end), Hpt::hw_attr(attr), t);
+        map_typed_range(hpt, cleanup, cursor, cur, min<uint64>(next, end), Hpt::hw_attr(attr), t);
         cur = next;
     }
+
+    cleanup.ignore_tlb_flush();
 }
 
 void Space_mem::claim(mword virt, unsigned o, mword attr, Paddr phys, bool exclusive)
@@ -52,6 +52,25 @@ Tlb_cleanup Space_obj::update(mword idx, Capability cap)
     return Tlb_cleanup{shootdown};
 }
 
+Capability& Space_obj::slot(mword idx)
+{
+    // A fresh capability page may replace PAGE_0. Stale TLB entries for PAGE_0 only make other CPUs see the
+    // slot as empty a little longer, just as in update.
+    bool shootdown = false;
+    return *static_cast<Capability*>(Buddy::phys_to_ptr(walk(idx, shootdown)));
+}
+
+bool Space_obj::reserve(mword idx)
+{
+    return Capability::cmp_swap(slot(idx), Capability(), Capability::reserved());
+}
+
+void Space_obj::unreserve(mword idx)
+{
+    // A delegation that won the race for the tree may have already put its capability into the slot.
+    Capability::cmp_swap(slot(idx), Capability::reserved(), Capability());
+}
+
 size_t Space_obj::lookup(mword idx, Capability& cap)
 {
     Paddr phys;
@@ -73,11 +92,22 @@ Tlb_cleanup Space_obj::update(Mdb* mdb, mword r)
 
 bool Space_obj::insert_root(Kobject* obj)
 {
-    if (!obj->space->tree_insert(obj))
+    if (obj->space == static_cast<Space_obj*>(&Pd::kern))
+        return obj->space->tree_insert(obj);
+
+    Space_obj* const space = static_cast<Space_obj*>(obj->space);
+
+    if (!space->reserve(obj->node_base))
         return false;
 
-    if (obj->space != static_cast<Space_obj*>(&Pd::kern))
-        static_cast<Space_obj*>(obj->space)->update(obj->node_base, Capability(obj, obj->node_attr));
+    // Delegations and revocations look up the derivation tree under its lock, so the insertion cannot avoid
+    // it.
+    if (!obj->space->tree_insert(obj)) {
+        space->unreserve(obj->node_base);
+        return false;
+    }
+
+    space->update(obj->node_base, Capability(obj, obj->node_attr));
 
     return true;
 }
@@ -20,14 +20,22 @@
 
 #include "assert.hpp"
 #include "lock_guard.hpp"
+#include "math.hpp"
 #include "pd.hpp"
 
+Paddr Space_pio::deny_all_gbmp;
+
 Space_pio::Space_pio(Space_mem* mem)
 {
     assert(mem);
 
+    // The first Port I/O space belongs to Pd::kern, which is created while only the boot CPU runs.
+    if (not deny_all_gbmp) {
+        deny_all_gbmp = Buddy::ptr_to_phys(Buddy::allocator.alloc(1, Buddy::FILL_1));
+    }
+
     hbmp = Buddy::ptr_to_phys(Buddy::allocator.alloc(1, Buddy::FILL_1));
-    gbmp = Buddy::ptr_to_phys(Buddy::allocator.alloc(1, Buddy::FILL_1));
+    gbmp = deny_all_gbmp;
 
     // This mapping of the IO Permission Bitmap is only used by the CPU to do access control. Map it
     // read-only.
@@ -36,23 +44,61 @@ Space_pio::Space_pio(Space_mem* mem)
 
 Space_pio::~Space_pio()
 {
-    Buddy::allocator.free(reinterpret_cast<mword>(Buddy::phys_to_ptr(gbmp)));
+    if (gbmp != deny_all_gbmp) {
+        Buddy::allocator.free(reinterpret_cast<mword>(Buddy::phys_to_ptr(gbmp)));
+    }
+
     Buddy::allocator.free(reinterpret_cast<mword>(Buddy::phys_to_ptr(hbmp)));
 }
 
+Paddr Space_pio::own_gbmp()
+{
+    Paddr const cur{Atomic::load(gbmp)};
+
+    if (cur != deny_all_gbmp) {
+        return cur;
+    }
+
+    // The shared bitmap never changes, so a filled bitmap is an exact copy of it.
+    Paddr const copy{Buddy::ptr_to_phys(Buddy::allocator.alloc(1, Buddy::FILL_1))};
+
+    // Delegations into the same PD can race us here. Only one copy must win.
+    if (not Atomic::cmp_swap(gbmp, cur, copy)) {
+        Buddy::allocator.free(reinterpret_cast<mword>(Buddy::phys_to_ptr(copy)));
+    }
+
+    return Atomic::load(gbmp);
+}
+
 Paddr Space_pio::walk(bool host, mword idx)
 {
-    return (host ? hbmp : gbmp) | (idx_to_virt(idx) & (2 * PAGE_SIZE - 1));
+    // Callers use the address of the guest bitmap for as long as the PD exists, so it must not change later.
+    return (host ? hbmp : own_gbmp()) | (idx_to_virt(idx) & (2 * PAGE_SIZE - 1));
 }
 
-void Space_pio::update(bool host, mword idx, mword attr)
+void Space_pio::update(bool host, mword idx, mword cnt, mword attr)
 {
-    mword* m = static_cast<mword*>(Buddy::phys_to_ptr(walk(host, idx)));
+    // Denying access in the shared bitmap changes nothing.
+    if (not host and not attr and Atomic::load(gbmp) == deny_all_gbmp) {
+        return;
+    }
 
-    if (attr)
-        Atomic::clr_mask(*m, idx_to_mask(idx));
-    else
-        Atomic::set_mask(*m, idx_to_mask(idx));
+    mword* const bmp{static_cast<mword*>(Buddy::phys_to_ptr(host ? hbmp : own_gbmp()))};
+
+    for (mword const end{idx + cnt}; idx < end;) {
+        mword const bit{idx % BITS_PER_WORD};
+        mword const n{min(end - idx, BITS_PER_WORD - bit)};
+        mword const mask{n == BITS_PER_WORD ? ~0UL : ((1UL << n) - 1) << bit};
+        mword& m{bmp[idx / BITS_PER_WORD]};
+
+        if (attr) {
+            Atomic::clr_mask(m, mask);
+        } else {
+            Atomic::set_mask(m, mask);
+        }
+
+        idx += n;
+    }
 }
 
 Tlb_cleanup Space_pio::update(Mdb* mdb, mword r)
@@ -61,14 +107,12 @@ Tlb_cleanup Space_pio::update(Mdb* mdb, mword r)
 
     Lock_guard<Spinlock> guard(mdb->node_lock);
 
-    for (unsigned long i = 0; i < (1UL << mdb->node_order); i++) {
-        if (mdb->node_sub & SUBSPACE_HOST) {
-            update(true, mdb->node_base + i, mdb->node_attr & ~r);
-        }
+    if (mdb->node_sub & SUBSPACE_HOST) {
+        update(true, mdb->node_base, 1UL << mdb->node_order, mdb->node_attr & ~r);
+    }
 
-        if (mdb->node_sub & SUBSPACE_GUEST) {
-            update(false, mdb->node_base + i, mdb->node_attr & ~r);
-        }
+    if (mdb->node_sub & SUBSPACE_GUEST) {
+        update(false, mdb->node_base, 1UL << mdb->node_order, mdb->node_attr & ~r);
     }
 
     return {};
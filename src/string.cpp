@@ -22,9 +22,26 @@
 // USED attributes are important to prevent linker failures when link-time
 // optimization is enabled.
 
-USED void* memcpy(void* d, void const* s, size_t n) { return impl_memcpy(d, s, n); }
+namespace
+{
+
+// Until the boot CPU has checked its features, we use the variants that are fast on any CPU.
+bool fast_strings;
+
+} // namespace
+
+void set_fast_strings(bool on) { fast_strings = on; }
+
+USED void* memcpy(void* d, void const* s, size_t n)
+{
+    return EXPECT_TRUE(fast_strings) ? impl_memcpy(d, s, n) : impl_memcpy_words(d, s, n);
+}
+
 USED void* memmove(void* d, void const* s, size_t n) { return impl_memmove(d, s, n); }
 
-USED void* memset(void* d, int c, size_t n) { return impl_memset(d, c, n); }
+USED void* memset(void* d, int c, size_t n)
+{
+    return EXPECT_TRUE(fast_strings) ? impl_memset(d, c, n) : impl_memset_words(d, c, n);
+}
 
 bool strnmatch(char const* s1, char const* s2, size_t n) { return impl_strnmatch(s1, s2, n); }
@@ -20,6 +20,7 @@
 #include "acpi_facs.hpp"
 #include "atomic.hpp"
 #include "ec.hpp"
+#include "extern.hpp"
 #include "hip.hpp"
 #include "hpt.hpp"
 #include "lapic.hpp"
@@ -68,10 +69,29 @@ void Suspend::suspend(uint8 slp_typa, uint8 slp_typb)
     // Not reached.
 }
 
+void Suspend::kexec(mword entry, mword mbi)
+{
+    if (Atomic::exchange(Suspend::in_progress, true)) {
+        return;
+    }
+
+    // The new kernel starts with the same processor state as after
+    // suspend: All other CPUs wait for INIT and we run on the boot page
+    // table, which identity maps the trampoline.
+    Lapic::park_all_but_self(prepare_cpu_for_suspend);
+
+    mword const trampoline{reinterpret_cast<mword>(__kexec) + PHYS_RELOCATION};
+
+    asm volatile("jmp *%0" ::"r"(trampoline), "D"(entry), "S"(mbi));
+    __builtin_unreachable();
+}
+
 void Suspend::prepare_cpu_for_suspend()
 {
     // Manually context-switch to the idle EC to trigger both FPU state saving
-    // and switching to the boot page table.
+    // and switching to the boot page table. A lazily switched FPU state has
+    // to be saved explicitly.
+    Ec::flush_fpu();
     Ec::idle_ec()->make_current();
 
     if (Hip::feature() & Hip::FEAT_VMX) {
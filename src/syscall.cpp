@@ -25,13 +25,24 @@
 
 #include "syscall.hpp"
 #include "acpi.hpp"
+#include "buddy.hpp"
+#include "console_log.hpp"
 #include "cpu.hpp"
+#include "cpu_load.hpp"
+#include "event_trace.hpp"
 #include "hip.hpp"
+#include "hwp.hpp"
 #include "kp.hpp"
 #include "lapic.hpp"
+#include "lock_stat.hpp"
+#include "microcode.hpp"
 #include "msr.hpp"
 #include "pci.hpp"
+#include "pmu.hpp"
 #include "pt.hpp"
+#include "rdt.hpp"
+#include "sched_stats.hpp"
+#include "slab.hpp"
 #include "sm.hpp"
 #include "stdio.hpp"
 #include "suspend.hpp"
@@ -48,6 +59,10 @@ void Ec::sys_finish(Sys_regs::Status status)
 
     current()->regs.set_status(status);
 
+    if (EXPECT_FALSE(current()->batch_cnt)) {
+        sys_batch_next();
+    }
+
     ret_user_sysexit();
 }
 
@@ -90,6 +105,8 @@ template <void (*C)()> void Ec::send_msg()
 {
     Exc_regs* r = &current()->regs;
 
+    // Event portals are not cached per EC. See Space_obj::lookup for why. vCPUs don't use event portals at
+    // all, their exits return from vcpu_ctrl_run.
     Pt* pt = capability_cast<Pt>(Space_obj::lookup(current()->evt + r->dst_portal));
 
     if (EXPECT_FALSE(not pt)) {
@@ -98,8 +115,11 @@ template <void (*C)()> void Ec::send_msg()
 
     Ec* ec = pt->ec;
 
-    if (EXPECT_FALSE(current()->cpu != ec->xcpu))
+    if (EXPECT_FALSE(current()->cpu != ec->xcpu)) {
+        // A migrated EC goes back to the CPU of its event portal.
+        follow(ec->xcpu, send_msg<C>);
         die("PT wrong CPU");
+    }
 
     if (EXPECT_TRUE(!ec->cont)) {
         current()->cont = C;
@@ -127,13 +147,23 @@ void Ec::sys_call()
 
     Ec* ec = pt->ec;
 
-    if (EXPECT_FALSE(current()->cpu != ec->xcpu))
+    if (EXPECT_FALSE(current()->cpu != ec->xcpu)) {
+        follow(ec->xcpu, sys_call);
         sys_finish<Sys_regs::BAD_CPU>();
+    }
 
     if (EXPECT_TRUE(!ec->cont)) {
         current()->cont = ret_user_sysexit;
         current()->set_partner(ec);
-        ec->cont = recv_user;
+
+        // A register-only message bypasses the UTCB copy and the item transfer in recv_user.
+        if (s->register_msg()) {
+            ec->regs.copy_msg_regs(current()->regs, s->msg_words());
+            ec->cont = ret_user_sysexit;
+        } else {
+            ec->cont = recv_user;
+        }
+
         ec->regs.set_pt(pt->id);
         ec->regs.set_ip(pt->ip);
         ec->return_to_user();
@@ -176,6 +206,10 @@ void Ec::reply(void (*c)(), Sm* sm)
 {
     current()->cont = c;
 
+    // SCs that gave up helping this EC wait for the reply to retry their call. See Ec::help.
+    if (EXPECT_FALSE(current()->Queue<Sc>::head()))
+        current()->release(nullptr);
+
     if (EXPECT_FALSE(current()->glb))
         Sc::schedule(true);
 
@@ -213,6 +247,17 @@ void Ec::sys_reply()
             }
         }
 
+        if (r->register_msg() and ec->cont == ret_user_sysexit) {
+            ec->regs.copy_msg_regs(current()->regs, r->msg_words());
+            reply(nullptr, sm);
+        }
+
+        // The reply to a VMCALL always consists of the message registers. See Ec::call_vmcall_portal.
+        if (EXPECT_FALSE(ec->cont == ret_vmcall)) {
+            ec->vcpu->set_vmcall_reply(current()->regs);
+            reply(nullptr, sm);
+        }
+
         Utcb* src = current()->utcb.get();
 
         if (EXPECT_FALSE(src->tcnt()))
@@ -246,8 +291,16 @@ void Ec::sys_create_pd()
         sys_finish<Sys_regs::BAD_CAP>();
     }
 
-    Pd* pd = new Pd(Pd::current(), r->sel(), parent_pd_cap.prm(),
-                    (r->is_passthrough() and parent_pd->is_passthrough) ? Pd::IS_PASSTHROUGH : 0);
+    if (EXPECT_FALSE(r->large_guest_space() and not(Hip::feature() & Hip::FEAT_EPT_5_LEVEL))) {
+        trace(TRACE_ERROR, "%s: No 5-level EPT", __func__);
+        sys_finish<Sys_regs::BAD_FTR>();
+    }
+
+    int const creation_flags{((r->is_passthrough() and parent_pd->is_passthrough) ? Pd::IS_PASSTHROUGH : 0) |
+                             (r->new_security_domain() ? Pd::NEW_SECURITY_DOMAIN : 0) |
+                             (r->large_guest_space() ? Pd::LARGE_GUEST_SPACE : 0)};
+
+    Pd* pd = new Pd(Pd::current(), r->sel(), parent_pd_cap.prm(), creation_flags, parent_pd->domain);
     if (!Space_obj::insert_root(pd)) {
         trace(TRACE_ERROR, "%s: Non-NULL CAP (%#lx)", __func__, r->sel());
         delete pd;
@@ -310,8 +363,8 @@ void Ec::sys_create_sc()
 {
     Sys_create_sc* r = static_cast<Sys_create_sc*>(current()->sys_regs());
 
-    trace(TRACE_SYSCALL, "EC:%p SYS_CREATE SC:%#lx EC:%#lx P:%#x Q:%#x", current(), r->sel(), r->ec(),
-          r->qpd().prio(), r->qpd().quantum());
+    trace(TRACE_SYSCALL, "EC:%p SYS_CREATE SC:%#lx EC:%#lx P:%#x", current(), r->sel(), r->ec(),
+          r->qpd().prio());
     if (Pd* pd_parent = capability_cast<Pd>(Space_obj::lookup(r->pd()), Pd::PERM_OBJ_CREATION);
         EXPECT_FALSE(not pd_parent)) {
         trace(TRACE_ERROR, "%s: Non-PD CAP (%#lx)", __func__, r->pd());
@@ -330,12 +383,32 @@ void Ec::sys_create_sc()
         sys_finish<Sys_regs::BAD_CAP>();
     }
 
-    if (EXPECT_FALSE(!r->qpd().prio() || !r->qpd().quantum() || (r->qpd().prio() >= NUM_PRIORITIES))) {
+    if (EXPECT_FALSE(!r->qpd().prio() || (r->qpd().prio() >= NUM_PRIORITIES))) {
         trace(TRACE_ERROR, "%s: Invalid QPD", __func__);
         sys_finish<Sys_regs::BAD_PAR>();
     }
 
-    Sc* sc = new Sc(Pd::current(), r->sel(), ec, ec->cpu, r->qpd().prio());
+    // The budget of a reservation only applies to the CPU it was granted on.
+    if (EXPECT_FALSE(r->is_reservation() and (!r->budget_us() or r->budget_us() > r->period_us() or
+                                              r->is_migratable()))) {
+        trace(TRACE_ERROR, "%s: Invalid reservation (B:%#x T:%#x)", __func__, r->budget_us(), r->period_us());
+        sys_finish<Sys_regs::BAD_PAR>();
+    }
+
+    if (EXPECT_FALSE(!ec->bind_sc(r->is_migratable()))) {
+        trace(TRACE_ERROR, "%s: Conflicting SC binding", __func__);
+        sys_finish<Sys_regs::BAD_CAP>();
+    }
+
+    uint64 budget{0}, period{0};
+
+    if (r->is_reservation()) {
+        budget = static_cast<uint64>(r->budget_us()) * Lapic::freq_tsc / 1000;
+        period = static_cast<uint64>(r->period_us()) * Lapic::freq_tsc / 1000;
+    }
+
+    Sc* sc = new Sc(Pd::current(), r->sel(), ec, ec->cpu, r->qpd().prio(), r->is_migratable(), budget,
+                    period);
     if (!Space_obj::insert_root(sc)) {
         trace(TRACE_ERROR, "%s: Non-NULL CAP (%#lx)", __func__, r->sel());
         delete sc;
@@ -393,7 +466,44 @@ void Ec::sys_create_sm()
         sys_finish<Sys_regs::BAD_CAP>();
     }
 
-    Sm* sm = new Sm(Pd::current(), r->sel(), r->cnt());
+    Sm* notification{nullptr};
+
+    if (r->is_bound()) {
+        notification = capability_cast<Sm>(Space_obj::lookup(r->notification()), Sm::PERM_UP);
+
+        if (EXPECT_FALSE(not notification or not notification->is_notification())) {
+            trace(TRACE_ERROR, "%s: Bad notification CAP (%#lx)", __func__, r->notification());
+            sys_finish<Sys_regs::BAD_CAP>();
+        }
+
+        if (EXPECT_FALSE(r->is_notification() or not(r->signals() & Sm::NOTIFY_SIGNALS))) {
+            trace(TRACE_ERROR, "%s: Invalid notification binding", __func__);
+            sys_finish<Sys_regs::BAD_PAR>();
+        }
+    }
+
+    Vcpu* vcpu{nullptr};
+
+    if (r->is_vcpu_bound()) {
+        vcpu = capability_cast<Vcpu>(Space_obj::lookup(r->vcpu()));
+
+        if (EXPECT_FALSE(not vcpu)) {
+            trace(TRACE_ERROR, "%s: Bad vCPU CAP (%#lx)", __func__, r->vcpu());
+            sys_finish<Sys_regs::BAD_CAP>();
+        }
+
+        // The vectors of exceptions cannot be delivered as interrupts. See sys_vcpu_ctrl_post_intr.
+        if (EXPECT_FALSE(r->is_notification() or r->is_bound() or r->vector() < NUM_EXC or
+                         r->vector() >= NUM_INT_VECTORS)) {
+            trace(TRACE_ERROR, "%s: Invalid vCPU binding", __func__);
+            sys_finish<Sys_regs::BAD_PAR>();
+        }
+    }
+
+    Sm* sm = vcpu ? new Sm(Pd::current(), r->sel(), r->cnt(), false, nullptr, 0, vcpu,
+                           static_cast<unsigned>(r->vector()))
+                  : new Sm(Pd::current(), r->sel(), r->cnt(), r->is_notification(), notification,
+                           r->signals());
 
     if (!Space_obj::insert_root(sm)) {
         trace(TRACE_ERROR, "%s: Non-NULL CAP (%#lx)", __func__, r->sel());
@@ -408,7 +518,9 @@ void Ec::sys_create_kp()
 {
     Sys_create_kp* r = static_cast<Sys_create_kp*>(current()->sys_regs());
 
-    trace(TRACE_SYSCALL, "EC:%p SYS_CREATE KP:%#lx", current(), r->sel());
+    trace(TRACE_SYSCALL, "EC:%p SYS_CREATE KP:%#lx%s%s%s%s", current(), r->sel(),
+          r->is_sched_stats() ? " STATS" : "", r->is_event_trace() ? " TRACE" : "",
+          r->is_lock_stat() ? " LOCKS" : "", r->is_console_log() ? " LOG" : "");
 
     if (Pd* pd_parent = capability_cast<Pd>(Space_obj::lookup(r->pd()), Pd::PERM_OBJ_CREATION);
         EXPECT_FALSE(not pd_parent)) {
@@ -416,7 +528,86 @@ void Ec::sys_create_kp()
         sys_finish<Sys_regs::BAD_CAP>();
     }
 
-    Kp* kp{new Kp(Pd::current(), r->sel())};
+    int const kinds{r->is_sched_stats() + r->is_event_trace() + r->is_lock_stat() + r->is_console_log()};
+
+    if (EXPECT_FALSE(kinds > 1)) {
+        trace(TRACE_ERROR, "%s: Conflicting KP flags", __func__);
+        sys_finish<Sys_regs::BAD_PAR>();
+    }
+
+    bool const per_cpu{(r->is_sched_stats() and not r->is_cpu_load()) or r->is_event_trace() or
+                       r->is_console_log()};
+
+    if (EXPECT_FALSE(per_cpu and not Hip::cpu_online(r->cpu()))) {
+        trace(TRACE_ERROR, "%s: Invalid CPU (%#x)", __func__, r->cpu());
+        sys_finish<Sys_regs::BAD_CPU>();
+    }
+
+    if (EXPECT_FALSE(r->is_event_trace() and not Event_trace::enabled())) {
+        trace(TRACE_ERROR, "%s: Event trace is not available", __func__);
+        sys_finish<Sys_regs::BAD_FTR>();
+    }
+
+    // The logs hold kernel addresses and the messages about other PDs.
+    if (EXPECT_FALSE(r->is_console_log() and not Pd::current()->is_passthrough)) {
+        trace(TRACE_ERROR, "%s: PD without passthrough permission created a log KP", __func__);
+        sys_finish<Sys_regs::BAD_CAP>();
+    }
+
+    if (EXPECT_FALSE(r->is_lock_stat() and not Lock_stat::enabled())) {
+        trace(TRACE_ERROR, "%s: Lock statistics are not available", __func__);
+        sys_finish<Sys_regs::BAD_FTR>();
+    }
+
+    Kp* kp;
+
+    if (r->is_cpu_load()) {
+        uint64* const table{Cpu_load::get_table()};
+
+        if (EXPECT_FALSE(not table)) {
+            sys_finish<Sys_regs::OOM>();
+        }
+
+        kp = new Kp(Pd::current(), r->sel(), table);
+    } else if (r->is_sched_stats()) {
+        kp = new Kp(Pd::current(), r->sel(), Sc::remote_load_stats(r->cpu()));
+    } else if (r->is_event_trace()) {
+        Event_trace_entry* const ring{Event_trace::get_ring(r->cpu())};
+
+        if (EXPECT_FALSE(not ring)) {
+            sys_finish<Sys_regs::OOM>();
+        }
+
+        kp = new Kp(Pd::current(), r->sel(), ring);
+    } else if (r->is_lock_stat()) {
+        Lock_stat_entry* const table{Lock_stat::get_table()};
+
+        if (EXPECT_FALSE(not table)) {
+            sys_finish<Sys_regs::OOM>();
+        }
+
+        kp = new Kp(Pd::current(), r->sel(), table);
+    } else if (r->is_console_log()) {
+        Console_log_ring* const ring{Console_log::get_ring(r->cpu())};
+
+        if (EXPECT_FALSE(not ring)) {
+            sys_finish<Sys_regs::OOM>();
+        }
+
+        kp = new Kp(Pd::current(), r->sel(), ring);
+    } else {
+        if (EXPECT_FALSE(r->order() > Kp::MAX_ORDER)) {
+            trace(TRACE_ERROR, "%s: Invalid order (%#lx)", __func__, r->order());
+            sys_finish<Sys_regs::BAD_PAR>();
+        }
+
+        kp = new Kp(Pd::current(), r->sel(), static_cast<unsigned>(r->order()));
+
+        if (EXPECT_FALSE(not kp->data_page())) {
+            delete kp;
+            sys_finish<Sys_regs::OOM>();
+        }
+    }
 
     if (!Space_obj::insert_root(kp)) {
         trace(TRACE_ERROR, "%s: Non-NULL CAP (%#lx)", __func__, r->sel());
@@ -483,6 +674,11 @@ void Ec::sys_revoke()
 
     trace(TRACE_SYSCALL, "EC:%p SYS_REVOKE", current());
 
+    if (EXPECT_FALSE(r->is_vectored() and r->num_entries() > Utcb::words)) {
+        trace(TRACE_ERROR, "%s: Too many entries (%lu)", __func__, r->num_entries());
+        sys_finish<Sys_regs::BAD_PAR>();
+    }
+
     Pd* pd = Pd::current();
 
     if (r->remote()) {
@@ -494,11 +690,21 @@ void Ec::sys_revoke()
         }
     }
 
-    pd->rev_crd(r->crd(), r->self());
+    if (r->is_vectored()) {
+        Utcb* const utcb{current()->utcb.get()};
+        pd->rev_crds(r->num_entries(), r->self(), [utcb](mword i) { return Crd{utcb->mr(i)}; });
+    } else {
+        pd->rev_crd(r->crd(), r->self());
+    }
 
     if (r->remote() && pd->del_rcu())
         Rcu::call(pd);
 
+    // Expediting sends an NMI to every CPU. Other PDs wait for a normal grace period, so they cannot disturb
+    // all CPUs with a revoke loop.
+    if (r->expedite() and Pd::current()->is_passthrough)
+        Rcu::expedite();
+
     sys_finish<Sys_regs::SUCCESS>();
 }
 
@@ -508,6 +714,10 @@ void Ec::sys_pd_ctrl_lookup()
 
     trace(TRACE_SYSCALL, "EC:%p SYS_LOOKUP T:%d B:%#lx", current(), s->crd().type(), s->crd().base());
 
+    if (s->is_range()) {
+        sys_pd_ctrl_lookup_range();
+    }
+
     Space* space;
     Mdb* mdb;
     if ((space = Pd::current()->subspace(s->crd().type())) && (mdb = space->tree_lookup(s->crd().base())))
@@ -518,6 +728,33 @@ void Ec::sys_pd_ctrl_lookup()
     sys_finish<Sys_regs::SUCCESS>();
 }
 
+void Ec::sys_pd_ctrl_lookup_range()
+{
+    Sys_pd_ctrl_lookup* s = static_cast<Sys_pd_ctrl_lookup*>(current()->sys_regs());
+    Crd::Type const type{s->crd().type()};
+    Space* const space{Pd::current()->subspace(type)};
+
+    if (EXPECT_FALSE(not space)) {
+        trace(TRACE_ERROR, "%s: Invalid CRD type (%u)", __func__, static_cast<unsigned>(type));
+        sys_finish<Sys_regs::BAD_PAR>();
+    }
+
+    Utcb* const utcb{current()->utcb.get()};
+    mword num{0};
+
+    mword const resume{space->tree_lookup_range(s->crd().base(), s->limit(), [&](Mdb* mdb) {
+        if (num == Utcb::words) {
+            return false;
+        }
+
+        utcb->mr(num++) = Crd(type, mdb->node_base, mdb->node_order, mdb->node_attr).value();
+        return true;
+    })};
+
+    s->set_result(num, resume);
+    sys_finish<Sys_regs::SUCCESS>();
+}
+
 void Ec::sys_pd_ctrl_map_access_page()
 {
     Sys_pd_ctrl_map_access_page* s = static_cast<Sys_pd_ctrl_map_access_page*>(current()->sys_regs());
@@ -540,12 +777,17 @@ void Ec::sys_pd_ctrl_map_access_page()
 
     mword access_addr_phys = Buddy::ptr_to_phys(access_addr);
 
-    auto cleanup{pd->ept.update({crd.base() << PAGE_BITS, access_addr_phys,
-                                 Ept::PTE_R | Ept::PTE_W | Ept::PTE_I | (6 /* WB */ << Ept::PTE_MT_SHIFT),
-                                 PAGE_BITS})};
+    // The scope makes sure that the cleanup is destroyed, because sys_finish does not return.
+    {
+        Space_mem::Mapping_guard guard{*pd, crd.base() << PAGE_BITS, PAGE_SIZE};
 
-    // XXX Check whether TLB needs to be invalidated.
-    cleanup.ignore_tlb_flush();
+        auto cleanup{pd->ept.update({crd.base() << PAGE_BITS, access_addr_phys,
+                                     Ept::PTE_R | Ept::PTE_W | Ept::PTE_I | (6 /* WB */ << Ept::PTE_MT_SHIFT),
+                                     PAGE_BITS})};
+
+        // XXX Check whether TLB needs to be invalidated.
+        cleanup.ignore_tlb_flush();
+    }
 
     sys_finish<Sys_regs::SUCCESS>();
 }
@@ -571,6 +813,11 @@ void Ec::sys_pd_ctrl_delegate()
           xfer.flags());
 
     Pd* src_pd = capability_cast<Pd>(Space_obj::lookup(s->src_pd()));
+
+    if (s->is_broadcast()) {
+        sys_pd_ctrl_delegate_broadcast(src_pd);
+    }
+
     Pd* dst_pd = capability_cast<Pd>(Space_obj::lookup(s->dst_pd()));
 
     if (EXPECT_FALSE(not(src_pd and dst_pd))) {
@@ -578,6 +825,10 @@ void Ec::sys_pd_ctrl_delegate()
         sys_finish<Sys_regs::BAD_CAP>();
     }
 
+    if (s->is_vectored()) {
+        sys_pd_ctrl_delegate_vector(src_pd, dst_pd);
+    }
+
     sys_finish(dst_pd->xfer_item(src_pd, s->dst_crd(), s->dst_crd(), xfer)
                    .map([s](Xfer x) -> monostate {
                        s->set_xfer(x);
@@ -586,6 +837,107 @@ void Ec::sys_pd_ctrl_delegate()
                    .map_err([](Delegate_error e) { return to_syscall_status(e.error_type); }));
 }
 
+void Ec::sys_pd_ctrl_delegate_vector(Pd* src_pd, Pd* dst_pd)
+{
+    Sys_pd_ctrl_delegate* s = static_cast<Sys_pd_ctrl_delegate*>(current()->sys_regs());
+    mword const num{s->num_entries()};
+
+    if (EXPECT_FALSE(num > Utcb::words / Sys_pd_ctrl_delegate::VECTOR_ENTRY_WORDS)) {
+        trace(TRACE_ERROR, "%s: Invalid number of entries (%lu)", __func__, num);
+        sys_finish<Sys_regs::BAD_PAR>();
+    }
+
+    Sys_regs::Status status{Sys_regs::SUCCESS};
+    mword done{0};
+
+    // All entries share one Tlb_cleanup, so there is only a single TLB shootdown at the end. The scope makes
+    // sure that the cleanup frees the page tables it collected, because sys_finish does not return.
+    {
+        Tlb_cleanup cleanup;
+
+        for (; done < num; done++) {
+            mword* entry{&current()->utcb->mr(done * Sys_pd_ctrl_delegate::VECTOR_ENTRY_WORDS)};
+            Crd const dst_crd{entry[2]};
+            auto xfer_result{
+                dst_pd->xfer_item(cleanup, src_pd, dst_crd, dst_crd, Xfer{Crd{entry[0]}, entry[1]})};
+
+            if (EXPECT_FALSE(xfer_result.is_err())) {
+                status = to_syscall_status(xfer_result.unwrap_err().error_type);
+                break;
+            }
+
+            Xfer const x{xfer_result.unwrap()};
+            entry[0] = x.crd().value();
+            entry[1] = x.metadata();
+        }
+
+        dst_pd->finish_delegation(cleanup);
+    }
+
+    s->set_num_done(done);
+    sys_finish(status);
+}
+
+void Ec::sys_pd_ctrl_delegate_broadcast(Pd* src_pd)
+{
+    Sys_pd_ctrl_delegate* s = static_cast<Sys_pd_ctrl_delegate*>(current()->sys_regs());
+    mword const num{s->num_entries()};
+
+    if (EXPECT_FALSE(not src_pd)) {
+        trace(TRACE_ERROR, "%s: Bad PD CAP SRC:%#lx", __func__, s->src_pd());
+        sys_finish<Sys_regs::BAD_CAP>();
+    }
+
+    // Each destination takes one word for its PD and two for its result.
+    if (EXPECT_FALSE(num > (Utcb::words - Sys_pd_ctrl_delegate::VECTOR_ENTRY_WORDS) / 3)) {
+        trace(TRACE_ERROR, "%s: Invalid number of destinations (%lu)", __func__, num);
+        sys_finish<Sys_regs::BAD_PAR>();
+    }
+
+    mword* const entry{&current()->utcb->mr(0)};
+    mword const* const dst_pds{entry + Sys_pd_ctrl_delegate::VECTOR_ENTRY_WORDS};
+    mword* const results{entry + Sys_pd_ctrl_delegate::VECTOR_ENTRY_WORDS + num};
+
+    Crd const dst_crd{entry[2]};
+    Xfer const xfer{Crd{entry[0]}, entry[1]};
+
+    Sys_regs::Status status{Sys_regs::SUCCESS};
+    mword done{0};
+
+    // All destinations share one Tlb_cleanup, so the page tables that the delegations replace go to RCU in a
+    // single batch. Each destination PD still gets its TLB shootdown right away, because shootdowns are per
+    // PD.
+    {
+        Tlb_cleanup cleanup;
+
+        for (; done < num; done++) {
+            Pd* const dst_pd{capability_cast<Pd>(Space_obj::lookup(dst_pds[done]))};
+
+            if (EXPECT_FALSE(not dst_pd)) {
+                trace(TRACE_ERROR, "%s: Bad PD CAP DST:%#lx", __func__, dst_pds[done]);
+                status = Sys_regs::BAD_CAP;
+                break;
+            }
+
+            auto xfer_result{dst_pd->xfer_item(cleanup, src_pd, dst_crd, dst_crd, xfer)};
+
+            dst_pd->finish_delegation(cleanup);
+
+            if (EXPECT_FALSE(xfer_result.is_err())) {
+                status = to_syscall_status(xfer_result.unwrap_err().error_type);
+                break;
+            }
+
+            Xfer const x{xfer_result.unwrap()};
+            results[done * 2] = x.crd().value();
+            results[done * 2 + 1] = x.metadata();
+        }
+    }
+
+    s->set_num_done(done);
+    sys_finish(status);
+}
+
 void Ec::sys_pd_ctrl_msr_access()
 {
     Sys_pd_ctrl_msr_access* s = static_cast<Sys_pd_ctrl_msr_access*>(current()->sys_regs());
@@ -612,6 +964,123 @@ void Ec::sys_pd_ctrl_msr_access()
     }
 }
 
+void Ec::sys_pd_ctrl_msr_access_vector()
+{
+    Sys_pd_ctrl_msr_access_vector* s = static_cast<Sys_pd_ctrl_msr_access_vector*>(current()->sys_regs());
+    mword const num{s->num_entries()};
+
+    if (EXPECT_FALSE(not Pd::current()->is_passthrough)) {
+        trace(TRACE_ERROR, "%s: PD without passthrough permission accessed MSRs", __func__);
+        sys_finish<Sys_regs::BAD_CAP>();
+    }
+
+    if (EXPECT_FALSE(num > Utcb::words / Sys_pd_ctrl_msr_access_vector::VECTOR_ENTRY_WORDS)) {
+        trace(TRACE_ERROR, "%s: Invalid number of entries (%lu)", __func__, num);
+        sys_finish<Sys_regs::BAD_PAR>();
+    }
+
+    mword done{0};
+
+    for (; done < num; done++) {
+        mword* entry{&current()->utcb->mr(done * Sys_pd_ctrl_msr_access_vector::VECTOR_ENTRY_WORDS)};
+        Msr::Register const msr{Msr::Register(static_cast<uint32>(entry[0]))};
+        uint64 value{entry[1]};
+
+        if (entry[0] & Sys_pd_ctrl_msr_access_vector::ENTRY_WRITE ? not Msr::user_write(msr, value)
+                                                                  : not Msr::user_read(msr, value)) {
+            break;
+        }
+
+        entry[1] = value;
+    }
+
+    s->set_num_done(done);
+    sys_finish(done == num ? Sys_regs::SUCCESS : Sys_regs::BAD_PAR);
+}
+
+void Ec::sys_pd_ctrl_kmem()
+{
+    Sys_pd_ctrl_kmem* s = static_cast<Sys_pd_ctrl_kmem*>(current()->sys_regs());
+
+    trace(TRACE_SYSCALL, "EC:%p SYS_PD_CTRL_KMEM PD:%#lx SET:%u LIMIT:%#lx", current(), s->pd(),
+          s->is_set_limit(), s->limit());
+
+    Pd* pd{capability_cast<Pd>(Space_obj::lookup(s->pd()), s->is_set_limit() ? Pd::PERM_KMEM_LIMIT : 0)};
+
+    if (EXPECT_FALSE(not pd)) {
+        trace(TRACE_ERROR, "%s: Bad PD CAP (%#lx)", __func__, s->pd());
+        sys_finish<Sys_regs::BAD_CAP>();
+    }
+
+    if (s->is_set_limit()) {
+        Atomic::store(pd->kmem_limit, s->limit());
+    }
+
+    size_t superpages[2]{};
+    pd->count_guest_superpages(superpages);
+
+    s->set_usage(pd->kmem_pages(), Atomic::load(pd->kmem_limit));
+    s->set_guest_superpages(superpages[0], superpages[1]);
+    sys_finish<Sys_regs::SUCCESS>();
+}
+
+void Ec::sys_pd_ctrl_ept_fill()
+{
+    Sys_pd_ctrl_ept_fill* s = static_cast<Sys_pd_ctrl_ept_fill*>(current()->sys_regs());
+
+    trace(TRACE_SYSCALL, "EC:%p SYS_PD_CTRL_EPT_FILL PD:%#lx GPA:%#lx HVA:%#lx SIZE:%#lx ORD:%lu", current(),
+          s->pd(), s->guest_base(), s->host_base(), s->size(), s->order());
+
+    Pd* pd{capability_cast<Pd>(Space_obj::lookup(s->pd()))};
+
+    if (EXPECT_FALSE(not pd)) {
+        trace(TRACE_ERROR, "%s: Bad PD CAP (%#lx)", __func__, s->pd());
+        sys_finish<Sys_regs::BAD_CAP>();
+    }
+
+    bool const ok{pd->set_ept_fill(s->guest_base(), s->host_base(), s->size(), s->order(), s->attr())};
+
+    if (EXPECT_FALSE(not ok)) {
+        trace(TRACE_ERROR, "%s: Invalid EPT fill window", __func__);
+        sys_finish<Sys_regs::BAD_PAR>();
+    }
+
+    sys_finish<Sys_regs::SUCCESS>();
+}
+
+void Ec::sys_pd_ctrl_teardown_sm()
+{
+    Sys_pd_ctrl_teardown_sm* s = static_cast<Sys_pd_ctrl_teardown_sm*>(current()->sys_regs());
+
+    trace(TRACE_SYSCALL, "EC:%p SYS_PD_CTRL_TEARDOWN_SM PD:%#lx SM:%#lx REMOVE:%u", current(), s->pd(),
+          s->sm(), s->is_remove());
+
+    Pd* pd{capability_cast<Pd>(Space_obj::lookup(s->pd()))};
+
+    if (EXPECT_FALSE(not pd)) {
+        trace(TRACE_ERROR, "%s: Bad PD CAP (%#lx)", __func__, s->pd());
+        sys_finish<Sys_regs::BAD_CAP>();
+    }
+
+    Sm* sm{nullptr};
+
+    if (not s->is_remove()) {
+        sm = capability_cast<Sm>(Space_obj::lookup(s->sm()), Sm::PERM_UP);
+
+        if (EXPECT_FALSE(not sm or sm->is_notification())) {
+            trace(TRACE_ERROR, "%s: Bad SM CAP (%#lx)", __func__, s->sm());
+            sys_finish<Sys_regs::BAD_CAP>();
+        }
+    }
+
+    if (EXPECT_FALSE(not pd->set_teardown_sm(sm))) {
+        trace(TRACE_ERROR, "%s: SM is being destroyed", __func__);
+        sys_finish<Sys_regs::BAD_CAP>();
+    }
+
+    sys_finish<Sys_regs::SUCCESS>();
+}
+
 void Ec::sys_pd_ctrl()
 {
     Sys_pd_ctrl* s = static_cast<Sys_pd_ctrl*>(current()->sys_regs());
@@ -628,6 +1097,18 @@ void Ec::sys_pd_ctrl()
     case Sys_pd_ctrl::MSR_ACCESS: {
         sys_pd_ctrl_msr_access();
     }
+    case Sys_pd_ctrl::KMEM: {
+        sys_pd_ctrl_kmem();
+    }
+    case Sys_pd_ctrl::MSR_ACCESS_VECTOR: {
+        sys_pd_ctrl_msr_access_vector();
+    }
+    case Sys_pd_ctrl::EPT_FILL: {
+        sys_pd_ctrl_ept_fill();
+    }
+    case Sys_pd_ctrl::TEARDOWN_SM: {
+        sys_pd_ctrl_teardown_sm();
+    }
     };
 
     sys_finish<Sys_regs::BAD_PAR>();
@@ -642,6 +1123,8 @@ void Ec::sys_ec_ctrl()
         Ec::current()->cont = Ec::ret_user_sysexit;
         Sc::current()->schedule();
     }
+    case Sys_ec_ctrl::YIELD_TO:
+        sys_ec_ctrl_yield_to();
     default:
         sys_finish<Sys_regs::BAD_PAR>();
     }
@@ -649,6 +1132,39 @@ void Ec::sys_ec_ctrl()
     sys_finish<Sys_regs::SUCCESS>();
 }
 
+void Ec::sys_ec_ctrl_yield_to()
+{
+    Sys_ec_ctrl* r = static_cast<Sys_ec_ctrl*>(current()->sys_regs());
+    Ec* ec = capability_cast<Ec>(Space_obj::lookup(r->ec()), Ec::PERM_EC_CTRL);
+
+    trace(TRACE_SYSCALL, "EC:%p SYS_EC_CTRL YIELD_TO EC:%#lx", current(), r->ec());
+
+    if (EXPECT_FALSE(not ec or not ec->glb)) {
+        trace(TRACE_ERROR, "%s: Bad EC CAP (%#lx)", __func__, r->ec());
+        sys_finish<Sys_regs::BAD_CAP>();
+    }
+
+    if (EXPECT_FALSE(ec->cpu != Cpu::id())) {
+        trace(TRACE_ERROR, "%s: Cross-CPU yield", __func__);
+        sys_finish<Sys_regs::BAD_CPU>();
+    }
+
+    // The EC of a migratable SC could be moved to another CPU while it runs on our SC.
+    if (EXPECT_FALSE(ec->is_migratable())) {
+        trace(TRACE_ERROR, "%s: Cannot yield to EC with migratable SC", __func__);
+        sys_finish<Sys_regs::BAD_CAP>();
+    }
+
+    // Donate the current SC to the EC in the same way a portal call helps a busy EC. The SC comes back to
+    // us when it is scheduled again. If the EC cannot run right now, we fall back to a plain yield.
+    if (ec != current() and not ec->blocked()) {
+        ec->help(sys_finish<Sys_regs::SUCCESS>);
+    }
+
+    current()->cont = sys_finish<Sys_regs::SUCCESS>;
+    Sc::schedule();
+}
+
 void Ec::sys_sc_ctrl()
 {
     Sys_sc_ctrl* r = static_cast<Sys_sc_ctrl*>(current()->sys_regs());
@@ -659,6 +1175,21 @@ void Ec::sys_sc_ctrl()
         sys_finish<Sys_regs::BAD_CAP>();
     }
 
+    if (r->set_hwp_request()) {
+        if (EXPECT_FALSE(not Hwp::supported())) {
+            trace(TRACE_ERROR, "%s: HWP is not supported", __func__);
+            sys_finish<Sys_regs::BAD_FTR>();
+        }
+
+        if (EXPECT_FALSE(not Hwp::valid(r->hwp_request()))) {
+            trace(TRACE_ERROR, "%s: Bad HWP request (%#llx)", __func__, r->hwp_request());
+            sys_finish<Sys_regs::BAD_PAR>();
+        }
+
+        // The SC picks the new request up the next time a CPU switches to it.
+        Atomic::store(sc->hwp_request, r->hwp_request());
+    }
+
     r->set_time((sc->time * 1000) / Lapic::freq_tsc);
 
     sys_finish<Sys_regs::SUCCESS>();
@@ -689,7 +1220,18 @@ void Ec::sys_sm_ctrl()
         sys_finish<Sys_regs::BAD_CAP>();
     }
 
-    if (EXPECT_FALSE(r->time() != 0)) {
+    if (EXPECT_FALSE(sm->is_notification() and r->is_conditional())) {
+        trace(TRACE_ERROR, "%s: Notifications don't support conditional down", __func__);
+        sys_finish<Sys_regs::BAD_PAR>();
+    }
+
+    if (sm->is_notification()) {
+        sys_sm_ctrl_notification(sm);
+    }
+
+    if (r->is_conditional()) {
+        sys_sm_ctrl_check_word();
+    } else if (EXPECT_FALSE(r->time() != 0)) {
         trace(TRACE_ERROR, "%s: Non-zero timeouts are not supported anymore", __func__);
         sys_finish<Sys_regs::BAD_PAR>();
     }
@@ -709,26 +1251,77 @@ void Ec::sys_sm_ctrl()
     sys_finish<Sys_regs::SUCCESS>();
 }
 
-void Ec::sys_kp_ctrl_map()
+void Ec::sys_sm_ctrl_check_word()
 {
-    Sys_kp_ctrl_map* r = static_cast<Sys_kp_ctrl_map*>(current()->sys_regs());
+    Sys_sm_ctrl* r = static_cast<Sys_sm_ctrl*>(current()->sys_regs());
 
-    trace(TRACE_SYSCALL, "EC:%p SYS_KP_CTRL_MAP KP:%#lx DST-PD:%#lx DST-ADDR:%#lx", current, r->kp(),
-          r->dst_pd(), r->dst_addr());
+    if (EXPECT_FALSE(r->op() != Sys_sm_ctrl::Sm_operation::Down)) {
+        trace(TRACE_ERROR, "%s: Only down can be conditional", __func__);
+        sys_finish<Sys_regs::BAD_PAR>();
+    }
+
+    Kp* kp{capability_cast<Kp>(Space_obj::lookup(r->kp()))};
 
-    Kp* kp = capability_cast<Kp>(Space_obj::lookup(r->kp()), Kp::PERM_KP_CTRL);
     if (EXPECT_FALSE(not kp)) {
         trace(TRACE_ERROR, "%s: Bad KP CAP (%#lx)", __func__, r->kp());
         sys_finish<Sys_regs::BAD_CAP>();
     }
 
-    Pd* user_pd = capability_cast<Pd>(Space_obj::lookup(r->dst_pd()));
-    if (EXPECT_FALSE(not user_pd)) {
-        trace(TRACE_ERROR, "%s: Bad PD CAP: %#lx", __func__, r->dst_pd());
-        sys_finish<Sys_regs::BAD_CAP>();
+    if (EXPECT_FALSE(r->offset() % sizeof(uint64) != 0 or r->offset() >= kp->size())) {
+        trace(TRACE_ERROR, "%s: Invalid offset (%#lx)", __func__, r->offset());
+        sys_finish<Sys_regs::BAD_PAR>();
+    }
+
+    // The waker changes the word before its "up". If it did so before this load, we return. Otherwise, its
+    // "up" either wakes us or leaves a count that the "down" below takes.
+    uint64* const word{reinterpret_cast<uint64*>(static_cast<char*>(kp->data_page()) + r->offset())};
+
+    if (Atomic::load(*word) != r->expected()) {
+        sys_finish<Sys_regs::COM_ABT>();
+    }
+}
+
+void Ec::sys_sm_ctrl_notification(Sm* sm)
+{
+    Sys_sm_ctrl* r = static_cast<Sys_sm_ctrl*>(current()->sys_regs());
+
+    switch (r->op()) {
+
+    case Sys_sm_ctrl::Sm_operation::Up:
+        sm->signal(r->signals());
+        break;
+
+    case Sys_sm_ctrl::Sm_operation::Down:
+        // If we block, we are woken up by the next signal and just try again.
+        current()->cont = sys_sm_ctrl;
+        r->set_signals(sm->wait());
+        break;
+    }
+
+    sys_finish<Sys_regs::SUCCESS>();
+}
+
+void Ec::sys_kp_ctrl_map()
+{
+    Sys_kp_ctrl_map* r = static_cast<Sys_kp_ctrl_map*>(current()->sys_regs());
+
+    trace(TRACE_SYSCALL, "EC:%p SYS_KP_CTRL_MAP KP:%#lx DST-PD:%#lx DST-ADDR:%#lx PEER:%u", current, r->kp(),
+          r->dst_pd(), r->dst_addr(), r->peer());
+
+    Kp* kp = capability_cast<Kp>(Space_obj::lookup(r->kp()), Kp::PERM_KP_CTRL);
+    if (EXPECT_FALSE(not kp)) {
+        trace(TRACE_ERROR, "%s: Bad KP CAP (%#lx)", __func__, r->kp());
+        sys_finish<Sys_regs::BAD_CAP>();
+    }
+
+    Pd* user_pd = capability_cast<Pd>(Space_obj::lookup(r->dst_pd()));
+    if (EXPECT_FALSE(not user_pd)) {
+        trace(TRACE_ERROR, "%s: Bad PD CAP: %#lx", __func__, r->dst_pd());
+        sys_finish<Sys_regs::BAD_CAP>();
     }
 
-    if (EXPECT_TRUE(kp->add_user_mapping(user_pd, r->dst_addr()))) {
+    if (EXPECT_TRUE(kp->add_user_mapping(user_pd, r->dst_addr(),
+                                         r->peer() ? Kp::PEER_MAPPING : Kp::OWN_MAPPING))) {
         sys_finish<Sys_regs::SUCCESS>();
     }
 
@@ -738,7 +1331,7 @@ void Ec::sys_kp_ctrl_map()
 void Ec::sys_kp_ctrl_unmap()
 {
     Sys_kp_ctrl_unmap* r = static_cast<Sys_kp_ctrl_unmap*>(current()->sys_regs());
-    trace(TRACE_SYSCALL, "EC:%p SYS_KP_CTRL_MAP KP:%#lx", current, r->kp());
+    trace(TRACE_SYSCALL, "EC:%p SYS_KP_CTRL_UNMAP KP:%#lx PEER:%u", current, r->kp(), r->peer());
 
     Kp* kp = capability_cast<Kp>(Space_obj::lookup(r->kp()), Kp::PERM_KP_CTRL);
     if (EXPECT_FALSE(not kp)) {
@@ -746,7 +1339,7 @@ void Ec::sys_kp_ctrl_unmap()
         sys_finish<Sys_regs::BAD_CAP>();
     }
 
-    if (EXPECT_TRUE(kp->remove_user_mapping())) {
+    if (EXPECT_TRUE(kp->remove_user_mapping(r->peer() ? Kp::PEER_MAPPING : Kp::OWN_MAPPING))) {
         sys_finish<Sys_regs::SUCCESS>();
     }
 
@@ -783,6 +1376,18 @@ void Ec::sys_machine_ctrl()
         sys_machine_ctrl_suspend();
     case Sys_machine_ctrl::UPDATE_MICROCODE:
         sys_machine_ctrl_update_microcode();
+    case Sys_machine_ctrl::MEM_STATS:
+        sys_machine_ctrl_mem_stats();
+    case Sys_machine_ctrl::STATS:
+        sys_machine_ctrl_stats();
+    case Sys_machine_ctrl::TRACE:
+        sys_machine_ctrl_trace();
+    case Sys_machine_ctrl::PMU:
+        sys_machine_ctrl_pmu();
+    case Sys_machine_ctrl::ISOLATE:
+        sys_machine_ctrl_isolate();
+    case Sys_machine_ctrl::RDT:
+        sys_machine_ctrl_rdt();
 
     default:
         sys_finish<Sys_regs::BAD_PAR>();
@@ -793,6 +1398,10 @@ void Ec::sys_machine_ctrl_suspend()
 {
     Sys_machine_ctrl_suspend* r = static_cast<Sys_machine_ctrl_suspend*>(current()->sys_regs());
 
+    if (r->kexec()) {
+        sys_machine_ctrl_kexec();
+    }
+
     r->set_waking_vector(Acpi::get_waking_vector(), Sys_machine_ctrl_suspend::mode::REAL_MODE);
 
     // In case of a successful suspend below, we will not return from the
@@ -805,6 +1414,27 @@ void Ec::sys_machine_ctrl_suspend()
     sys_finish<Sys_regs::BAD_PAR>();
 }
 
+void Ec::sys_machine_ctrl_kexec()
+{
+    Sys_machine_ctrl_kexec* r = static_cast<Sys_machine_ctrl_kexec*>(current()->sys_regs());
+
+    // The new kernel starts in 32-bit protected mode.
+    if (EXPECT_FALSE(r->entry() > ~0U or r->mbi() > ~0U or r->mbi() % 8 != 0)) {
+        sys_finish<Sys_regs::BAD_PAR>();
+    }
+
+    // The new kernel starts the application processors with INIT-SIPI-SIPI, which only works from the BSP.
+    if (EXPECT_FALSE(not Cpu::bsp())) {
+        trace(TRACE_ERROR, "%s: Not on the BSP", __func__);
+        sys_finish<Sys_regs::BAD_CPU>();
+    }
+
+    Suspend::kexec(r->entry(), r->mbi());
+
+    // Someone else is suspending or rebooting.
+    sys_finish<Sys_regs::BAD_PAR>();
+}
+
 void Ec::sys_machine_ctrl_update_microcode()
 {
     Sys_machine_ctrl_update_microcode* r =
@@ -820,11 +1450,230 @@ void Ec::sys_machine_ctrl_update_microcode()
     // The userspace mapping describes the start of the microcode update BLOB,
     // but the WRMSR instruction expects a pointer to the payload, which starts
     // at offset 48.
-    auto kernel_addr{reinterpret_cast<mword>(Hpt::remap(r->update_address(), false)) + 48};
-    Msr::write_safe(Msr::IA32_BIOS_UPDT_TRIG, kernel_addr);
+    constexpr mword payload_offset{48};
+    void* const blob{Hpt::remap(r->update_address(), false)};
+
+    if (not r->all_cpus()) {
+        Microcode::load(reinterpret_cast<mword>(blob) + payload_offset);
+
+        // Microcode loads may expose new CPU features.
+        Cpu::update_features();
+
+        r->set_revision(Microcode::revision());
+        sys_finish<Sys_regs::SUCCESS>();
+    }
+
+    // The remap window only exists in the current address space, so the other CPUs need a copy in memory
+    // that every address space can reach.
+    unsigned short order{0};
+
+    while ((mword{PAGE_SIZE} << order) < r->size()) {
+        order++;
+    }
+
+    Alloc_result<void*> copy{Buddy::allocator.try_alloc(order, Buddy::NOFILL)};
+
+    if (EXPECT_FALSE(copy.is_err())) {
+        sys_finish<Sys_regs::OOM>();
+    }
+
+    memcpy(copy.unwrap(), blob, r->size());
+
+    bool const loaded{Microcode::load_all(reinterpret_cast<mword>(copy.unwrap()) + payload_offset)};
+
+    Buddy::allocator.free(reinterpret_cast<mword>(copy.unwrap()));
+
+    if (EXPECT_FALSE(not loaded)) {
+        trace(TRACE_ERROR, "%s: Could not gather all CPUs for the microcode update", __func__);
+        sys_finish<Sys_regs::BUSY>();
+    }
+
+    static_assert(NUM_CPU <= Utcb::words, "The revisions of all CPUs must fit into the UTCB");
+
+    for (unsigned cpu{0}; cpu < NUM_CPU; cpu++) {
+        current()->utcb->mr(cpu) = Hip::cpu_online(cpu) ? Microcode::loaded_revision(cpu) : 0;
+    }
+
+    r->set_revision(Microcode::loaded_revision(Cpu::id()));
+    sys_finish<Sys_regs::SUCCESS>();
+}
+
+void Ec::sys_machine_ctrl_mem_stats()
+{
+    Sys_machine_ctrl_mem_stats* r = static_cast<Sys_machine_ctrl_mem_stats*>(current()->sys_regs());
+
+    if (r->drain()) {
+        Slab_cache::shrink_all();
+    }
+
+    mword* const words{&current()->utcb->mr(0)};
+
+    unsigned long drained;
+    unsigned long const orders{Buddy::allocator.free_stats(words, Utcb::words, r->drain(), drained)};
+    unsigned long const caches{Slab_cache::all_stats(words + orders, Utcb::words - orders)};
+
+    trace(TRACE_SYSCALL, "EC:%p SYS_MACHINE_CTRL_MEM_STATS DRAIN:%u ORDERS:%lu DRAINED:%lu CACHES:%lu",
+          current(), r->drain(), orders, drained, caches);
+
+    r->set_result(orders, drained, caches);
+    sys_finish<Sys_regs::SUCCESS>();
+}
+
+void Ec::sys_machine_ctrl_stats()
+{
+    Sys_machine_ctrl_stats* r = static_cast<Sys_machine_ctrl_stats*>(current()->sys_regs());
+
+    constexpr size_t counters{sizeof(Sched_stats) / sizeof(uint64)};
+    static_assert(counters <= Utcb::words, "Scheduling statistics must fit into the UTCB");
+
+    mword* const sum{&current()->utcb->mr(0)};
+    unsigned long cpus{0};
+
+    memset(sum, 0, sizeof(Sched_stats));
+
+    Hip::for_each_online_cpu([&](unsigned cpu) {
+        Sched_stats* const stats{Sc::remote_load_stats(cpu)};
+
+        if (not stats) {
+            return;
+        }
+
+        uint64 const* const counter{reinterpret_cast<uint64 const*>(stats)};
+
+        for (size_t i{0}; i < counters; i++) {
+            sum[i] += Atomic::load<uint64 const, Atomic::RELAXED>(counter[i]);
+        }
+
+        cpus++;
+    });
+
+    trace(TRACE_SYSCALL, "EC:%p SYS_MACHINE_CTRL_STATS CPUS:%lu", current(), cpus);
+
+    r->set_result(sizeof(Sched_stats), cpus);
+    sys_finish<Sys_regs::SUCCESS>();
+}
+
+void Ec::sys_machine_ctrl_trace()
+{
+    Sys_machine_ctrl_trace* r = static_cast<Sys_machine_ctrl_trace*>(current()->sys_regs());
+
+    unsigned old{Atomic::load<unsigned, Atomic::RELAXED>(trace_mask)};
+
+    while (not Atomic::cmp_swap(trace_mask, old, (old | r->enable()) & ~r->disable())) {
+        old = Atomic::load<unsigned, Atomic::RELAXED>(trace_mask);
+    }
+
+    trace(TRACE_SYSCALL, "EC:%p SYS_MACHINE_CTRL_TRACE ENABLE:%#x DISABLE:%#x OLD:%#x", current(),
+          r->enable(), r->disable(), old);
+
+    r->set_result(old);
+    sys_finish<Sys_regs::SUCCESS>();
+}
+
+void Ec::sys_machine_ctrl_isolate()
+{
+    Sys_machine_ctrl_isolate* r = static_cast<Sys_machine_ctrl_isolate*>(current()->sys_regs());
+
+    trace(TRACE_SYSCALL, "EC:%p SYS_MACHINE_CTRL_ISOLATE CPU:%u DISABLE:%u", current(), r->cpu(),
+          r->disable());
+
+    if (EXPECT_FALSE(not Hip::cpu_online(r->cpu()))) {
+        trace(TRACE_ERROR, "%s: Invalid CPU (%u)", __func__, r->cpu());
+        sys_finish<Sys_regs::BAD_CPU>();
+    }
+
+    // The CPU notices the change with its next VM entry. See Vcpu::run.
+    Cpu::remote_store_isolated(r->cpu(), not r->disable());
+
+    sys_finish<Sys_regs::SUCCESS>();
+}
+
+void Ec::sys_machine_ctrl_rdt()
+{
+    Sys_machine_ctrl_rdt* r = static_cast<Sys_machine_ctrl_rdt*>(current()->sys_regs());
+
+    trace(TRACE_SYSCALL, "EC:%p SYS_MACHINE_CTRL_RDT ASSIGN:%u ARG:%#lx COS:%u VAL:%#llx", current(),
+          r->assign(), r->pd(), r->cos(), r->value());
+
+    if (EXPECT_FALSE(not Rdt::num_cos() and not Rdt::num_rmid())) {
+        trace(TRACE_ERROR, "%s: No RDT allocation or monitoring", __func__);
+        sys_finish<Sys_regs::BAD_FTR>();
+    }
+
+    if (not r->assign() and r->resource() >= Rdt::MON_L3_OCCUPANCY) {
+        long const counters{Rdt::read_counters(Rdt::Resource(r->resource()), r->first_rmid(),
+                                               &current()->utcb->mr(0), Utcb::words)};
+
+        if (EXPECT_FALSE(counters < 0)) {
+            trace(TRACE_ERROR, "%s: Invalid event (%u) or RMID (%u)", __func__, r->resource(),
+                  r->first_rmid());
+            sys_finish<Sys_regs::BAD_PAR>();
+        }
+
+        r->set_result(static_cast<mword>(counters));
+        sys_finish<Sys_regs::SUCCESS>();
+    }
+
+    if (not r->assign()) {
+        if (EXPECT_FALSE(not Rdt::configure(Rdt::Resource(r->resource()), r->cos(), r->value()))) {
+            trace(TRACE_ERROR, "%s: Invalid resource (%u), COS (%u) or value (%#llx)", __func__,
+                  r->resource(), r->cos(), r->value());
+            sys_finish<Sys_regs::BAD_PAR>();
+        }
+
+        sys_finish<Sys_regs::SUCCESS>();
+    }
+
+    Pd* pd{capability_cast<Pd>(Space_obj::lookup(r->pd()))};
+
+    if (EXPECT_FALSE(not pd)) {
+        trace(TRACE_ERROR, "%s: Bad PD CAP (%#lx)", __func__, r->pd());
+        sys_finish<Sys_regs::BAD_CAP>();
+    }
+
+    // COS 0 and RMID 0 are always valid, so CPUs with only allocation or only monitoring can assign the
+    // other one.
+    bool const cos_ok{r->cos() == 0 or r->cos() < Rdt::num_cos()};
+    bool const rmid_ok{r->rmid() == 0 or r->rmid() < Rdt::num_rmid()};
+
+    if (EXPECT_FALSE(not cos_ok or not rmid_ok)) {
+        trace(TRACE_ERROR, "%s: Invalid COS (%u) or RMID (%u)", __func__, r->cos(), r->rmid());
+        sys_finish<Sys_regs::BAD_PAR>();
+    }
+
+    // CPUs load the new values the next time they switch to the PD or enter one of its guests.
+    Atomic::store(pd->rdt_cos, r->cos());
+    Atomic::store(pd->rdt_rmid, r->rmid());
 
-    // Microcode loads may expose new CPU features.
-    Cpu::update_features();
+    sys_finish<Sys_regs::SUCCESS>();
+}
+
+void Ec::sys_machine_ctrl_pmu()
+{
+    Sys_machine_ctrl_pmu* r = static_cast<Sys_machine_ctrl_pmu*>(current()->sys_regs());
+
+    trace(TRACE_SYSCALL, "EC:%p SYS_MACHINE_CTRL_PMU KP:%#lx STOP:%u", current(), r->kp(), r->stop());
+
+    if (EXPECT_FALSE(not Pmu::available())) {
+        trace(TRACE_ERROR, "%s: No architectural PMU", __func__);
+        sys_finish<Sys_regs::BAD_FTR>();
+    }
+
+    if (r->stop()) {
+        Pmu::stop();
+        sys_finish<Sys_regs::SUCCESS>();
+    }
+
+    Kp* kp{capability_cast<Kp>(Space_obj::lookup(r->kp()))};
+    if (EXPECT_FALSE(not kp or kp->is_kernel_owned())) {
+        trace(TRACE_ERROR, "%s: Bad KP CAP (%#lx)", __func__, r->kp());
+        sys_finish<Sys_regs::BAD_CAP>();
+    }
+
+    if (EXPECT_FALSE(not Pmu::start(kp))) {
+        trace(TRACE_ERROR, "%s: Invalid PMU configuration", __func__);
+        sys_finish<Sys_regs::BAD_PAR>();
+    }
 
     sys_finish<Sys_regs::SUCCESS>();
 }
@@ -852,6 +1701,9 @@ void Ec::sys_vcpu_ctrl_run()
         sys_finish(Sys_regs::BAD_CAP);
     }
 
+    // A migrated EC goes back to the CPU of its vCPU.
+    follow(vcpu->cpu(), sys_vcpu_ctrl_run);
+
     auto result{Ec::try_acquire_vcpu(vcpu)};
 
     if (result.is_err()) {
@@ -868,7 +1720,7 @@ void Ec::sys_vcpu_ctrl_run()
 void Ec::sys_vcpu_ctrl_poke()
 {
     Sys_vcpu_ctrl_poke* r = static_cast<Sys_vcpu_ctrl_poke*>(current()->sys_regs());
-    trace(TRACE_SYSCALL, "EC:%p, SYS_VCPU_CTRL_POKE VCPU: %#lx", current(), r->sel());
+    trace(TRACE_SYSCALL, "EC:%p, SYS_VCPU_CTRL_POKE VCPU: %#lx SOFT: %u", current(), r->sel(), r->soft());
 
     Vcpu* vcpu = capability_cast<Vcpu>(Space_obj::lookup(r->sel()));
     if (EXPECT_FALSE(not vcpu)) {
@@ -876,70 +1728,892 @@ void Ec::sys_vcpu_ctrl_poke()
         sys_finish(Sys_regs::BAD_CAP);
     }
 
-    vcpu->poke();
+    if (r->soft()) {
+        vcpu->soft_poke();
+    } else {
+        vcpu->poke();
+    }
+
     sys_finish(Sys_regs::SUCCESS);
 }
 
-void Ec::sys_vcpu_ctrl()
+void Ec::sys_vcpu_ctrl_poke_batch()
 {
-    Sys_vcpu_ctrl* r = static_cast<Sys_vcpu_ctrl*>(current()->sys_regs());
+    Sys_vcpu_ctrl_poke_batch* r = static_cast<Sys_vcpu_ctrl_poke_batch*>(current()->sys_regs());
+    trace(TRACE_SYSCALL, "EC:%p, SYS_VCPU_CTRL_POKE_BATCH COUNT: %#lx", current(), r->count());
 
-    switch (r->op()) {
-    case Sys_vcpu_ctrl::RUN: {
-        sys_vcpu_ctrl_run();
+    if (EXPECT_FALSE(r->count() == 0 or r->count() > Utcb::words)) {
+        trace(TRACE_ERROR, "%s: Invalid number of vCPUs (%lu)", __func__, r->count());
+        sys_finish(Sys_regs::BAD_PAR);
     }
-    case Sys_vcpu_ctrl::POKE: {
-        sys_vcpu_ctrl_poke();
+
+    mword const* const sels{&current()->utcb->mr(0)};
+    Cpuset kick;
+    mword poked{0};
+
+    for (; poked < r->count(); poked++) {
+        Vcpu* vcpu = capability_cast<Vcpu>(Space_obj::lookup(sels[poked]));
+        if (EXPECT_FALSE(not vcpu)) {
+            trace(TRACE_ERROR, "%s: Bad vCPU CAP (%#lx)", __func__, sels[poked]);
+            break;
+        }
+
+        vcpu->poke(kick);
     }
-    };
 
-    sys_finish<Sys_regs::BAD_PAR>();
+    // Several of the vCPUs may execute on the same CPU, but one NMI makes all of them exit.
+    Lapic::send_nmi(kick);
+
+    r->set_poked(poked);
+    sys_finish(poked == r->count() ? Sys_regs::SUCCESS : Sys_regs::BAD_CAP);
 }
 
-void Ec::syscall_handler()
+void Ec::sys_vcpu_ctrl_exit_policy()
 {
-    // System call handler functions are all marked noreturn.
+    Sys_vcpu_ctrl_exit_policy* r = static_cast<Sys_vcpu_ctrl_exit_policy*>(current()->sys_regs());
+    trace(TRACE_SYSCALL, "EC:%p, SYS_VCPU_CTRL_EXIT_POLICY VCPU: %#lx POLICY: %#lx KP: %#lx", current(),
+          r->sel(), r->policy(), r->cpuid_kp());
 
-    switch (current()->sys_regs()->id()) {
-    case hypercall_id::HC_CALL:
-        sys_call();
-    case hypercall_id::HC_REPLY:
-        sys_reply();
-    case hypercall_id::HC_REVOKE:
-        sys_revoke();
+    Vcpu* vcpu = capability_cast<Vcpu>(Space_obj::lookup(r->sel()));
+    if (EXPECT_FALSE(not vcpu)) {
+        trace(TRACE_ERROR, "%s: Bad vCPU CAP (%#lx)", __func__, r->sel());
+        sys_finish(Sys_regs::BAD_CAP);
+    }
 
-    case hypercall_id::HC_CREATE_PD:
-        sys_create_pd();
-    case hypercall_id::HC_CREATE_EC:
-        sys_create_ec();
-    case hypercall_id::HC_CREATE_SC:
-        sys_create_sc();
-    case hypercall_id::HC_CREATE_PT:
-        sys_create_pt();
-    case hypercall_id::HC_CREATE_SM:
-        sys_create_sm();
-    case hypercall_id::HC_CREATE_KP:
-        sys_create_kp();
-    case hypercall_id::HC_CREATE_VCPU:
-        sys_create_vcpu();
+    if (EXPECT_FALSE(r->policy() & ~static_cast<mword>(Vcpu::EXIT_POLICY_ALL))) {
+        trace(TRACE_ERROR, "%s: Invalid exit policy (%#lx)", __func__, r->policy());
+        sys_finish(Sys_regs::BAD_PAR);
+    }
 
-    case hypercall_id::HC_PD_CTRL:
-        sys_pd_ctrl();
-    case hypercall_id::HC_EC_CTRL:
-        sys_ec_ctrl();
-    case hypercall_id::HC_SC_CTRL:
-        sys_sc_ctrl();
-    case hypercall_id::HC_PT_CTRL:
-        sys_pt_ctrl();
-    case hypercall_id::HC_SM_CTRL:
-        sys_sm_ctrl();
-    case hypercall_id::HC_KP_CTRL:
-        sys_kp_ctrl();
-    case hypercall_id::HC_VCPU_CTRL:
-        sys_vcpu_ctrl();
+    Kp* cpuid_table{nullptr};
 
-    case hypercall_id::HC_MACHINE_CTRL:
-        sys_machine_ctrl();
+    if (r->policy() & Vcpu::EXIT_POLICY_CPUID) {
+        cpuid_table = capability_cast<Kp>(Space_obj::lookup(r->cpuid_kp()));
+
+        if (EXPECT_FALSE(not cpuid_table)) {
+            trace(TRACE_ERROR, "%s: Bad KP CAP (CPUID table) (%#lx)", __func__, r->cpuid_kp());
+            sys_finish(Sys_regs::BAD_CAP);
+        }
+    }
+
+    Kp* steal_time{nullptr};
+
+    if (r->policy() & Vcpu::EXIT_POLICY_STEAL_TIME) {
+        steal_time = capability_cast<Kp>(Space_obj::lookup(r->steal_time_kp()));
+
+        if (EXPECT_FALSE(not steal_time or steal_time->is_kernel_owned())) {
+            trace(TRACE_ERROR, "%s: Bad KP CAP (steal time) (%#lx)", __func__, r->steal_time_kp());
+            sys_finish(Sys_regs::BAD_CAP);
+        }
+    }
+
+    auto result{Ec::try_acquire_vcpu(vcpu)};
+
+    if (result.is_err()) {
+        trace(TRACE_ERROR, "Refusing to claim vCPU.");
+        sys_finish(result.map_err([](auto e) { return to_syscall_status(e); }));
+    }
+
+    // We release the vCPU again in sys_finish.
+    if (EXPECT_FALSE(not vcpu->set_exit_policy(static_cast<unsigned>(r->policy()), cpuid_table,
+                                               r->pv_index(), steal_time))) {
+        trace(TRACE_ERROR, "%s: Paravirtual index unavailable (%lu)", __func__, r->pv_index());
+        sys_finish(Sys_regs::BAD_PAR);
+    }
+
+    sys_finish(Sys_regs::SUCCESS);
+}
+
+void Ec::sys_vcpu_ctrl_mtd_profile()
+{
+    Sys_vcpu_ctrl_mtd_profile* r = static_cast<Sys_vcpu_ctrl_mtd_profile*>(current()->sys_regs());
+    trace(TRACE_SYSCALL, "EC:%p, SYS_VCPU_CTRL_MTD_PROFILE VCPU: %#lx KP: %#lx EN: %u", current(), r->sel(),
+          r->profile_kp(), r->enable());
+
+    Vcpu* vcpu = capability_cast<Vcpu>(Space_obj::lookup(r->sel()));
+    if (EXPECT_FALSE(not vcpu)) {
+        trace(TRACE_ERROR, "%s: Bad vCPU CAP (%#lx)", __func__, r->sel());
+        sys_finish(Sys_regs::BAD_CAP);
+    }
+
+    Kp* profile{nullptr};
+
+    if (r->enable()) {
+        profile = capability_cast<Kp>(Space_obj::lookup(r->profile_kp()));
+
+        if (EXPECT_FALSE(not profile)) {
+            trace(TRACE_ERROR, "%s: Bad KP CAP (MTD profile) (%#lx)", __func__, r->profile_kp());
+            sys_finish(Sys_regs::BAD_CAP);
+        }
+    }
+
+    auto result{Ec::try_acquire_vcpu(vcpu)};
+
+    if (result.is_err()) {
+        trace(TRACE_ERROR, "Refusing to claim vCPU.");
+        sys_finish(result.map_err([](auto e) { return to_syscall_status(e); }));
+    }
+
+    // We release the vCPU again in sys_finish.
+    vcpu->set_mtd_profile(profile);
+    sys_finish(Sys_regs::SUCCESS);
+}
+
+void Ec::sys_vcpu_ctrl_pml()
+{
+    Sys_vcpu_ctrl_pml* r = static_cast<Sys_vcpu_ctrl_pml*>(current()->sys_regs());
+    trace(TRACE_SYSCALL, "EC:%p, SYS_VCPU_CTRL_PML VCPU: %#lx KP: %#lx/%#lx EN: %u RING: %u", current(),
+          r->sel(), r->buffer_kp(), r->dirty_ring_kp(), r->enable(), r->dirty_ring());
+
+    if (EXPECT_FALSE(not Vmcs::has_pml())) {
+        trace(TRACE_ERROR, "%s: Page-modification logging is not supported", __func__);
+        sys_finish(Sys_regs::BAD_FTR);
+    }
+
+    Vcpu* vcpu = capability_cast<Vcpu>(Space_obj::lookup(r->sel()));
+    if (EXPECT_FALSE(not vcpu)) {
+        trace(TRACE_ERROR, "%s: Bad vCPU CAP (%#lx)", __func__, r->sel());
+        sys_finish(Sys_regs::BAD_CAP);
+    }
+
+    Kp* buffer{nullptr};
+
+    if (r->enable()) {
+        buffer = capability_cast<Kp>(Space_obj::lookup(r->buffer_kp()));
+
+        // The CPU writes into the buffer, so it must not be one of the read-only KPs.
+        if (EXPECT_FALSE(not buffer or buffer->is_kernel_owned())) {
+            trace(TRACE_ERROR, "%s: Bad KP CAP (PML buffer) (%#lx)", __func__, r->buffer_kp());
+            sys_finish(Sys_regs::BAD_CAP);
+        }
+    }
+
+    Kp* dirty_ring{nullptr};
+
+    if (r->dirty_ring()) {
+        if (EXPECT_FALSE(not buffer)) {
+            trace(TRACE_ERROR, "%s: Dirty ring without PML buffer", __func__);
+            sys_finish(Sys_regs::BAD_PAR);
+        }
+
+        dirty_ring = capability_cast<Kp>(Space_obj::lookup(r->dirty_ring_kp()));
+
+        if (EXPECT_FALSE(not dirty_ring or dirty_ring->is_kernel_owned())) {
+            trace(TRACE_ERROR, "%s: Bad KP CAP (dirty ring) (%#lx)", __func__, r->dirty_ring_kp());
+            sys_finish(Sys_regs::BAD_CAP);
+        }
+
+        // A full PML buffer has to fit into the ring.
+        if (EXPECT_FALSE(Vcpu_dirty_ring::entries(dirty_ring->size()) <= Vcpu::PML_ENTRIES)) {
+            trace(TRACE_ERROR, "%s: Dirty ring is too small", __func__);
+            sys_finish(Sys_regs::BAD_PAR);
+        }
+    }
+
+    auto result{Ec::try_acquire_vcpu(vcpu)};
+
+    if (result.is_err()) {
+        trace(TRACE_ERROR, "Refusing to claim vCPU.");
+        sys_finish(result.map_err([](auto e) { return to_syscall_status(e); }));
+    }
+
+    // The CPU only logs pages when it sets their dirty flags. Vcpu::run enables them before the next entry.
+    if (buffer) {
+        Atomic::store(vcpu->guest_pd()->ept_ad, true);
+    }
+
+    // We release the vCPU again in sys_finish.
+    r->set_logged(vcpu->set_pml_buffer(buffer, dirty_ring));
+    sys_finish(Sys_regs::SUCCESS);
+}
+
+void Ec::sys_vcpu_ctrl_harvest_dirty()
+{
+    Sys_vcpu_ctrl_harvest_dirty* r = static_cast<Sys_vcpu_ctrl_harvest_dirty*>(current()->sys_regs());
+    trace(TRACE_SYSCALL, "EC:%p, SYS_VCPU_CTRL_HARVEST_DIRTY VCPU: %#lx PAGE: %#lx COUNT: %#lx A: %u K: %u",
+          current(), r->sel(), r->page(), r->count(), r->accessed(), r->keep());
+
+    if (EXPECT_FALSE(not Vmcs::has_ept_ad())) {
+        trace(TRACE_ERROR, "%s: EPT accessed and dirty flags are not supported", __func__);
+        sys_finish(Sys_regs::BAD_FTR);
+    }
+
+    Vcpu* vcpu = capability_cast<Vcpu>(Space_obj::lookup(r->sel()));
+    if (EXPECT_FALSE(not vcpu)) {
+        trace(TRACE_ERROR, "%s: Bad vCPU CAP (%#lx)", __func__, r->sel());
+        sys_finish(Sys_regs::BAD_CAP);
+    }
+
+    // The vCPUs of the PD set the flags from their next VM entry on. See Space_mem::ept_ad.
+    Atomic::store(vcpu->guest_pd()->ept_ad, true);
+
+    if (r->ring()) {
+        Kp* const ring{capability_cast<Kp>(Space_obj::lookup(r->ring_kp()))};
+
+        // Only the dirty ring of this vCPU holds pages of its PD whose slots the vCPU may fill again.
+        if (EXPECT_FALSE(not ring or ring != vcpu->dirty_ring())) {
+            trace(TRACE_ERROR, "%s: Bad KP CAP (dirty ring) (%#lx)", __func__, r->ring_kp());
+            sys_finish(Sys_regs::BAD_CAP);
+        }
+
+        Optional<mword> const reset{r->accessed() or r->keep() ? Optional<mword>{}
+                                                                : vcpu->reset_dirty_ring(ring)};
+
+        if (EXPECT_FALSE(not reset.has_value())) {
+            trace(TRACE_ERROR, "%s: Invalid dirty ring reset", __func__);
+            sys_finish(Sys_regs::BAD_PAR);
+        }
+
+        r->set_reset(reset.value());
+        sys_finish(Sys_regs::SUCCESS);
+    }
+
+    static constexpr mword BITS_PER_WORD{sizeof(mword) * 8};
+
+    Pd* const pd{vcpu->guest_pd()};
+    mword const guest_pages{1UL << (pd->ept.max_order() - PAGE_BITS)};
+
+    if (EXPECT_FALSE(r->count() == 0 or r->count() > Utcb::words * BITS_PER_WORD or
+                     r->page() >= guest_pages or r->count() > guest_pages - r->page())) {
+        trace(TRACE_ERROR, "%s: Invalid range (%#lx+%#lx)", __func__, r->page(), r->count());
+        sys_finish(Sys_regs::BAD_PAR);
+    }
+
+    mword* const bitmap{&current()->utcb->mr(0)};
+
+    for (mword i = 0; i < (r->count() + BITS_PER_WORD - 1) / BITS_PER_WORD; i++) {
+        bitmap[i] = 0;
+    }
+
+    pd->harvest(r->page() << PAGE_BITS, r->count(), not r->accessed(), not r->keep(), bitmap);
+    sys_finish(Sys_regs::SUCCESS);
+}
+
+void Ec::sys_vcpu_ctrl_post_intr()
+{
+    Sys_vcpu_ctrl_post_intr* r = static_cast<Sys_vcpu_ctrl_post_intr*>(current()->sys_regs());
+    trace(TRACE_SYSCALL, "EC:%p, SYS_VCPU_CTRL_POST_INTR VCPU: %#lx VECTOR: %#lx", current(), r->sel(),
+          r->vector());
+
+    Vcpu* vcpu = capability_cast<Vcpu>(Space_obj::lookup(r->sel()));
+    if (EXPECT_FALSE(not vcpu)) {
+        trace(TRACE_ERROR, "%s: Bad vCPU CAP (%#lx)", __func__, r->sel());
+        sys_finish(Sys_regs::BAD_CAP);
+    }
+
+    // The vectors of exceptions cannot be delivered as interrupts.
+    if (EXPECT_FALSE(r->vector() < NUM_EXC or r->vector() >= NUM_INT_VECTORS)) {
+        trace(TRACE_ERROR, "%s: Invalid vector (%#lx)", __func__, r->vector());
+        sys_finish(Sys_regs::BAD_PAR);
+    }
+
+    vcpu->post_interrupt(static_cast<unsigned>(r->vector()));
+    sys_finish(Sys_regs::SUCCESS);
+}
+
+void Ec::sys_vcpu_ctrl_exit_stats()
+{
+    Sys_vcpu_ctrl_exit_stats* r = static_cast<Sys_vcpu_ctrl_exit_stats*>(current()->sys_regs());
+    trace(TRACE_SYSCALL, "EC:%p, SYS_VCPU_CTRL_EXIT_STATS VCPU: %#lx KP: %#lx EN: %u", current(), r->sel(),
+          r->stats_kp(), r->enable());
+
+    Vcpu* vcpu = capability_cast<Vcpu>(Space_obj::lookup(r->sel()));
+    if (EXPECT_FALSE(not vcpu)) {
+        trace(TRACE_ERROR, "%s: Bad vCPU CAP (%#lx)", __func__, r->sel());
+        sys_finish(Sys_regs::BAD_CAP);
+    }
+
+    Kp* stats{nullptr};
+
+    if (r->enable()) {
+        stats = capability_cast<Kp>(Space_obj::lookup(r->stats_kp()));
+
+        // We write the statistics into the KP, so it must not be one of the read-only KPs.
+        if (EXPECT_FALSE(not stats or stats->is_kernel_owned())) {
+            trace(TRACE_ERROR, "%s: Bad KP CAP (exit statistics) (%#lx)", __func__, r->stats_kp());
+            sys_finish(Sys_regs::BAD_CAP);
+        }
+    }
+
+    auto result{Ec::try_acquire_vcpu(vcpu)};
+
+    if (result.is_err()) {
+        trace(TRACE_ERROR, "Refusing to claim vCPU.");
+        sys_finish(result.map_err([](auto e) { return to_syscall_status(e); }));
+    }
+
+    // We release the vCPU again in sys_finish.
+    vcpu->set_exit_stats(stats);
+    sys_finish(Sys_regs::SUCCESS);
+}
+
+void Ec::sys_vcpu_ctrl_pmu()
+{
+    Sys_vcpu_ctrl_pmu* r = static_cast<Sys_vcpu_ctrl_pmu*>(current()->sys_regs());
+    trace(TRACE_SYSCALL, "EC:%p, SYS_VCPU_CTRL_PMU VCPU: %#lx EN: %u", current(), r->sel(), r->enable());
+
+    Vcpu* vcpu = capability_cast<Vcpu>(Space_obj::lookup(r->sel()));
+    if (EXPECT_FALSE(not vcpu)) {
+        trace(TRACE_ERROR, "%s: Bad vCPU CAP (%#lx)", __func__, r->sel());
+        sys_finish(Sys_regs::BAD_CAP);
+    }
+
+    if (EXPECT_FALSE(not Pmu::available() or not Vmcs::has_perf_global_ctrl())) {
+        trace(TRACE_ERROR, "%s: No PMU virtualization support", __func__);
+        sys_finish(Sys_regs::BAD_FTR);
+    }
+
+    auto result{Ec::try_acquire_vcpu(vcpu)};
+
+    if (result.is_err()) {
+        trace(TRACE_ERROR, "Refusing to claim vCPU.");
+        sys_finish(result.map_err([](auto e) { return to_syscall_status(e); }));
+    }
+
+    // We release the vCPU again in sys_finish.
+    vcpu->set_pmu(r->enable());
+    sys_finish(Sys_regs::SUCCESS);
+}
+
+void Ec::sys_vcpu_ctrl_vmcs_shadow()
+{
+    Sys_vcpu_ctrl_vmcs_shadow* r = static_cast<Sys_vcpu_ctrl_vmcs_shadow*>(current()->sys_regs());
+    trace(TRACE_SYSCALL, "EC:%p, SYS_VCPU_CTRL_VMCS_SHADOW VCPU: %#lx KP: %#lx/%#lx EN: %u", current(),
+          r->sel(), r->vmread_bitmap_kp(), r->vmwrite_bitmap_kp(), r->enable());
+
+    if (EXPECT_FALSE(not Vmcs::has_vmcs_shadow())) {
+        trace(TRACE_ERROR, "%s: VMCS shadowing is not supported", __func__);
+        sys_finish(Sys_regs::BAD_FTR);
+    }
+
+    Vcpu* vcpu = capability_cast<Vcpu>(Space_obj::lookup(r->sel()));
+    if (EXPECT_FALSE(not vcpu)) {
+        trace(TRACE_ERROR, "%s: Bad vCPU CAP (%#lx)", __func__, r->sel());
+        sys_finish(Sys_regs::BAD_CAP);
+    }
+
+    Kp* vmread_bitmap{nullptr};
+    Kp* vmwrite_bitmap{nullptr};
+
+    if (r->enable()) {
+        vmread_bitmap = capability_cast<Kp>(Space_obj::lookup(r->vmread_bitmap_kp()));
+        vmwrite_bitmap = capability_cast<Kp>(Space_obj::lookup(r->vmwrite_bitmap_kp()));
+
+        if (EXPECT_FALSE(not vmread_bitmap or vmread_bitmap->is_kernel_owned())) {
+            trace(TRACE_ERROR, "%s: Bad KP CAP (VMREAD bitmap) (%#lx)", __func__, r->vmread_bitmap_kp());
+            sys_finish(Sys_regs::BAD_CAP);
+        }
+
+        if (EXPECT_FALSE(not vmwrite_bitmap or vmwrite_bitmap->is_kernel_owned())) {
+            trace(TRACE_ERROR, "%s: Bad KP CAP (VMWRITE bitmap) (%#lx)", __func__, r->vmwrite_bitmap_kp());
+            sys_finish(Sys_regs::BAD_CAP);
+        }
+    }
+
+    auto result{Ec::try_acquire_vcpu(vcpu)};
+
+    if (result.is_err()) {
+        trace(TRACE_ERROR, "Refusing to claim vCPU.");
+        sys_finish(result.map_err([](auto e) { return to_syscall_status(e); }));
+    }
+
+    // We release the vCPU again in sys_finish.
+    vcpu->set_vmcs_shadow(vmread_bitmap, vmwrite_bitmap);
+    sys_finish(Sys_regs::SUCCESS);
+}
+
+void Ec::sys_vcpu_ctrl_vmcs_shadow_access()
+{
+    Sys_vcpu_ctrl_vmcs_shadow_access* r =
+        static_cast<Sys_vcpu_ctrl_vmcs_shadow_access*>(current()->sys_regs());
+    trace(TRACE_SYSCALL, "EC:%p, SYS_VCPU_CTRL_VMCS_SHADOW_ACCESS VCPU: %#lx COUNT: %#lx W: %u", current(),
+          r->sel(), r->count(), r->write());
+
+    Vcpu* vcpu = capability_cast<Vcpu>(Space_obj::lookup(r->sel()));
+    if (EXPECT_FALSE(not vcpu)) {
+        trace(TRACE_ERROR, "%s: Bad vCPU CAP (%#lx)", __func__, r->sel());
+        sys_finish(Sys_regs::BAD_CAP);
+    }
+
+    if (EXPECT_FALSE(r->count() == 0 or
+                     r->count() > Utcb::words / Sys_vcpu_ctrl_vmcs_shadow_access::FIELD_WORDS)) {
+        trace(TRACE_ERROR, "%s: Invalid number of fields (%lu)", __func__, r->count());
+        sys_finish(Sys_regs::BAD_PAR);
+    }
+
+    auto result{Ec::try_acquire_vcpu(vcpu)};
+
+    if (result.is_err()) {
+        trace(TRACE_ERROR, "Refusing to claim vCPU.");
+        sys_finish(result.map_err([](auto e) { return to_syscall_status(e); }));
+    }
+
+    // We release the vCPU again in sys_finish.
+    if (EXPECT_FALSE(not vcpu->has_shadow_vmcs())) {
+        trace(TRACE_ERROR, "%s: vCPU has no shadow VMCS", __func__);
+        sys_finish(Sys_regs::BAD_PAR);
+    }
+
+    // The fields are read from and written back to the UTCB of the calling EC.
+    mword const accessed{vcpu->access_shadow_vmcs(&current()->utcb->mr(0), r->count(), r->write())};
+
+    r->set_accessed(accessed);
+    sys_finish(accessed == r->count() ? Sys_regs::SUCCESS : Sys_regs::BAD_PAR);
+}
+
+void Ec::sys_vcpu_ctrl_snapshot()
+{
+    Sys_vcpu_ctrl_snapshot* r = static_cast<Sys_vcpu_ctrl_snapshot*>(current()->sys_regs());
+    trace(TRACE_SYSCALL, "EC:%p, SYS_VCPU_CTRL_SNAPSHOT VCPU: %#lx KP: %#lx R: %u", current(), r->sel(),
+          r->snapshot_kp(), r->restore());
+
+    Vcpu* vcpu = capability_cast<Vcpu>(Space_obj::lookup(r->sel()));
+    if (EXPECT_FALSE(not vcpu)) {
+        trace(TRACE_ERROR, "%s: Bad vCPU CAP (%#lx)", __func__, r->sel());
+        sys_finish(Sys_regs::BAD_CAP);
+    }
+
+    Kp* snapshot{capability_cast<Kp>(Space_obj::lookup(r->snapshot_kp()))};
+
+    // We write the snapshot into the KP, so it must not be one of the read-only KPs.
+    if (EXPECT_FALSE(not snapshot or (not r->restore() and snapshot->is_kernel_owned()))) {
+        trace(TRACE_ERROR, "%s: Bad KP CAP (snapshot) (%#lx)", __func__, r->snapshot_kp());
+        sys_finish(Sys_regs::BAD_CAP);
+    }
+
+    auto result{Ec::try_acquire_vcpu(vcpu)};
+
+    if (result.is_err()) {
+        trace(TRACE_ERROR, "Refusing to claim vCPU.");
+        sys_finish(result.map_err([](auto e) { return to_syscall_status(e); }));
+    }
+
+    // We release the vCPU again in sys_finish.
+    if (EXPECT_FALSE(not vcpu->snapshot(snapshot, r->restore()))) {
+        trace(TRACE_ERROR, "%s: Snapshot KP is the vCPU state KP", __func__);
+        sys_finish(Sys_regs::BAD_PAR);
+    }
+
+    sys_finish(Sys_regs::SUCCESS);
+}
+
+void Ec::sys_vcpu_ctrl_ioevent()
+{
+    Sys_vcpu_ctrl_ioevent* r = static_cast<Sys_vcpu_ctrl_ioevent*>(current()->sys_regs());
+    trace(TRACE_SYSCALL, "EC:%p, SYS_VCPU_CTRL_IOEVENT VCPU: %#lx SLOT: %lu SM: %#lx PORT: %#x EN: %u",
+          current(), r->sel(), r->slot(), r->sm(), r->port(), r->enable());
+
+    Vcpu* vcpu = capability_cast<Vcpu>(Space_obj::lookup(r->sel()));
+    if (EXPECT_FALSE(not vcpu)) {
+        trace(TRACE_ERROR, "%s: Bad vCPU CAP (%#lx)", __func__, r->sel());
+        sys_finish(Sys_regs::BAD_CAP);
+    }
+
+    Sm* sm{nullptr};
+
+    if (r->enable()) {
+        sm = capability_cast<Sm>(Space_obj::lookup(r->sm()), Sm::PERM_UP);
+
+        // Notifications are signaled with bits that an ioevent has no room for. Semaphores that post
+        // interrupts to a vCPU could keep each other and the vCPU alive in a reference cycle.
+        if (EXPECT_FALSE(not sm or sm->is_notification() or sm->is_vcpu_bound())) {
+            trace(TRACE_ERROR, "%s: Bad SM CAP (%#lx)", __func__, r->sm());
+            sys_finish(Sys_regs::BAD_CAP);
+        }
+
+        if (EXPECT_FALSE(r->size() != 1 and r->size() != 2 and r->size() != 4)) {
+            trace(TRACE_ERROR, "%s: Invalid access size (%lu)", __func__, r->size());
+            sys_finish(Sys_regs::BAD_PAR);
+        }
+    }
+
+    auto result{Ec::try_acquire_vcpu(vcpu)};
+
+    if (result.is_err()) {
+        trace(TRACE_ERROR, "Refusing to claim vCPU.");
+        sys_finish(result.map_err([](auto e) { return to_syscall_status(e); }));
+    }
+
+    Vcpu_ioevent const ioevent{r->port(), static_cast<uint8>(r->size()), r->match_value(), r->value()};
+
+    // We release the vCPU again in sys_finish.
+    if (EXPECT_FALSE(not vcpu->set_ioevent(r->slot(), ioevent, sm))) {
+        trace(TRACE_ERROR, "%s: Invalid slot (%lu)", __func__, r->slot());
+        sys_finish(Sys_regs::BAD_PAR);
+    }
+
+    sys_finish(Sys_regs::SUCCESS);
+}
+
+void Ec::sys_vcpu_ctrl_io_ring()
+{
+    Sys_vcpu_ctrl_io_ring* r = static_cast<Sys_vcpu_ctrl_io_ring*>(current()->sys_regs());
+    trace(TRACE_SYSCALL, "EC:%p, SYS_VCPU_CTRL_IO_RING VCPU: %#lx KP: %#lx EN: %u", current(), r->sel(),
+          r->ring_kp(), r->enable());
+
+    Vcpu* vcpu = capability_cast<Vcpu>(Space_obj::lookup(r->sel()));
+    if (EXPECT_FALSE(not vcpu)) {
+        trace(TRACE_ERROR, "%s: Bad vCPU CAP (%#lx)", __func__, r->sel());
+        sys_finish(Sys_regs::BAD_CAP);
+    }
+
+    Kp* ring{nullptr};
+
+    if (r->enable()) {
+        ring = capability_cast<Kp>(Space_obj::lookup(r->ring_kp()));
+
+        // We write the ring, so it must not be one of the read-only KPs.
+        if (EXPECT_FALSE(not ring or ring->is_kernel_owned())) {
+            trace(TRACE_ERROR, "%s: Bad KP CAP (I/O ring) (%#lx)", __func__, r->ring_kp());
+            sys_finish(Sys_regs::BAD_CAP);
+        }
+    }
+
+    auto result{Ec::try_acquire_vcpu(vcpu)};
+
+    if (result.is_err()) {
+        trace(TRACE_ERROR, "Refusing to claim vCPU.");
+        sys_finish(result.map_err([](auto e) { return to_syscall_status(e); }));
+    }
+
+    // We release the vCPU again in sys_finish.
+    vcpu->set_io_ring(ring);
+    sys_finish(Sys_regs::SUCCESS);
+}
+
+void Ec::sys_vcpu_ctrl_vmcall_portal()
+{
+    Sys_vcpu_ctrl_vmcall_portal* r = static_cast<Sys_vcpu_ctrl_vmcall_portal*>(current()->sys_regs());
+    trace(TRACE_SYSCALL, "EC:%p, SYS_VCPU_CTRL_VMCALL_PORTAL VCPU: %#lx NR: %lu PT: %#lx EN: %u", current(),
+          r->sel(), r->nr(), r->pt(), r->enable());
+
+    Vcpu* vcpu = capability_cast<Vcpu>(Space_obj::lookup(r->sel()));
+    if (EXPECT_FALSE(not vcpu)) {
+        trace(TRACE_ERROR, "%s: Bad vCPU CAP (%#lx)", __func__, r->sel());
+        sys_finish(Sys_regs::BAD_CAP);
+    }
+
+    // The portal is looked up again on each VMCALL. See Vcpu::vmcall_pt_sels.
+    if (EXPECT_FALSE(r->enable() and not capability_cast<Pt>(Space_obj::lookup(r->pt()), Pt::PERM_CALL))) {
+        trace(TRACE_ERROR, "%s: Bad PT CAP (%#lx)", __func__, r->pt());
+        sys_finish(Sys_regs::BAD_CAP);
+    }
+
+    auto result{Ec::try_acquire_vcpu(vcpu)};
+
+    if (result.is_err()) {
+        trace(TRACE_ERROR, "Refusing to claim vCPU.");
+        sys_finish(result.map_err([](auto e) { return to_syscall_status(e); }));
+    }
+
+    // We release the vCPU again in sys_finish.
+    if (EXPECT_FALSE(not vcpu->set_vmcall_portal(r->nr(), r->pt(), r->enable()))) {
+        trace(TRACE_ERROR, "%s: Invalid VMCALL number (%lu)", __func__, r->nr());
+        sys_finish(Sys_regs::BAD_PAR);
+    }
+
+    sys_finish(Sys_regs::SUCCESS);
+}
+
+void Ec::sys_vcpu_migrate()
+{
+    Sys_vcpu_migrate* r = static_cast<Sys_vcpu_migrate*>(current()->sys_regs());
+    trace(TRACE_SYSCALL, "EC:%p, SYS_VCPU_MIGRATE VCPU: %#lx CPU: %#x", current(), r->sel(), r->cpu());
+
+    Vcpu* vcpu = capability_cast<Vcpu>(Space_obj::lookup(r->sel()));
+    if (EXPECT_FALSE(not vcpu)) {
+        trace(TRACE_ERROR, "%s: Bad vCPU CAP (%#lx)", __func__, r->sel());
+        sys_finish(Sys_regs::BAD_CAP);
+    }
+
+    if (EXPECT_FALSE(not Hip::cpu_online(r->cpu()))) {
+        trace(TRACE_ERROR, "%s: Invalid CPU (%#x)", __func__, r->cpu());
+        sys_finish(Sys_regs::BAD_CPU);
+    }
+
+    auto result{Ec::try_acquire_vcpu(vcpu)};
+
+    if (result.is_err()) {
+        trace(TRACE_ERROR, "Refusing to claim vCPU.");
+        sys_finish(result.map_err([](auto e) { return to_syscall_status(e); }));
+    }
+
+    // We release the vCPU again in sys_finish. From then on, only ECs on the new CPU can acquire it.
+    vcpu->migrate(r->cpu());
+    sys_finish(Sys_regs::SUCCESS);
+}
+
+void Ec::sys_vcpu_ept_views()
+{
+    Sys_vcpu_ept_views* r = static_cast<Sys_vcpu_ept_views*>(current()->sys_regs());
+    trace(TRACE_SYSCALL, "EC:%p, SYS_VCPU_EPT_VIEWS VCPU: %#lx COUNT: %#lx", current(), r->sel(), r->count());
+
+    if (EXPECT_FALSE(not Vmcs::has_eptp_switching())) {
+        trace(TRACE_ERROR, "%s: EPTP switching is not supported", __func__);
+        sys_finish(Sys_regs::BAD_FTR);
+    }
+
+    Vcpu* vcpu = capability_cast<Vcpu>(Space_obj::lookup(r->sel()));
+    if (EXPECT_FALSE(not vcpu)) {
+        trace(TRACE_ERROR, "%s: Bad vCPU CAP (%#lx)", __func__, r->sel());
+        sys_finish(Sys_regs::BAD_CAP);
+    }
+
+    // View 0 is always the PD of the vCPU.
+    if (EXPECT_FALSE(r->count() >= Vcpu::MAX_EPT_VIEWS)) {
+        trace(TRACE_ERROR, "%s: Invalid number of views (%lu)", __func__, r->count());
+        sys_finish(Sys_regs::BAD_PAR);
+    }
+
+    Pd* views[Vcpu::MAX_EPT_VIEWS - 1];
+
+    for (mword i{0}; i < r->count(); i++) {
+        mword const sel{current()->utcb->mr(i)};
+
+        views[i] = capability_cast<Pd>(Space_obj::lookup(sel), Pd::PERM_OBJ_CREATION);
+
+        if (EXPECT_FALSE(not views[i])) {
+            trace(TRACE_ERROR, "%s: Non-PD CAP (%#lx)", __func__, sel);
+            sys_finish(Sys_regs::BAD_CAP);
+        }
+    }
+
+    auto result{Ec::try_acquire_vcpu(vcpu)};
+
+    if (result.is_err()) {
+        trace(TRACE_ERROR, "Refusing to claim vCPU.");
+        sys_finish(result.map_err([](auto e) { return to_syscall_status(e); }));
+    }
+
+    // We release the vCPU again in sys_finish.
+    vcpu->set_ept_views(views, static_cast<unsigned>(r->count()));
+    sys_finish(Sys_regs::SUCCESS);
+}
+
+void Ec::sys_vcpu_ctrl()
+{
+    Sys_vcpu_ctrl* r = static_cast<Sys_vcpu_ctrl*>(current()->sys_regs());
+
+    switch (r->op()) {
+    case Sys_vcpu_ctrl::RUN: {
+        sys_vcpu_ctrl_run();
+    }
+    case Sys_vcpu_ctrl::POKE: {
+        sys_vcpu_ctrl_poke();
+    }
+    case Sys_vcpu_ctrl::EXIT_POLICY: {
+        sys_vcpu_ctrl_exit_policy();
+    }
+    case Sys_vcpu_ctrl::MTD_PROFILE: {
+        sys_vcpu_ctrl_mtd_profile();
+    }
+    case Sys_vcpu_ctrl::PML: {
+        sys_vcpu_ctrl_pml();
+    }
+    case Sys_vcpu_ctrl::HARVEST_DIRTY: {
+        sys_vcpu_ctrl_harvest_dirty();
+    }
+    case Sys_vcpu_ctrl::POST_INTR: {
+        sys_vcpu_ctrl_post_intr();
+    }
+    case Sys_vcpu_ctrl::EXIT_STATS: {
+        sys_vcpu_ctrl_exit_stats();
+    }
+    case Sys_vcpu_ctrl::VMCS_SHADOW: {
+        sys_vcpu_ctrl_vmcs_shadow();
+    }
+    case Sys_vcpu_ctrl::VMCS_SHADOW_ACCESS: {
+        sys_vcpu_ctrl_vmcs_shadow_access();
+    }
+    case Sys_vcpu_ctrl::POKE_BATCH: {
+        sys_vcpu_ctrl_poke_batch();
+    }
+    case Sys_vcpu_ctrl::PMU: {
+        sys_vcpu_ctrl_pmu();
+    }
+    case Sys_vcpu_ctrl::SNAPSHOT: {
+        sys_vcpu_ctrl_snapshot();
+    }
+    case Sys_vcpu_ctrl::IOEVENT: {
+        sys_vcpu_ctrl_ioevent();
+    }
+    case Sys_vcpu_ctrl::IO_RING: {
+        sys_vcpu_ctrl_io_ring();
+    }
+    case Sys_vcpu_ctrl::VMCALL_PORTAL: {
+        sys_vcpu_ctrl_vmcall_portal();
+    }
+    };
+
+    sys_finish<Sys_regs::BAD_PAR>();
+}
+
+void Ec::sys_batch()
+{
+    Sys_batch* r = static_cast<Sys_batch*>(current()->sys_regs());
+
+    // A repeated entry only occupies the first entry in the UTCB, no matter how often it runs.
+    mword const max_entries{Utcb::words / Sys_batch::ENTRY_WORDS};
+
+    if (EXPECT_FALSE(r->count() == 0 or (not r->repeat() and r->count() > max_entries))) {
+        trace(TRACE_ERROR, "%s: Invalid number of entries (%lu)", __func__, r->count());
+        sys_finish<Sys_regs::BAD_PAR>();
+    }
+
+    current()->batch_idx = 0;
+    current()->batch_cnt = r->count();
+    current()->batch_repeat = r->repeat();
+
+    sys_batch_dispatch();
+}
+
+void Ec::sys_batch_dispatch()
+{
+    Ec* ec = current();
+    Sys_batch* r = static_cast<Sys_batch*>(ec->sys_regs());
+
+    if (ec->batch_repeat) {
+        // We read the entry again each time, because the previous execution overwrote the registers.
+        r->load_entry(&ec->utcb->mr(0));
+
+        // The other system calls have no selector in ARG1 and run unchanged each time.
+        if (r->creates_object()) {
+            r->offset_selector(ec->batch_idx);
+        }
+    } else {
+        r->load_entry(&ec->utcb->mr(ec->batch_idx * Sys_batch::ENTRY_WORDS));
+    }
+
+    // Only hypercalls that return to the caller are allowed in a batch. Everything that switches to another
+    // EC or enters a vCPU would leave the batch in an undefined state.
+    switch (r->id()) {
+    case hypercall_id::HC_REVOKE:
+        sys_revoke();
+    case hypercall_id::HC_CREATE_EC:
+        sys_create_ec();
+    case hypercall_id::HC_CREATE_SC:
+        sys_create_sc();
+    case hypercall_id::HC_CREATE_PT:
+        sys_create_pt();
+    case hypercall_id::HC_CREATE_SM:
+        sys_create_sm();
+    case hypercall_id::HC_CREATE_KP:
+        sys_create_kp();
+    case hypercall_id::HC_PD_CTRL:
+        sys_pd_ctrl();
+    case hypercall_id::HC_SC_CTRL:
+        sys_sc_ctrl();
+    case hypercall_id::HC_PT_CTRL:
+        sys_pt_ctrl();
+    case hypercall_id::HC_SM_CTRL:
+        sys_sm_ctrl();
+    case hypercall_id::HC_KP_CTRL:
+        sys_kp_ctrl();
+
+    default:
+        sys_finish<Sys_regs::BAD_HYP>();
+    }
+}
+
+void Ec::sys_batch_next()
+{
+    Ec* ec = current();
+    Sys_batch* r = static_cast<Sys_batch*>(ec->sys_regs());
+    auto const status{static_cast<Sys_regs::Status>(r->status())};
+
+    // A repeated entry is the template for all executions and must stay intact.
+    if (not ec->batch_repeat) {
+        r->store_entry(&ec->utcb->mr(ec->batch_idx * Sys_batch::ENTRY_WORDS));
+    }
+
+    // The batch stops at the first entry that does not succeed. The caller learns how many entries were
+    // processed and the status of the last one.
+    if (++ec->batch_idx == ec->batch_cnt or status != Sys_regs::SUCCESS) {
+        r->set_result(status, ec->batch_idx);
+        ec->batch_cnt = 0;
+
+        ret_user_sysexit();
+    }
+
+    // Long batches must not delay rescheduling.
+    ec->cont = sys_batch_dispatch;
+    handle_hazards(sys_batch_dispatch);
+
+    // Each entry ends in another noreturn handler, so we need to reset the kernel stack between entries.
+    ec->return_to_user();
+}
+
+void Ec::syscall_handler()
+{
+    Sched_stats::count(&Sched_stats::syscall_cnt);
+    Sched_stats::enter_kernel(&Sched_stats::syscall_tsc);
+
+    if constexpr (Event_trace::syscall_args()) {
+        Sys_regs const* const r{current()->sys_regs()};
+
+        // The entries of one system call are recorded back to back on this CPU, so the sequence numbers tell
+        // user space which ones belong together.
+        Event_trace::record(Event_trace::SYSCALL, static_cast<uint32>(r->ARG_1),
+                            static_cast<uint32>(r->ARG_1 >> 32), static_cast<uint32>(r->ARG_2),
+                            static_cast<uint32>(r->ARG_2 >> 32));
+        Event_trace::record(Event_trace::SYSCALL_ARG3, static_cast<uint32>(r->ARG_3),
+                            static_cast<uint32>(r->ARG_3 >> 32), static_cast<uint32>(r->ARG_4),
+                            static_cast<uint32>(r->ARG_4 >> 32));
+        Event_trace::record(Event_trace::SYSCALL_ARG5, static_cast<uint32>(r->ARG_5),
+                            static_cast<uint32>(r->ARG_5 >> 32));
+    } else {
+        Event_trace::record(Event_trace::SYSCALL, static_cast<uint32>(current()->sys_regs()->ARG_1));
+    }
+
+    // System call handler functions are all marked noreturn.
+
+    switch (current()->sys_regs()->id()) {
+    case hypercall_id::HC_CALL:
+        sys_call();
+    case hypercall_id::HC_REPLY:
+        sys_reply();
+    case hypercall_id::HC_REVOKE:
+        sys_revoke();
+
+    case hypercall_id::HC_CREATE_PD:
+        sys_create_pd();
+    case hypercall_id::HC_CREATE_EC:
+        sys_create_ec();
+    case hypercall_id::HC_CREATE_SC:
+        sys_create_sc();
+    case hypercall_id::HC_CREATE_PT:
+        sys_create_pt();
+    case hypercall_id::HC_CREATE_SM:
+        sys_create_sm();
+    case hypercall_id::HC_CREATE_KP:
+        sys_create_kp();
+    case hypercall_id::HC_CREATE_VCPU:
+        sys_create_vcpu();
+
+    case hypercall_id::HC_PD_CTRL:
+        sys_pd_ctrl();
+    case hypercall_id::HC_EC_CTRL:
+        sys_ec_ctrl();
+    case hypercall_id::HC_SC_CTRL:
+        sys_sc_ctrl();
+    case hypercall_id::HC_PT_CTRL:
+        sys_pt_ctrl();
+    case hypercall_id::HC_SM_CTRL:
+        sys_sm_ctrl();
+    case hypercall_id::HC_KP_CTRL:
+        sys_kp_ctrl();
+    case hypercall_id::HC_VCPU_CTRL:
+        sys_vcpu_ctrl();
+    case hypercall_id::HC_VCPU_MIGRATE:
+        sys_vcpu_migrate();
+    case hypercall_id::HC_VCPU_EPT_VIEWS:
+        sys_vcpu_ept_views();
+
+    case hypercall_id::HC_MACHINE_CTRL:
+        sys_machine_ctrl();
+
+    case hypercall_id::HC_BATCH:
+        sys_batch();
 
     default:
         Ec::sys_finish<Sys_regs::BAD_HYP>();
@@ -0,0 +1,110 @@
+/*
+ * TLB cleanup and lazy page reclamation
+ *
+ * This file is part of the Hedron hypervisor.
+ *
+ * Hedron is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Hedron is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License version 2 for more details.
+ */
+
+#include "tlb_cleanup.hpp"
+#include "buddy.hpp"
+#include "cpulocal.hpp"
+#include "rcu.hpp"
+#include "slab.hpp"
+
+namespace
+{
+
+// Pages that were reclaimed after their grace period go to the page table cache of the current CPU first,
+// because new page tables often follow soon, e.g. when a VMM remaps guest memory. The pages of a whole
+// memory space that is destroyed only go back to the buddy allocator.
+void free_page_list(Tlb_cleanup::pointer page, bool cache)
+{
+    while (page) {
+        mword const next{Buddy::allocator.next_used(reinterpret_cast<mword>(page))};
+
+        if (cache) {
+            Buddy::allocator.free_page_table(reinterpret_cast<mword>(page));
+        } else {
+            Buddy::allocator.free(reinterpret_cast<mword>(page));
+        }
+
+        page = reinterpret_cast<Tlb_cleanup::pointer>(next);
+    }
+}
+
+// Carries a list of page table pages through an RCU grace period.
+//
+// The RCU element cannot live in one of the pages itself, because software page table walks may still
+// interpret its content as page table entries until the grace period is over.
+class Page_list_rcu : public Rcu_elem
+{
+    static Slab_cache cache;
+
+    Tlb_cleanup::pointer const pages;
+
+    static void free(Rcu_elem* e)
+    {
+        Page_list_rcu* const list{static_cast<Page_list_rcu*>(e)};
+
+        free_page_list(list->pages, true);
+        delete list;
+    }
+
+public:
+    explicit Page_list_rcu(Tlb_cleanup::pointer pages_) : Rcu_elem(free), pages(pages_) {}
+
+    static inline void* operator new(size_t) { return cache.alloc(); }
+    static inline void operator delete(void* ptr) { cache.free(ptr); }
+};
+
+INIT_PRIORITY(PRIO_SLAB)
+Slab_cache Page_list_rcu::cache{Slab_cache::create<Page_list_rcu, 32>()};
+
+} // namespace
+
+void Tlb_cleanup::append(pointer first, pointer last)
+{
+    Buddy::allocator.set_next_used(reinterpret_cast<mword>(last), 0);
+
+    if (pages_last_) {
+        Buddy::allocator.set_next_used(reinterpret_cast<mword>(pages_last_), reinterpret_cast<mword>(first));
+    } else {
+        pages_ = first;
+    }
+
+    pages_last_ = last;
+}
+
+void Tlb_cleanup::free_pages_now()
+{
+    assert(not tlb_flush_);
+
+    free_page_list(pages_, false);
+
+    pages_ = nullptr;
+    pages_last_ = nullptr;
+}
+
+void Tlb_cleanup::free_pages_deferred()
+{
+    // Before CPU-local memory is set up, there is no RCU and only the boot CPU runs. The code that changes
+    // page tables this early flushes the TLB itself.
+    if (EXPECT_FALSE(not Cpulocal::is_initialized())) {
+        ignore_tlb_flush();
+        free_pages_now();
+        return;
+    }
+
+    Rcu::call(new Page_list_rcu(pages_));
+
+    pages_ = nullptr;
+    pages_last_ = nullptr;
+}
@@ -29,114 +29,58 @@
 #include "mtd.hpp"
 #include "regs.hpp"
 #include "vmx.hpp"
+#include "vmx_exit_cache.hpp"
 #include "vmx_preemption_timer.hpp"
 #include "x86.hpp"
 
-bool Utcb::load_exc(Cpu_regs* regs)
+namespace
 {
-    mword m = regs->mtd;
 
-    if (m & Mtd::GPR_ACDB) {
-        rax = regs->rax;
-        rcx = regs->rcx;
-        rdx = regs->rdx;
-        rbx = regs->rbx;
-    }
-
-    if (m & Mtd::GPR_BSD) {
-        rbp = regs->rbp;
-        rsi = regs->rsi;
-        rdi = regs->rdi;
-    }
-
-    if (m & Mtd::GPR_R8_R15) {
-        r8 = regs->r8;
-        r9 = regs->r9;
-        r10 = regs->r10;
-        r11 = regs->r11;
-        r12 = regs->r12;
-        r13 = regs->r13;
-        r14 = regs->r14;
-        r15 = regs->r15;
-    }
-
-    if (m & Mtd::RSP)
-        rsp = regs->rsp;
-
-    if (m & Mtd::RIP_LEN)
-        rip = regs->rip;
-
-    if (m & Mtd::RFLAGS)
-        rflags = regs->rfl;
-
-    if (m & Mtd::QUAL) {
-        qual[0] = regs->err;
-        qual[1] = regs->cr2;
-    }
-
-    barrier();
-    mtd = m;
-    items = sizeof(Utcb_data) / sizeof(mword);
-
-    return m & Mtd::FPU;
-}
-
-bool Utcb::save_exc(Cpu_regs* regs)
+// The MTDs that VMMs commonly use on the vCPU exit path. load_vmx and save_vmx have copies of their field
+// transfers that are specialized for these.
+//
+// The whole state is what vCPU exits transfer without an MTD profile (see Vcpu::return_to_vmm). The others
+// are typical for CPUID, I/O port accesses, MMIO accesses that cause EPT violations and HLT: The VMM
+// reads the few registers that it emulates the instruction with and writes back the results and the next RIP.
+constexpr mword PROFILE_ALL{Mtd::VMX_EXIT_STATE};
+constexpr mword PROFILE_ALL_NO_VINTR{Mtd::VMX_EXIT_STATE & ~Mtd::VINTR};
+constexpr mword PROFILE_CPUID{Mtd::GPR_ACDB | Mtd::RIP_LEN};
+constexpr mword PROFILE_IO{Mtd::GPR_ACDB | Mtd::RIP_LEN | Mtd::QUAL};
+constexpr mword PROFILE_EPT{Mtd::GPR_ACDB | Mtd::GPR_BSD | Mtd::GPR_R8_R15 | Mtd::RSP | Mtd::RIP_LEN |
+                            Mtd::QUAL};
+constexpr mword PROFILE_HLT{Mtd::RIP_LEN | Mtd::INJ | Mtd::STA};
+constexpr mword PROFILE_RIP{Mtd::RIP_LEN};
+constexpr mword PROFILE_RIP_STA{Mtd::RIP_LEN | Mtd::STA};
+
+// Whether the MTD m contains bit. A PROFILE other than zero is the value of m, so the answer is known at
+// compile time and the code for all other bits drops out.
+template <mword PROFILE> constexpr bool has(mword m, mword bit)
 {
-    if (mtd & Mtd::GPR_ACDB) {
-        regs->rax = rax;
-        regs->rcx = rcx;
-        regs->rdx = rdx;
-        regs->rbx = rbx;
-    }
-
-    if (mtd & Mtd::GPR_BSD) {
-        regs->rbp = rbp;
-        regs->rsi = rsi;
-        regs->rdi = rdi;
+    if constexpr (PROFILE == 0) {
+        return m & bit;
+    } else {
+        return PROFILE & bit;
     }
-
-    if (mtd & Mtd::GPR_R8_R15) {
-        regs->r8 = r8;
-        regs->r9 = r9;
-        regs->r10 = r10;
-        regs->r11 = r11;
-        regs->r12 = r12;
-        regs->r13 = r13;
-        regs->r14 = r14;
-        regs->r15 = r15;
-    }
-
-    if (mtd & Mtd::RSP)
-        regs->rsp = rsp;
-
-    if (mtd & Mtd::RIP_LEN)
-        regs->rip = rip;
-
-    if (mtd & Mtd::RFLAGS)
-        regs->rfl = rflags & ~(Cpu::EFL_VIP | Cpu::EFL_VIF | Cpu::EFL_VM | Cpu::EFL_RF | Cpu::EFL_IOPL);
-
-    return mtd & Mtd::FPU;
 }
 
-void Utcb::load_vmx(Cpu_regs* regs)
-{
-    mword m = regs->mtd;
+} // namespace
 
-    if (m & Mtd::GPR_ACDB) {
+template <mword PROFILE> void Utcb::load_vmx_fields(Cpu_regs* regs, mword m, Vmx_exit_cache& exit_info)
+{
+    if (has<PROFILE>(m, Mtd::GPR_ACDB)) {
         rax = regs->rax;
         rcx = regs->rcx;
         rdx = regs->rdx;
         rbx = regs->rbx;
     }
 
-    if (m & Mtd::GPR_BSD) {
+    if (has<PROFILE>(m, Mtd::GPR_BSD)) {
         rbp = regs->rbp;
         rsi = regs->rsi;
         rdi = regs->rdi;
     }
 
-    if (m & Mtd::GPR_R8_R15) {
+    if (has<PROFILE>(m, Mtd::GPR_R8_R15)) {
         r8 = regs->r8;
         r9 = regs->r9;
         r10 = regs->r10;
@@ -149,53 +93,53 @@ void Utcb::load_vmx(Cpu_regs* regs)
 
     regs->vmcs->make_current();
 
-    if (m & Mtd::RSP)
+    if (has<PROFILE>(m, Mtd::RSP))
         rsp = Vmcs::read(Vmcs::GUEST_RSP);
 
-    if (m & Mtd::RIP_LEN) {
+    if (has<PROFILE>(m, Mtd::RIP_LEN)) {
         rip = Vmcs::read(Vmcs::GUEST_RIP);
-        inst_len = Vmcs::read(Vmcs::EXI_INST_LEN);
+        inst_len = exit_info.read<Vmcs::EXI_INST_LEN>();
     }
 
-    if (m & Mtd::RFLAGS)
+    if (has<PROFILE>(m, Mtd::RFLAGS))
         rflags = Vmcs::read(Vmcs::GUEST_RFLAGS);
 
-    if (m & Mtd::DS_ES) {
+    if (has<PROFILE>(m, Mtd::DS_ES)) {
         ds.set_vmx(Vmcs::read(Vmcs::GUEST_SEL_DS), Vmcs::read(Vmcs::GUEST_BASE_DS),
                    Vmcs::read(Vmcs::GUEST_LIMIT_DS), Vmcs::read(Vmcs::GUEST_AR_DS));
         es.set_vmx(Vmcs::read(Vmcs::GUEST_SEL_ES), Vmcs::read(Vmcs::GUEST_BASE_ES),
                    Vmcs::read(Vmcs::GUEST_LIMIT_ES), Vmcs::read(Vmcs::GUEST_AR_ES));
     }
 
-    if (m & Mtd::FS_GS) {
+    if (has<PROFILE>(m, Mtd::FS_GS)) {
         fs.set_vmx(Vmcs::read(Vmcs::GUEST_SEL_FS), Vmcs::read(Vmcs::GUEST_BASE_FS),
                    Vmcs::read(Vmcs::GUEST_LIMIT_FS), Vmcs::read(Vmcs::GUEST_AR_FS));
         gs.set_vmx(Vmcs::read(Vmcs::GUEST_SEL_GS), Vmcs::read(Vmcs::GUEST_BASE_GS),
                    Vmcs::read(Vmcs::GUEST_LIMIT_GS), Vmcs::read(Vmcs::GUEST_AR_GS));
     }
 
-    if (m & Mtd::CS_SS) {
+    if (has<PROFILE>(m, Mtd::CS_SS)) {
         cs.set_vmx(Vmcs::read(Vmcs::GUEST_SEL_CS), Vmcs::read(Vmcs::GUEST_BASE_CS),
                    Vmcs::read(Vmcs::GUEST_LIMIT_CS), Vmcs::read(Vmcs::GUEST_AR_CS));
         ss.set_vmx(Vmcs::read(Vmcs::GUEST_SEL_SS), Vmcs::read(Vmcs::GUEST_BASE_SS),
                    Vmcs::read(Vmcs::GUEST_LIMIT_SS), Vmcs::read(Vmcs::GUEST_AR_SS));
     }
 
-    if (m & Mtd::TR)
+    if (has<PROFILE>(m, Mtd::TR))
         tr.set_vmx(Vmcs::read(Vmcs::GUEST_SEL_TR), Vmcs::read(Vmcs::GUEST_BASE_TR),
                    Vmcs::read(Vmcs::GUEST_LIMIT_TR), Vmcs::read(Vmcs::GUEST_AR_TR));
 
-    if (m & Mtd::LDTR)
+    if (has<PROFILE>(m, Mtd::LDTR))
         ld.set_vmx(Vmcs::read(Vmcs::GUEST_SEL_LDTR), Vmcs::read(Vmcs::GUEST_BASE_LDTR),
                    Vmcs::read(Vmcs::GUEST_LIMIT_LDTR), Vmcs::read(Vmcs::GUEST_AR_LDTR));
 
-    if (m & Mtd::GDTR)
+    if (has<PROFILE>(m, Mtd::GDTR))
         gd.set_vmx(0, Vmcs::read(Vmcs::GUEST_BASE_GDTR), Vmcs::read(Vmcs::GUEST_LIMIT_GDTR), 0);
 
-    if (m & Mtd::IDTR)
+    if (has<PROFILE>(m, Mtd::IDTR))
         id.set_vmx(0, Vmcs::read(Vmcs::GUEST_BASE_IDTR), Vmcs::read(Vmcs::GUEST_LIMIT_IDTR), 0);
 
-    if (m & Mtd::CR) {
+    if (has<PROFILE>(m, Mtd::CR)) {
         cr0 = regs->read_cr<Vmcs>(0);
         cr2 = regs->read_cr<Vmcs>(2);
         cr3 = regs->read_cr<Vmcs>(3);
@@ -204,38 +148,38 @@ void Utcb::load_vmx(Cpu_regs* regs)
         spec_ctrl = regs->spec_ctrl;
     }
 
-    if (m & Mtd::DR)
+    if (has<PROFILE>(m, Mtd::DR))
         dr7 = Vmcs::read(Vmcs::GUEST_DR7);
 
-    if (m & Mtd::SYSENTER) {
+    if (has<PROFILE>(m, Mtd::SYSENTER)) {
         sysenter_cs = Vmcs::read(Vmcs::GUEST_SYSENTER_CS);
         sysenter_rsp = Vmcs::read(Vmcs::GUEST_SYSENTER_ESP);
         sysenter_rip = Vmcs::read(Vmcs::GUEST_SYSENTER_EIP);
     }
 
-    if (m & Mtd::QUAL) {
-        qual[0] = Vmcs::read(Vmcs::EXI_QUALIFICATION);
-        qual[1] = Vmcs::read(Vmcs::INFO_PHYS_ADDR);
+    if (has<PROFILE>(m, Mtd::QUAL)) {
+        qual[0] = exit_info.read<Vmcs::EXI_QUALIFICATION>();
+        qual[1] = exit_info.read<Vmcs::INFO_PHYS_ADDR>();
     }
 
-    if (m & Mtd::INJ) {
+    if (has<PROFILE>(m, Mtd::INJ)) {
         if (regs->dst_portal == Vmcs::VMX_FAIL_STATE || regs->dst_portal == Vmcs::VMX_POKED) {
             intr_info = static_cast<uint32>(Vmcs::read(Vmcs::ENT_INTR_INFO));
             intr_error = static_cast<uint32>(Vmcs::read(Vmcs::ENT_INTR_ERROR));
         } else {
-            intr_info = static_cast<uint32>(Vmcs::read(Vmcs::EXI_INTR_INFO));
-            intr_error = static_cast<uint32>(Vmcs::read(Vmcs::EXI_INTR_ERROR));
-            vect_info = static_cast<uint32>(Vmcs::read(Vmcs::IDT_VECT_INFO));
-            vect_error = static_cast<uint32>(Vmcs::read(Vmcs::IDT_VECT_ERROR));
+            intr_info = static_cast<uint32>(exit_info.read<Vmcs::EXI_INTR_INFO>());
+            intr_error = static_cast<uint32>(exit_info.read<Vmcs::EXI_INTR_ERROR>());
+            vect_info = static_cast<uint32>(exit_info.read<Vmcs::IDT_VECT_INFO>());
+            vect_error = static_cast<uint32>(exit_info.read<Vmcs::IDT_VECT_ERROR>());
         }
     }
 
-    if (m & Mtd::STA) {
+    if (has<PROFILE>(m, Mtd::STA)) {
         intr_state = static_cast<uint32>(Vmcs::read(Vmcs::GUEST_INTR_STATE));
         actv_state = static_cast<uint32>(Vmcs::read(Vmcs::GUEST_ACTV_STATE));
     }
 
-    if (m & Mtd::TSC) {
+    if (has<PROFILE>(m, Mtd::TSC)) {
         tsc_val = rdtsc();
         tsc_off = Vmcs::read(Vmcs::TSC_OFFSET);
 
@@ -244,16 +188,20 @@ void Utcb::load_vmx(Cpu_regs* regs)
         tsc_aux = static_cast<uint32>(guest_msr_area->ia32_tsc_aux.msr_data);
     }
 
-    if (m & Mtd::TSC_TIMEOUT) {
+    if (has<PROFILE>(m, Mtd::TSC_TIMEOUT)) {
         tsc_timeout = vmx_timer::get();
     }
 
-    if (m & Mtd::EFER_PAT) {
+    if (has<PROFILE>(m, Mtd::TSC_SCALE)) {
+        tsc_multiplier = Vmcs::has_tsc_scaling() ? Vmcs::read(Vmcs::TSC_MULTIPLIER) : 1ul << 48;
+    }
+
+    if (has<PROFILE>(m, Mtd::EFER_PAT)) {
         efer = Vmcs::read(Vmcs::GUEST_EFER);
         pat = Vmcs::read(Vmcs::GUEST_PAT);
     }
 
-    if (m & Mtd::SYSCALL_SWAPGS) {
+    if (has<PROFILE>(m, Mtd::SYSCALL_SWAPGS)) {
         mword guest_msr_area_phys = Vmcs::read(Vmcs::EXI_MSR_ST_ADDR);
         Msr_area* guest_msr_area = reinterpret_cast<Msr_area*>(Buddy::phys_to_ptr(guest_msr_area_phys));
         star = guest_msr_area->ia32_star.msr_data;
@@ -262,25 +210,25 @@ void Utcb::load_vmx(Cpu_regs* regs)
         kernel_gs_base = guest_msr_area->ia32_kernel_gs_base.msr_data;
     }
 
-    if (m & Mtd::PDPTE) {
+    if (has<PROFILE>(m, Mtd::PDPTE)) {
         pdpte[0] = Vmcs::read(Vmcs::GUEST_PDPTE0);
         pdpte[1] = Vmcs::read(Vmcs::GUEST_PDPTE1);
         pdpte[2] = Vmcs::read(Vmcs::GUEST_PDPTE2);
         pdpte[3] = Vmcs::read(Vmcs::GUEST_PDPTE3);
     }
 
-    if (m & Mtd::TPR) {
+    if (has<PROFILE>(m, Mtd::TPR)) {
         tpr_threshold = static_cast<uint32>(Vmcs::read(Vmcs::TPR_THRESHOLD));
     }
 
-    if (m & Mtd::EOI) {
+    if (has<PROFILE>(m, Mtd::EOI)) {
         eoi_bitmap[0] = Vmcs::read(Vmcs::EOI_EXIT_BITMAP_0);
         eoi_bitmap[1] = Vmcs::read(Vmcs::EOI_EXIT_BITMAP_1);
         eoi_bitmap[2] = Vmcs::read(Vmcs::EOI_EXIT_BITMAP_2);
         eoi_bitmap[3] = Vmcs::read(Vmcs::EOI_EXIT_BITMAP_3);
     }
 
-    if (m & Mtd::VINTR) {
+    if (has<PROFILE>(m, Mtd::VINTR)) {
         vintr_status = static_cast<uint16>(Vmcs::read(Vmcs::GUEST_INTR_STS));
     }
 
@@ -289,26 +237,22 @@ void Utcb::load_vmx(Cpu_regs* regs)
     items = sizeof(Utcb_data) / sizeof(mword);
 }
 
-void Utcb::save_vmx(Cpu_regs* regs, const bool passthrough_vcpu)
+template <mword PROFILE> void Utcb::save_vmx_fields(Cpu_regs* regs, mword m, const bool passthrough_vcpu)
 {
-    if (mtd == 0) {
-        return;
-    }
-
-    if (mtd & Mtd::GPR_ACDB) {
+    if (has<PROFILE>(m, Mtd::GPR_ACDB)) {
         regs->rax = rax;
         regs->rcx = rcx;
         regs->rdx = rdx;
         regs->rbx = rbx;
     }
 
-    if (mtd & Mtd::GPR_BSD) {
+    if (has<PROFILE>(m, Mtd::GPR_BSD)) {
         regs->rbp = rbp;
         regs->rsi = rsi;
         regs->rdi = rdi;
     }
 
-    if (mtd & Mtd::GPR_R8_R15) {
+    if (has<PROFILE>(m, Mtd::GPR_R8_R15)) {
         regs->r8 = r8;
         regs->r9 = r9;
         regs->r10 = r10;
@@ -321,18 +265,18 @@ void Utcb::save_vmx(Cpu_regs* regs, const bool passthrough_vcpu)
 
     regs->vmcs->make_current();
 
-    if (mtd & Mtd::RSP)
+    if (has<PROFILE>(m, Mtd::RSP))
         Vmcs::write(Vmcs::GUEST_RSP, rsp);
 
-    if (mtd & Mtd::RIP_LEN) {
+    if (has<PROFILE>(m, Mtd::RIP_LEN)) {
         Vmcs::write(Vmcs::GUEST_RIP, rip);
         Vmcs::write(Vmcs::ENT_INST_LEN, inst_len);
     }
 
-    if (mtd & Mtd::RFLAGS)
+    if (has<PROFILE>(m, Mtd::RFLAGS))
         Vmcs::write(Vmcs::GUEST_RFLAGS, rflags);
 
-    if (mtd & Mtd::DS_ES) {
+    if (has<PROFILE>(m, Mtd::DS_ES)) {
         Vmcs::write(Vmcs::GUEST_SEL_DS, ds.sel);
         Vmcs::write(Vmcs::GUEST_BASE_DS, static_cast<mword>(ds.base));
         Vmcs::write(Vmcs::GUEST_LIMIT_DS, ds.limit);
@@ -343,7 +287,7 @@ void Utcb::save_vmx(Cpu_regs* regs, const bool passthrough_vcpu)
         Vmcs::write(Vmcs::GUEST_AR_ES, (es.ar << 4 & 0x1f000) | (es.ar & 0xff));
     }
 
-    if (mtd & Mtd::FS_GS) {
+    if (has<PROFILE>(m, Mtd::FS_GS)) {
         Vmcs::write(Vmcs::GUEST_SEL_FS, fs.sel);
         Vmcs::write(Vmcs::GUEST_BASE_FS, static_cast<mword>(fs.base));
         Vmcs::write(Vmcs::GUEST_LIMIT_FS, fs.limit);
@@ -354,7 +298,7 @@ void Utcb::save_vmx(Cpu_regs* regs, const bool passthrough_vcpu)
         Vmcs::write(Vmcs::GUEST_AR_GS, (gs.ar << 4 & 0x1f000) | (gs.ar & 0xff));
     }
 
-    if (mtd & Mtd::CS_SS) {
+    if (has<PROFILE>(m, Mtd::CS_SS)) {
         Vmcs::write(Vmcs::GUEST_SEL_CS, cs.sel);
         Vmcs::write(Vmcs::GUEST_BASE_CS, static_cast<mword>(cs.base));
         Vmcs::write(Vmcs::GUEST_LIMIT_CS, cs.limit);
@@ -365,31 +309,31 @@ void Utcb::save_vmx(Cpu_regs* regs, const bool passthrough_vcpu)
         Vmcs::write(Vmcs::GUEST_AR_SS, (ss.ar << 4 & 0x1f000) | (ss.ar & 0xff));
     }
 
-    if (mtd & Mtd::TR) {
+    if (has<PROFILE>(m, Mtd::TR)) {
         Vmcs::write(Vmcs::GUEST_SEL_TR, tr.sel);
         Vmcs::write(Vmcs::GUEST_BASE_TR, static_cast<mword>(tr.base));
         Vmcs::write(Vmcs::GUEST_LIMIT_TR, tr.limit);
         Vmcs::write(Vmcs::GUEST_AR_TR, (tr.ar << 4 & 0x1f000) | (tr.ar & 0xff));
     }
 
-    if (mtd & Mtd::LDTR) {
+    if (has<PROFILE>(m, Mtd::LDTR)) {
         Vmcs::write(Vmcs::GUEST_SEL_LDTR, ld.sel);
         Vmcs::write(Vmcs::GUEST_BASE_LDTR, static_cast<mword>(ld.base));
         Vmcs::write(Vmcs::GUEST_LIMIT_LDTR, ld.limit);
         Vmcs::write(Vmcs::GUEST_AR_LDTR, (ld.ar << 4 & 0x1f000) | (ld.ar & 0xff));
     }
 
-    if (mtd & Mtd::GDTR) {
+    if (has<PROFILE>(m, Mtd::GDTR)) {
         Vmcs::write(Vmcs::GUEST_BASE_GDTR, static_cast<mword>(gd.base));
         Vmcs::write(Vmcs::GUEST_LIMIT_GDTR, gd.limit);
     }
 
-    if (mtd & Mtd::IDTR) {
+    if (has<PROFILE>(m, Mtd::IDTR)) {
         Vmcs::write(Vmcs::GUEST_BASE_IDTR, static_cast<mword>(id.base));
         Vmcs::write(Vmcs::GUEST_LIMIT_IDTR, id.limit);
     }
 
-    if (mtd & Mtd::CR) {
+    if (has<PROFILE>(m, Mtd::CR)) {
         regs->write_cr<Vmcs>(0, cr0);
         regs->write_cr<Vmcs>(2, cr2);
         regs->write_cr<Vmcs>(3, cr3);
@@ -398,16 +342,16 @@ void Utcb::save_vmx(Cpu_regs* regs, const bool passthrough_vcpu)
         regs->spec_ctrl = spec_ctrl;
     }
 
-    if (mtd & Mtd::DR)
+    if (has<PROFILE>(m, Mtd::DR))
         Vmcs::write(Vmcs::GUEST_DR7, dr7);
 
-    if (mtd & Mtd::SYSENTER) {
+    if (has<PROFILE>(m, Mtd::SYSENTER)) {
         Vmcs::write(Vmcs::GUEST_SYSENTER_CS, sysenter_cs);
         Vmcs::write(Vmcs::GUEST_SYSENTER_ESP, sysenter_rsp);
         Vmcs::write(Vmcs::GUEST_SYSENTER_EIP, sysenter_rip);
     }
 
-    if (mtd & Mtd::CTRL) {
+    if (has<PROFILE>(m, Mtd::CTRL)) {
         regs->vmx_set_cpu_ctrl0(ctrl[0], passthrough_vcpu);
         regs->vmx_set_cpu_ctrl1(ctrl[1], passthrough_vcpu);
         regs->exc_bitmap = exc_bitmap;
@@ -417,7 +361,7 @@ void Utcb::save_vmx(Cpu_regs* regs, const bool passthrough_vcpu)
         regs->set_exc<Vmcs>();
     }
 
-    if (mtd & Mtd::INJ) {
+    if (has<PROFILE>(m, Mtd::INJ)) {
 
         uint32 val = static_cast<uint32>(Vmcs::read(Vmcs::CPU_EXEC_CTRL0));
 
@@ -437,12 +381,12 @@ void Utcb::save_vmx(Cpu_regs* regs, const bool passthrough_vcpu)
         Vmcs::write(Vmcs::ENT_INTR_ERROR, intr_error);
     }
 
-    if (mtd & Mtd::STA) {
+    if (has<PROFILE>(m, Mtd::STA)) {
         Vmcs::write(Vmcs::GUEST_INTR_STATE, intr_state);
         Vmcs::write(Vmcs::GUEST_ACTV_STATE, actv_state);
     }
 
-    if (mtd & Mtd::TSC) {
+    if (has<PROFILE>(m, Mtd::TSC)) {
         Vmcs::write(Vmcs::TSC_OFFSET, tsc_off);
 
         mword guest_msr_area_phys = Vmcs::read(Vmcs::EXI_MSR_ST_ADDR);
@@ -450,16 +394,21 @@ void Utcb::save_vmx(Cpu_regs* regs, const bool passthrough_vcpu)
         guest_msr_area->ia32_tsc_aux.msr_data = tsc_aux;
     }
 
-    if (mtd & Mtd::TSC_TIMEOUT) {
+    if (has<PROFILE>(m, Mtd::TSC_TIMEOUT)) {
         vmx_timer::set(tsc_timeout);
     }
 
-    if (mtd & Mtd::EFER_PAT) {
+    // Without TSC scaling, the CPU can't enable it either, so the multiplier would have no effect.
+    if (has<PROFILE>(m, Mtd::TSC_SCALE) and Vmcs::has_tsc_scaling()) {
+        Vmcs::write(Vmcs::TSC_MULTIPLIER, tsc_multiplier);
+    }
+
+    if (has<PROFILE>(m, Mtd::EFER_PAT)) {
         regs->write_efer<Vmcs>(efer);
         Vmcs::write(Vmcs::GUEST_PAT, pat);
     }
 
-    if (mtd & Mtd::SYSCALL_SWAPGS) {
+    if (has<PROFILE>(m, Mtd::SYSCALL_SWAPGS)) {
         mword guest_msr_area_phys = Vmcs::read(Vmcs::EXI_MSR_ST_ADDR);
         Msr_area* guest_msr_area = reinterpret_cast<Msr_area*>(Buddy::phys_to_ptr(guest_msr_area_phys));
         guest_msr_area->ia32_star.msr_data = star;
@@ -468,29 +417,73 @@ void Utcb::save_vmx(Cpu_regs* regs, const bool passthrough_vcpu)
         guest_msr_area->ia32_kernel_gs_base.msr_data = kernel_gs_base;
     }
 
-    if (mtd & Mtd::PDPTE) {
+    if (has<PROFILE>(m, Mtd::PDPTE)) {
         Vmcs::write(Vmcs::GUEST_PDPTE0, pdpte[0]);
         Vmcs::write(Vmcs::GUEST_PDPTE1, pdpte[1]);
         Vmcs::write(Vmcs::GUEST_PDPTE2, pdpte[2]);
         Vmcs::write(Vmcs::GUEST_PDPTE3, pdpte[3]);
     }
 
-    if (mtd & Mtd::TLB) {
+    if (has<PROFILE>(m, Mtd::TLB)) {
         regs->tlb_flush<Vmcs>(true);
     }
 
-    if (mtd & Mtd::TPR) {
+    if (has<PROFILE>(m, Mtd::TPR)) {
         Vmcs::write(Vmcs::TPR_THRESHOLD, tpr_threshold);
     }
 
-    if (mtd & Mtd::EOI) {
+    if (has<PROFILE>(m, Mtd::EOI)) {
         Vmcs::write(Vmcs::EOI_EXIT_BITMAP_0, eoi_bitmap[0]);
         Vmcs::write(Vmcs::EOI_EXIT_BITMAP_1, eoi_bitmap[1]);
         Vmcs::write(Vmcs::EOI_EXIT_BITMAP_2, eoi_bitmap[2]);
         Vmcs::write(Vmcs::EOI_EXIT_BITMAP_3, eoi_bitmap[3]);
     }
 
-    if (mtd & Mtd::VINTR) {
+    if (has<PROFILE>(m, Mtd::VINTR)) {
         Vmcs::write(Vmcs::GUEST_INTR_STS, vintr_status);
     }
 }
+
+void Utcb::load_vmx(Cpu_regs* regs, Vmx_exit_cache& exit_info)
+{
+    mword const m{regs->mtd};
+
+    switch (m) {
+    case PROFILE_ALL:
+        return load_vmx_fields<PROFILE_ALL>(regs, m, exit_info);
+    case PROFILE_ALL_NO_VINTR:
+        return load_vmx_fields<PROFILE_ALL_NO_VINTR>(regs, m, exit_info);
+    case PROFILE_CPUID:
+        return load_vmx_fields<PROFILE_CPUID>(regs, m, exit_info);
+    case PROFILE_IO:
+        return load_vmx_fields<PROFILE_IO>(regs, m, exit_info);
+    case PROFILE_EPT:
+        return load_vmx_fields<PROFILE_EPT>(regs, m, exit_info);
+    case PROFILE_HLT:
+        return load_vmx_fields<PROFILE_HLT>(regs, m, exit_info);
+    default:
+        return load_vmx_fields<0>(regs, m, exit_info);
+    }
+}
+
+void Utcb::save_vmx(Cpu_regs* regs, const bool passthrough_vcpu)
+{
+    mword const m{mtd};
+
+    switch (m) {
+    case 0:
+        return;
+    case PROFILE_RIP:
+        return save_vmx_fields<PROFILE_RIP>(regs, m, passthrough_vcpu);
+    case PROFILE_RIP_STA:
+        return save_vmx_fields<PROFILE_RIP_STA>(regs, m, passthrough_vcpu);
+    case PROFILE_CPUID:
+        return save_vmx_fields<PROFILE_CPUID>(regs, m, passthrough_vcpu);
+    case PROFILE_IO:
+        return save_vmx_fields<PROFILE_IO>(regs, m, passthrough_vcpu);
+    case PROFILE_HLT:
+        return save_vmx_fields<PROFILE_HLT>(regs, m, passthrough_vcpu);
+    default:
+        return save_vmx_fields<0>(regs, m, passthrough_vcpu);
+    }
+}
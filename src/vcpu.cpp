@@ -17,24 +17,100 @@
 
 #include "vcpu.hpp"
 
+#include "algorithm.hpp"
 #include "atomic.hpp"
+#include "barrier.hpp"
 #include "counter.hpp"
 #include "cpu.hpp"
 #include "ec.hpp"
+#include "event_trace.hpp"
 #include "hip.hpp"
 #include "lapic.hpp"
+#include "lock_guard.hpp"
+#include "math.hpp"
+#include "microcode.hpp"
+#include "pmu.hpp"
+#include "pt.hpp"
+#include "rdt.hpp"
+#include "sc.hpp"
+#include "sched_stats.hpp"
+#include "sm.hpp"
 #include "space_obj.hpp"
+#include "spinlock.hpp"
 #include "stdio.hpp"
+#include "string.hpp"
+#include "time.hpp"
 #include "vmx_preemption_timer.hpp"
+#include "vpid.hpp"
 
 INIT_PRIORITY(PRIO_SLAB)
-Slab_cache Vcpu::cache(sizeof(Vcpu), 32);
+Slab_cache Vcpu::cache{Slab_cache::create<Vcpu, 32>()};
+
+namespace
+{
+
+// The VMX structures of destroyed vCPUs that new vCPUs on the same CPU can reuse. VMMs that create and
+// destroy vCPUs at a high rate would otherwise go to the page allocator three times for each of them.
+class Vcpu_pool
+{
+public:
+    // Pooled pages are not returned to the page allocator, so we keep only a few per CPU.
+    static constexpr unsigned SIZE{4};
+
+    struct Entry {
+        Vmcs* vmcs;
+        Msr_area* msr_area;
+        Vmx_msr_bitmap* msr_bitmap;
+    };
+
+    // Returns an entry with null pointers if the pool is empty.
+    Entry take()
+    {
+        Lock_guard<Spinlock> guard(lock);
+
+        return count ? entries[--count] : Entry{};
+    }
+
+    // Returns false if the pool is full. The caller keeps ownership of the structures then.
+    bool put(Entry const& entry)
+    {
+        Lock_guard<Spinlock> guard(lock);
+
+        if (count == SIZE) {
+            return false;
+        }
+
+        entries[count++] = entry;
+        return true;
+    }
+
+private:
+    Spinlock lock;
+    unsigned count{0};
+    Entry entries[SIZE]{};
+};
+
+Vcpu_pool vcpu_pools[NUM_CPU];
+
+// Construct an object in the page of a pooled object or in a new page, if there is none. The page is
+// cleared first, so nothing of the previous vCPU remains.
+template <typename T, typename... ARGS> Unique_ptr<T> reuse_or_make(T* pooled, ARGS&&... args)
+{
+    if (not pooled) {
+        return make_unique<T>(forward<ARGS>(args)...);
+    }
+
+    memset(pooled, 0, PAGE_SIZE);
+    return {::new (pooled) T(forward<ARGS>(args)...)};
+}
+
+} // namespace
 
 Vcpu::Vcpu(const Vcpu_init_config& init_cfg)
     : Typed_kobject(static_cast<Space_obj*>(init_cfg.owner_pd), init_cfg.cap_selector, Vcpu::PERM_ALL, free),
       pd(init_cfg.owner_pd), kp_vcpu_state(init_cfg.kp_vcpu_state), kp_vlapic_page(init_cfg.kp_vlapic_page),
-      kp_fpu_state(init_cfg.kp_fpu_state), cpu_id(init_cfg.cpu), fpu(kp_fpu_state.get()),
-      passthrough_vcpu(pd->is_passthrough)
+      kp_fpu_state(init_cfg.kp_fpu_state), cpu_id(init_cfg.cpu),
+      fpu(kp_fpu_state.get(), Fpu::Format::STANDARD), passthrough_vcpu(pd->is_passthrough)
 {
     assert(Hip::feature() & Hip::FEAT_VMX);
 
@@ -42,8 +118,10 @@ Vcpu::Vcpu(const Vcpu_init_config& init_cfg)
     // - set a proper RSP
     // - set the host CR3
 
+    Vcpu_pool::Entry const pooled{vcpu_pools[cpu_id].take()};
+
     const mword io_bitmap{pd->Space_pio::walk()};
-    vmcs = make_unique<Vmcs>(0, io_bitmap, 0, pd, cpu_id);
+    vmcs = reuse_or_make(pooled.vmcs, 0, io_bitmap, 0, pd.get(), cpu_id);
 
     // We restore the host MSRs in the VM Exit path, thus the VM Exit shouldn't restore any MSRs
     Vmcs::write(Vmcs::EXI_MSR_LD_ADDR, 0);
@@ -51,7 +129,7 @@ Vcpu::Vcpu(const Vcpu_init_config& init_cfg)
 
     // Allocate and register the guest MSR area, i.e. the area to load MSRs from during a VM Entry and to
     // store MSRs to during a VM Exit.
-    guest_msr_area = make_unique<Msr_area>();
+    guest_msr_area = reuse_or_make(pooled.msr_area);
     const mword guest_msr_area_phys = Buddy::ptr_to_phys(guest_msr_area.get());
     Vmcs::write(Vmcs::ENT_MSR_LD_ADDR, guest_msr_area_phys);
     Vmcs::write(Vmcs::ENT_MSR_LD_CNT, Msr_area::MSR_COUNT);
@@ -59,7 +137,7 @@ Vcpu::Vcpu(const Vcpu_init_config& init_cfg)
     Vmcs::write(Vmcs::EXI_MSR_ST_CNT, Msr_area::MSR_COUNT);
 
     // Allocate and configure a default MSR bitmap.
-    msr_bitmap = make_unique<Vmx_msr_bitmap>();
+    msr_bitmap = reuse_or_make(pooled.msr_bitmap);
 
     static const Msr::Register guest_accessible_msrs[] = {
         Msr::Register::IA32_FS_BASE,
@@ -123,12 +201,85 @@ Vcpu::Vcpu(const Vcpu_init_config& init_cfg)
     // TODO: Utcb::save_vmx takes a Cpu_regs object as parameter and does a regs->vmcs->make_current(). Thus
     // the regs must know the address of the VMCS. This is just a workaround, see hedron#252
     regs.vmcs = vmcs.get();
+    regs.native_idle = false;
 
     // TODO: We have to keep in mind that we, if we remove the line above, also have to look into this
     // function, as it will throw an assertion if we don't set the vmcs member. See hedron#252.
     regs.nst_ctrl<Vmcs>(passthrough_vcpu);
 
+    // Intercept accesses to the debug registers from the start. See dr_passthrough.
+    set_cpu_ctrl0(Vmcs::read(Vmcs::CPU_EXEC_CTRL0));
+
+    vmcs->clear();
+}
+
+Vcpu::~Vcpu()
+{
+    // Other vCPUs of the guest must not find us anymore. Pd::get_pv_vcpu doesn't hand out vCPUs whose
+    // reference count has dropped to zero.
+    if (pv_tlb_index.has_value()) {
+        pd->replace_pv_vcpu(pv_tlb_index.value(), this, nullptr);
+    }
+
+    // A new vCPU at the same address must not mistake our guest MSRs for its own.
+    Atomic::cmp_swap(remote_ref_guest_msrs(cpu_id), this, static_cast<Vcpu*>(nullptr));
+
+    // The same goes for a new VMCS at the same address, which is likely with Vcpu_pool.
+    Atomic::cmp_swap(Vmcs::remote_ref_current(cpu_id), vmcs.get(), static_cast<Vmcs*>(nullptr));
+
+    if (vcpu_pools[cpu_id].put({vmcs.get(), guest_msr_area.get(), msr_bitmap.get()})) {
+        vmcs.release();
+        guest_msr_area.release();
+        msr_bitmap.release();
+    }
+}
+
+void Vcpu::migrate(unsigned to)
+{
+    assert(Atomic::load(owner) == Ec::current());
+    assert(cpu_id == Cpu::id());
+
+    if (to == cpu_id) {
+        return;
+    }
+
+    save_guest_fpu();
+
+    if (pmu_owner() == this) {
+        flush_pmu();
+    }
+
+    if (guest_msrs() == this) {
+        guest_msrs() = nullptr;
+    }
+
+    // A VMCS must not be active on more than one CPU. VMCLEAR writes the state that this CPU caches back to
+    // memory. The next VM entry on the new CPU loads it again and uses VMLAUNCH, because VMRESUME fails.
     vmcs->clear();
+    host_state_stale = true;
+
+    // The VPID belongs to the allocator of this CPU. Vcpu::run assigns a new one on the new CPU and flushes
+    // its TLB entries.
+    vpid_tag = 0;
+
+    // The new CPU has to receive TLB shootdowns for the EPT from now on. It might also still cache
+    // translations from earlier, so it invalidates the EPT before the first VM entry.
+    pd->Space_mem::init(to);
+    pd->stale_guest_tlb.set(to);
+
+    for (unsigned i{1}; i < num_ept_views; i++) {
+        Pd* const view{ept_views[i].get()};
+
+        view->Space_mem::init(to);
+        view->ept_view_cpus.clr(cpu_id);
+        view->ept_view_cpus.set(to);
+        view->stale_guest_tlb.set(to);
+    }
+
+    trace(TRACE_VMX, "VCPU:%p migrated CPU:%#x->%#x", this, cpu_id, to);
+
+    // Pokes and posted interrupts kick the vCPU on the new CPU once we release it. See Vcpu::post_interrupt.
+    Atomic::store(cpu_id, to);
 }
 
 void Vcpu::init()
@@ -142,11 +293,17 @@ void Vcpu::init()
         "mov %%dr3, %[dr3]\n"
         "mov %%dr6, %[dr6]\n"
         : [dr0] "=r"(dr[0]), [dr1] "=r"(dr[1]), [dr2] "=r"(dr[2]), [dr3] "=r"(dr[3]), [dr6] "=r"(dr[4]));
+
+    // Cpu::init has just loaded the host MSRs. We don't know what ran before.
+    guest_msrs() = nullptr;
+    host_msrs_stale() = false;
+    spec_ctrl() = 0;
+    l1d_flush() = true;
 }
 
 Vcpu_acquire_result Vcpu::try_acquire()
 {
-    if (cpu_id != Cpu::id()) {
+    if (Atomic::load(cpu_id) != Cpu::id()) {
         return Err(Vcpu_acquire_error::bad_cpu());
     }
 
@@ -168,65 +325,1324 @@ void Vcpu::mtd(Mtd mtd)
     regs.mtd |= mtd.val;
 }
 
-void Vcpu::load_dr()
+bool Vcpu::set_exit_policy(unsigned policy, Kp* cpuid_table, mword pv_index, Kp* steal_time)
 {
-    mword const* const host_dr = Vcpu::host_dr();
+    assert(Atomic::load(owner) == Ec::current());
+    assert((policy & ~EXIT_POLICY_ALL) == 0);
 
-    // If these assertions fail our debug register caching is broken. No function besides save_dr and load_dr
-    // must touch the debug registers.
-    assert_slow(get_dr0() == host_dr[0]);
-    assert_slow(get_dr1() == host_dr[1]);
-    assert_slow(get_dr2() == host_dr[2]);
-    assert_slow(get_dr3() == host_dr[3]);
-    assert_slow(get_dr6() == host_dr[4]);
+    bool const pv_tlb{(policy & EXIT_POLICY_PV_TLB_FLUSH) != 0};
 
-    // Restore Debug Registers of the vCPU. DR7 is special and will be restored by vmlaunch/vmresume.
-    //
-    // We only write to the debug registers when their values have changed. This avoids the expensive mov to
-    // debug register instructions in the common case where we just enter and exit the same vCPU.
+    if (pv_tlb and not(pv_tlb_index.has_value() and pv_tlb_index.value() == pv_index)) {
+        if (not pd->replace_pv_vcpu(pv_index, nullptr, this)) {
+            return false;
+        }
 
-    if (EXPECT_FALSE(host_dr[0] != regs.dr0)) {
-        set_dr0(regs.dr0);
+        if (pv_tlb_index.has_value()) {
+            pd->replace_pv_vcpu(pv_tlb_index.value(), this, nullptr);
+        }
+
+        pv_tlb_index = static_cast<unsigned>(pv_index);
+    } else if (not pv_tlb and pv_tlb_index.has_value()) {
+        pd->replace_pv_vcpu(pv_tlb_index.value(), this, nullptr);
+        pv_tlb_index = Optional<unsigned>{};
     }
 
-    if (EXPECT_FALSE(host_dr[1] != regs.dr1)) {
-        set_dr1(regs.dr1);
+    exit_policy = policy;
+    kp_cpuid_table.reset(cpuid_table);
+    msr_exits_stale = true;
+
+    if (bool const native_idle{(policy & EXIT_POLICY_NATIVE_IDLE) != 0}; native_idle != regs.native_idle) {
+        regs.native_idle = native_idle;
+        idle_exits_stale = true;
+    }
+
+    // The VMM takes over the timer again and has to rearm it.
+    if (not(policy & EXIT_POLICY_TSC_DEADLINE)) {
+        tsc_deadline = 0;
+    }
+
+    halt_poll_window = 0;
+    halt_exit_tsc = 0;
+
+    // The guest starts counting again with a new record.
+    if (steal_time != kp_steal_time.get()) {
+        kp_steal_time.reset(steal_time);
+        steal_sc_id = 0;
+        steal_tsc = 0;
+        steal_version = 0;
+        steal_preempted = false;
+
+        if (steal_time) {
+            memset(steal_time->data_page(), 0, sizeof(Vcpu_steal_time));
+        }
+    }
+
+    return true;
+}
+
+void Vcpu::set_mtd_profile(Kp* profile)
+{
+    assert(Atomic::load(owner) == Ec::current());
+
+    kp_mtd_profile.reset(profile);
+}
+
+void Vcpu::set_exit_stats(Kp* stats)
+{
+    assert(Atomic::load(owner) == Ec::current());
+
+    pending_exit_stats = nullptr;
+    kp_exit_stats.reset(stats);
+}
+
+unsigned Vcpu::set_pml_buffer(Kp* buffer, Kp* dirty_ring)
+{
+    assert(Atomic::load(owner) == Ec::current());
+    assert(Vmcs::has_pml());
+
+    vmcs->make_current();
+
+    unsigned logged{0};
+
+    if (kp_pml_buffer) {
+        // The CPU logs from the last entry to the first one and decrements the index after each entry. The
+        // index underflows when the buffer is full.
+        auto const index{static_cast<uint16>(Vmcs::read(Vmcs::GUEST_PML_INDEX))};
+
+        logged = index < PML_ENTRIES ? PML_ENTRIES - 1 - index : PML_ENTRIES;
+    }
+
+    kp_pml_buffer.reset(buffer);
+
+    Kp* const kp{kp_pml_buffer.get()};
+
+    // Without a buffer, the CPU must not log at all. Vcpu::run refuses to enable PML again in this case.
+    if (not kp) {
+        Vmcs::write(Vmcs::CPU_EXEC_CTRL1, Vmcs::read(Vmcs::CPU_EXEC_CTRL1) & ~Vmcs::CPU_PML);
+    }
+
+    Vmcs::write(Vmcs::PML_ADDR, kp ? Buddy::ptr_to_phys(kp->data_page()) : 0);
+    Vmcs::write(Vmcs::GUEST_PML_INDEX, PML_ENTRIES - 1);
+
+    assert(not dirty_ring or (kp and Vcpu_dirty_ring::entries(dirty_ring->size()) > PML_ENTRIES));
+
+    if (dirty_ring != kp_dirty_ring.get()) {
+        kp_dirty_ring.reset(dirty_ring);
+        dirty_ring_head = 0;
+
+        if (dirty_ring) {
+            memset(dirty_ring->data_page(), 0, sizeof(Vcpu_dirty_ring));
+        }
+    }
+
+    return logged;
+}
+
+bool Vcpu::drain_pml_buffer()
+{
+    if (not kp_dirty_ring) {
+        return false;
+    }
+
+    auto* const ring{static_cast<Vcpu_dirty_ring*>(kp_dirty_ring->data_page())};
+    mword const entries{Vcpu_dirty_ring::entries(kp_dirty_ring->size())};
+    mword const reset{Atomic::load<uint32, Atomic::RELAXED>(ring->reset)};
+
+    // The ring is full if head is just before reset. The VMM sees the exit, if the rest of the ring cannot
+    // take the whole buffer.
+    if (reset >= entries or (reset + entries - dirty_ring_head - 1) % entries < PML_ENTRIES) {
+        return false;
+    }
+
+    uint64 const* const pml{static_cast<uint64 const*>(kp_pml_buffer->data_page())};
+    uint64* const gpas{ring->gpas()};
+
+    // The CPU logs from the last entry to the first one.
+    for (unsigned i{PML_ENTRIES}; i-- > 0;) {
+        gpas[dirty_ring_head] = pml[i];
+        dirty_ring_head = static_cast<uint32>((dirty_ring_head + 1) % entries);
+    }
+
+    // The VMM must see the entries before the new head.
+    barrier();
+    Atomic::store<uint32, Atomic::RELAXED>(ring->head, dirty_ring_head);
+
+    Vmcs::write(Vmcs::GUEST_PML_INDEX, PML_ENTRIES - 1);
+
+    // The guest executes the write again that caused the exit. If it was an IRET that unblocked NMIs, we
+    // have to block them again, like for EPT violations. See Vcpu::fill_ept.
+    if (exit_info.read<Vmcs::EXI_QUALIFICATION>() & (1U << 12)) {
+        Vmcs::write(Vmcs::GUEST_INTR_STATE, Vmcs::read(Vmcs::GUEST_INTR_STATE) | 0x8);
     }
 
-    if (EXPECT_FALSE(host_dr[2] != regs.dr2)) {
-        set_dr2(regs.dr2);
+    return true;
+}
+
+Optional<mword> Vcpu::reset_dirty_ring(Kp* kp)
+{
+    auto* const ring{static_cast<Vcpu_dirty_ring*>(kp->data_page())};
+    mword const entries{Vcpu_dirty_ring::entries(kp->size())};
+
+    // The VMM can modify all indices, so we only trust them after checking that tail is between reset and
+    // head.
+    mword const head{Atomic::load<uint32, Atomic::RELAXED>(ring->head)};
+    mword const tail{Atomic::load<uint32, Atomic::RELAXED>(ring->tail)};
+    mword const reset{Atomic::load<uint32, Atomic::RELAXED>(ring->reset)};
+
+    if (head >= entries or tail >= entries or reset >= entries or
+        (tail + entries - reset) % entries > (head + entries - reset) % entries) {
+        return {};
+    }
+
+    mword const count{(tail + entries - reset) % entries};
+
+    // We must read the entries before we hand their slots back to Vcpu::drain_pml_buffer.
+    pd->clear_dirty(count, [ring, entries, reset](mword i) {
+        return static_cast<mword>(Atomic::load<uint64, Atomic::RELAXED>(ring->gpas()[(reset + i) % entries]));
+    });
+
+    barrier();
+    Atomic::store<uint32, Atomic::RELAXED>(ring->reset, static_cast<uint32>(tail));
+
+    return count;
+}
+
+void Vcpu::set_vmcs_shadow(Kp* vmread_bitmap, Kp* vmwrite_bitmap)
+{
+    assert(Atomic::load(owner) == Ec::current());
+    assert(Vmcs::has_vmcs_shadow());
+    assert((vmread_bitmap == nullptr) == (vmwrite_bitmap == nullptr));
+
+    if (vmread_bitmap and not shadow_vmcs) {
+        shadow_vmcs = make_unique<Vmcs>(Vmcs::Shadow{});
+    }
+
+    vmcs->make_current();
+
+    kp_vmread_bitmap.reset(vmread_bitmap);
+    kp_vmwrite_bitmap.reset(vmwrite_bitmap);
+
+    // Without bitmaps, the guest must not access the shadow VMCS anymore. Vcpu::run refuses to enable VMCS
+    // shadowing again in this case.
+    if (not vmread_bitmap) {
+        Vmcs::write(Vmcs::CPU_EXEC_CTRL1, Vmcs::read(Vmcs::CPU_EXEC_CTRL1) & ~Vmcs::CPU_VMCS_SHADOW);
+    }
+
+    Vmcs::write(Vmcs::VMREAD_BITMAP, vmread_bitmap ? Buddy::ptr_to_phys(vmread_bitmap->data_page()) : 0);
+    Vmcs::write(Vmcs::VMWRITE_BITMAP, vmwrite_bitmap ? Buddy::ptr_to_phys(vmwrite_bitmap->data_page()) : 0);
+    Vmcs::write(Vmcs::VMCS_LINK_PTR, vmread_bitmap ? Buddy::ptr_to_phys(shadow_vmcs.get()) : ~0ul);
+}
+
+void Vcpu::set_ept_views(Pd* const* views, unsigned count)
+{
+    assert(Atomic::load(owner) == Ec::current());
+    assert(Vmcs::has_eptp_switching());
+    assert(count < MAX_EPT_VIEWS);
+
+    if (count and not eptp_list) {
+        eptp_list = make_unique<Eptp_list>();
+    }
+
+    vmcs->make_current();
+
+    // The guest may still use one of the old views.
+    Vmcs::write(Vmcs::EPTP, pd->ept.vmcs_eptp());
+
+    // Shootdowns of the old views don't need to kick this CPU anymore. Other vCPUs of this CPU that still
+    // use them set the bit again before their next VM entry. See Vcpu::run.
+    for (unsigned i{1}; i < num_ept_views; i++) {
+        ept_views[i]->ept_view_cpus.clr(cpu_id);
+    }
+
+    num_ept_views = count ? count + 1 : 0;
+
+    for (unsigned i{0}; i < MAX_EPT_VIEWS; i++) {
+        Pd* const view{i == 0 ? pd.get() : (i <= count ? views[i - 1] : nullptr)};
+
+        ept_views[i].reset(i < num_ept_views ? view : nullptr);
+
+        if (i == 0 or i >= num_ept_views) {
+            continue;
+        }
+
+        // Like for our own PD, shootdowns of the view have to reach this CPU from now on and the view may
+        // still be cached from an earlier guest. See Vcpu::migrate.
+        view->Space_mem::init(cpu_id);
+        view->ept_view_cpus.set(cpu_id);
+        view->stale_guest_tlb.set(cpu_id);
+    }
+
+    // The guest is in view 0 now, which update_eptps keeps.
+    ept_ad_views = 0;
+    update_eptps();
+
+    Vmcs::write(Vmcs::EPTP_LIST_ADDR, eptp_list ? Buddy::ptr_to_phys(eptp_list.get()) : 0);
+    Vmcs::write(Vmcs::VM_FUNC_CTRL, num_ept_views ? mword{Vmcs::VM_FUNC_EPTP_SWITCHING} : 0);
+}
+
+uint32 Vcpu::wanted_ept_ad_views() const
+{
+    uint32 wanted{Atomic::load(pd->ept_ad) ? 1U : 0U};
+
+    for (unsigned i{1}; i < num_ept_views; i++) {
+        wanted |= Atomic::load(ept_views[i]->ept_ad) ? 1U << i : 0U;
+    }
+
+    return wanted;
+}
+
+void Vcpu::update_eptps()
+{
+    unsigned const active{active_ept_view()};
+    uint32 const wanted{wanted_ept_ad_views()};
+
+    for (unsigned i{0}; i < MAX_EPT_VIEWS and eptp_list; i++) {
+        eptp_list->eptp[i] = i < num_ept_views ? ept_views[i]->ept.vmcs_eptp(wanted & (1U << i)) : 0;
+    }
+
+    Vmcs::write(Vmcs::EPTP, num_ept_views ? eptp_list->eptp[active] : pd->ept.vmcs_eptp(wanted & 1));
+
+    // Translations that the TLB cached before may not set the flags. They are flushed before the next VM
+    // entry.
+    for (unsigned i{0}; i < num_ept_views or i == 0; i++) {
+        if ((wanted ^ ept_ad_views) & (1U << i)) {
+            (i == 0 ? pd.get() : ept_views[i].get())->stale_guest_tlb.set(cpu_id);
+        }
+    }
+
+    ept_ad_views = wanted;
+}
+
+Pd* Vcpu::active_ept_view_pd() { return num_ept_views ? ept_views[active_ept_view()].get() : pd.get(); }
+
+unsigned Vcpu::active_ept_view()
+{
+    uint64 const eptp{Vmcs::read(Vmcs::EPTP)};
+
+    for (unsigned i{1}; i < num_ept_views; i++) {
+        if (eptp_list->eptp[i] == eptp) {
+            return i;
+        }
+    }
+
+    return 0;
+}
+
+void Vcpu::set_active_ept_view(uint64 view)
+{
+    if (view < num_ept_views) {
+        Vmcs::write(Vmcs::EPTP, eptp_list->eptp[view]);
+    }
+}
+
+void Vcpu::set_pmu(bool enable)
+{
+    assert(Atomic::load(owner) == Ec::current());
+    assert(Pmu::available() and Vmcs::has_perf_global_ctrl());
+
+    vmcs->make_current();
+
+    // The guest starts with clear counters, also when it gets access again.
+    if (pmu_owner() == this) {
+        flush_pmu();
+    }
+
+    pmu_access = enable;
+    pmu_ctx = {};
+    guest_msr_area->ia32_perf_global_ctrl.msr_data = 0;
+
+    // VM exits stop the counters, so they never count events of the host or of other guests.
+    mword const exi{Vmcs::read(Vmcs::EXI_CONTROLS) & ~mword{Vmcs::EXI_LOAD_PERF_GLOBAL_CTRL}};
+    mword const ent{Vmcs::read(Vmcs::ENT_CONTROLS) & ~mword{Vmcs::ENT_LOAD_PERF_GLOBAL_CTRL}};
+
+    Vmcs::write(Vmcs::EXI_CONTROLS, exi | (enable ? mword{Vmcs::EXI_LOAD_PERF_GLOBAL_CTRL} : 0));
+    Vmcs::write(Vmcs::ENT_CONTROLS, ent | (enable ? mword{Vmcs::ENT_LOAD_PERF_GLOBAL_CTRL} : 0));
+    Vmcs::write(Vmcs::HOST_PERF_GLOBAL_CTRL, 0);
+    Vmcs::write(Vmcs::GUEST_PERF_GLOBAL_CTRL, 0);
+
+    // There is no VM exit control that saves IA32_PERF_GLOBAL_CTRL on all CPUs, so the MSR area does.
+    Vmcs::write(Vmcs::EXI_MSR_ST_CNT, enable ? Msr_area::PMU_MSR_COUNT : Msr_area::MSR_COUNT);
+
+    auto const setting{enable ? Vmx_msr_bitmap::exit_setting::EXIT_NEVER
+                              : Vmx_msr_bitmap::exit_setting::EXIT_ALWAYS};
+
+    for (unsigned i{0}; i < Pmu::GP_COUNTERS; i++) {
+        msr_bitmap->set_exit(Msr::Register(Msr::IA32_PMC0 + i), setting);
+        msr_bitmap->set_exit(Msr::Register(Msr::IA32_PERFEVTSEL0 + i), setting);
+    }
+
+    for (unsigned i{0}; i < Pmu::FIXED_COUNTERS; i++) {
+        msr_bitmap->set_exit(Msr::Register(Msr::IA32_FIXED_CTR0 + i), setting);
+    }
+
+    static const Msr::Register pmu_msrs[] = {
+        Msr::Register::IA32_FIXED_CTR_CTRL,
+        Msr::Register::IA32_PERF_GLOBAL_STATUS,
+        Msr::Register::IA32_PERF_GLOBAL_CTRL,
+        Msr::Register::IA32_PERF_GLOBAL_OVF_CTRL,
+        Msr::Register::IA32_PERF_GLOBAL_STATUS_SET,
+    };
+
+    for (auto msr : pmu_msrs) {
+        msr_bitmap->set_exit(msr, setting);
+    }
+}
+
+void Vcpu::switch_pmu()
+{
+    flush_pmu();
+
+    if (not pmu_access) {
+        return;
+    }
+
+    // The guest owns the counters now, so Hedron stops sampling with them on this CPU.
+    Pmu::stop();
+    Pmu::load(pmu_ctx);
+
+    // Overflows of the counters of the guest arrive as NMIs. See Vcpu::handle_exception.
+    Lapic::set_pmi_delivery(true);
+
+    bool ok = add_ref();
+    assert(ok);
+
+    pmu_owner() = this;
+}
+
+void Vcpu::flush_pmu()
+{
+    Vcpu* const old{pmu_owner()};
+
+    if (not old) {
+        return;
+    }
+
+    Pmu::save(old->pmu_ctx);
+    Lapic::set_pmi_delivery(false);
+
+    pmu_owner() = nullptr;
+
+    if (old->del_rcu()) {
+        Rcu::call(old);
+    }
+}
+
+mword Vcpu::access_shadow_vmcs(mword* fields, mword count, bool write)
+{
+    assert(Atomic::load(owner) == Ec::current());
+    assert(shadow_vmcs);
+
+    // We access the shadow VMCS as if it were an ordinary VMCS. Clearing it afterwards writes back any state
+    // that the CPU caches, so the guest sees our changes.
+    shadow_vmcs->make_current();
+
+    mword done{0};
+
+    for (; done < count; done++) {
+        mword* const field{&fields[done * 2]};
+
+        if (not(write ? Vmcs::try_write(field[0], field[1]) : Vmcs::try_read(field[0], field[1]))) {
+            break;
+        }
+    }
+
+    shadow_vmcs->clear();
+    vmcs->make_current();
+
+    return done;
+}
+
+bool Vcpu::snapshot(Kp* kp, bool restore)
+{
+    assert(Atomic::load(owner) == Ec::current());
+
+    if (kp == kp_vcpu_state.get()) {
+        return false;
+    }
+
+    Vcpu_snapshot* const snap{static_cast<Vcpu_snapshot*>(kp->data_page())};
+    Utcb* const state{reinterpret_cast<Utcb*>(snap->state)};
+
+    if (restore) {
+        // The next Vcpu::run loads the state with the same checks as state that the VMM provides itself. The
+        // FPU state is in the FPU KP, which the VMM restores by copying it.
+        memcpy(utcb(), state, sizeof(snap->state));
+        mtd(Mtd{(utcb()->mtd & ~Mtd::FPU) | Mtd::TLB});
+
+        regs.dr0 = snap->dr0;
+        regs.dr1 = snap->dr1;
+        regs.dr2 = snap->dr2;
+        regs.dr3 = snap->dr3;
+        regs.dr6 = snap->dr6;
+
+        return true;
+    }
+
+    // The VMM may have changed state that only the next Vcpu::run transfers into the VMCS. This state is
+    // only in the vCPU state page, so we take it from there.
+    memcpy(state, utcb(), sizeof(snap->state));
+
+    mword const pending{regs.mtd};
+    Mtd all{~0UL & ~(Mtd::TLB | Mtd::FPU)};
+
+    // See return_to_vmm.
+    if (not vint_delivery_enabled()) {
+        all.val &= ~Mtd::VINTR;
+    }
+
+    regs.mtd = all.val & ~pending;
+    state->load_vmx(&regs, exit_info);
+    regs.mtd = pending;
+
+    // See return_to_vmm.
+    if (not(pending & Mtd::EPT_VIEW)) {
+        state->ept_view = active_ept_view();
+    }
+
+    state->mtd = all.val;
+
+    snap->dr0 = regs.dr0;
+    snap->dr1 = regs.dr1;
+    snap->dr2 = regs.dr2;
+    snap->dr3 = regs.dr3;
+    snap->dr6 = regs.dr6;
+
+    return true;
+}
+
+bool Vcpu::set_ioevent(mword slot, Vcpu_ioevent const& ioevent, Sm* sm)
+{
+    assert(Atomic::load(owner) == Ec::current());
+
+    if (slot >= MAX_IOEVENTS) {
+        return false;
+    }
+
+    ioevents[slot] = ioevent;
+    ioevent_sms[slot].reset(sm);
+
+    while (ioevent_cnt and not ioevent_sms[ioevent_cnt - 1]) {
+        ioevent_cnt--;
+    }
+
+    ioevent_cnt = max(ioevent_cnt, sm ? static_cast<unsigned>(slot) + 1 : 0U);
+    return true;
+}
+
+bool Vcpu::set_vmcall_portal(mword nr, mword pt_sel, bool enable)
+{
+    assert(Atomic::load(owner) == Ec::current());
+
+    if (nr >= MAX_VMCALL_PORTALS) {
+        return false;
+    }
+
+    uint16 const bit{static_cast<uint16>(1U << nr)};
+
+    vmcall_pt_sels[nr] = pt_sel;
+    vmcall_pt_mask = static_cast<uint16>(enable ? vmcall_pt_mask | bit : vmcall_pt_mask & ~bit);
+
+    return true;
+}
+
+Pt* Vcpu::vmcall_portal()
+{
+    // Only the guest kernel calls services directly. The VMM decides what VMCALLs from guest user space do.
+    if (regs.rax >= MAX_VMCALL_PORTALS or not(vmcall_pt_mask & 1U << regs.rax) or not guest_in_kernel()) {
+        return nullptr;
+    }
+
+    return capability_cast<Pt>(Space_obj::lookup(vmcall_pt_sels[regs.rax]), Pt::PERM_CALL);
+}
+
+void Vcpu::set_vmcall_reply(Sys_regs const& reply)
+{
+    regs.rax = reply.ARG_2;
+    regs.rbx = reply.ARG_3;
+    regs.rcx = reply.ARG_4;
+    regs.rdx = reply.ARG_5;
+
+    vmcall_replied = true;
+}
+
+void Vcpu::finish_vmcall()
+{
+    assert(Atomic::load(owner) == Ec::current());
+
+    // The handler may have run another vCPU on this CPU.
+    vmcs->make_current();
+
+    if (EXPECT_TRUE(vmcall_replied)) {
+        vmcall_replied = false;
+
+        skip_instruction();
+        continue_running();
+    }
+
+    return_to_vmm(Sys_regs::SUCCESS);
+}
+
+void Vcpu::set_io_ring(Kp* ring)
+{
+    assert(Atomic::load(owner) == Ec::current());
+
+    if (ring) {
+        Vcpu_io_ring* const r{static_cast<Vcpu_io_ring*>(ring->data_page())};
+
+        Atomic::store(r->head, 0U);
+        Atomic::store(r->tail, 0U);
+    }
+
+    io_ring_head = 0;
+    kp_io_ring.reset(ring);
+}
+
+bool Vcpu::handle_io_write()
+{
+    mword const qual{exit_info.read<Vmcs::EXI_QUALIFICATION>()};
+
+    // Only OUT instructions without string or REP prefix write the value in RAX.
+    if (qual & 0x38) {
+        return false;
+    }
+
+    auto const size{static_cast<uint8>((qual & 0x7) + 1)};
+    auto const port{static_cast<uint16>(qual >> 16)};
+    auto const value{static_cast<uint32>(regs.rax & (~0ULL >> (64 - 8 * size)))};
+
+    for (unsigned i{0}; i < ioevent_cnt; i++) {
+        Vcpu_ioevent const& e{ioevents[i]};
+        bool const match{e.port == port and e.size == size and (not e.match_value or e.value == value)};
+
+        if (ioevent_sms[i] and match) {
+            ioevent_sms[i]->up();
+            return true;
+        }
+    }
+
+    if (not kp_io_ring) {
+        return false;
+    }
+
+    Vcpu_io_ring* const ring{static_cast<Vcpu_io_ring*>(kp_io_ring->data_page())};
+    bool in_range{false};
+
+    for (Vcpu_io_ring::Range const r : ring->ranges) {
+        in_range |= static_cast<uint16>(port - r.base) < r.count;
+    }
+
+    uint32 const new_head{(io_ring_head + 1) % Vcpu_io_ring::ENTRIES};
+
+    // The VMM sees the write with the exit, if the ring is full. It drains the ring first to keep the order.
+    if (not in_range or new_head == Atomic::load<uint32, Atomic::RELAXED>(ring->tail)) {
+        return false;
+    }
+
+    ring->entries[io_ring_head] = {port, size, 0, value};
+
+    // The VMM must see the entry before the new head.
+    barrier();
+    io_ring_head = new_head;
+    Atomic::store<uint32, Atomic::RELAXED>(ring->head, new_head);
+
+    return true;
+}
+
+bool Vcpu::emulate_cpuid()
+{
+    if (EXPECT_FALSE(not kp_cpuid_table)) {
+        return false;
+    }
+
+    auto const* const table{static_cast<Vcpu_cpuid_entry const*>(kp_cpuid_table->data_page())};
+    uint32 const leaf{static_cast<uint32>(regs.rax)};
+    uint32 const subleaf{static_cast<uint32>(regs.rcx)};
+
+    for (unsigned i = 0; i < PAGE_SIZE / sizeof(Vcpu_cpuid_entry); i++) {
+        // The VMM may modify the table concurrently, so we work on a copy of the entry.
+        Vcpu_cpuid_entry const entry{table[i]};
+
+        if (not(entry.flags & Vcpu_cpuid_entry::VALID)) {
+            break;
+        }
+
+        if (entry.leaf != leaf or (entry.flags & Vcpu_cpuid_entry::SUBLEAF and entry.subleaf != subleaf)) {
+            continue;
+        }
+
+        // CPUID clears the upper halves of the registers.
+        regs.rax = entry.eax;
+        regs.rbx = entry.ebx;
+        regs.rcx = entry.ecx;
+        regs.rdx = entry.edx;
+
+        return true;
+    }
+
+    return false;
+}
+
+bool Vcpu::emulate_xsetbv()
+{
+    uint64 const xcr0{static_cast<uint64>(static_cast<uint32>(regs.rdx)) << 32 |
+                      static_cast<uint32>(regs.rax)};
+    mword const cpl{(Vmcs::read(Vmcs::GUEST_AR_SS) >> 5) & 0x3};
+
+    // We only know XCR0. Everything else is left to the VMM, which injects the #GP.
+    if (static_cast<uint32>(regs.rcx) != 0 or cpl != 0 or not Fpu::is_valid_xcr0(xcr0)) {
+        return false;
+    }
+
+    // Vcpu::run loads the new value into XCR0 before the next VM entry.
+    regs.xcr0 = xcr0;
+    return true;
+}
+
+void Vcpu::update_x2apic_msr_exits()
+{
+    mword const ctrl0{Vmcs::read(Vmcs::CPU_EXEC_CTRL0)};
+    mword const ctrl1{Vmcs::read(Vmcs::CPU_EXEC_CTRL1)};
+    mword const needed1{Vmcs::CPU_VIRT_X2APIC | Vmcs::CPU_VINT_DELIVERY};
+
+    bool const virtualized{(exit_policy & EXIT_POLICY_X2APIC) and (ctrl0 & Vmcs::Ctrl0::CPU_SECONDARY) and
+                           (ctrl0 & Vmcs::Ctrl0::CPU_TPR_SHADOW) and (ctrl1 & needed1) == needed1};
+
+    if (virtualized == x2apic_virtualized) {
+        return;
+    }
+
+    x2apic_virtualized = virtualized;
+
+    using exit_setting = Vmx_msr_bitmap::exit_setting;
+
+    // EOI and SELF_IPI are write-only. Reading them causes a #GP that the VMM injects.
+    exit_setting const read_write{virtualized ? exit_setting::EXIT_NEVER : exit_setting::EXIT_ALWAYS};
+    exit_setting const write_only{virtualized ? exit_setting::EXIT_READ : exit_setting::EXIT_ALWAYS};
+
+    msr_bitmap->set_exit(Msr::IA32_X2APIC_TPR, read_write);
+    msr_bitmap->set_exit(Msr::IA32_X2APIC_EOI, write_only);
+    msr_bitmap->set_exit(Msr::IA32_X2APIC_SELF_IPI, write_only);
+}
+
+bool Vcpu::emulate_tsc_deadline(bool write)
+{
+    if (static_cast<uint32>(regs.rcx) != Msr::IA32_TSC_DEADLINE or not vint_delivery_enabled()) {
+        return false;
+    }
+
+    // The LAPIC ignores the MSR in the other timer modes. The VMM knows what it does with it.
+    if ((lvt_timer() & LVT_TIMER_MODE) != LVT_TSC_DEADLINE) {
+        return false;
+    }
+
+    if (not write) {
+        // RDMSR clears the upper halves of the registers.
+        regs.rax = static_cast<uint32>(tsc_deadline);
+        regs.rdx = static_cast<uint32>(tsc_deadline >> 32);
+        return true;
+    }
+
+    // Vcpu::run delivers a deadline in the past right away and programs the preemption timer for all others.
+    tsc_deadline = static_cast<uint64>(static_cast<uint32>(regs.rdx)) << 32 | static_cast<uint32>(regs.rax);
+    return true;
+}
+
+bool Vcpu::can_skip_instruction()
+{
+    return (utcb()->ctrl[0] & Vmcs::Ctrl0::CPU_MTF) == 0 and
+           (Vmcs::read(Vmcs::GUEST_RFLAGS) & Cpu::EFL_TF) == 0;
+}
+
+void Vcpu::skip_instruction()
+{
+    Vmcs::write(Vmcs::GUEST_RIP, Vmcs::read(Vmcs::GUEST_RIP) + exit_info.read<Vmcs::EXI_INST_LEN>());
+
+    // Executing an instruction ends the interrupt shadow of a preceding STI or MOV SS.
+    mword const intr_state{Vmcs::read(Vmcs::GUEST_INTR_STATE)};
+
+    if (EXPECT_FALSE(intr_state & 0x3)) {
+        Vmcs::write(Vmcs::GUEST_INTR_STATE, intr_state & ~0x3ul);
+    }
+}
+
+void Vcpu::load_dr()
+{
+    mword const* const host_dr = Vcpu::host_dr();
+
+    // If these assertions fail our debug register caching is broken. No function besides save_dr and load_dr
+    // must touch the debug registers.
+    assert_slow(get_dr0() == host_dr[0]);
+    assert_slow(get_dr1() == host_dr[1]);
+    assert_slow(get_dr2() == host_dr[2]);
+    assert_slow(get_dr3() == host_dr[3]);
+    assert_slow(get_dr6() == host_dr[4]);
+
+    // Restore Debug Registers of the vCPU. DR7 is special and will be restored by vmlaunch/vmresume.
+    //
+    // We only write to the debug registers when their values have changed. This avoids the expensive mov to
+    // debug register instructions in the common case where we just enter and exit the same vCPU.
+
+    if (EXPECT_FALSE(host_dr[0] != regs.dr0)) {
+        set_dr0(regs.dr0);
+    }
+
+    if (EXPECT_FALSE(host_dr[1] != regs.dr1)) {
+        set_dr1(regs.dr1);
+    }
+
+    if (EXPECT_FALSE(host_dr[2] != regs.dr2)) {
+        set_dr2(regs.dr2);
+    }
+
+    if (EXPECT_FALSE(host_dr[3] != regs.dr3)) {
+        set_dr3(regs.dr3);
+    }
+
+    if (EXPECT_FALSE(host_dr[4] != regs.dr6)) {
+        set_dr6(regs.dr6);
+    }
+}
+
+void Vcpu::save_dr()
+{
+    mword* const host_dr = Vcpu::host_dr();
+
+    // Save Debug Registers. DR7 is special. The CPU loads a default value on VM exit that disables all
+    // debugging functionality. That means, we don't have to restore any host values here, because they are
+    // not used.
+    //
+    // We read the debug registers only once here and cache their values, because reading them is expensive.
+    // The CPU modifies DR6 when it delivers debug exceptions to the guest, so we always have to save it.
+    host_dr[4] = regs.dr6 = get_dr6();
+
+    // Without dr_passthrough, the guest could not have modified DR0-3.
+    if (EXPECT_TRUE(not dr_passthrough)) {
+        return;
+    }
+
+    host_dr[0] = regs.dr0 = get_dr0();
+    host_dr[1] = regs.dr1 = get_dr1();
+    host_dr[2] = regs.dr2 = get_dr2();
+    host_dr[3] = regs.dr3 = get_dr3();
+
+    // Intercept accesses to the debug registers again. The next access costs us one more VM exit, but the
+    // guest rarely uses the debug registers for long.
+    dr_passthrough = false;
+    set_cpu_ctrl0(utcb()->ctrl[0]);
+}
+
+void Vcpu::set_cpu_ctrl0(mword ctrl0)
+{
+    regs.vmx_set_cpu_ctrl0(ctrl0 | (dr_passthrough ? 0 : mword{Vmcs::Ctrl0::CPU_MOV_DR}), passthrough_vcpu);
+}
+
+bool Vcpu::injecting_event()
+{
+    // The intr_info field is only valid inbound from userspace. But on the way to userspace we clear mtd and
+    // won't read it.
+    return (utcb()->mtd & Mtd::INJ) and (utcb()->intr_info & Vmcs::EVENT_VALID);
+}
+
+bool Vcpu::vint_delivery_enabled()
+{
+    return (utcb()->ctrl[0] & Vmcs::Ctrl0::CPU_SECONDARY) and
+           (utcb()->ctrl[1] & Vmcs::Ctrl1::CPU_VINT_DELIVERY);
+}
+
+bool Vcpu::deliver_posted_interrupts()
+{
+    // Interrupts that are posted from now on need another kick. Without virtual-interrupt delivery, the CPU
+    // ignores the virtual-APIC page. The interrupts stay posted until the VMM enables it. See Vcpu::run.
+    if (not Atomic::exchange(posted_pending, false) or not vint_delivery_enabled()) {
+        return false;
+    }
+
+    static constexpr unsigned BITS{sizeof(mword) * 8};
+
+    auto* const virr{static_cast<uint32*>(kp_vlapic_page->data_page()) + VAPIC_IRR / sizeof(uint32)};
+    unsigned highest{0};
+
+    for (unsigned i = 0; i < array_size(posted_pir); i++) {
+        mword const pir{Atomic::exchange(posted_pir[i], mword{0})};
+
+        if (not pir) {
+            continue;
+        }
+
+        highest = i * BITS + static_cast<unsigned>(bit_scan_reverse(pir));
+
+        // The IRR consists of eight 32-bit registers that are 16 bytes apart.
+        for (unsigned half = 0; half < 2; half++) {
+            if (uint32 const bits{static_cast<uint32>(pir >> (half * 32))}) {
+                Atomic::set_mask(virr[(i * 2 + half) * 4], bits);
+            }
+        }
+    }
+
+    // The CPU only recognizes a new virtual interrupt via RVI, the low byte of the guest interrupt status.
+    mword const intr_sts{Vmcs::read(Vmcs::GUEST_INTR_STS)};
+
+    if (highest > (intr_sts & 0xff)) {
+        Vmcs::write(Vmcs::GUEST_INTR_STS, (intr_sts & ~0xfful) | highest);
+    }
+
+    return true;
+}
+
+bool Vcpu::sync_virtual_interrupts()
+{
+    // Like posted interrupts, the soft poke waits until the VMM enables virtual-interrupt delivery.
+    if (not Atomic::exchange(vapic_irr_stale, false) or not vint_delivery_enabled()) {
+        return false;
+    }
+
+    auto* const virr{static_cast<uint32*>(kp_vlapic_page->data_page()) + VAPIC_IRR / sizeof(uint32)};
+
+    // The IRR consists of eight 32-bit registers that are 16 bytes apart.
+    for (unsigned i{NUM_INT_VECTORS / 32}; i-- > 0;) {
+        if (uint32 const bits{Atomic::load<uint32, Atomic::RELAXED>(virr[i * 4])}) {
+            unsigned const highest{i * 32 + static_cast<unsigned>(bit_scan_reverse(bits))};
+            mword const intr_sts{Vmcs::read(Vmcs::GUEST_INTR_STS)};
+
+            if (highest > (intr_sts & 0xff)) {
+                Vmcs::write(Vmcs::GUEST_INTR_STS, (intr_sts & ~0xfful) | highest);
+            }
+
+            break;
+        }
+    }
+
+    return true;
+}
+
+bool Vcpu::injection_pending()
+{
+    if (not(exit_policy & EXIT_POLICY_INJECT) or vint_delivery_enabled()) {
+        return false;
+    }
+
+    bool more;
+    Optional<unsigned> const vector{highest_posted_interrupt(more)};
+
+    return vector.has_value() and (vector.value() & 0xf0) > injection_priority();
+}
+
+Optional<unsigned> Vcpu::highest_posted_interrupt(bool& more)
+{
+    static constexpr unsigned BITS{sizeof(mword) * 8};
+
+    Optional<unsigned> vector;
+    more = false;
+
+    for (unsigned i{NUM_INT_VECTORS / BITS}; i-- > 0;) {
+        if (mword const pir{Atomic::load(posted_pir[i])}) {
+            if (vector.has_value()) {
+                more = true;
+                break;
+            }
+
+            vector = i * BITS + static_cast<unsigned>(bit_scan_reverse(pir));
+            more = (pir & (pir - 1)) != 0;
+        }
+    }
+
+    return vector;
+}
+
+unsigned Vcpu::injection_tpr()
+{
+    if (not(Vmcs::read(Vmcs::CPU_EXEC_CTRL0) & Vmcs::Ctrl0::CPU_TPR_SHADOW) or not kp_vlapic_page) {
+        return 0;
+    }
+
+    return Atomic::load<uint32, Atomic::RELAXED>(
+               static_cast<uint32*>(kp_vlapic_page->data_page())[VAPIC_TPR / sizeof(uint32)]) &
+           0xff;
+}
+
+unsigned Vcpu::injection_priority()
+{
+    unsigned const tpr{injection_tpr() & 0xf0};
+
+    // The VMM clears the bits of injected vectors when the guest signals their EOI.
+    for (unsigned i{NUM_INT_VECTORS / 64}; i-- > 0;) {
+        if (uint64 const isr{utcb()->injected_vectors[i]}) {
+            unsigned const isrv{i * 64 + static_cast<unsigned>(bit_scan_reverse(static_cast<mword>(isr)))};
+            return max(tpr, isrv & 0xf0);
+        }
+    }
+
+    return tpr;
+}
+
+void Vcpu::inject_posted_interrupt()
+{
+    static constexpr unsigned BITS{sizeof(mword) * 8};
+
+    // With virtual-interrupt delivery, deliver_posted_interrupts takes care of them.
+    if (vint_delivery_enabled()) {
+        return;
+    }
+
+    // The threshold of the VMM applies again, unless the TPR still holds back a posted interrupt below.
+    if (inject_tpr_threshold.has_value()) {
+        Vmcs::write(Vmcs::TPR_THRESHOLD, inject_tpr_threshold.value());
+        inject_tpr_threshold = Optional<uint32>{};
+    }
+
+    // Interrupts that are posted from now on need another kick.
+    Atomic::store(posted_pending, false);
+
+    bool more;
+    Optional<unsigned> const vector{highest_posted_interrupt(more)};
+
+    if (not vector.has_value()) {
+        return;
+    }
+
+    unsigned const v{vector.value()};
+
+    // An interrupt in service or the TPR holds back interrupts of the same or a lower priority class. The
+    // guest signals the end of an interrupt to the VMM, which clears its bit in injected_vectors and runs the
+    // vCPU again. When the guest lowers its TPR, we only learn about it with a TPR-below-threshold exit.
+    if ((v & 0xf0) <= injection_priority()) {
+        uint32 const threshold{static_cast<uint32>(Vmcs::read(Vmcs::TPR_THRESHOLD))};
+
+        if ((v & 0xf0) <= (injection_tpr() & 0xf0) and (v >> 4) > (threshold & 0xf)) {
+            inject_tpr_threshold = threshold;
+            Vmcs::write(Vmcs::TPR_THRESHOLD, v >> 4);
+        }
+
+        return;
+    }
+
+    // The guest takes external interrupts, if it enabled them and is neither blocked by STI or MOV SS (bits 0
+    // and 1 of the interruptibility state) nor in shutdown or wait-for-SIPI. An event that the VMM or a
+    // previous exit left for injection goes first.
+    bool const can_inject{not(Vmcs::read(Vmcs::ENT_INTR_INFO) & Vmcs::EVENT_VALID) and
+                          (Vmcs::read(Vmcs::GUEST_RFLAGS) & Cpu::EFL_IF) and
+                          (Vmcs::read(Vmcs::GUEST_INTR_STATE) & 0x3) == 0 and
+                          Vmcs::read(Vmcs::GUEST_ACTV_STATE) <= 1};
+
+    if (can_inject) {
+        Atomic::clr_mask(posted_pir[v / BITS], 1UL << (v % BITS));
+        Vmcs::write(Vmcs::ENT_INTR_INFO, Vmcs::EVENT_VALID | v);
+
+        // The interrupt wakes up a halted guest.
+        Vmcs::write(Vmcs::GUEST_ACTV_STATE, 0);
+
+        utcb()->injected_vectors[v / 64] |= 1ULL << (v % 64);
+
+        if (not more) {
+            return;
+        }
+    }
+
+    // The VMM may wait for the interrupt window itself. Then the exit is for the VMM and we try again with
+    // the next VM entry.
+    mword const ctrl0{Vmcs::read(Vmcs::CPU_EXEC_CTRL0)};
+
+    if (not(ctrl0 & Vmcs::CPU_INTR_WINDOW)) {
+        regs.vmx_set_cpu_ctrl0(ctrl0 | Vmcs::CPU_INTR_WINDOW, passthrough_vcpu);
+        inject_window = true;
+    }
+}
+
+void Vcpu::request_virtual_interrupt(unsigned vector)
+{
+    auto* const virr{static_cast<uint32*>(kp_vlapic_page->data_page()) + VAPIC_IRR / sizeof(uint32)};
+
+    Atomic::set_mask(virr[(vector / 32) * 4], 1U << (vector % 32));
+
+    mword const intr_sts{Vmcs::read(Vmcs::GUEST_INTR_STS)};
+
+    if (vector > (intr_sts & 0xff)) {
+        Vmcs::write(Vmcs::GUEST_INTR_STS, (intr_sts & ~0xfful) | vector);
+    }
+}
+
+uint32 Vcpu::lvt_timer()
+{
+    // The guest and the VMM can change the register at any time.
+    return Atomic::load<uint32, Atomic::RELAXED>(
+        static_cast<uint32*>(kp_vlapic_page->data_page())[VAPIC_LVT_TIMER / sizeof(uint32)]);
+}
+
+uint64 Vcpu::guest_tsc_offset()
+{
+    return (utcb()->ctrl[0] & Vmcs::Ctrl0::CPU_TSC_OFFSETTING) ? Vmcs::read(Vmcs::TSC_OFFSET) : 0;
+}
+
+uint64 Vcpu::guest_tsc_multiplier()
+{
+    bool const scaling{Vmcs::has_tsc_scaling() and (utcb()->ctrl[0] & Vmcs::Ctrl0::CPU_SECONDARY) and
+                       (utcb()->ctrl[1] & Vmcs::CPU_TSC_SCALING)};
+
+    return scaling ? Vmcs::read(Vmcs::TSC_MULTIPLIER) : 1ULL << 48;
+}
+
+uint64 Vcpu::host_tsc_deadline()
+{
+    uint64 const ticks{tsc_deadline - guest_tsc_offset()};
+    uint64 const multiplier{guest_tsc_multiplier()};
+
+    if (EXPECT_TRUE(multiplier == 1ULL << 48)) {
+        return ticks;
+    }
+
+    // The guest TSC is (host TSC * multiplier) >> 48 plus the offset. We round up, so the timer does not fire
+    // before the guest TSC reaches the deadline.
+    if (multiplier == 0 or ticks >> 16 >= multiplier) {
+        return ~0ULL;
+    }
+
+    uint64 rem;
+    uint64 const host{div128(ticks >> 16, ticks << 48, multiplier, rem)};
+
+    return rem and host != ~0ULL ? host + 1 : host;
+}
+
+void Vcpu::deliver_tsc_deadline()
+{
+    // Without virtual-interrupt delivery, the timer stays armed until the VMM enables it, like posted
+    // interrupts.
+    if (not vint_delivery_enabled() or rdtsc() < host_tsc_deadline()) {
+        return;
+    }
+
+    uint32 const lvt{lvt_timer()};
+    unsigned const vector{lvt & 0xff};
+
+    // Like the LAPIC, we disarm the timer when it fires. A masked timer or one that the guest switched to
+    // another mode raises no interrupt. Vectors below 16 are illegal.
+    tsc_deadline = 0;
+
+    if ((lvt & (LVT_MASKED | LVT_TIMER_MODE)) == LVT_TSC_DEADLINE and vector >= 16) {
+        request_virtual_interrupt(vector);
+    }
+}
+
+bool Vcpu::guest_in_kernel() { return (Vmcs::read(Vmcs::GUEST_AR_SS) >> 5 & 0x3) == 0; }
+
+void Vcpu::flush_pv_tlb()
+{
+    // Without VPIDs, each VM entry and exit invalidates the guest TLB entries anyway.
+    if (Atomic::exchange(pv_tlb_flush_pending, false) and Vmcs::has_vpid()) {
+        Vpid::flush_context(true, Vpid_alloc::id(vpid_tag));
+    }
+}
+
+bool Vcpu::request_pv_tlb_flush(Cpuset& kick)
+{
+    Atomic::store(pv_tlb_flush_pending, true);
+
+    unsigned const cpu{Atomic::load(cpu_id)};
+
+    // A vCPU that does not execute right now flushes in Vcpu::run. If we kick the vCPU while it is still in
+    // the kernel, the NMI makes the next VM entry fail and Vcpu::run runs again. See Vcpu::post_interrupt.
+    if (Cpu::id() != cpu and Ec::remote(cpu) == Atomic::load(owner)) {
+        kick.set(cpu);
+        return true;
+    }
+
+    return false;
+}
+
+bool Vcpu::pv_tlb_flushing()
+{
+    return Atomic::load(pv_tlb_flush_pending) and Ec::remote(Atomic::load(cpu_id)) == Atomic::load(owner);
+}
+
+void Vcpu::pv_tlb_flush(mword mask)
+{
+    static constexpr unsigned BITS{sizeof(mword) * 8};
+
+    Vcpu* kicked[BITS];
+    unsigned kicked_cnt{0};
+    Cpuset kick;
+
+    auto const drop{[](Vcpu* vcpu) {
+        if (vcpu->del_rcu()) {
+            Rcu::call(vcpu);
+        }
+    }};
+
+    // The guest invalidates the TLB of the current vCPU itself.
+    if (pv_tlb_index.has_value()) {
+        mask &= ~(1UL << pv_tlb_index.value());
+    }
+
+    for (; mask; mask &= mask - 1) {
+        Vcpu* const vcpu{pd->get_pv_vcpu(static_cast<mword>(bit_scan_forward(mask)))};
+
+        if (not vcpu) {
+            continue;
+        }
+
+        if (vcpu->request_pv_tlb_flush(kick)) {
+            kicked[kicked_cnt++] = vcpu;
+        } else {
+            drop(vcpu);
+        }
+    }
+
+    // Several of the vCPUs may execute on the same CPU, but one NMI makes all of them exit.
+    Lapic::send_nmi(kick);
+
+    // The guest may free the page tables when the hypercall returns. Another vCPU may wait for us in the
+    // same way, so we also serve our own requests while we wait.
+    for (unsigned i = 0; i < kicked_cnt; i++) {
+        while (kicked[i]->pv_tlb_flushing()) {
+            flush_pv_tlb();
+            relax();
+        }
+
+        drop(kicked[i]);
+    }
+}
+
+bool Vcpu::virtual_interrupt_deliverable()
+{
+    mword const intr_sts{Vmcs::read(Vmcs::GUEST_INTR_STS)};
+    uint32 const vtpr{Atomic::load<uint32, Atomic::RELAXED>(
+        static_cast<uint32*>(kp_vlapic_page->data_page())[VAPIC_TPR / sizeof(uint32)])};
+
+    // The virtual processor priority is the priority class of the TPR or of the highest in-service
+    // interrupt (SVI), whichever is higher.
+    mword const rvi{intr_sts & 0xf0};
+    mword const vppr{max(mword{vtpr & 0xf0}, intr_sts >> 8 & 0xf0)};
+
+    return rvi > vppr;
+}
+
+bool Vcpu::poll_halt()
+{
+    // A guest that halts with interrupts disabled only waits for events that the VMM delivers.
+    if (not(Vmcs::read(Vmcs::GUEST_RFLAGS) & Cpu::EFL_IF)) {
+        return false;
+    }
+
+    uint64 const start{rdtsc()};
+    uint64 now{start};
+
+    for (;;) {
+        // Other vCPUs wait for us, while we poll.
+        if (Atomic::load(pv_tlb_flush_pending)) {
+            flush_pv_tlb();
+        }
+
+        // Hedron itself wakes up the guest with posted interrupts and the TSC deadline timer. Without
+        // virtual-interrupt delivery, only the VMM can wake up the guest, unless we inject posted interrupts.
+        if (Atomic::load(posted_pending)) {
+            deliver_posted_interrupts();
+        }
+
+        // A soft poke only kicks, which the halted guest doesn't notice while we poll.
+        if (Atomic::load(vapic_irr_stale)) {
+            sync_virtual_interrupts();
+        }
+
+        if (tsc_deadline) {
+            deliver_tsc_deadline();
+        }
+
+        if ((vint_delivery_enabled() and virtual_interrupt_deliverable()) or injection_pending()) {
+            Sched_stats::count(&Sched_stats::halt_poll_hit_cnt);
+            break;
+        }
+
+        // A poke usually means that the VMM wants to inject an interrupt. The VMM sees the HLT exit, but
+        // doesn't have to block.
+        if (Atomic::load(poked)) {
+            Sched_stats::count(&Sched_stats::halt_poll_hit_cnt);
+            Sched_stats::count(&Sched_stats::halt_poll_tsc, now - start);
+            return false;
+        }
+
+        // Polling must not delay other work of this CPU. We poll with interrupts disabled, so host
+        // interrupts wait in the LAPIC until we return.
+        if ((Atomic::load(Cpu::hazard()) & ~HZD_LAZY) or Lapic::interrupt_pending() or
+            Sc::current()->budget_remaining(now) == 0) {
+            Sched_stats::count(&Sched_stats::halt_poll_tsc, now - start);
+            return false;
+        }
+
+        if (now - start >= halt_poll_window) {
+            Sched_stats::count(&Sched_stats::halt_poll_miss_cnt);
+            Sched_stats::count(&Sched_stats::halt_poll_tsc, now - start);
+
+            halt_exit_tsc = now;
+            return false;
+        }
+
+        relax();
+        now = rdtsc();
     }
 
-    if (EXPECT_FALSE(host_dr[3] != regs.dr3)) {
-        set_dr3(regs.dr3);
-    }
+    Sched_stats::count(&Sched_stats::halt_poll_tsc, now - start);
 
-    if (EXPECT_FALSE(host_dr[4] != regs.dr6)) {
-        set_dr6(regs.dr6);
+    return true;
+}
+
+void Vcpu::adapt_halt_poll_window()
+{
+    uint64 const waited{rdtsc() - halt_exit_tsc};
+    uint64 const min_window{us_as_ticks_in_freq(Lapic::freq_tsc, HALT_POLL_MIN_US)};
+    uint64 const max_window{us_as_ticks_in_freq(Lapic::freq_tsc, HALT_POLL_MAX_US)};
+
+    halt_exit_tsc = 0;
+
+    // Like the halt polling of KVM, we grow the window if a longer one would have caught the wake-up and
+    // shrink it if the guest slept for long, because polling would only have wasted CPU time.
+    if (waited < max_window) {
+        halt_poll_window = min(max(halt_poll_window * 2, min_window), max_window);
+    } else {
+        halt_poll_window = halt_poll_window / 2 < min_window ? 0 : halt_poll_window / 2;
     }
 }
 
-void Vcpu::save_dr()
+void Vcpu::update_steal_time()
 {
-    mword* const host_dr = Vcpu::host_dr();
+    Sc* const sc{Sc::current()};
+    uint64 const stolen{sc->id == steal_sc_id ? sc->wait - steal_sc_wait : 0};
 
-    // Save Debug Registers. DR7 is special. The CPU loads a default value on VM exit that disables all
-    // debugging functionality. That means, we don't have to restore any host values here, because they are
-    // not used.
-    //
-    // We read the debug registers only once here and cache their values, because reading them is expensive.
-    host_dr[0] = regs.dr0 = get_dr0();
-    host_dr[1] = regs.dr1 = get_dr1();
-    host_dr[2] = regs.dr2 = get_dr2();
-    host_dr[3] = regs.dr3 = get_dr3();
-    host_dr[4] = regs.dr6 = get_dr6();
+    steal_sc_id = sc->id;
+    steal_sc_wait = sc->wait;
+
+    if (not stolen and not steal_preempted) {
+        return;
+    }
+
+    auto* const st{static_cast<Vcpu_steal_time*>(kp_steal_time->data_page())};
+    uint64 const khz{Lapic::freq_tsc};
+
+    steal_tsc += stolen;
+    steal_preempted = false;
+
+    // Like KVM, we make the version odd while we update the record. The guest reads it again, until the
+    // version is even and did not change.
+    Atomic::store<uint32, Atomic::RELAXED>(st->version, ++steal_version);
+    barrier();
+
+    // Converting the whole time avoids accumulating rounding errors and this split avoids overflows.
+    Atomic::store<uint64, Atomic::RELAXED>(
+        st->steal, steal_tsc / khz * 1000000 + steal_tsc % khz * 1000000 / khz);
+    Atomic::store<uint8, Atomic::RELAXED>(st->preempted, 0);
+
+    barrier();
+    Atomic::store<uint32, Atomic::RELAXED>(st->version, ++steal_version);
 }
 
-bool Vcpu::injecting_event()
+void Vcpu::mark_preempted()
 {
-    // The intr_info field is only valid inbound from userspace. But on the way to userspace we clear mtd and
-    // won't read it.
-    return (utcb()->mtd & Mtd::INJ) and (utcb()->intr_info & Vmcs::EVENT_VALID);
+    if (not kp_steal_time or steal_preempted) {
+        return;
+    }
+
+    auto* const st{static_cast<Vcpu_steal_time*>(kp_steal_time->data_page())};
+
+    steal_preempted = true;
+    Atomic::store<uint8, Atomic::RELAXED>(st->preempted, 1);
 }
 
 void Vcpu::synthesize_poked_exit()
@@ -239,6 +1655,39 @@ void Vcpu::synthesize_poked_exit()
     exit_reason_shadow = Vmcs::VMX_POKED;
 }
 
+bool Vcpu::fill_ept()
+{
+    mword const qual{exit_info.read<Vmcs::EXI_QUALIFICATION>()};
+
+    // We only fill unmapped memory (bits 5:3 are the rights of the guest-physical address). If the violation
+    // happened while the CPU delivered an event, the VMM has to inject it again.
+    if ((qual & 0x38) or (exit_info.read<Vmcs::IDT_VECT_INFO>() & (1U << 31))) {
+        return false;
+    }
+
+    if (not active_ept_view_pd()->fill_ept(exit_info.read<Vmcs::INFO_PHYS_ADDR>())) {
+        return false;
+    }
+
+    // The guest executes the faulting instruction again. If it was an IRET that unblocked NMIs, we have to
+    // block them again. See Intel SDM Vol. 3 Chap. 28.2.3 "Information about NMI Unblocking Due to IRET".
+    if (qual & (1U << 12)) {
+        Vmcs::write(Vmcs::GUEST_INTR_STATE, Vmcs::read(Vmcs::GUEST_INTR_STATE) | 0x8);
+    }
+
+    return true;
+}
+
+bool Vcpu::is_cow_write()
+{
+    // Bit 1 of the exit qualification is set for data writes.
+    if (not(exit_info.read<Vmcs::EXI_QUALIFICATION>() & 0x2)) {
+        return false;
+    }
+
+    return active_ept_view_pd()->ept.lookup(exit_info.read<Vmcs::INFO_PHYS_ADDR>()).attr & Ept::PTE_COW;
+}
+
 void Vcpu::run()
 {
     // Only the owner of a vCPU is allowed to run it. This check must always come first in this function!
@@ -246,6 +1695,12 @@ void Vcpu::run()
 
     vmcs->make_current();
 
+    // The vCPU ran on another CPU before. See Vcpu::migrate.
+    if (EXPECT_FALSE(host_state_stale)) {
+        Vmcs::set_host_cpu(cpu_id);
+        host_state_stale = false;
+    }
+
     // When the host received an NMI we give them to the next passthrough vCPU that runs.
     if (passthrough_vcpu and EXPECT_FALSE(Cpu::fetch_spurious_nmi())) {
         utcb()->exit_flags |= Utcb_exit_flags::NMI_PENDING;
@@ -260,7 +1715,7 @@ void Vcpu::run()
         // Another CPU might have already sent an NMI before seeing that NMIs might not work anymore and we
         // might receive it when we already entered the geust. We promise to look at hazards before returning
         // to (host) userspace.
-        Atomic::add(Counter::tlb_shootdown(), static_cast<uint16>(1));
+        Counter::ack_tlb_shootdown();
     }
 
     // We check the hazards here again to avoid racyness due to our NMI handling. The following can happen:
@@ -271,8 +1726,14 @@ void Vcpu::run()
     Ec::handle_hazards(Ec::resume_vcpu);
 
     exit_reason_shadow = Optional<uint32>{};
+    exit_info.invalidate();
     has_pending_mtf_trap = false;
 
+    // The VMM runs the vCPU again after the guest woke up from a HLT that we returned to the VMM.
+    if (EXPECT_FALSE(halt_exit_tsc)) {
+        adapt_halt_poll_window();
+    }
+
     if (EXPECT_FALSE(Atomic::load(poked))) {
         // Someone poked this vCPU, this means that this vCPU must return to user space as soon as possible.
         //
@@ -302,9 +1763,44 @@ void Vcpu::run()
     // member variable.
     Vmcs::write(Vmcs::HOST_RSP, host_rsp());
 
-    const mword host_cr3{Pd::current()->hpt.root() | (Cpu::feature(Cpu::FEAT_PCID) ? Pd::current()->did : 0)};
+    // Another vCPU may have taken over the VPID of this vCPU since it ran last. The new VPID may still tag
+    // TLB entries of its previous owner.
+    if (Vmcs::has_vpid() and Vmcs::vpid_alloc().assign(vpid_tag)) {
+        mword const vpid{Vpid_alloc::id(vpid_tag)};
+
+        Vmcs::write(Vmcs::VPID, vpid);
+        Vpid::flush_context(true, vpid);
+    }
+
+    Pd* const host_pd{Pd::current()};
+    const mword host_cr3{host_pd->hpt.root() | (Cpu::feature(Cpu::FEAT_PCID) ? host_pd->pcid() : 0)};
     Vmcs::write(Vmcs::HOST_CR3, host_cr3);
 
+    // Without a PML buffer, the CPU would log guest-physical addresses to physical address zero.
+    bool const pml_without_buffer{(regs.mtd & Mtd::CTRL) and (utcb()->ctrl[1] & Vmcs::CPU_PML) and
+                                  not kp_pml_buffer};
+
+    // Without bitmaps, the CPU would use physical page zero as VMREAD and VMWRITE bitmaps.
+    bool const shadow_without_bitmaps{(regs.mtd & Mtd::CTRL) and
+                                      (utcb()->ctrl[1] & Vmcs::CPU_VMCS_SHADOW) and not kp_vmread_bitmap};
+
+    bool const ctrl_changed{(regs.mtd & Mtd::CTRL) != 0};
+    bool const ept_view_changed{(regs.mtd & Mtd::EPT_VIEW) != 0};
+
+    // The VMM takes over the interrupt window, when it sets the controls or injects an event itself.
+    if (regs.mtd & (Mtd::CTRL | Mtd::INJ)) {
+        inject_window = false;
+    }
+
+    // The same goes for the TPR threshold.
+    if (regs.mtd & Mtd::TPR) {
+        inject_tpr_threshold = Optional<uint32>{};
+    }
+
+    // The guest MSRs are still loaded, unless another vCPU ran on this CPU, we returned to host user space or
+    // the VMM changed them.
+    bool const load_guest_msrs{guest_msrs() != this or (regs.mtd & (Mtd::SYSCALL_SWAPGS | Mtd::TSC))};
+
     // This a workaround until hedron#252 is resolved.
     utcb()->mtd = regs.mtd;
     utcb()->save_vmx(&regs, passthrough_vcpu);
@@ -314,9 +1810,90 @@ void Vcpu::run()
     // We have to do this after loading the state above, so it's not overwritten. We also don't want to modify
     // the value in the vCPU state page so we can roll back to the value that userspace intended.
     if (EXPECT_FALSE(has_pending_mtf_trap)) {
-        regs.vmx_set_cpu_ctrl0(utcb()->ctrl[0] | Vmcs::Ctrl0::CPU_MTF, passthrough_vcpu);
+        set_cpu_ctrl0(utcb()->ctrl[0] | Vmcs::Ctrl0::CPU_MTF);
+    } else if (EXPECT_FALSE(ctrl_changed or idle_exits_stale)) {
+        // Utcb::save_vmx only knows the controls that the VMM asked for.
+        set_cpu_ctrl0(utcb()->ctrl[0]);
+    }
+
+    idle_exits_stale = false;
+
+    // Utcb::save_vmx doesn't know the EPT views.
+    if (EXPECT_FALSE(ept_view_changed)) {
+        set_active_ept_view(utcb()->ept_view);
+    }
+
+    // A PD may have asked for accessed and dirty flags since the last VM entry. See Space_mem::ept_ad.
+    if (EXPECT_FALSE(wanted_ept_ad_views() != ept_ad_views)) {
+        update_eptps();
+    }
+
+    // The CPU reads the MSR bitmap on each access, so changes take effect with this VM entry.
+    if (EXPECT_FALSE(ctrl_changed or msr_exits_stale)) {
+        msr_exits_stale = false;
+        update_x2apic_msr_exits();
+    }
+
+    mword const msr_cnt{load_guest_msrs ? mword{Msr_area::MSR_COUNT} : 0};
+
+    if (msr_cnt != guest_msr_load_cnt) {
+        Vmcs::write(Vmcs::ENT_MSR_LD_CNT, msr_cnt);
+        guest_msr_load_cnt = msr_cnt;
+    }
+
+    // Interrupts that stayed posted or soft pokes that came while virtual-interrupt delivery was disabled are
+    // handled once the VMM enables it.
+    if (EXPECT_FALSE(ctrl_changed)) {
+        Atomic::store(posted_pending, true);
+        Atomic::store(vapic_irr_stale, true);
+    }
+
+    // Interrupts that were posted while the vCPU did not execute are delivered with this VM entry. This has
+    // to happen after loading the state above, because the VMM may have changed the guest interrupt status.
+    if (EXPECT_FALSE(Atomic::load(posted_pending))) {
+        deliver_posted_interrupts();
+    }
+
+    // The same goes for interrupts that the VMM set in the virtual-APIC page itself before a soft poke.
+    if (EXPECT_FALSE(Atomic::load(vapic_irr_stale))) {
+        sync_virtual_interrupts();
+    }
+
+    // A guest TSC deadline that has passed is delivered the same way. See EXIT_POLICY_TSC_DEADLINE.
+    if (EXPECT_FALSE(tsc_deadline)) {
+        deliver_tsc_deadline();
+    }
+
+    // Without virtual-interrupt delivery, we inject posted interrupts ourselves. See EXIT_POLICY_INJECT.
+    if (EXPECT_FALSE(exit_policy & EXIT_POLICY_INJECT)) {
+        inject_posted_interrupt();
+    }
+
+    // Hedron has no timer of its own, so the budget of a reservation and the guest TSC deadline are enforced
+    // with the preemption timer.
+    vmm_timer_rest = Optional<uint64>{};
+
+    uint64 const now{rdtsc()};
+    uint64 timeout{Sc::current()->budget_remaining(now)};
+
+    if (EXPECT_FALSE(tsc_deadline)) {
+        uint64 const deadline{host_tsc_deadline()};
+
+        timeout = min(timeout, deadline > now ? deadline - now : 0);
+    }
+
+    if (EXPECT_FALSE(timeout != ~0ULL)) {
+        uint64 const vmm_timeout{vmx_timer::get()};
+
+        if (timeout < vmm_timeout) {
+            vmm_timer_rest = vmm_timeout - timeout;
+            vmx_timer::set(timeout);
+        }
     }
 
+    // The class of service or monitoring ID may have changed while the vCPU and its VMM stayed in their PD.
+    Rdt::switch_pqr(Atomic::load(pd->rdt_cos), Atomic::load(pd->rdt_rmid));
+
     // Invalidate stale guest TLB entries if necessary.
     if (EXPECT_FALSE(Pd::current()->stale_guest_tlb.chk(Cpu::id()))) {
         Pd::current()->stale_guest_tlb.clr(Cpu::id());
@@ -326,17 +1903,63 @@ void Vcpu::run()
         Pd::current()->ept.invalidate();
     }
 
+    // The same goes for the other EPTs that the guest can switch to. See Space_mem::shootdown.
+    for (unsigned i{1}; i < num_ept_views; i++) {
+        Pd* const view{ept_views[i].get()};
+
+        // Another vCPU of this CPU may have dropped the view. We set the bit before we check for stale
+        // entries, so shootdowns either kick us or find us already invalidating. See Vcpu::set_ept_views.
+        if (EXPECT_FALSE(not view->ept_view_cpus.chk(Cpu::id()))) {
+            view->ept_view_cpus.set(Cpu::id());
+        }
+
+        if (EXPECT_FALSE(view->stale_guest_tlb.chk(Cpu::id()))) {
+            view->stale_guest_tlb.clr(Cpu::id());
+            view->ept.invalidate();
+        }
+    }
+
+    if (EXPECT_FALSE(kp_steal_time)) {
+        update_steal_time();
+    }
+
+    // Other vCPUs of the guest may have changed its page tables. See EXIT_POLICY_PV_TLB_FLUSH.
+    if (EXPECT_FALSE(Atomic::load(pv_tlb_flush_pending))) {
+        flush_pv_tlb();
+    }
+
     // Intel VT does not context switch the CR2, thus we have to do this.
     if (EXPECT_FALSE(get_cr2() != regs.cr2)) {
         set_cr2(regs.cr2);
     }
 
-    Ec::current()->save_fpu();
-
     // The VMCS does not contain any FPU state, thus we have to context switch it. After the VM entry the
-    // guest will execute using this FPU state, which we also have to save after the VM exit.
-    if (EXPECT_FALSE(not fpu.load_from_user())) {
-        trace(TRACE_ERROR, "Refusing VM entry because loading the FPU state caused a #GP exception");
+    // guest will execute using this FPU state, which we also have to save before we return to the VMM. If we
+    // come from a VM exit that we handled in the kernel, the guest FPU state is still loaded.
+    if (not fpu_live) {
+        Ec::current()->save_fpu();
+
+        if (EXPECT_FALSE(not fpu.load_from_user())) {
+            trace(TRACE_ERROR, "Refusing VM entry because loading the FPU state caused a #GP exception");
+
+            exit_reason_shadow = Vmcs::VMX_FAIL_STATE | Vmcs::VMX_ENTRY_FAILURE;
+            asm volatile("jmp entry_vmx_failure");
+            UNREACHED;
+        }
+
+        fpu_live = true;
+    }
+
+    if (EXPECT_FALSE(pml_without_buffer)) {
+        trace(TRACE_ERROR, "Refusing VM entry due to page-modification logging without PML buffer");
+
+        exit_reason_shadow = Vmcs::VMX_FAIL_STATE | Vmcs::VMX_ENTRY_FAILURE;
+        asm volatile("jmp entry_vmx_failure");
+        UNREACHED;
+    }
+
+    if (EXPECT_FALSE(shadow_without_bitmaps)) {
+        trace(TRACE_ERROR, "Refusing VM entry due to VMCS shadowing without shadow VMCS");
 
         exit_reason_shadow = Vmcs::VMX_FAIL_STATE | Vmcs::VMX_ENTRY_FAILURE;
         asm volatile("jmp entry_vmx_failure");
@@ -355,14 +1978,52 @@ void Vcpu::run()
 
     load_dr();
 
+    // The counters of another vCPU must not be visible to this one. See pmu_owner.
+    if (EXPECT_FALSE(pmu_owner() != (pmu_access ? this : nullptr))) {
+        switch_pmu();
+    }
+
+    // The VM exit stored the value of the guest in the MSR area. See set_pmu.
+    if (EXPECT_FALSE(pmu_access)) {
+        Vmcs::write(Vmcs::GUEST_PERF_GLOBAL_CTRL, guest_msr_area->ia32_perf_global_ctrl.msr_data);
+    }
+
     // If we knew for sure that SPEC_CTRL is available, we could load it via the MSR area (guest_msr_area).
     // The problem is that older CPUs may boot with a microcode that doesn't expose SPEC_CTRL. It only becomes
     // available once microcode is updated. So we manually context switch it instead.
     //
     // Another complication is that userspace may set invalid bits and we don't have the knowledge to sanitize
     // the value. To avoid dying with a #GP in the kernel, we just handle it and carry on.
-    if (EXPECT_TRUE(Cpu::feature(Cpu::FEAT_IA32_SPEC_CTRL)) and regs.spec_ctrl != 0) {
-        Msr::write_safe(Msr::IA32_SPEC_CTRL, regs.spec_ctrl);
+    //
+    // The value of the last VM exit is still loaded, unless the CPU switched security domains since.
+    if (EXPECT_TRUE(Cpu::feature(Cpu::FEAT_IA32_SPEC_CTRL)) and regs.spec_ctrl != spec_ctrl() and
+        Msr::write_safe(Msr::IA32_SPEC_CTRL, regs.spec_ctrl)) {
+        spec_ctrl() = regs.spec_ctrl;
+    }
+
+    // The guest must not read data of another security domain from the L1D cache (L1TF).
+    if (EXPECT_FALSE(l1d_flush())) {
+        if (Cpu::feature(Cpu::FEAT_L1D_FLUSH)) {
+            Msr::write(Msr::IA32_FLUSH_CMD, 1);
+        }
+
+        l1d_flush() = false;
+    }
+
+    if (EXPECT_FALSE(pending_exit_stats)) {
+        Vcpu_exit_stats::inc(pending_exit_stats->tsc, rdtsc() - pending_exit_tsc);
+        pending_exit_stats = nullptr;
+    }
+
+    Sched_stats::leave_kernel();
+
+    // On an isolated CPU, the execution of the guest is an extended quiescent state. Other CPUs count us as
+    // quiet for new RCU batches and don't send us NMIs for their kernel work until the next VM exit. We must
+    // not touch objects that RCU protects from here on. A batch that started before we set the flag is not
+    // counted for us, so we pass through a quiescent state for it ourselves.
+    if (EXPECT_FALSE(Atomic::load(Cpu::isolated()))) {
+        Atomic::store(Cpu::isolated_guest(), true);
+        Rcu::quiet_expedited();
     }
 
     // clang-format off
@@ -395,8 +2056,22 @@ void Vcpu::handle_vmx()
     // As a precaution we check whether it is really the vCPUs owner that is currently executing.
     assert(Atomic::load(owner) == Ec::current());
 
-    // Unblock NMIs if we blocked them due to entering the vCPU in wait for SIPI state.
-    Atomic::store(Cpu::might_lose_nmis(), false);
+    // Unblock NMIs if we blocked them due to entering the vCPU in wait for SIPI state. A shootdown NMI that
+    // another CPU claimed while NMIs were blocked may never have been sent, so we acknowledge its generation
+    // here. We look at our hazards before we enter the guest again.
+    if (EXPECT_FALSE(Atomic::exchange(Cpu::might_lose_nmis(), false))) {
+        Counter::ack_tlb_shootdown();
+    }
+
+    // Leave the extended quiescent state of an isolated CPU before we touch anything that RCU protects. See
+    // Vcpu::run. Work that other CPUs queued for us in the meantime waits in our hazards.
+    bool const was_isolated{Atomic::load(Cpu::isolated_guest()) and
+                            Atomic::exchange(Cpu::isolated_guest(), false)};
+
+    Sched_stats::count(&Sched_stats::vm_exit_cnt);
+    Sched_stats::enter_kernel(&Sched_stats::vm_exit_tsc);
+
+    uint64 const exit_tsc{kp_exit_stats ? rdtsc() : 0};
 
     // To defend against Spectre v2 other kernels would stuff the return stack buffer (RSB) here to avoid the
     // guest injecting branch targets. This is not necessary for us, because we start from a fresh stack and
@@ -409,12 +2084,10 @@ void Vcpu::handle_vmx()
 
         regs.spec_ctrl = guest_spec_ctrl;
 
-        // Don't leak the guests SPEC_CTRL settings into the host and disable
-        // all hardware-based mitigations.  We do this early to avoid
-        // performance penalties due to enabled mitigation features.
-        if (guest_spec_ctrl != 0) {
-            Msr::write(Msr::IA32_SPEC_CTRL, 0);
-        }
+        // The guest shares the security domain of its PD with the VMM, so its SPEC_CTRL settings only need
+        // to go, when this CPU switches to another domain. Until then, we save the MSR writes on each exit
+        // and entry. See Pd::switch_domain.
+        spec_ctrl() = guest_spec_ctrl;
     }
 
     // The VM exit forces the GDT limit to 0xFFFF. We need to make sure this matches our GDT.
@@ -423,21 +2096,39 @@ void Vcpu::handle_vmx()
     // Restore XCR0 before context switching the FPU, to use our own value instead of the guest's.
     Fpu::restore_xcr0();
 
-    // The FPU content is still the state of our guest, thus to not corrupt it we immeadiately save it.
-    // Currently we save the FPU too often, e.g. in case of a EXTINT we don't have to save the FPU if we
-    // immediately reenter the vCPU, but we don't know whether Ec::resume_vcpu reschedules us.
-    fpu.save();
-
-    Ec::current()->load_fpu();
+    // The FPU content is still the state of our guest. We leave it in place until we return to the VMM or
+    // Ec::resume_vcpu reschedules us. See fpu_live.
 
     save_dr();
 
+    Event_trace::record(Event_trace::VM_EXIT, exit_reason());
+
     uint16 basic_exit_reason{static_cast<uint16>(exit_reason() & 0xffff)};
 
+    if (EXPECT_FALSE(was_isolated and basic_exit_reason == Vmcs::VMX_EXC_NMI and
+                     (exit_info.read<Vmcs::EXI_INTR_INFO>() & 0x7ff) == 0x202)) {
+        Sched_stats::count(&Sched_stats::isolated_nmi_cnt);
+    }
+
+    // Vcpu::run adds the time until the next VM entry.
+    if (EXPECT_FALSE(kp_exit_stats and basic_exit_reason < NUM_VMI)) {
+        pending_exit_stats = static_cast<Vcpu_exit_stats*>(kp_exit_stats->data_page()) + basic_exit_reason;
+        pending_exit_tsc = exit_tsc;
+
+        Vcpu_exit_stats::inc(pending_exit_stats->count);
+    }
+
+    // The VM exit leaves the guest MSRs loaded. If the VM entry failed, we don't know which MSRs are loaded.
+    // See Vcpu::run and Vcpu::restore_host_msrs.
+    host_msrs_stale() = true;
+    guest_msrs() = (exit_reason() & Vmcs::VMX_ENTRY_FAILURE or basic_exit_reason == Vmcs::VMX_FAIL_VMENTRY)
+                       ? nullptr
+                       : this;
+
     if (EXPECT_FALSE(has_pending_mtf_trap)
         // If userspace had MTF enabled, we should not hide the exit from it.
         and ((utcb()->ctrl[0] & Vmcs::Ctrl0::CPU_MTF) == 0)) {
-        regs.vmx_set_cpu_ctrl0(utcb()->ctrl[0], passthrough_vcpu);
+        set_cpu_ctrl0(utcb()->ctrl[0]);
 
         // Even when we enable MTF, we might get different exits due to event injection failures. We only want
         // to hide our MTF exit, because it is an implementation detail of how poke currently works.
@@ -447,6 +2138,22 @@ void Vcpu::handle_vmx()
     }
     has_pending_mtf_trap = false;
 
+    // Give the VMM back the preemption timer it programmed. If the timer expired because of our own timeout,
+    // the VMM must not see the exit. Either the guest TSC deadline has passed and Vcpu::run injects the timer
+    // interrupt, or the budget of our reservation is exhausted and we reschedule and enter again later.
+    if (EXPECT_FALSE(vmm_timer_rest.has_value())) {
+        vmx_timer::set(vmx_timer::get() + vmm_timer_rest.value());
+        vmm_timer_rest = Optional<uint64>{};
+
+        if (basic_exit_reason == Vmcs::VMX_PREEMPT) {
+            if (not tsc_deadline or rdtsc() < host_tsc_deadline()) {
+                Atomic::set_mask(Cpu::hazard(), HZD_SCHED);
+            }
+
+            continue_running();
+        }
+    }
+
     // We only care for the basic exit reason here, i.e. the first 16 bits of the exit reason.
     switch (basic_exit_reason) {
     case Vmcs::VMX_FAIL_STATE:
@@ -458,10 +2165,121 @@ void Vcpu::handle_vmx()
     case Vmcs::VMX_INIT:
         // After sending the INIT-IPI, the guest will send the SIPI-IPI after 10ms. When the CPU is executing
         // code in Hedron or host userspace, it is not in wait-for-SIPI state and the IPI will be lost.  To
-        // reduce the chance of this happening, we handle the INIT IPI here instead of userspace.
+        // reduce the chance of this happening, we handle the INIT IPI here instead of userspace. INIT also
+        // resets the LAPIC timer.
+        tsc_deadline = 0;
         utcb()->actv_state = 3; // wait for SIPI state.
         regs.mtd |= Mtd::STA;
         continue_running();
+    case Vmcs::VMX_PAUSE:
+        // We enable PAUSE-loop exiting for non-passthrough vCPUs. Unless the VMM asked for these exits
+        // itself, the vCPU is spinning on a lock and should let other SCs run. Both the lock holder and the
+        // vCPU are usually ready on this CPU, so rescheduling gives the lock holder a chance to make progress
+        // without a round trip to the VMM. The PAUSE instruction is executed again after the VM entry.
+        if (not passthrough_vcpu and (utcb()->ctrl[0] & Vmcs::Ctrl0::CPU_PAUSE) == 0 and
+            (utcb()->ctrl[1] & Vmcs::CPU_PAUSE_LOOP) == 0) {
+            Atomic::set_mask(Cpu::hazard(), HZD_SCHED);
+            continue_running();
+        }
+        break;
+    case Vmcs::VMX_HLT:
+        // Non-passthrough vCPUs always exit on HLT. The VMM would block until an interrupt arrives for the
+        // guest, which costs a wake-up for each short sleep of the guest.
+        if ((exit_policy & EXIT_POLICY_HLT_POLL) and not passthrough_vcpu and can_skip_instruction() and
+            poll_halt()) {
+            skip_instruction();
+            continue_running();
+        }
+        break;
+    case Vmcs::VMX_INTR_WINDOW:
+        // The window that Vcpu::inject_posted_interrupt waits for. The VMM did not ask for it.
+        if (inject_window) {
+            inject_window = false;
+            regs.vmx_set_cpu_ctrl0(Vmcs::read(Vmcs::CPU_EXEC_CTRL0) & ~Vmcs::CPU_INTR_WINDOW,
+                                   passthrough_vcpu);
+            continue_running();
+        }
+        break;
+    case Vmcs::VMX_TPR_THRESHOLD:
+        // The TPR that Vcpu::inject_posted_interrupt waits for. The VMM only asked for it, if the TPR is
+        // below its own threshold as well.
+        if (inject_tpr_threshold.has_value()) {
+            uint32 const threshold{inject_tpr_threshold.value()};
+
+            Vmcs::write(Vmcs::TPR_THRESHOLD, threshold);
+            inject_tpr_threshold = Optional<uint32>{};
+
+            if ((injection_tpr() >> 4) >= (threshold & 0xf)) {
+                continue_running();
+            }
+        }
+        break;
+    case Vmcs::VMX_DR:
+        // We intercept debug register accesses for ourselves, see dr_passthrough. The guest executes the
+        // instruction again without interception.
+        if ((utcb()->ctrl[0] & Vmcs::Ctrl0::CPU_MOV_DR) == 0) {
+            dr_passthrough = true;
+            set_cpu_ctrl0(utcb()->ctrl[0]);
+            continue_running();
+        }
+        break;
+    case Vmcs::VMX_CPUID:
+        if ((exit_policy & EXIT_POLICY_CPUID) and can_skip_instruction() and emulate_cpuid()) {
+            skip_instruction();
+            continue_running();
+        }
+        break;
+    case Vmcs::VMX_XSETBV:
+        if ((exit_policy & EXIT_POLICY_XSETBV) and can_skip_instruction() and emulate_xsetbv()) {
+            skip_instruction();
+            continue_running();
+        }
+        break;
+    case Vmcs::VMX_RDMSR:
+    case Vmcs::VMX_WRMSR:
+        if ((exit_policy & EXIT_POLICY_TSC_DEADLINE) and can_skip_instruction() and
+            emulate_tsc_deadline(basic_exit_reason == Vmcs::VMX_WRMSR)) {
+            skip_instruction();
+            continue_running();
+        }
+        break;
+    case Vmcs::VMX_IO:
+        if ((ioevent_cnt or kp_io_ring) and can_skip_instruction() and handle_io_write()) {
+            skip_instruction();
+            continue_running();
+        }
+        break;
+    case Vmcs::VMX_VMCALL:
+        if ((exit_policy & EXIT_POLICY_PV_TLB_FLUSH) and regs.rax == PV_TLB_FLUSH_VMCALL and
+            can_skip_instruction() and guest_in_kernel()) {
+            pv_tlb_flush(regs.rbx);
+
+            regs.rax = 0;
+            skip_instruction();
+            continue_running();
+        }
+
+        // Paravirtual services of the guest kernel are one IPC away without a round trip to the VMM.
+        if (vmcall_pt_mask and can_skip_instruction()) {
+            if (Pt* const pt{vmcall_portal()}) {
+                Ec::call_vmcall_portal(pt, regs);
+            }
+        }
+        break;
+    case Vmcs::VMX_PML_FULL:
+        if (drain_pml_buffer()) {
+            continue_running();
+        }
+        break;
+    case Vmcs::VMX_EPT_VIOLATION:
+        // The VMM usually breaks the sharing with a single delegation and resumes the guest. It only needs
+        // the faulting address for that, so by default this exit only transfers the exit qualification.
+        if (is_cow_write()) {
+            exit_reason_shadow = Vmcs::VMX_COW_WRITE;
+        } else if (fill_ept()) {
+            continue_running();
+        }
+        break;
     case Vmcs::VMX_PREEMPT:
         // Whenever a preemption timer exit occurs we set the value to the
         // maximum possible. This allows to always keep the preemption
@@ -479,7 +2297,7 @@ void Vcpu::handle_vmx()
 
 void Vcpu::handle_exception()
 {
-    const mword vect_info{Vmcs::read(Vmcs::IDT_VECT_INFO)};
+    const mword vect_info{exit_info.read<Vmcs::IDT_VECT_INFO>()};
 
     const bool valid{(vect_info & (1u << 31)) != 0};
     if (valid) {
@@ -495,7 +2313,7 @@ void Vcpu::handle_exception()
         if (deliver_error_code) {
             // The VM exit occured during delivery of a hardware exception that would have delivered an error
             // code on the stack, thus we have to set the VM-Entr exception error code.
-            Vmcs::write(Vmcs::ENT_INTR_ERROR, Vmcs::read(Vmcs::IDT_VECT_ERROR));
+            Vmcs::write(Vmcs::ENT_INTR_ERROR, exit_info.read<Vmcs::IDT_VECT_ERROR>());
         }
 
         const mword intr_type{(vect_info >> 8) & 0x7};
@@ -506,7 +2324,7 @@ void Vcpu::handle_exception()
         }
     }
 
-    const mword intr_info{Vmcs::read(Vmcs::EXI_INTR_INFO)};
+    const mword intr_info{exit_info.read<Vmcs::EXI_INTR_INFO>()};
     const unsigned intr_vect = intr_info & 0xff;
     const unsigned intr_type = (intr_info >> 8) & 0x7;
 
@@ -515,11 +2333,39 @@ void Vcpu::handle_exception()
         // Ec::handle_exc_altstack to learn more about our NMI handling.
         Ec::do_early_nmi_work();
 
+        // A PMI of Hedron's own sampling is not meant for the guest either.
+        bool const pmi{Pmu::handle_nmi(Vmcs::read(Vmcs::GUEST_RIP), Pmu::GUEST)};
+
+        // Neither is the NMI that gathers all CPUs for a microcode update.
+        bool const ucode{Microcode::handle_nmi()};
+
+        // Overflows of the counters of a guest with PMU access are meant for the guest. Its VMM emulates the
+        // LAPIC that delivers them.
+        if (EXPECT_FALSE(not pmi and pmu_owner() == this and
+                         Pmu::overflowed(guest_msr_area->ia32_perf_global_ctrl.msr_data))) {
+            utcb()->exit_flags |= Utcb_exit_flags::PMI_PENDING;
+
+            // The LAPIC masked the entry when it delivered the PMI.
+            Lapic::set_pmi_delivery(true);
+
+            synthesize_poked_exit();
+            return_to_vmm(Sys_regs::SUCCESS);
+        }
+
+        // The NMI may be the kick of Vcpu::post_interrupt, Vcpu::soft_poke or Vcpu::request_pv_tlb_flush. The
+        // VMM does not need to see this exit.
+        bool const delivered{deliver_posted_interrupts()};
+        bool const synced{sync_virtual_interrupts()};
+
+        if (delivered or synced or injection_pending() or Atomic::load(pv_tlb_flush_pending)) {
+            continue_running();
+        }
+
         // When a guest was running and we don't see any hazards, the NMI may have been sent by the
         // passthrough guest. We don't do this when we receive the NMI in root mode, because it generates too
         // many false positives in practice. The only goal is to satisfy the guest's NMI watchdog and hung
         // task detection, so this should be good enough for the time being.
-        if (EXPECT_FALSE(Atomic::load(Cpu::hazard()) == 0)) {
+        if (EXPECT_FALSE((Atomic::load(Cpu::hazard()) & ~HZD_LAZY) == 0 and not pmi and not ucode)) {
             Cpu::spurious_nmi();
 
             // We don't want to give the NMI exit reason to userspace.
@@ -553,24 +2399,43 @@ void Vcpu::return_to_vmm(Sys_regs::Status status)
         // - the EOI_EXIT_BITMAP and the TPR_THRESHOLD, because the hardware does not modify it
         // - Mtd::TLB, because Utcb::load_vmx does not use it
         // - Mtd::FPU, because we already saved the FPU
-        Mtd mtd{~0UL & ~(Mtd::EOI | Mtd::TPR | Mtd::TLB | Mtd::FPU)};
+        Mtd mtd{Mtd::VMX_EXIT_STATE};
 
         // We only transfer the Guest interrupt status (GUEST_INTR_STS) if the "virtual-interrupt delivery"
         // field of the VM-execution control is set. This also prevents reading these fields on CPUs where
         // they don't exist. The CPU handles reading non-existent fields gracefully, but it is a performance
         // issue.
-        const bool vint_delivery_enabled{(utcb()->ctrl[0] & Vmcs::Ctrl0::CPU_SECONDARY) and
-                                         (utcb()->ctrl[1] & Vmcs::Ctrl1::CPU_VINT_DELIVERY)};
-
-        if (not vint_delivery_enabled) {
+        if (not vint_delivery_enabled()) {
             mtd.val &= ~Mtd::VINTR;
         }
 
+        if (exit_reason() == Vmcs::VMX_COW_WRITE) {
+            mtd.val &= Mtd::QUAL;
+        }
+
+        // The VMM may only be interested in a few fields for this exit reason.
+        if (kp_mtd_profile) {
+            static_assert(sizeof(mword) * NUM_VMI <= PAGE_SIZE, "MTD profile must fit into a KP");
+
+            auto* const profile{static_cast<mword*>(kp_mtd_profile->data_page())};
+            uint32 const basic_exit_reason{exit_reason() & 0xffff};
+
+            if (EXPECT_TRUE(basic_exit_reason < NUM_VMI)) {
+                mtd.val &= Atomic::load<mword, Atomic::RELAXED>(profile[basic_exit_reason]);
+            }
+        }
+
         // Utcb::load_vmx uses the Mtd bits of the given regs to determine which state to transfer, thus this
         // time we don't have to put anything into the UTCB.
         regs.mtd = mtd.val;
 
-        utcb()->load_vmx(&regs);
+        utcb()->load_vmx(&regs, exit_info);
+
+        // Utcb::load_vmx doesn't know the EPT views either.
+        if (mtd.val & Mtd::EPT_VIEW) {
+            utcb()->ept_view = active_ept_view();
+        }
+
         regs.mtd = 0;
         regs.dst_portal = 0;
 
@@ -579,6 +2444,16 @@ void Vcpu::return_to_vmm(Sys_regs::Status status)
 
     utcb()->exit_reason = exit_reason();
 
+    // The VMM has to wake up a guest that halts with an armed deadline. See EXIT_POLICY_TSC_DEADLINE.
+    if (exit_policy & EXIT_POLICY_TSC_DEADLINE) {
+        utcb()->tsc_deadline = tsc_deadline;
+    }
+
+    // The VMM finds the guest FPU state in its KP and expects its own FPU state in the registers.
+    if (save_guest_fpu()) {
+        Ec::current()->load_fpu();
+    }
+
     // We can unconditionally clear the poked flag here, because we are just about to return to the VMM.
     Atomic::store(poked, false);
 
@@ -592,21 +2467,87 @@ void Vcpu::continue_running()
     Ec::current()->resume_vcpu();
 }
 
-void Vcpu::poke()
+bool Vcpu::set_poked()
 {
     if (Atomic::exchange(poked, true)) {
         // The vCPU has already been poked before. Whoever set Vcpu::poked initially has already sent the IPI.
-        return;
+        return false;
     }
 
     if (Atomic::load(owner) == nullptr) {
         // The vCPU has no owner and thus is not running. We don't have to send an IPI.
+        return false;
+    }
+
+    // If the owner of this vCPU is currently executing on another CPU, the vCPU is currently executing. We
+    // need an NMI to force a VM exit.
+    unsigned const cpu{Atomic::load(cpu_id)};
+
+    return Cpu::id() != cpu and Ec::remote(cpu) == Atomic::load(owner);
+}
+
+void Vcpu::poke()
+{
+    if (set_poked()) {
+        Lapic::send_nmi(Atomic::load(cpu_id));
+    }
+}
+
+void Vcpu::poke(Cpuset& kick)
+{
+    if (set_poked()) {
+        kick.set(Atomic::load(cpu_id));
+    }
+}
+
+bool Vcpu::save_guest_fpu()
+{
+    if (not fpu_live) {
+        return false;
+    }
+
+    // Vcpu::handle_vmx has already restored the host XCR0.
+    fpu.save();
+    fpu_live = false;
+
+    return true;
+}
+
+void Vcpu::post_interrupt(unsigned vector)
+{
+    static constexpr unsigned BITS{sizeof(mword) * 8};
+
+    assert(vector < NUM_INT_VECTORS);
+
+    Atomic::set_mask(posted_pir[vector / BITS], 1UL << (vector % BITS));
+
+    if (Atomic::exchange(posted_pending, true)) {
+        // Whoever set Vcpu::posted_pending initially has already kicked the vCPU, if it was necessary.
+        return;
+    }
+
+    // A vCPU that does not execute right now picks up the interrupt in Vcpu::run.
+    kick();
+}
+
+void Vcpu::soft_poke()
+{
+    if (Atomic::exchange(vapic_irr_stale, true)) {
+        // Whoever set Vcpu::vapic_irr_stale initially has already kicked the vCPU, if it was necessary.
         return;
     }
 
-    if (Cpu::id() != cpu_id and Ec::remote(cpu_id) == Atomic::load(owner)) {
-        // The owner of this vCPU is currently executing on another CPU, i.e. the vCPU is currently
-        // executing. We send an NMI to force a VM exit.
-        Lapic::send_nmi(cpu_id);
+    // A vCPU that does not execute right now updates RVI in Vcpu::run.
+    kick();
+}
+
+void Vcpu::kick()
+{
+    unsigned const cpu{Atomic::load(cpu_id)};
+
+    // If we kick the vCPU while it is still in the kernel, the NMI makes the next VM entry fail and Vcpu::run
+    // runs again.
+    if (Cpu::id() != cpu and Ec::remote(cpu) == Atomic::load(owner)) {
+        Lapic::send_nmi(cpu);
     }
 }
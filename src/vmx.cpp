@@ -33,12 +33,14 @@
 #include "stdio.hpp"
 #include "tss.hpp"
 #include "vmx_preemption_timer.hpp"
+#include "vpid.hpp"
 #include "x86.hpp"
 
 Vmcs::Vmcs(mword esp, mword bmp, mword cr3, Pd* pd, unsigned cpu) : rev(basic().revision)
 {
     make_current();
 
+    // Vcpu::run enables accessed and dirty flags, if the PD asks for them. See Space_mem::ept_ad.
     uint64 const eptp = pd->ept.vmcs_eptp();
     uint32 const pin = PIN_NMI | PIN_VIRT_NMI | PIN_PREEMPT_TIMER | (pd->is_passthrough ? 0 : PIN_EXTINT);
     uint32 const exi = EXI_SAVE_PREEMPT_TIMER | EXI_SAVE_DR | EXI_SAVE_EFER | EXI_LOAD_EFER | EXI_HOST_64 |
@@ -49,10 +51,24 @@ Vmcs::Vmcs(mword esp, mword bmp, mword cr3, Pd* pd, unsigned cpu) : rev(basic().
     write(PF_ERROR_MATCH, 0);
     write(CR3_TARGET_COUNT, 0);
 
+    // A guest that executes PAUSE in a loop for longer than the window is most likely spinning on a lock
+    // whose holder does not run. The values are in TSC ticks and follow common practice.
+    if (has_ple()) {
+        write(PLE_GAP, 128);
+        write(PLE_WINDOW, 4096);
+    }
+
+    // The multiplier is a fixed-point number with 48 fractional bits. Until the VMM sets one, enabling TSC
+    // scaling doesn't change the guest TSC.
+    if (has_tsc_scaling()) {
+        write(TSC_MULTIPLIER, 1ul << 48);
+    }
+
     write(VMCS_LINK_PTR, ~0ul);
     write(VMCS_LINK_PTR_HI, ~0ul);
 
-    write(VPID, Atomic::add(remote_ref_vpid_ctr(cpu), 1U));
+    // This is not a valid VPID. Vcpu::run assigns one before the first VM entry.
+    write(VPID, 0);
 
     write(EPTP, static_cast<mword>(eptp));
     write(EPTP_HI, static_cast<mword>(eptp >> 32));
@@ -65,7 +81,6 @@ Vmcs::Vmcs(mword esp, mword bmp, mword cr3, Pd* pd, unsigned cpu) : rev(basic().
     write(HOST_SEL_DS, 0);
     write(HOST_SEL_ES, 0);
     write(HOST_SEL_FS, 0);
-    write(HOST_SEL_TR, Gdt::local_tss_selector());
 
     write(HOST_PAT, Msr::read(Msr::IA32_CR_PAT));
     write(HOST_EFER, Msr::read(Msr::IA32_EFER));
@@ -75,16 +90,16 @@ Vmcs::Vmcs(mword esp, mword bmp, mword cr3, Pd* pd, unsigned cpu) : rev(basic().
     write(ENT_CONTROLS, (ent | ctrl_ent().set) & ctrl_ent().clr);
 
     write(HOST_CR3, cr3);
-    write(HOST_CR0, get_cr0());
+    // Lazy FPU switching may have set CR0.TS, but the VM exit path always expects the FPU to be usable.
+    write(HOST_CR0, get_cr0() & ~mword{Cpu::CR0_TS});
     write(HOST_CR4, get_cr4());
 
-    write(HOST_BASE_GS, reinterpret_cast<mword>(&Cpulocal::get_remote(cpu).self));
-    write(HOST_BASE_TR, reinterpret_cast<mword>(&Tss::remote(cpu)));
+    set_host_cpu(cpu);
+
     write(HOST_BASE_GDTR, reinterpret_cast<mword>(&Gdt::gdt(0)));
     write(HOST_BASE_IDTR, reinterpret_cast<mword>(Idt::idt));
 
     write(HOST_SYSENTER_CS, SEL_KERN_CODE);
-    write(HOST_SYSENTER_ESP, reinterpret_cast<mword>(&Tss::remote(cpu).sp0));
     write(HOST_SYSENTER_EIP, reinterpret_cast<mword>(&entry_sysenter));
 
     write(HOST_RSP, esp);
@@ -93,6 +108,14 @@ Vmcs::Vmcs(mword esp, mword bmp, mword cr3, Pd* pd, unsigned cpu) : rev(basic().
     vmx_timer::set(~0ull);
 }
 
+void Vmcs::set_host_cpu(unsigned cpu)
+{
+    write(HOST_SEL_TR, Gdt::remote_tss_selector(cpu));
+    write(HOST_BASE_GS, reinterpret_cast<mword>(&Cpulocal::get_remote(cpu).self));
+    write(HOST_BASE_TR, reinterpret_cast<mword>(&Tss::remote(cpu)));
+    write(HOST_SYSENTER_ESP, reinterpret_cast<mword>(&Tss::remote(cpu).sp0));
+}
+
 bool Vmcs::try_enable_vmx()
 {
     auto feature_ctrl = Msr::read(Msr::IA32_FEATURE_CONTROL);
@@ -106,8 +129,20 @@ bool Vmcs::try_enable_vmx()
     return !!(Msr::read(Msr::IA32_FEATURE_CONTROL) & Msr::FEATURE_VMX_O_SMX);
 }
 
-void Vmcs::init()
+void Vmcs::init(bool resume)
 {
+    if (resume) {
+        if (Hip::feature() & Hip::FEAT_VMX) {
+            if (not try_enable_vmx()) {
+                panic("VMX is not available after resume");
+            }
+
+            enable();
+        }
+
+        return;
+    }
+
     if (not Cpu::feature(Cpu::FEAT_VMX) or not try_enable_vmx()) {
         Hip::clr_feature(Hip::FEAT_VMX);
         return;
@@ -154,6 +189,15 @@ void Vmcs::init()
     auto const leaf_levels{static_cast<Ept::level_t>(bit_scan_reverse(leaf_bit_mask) + 1)};
     Ept::set_supported_leaf_levels(leaf_levels);
 
+    if (leaf_levels < 3) {
+        Hip::clr_feature(Hip::FEAT_EPT_1G);
+    }
+
+    // PDs with a large guest space may run on any CPU, so all of them have to walk five levels.
+    if (not ept_vpid().walk_5) {
+        Hip::clr_feature(Hip::FEAT_EPT_5_LEVEL);
+    }
+
     fix_cr0_set() &= ~(Cpu::CR0_PG | Cpu::CR0_PE);
 
     fix_cr0_clr() |= Cpu::CR0_CD | Cpu::CR0_NW;
@@ -162,19 +206,51 @@ void Vmcs::init()
     ctrl_cpu()[0].non_passthrough_set = CPU_HLT;
     ctrl_cpu()[1].set |= CPU_VPID | CPU_URG;
 
-    if (not ept_vpid().invept) {
+    // Spinning vCPUs give up the CPU in the kernel, see Vcpu::handle_vmx. The passthrough vCPU has the CPU
+    // for itself and doesn't need this.
+    ctrl_cpu()[1].non_passthrough_set = CPU_PAUSE_LOOP;
+
+    if (not ept_vpid().invept or not(ept_vpid().invept_single or ept_vpid().invept_all)) {
         Hip::clr_feature(Hip::FEAT_VMX);
         return;
     }
 
-    if (Cmdline::novpid or not ept_vpid().invvpid) {
+    if (not ept_vpid().invept_single) {
+        Hip::clr_feature(Hip::FEAT_INVEPT_SINGLE);
+    }
+
+    Ept::set_single_context_invept(ept_vpid().invept_single);
+
+    if (Cmdline::novpid or not ept_vpid().invvpid or
+        not(ept_vpid().invvpid_single or ept_vpid().invvpid_all)) {
         ctrl_cpu()[1].clr &= ~CPU_VPID;
+    } else {
+        Vpid::set_supported(ept_vpid().invvpid_single, ept_vpid().invvpid_single_noglobal);
+    }
+
+    if (not has_vpid() or not ept_vpid().invvpid_single) {
+        Hip::clr_feature(Hip::FEAT_INVVPID_SINGLE);
+    }
+
+    // The CPU only logs modified pages when it sets dirty flags in the EPT.
+    if (not ept_vpid().accessed_dirty) {
+        ctrl_cpu()[1].clr &= ~CPU_PML;
+    }
+
+    // EPTP switching is the only VM function we support. See Vcpu::set_ept_views.
+    if ((ctrl_cpu()[1].clr & CPU_VMFUNC) and not(Msr::read(Msr::IA32_VMX_VMFUNC) & VM_FUNC_EPTP_SWITCHING)) {
+        ctrl_cpu()[1].clr &= ~CPU_VMFUNC;
     }
 
     if (has_secondary()) {
         Hip::set_secondary_vmx_caps(ctrl_cpu()[1].val);
     }
 
+    enable();
+}
+
+void Vmcs::enable()
+{
     set_cr0((get_cr0() & ~fix_cr0_clr()) | fix_cr0_set());
     set_cr4((get_cr4() & ~fix_cr4_clr()) | fix_cr4_set());
 
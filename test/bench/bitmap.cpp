@@ -0,0 +1,73 @@
+/*
+ * Bitmap Benchmarks
+ *
+ * This file is part of the Hedron hypervisor.
+ *
+ * Hedron is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Hedron is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License version 2 for more details.
+ */
+
+// Include the class under test first to detect any missing includes early
+#include <bitmap.hpp>
+
+#include <catch2/catch.hpp>
+
+#include <cstdint>
+#include <string>
+
+namespace
+{
+
+// As large as a CPU set with NUM_CPU set to its maximum.
+constexpr size_t BITS{4096};
+
+using Large_bitmap = Bitmap<mword, BITS>;
+
+} // namespace
+
+TEST_CASE("Bitmap scans", "[bitmap]")
+{
+    for (size_t const stride : {1UL, 64UL, 4096UL}) {
+        Large_bitmap bitmap{false};
+
+        for (size_t i{0}; i < BITS; i += stride) {
+            bitmap[i] = true;
+        }
+
+        BENCHMARK("for_each_set, one in " + std::to_string(stride) + " bits set")
+        {
+            size_t sum{0};
+
+            bitmap.for_each_set([&sum](size_t i) { sum += i; });
+            return sum;
+        };
+
+        BENCHMARK("find_last_set, one in " + std::to_string(stride) + " bits set")
+        {
+            return bitmap.find_last_set();
+        };
+    }
+
+    Large_bitmap empty{false};
+
+    BENCHMARK("find_last_set of an empty bitmap") { return empty.find_last_set(); };
+
+    BENCHMARK("atomic_fetch_set and atomic_clear of all bits")
+    {
+        for (size_t i{0}; i < BITS; i++) {
+            empty.atomic_fetch_set(i);
+        }
+
+        for (size_t i{0}; i < BITS; i++) {
+            empty.atomic_clear(i);
+        }
+
+        return empty.find_last_set();
+    };
+}
@@ -0,0 +1,153 @@
+/*
+ * Page Tables in Host Memory
+ *
+ * This file is part of the Hedron hypervisor.
+ *
+ * Hedron is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Hedron is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License version 2 for more details.
+ */
+
+#pragma once
+
+#include <alloc_result.hpp>
+#include <generic_page_table.hpp>
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+using host_entry = uint64_t;
+using host_pointer = host_entry*;
+
+// Page table entries in host memory. Unlike the fake memory of the unit tests, this doesn't record a
+// history, so the benchmarks measure the page table code and not the test scaffolding.
+struct Host_memory {
+    using entry = host_entry;
+    using pointer = host_pointer;
+
+    static entry read(pointer ptr) { return __atomic_load_n(ptr, __ATOMIC_SEQ_CST); }
+    static void write(pointer ptr, entry e) { __atomic_store_n(ptr, e, __ATOMIC_SEQ_CST); }
+
+    static bool cmp_swap(pointer ptr, entry old, entry desired)
+    {
+        return __atomic_compare_exchange_n(ptr, &old, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    }
+
+    static entry exchange(pointer ptr, entry desired)
+    {
+        return __atomic_exchange_n(ptr, desired, __ATOMIC_SEQ_CST);
+    }
+};
+
+// Hands out page-aligned host memory. Host virtual addresses double as physical addresses.
+struct Host_page_alloc {
+    static host_pointer phys_to_pointer(host_entry e) { return reinterpret_cast<host_pointer>(e); }
+    static host_entry pointer_to_phys(host_pointer p) { return reinterpret_cast<host_entry>(p); }
+
+    static Alloc_result<host_pointer> alloc_zeroed_page()
+    {
+        void* const page{std::aligned_alloc(PAGE_SIZE, PAGE_SIZE)};
+
+        if (page == nullptr) {
+            return Err(Out_of_memory_error{});
+        }
+
+        allocated++;
+
+        memset(page, 0, PAGE_SIZE);
+        return Ok(static_cast<host_pointer>(page));
+    }
+
+    static void free_page(host_pointer ptr)
+    {
+        freed++;
+        std::free(ptr);
+    }
+
+    // The number of page table pages that were allocated and freed so far.
+    static inline uint64_t allocated{0};
+    static inline uint64_t freed{0};
+};
+
+// There is no TLB on this side, so this only frees page tables.
+class Host_cleanup
+{
+    bool tlb_flush_{false};
+    std::vector<host_pointer> lazy_free_pages_;
+
+public:
+    Host_cleanup() = default;
+    Host_cleanup(Host_cleanup&&) = default;
+    Host_cleanup& operator=(Host_cleanup&&) = default;
+
+    ~Host_cleanup() { free_pages_now(); }
+
+    WARN_UNUSED_RESULT bool need_tlb_flush() const { return tlb_flush_; }
+
+    void ignore_tlb_flush() { tlb_flush_ = false; }
+    void flush_tlb_later() { tlb_flush_ = true; }
+    void flush_tlb_later(uint64_t, uint64_t) { tlb_flush_ = true; }
+
+    void merge(Host_cleanup& other)
+    {
+        tlb_flush_ = tlb_flush_ or other.tlb_flush_;
+        lazy_free_pages_.insert(lazy_free_pages_.end(), other.lazy_free_pages_.cbegin(),
+                                other.lazy_free_pages_.cend());
+        other.lazy_free_pages_.clear();
+    }
+
+    void free_pages_now()
+    {
+        for (host_pointer page : lazy_free_pages_) {
+            Host_page_alloc::free_page(page);
+        }
+
+        lazy_free_pages_.clear();
+    }
+
+    static Host_cleanup tlb_flush(bool tlb_flush)
+    {
+        Host_cleanup cleanup;
+
+        cleanup.tlb_flush_ = tlb_flush;
+        return cleanup;
+    }
+
+    void free_later(host_pointer page)
+    {
+        tlb_flush_ = true;
+        lazy_free_pages_.emplace_back(page);
+    }
+};
+
+struct Host_attr {
+    enum : uint64_t
+    {
+        PTE_P = 1ULL << 0,
+        PTE_W = 1ULL << 1,
+        PTE_U = 1ULL << 2,
+        PTE_A = 1ULL << 5,
+        PTE_D = 1ULL << 6,
+        PTE_S = 1ULL << 7,
+        PTE_PAT2 = 1ULL << 7,
+        PTE_PAT2_S = 1ULL << 12,
+
+        PTE_NX = 1ULL << 63,
+    };
+
+    static constexpr uint64_t mask{PTE_NX | PTE_P | PTE_W | PTE_U | PTE_A | PTE_D};
+    static constexpr uint64_t all_rights{PTE_P | PTE_W | PTE_U};
+};
+
+using Host_hpt = Generic_page_table<9, uint64_t, Host_memory, Host_page_alloc, Host_cleanup, Host_attr>;
+
+constexpr Host_hpt::ord_t FOUR_KB{PAGE_BITS};
+constexpr Host_hpt::ord_t TWO_MB{PAGE_BITS + 9};
+constexpr Host_hpt::ord_t ONE_GB{PAGE_BITS + 18};
@@ -0,0 +1,97 @@
+/*
+ * Generic Page Table Benchmarks
+ *
+ * This file is part of the Hedron hypervisor.
+ *
+ * Hedron is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Hedron is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License version 2 for more details.
+ */
+
+#include "host_page_table.hpp"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <catch2/catch.hpp>
+
+namespace
+{
+
+// The number of mappings each benchmark iteration creates.
+constexpr size_t MAPPINGS{512};
+
+constexpr uint64_t ATTR{Host_attr::PTE_P | Host_attr::PTE_W};
+
+// Map MAPPINGS consecutive mappings of the given order into an empty page table.
+void map_range(Host_hpt& hpt, Host_hpt::ord_t order, bool use_cursor)
+{
+    Host_cleanup cleanup;
+    Host_hpt::Update_cursor cursor;
+
+    for (size_t i{0}; i < MAPPINGS; i++) {
+        uint64_t const addr{static_cast<uint64_t>(i) << order};
+        Host_hpt::Mapping const mapping{addr, addr, ATTR, order};
+
+        if (use_cursor) {
+            hpt.update(cleanup, cursor, mapping).unwrap("Out of memory");
+        } else {
+            hpt.update(cleanup, mapping).unwrap("Out of memory");
+        }
+    }
+
+    cleanup.ignore_tlb_flush();
+}
+
+} // namespace
+
+// The page sizes to benchmark.
+constexpr std::pair<char const*, Host_hpt::ord_t> ORDERS[]{{"4K", FOUR_KB}, {"2M", TWO_MB}, {"1G", ONE_GB}};
+
+TEST_CASE("Page table updates", "[page_table]")
+{
+    for (auto const& [name, order] : ORDERS) {
+        for (bool const use_cursor : {false, true}) {
+            std::string const suffix{use_cursor ? " pages with a cursor" : " pages"};
+
+            BENCHMARK_ADVANCED(std::string{"Map 512 "} + name + suffix)(Catch::Benchmark::Chronometer meter)
+            {
+                // Each run needs a fresh page table. Creating it is not part of the measurement.
+                std::vector<std::unique_ptr<Host_hpt>> hpts;
+
+                for (int i{0}; i < meter.runs(); i++) {
+                    hpts.emplace_back(std::make_unique<Host_hpt>(4, 3));
+                }
+
+                meter.measure([&](int i) { map_range(*hpts[static_cast<size_t>(i)], order, use_cursor); });
+            };
+        }
+    }
+}
+
+TEST_CASE("Page table lookups", "[page_table]")
+{
+    for (auto const& [name, order] : ORDERS) {
+        Host_hpt hpt{4, 3};
+        map_range(hpt, order, true);
+
+        BENCHMARK(std::string{"Look up 512 "} + name + " pages")
+        {
+            uint64_t sum{0};
+
+            for (size_t i{0}; i < MAPPINGS; i++) {
+                sum += hpt.lookup(static_cast<uint64_t>(i) << order).paddr;
+            }
+
+            return sum;
+        };
+    }
+}
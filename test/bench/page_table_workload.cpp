@@ -0,0 +1,501 @@
+/*
+ * Generic Page Table Workloads
+ *
+ * This file is part of the Hedron hypervisor.
+ *
+ * Hedron is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Hedron is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License version 2 for more details.
+ */
+
+#include "host_page_table.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <random>
+#include <vector>
+
+#include <catch2/catch.hpp>
+
+// Randomized guest memory workloads that a VMM would cause in its guest page table. Each workload is a list
+// of batches. A batch is what a VMM would do in one go, e.g. map one memory region. The workloads are
+// replayed in different modes to compare how many page table pages and how much time each mode needs. A
+// simple model of the guest-physical address space checks that every mode ends up with the right
+// translations.
+//
+// Seed the workloads with --rng-seed.
+
+namespace
+{
+
+using Mapping = Host_hpt::Mapping;
+using ord_t = Host_hpt::ord_t;
+
+constexpr uint64_t ATTR_RW{Host_attr::PTE_P | Host_attr::PTE_W | Host_attr::PTE_U};
+constexpr uint64_t ATTR_RO{Host_attr::PTE_P | Host_attr::PTE_U};
+
+constexpr uint64_t PAGE{1ULL << FOUR_KB};
+constexpr uint64_t LARGE_PAGE{1ULL << TWO_MB};
+constexpr uint64_t GUEST_SPACE{8ULL << 30};
+
+// The guest has its RAM below 3 GiB. Hotplugged memory goes above 4 GiB.
+constexpr uint64_t RAM_END{3ULL << 30};
+constexpr uint64_t HOTPLUG_BASE{4ULL << 30};
+
+struct Op {
+    enum class Kind
+    {
+        // Change the mapping. Mappings without attributes unmap memory.
+        UPDATE,
+
+        // Promote the page tables that translate the mapping to superpages. Only done in modes that promote.
+        PROMOTE,
+
+        // Clear the dirty bits in the range of the mapping, as when a VMM harvests dirty pages.
+        HARVEST_DIRTY,
+    };
+
+    Kind kind;
+    Mapping mapping;
+};
+
+using Batch = std::vector<Op>;
+using Workload = std::vector<Batch>;
+
+// Split [vaddr, vaddr + size) into the largest mappings that are naturally aligned in guest and host memory.
+void map_region(Batch& batch, uint64_t vaddr, uint64_t paddr, uint64_t size, uint64_t attr)
+{
+    while (size) {
+        ord_t const order{static_cast<ord_t>(max_order(vaddr | paddr, size))};
+
+        batch.push_back({Op::Kind::UPDATE, {vaddr, paddr, attr, order}});
+
+        vaddr += 1ULL << order;
+        paddr += 1ULL << order;
+        size -= 1ULL << order;
+    }
+}
+
+// Map single pages, as a VMM does when it handles page faults or changes permissions of individual pages.
+void map_pages(Batch& batch, uint64_t vaddr, uint64_t paddr, uint64_t pages, uint64_t attr)
+{
+    for (uint64_t i{0}; i < pages; i++) {
+        batch.push_back({Op::Kind::UPDATE, {vaddr + i * PAGE, paddr + i * PAGE, attr, FOUR_KB}});
+    }
+}
+
+// The guest-physical to host-physical translation of the guest RAM. Host memory comes in 2 MiB aligned
+// chunks of different sizes at random places, so not all of it can be mapped with 1 GiB pages.
+struct Guest_ram {
+    struct Region {
+        uint64_t vaddr;
+        uint64_t paddr;
+        uint64_t size;
+    };
+
+    std::vector<Region> regions;
+
+    explicit Guest_ram(std::mt19937_64& rng)
+    {
+        std::uniform_int_distribution<uint64_t> chunk_size{32, 512};
+        std::uniform_int_distribution<uint64_t> host_chunk{0, (64ULL << 30) / LARGE_PAGE};
+
+        // The legacy BIOS area is backed by 4 KiB pages.
+        regions.push_back({0, host_chunk(rng) * LARGE_PAGE, 640ULL << 10});
+        regions.push_back(
+            {1ULL << 20, host_chunk(rng) * LARGE_PAGE + (1ULL << 20), LARGE_PAGE - (1ULL << 20)});
+
+        for (uint64_t vaddr{LARGE_PAGE}; vaddr < RAM_END;) {
+            uint64_t const size{std::min(chunk_size(rng) * LARGE_PAGE, RAM_END - vaddr)};
+
+            regions.push_back({vaddr, host_chunk(rng) * LARGE_PAGE, size});
+            vaddr += size;
+        }
+    }
+
+    // Returns the host address that backs the given guest address.
+    uint64_t host(uint64_t vaddr) const
+    {
+        for (Region const& r : regions) {
+            if (vaddr >= r.vaddr and vaddr < r.vaddr + r.size) {
+                return r.paddr + (vaddr - r.vaddr);
+            }
+        }
+
+        FAIL("Guest address " << vaddr << " is not RAM");
+        return 0;
+    }
+
+    // Map the whole RAM with one batch per region.
+    void boot(Workload& workload) const
+    {
+        for (Region const& r : regions) {
+            Batch batch;
+
+            map_region(batch, r.vaddr, r.paddr, r.size, ATTR_RW);
+            workload.push_back(batch);
+        }
+    }
+
+    // Pick a random 2 MiB aligned 2 MiB region in RAM above the first 2 MiB.
+    uint64_t random_large_page(std::mt19937_64& rng) const
+    {
+        return std::uniform_int_distribution<uint64_t>{1, RAM_END / LARGE_PAGE - 1}(rng) * LARGE_PAGE;
+    }
+};
+
+// Boot a guest by mapping all of its RAM.
+Workload boot_workload(std::mt19937_64& rng)
+{
+    Workload workload;
+
+    Guest_ram{rng}.boot(workload);
+    return workload;
+}
+
+// After boot, the balloon driver of the guest repeatedly gives random pages back and takes them again later.
+// This splits large pages that can only become large pages again via promotion.
+Workload balloon_workload(std::mt19937_64& rng)
+{
+    Guest_ram const ram{rng};
+    Workload workload;
+
+    ram.boot(workload);
+
+    for (unsigned round{0}; round < 64; round++) {
+        uint64_t const base{ram.random_large_page(rng)};
+        std::vector<uint64_t> pages;
+
+        for (uint64_t page{0}; page < LARGE_PAGE / PAGE; page++) {
+            if (rng() % 4 == 0) {
+                pages.push_back(base + page * PAGE);
+            }
+        }
+
+        Batch inflate;
+        Batch deflate;
+
+        for (uint64_t const vaddr : pages) {
+            inflate.push_back({Op::Kind::UPDATE, {vaddr, 0, 0, FOUR_KB}});
+            map_pages(deflate, vaddr, ram.host(vaddr), 1, ATTR_RW);
+        }
+
+        deflate.push_back({Op::Kind::PROMOTE, {base, 0, 0, TWO_MB}});
+
+        workload.push_back(inflate);
+        workload.push_back(deflate);
+    }
+
+    return workload;
+}
+
+// After boot, memory is hot-plugged above 4 GiB and some of it is unplugged again.
+Workload hotplug_workload(std::mt19937_64& rng)
+{
+    Guest_ram const ram{rng};
+    Workload workload;
+    std::uniform_int_distribution<uint64_t> host_chunk{0, (64ULL << 30) / LARGE_PAGE};
+
+    ram.boot(workload);
+
+    struct Dimm {
+        uint64_t vaddr;
+        uint64_t size;
+    };
+
+    std::vector<Dimm> dimms;
+
+    for (uint64_t vaddr{HOTPLUG_BASE}; vaddr < GUEST_SPACE;) {
+        uint64_t const dimm_size{std::min(uint64_t{128ULL << 20} << (rng() % 4), GUEST_SPACE - vaddr)};
+        Batch plug;
+
+        map_region(plug, vaddr, host_chunk(rng) * LARGE_PAGE, dimm_size, ATTR_RW);
+        workload.push_back(plug);
+
+        dimms.push_back({vaddr, dimm_size});
+        vaddr += dimm_size;
+    }
+
+    std::shuffle(dimms.begin(), dimms.end(), rng);
+
+    for (size_t i{0}; i < dimms.size() / 2; i++) {
+        Batch unplug;
+
+        map_region(unplug, dimms[i].vaddr, 0, dimms[i].size, 0);
+        workload.push_back(unplug);
+    }
+
+    return workload;
+}
+
+// After boot, the VMM tracks which pages of 256 MiB of RAM the guest writes to, as during live migration.
+// All pages are write-protected one by one. The guest then writes to random pages, which the VMM makes
+// writable and dirty. Each round, the VMM harvests the dirty bits and write-protects the dirty pages again.
+// In the end, the VMM stops tracking and maps the region writable again.
+Workload dirty_tracking_workload(std::mt19937_64& rng)
+{
+    Guest_ram const ram{rng};
+    Workload workload;
+
+    ram.boot(workload);
+
+    // Stay clear of the legacy BIOS area in the first 2 MiB.
+    uint64_t const base{std::max(ram.random_large_page(rng) & ~((256ULL << 20) - 1), 256ULL << 20)};
+    uint64_t const large_pages{(256ULL << 20) / LARGE_PAGE};
+
+    for (uint64_t i{0}; i < large_pages; i++) {
+        uint64_t const vaddr{base + i * LARGE_PAGE};
+        Batch protect;
+
+        map_pages(protect, vaddr, ram.host(vaddr), LARGE_PAGE / PAGE, ATTR_RO);
+        workload.push_back(protect);
+    }
+
+    std::uniform_int_distribution<uint64_t> random_page{0, large_pages * LARGE_PAGE / PAGE - 1};
+
+    for (unsigned round{0}; round < 8; round++) {
+        std::vector<uint64_t> dirty;
+
+        for (unsigned i{0}; i < 4096; i++) {
+            uint64_t const vaddr{base + random_page(rng) * PAGE};
+            Batch fault;
+
+            map_pages(fault, vaddr, ram.host(vaddr), 1, ATTR_RW | Host_attr::PTE_D);
+            workload.push_back(fault);
+            dirty.push_back(vaddr);
+        }
+
+        std::sort(dirty.begin(), dirty.end());
+        dirty.erase(std::unique(dirty.begin(), dirty.end()), dirty.end());
+
+        Batch harvest{{Op::Kind::HARVEST_DIRTY, {base, 0, 0, TWO_MB + 7}}};
+
+        for (uint64_t const vaddr : dirty) {
+            map_pages(harvest, vaddr, ram.host(vaddr), 1, ATTR_RO);
+        }
+
+        workload.push_back(harvest);
+    }
+
+    for (uint64_t i{0}; i < large_pages; i++) {
+        uint64_t const vaddr{base + i * LARGE_PAGE};
+        Batch unprotect;
+
+        map_region(unprotect, vaddr, ram.host(vaddr), LARGE_PAGE, ATTR_RW);
+        workload.push_back(unprotect);
+    }
+
+    return workload;
+}
+
+// How a workload is applied to the page table.
+struct Mode {
+    char const* name;
+
+    // Use one cursor and one cleanup for a whole batch instead of one per update. With one cleanup per
+    // update, replaced page tables are freed immediately.
+    bool batch;
+
+    // Promote page tables to superpages where the workload asks for it.
+    bool promote;
+};
+
+constexpr Mode MODES[]{
+    {"single updates", false, false},
+    {"batched", true, false},
+    {"batched + promote", true, true},
+};
+
+struct Replay_result {
+    uint64_t updates{0};
+    std::chrono::nanoseconds time{0};
+
+    long peak_pages{0};
+    long final_pages{0};
+    uint64_t allocated{0};
+    uint64_t freed{0};
+
+    // The number of page table levels that a lookup of each mapped page walks.
+    uint64_t lookups{0};
+    uint64_t walk_levels{0};
+};
+
+void apply(Host_hpt& hpt, Host_cleanup& cleanup, Host_hpt::Update_cursor& cursor, Op const& op, Mode mode)
+{
+    Mapping const& m{op.mapping};
+
+    switch (op.kind) {
+    case Op::Kind::UPDATE:
+        hpt.update(cleanup, cursor, m).unwrap("Out of memory");
+        break;
+    case Op::Kind::PROMOTE:
+        if (mode.promote) {
+            hpt.promote(cleanup, m.vaddr);
+            cursor.reset();
+        }
+        break;
+    case Op::Kind::HARVEST_DIRTY:
+        hpt.test_and_clear_leaves(m.vaddr, m.size(), Host_attr::PTE_D, [](uint64_t, ord_t) {});
+        break;
+    }
+}
+
+Replay_result replay(Host_hpt& hpt, Workload const& workload, Mode mode)
+{
+    Replay_result result;
+    uint64_t const allocated{Host_page_alloc::allocated};
+    uint64_t const freed{Host_page_alloc::freed};
+
+    for (Batch const& batch : workload) {
+        auto const start{std::chrono::steady_clock::now()};
+
+        if (mode.batch) {
+            Host_cleanup cleanup;
+            Host_hpt::Update_cursor cursor;
+
+            for (Op const& op : batch) {
+                apply(hpt, cleanup, cursor, op, mode);
+            }
+
+            cleanup.ignore_tlb_flush();
+        } else {
+            for (Op const& op : batch) {
+                Host_cleanup cleanup;
+                Host_hpt::Update_cursor cursor;
+
+                apply(hpt, cleanup, cursor, op, mode);
+                cleanup.ignore_tlb_flush();
+            }
+        }
+
+        result.time += std::chrono::steady_clock::now() - start;
+        result.updates += static_cast<uint64_t>(std::count_if(
+            batch.begin(), batch.end(), [](Op const& op) { return op.kind == Op::Kind::UPDATE; }));
+        result.peak_pages = std::max(result.peak_pages, hpt.pages());
+    }
+
+    result.final_pages = hpt.pages();
+    result.allocated = Host_page_alloc::allocated - allocated;
+    result.freed = Host_page_alloc::freed - freed;
+
+    return result;
+}
+
+// The expected translation of each guest page: the host address and the attributes or zero, if the page is
+// not mapped.
+class Model
+{
+    std::vector<uint64_t> pages_ = std::vector<uint64_t>(GUEST_SPACE / PAGE);
+
+public:
+    explicit Model(Workload const& workload)
+    {
+        for (Batch const& batch : workload) {
+            for (Op const& op : batch) {
+                apply(op);
+            }
+        }
+    }
+
+    void apply(Op const& op)
+    {
+        Mapping const& m{op.mapping};
+
+        for (uint64_t offset{0}; offset < m.size(); offset += PAGE) {
+            uint64_t& page{pages_[(m.vaddr + offset) / PAGE]};
+
+            switch (op.kind) {
+            case Op::Kind::UPDATE:
+                page = m.present() ? (m.paddr + offset) | m.attr : 0;
+                break;
+            case Op::Kind::PROMOTE:
+                break;
+            case Op::Kind::HARVEST_DIRTY:
+                page &= ~static_cast<uint64_t>(Host_attr::PTE_D);
+                break;
+            }
+        }
+    }
+
+    // Check the translation of every guest page and count how many page table levels were walked.
+    void check(Host_hpt& hpt, Replay_result& result) const
+    {
+        uint64_t mismatches{0};
+
+        for (uint64_t i{0}; i < pages_.size(); i++) {
+            uint64_t const vaddr{i * PAGE};
+            Mapping const m{hpt.lookup(vaddr)};
+
+            if (pages_[i] == 0) {
+                mismatches += m.present();
+                continue;
+            }
+
+            uint64_t const expected_paddr{pages_[i] & ~Host_attr::mask};
+            uint64_t const expected_attr{pages_[i] & Host_attr::mask};
+
+            mismatches += not m.present() or m.paddr + (vaddr - m.vaddr) != expected_paddr or
+                          m.attr != expected_attr;
+
+            result.lookups++;
+            result.walk_levels += static_cast<uint64_t>(hpt.max_levels() - (m.order - FOUR_KB) / 9);
+        }
+
+        CHECK(mismatches == 0);
+    }
+};
+
+void print_results(char const* workload, std::vector<std::pair<Mode, Replay_result>> const& results)
+{
+    std::printf("\n%s\n", workload);
+    std::printf("%-20s %9s %10s %10s %10s %10s %10s %10s\n", "Mode", "Updates", "ns/update", "Peak pages",
+                "End pages", "Allocated", "Freed", "Avg. walk");
+
+    for (auto const& [mode, r] : results) {
+        std::printf("%-20s %9llu %10.1f %10ld %10ld %10llu %10llu %10.2f\n", mode.name,
+                    static_cast<unsigned long long>(r.updates),
+                    r.updates ? double(r.time.count()) / double(r.updates) : 0.0, r.peak_pages, r.final_pages,
+                    static_cast<unsigned long long>(r.allocated), static_cast<unsigned long long>(r.freed),
+                    r.lookups ? double(r.walk_levels) / double(r.lookups) : 0.0);
+    }
+}
+
+} // namespace
+
+TEST_CASE("Page table workloads", "[page_table_workload]")
+{
+    std::pair<char const*, std::function<Workload(std::mt19937_64&)>> const workloads[]{
+        {"Boot", boot_workload},
+        {"Balloon", balloon_workload},
+        {"Hotplug", hotplug_workload},
+        {"Dirty tracking", dirty_tracking_workload},
+    };
+
+    for (auto const& [name, generate] : workloads) {
+        std::mt19937_64 rng{Catch::rngSeed()};
+        Workload const workload{generate(rng)};
+        Model const model{workload};
+
+        std::vector<std::pair<Mode, Replay_result>> results;
+
+        for (Mode const& mode : MODES) {
+            INFO(name << " workload replayed with " << mode.name);
+
+            Host_hpt hpt{4, 3};
+            Replay_result result{replay(hpt, workload, mode)};
+
+            model.check(hpt, result);
+            results.emplace_back(mode, result);
+        }
+
+        print_results(name, results);
+    }
+}
@@ -0,0 +1,178 @@
+/*
+ * Spinlock Benchmarks
+ *
+ * This file is part of the Hedron hypervisor.
+ *
+ * Hedron is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Hedron is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License version 2 for more details.
+ */
+
+#include "mcs_lock.hpp"
+#include "spinlock.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <catch2/catch.hpp>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <numeric>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+
+// Each thread plays the role of a CPU with its own nodes.
+struct Thread_local_nodes {
+    static constexpr unsigned MAX_NESTING{1};
+
+    static inline thread_local Mcs_node nodes[MAX_NESTING];
+
+    static Mcs_node* get() { return &nodes[0]; }
+    static void put(Mcs_node*) {}
+};
+
+using Bench_mcs_lock = Generic_mcs_lock<Thread_local_nodes>;
+
+// A lock with the data it protects on its own cache line, so independent locks don't share cache lines.
+template <typename LOCK> struct alignas(64) Padded_lock {
+    LOCK lock;
+    uint64_t counter{0};
+};
+
+// The number of critical sections each thread runs per benchmark iteration.
+constexpr unsigned ROUNDS{1000};
+
+// How long each thread count runs to measure fairness.
+constexpr std::chrono::milliseconds FAIRNESS_DURATION{200};
+
+// The thread counts to benchmark: powers of two up to the number of host CPUs and the number of host CPUs
+// itself.
+//
+// The lock variants we compare hand over in FIFO order. With more threads than CPUs, each handover would
+// wait for the scheduler to run the next thread in line, so that case is not interesting.
+std::vector<unsigned> thread_counts()
+{
+    unsigned const cpus{std::max(1U, std::thread::hardware_concurrency())};
+    std::vector<unsigned> counts;
+
+    for (unsigned threads{1}; threads < cpus; threads *= 2) {
+        counts.push_back(threads);
+    }
+
+    counts.push_back(cpus);
+    return counts;
+}
+
+// Let the given number of threads take a lock ROUNDS times each. Thread i uses lock i modulo the number of
+// locks. The critical section is a single increment, so this mostly measures lock handovers. Starting the
+// threads is part of the measurement, but is small compared to the critical sections.
+template <typename LOCK> uint64_t contend(std::vector<Padded_lock<LOCK>>& locks, unsigned threads)
+{
+    std::vector<std::thread> workers;
+
+    for (unsigned t{0}; t < threads; t++) {
+        workers.emplace_back([&l = locks[t % locks.size()]]() {
+            for (unsigned i{0}; i < ROUNDS; i++) {
+                l.lock.lock();
+                l.counter++;
+                l.lock.unlock();
+            }
+        });
+    }
+
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    return locks[0].counter;
+}
+
+// Let the given number of threads take one lock for FAIRNESS_DURATION and return how often each thread got
+// it.
+template <typename LOCK> std::vector<uint64_t> acquisitions_per_thread(unsigned threads)
+{
+    Padded_lock<LOCK> l;
+    std::atomic<bool> should_exit{false};
+    std::vector<uint64_t> acquisitions(threads);
+    std::vector<std::thread> workers;
+
+    for (unsigned t{0}; t < threads; t++) {
+        workers.emplace_back([&l, &should_exit, &count = acquisitions[t]]() {
+            uint64_t local{0};
+
+            while (not should_exit.load(std::memory_order_relaxed)) {
+                l.lock.lock();
+                l.counter++;
+                l.lock.unlock();
+
+                local++;
+            }
+
+            count = local;
+        });
+    }
+
+    std::this_thread::sleep_for(FAIRNESS_DURATION);
+    should_exit = true;
+
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    return acquisitions;
+}
+
+// Jain's fairness index: 1 if all threads got the lock equally often, 1/n if one thread got it every time.
+double fairness_index(std::vector<uint64_t> const& acquisitions)
+{
+    double const sum{std::accumulate(acquisitions.begin(), acquisitions.end(), 0.0)};
+    double const sum_sq{std::accumulate(acquisitions.begin(), acquisitions.end(), 0.0,
+                                        [](double acc, uint64_t a) { return acc + double(a) * double(a); })};
+
+    return sum_sq > 0 ? sum * sum / (double(acquisitions.size()) * sum_sq) : 1.0;
+}
+
+std::string with_threads(unsigned threads)
+{
+    return " with " + std::to_string(threads) + (threads == 1 ? " thread" : " threads");
+}
+
+} // namespace
+
+// To compare another lock variant, add it to the list of types.
+TEMPLATE_TEST_CASE("Lock scaling", "[spinlock]", Spinlock, Bench_mcs_lock)
+{
+    for (unsigned const threads : thread_counts()) {
+        std::vector<Padded_lock<TestType>> shared(1);
+        BENCHMARK("One shared lock" + with_threads(threads)) { return contend(shared, threads); };
+
+        std::vector<Padded_lock<TestType>> independent(threads);
+        BENCHMARK("Independent locks" + with_threads(threads)) { return contend(independent, threads); };
+    }
+}
+
+TEMPLATE_TEST_CASE("Lock fairness", "[spinlock]", Spinlock, Bench_mcs_lock)
+{
+    std::printf("\n%s\n", Catch::getResultCapture().getCurrentTestName().c_str());
+    std::printf("%-12s %16s %10s %14s\n", "Threads", "Acquisitions/s", "Fairness", "Min/max ratio");
+
+    for (unsigned const threads : thread_counts()) {
+        std::vector<uint64_t> const acquisitions{acquisitions_per_thread<TestType>(threads)};
+        auto const [min, max] = std::minmax_element(acquisitions.begin(), acquisitions.end());
+
+        double const total{std::accumulate(acquisitions.begin(), acquisitions.end(), 0.0)};
+        double const seconds{std::chrono::duration<double>(FAIRNESS_DURATION).count()};
+
+        std::printf("%-12u %16.0f %10.3f %14.3f\n", threads, total / seconds, fairness_index(acquisitions),
+                    *max > 0 ? double(*min) / double(*max) : 1.0);
+    }
+}
@@ -0,0 +1,99 @@
+/*
+ * UTCB Transfer Benchmarks
+ *
+ * This file is part of the Hedron hypervisor.
+ *
+ * Hedron is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Hedron is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License version 2 for more details.
+ */
+
+// Include the class under test first to detect any missing includes early
+#include <utcb.hpp>
+
+#include <x86.hpp>
+
+#include <catch2/catch.hpp>
+
+#include <cstdio>
+#include <string>
+
+namespace
+{
+
+// The part of Cpu_regs that Utcb::load_exc and Utcb::save_exc use.
+struct Bench_regs {
+    mword rax, rcx, rdx, rbx, rsp, rbp, rsi, rdi;
+    mword r8, r9, r10, r11, r12, r13, r14, r15;
+    mword rip, rfl, err, cr2;
+    mword mtd;
+};
+
+struct Profile {
+    char const* name;
+    mword mtd;
+};
+
+constexpr mword ALL_GPR{Mtd::GPR_ACDB | Mtd::GPR_BSD | Mtd::GPR_R8_R15 | Mtd::RSP};
+
+// The MTDs of the exception portals of our VMM: Nothing for exceptions it only counts, the instruction
+// pointer to skip or emulate an instruction, the fault address for page faults and the whole state for
+// debugging and for ECs that it migrates.
+constexpr Profile PROFILES[]{
+    {"none", 0},
+    {"RIP", Mtd::RIP_LEN},
+    {"emulate", Mtd::GPR_ACDB | Mtd::RIP_LEN},
+    {"page fault", Mtd::GPR_ACDB | Mtd::RIP_LEN | Mtd::QUAL},
+    {"all GPRs", ALL_GPR | Mtd::RIP_LEN | Mtd::RFLAGS},
+    {"all", ALL_GPR | Mtd::RIP_LEN | Mtd::RFLAGS | Mtd::QUAL},
+    {"all with FPU", ALL_GPR | Mtd::RIP_LEN | Mtd::RFLAGS | Mtd::QUAL | Mtd::FPU},
+};
+
+// The transfers run on global objects, so the compiler can't drop stores or know the MTD in advance.
+alignas(PAGE_SIZE) Utcb utcb;
+Bench_regs regs;
+bool fpu;
+
+// The number of transfers that the cycle counts are averaged over.
+constexpr unsigned ROUNDS{1000000};
+
+template <typename FN> double cycles_per_transfer(FN fn)
+{
+    uint64 const start{rdtsc()};
+
+    for (unsigned i{0}; i < ROUNDS; i++) {
+        fpu = fn();
+        barrier();
+    }
+
+    return static_cast<double>(rdtsc() - start) / ROUNDS;
+}
+
+} // namespace
+
+TEST_CASE("UTCB exception state transfers", "[utcb]")
+{
+    for (Profile const& p : PROFILES) {
+        regs.mtd = p.mtd;
+
+        BENCHMARK(std::string{"load_exc, "} + p.name) { return utcb.load_exc(&regs); };
+        BENCHMARK(std::string{"save_exc, "} + p.name) { return utcb.save_exc(&regs); };
+    }
+
+    // The TSC ticks at a constant rate, which is close to the core clock on most machines, but not all.
+    std::printf("\n%-14s %12s %12s %16s\n", "MTD", "load cycles", "save cycles", "exception IPC");
+
+    for (Profile const& p : PROFILES) {
+        regs.mtd = p.mtd;
+
+        double const load{cycles_per_transfer([] { return utcb.load_exc(&regs); })};
+        double const save{cycles_per_transfer([] { return utcb.save_exc(&regs); })};
+
+        std::printf("%-14s %12.1f %12.1f %16.1f\n", p.name, load, save, load + save);
+    }
+}
@@ -46,4 +46,9 @@ TEST_CASE("Atomic fetch read-modify-write operations return old value")
         CHECK(Atomic::fetch_add(value_to_modify, 1) == old_value);
         CHECK(value_to_modify == old_value + 1);
     };
+    SECTION("fetch-or")
+    {
+        CHECK(Atomic::fetch_or(value_to_modify, 3) == old_value);
+        CHECK(value_to_modify == (old_value | 3));
+    };
 }
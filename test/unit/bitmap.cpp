@@ -149,6 +149,77 @@ TEST_CASE("Bitmap can be used as simple array of bits", "[bitmap]")
     }
 }
 
+TEST_CASE("Bitmap finds the highest set bit", "[bitmap]")
+{
+    // We make the bitmap larger than a single mword.
+    constexpr size_t SIZE{128};
+    Bitmap<mword, SIZE> bitmap{false};
+
+    SECTION("Empty bitmap has no set bit")
+    {
+        CHECK(bitmap.find_last_set() == -1);
+    }
+
+    SECTION("Highest bit is found across words")
+    {
+        bitmap[3] = true;
+        CHECK(bitmap.find_last_set() == 3);
+
+        bitmap[100] = true;
+        CHECK(bitmap.find_last_set() == 100);
+
+        bitmap[127] = true;
+        CHECK(bitmap.find_last_set() == 127);
+
+        bitmap[127] = false;
+        bitmap[100] = false;
+        CHECK(bitmap.find_last_set() == 3);
+    }
+
+    SECTION("Bits beyond the size are ignored")
+    {
+        Bitmap<unsigned, 33> bitmap_odd{true};
+        CHECK(bitmap_odd.find_last_set() == 32);
+
+        bitmap_odd[32] = false;
+        CHECK(bitmap_odd.find_last_set() == 31);
+    }
+}
+
+TEST_CASE("Visiting set bits works", "[bitmap]")
+{
+    Bitmap<mword, 128> bitmap{false};
+    std::vector<size_t> visited;
+
+    auto const visit{[&visited](size_t i) { visited.push_back(i); }};
+
+    SECTION("Empty bitmap has no set bit")
+    {
+        bitmap.for_each_set(visit);
+        CHECK(visited.empty());
+    }
+
+    SECTION("Set bits are visited in ascending order across words")
+    {
+        bitmap[0] = true;
+        bitmap[63] = true;
+        bitmap[64] = true;
+        bitmap[127] = true;
+
+        bitmap.for_each_set(visit);
+        CHECK(visited == std::vector<size_t>{0, 63, 64, 127});
+    }
+
+    SECTION("Bits beyond the size are ignored")
+    {
+        Bitmap<unsigned, 33> bitmap_odd{true};
+
+        bitmap_odd.for_each_set(visit);
+        CHECK(visited.size() == 33);
+        CHECK(visited.back() == 32);
+    }
+}
+
 TEST_CASE("Bitmap atomic operations work", "[bitmap]")
 {
     // We make the bitmap larger than a single mword.
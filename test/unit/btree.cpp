@@ -0,0 +1,148 @@
+/*
+ * B+ tree tests
+ *
+ * This file is part of the Hedron hypervisor.
+ *
+ * Hedron is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Hedron is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License version 2 for more details.
+ */
+
+#include <btree.hpp>
+
+#include <catch2/catch.hpp>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <random>
+#include <vector>
+
+namespace
+{
+
+struct Value {
+    mword key;
+};
+
+size_t live_nodes{0};
+
+struct Test_alloc {
+    // The kernel allocators don't zero memory, so the tree must initialize each node itself.
+    static void* alloc()
+    {
+        live_nodes++;
+        return std::memset(std::malloc(sizeof(Btree<Value, Test_alloc>::Node)), 0xa5,
+                           sizeof(Btree<Value, Test_alloc>::Node));
+    }
+
+    static void free(void* node)
+    {
+        live_nodes--;
+        std::free(node);
+    }
+};
+
+using Tree = Btree<Value, Test_alloc>;
+
+// Compare the tree against a reference map.
+void check_neighbors(Tree const& tree, std::map<mword, Value*> const& ref, mword key)
+{
+    auto const above{ref.upper_bound(key)};
+
+    CHECK(tree.above(key) == (above == ref.end() ? nullptr : above->second));
+    CHECK(tree.floor(key) == (above == ref.begin() ? nullptr : std::prev(above)->second));
+}
+
+} // namespace
+
+TEST_CASE("Empty tree has no values", "[btree]")
+{
+    Tree tree;
+
+    CHECK(tree.empty());
+    CHECK(tree.floor(0) == nullptr);
+    CHECK(tree.above(0) == nullptr);
+
+    Value v{1};
+    CHECK(not tree.remove(1, &v));
+}
+
+TEST_CASE("Lookups find neighbors", "[btree]")
+{
+    Tree tree;
+    std::vector<Value> values;
+
+    for (mword i{0}; i < 1000; i++) {
+        values.push_back({i * 16 + 16});
+    }
+
+    for (Value& v : values) {
+        tree.insert(v.key, &v);
+    }
+
+    CHECK(tree.floor(15) == nullptr);
+    CHECK(tree.floor(16) == &values[0]);
+    CHECK(tree.floor(31) == &values[0]);
+    CHECK(tree.floor(~0UL) == &values.back());
+
+    CHECK(tree.above(0) == &values[0]);
+    CHECK(tree.above(16) == &values[1]);
+    CHECK(tree.above(values.back().key) == nullptr);
+}
+
+TEST_CASE("Removal only removes matching values", "[btree]")
+{
+    Tree tree;
+    Value a{1}, b{1};
+
+    tree.insert(a.key, &a);
+
+    CHECK(not tree.remove(b.key, &b));
+    CHECK(not tree.remove(2, &a));
+    CHECK(tree.remove(a.key, &a));
+    CHECK(tree.empty());
+}
+
+TEST_CASE("Random insertions and removals match a reference", "[btree]")
+{
+    std::mt19937 rng{42};
+    std::vector<Value> values(4096);
+    std::map<mword, Value*> ref;
+
+    {
+        Tree tree;
+
+        for (unsigned round{0}; round < 20000; round++) {
+            Value& v{values[rng() % values.size()]};
+            mword const key{(rng() % 8192) * 2};
+
+            if (ref.count(v.key) and ref[v.key] == &v) {
+                CHECK(tree.remove(v.key, &v));
+                ref.erase(v.key);
+            } else if (not ref.count(key)) {
+                v.key = key;
+                tree.insert(key, &v);
+                ref[key] = &v;
+            }
+
+            check_neighbors(tree, ref, rng() % 16384);
+        }
+
+        for (mword key{0}; key < 16384; key++) {
+            check_neighbors(tree, ref, key);
+        }
+
+        for (auto const& [key, value] : ref) {
+            CHECK(tree.remove(key, value));
+        }
+
+        CHECK(tree.empty());
+    }
+
+    CHECK(live_nodes == 0);
+}
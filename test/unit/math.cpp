@@ -18,6 +18,7 @@
 #include <catch2/catch.hpp>
 
 #include "math.hpp"
+#include "x86.hpp"
 
 TEST_CASE("Minimum is computed", "[math]")
 {
@@ -63,3 +64,18 @@ TEST_CASE("Alignment functions work", "[math]")
     CHECK(align_up(0x4000, 0x1000) == 0x4000);
     CHECK(align_up(0x4005, 0x1000) == 0x5000);
 }
+
+TEST_CASE("128-bit division works", "[math]")
+{
+    uint64 rem;
+
+    CHECK(div128(0, 7, 2, rem) == 3);
+    CHECK(rem == 1);
+
+    // A TSC deadline of 3 << 48 guest ticks with a multiplier of 2.0 is reached after 3 << 47 host ticks.
+    CHECK(div128(3ULL << 32, 0, 2ULL << 48, rem) == 3ULL << 47);
+    CHECK(rem == 0);
+
+    CHECK(div128(1, 0, 3, rem) == 0x5555555555555555ULL);
+    CHECK(rem == 1);
+}
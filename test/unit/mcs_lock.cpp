@@ -0,0 +1,133 @@
+/*
+ * Queued Spinlock Tests
+ *
+ * This file is part of the Hedron hypervisor.
+ *
+ * Hedron is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Hedron is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License version 2 for more details.
+ */
+
+#include "mcs_lock.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <catch2/catch.hpp>
+#include <chrono>
+#include <cstdint>
+#include <future>
+#include <thread>
+#include <vector>
+
+namespace
+{
+
+// Each thread plays the role of a CPU with its own nodes. These run on many threads at once, so they use
+// assert instead of the Catch macros.
+struct Thread_local_nodes {
+    static constexpr unsigned MAX_NESTING{2};
+
+    static inline thread_local Mcs_node nodes[MAX_NESTING];
+    static inline thread_local unsigned depth{0};
+
+    static Mcs_node* get()
+    {
+        assert(depth < MAX_NESTING);
+        return &nodes[depth++];
+    }
+
+    static void put(Mcs_node* node)
+    {
+        assert(node == &nodes[depth - 1]);
+        depth--;
+    }
+};
+
+using Test_mcs_lock = Generic_mcs_lock<Thread_local_nodes>;
+
+} // namespace
+
+TEST_CASE("Simple queued spinlock functionality", "[mcs_lock]")
+{
+    Test_mcs_lock l;
+
+    CHECK(not l.is_locked());
+
+    l.lock();
+    CHECK(l.is_locked());
+    l.unlock();
+
+    CHECK(not l.is_locked());
+}
+
+TEST_CASE("Queued spinlock try_lock only succeeds when unlocked", "[mcs_lock]")
+{
+    Test_mcs_lock l;
+
+    CHECK(l.try_lock());
+    CHECK(l.is_locked());
+    CHECK_FALSE(l.try_lock());
+
+    l.unlock();
+
+    CHECK(l.try_lock());
+    l.unlock();
+}
+
+TEST_CASE("Queued spinlock smoke test", "[mcs_lock]")
+{
+    // We want contention even on machines with few CPUs.
+    static unsigned const thread_count{std::max(4U, std::thread::hardware_concurrency())};
+
+    // Two locks that are always taken in the same order, so waiters queue up while holding the outer lock.
+    Test_mcs_lock outer, inner;
+
+    uint64_t unsafe_outer{0}, unsafe_inner{0};
+    std::atomic<uint64_t> safe_outer{0}, safe_inner{0};
+
+    {
+        std::atomic<bool> should_exit{false};
+
+        // See the spinlock smoke test for why this must be declared last.
+        std::vector<std::future<void>> futures;
+
+        std::generate_n(std::back_inserter(futures), thread_count, [&]() {
+            return std::async(std::launch::async, [&]() {
+                for (uint64_t i{0}; not should_exit.load(std::memory_order_relaxed); i++) {
+                    outer.lock();
+                    unsafe_outer++;
+
+                    // Only take the inner lock some of the time, so it sees both uncontended and contended
+                    // locking.
+                    if (i % 2 == 0) {
+                        inner.lock();
+                        unsafe_inner++;
+                        inner.unlock();
+
+                        safe_inner++;
+                    }
+
+                    outer.unlock();
+
+                    inner.lock();
+                    unsafe_inner++;
+                    inner.unlock();
+
+                    safe_outer++;
+                    safe_inner++;
+                }
+            });
+        });
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        should_exit = true;
+    }
+
+    CHECK(unsafe_outer == safe_outer.load());
+    CHECK(unsafe_inner == safe_inner.load());
+}
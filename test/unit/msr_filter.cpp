@@ -0,0 +1,82 @@
+/*
+ * User Space MSR Access Filter Tests
+ *
+ * This file is part of the Hedron hypervisor.
+ *
+ * Hedron is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Hedron is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License version 2 for more details.
+ */
+
+// Include the class under test first to detect any missing includes early.
+#include <msr_filter.hpp>
+
+#include <catch2/catch.hpp>
+
+// The filter is built at compile time.
+static_assert(not Msr_filter::may_read(Msr::IA32_EFER));
+static_assert(Msr_filter::may_read(Msr::IA32_TSC));
+
+TEST_CASE("MSR sets contain the added MSRs", "[msr_filter]")
+{
+    Msr_set s;
+
+    s.add(0x10).add(0x3f, 0x41).add(0xc0000000).add(0xc0001fff);
+
+    CHECK(s.contains(0x10));
+    CHECK(s.contains(0x3f));
+    CHECK(s.contains(0x40));
+    CHECK(s.contains(0x41));
+    CHECK(s.contains(0xc0000000));
+    CHECK(s.contains(0xc0001fff));
+
+    CHECK_FALSE(s.contains(0x0));
+    CHECK_FALSE(s.contains(0x11));
+    CHECK_FALSE(s.contains(0x3e));
+    CHECK_FALSE(s.contains(0x42));
+    CHECK_FALSE(s.contains(0xc0000001));
+
+    // The low and high ranges don't alias.
+    CHECK_FALSE(s.contains(0x1fff));
+    CHECK_FALSE(s.contains(0xc0000010));
+
+    // MSRs outside of both ranges are never contained.
+    CHECK_FALSE(s.contains(0x2000));
+    CHECK_FALSE(s.contains(0xc0002000));
+    CHECK_FALSE(s.contains(0xffffffff));
+}
+
+TEST_CASE("MSRs that Hedron owns are not accessible", "[msr_filter]")
+{
+    for (auto msr : {Msr::IA32_DS_AREA, Msr::IA32_EFER, Msr::IA32_GS_BASE, Msr::IA32_KERNEL_GS_BASE,
+                     Msr::IA32_SYSENTER_CS, Msr::IA32_SYSENTER_EIP, Msr::IA32_SYSENTER_ESP, Msr::IA32_TSC_AUX,
+                     Msr::IA32_EXT_XAPIC, Msr::IA32_EXT_XAPIC_END, Msr::IA32_VMX_BASIC,
+                     Msr::IA32_VMX_VMFUNC}) {
+        CHECK_FALSE(Msr_filter::may_read(msr));
+        CHECK_FALSE(Msr_filter::may_write(msr));
+    }
+}
+
+TEST_CASE("MSRs that affect paging are read-only", "[msr_filter]")
+{
+    for (auto msr : {Msr::IA32_FEATURE_CONTROL, Msr::IA32_MTRR_PHYS_BASE, Msr::IA32_MTRR_FIX4K_F8000,
+                     Msr::IA32_CR_PAT, Msr::IA32_MTRR_DEF_TYPE}) {
+        CHECK(Msr_filter::may_read(msr));
+        CHECK_FALSE(Msr_filter::may_write(msr));
+    }
+}
+
+TEST_CASE("Other MSRs are accessible", "[msr_filter]")
+{
+    for (auto msr : {Msr::IA32_TSC, Msr::IA32_SGXLEPUBKEYHASH0, Msr::IA32_SGXLEPUBKEYHASH3,
+                     Msr::Register(Msr::IA32_EXT_XAPIC - 1), Msr::Register(Msr::IA32_EXT_XAPIC_END + 1),
+                     Msr::Register(0x40000000)}) {
+        CHECK(Msr_filter::may_read(msr));
+        CHECK(Msr_filter::may_write(msr));
+    }
+}
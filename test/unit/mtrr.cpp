@@ -247,3 +247,67 @@ TEST_CASE("NUC Variable-range MTRRs are parsed correctly in the SDM example", "[
         CHECK(next == 0xA0000000U + megabyte(8));
     }
 }
+
+TEST_CASE("Ranges with the same memory type are merged", "[mtrr]")
+{
+    using Mtrr_state = Generic_mtrr_state<Fake_sdm_msr>;
+
+    Mtrr_state state;
+    state.init();
+
+    unsigned type;
+    uint64 next;
+
+    SECTION("Fixed-range RAM is merged up to the legacy video memory")
+    {
+        type = state.memtype_range(0, ~0ULL, next);
+
+        CHECK(type == 0x06);
+        CHECK(next == 0xA0000U);
+    }
+
+    SECTION("Adjacent variable-range MTRRs with the same type are merged")
+    {
+        type = state.memtype_range(megabyte(68), ~0ULL, next);
+
+        CHECK(type == 0x06);
+        CHECK(next == megabyte(100));
+    }
+
+    SECTION("Merging stops at the limit")
+    {
+        type = state.memtype_range(megabyte(68), megabyte(80), next);
+
+        CHECK(type == 0x06);
+        CHECK(next == megabyte(96));
+    }
+}
+
+TEST_CASE("The memory map covers the whole address space without gaps", "[mtrr]")
+{
+    using Mtrr_state = Generic_mtrr_state<Fake_sdm_msr>;
+
+    Mtrr_state state;
+    state.init();
+
+    uint64 phys{0}, next;
+    unsigned previous{~0U};
+    size_t count{0};
+
+    for (; phys != ~0ULL; phys = next, count++) {
+        unsigned const type{state.memtype_range(phys, ~0ULL, next)};
+
+        REQUIRE(next > phys);
+
+        // Adjacent ranges with the same type are merged, so their types differ.
+        CHECK(type != previous);
+        previous = type;
+
+        uint64 following;
+        CHECK(state.memtype(phys, following) == type);
+        CHECK(following <= next);
+    }
+
+    // WB, UC (legacy video), WP (option ROMs), WB, UC (BIOS area), WB, UC (I/O card), WB, UC, WC (video), UC
+    CHECK(count == 11);
+}
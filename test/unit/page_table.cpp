@@ -26,6 +26,7 @@
 #include <cstdio>
 #include <forward_list>
 #include <initializer_list>
+#include <vector>
 
 #include <catch2/catch.hpp>
 
@@ -240,6 +241,7 @@ public:
 
     void ignore_tlb_flush() { tlb_flush_ = false; }
     void flush_tlb_later() { tlb_flush_ = true; }
+    void flush_tlb_later(uint64_t, uint64_t) { tlb_flush_ = true; }
 
     void merge(Fake_deferred_cleanup& other)
     {
@@ -267,12 +269,16 @@ public:
         PTE_P = 1ULL << 0,
         PTE_W = 1ULL << 1,
         PTE_U = 1ULL << 2,
+        PTE_A = 1ULL << 5,
+        PTE_D = 1ULL << 6,
         PTE_S = 1ULL << 7,
+        PTE_PAT2 = 1ULL << 7,
+        PTE_PAT2_S = 1ULL << 12,
 
         PTE_NX = 1ULL << 63,
     };
 
-    static constexpr uint64_t mask{PTE_NX | PTE_P | PTE_W | PTE_U};
+    static constexpr uint64_t mask{PTE_NX | PTE_P | PTE_W | PTE_U | PTE_A | PTE_D};
     static constexpr uint64_t all_rights{PTE_P | PTE_W | PTE_U};
 };
 
@@ -489,6 +495,81 @@ TEST_CASE("Update creates new mappings in empty page table", "[page_table]")
     }
 }
 
+TEST_CASE("Five-level page tables map addresses beyond 48 bits", "[page_table]")
+{
+    Fake_hpt hpt{5, 3};
+
+    Fake_hpt::virt_t const vaddr{(1UL << 51) | (1UL << twomb_order)};
+
+    CHECK(hpt.max_order() == 57);
+
+    auto const cleanup{hpt.update({vaddr, 0xDEADB000, Fake_attr::PTE_P | Fake_attr::PTE_W, PAGE_BITS})};
+    CHECK_FALSE(cleanup.need_tlb_flush());
+
+    // The root and one page table at each of the four lower levels.
+    CHECK(hpt.pages() == 5);
+
+    auto const mapping{hpt.lookup(vaddr)};
+
+    CHECK(mapping.paddr == 0xDEADB000);
+    CHECK(mapping.order == PAGE_BITS);
+
+    // The same address in the lower 48 bits is not mapped.
+    CHECK_FALSE(hpt.lookup(vaddr & ((1UL << 48) - 1)).present());
+}
+
+TEST_CASE("Batched updates create the same mappings as single updates", "[page_table]")
+{
+    Fake_hpt hpt{4, 3};
+    Fake_hpt::pte_t const attr{Fake_attr::PTE_P | Fake_attr::PTE_W};
+
+    // 4K pages that cross a page table boundary, followed by a 2MB page, another 4K page and an unmap.
+    std::vector<Fake_hpt::Mapping> const mappings{
+        {0x1ff000, 0x10000000, attr, PAGE_BITS},
+        {0x200000, 0x10001000, attr, PAGE_BITS},
+        {0x201000, 0x10002000, attr, PAGE_BITS},
+        {0x400000, 0x20000000, attr, twomb_order},
+        {0x202000, 0x10003000, attr, PAGE_BITS},
+        {0x200000, 0, 0, PAGE_BITS},
+    };
+
+    Fake_deferred_cleanup cleanup;
+    hpt.update(cleanup, mappings.cbegin(), mappings.cend()).unwrap();
+
+    CHECK(hpt.lookup(0x1ff000) == mappings[0]);
+    CHECK(hpt.lookup(0x201000) == mappings[2]);
+    CHECK(hpt.lookup(0x400000) == mappings[3]);
+    CHECK(hpt.lookup(0x202000) == mappings[4]);
+    CHECK_FALSE(hpt.lookup(0x200000).present());
+
+    // The root, one page table at each of the two upper levels and two page tables at the lowest level.
+    CHECK(hpt.page_alloc().allocated_pages() == 5);
+}
+
+TEST_CASE("Update cursors can be reset after promotion", "[page_table]")
+{
+    Fake_hpt hpt{4, 3};
+    Fake_hpt::pte_t const attr{Fake_attr::PTE_P | Fake_attr::PTE_W};
+    size_t const entries{static_cast<size_t>(1) << BITS_PER_LEVEL_64BIT};
+
+    Fake_deferred_cleanup cleanup;
+    Fake_hpt::Update_cursor cursor;
+
+    for (size_t i{0}; i < entries; i++) {
+        hpt.update(cleanup, cursor, {i * PAGE_SIZE, 0x40000000 + i * PAGE_SIZE, attr, PAGE_BITS}).unwrap();
+    }
+
+    REQUIRE(hpt.promote(cleanup, 0));
+    cursor.reset();
+
+    // This has to split the new superpage again instead of writing into the page table it replaced.
+    hpt.update(cleanup, cursor, {0, 0x80000000, attr, PAGE_BITS}).unwrap();
+
+    CHECK(hpt.lookup(0).paddr == 0x80000000);
+    CHECK(hpt.lookup(PAGE_SIZE).paddr == 0x40000000 + PAGE_SIZE);
+    CHECK(hpt.lookup(PAGE_SIZE).order == PAGE_BITS);
+}
+
 TEST_CASE("Update deals with out-of-memory errors", "[page_table]")
 {
     // A page table that will only be able to allocate this many pages as page table backing store.
@@ -700,6 +781,247 @@ TEST_CASE("Update that creates superpages reclaims page table structures")
     }
 }
 
+TEST_CASE("Page tables count their pages", "[page_table]")
+{
+    Fake_hpt hpt{4, 3};
+
+    // The root is allocated with the page table.
+    CHECK(hpt.pages() == 1);
+
+    auto cleanup{hpt.update({0, 0, Fake_attr::PTE_P | Fake_attr::PTE_W, PAGE_BITS})};
+    CHECK(hpt.pages() == 4);
+    CHECK(hpt.pages() == static_cast<long>(hpt.page_alloc().allocated_pages()));
+
+    SECTION("Superpages release the page tables they replace")
+    {
+        auto superpage_cleanup{hpt.update({0, 0, Fake_attr::PTE_P | Fake_attr::PTE_W, onegb_order})};
+
+        CHECK(hpt.pages() == 2);
+        CHECK(hpt.pages() + static_cast<long>(superpage_cleanup.get_freed_pages().size()) == 4);
+    }
+
+    SECTION("Promotion releases the page tables it replaces")
+    {
+        for (uint64_t addr{PAGE_SIZE}; addr < (1UL << twomb_order); addr += PAGE_SIZE) {
+            auto page_cleanup{hpt.update({addr, addr, Fake_attr::PTE_P | Fake_attr::PTE_W, PAGE_BITS})};
+            cleanup.merge(page_cleanup);
+        }
+
+        CHECK(hpt.pages() == 4);
+        CHECK(hpt.promote(cleanup, 0));
+        CHECK(hpt.pages() == 3);
+    }
+}
+
+TEST_CASE("Page tables can be destroyed step by step", "[page_table]")
+{
+    Fake_hpt hpt{4, 3};
+
+    auto cleanup{hpt.update({0, 0, Fake_attr::PTE_P | Fake_attr::PTE_W, PAGE_BITS})};
+    auto cleanup_1gb{hpt.update({1UL << onegb_order, 0, Fake_attr::PTE_P | Fake_attr::PTE_W, PAGE_BITS})};
+
+    // The root, one PDPT and a page directory and page table for each mapping.
+    CHECK(hpt.pages() == 6);
+
+    // Each step frees one page table. Page directories go once their page table is gone.
+    for (long pages{6}; pages > 1; pages--) {
+        CHECK(hpt.destroy_step());
+        CHECK(hpt.pages() == pages - 1);
+    }
+
+    CHECK(not hpt.destroy_step());
+    CHECK(hpt.pages() == 1);
+
+    CHECK(hpt.lookup(0).attr == 0);
+    CHECK(hpt.lookup(1UL << onegb_order).attr == 0);
+}
+
+TEST_CASE("Promotion replaces uniform page tables by superpages", "[page_table]")
+{
+    Fake_hpt hpt{4, 3};
+    Fake_hpt::pte_t const attr{Fake_attr::PTE_P | Fake_attr::PTE_W};
+    size_t const entries{static_cast<size_t>(1) << BITS_PER_LEVEL_64BIT};
+
+    auto const map_4k{[&hpt, attr](Fake_hpt::virt_t vaddr, Fake_hpt::phys_t paddr) {
+        hpt.update({vaddr, paddr, attr, PAGE_BITS}).ignore_tlb_flush();
+    }};
+
+    SECTION("Fully populated page tables are promoted")
+    {
+        for (size_t i{0}; i < entries; i++) {
+            map_4k(i * PAGE_SIZE, 0x40000000 + i * PAGE_SIZE);
+        }
+
+        Fake_deferred_cleanup cleanup;
+        hpt.promote(cleanup, 0);
+
+        CHECK(cleanup.need_tlb_flush());
+        CHECK(cleanup.get_freed_pages().size() == 1);
+
+        auto const mapping{hpt.lookup(PAGE_SIZE)};
+
+        CHECK(mapping.vaddr == 0);
+        CHECK(mapping.paddr == 0x40000000);
+        CHECK(mapping.attr == attr);
+        CHECK(mapping.order == twomb_order);
+    }
+
+    SECTION("Accessed and dirty bits survive promotion")
+    {
+        for (size_t i{0}; i < entries; i++) {
+            Fake_hpt::pte_t const ad{i == 3   ? static_cast<Fake_hpt::pte_t>(Fake_attr::PTE_A)
+                                     : i == 9 ? static_cast<Fake_hpt::pte_t>(Fake_attr::PTE_D)
+                                              : 0};
+
+            hpt.update({i * PAGE_SIZE, 0x40000000 + i * PAGE_SIZE, attr | ad, PAGE_BITS}).ignore_tlb_flush();
+        }
+
+        Fake_deferred_cleanup cleanup;
+        hpt.promote(cleanup, 0);
+
+        auto const mapping{hpt.lookup(0)};
+
+        CHECK(mapping.order == twomb_order);
+        CHECK(mapping.attr == (attr | Fake_attr::PTE_A | Fake_attr::PTE_D));
+    }
+
+    SECTION("Promotion continues with the next level")
+    {
+        for (size_t i{0}; i < entries; i++) {
+            hpt.update({i << twomb_order, 0x40000000 + (i << twomb_order), attr, twomb_order})
+                .ignore_tlb_flush();
+        }
+
+        // Replace the first 2MB page by 4K pages that map the same memory.
+        for (size_t i{0}; i < entries; i++) {
+            map_4k(i * PAGE_SIZE, 0x40000000 + i * PAGE_SIZE);
+        }
+
+        Fake_deferred_cleanup cleanup;
+        hpt.promote(cleanup, 0);
+
+        CHECK(cleanup.get_freed_pages().size() == 2);
+        CHECK(hpt.lookup(0).order == onegb_order);
+        CHECK(hpt.lookup(0).paddr == 0x40000000);
+    }
+
+    SECTION("Page tables with holes are not promoted")
+    {
+        for (size_t i{1}; i < entries; i++) {
+            map_4k(i * PAGE_SIZE, 0x40000000 + i * PAGE_SIZE);
+        }
+
+        Fake_deferred_cleanup cleanup;
+        hpt.promote(cleanup, PAGE_SIZE);
+
+        CHECK_FALSE(cleanup.need_tlb_flush());
+        CHECK(hpt.lookup(PAGE_SIZE).order == PAGE_BITS);
+    }
+
+    SECTION("Page tables with discontiguous memory are not promoted")
+    {
+        for (size_t i{0}; i < entries; i++) {
+            map_4k(i * PAGE_SIZE, 0x40000000 + (i ^ 1) * PAGE_SIZE);
+        }
+
+        Fake_deferred_cleanup cleanup;
+        hpt.promote(cleanup, 0);
+
+        CHECK_FALSE(cleanup.need_tlb_flush());
+        CHECK(hpt.lookup(0).order == PAGE_BITS);
+    }
+
+    SECTION("Page tables with misaligned memory are not promoted")
+    {
+        for (size_t i{0}; i < entries; i++) {
+            map_4k(i * PAGE_SIZE, 0x40001000 + i * PAGE_SIZE);
+        }
+
+        Fake_deferred_cleanup cleanup;
+        hpt.promote(cleanup, 0);
+
+        CHECK_FALSE(cleanup.need_tlb_flush());
+        CHECK(hpt.lookup(0).order == PAGE_BITS);
+    }
+
+    SECTION("Page tables with different attributes are not promoted")
+    {
+        for (size_t i{0}; i < entries; i++) {
+            Fake_hpt::pte_t const entry_attr{i == 7 ? static_cast<Fake_hpt::pte_t>(Fake_attr::PTE_P) : attr};
+
+            hpt.update({i * PAGE_SIZE, 0x40000000 + i * PAGE_SIZE, entry_attr, PAGE_BITS}).ignore_tlb_flush();
+        }
+
+        Fake_deferred_cleanup cleanup;
+        hpt.promote(cleanup, 0);
+
+        CHECK_FALSE(cleanup.need_tlb_flush());
+        CHECK(hpt.lookup(0).order == PAGE_BITS);
+    }
+}
+
+
+TEST_CASE("Promotion moves the PAT bit between 4K entries and superpages", "[page_table]")
+{
+    // Delegation never sets PAT bits, so the 4K entries with the highest PAT bit are written directly.
+    Fake_memory mem{{{0x1000, 0x00002000 | Fake_attr::PTE_P},
+                     {0x2000, 0x00003000 | Fake_attr::PTE_P},
+                     {0x3000, 0x00004000 | Fake_attr::PTE_P}}};
+
+    Fake_hpt::pte_t const attr{Fake_attr::PTE_P | Fake_attr::PTE_W};
+
+    for (size_t i{0}; i < static_cast<size_t>(1) << BITS_PER_LEVEL_64BIT; i++) {
+        mem.write(0x4000 + i * sizeof(entry), (0x40000000 + i * PAGE_SIZE) | attr | Fake_attr::PTE_PAT2);
+    }
+
+    Fake_hpt hpt{4, 2, 0x1000, mem};
+    Fake_deferred_cleanup cleanup;
+
+    REQUIRE(hpt.promote(cleanup, 0));
+    CHECK(hpt.memory().read(0x3000) == (0x40000000 | attr | Fake_attr::PTE_S | Fake_attr::PTE_PAT2_S));
+
+    // Splitting the superpage moves the bit back.
+    hpt.update({PAGE_SIZE, 0x50000000, attr, PAGE_BITS}).ignore_tlb_flush();
+
+    entry const table{hpt.memory().read(0x3000) & ~Fake_attr::mask};
+
+    CHECK(hpt.memory().read(table) == (0x40000000 | attr | Fake_attr::PTE_PAT2));
+    CHECK(hpt.memory().read(table + 2 * sizeof(entry)) == (0x40002000 | attr | Fake_attr::PTE_PAT2));
+}
+TEST_CASE("Page tables can be shared", "[page_table]")
+{
+    Fake_hpt src{4, 3};
+    Fake_hpt dst{4, 3};
+    Fake_hpt::virt_t const vaddr{0x40000000};
+    Fake_hpt::level_t const level{2};
+
+    src.update({vaddr, 0x80000000, Fake_attr::PTE_P, PAGE_BITS}).ignore_tlb_flush();
+
+    Fake_deferred_cleanup cleanup;
+    dst.share(cleanup, src, vaddr, level).unwrap();
+
+    CHECK_FALSE(cleanup.need_tlb_flush());
+
+    // Page tables below the shared entry are not allocated again.
+    CHECK(dst.page_alloc().allocated_pages() == 2);
+
+    SECTION("The shared page table is linked")
+    {
+        auto const src_table{src.walk_down_and_split(cleanup, vaddr, level - 1, false).unwrap()};
+        auto const dst_table{dst.walk_down_and_split(cleanup, vaddr, level - 1, false).unwrap()};
+
+        CHECK(dst_table != nullptr);
+        CHECK(dst_table == src_table);
+    }
+
+    SECTION("The shared page table can be unlinked")
+    {
+        dst.unshare(vaddr, level);
+
+        CHECK(dst.walk_down_and_split(cleanup, vaddr, level - 1, false).unwrap() == nullptr);
+    }
+}
+
 TEST_CASE("Mapping memory works if it has to create multiple new page tables")
 {
     Fake_memory const mem{{{0x1000, 0x00002000 | Fake_attr::all_rights},
@@ -768,6 +1090,150 @@ TEST_CASE("Replacing read-only pages works", "[page_table]")
     }
 }
 
+TEST_CASE("Test-and-clear of leaf bits works", "[page_table]")
+{
+    Fake_hpt hpt{4, 3};
+
+    auto const rw{Fake_attr::PTE_P | Fake_attr::PTE_W};
+
+    CHECK_FALSE(hpt.update({0x1000, 0x10000, rw | Fake_attr::PTE_D, PAGE_BITS}).need_tlb_flush());
+    CHECK_FALSE(hpt.update({0x2000, 0x20000, rw, PAGE_BITS}).need_tlb_flush());
+    CHECK_FALSE(hpt.update({1UL << twomb_order, 0, rw | Fake_attr::PTE_D, twomb_order}).need_tlb_flush());
+
+    std::vector<std::pair<uint64_t, Fake_hpt::ord_t>> found;
+    auto const collect = [&found](uint64_t vaddr, Fake_hpt::ord_t order) {
+        found.emplace_back(vaddr, order);
+    };
+
+    SECTION("Only entries in the range are cleared")
+    {
+        hpt.test_and_clear_leaves(0x2000, 4UL << 20, Fake_attr::PTE_D, collect);
+
+        CHECK(found == decltype(found){{1UL << twomb_order, twomb_order}});
+        CHECK(hpt.lookup(0x1000).attr == (rw | Fake_attr::PTE_D));
+    }
+
+    SECTION("Partially covered superpages are reported, but not cleared")
+    {
+        hpt.test_and_clear_leaves((1UL << twomb_order) + 0x1000, 0x2000, Fake_attr::PTE_D, collect);
+
+        CHECK(found == decltype(found){{1UL << twomb_order, twomb_order}});
+        CHECK(hpt.lookup(1UL << twomb_order).attr == (rw | Fake_attr::PTE_D));
+    }
+
+    SECTION("Entries are only reported without clearing")
+    {
+        hpt.test_and_clear_leaves(0, 4UL << 20, Fake_attr::PTE_D, collect, false);
+
+        CHECK(found == decltype(found){{0x1000, PAGE_BITS}, {1UL << twomb_order, twomb_order}});
+        CHECK(hpt.lookup(0x1000).attr == (rw | Fake_attr::PTE_D));
+    }
+
+    SECTION("Entries are reported once")
+    {
+        hpt.test_and_clear_leaves(0, 4UL << 20, Fake_attr::PTE_D, collect);
+
+        CHECK(found == decltype(found){{0x1000, PAGE_BITS}, {1UL << twomb_order, twomb_order}});
+        CHECK(hpt.lookup(0x1000).attr == rw);
+        CHECK(hpt.lookup(0x1000).paddr == 0x10000);
+        CHECK(hpt.lookup(1UL << twomb_order).attr == rw);
+
+        found.clear();
+        hpt.test_and_clear_leaves(0, 4UL << 20, Fake_attr::PTE_D, collect);
+
+        CHECK(found.empty());
+    }
+}
+
+TEST_CASE("Visiting mappings works", "[page_table]")
+{
+    Fake_hpt hpt{4, 3};
+    Fake_hpt::pte_t const attr{Fake_attr::PTE_P | Fake_attr::PTE_W};
+
+    std::vector<Fake_hpt::Mapping> const mappings{
+        {0x1000, 0x10000000, attr, PAGE_BITS},
+        {0x3000, 0x10001000, attr, PAGE_BITS},
+        {0x200000, 0x20000000, attr, twomb_order},
+        {0x40000000, 0x40000000, attr, onegb_order},
+    };
+
+    Fake_deferred_cleanup cleanup;
+    hpt.update(cleanup, mappings.cbegin(), mappings.cend()).unwrap();
+
+    std::vector<Fake_hpt::Mapping> visited;
+    auto const collect{[&visited](Fake_hpt::Mapping const& mapping) {
+        visited.push_back(mapping);
+        return true;
+    }};
+
+    SECTION("All mappings in the range are visited in order")
+    {
+        CHECK(hpt.for_each_mapping(0, 0x80000000, collect));
+        CHECK(visited == mappings);
+    }
+
+    SECTION("Partially covered mappings are visited as a whole")
+    {
+        CHECK(hpt.for_each_mapping(0x201000, 0x40001000 - 0x201000, collect));
+
+        REQUIRE(visited.size() == 2);
+        CHECK(visited[0] == mappings[2]);
+        CHECK(visited[1] == mappings[3]);
+    }
+
+    SECTION("The walk stops when asked to")
+    {
+        CHECK_FALSE(hpt.for_each_mapping(0, 0x80000000, [&visited](Fake_hpt::Mapping const& mapping) {
+            visited.push_back(mapping);
+            return false;
+        }));
+
+        REQUIRE(visited.size() == 1);
+        CHECK(visited[0] == mappings[0]);
+    }
+
+    SECTION("Empty ranges visit nothing")
+    {
+        CHECK(hpt.for_each_mapping(0x4000, 0x1000, collect));
+        CHECK(visited.empty());
+    }
+}
+
+TEST_CASE("Counting superpages works", "[page_table]")
+{
+    Fake_hpt hpt{4, 3};
+    Fake_hpt::pte_t const attr{Fake_attr::PTE_P | Fake_attr::PTE_W};
+
+    size_t counts[2]{};
+
+    SECTION("Empty page tables have no superpages")
+    {
+        hpt.count_superpages(counts);
+
+        CHECK(counts[0] == 0);
+        CHECK(counts[1] == 0);
+    }
+
+    SECTION("Superpages are counted per level")
+    {
+        std::vector<Fake_hpt::Mapping> const mappings{
+            {0x1000, 0x10000000, attr, PAGE_BITS},
+            {0x200000, 0x20000000, attr, twomb_order},
+            {0x400000, 0x20200000, attr, twomb_order},
+            {0x40000000, 0x40000000, attr, onegb_order},
+            {0x8000000000, 0x80000000, attr, onegb_order},
+        };
+
+        Fake_deferred_cleanup cleanup;
+        hpt.update(cleanup, mappings.cbegin(), mappings.cend()).unwrap();
+
+        hpt.count_superpages(counts);
+
+        CHECK(counts[0] == 2);
+        CHECK(counts[1] == 2);
+    }
+}
+
 TEST_CASE("Clamping mappings works", "[page_table]")
 {
     using Mapping = Fake_hpt::Mapping;
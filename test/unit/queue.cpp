@@ -0,0 +1,88 @@
+/*
+ * Queue Tests
+ *
+ * This file is part of the Hedron hypervisor.
+ *
+ * Hedron is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Hedron is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License version 2 for more details.
+ */
+
+#include "queue.hpp"
+
+#include <catch2/catch.hpp>
+
+#include <vector>
+
+namespace
+{
+
+struct Element {
+    Element* prev{nullptr};
+    Element* next{nullptr};
+
+    int prio;
+    int id;
+};
+
+bool higher_prio(Element const* a, Element const* b) { return a->prio > b->prio; }
+
+std::vector<int> drain(Queue<Element>& queue)
+{
+    std::vector<int> ids;
+
+    for (Element* e; queue.dequeue(e = queue.head());) {
+        ids.push_back(e->id);
+    }
+
+    return ids;
+}
+
+} // namespace
+
+TEST_CASE("Sorted enqueue orders by priority", "[queue]")
+{
+    Queue<Element> queue;
+    Element elements[]{{nullptr, nullptr, 1, 0}, {nullptr, nullptr, 3, 1}, {nullptr, nullptr, 2, 2},
+                       {nullptr, nullptr, 5, 3}, {nullptr, nullptr, 0, 4}};
+
+    for (Element& e : elements) {
+        queue.enqueue_sorted(&e, higher_prio);
+    }
+
+    CHECK(drain(queue) == std::vector<int>{3, 1, 2, 0, 4});
+}
+
+TEST_CASE("Sorted enqueue keeps FIFO order within a priority", "[queue]")
+{
+    Queue<Element> queue;
+    Element elements[]{{nullptr, nullptr, 1, 0}, {nullptr, nullptr, 2, 1}, {nullptr, nullptr, 1, 2},
+                       {nullptr, nullptr, 2, 3}, {nullptr, nullptr, 1, 4}};
+
+    for (Element& e : elements) {
+        queue.enqueue_sorted(&e, higher_prio);
+    }
+
+    CHECK(drain(queue) == std::vector<int>{1, 3, 0, 2, 4});
+}
+
+TEST_CASE("Sorted enqueue works after dequeuing the head", "[queue]")
+{
+    Queue<Element> queue;
+    Element low{nullptr, nullptr, 1, 0}, high{nullptr, nullptr, 3, 1}, mid{nullptr, nullptr, 2, 2};
+
+    queue.enqueue_sorted(&low, higher_prio);
+    queue.enqueue_sorted(&high, higher_prio);
+
+    REQUIRE(queue.dequeue(queue.head()));
+    CHECK(high.next == nullptr);
+
+    queue.enqueue_sorted(&mid, higher_prio);
+
+    CHECK(drain(queue) == std::vector<int>{2, 0});
+}
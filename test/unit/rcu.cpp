@@ -0,0 +1,340 @@
+/*
+ * RCU Tests
+ *
+ * This file is part of the Hedron hypervisor.
+ *
+ * Hedron is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Hedron is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License version 2 for more details.
+ */
+
+#include "generic_rcu.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <catch2/catch.hpp>
+#include <chrono>
+#include <cstdio>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace
+{
+
+constexpr unsigned MAX_CPUS{64};
+
+// The RCU state of one simulated CPU.
+struct alignas(64) Test_cpu {
+    mword l_batch{0};
+    mword c_batch{0};
+    uint64 c_tsc{0};
+
+    Rcu_list next, curr, done;
+
+    unsigned hazard{0};
+
+    alignas(64) mword q_batch{0};
+};
+
+// Each thread plays the role of one CPU. Every TAG gets its own RCU state, so tests don't see each other's
+// batches.
+template <unsigned TAG> struct Test_cpus {
+    static inline Test_cpu cpus[MAX_CPUS];
+    static inline unsigned num{1};
+    static inline thread_local unsigned self{0};
+
+    // Grace periods as seen by the CPUs that waited for them. See Generic_rcu::update.
+    static inline std::atomic<uint64> batches{0};
+    static inline std::atomic<uint64> wait_ns{0};
+    static inline std::atomic<uint64> max_wait_ns{0};
+
+    static unsigned id() { return self; }
+    static mword online() { return num; }
+
+    template <typename FN> static void for_each_online_cpu(FN fn)
+    {
+        for (unsigned cpu{0}; cpu < num; cpu++) {
+            fn(cpu);
+        }
+    }
+
+    static bool isolated_guest(unsigned) { return false; }
+
+    static mword& l_batch() { return cpus[self].l_batch; }
+    static mword& c_batch() { return cpus[self].c_batch; }
+    static uint64& c_tsc() { return cpus[self].c_tsc; }
+    static Rcu_list& next() { return cpus[self].next; }
+    static Rcu_list& curr() { return cpus[self].curr; }
+    static Rcu_list& done() { return cpus[self].done; }
+    static mword& remote_ref_q_batch(unsigned cpu) { return cpus[cpu].q_batch; }
+    static unsigned& hazard() { return cpus[self].hazard; }
+
+    // There are no NMIs. The threads notice the hazard when they leave the kernel the next time.
+    static void kick()
+    {
+        for_each_online_cpu([](unsigned cpu) { Atomic::set_mask(cpus[cpu].hazard, HZD_IDL); });
+    }
+
+    static uint64 tsc()
+    {
+        return static_cast<uint64>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                       std::chrono::steady_clock::now().time_since_epoch())
+                                       .count());
+    }
+
+    static void count_call() {}
+    static void count_invoke(unsigned, uint64) {}
+
+    static void count_batch(mword, uint64 wait)
+    {
+        batches++;
+        wait_ns += wait;
+
+        for (uint64 m{max_wait_ns.load()}; wait > m and not max_wait_ns.compare_exchange_weak(m, wait);) {
+        }
+    }
+};
+
+// Leave the kernel on the current CPU, which is a quiescent state. This handles the RCU hazards like
+// Ec::handle_hazards and then advances the batches of the CPU, like a periodic tick would.
+template <typename RCU, typename CPUS> void leave_kernel()
+{
+    unsigned const hzd{Atomic::exchange(CPUS::hazard(), 0u)};
+
+    if (hzd & HZD_RCU) {
+        RCU::quiet();
+    }
+
+    if (hzd & HZD_IDL) {
+        RCU::update_expedited();
+    }
+
+    RCU::update();
+}
+
+// An object that readers find via a shared pointer. Its callback only marks it as freed, so readers that
+// wrongly still use it notice instead of touching freed memory.
+struct Test_object : Rcu_elem {
+    std::atomic<bool> freed{false};
+    std::atomic<uint64>* invoked;
+
+    explicit Test_object(std::atomic<uint64>* counter)
+        : Rcu_elem([](Rcu_elem* e) {
+              Test_object* const o{static_cast<Test_object*>(e)};
+
+              o->freed = true;
+              (*o->invoked)++;
+          }),
+          invoked(counter)
+    {
+    }
+};
+
+struct Stress_result {
+    uint64 called;
+    uint64 invoked;
+    uint64 violations;
+    uint64 reads;
+    double seconds;
+};
+
+// Runs readers and updaters as CPUs for the given time. Readers look up objects and check that they are not
+// freed before they leave the kernel. Updaters replace objects and hand the old ones to RCU. At the end, all
+// CPUs keep leaving the kernel until every callback has run.
+template <unsigned TAG>
+Stress_result run_stress(unsigned readers, unsigned updaters, std::chrono::milliseconds duration)
+{
+    using Cpus = Test_cpus<TAG>;
+    using Test_rcu = Generic_rcu<Cpus>;
+
+    constexpr unsigned SLOTS{16};
+
+    std::atomic<uint64> invoked{0}, called{0}, violations{0}, reads{0};
+    std::atomic<unsigned> stopped{0};
+    std::atomic<Test_object*> slots[SLOTS];
+
+    std::mutex all_lock;
+    std::vector<std::unique_ptr<Test_object>> all;
+
+    auto make_object = [&]() {
+        auto o{std::make_unique<Test_object>(&invoked)};
+        Test_object* const ptr{o.get()};
+
+        std::lock_guard<std::mutex> guard{all_lock};
+        all.push_back(std::move(o));
+
+        return ptr;
+    };
+
+    for (auto& s : slots) {
+        s = make_object();
+    }
+
+    Cpus::num = std::min(readers + updaters, MAX_CPUS);
+
+    auto const start{std::chrono::steady_clock::now()};
+
+    {
+        std::atomic<bool> should_exit{false};
+
+        // See the spinlock smoke test for why this must be declared last.
+        std::vector<std::future<void>> futures;
+
+        for (unsigned cpu{0}; cpu < Cpus::num; cpu++) {
+            futures.push_back(std::async(std::launch::async, [&, cpu]() {
+                Cpus::self = cpu;
+
+                bool const updater{cpu >= readers};
+                std::minstd_rand rng{cpu + 1};
+
+                while (not should_exit.load(std::memory_order_relaxed)) {
+                    Test_object* const o{slots[rng() % SLOTS].load(std::memory_order_acquire)};
+
+                    if (updater) {
+                        Test_object* const old{slots[rng() % SLOTS].exchange(make_object())};
+
+                        if (Test_rcu::call(old)) {
+                            called++;
+                        }
+                    }
+
+                    // The object must stay alive until we leave the kernel, even if an updater replaced it.
+                    for (unsigned i{0}; i < 16; i++) {
+                        violations += o->freed.load(std::memory_order_relaxed);
+                    }
+
+                    reads++;
+                    leave_kernel<Test_rcu, Cpus>();
+                }
+
+                // No CPU stops passing through quiescent states before all callbacks ran.
+                stopped++;
+
+                while (stopped.load() != Cpus::num or invoked.load() != called.load()) {
+                    leave_kernel<Test_rcu, Cpus>();
+                    std::this_thread::yield();
+                }
+            }));
+        }
+
+        std::this_thread::sleep_for(duration);
+        should_exit = true;
+    }
+
+    std::chrono::duration<double> const elapsed{std::chrono::steady_clock::now() - start};
+
+    return {called.load(), invoked.load(), violations.load(), reads.load(), elapsed.count()};
+}
+
+} // namespace
+
+TEST_CASE("RCU invokes callbacks only after all CPUs were quiet", "[rcu]")
+{
+    using Cpus = Test_cpus<0>;
+    using Test_rcu = Generic_rcu<Cpus>;
+
+    std::atomic<uint64> invoked{0};
+    Test_object o{&invoked};
+
+    Cpus::num = 2;
+
+    Cpus::self = 0;
+    CHECK(Test_rcu::call(&o));
+    CHECK(Test_rcu::pending());
+
+    // The first update starts a batch, the second one notices it. CPU 0 is quiet when it leaves the kernel,
+    // but CPU 1 isn't yet.
+    leave_kernel<Test_rcu, Cpus>();
+    leave_kernel<Test_rcu, Cpus>();
+    leave_kernel<Test_rcu, Cpus>();
+    CHECK(invoked == 0);
+
+    Cpus::self = 1;
+    leave_kernel<Test_rcu, Cpus>();
+    leave_kernel<Test_rcu, Cpus>();
+    CHECK(invoked == 0);
+
+    Cpus::self = 0;
+    leave_kernel<Test_rcu, Cpus>();
+    CHECK(invoked == 1);
+    CHECK(o.freed);
+    CHECK(not Test_rcu::pending());
+}
+
+TEST_CASE("Expedited RCU kicks all CPUs", "[rcu]")
+{
+    using Cpus = Test_cpus<1>;
+    using Test_rcu = Generic_rcu<Cpus>;
+
+    std::atomic<uint64> invoked{0};
+    Test_object o{&invoked};
+
+    Cpus::num = 2;
+
+    Cpus::self = 0;
+    CHECK(Test_rcu::call(&o));
+    Test_rcu::expedite();
+
+    CHECK(Cpus::cpus[0].hazard & HZD_IDL);
+    CHECK(Cpus::cpus[1].hazard & HZD_IDL);
+
+    // Each CPU handles its HZD_IDL. They kick each other until the batch of CPU 0 is complete.
+    for (unsigned i{0}; i < 8 and invoked == 0; i++) {
+        Cpus::self = i % 2;
+        leave_kernel<Test_rcu, Cpus>();
+    }
+
+    CHECK(invoked == 1);
+}
+
+TEST_CASE("RCU stress test with concurrent readers and updaters", "[rcu]")
+{
+    // We want concurrency even on machines with few CPUs.
+    unsigned const cpus{std::clamp(std::thread::hardware_concurrency(), 4U, 8U)};
+
+    Stress_result const r{run_stress<2>(cpus / 2, cpus - cpus / 2, std::chrono::milliseconds(100))};
+
+    CHECK(r.called > 0);
+    CHECK(r.invoked == r.called);
+    CHECK(r.violations == 0);
+}
+
+// Grace-period latency and callback throughput for different mixes of readers and updaters. This is not run
+// by default. Run it with: test_unit "[.benchmark]"
+TEST_CASE("RCU grace-period benchmark", "[.benchmark][rcu]")
+{
+    unsigned const cpus{std::clamp(std::thread::hardware_concurrency(), 2U, MAX_CPUS)};
+
+    std::chrono::milliseconds const duration{500};
+
+    auto run = [duration](auto tag, char const* name, unsigned readers, unsigned updaters) {
+        using Cpus = Test_cpus<decltype(tag)::value>;
+
+        Stress_result const r{run_stress<decltype(tag)::value>(readers, updaters, duration)};
+        uint64 const batches{Cpus::batches};
+
+        std::printf("%-12s readers %2u updaters %2u: %10.0f callbacks/s %10.0f reads/s, "
+                    "grace period avg %8.1f us max %8.1f us\n",
+                    name, readers, updaters, static_cast<double>(r.invoked) / r.seconds,
+                    static_cast<double>(r.reads) / r.seconds,
+                    batches ? static_cast<double>(Cpus::wait_ns) / static_cast<double>(batches) / 1000. : 0.,
+                    static_cast<double>(Cpus::max_wait_ns) / 1000.);
+
+        CHECK(r.violations == 0);
+    };
+
+    run(std::integral_constant<unsigned, 10>{}, "one updater", 1, 1);
+    run(std::integral_constant<unsigned, 11>{}, "read-mostly", cpus - 1, 1);
+    run(std::integral_constant<unsigned, 12>{}, "balanced", cpus / 2, cpus - cpus / 2);
+    run(std::integral_constant<unsigned, 13>{}, "update-heavy", 1, cpus - 1);
+}
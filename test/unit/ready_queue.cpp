@@ -0,0 +1,253 @@
+/*
+ * Ready Queue Tests
+ *
+ * This file is part of the Hedron hypervisor.
+ *
+ * Hedron is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Hedron is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License version 2 for more details.
+ */
+
+#include "ready_queue.hpp"
+#include "rq.hpp"
+
+#include <catch2/catch.hpp>
+
+#include <algorithm>
+#include <deque>
+#include <random>
+#include <vector>
+
+namespace
+{
+
+struct Element {
+    Element* prev{nullptr};
+    Element* next{nullptr};
+
+    unsigned prio{0};
+    uint64 deadline{0};
+    bool reserved{false};
+
+    int id{0};
+};
+
+constexpr size_t PRIOS{128};
+
+using Test_queue = Ready_queue<Element, PRIOS>;
+
+// Picks and dequeues elements until the queue is empty.
+std::vector<int> drain(Test_queue& queue)
+{
+    std::vector<int> ids;
+
+    for (Element* e; (e = queue.pick());) {
+        queue.dequeue(e, e->reserved);
+        ids.push_back(e->id);
+    }
+
+    return ids;
+}
+
+} // namespace
+
+TEST_CASE("Ready queue picks the highest priority in FIFO order", "[ready_queue]")
+{
+    Test_queue queue;
+    Element e[5];
+
+    unsigned const prios[]{1, 5, 1, 127, 5};
+
+    for (int i = 0; i < 5; i++) {
+        e[i].prio = prios[i];
+        e[i].id = i;
+        queue.enqueue(&e[i]);
+    }
+
+    CHECK(queue.top() == 127);
+    CHECK(queue.size() == 5);
+    CHECK(drain(queue) == std::vector<int>{3, 1, 4, 0, 2});
+    CHECK(queue.top() == 0);
+    CHECK(queue.size() == 0);
+    CHECK(queue.pick() == nullptr);
+}
+
+TEST_CASE("Ready queue picks reservations by deadline before priorities", "[ready_queue]")
+{
+    Test_queue queue;
+    Element e[5];
+
+    uint64 const deadlines[]{30, 10, 20, 10};
+
+    for (int i = 0; i < 4; i++) {
+        e[i].deadline = deadlines[i];
+        e[i].reserved = true;
+        e[i].id = i;
+        queue.enqueue_reserved(&e[i]);
+    }
+
+    e[4].prio = 127;
+    e[4].id = 4;
+    queue.enqueue(&e[4]);
+
+    CHECK(queue.res_head() == &e[1]);
+    CHECK(queue.size() == 5);
+    CHECK(drain(queue) == std::vector<int>{1, 3, 2, 0, 4});
+}
+
+TEST_CASE("Ready queue removes elements from the middle", "[ready_queue]")
+{
+    Test_queue queue;
+    Element e[3];
+
+    for (int i = 0; i < 3; i++) {
+        e[i].prio = 7;
+        e[i].id = i;
+        queue.enqueue(&e[i]);
+    }
+
+    queue.dequeue(&e[1], false);
+    CHECK(e[1].prev == nullptr);
+    CHECK(e[1].next == nullptr);
+
+    queue.dequeue(&e[0], false);
+    CHECK(queue.head(7) == &e[2]);
+
+    queue.dequeue(&e[2], false);
+    CHECK(queue.head(7) == nullptr);
+    CHECK(queue.top() == 0);
+}
+
+// Replays a random trace of wakeups, preemptions and blocking against a simple reference model. The same
+// harness can replay recorded traces against other queue designs.
+TEST_CASE("Ready queue matches a reference model on random traces", "[ready_queue]")
+{
+    std::mt19937 rng{12345};
+
+    Test_queue queue;
+    std::vector<Element> elements(256);
+
+    std::deque<Element*> ref_prio[PRIOS];
+    std::vector<Element*> ref_res;
+    std::vector<Element*> blocked;
+
+    for (size_t i = 0; i < elements.size(); i++) {
+        elements[i].id = static_cast<int>(i);
+        blocked.push_back(&elements[i]);
+    }
+
+    auto ref_pick = [&]() -> Element* {
+        if (not ref_res.empty()) {
+            return ref_res.front();
+        }
+
+        for (size_t p = PRIOS; p-- > 0;) {
+            if (not ref_prio[p].empty()) {
+                return ref_prio[p].front();
+            }
+        }
+
+        return nullptr;
+    };
+
+    auto ref_remove = [&](Element* e) {
+        if (e->reserved) {
+            ref_res.erase(std::find(ref_res.begin(), ref_res.end(), e));
+        } else {
+            auto& l{ref_prio[e->prio]};
+            l.erase(std::find(l.begin(), l.end(), e));
+        }
+    };
+
+    for (int step = 0; step < 100000; step++) {
+        auto const op{rng() % 3};
+
+        if (op == 0 and not blocked.empty()) {
+            // Wake up a blocked element.
+            size_t const idx{rng() % blocked.size()};
+            Element* const e{blocked[idx]};
+
+            blocked.erase(blocked.begin() + static_cast<long>(idx));
+
+            e->reserved = rng() % 4 == 0;
+
+            if (e->reserved) {
+                e->deadline = rng() % 64;
+                queue.enqueue_reserved(e);
+
+                auto pos{std::upper_bound(ref_res.begin(), ref_res.end(), e, [](Element* a, Element* b) {
+                    return a->deadline < b->deadline;
+                })};
+                ref_res.insert(pos, e);
+            } else {
+                e->prio = static_cast<unsigned>(rng() % PRIOS);
+                queue.enqueue(e);
+                ref_prio[e->prio].push_back(e);
+            }
+        } else if (op == 1) {
+            // Run the next element and block it.
+            Element* const e{queue.pick()};
+
+            REQUIRE(e == ref_pick());
+
+            if (e) {
+                queue.dequeue(e, e->reserved);
+                ref_remove(e);
+                blocked.push_back(e);
+            }
+        } else if (Element* const e{queue.pick()}; e) {
+            // Run the next element and put it back, like a preempted SC.
+            REQUIRE(e == ref_pick());
+
+            queue.dequeue(e, e->reserved);
+            ref_remove(e);
+
+            if (e->reserved) {
+                queue.enqueue_reserved(e);
+
+                auto pos{std::upper_bound(ref_res.begin(), ref_res.end(), e, [](Element* a, Element* b) {
+                    return a->deadline < b->deadline;
+                })};
+                ref_res.insert(pos, e);
+            } else {
+                queue.enqueue(e);
+                ref_prio[e->prio].push_back(e);
+            }
+        }
+    }
+
+    CHECK(queue.size() == elements.size() - blocked.size());
+
+    while (Element* const e{queue.pick()}) {
+        REQUIRE(e == ref_pick());
+        queue.dequeue(e, e->reserved);
+        ref_remove(e);
+    }
+
+    CHECK(ref_pick() == nullptr);
+}
+
+TEST_CASE("Remote queue is drained in push order", "[ready_queue]")
+{
+    Remote_queue<Element> rq{nullptr};
+    Element e[3];
+
+    for (int i = 0; i < 3; i++) {
+        e[i].id = i;
+        CHECK(rq.push(&e[i]) == (i == 0));
+    }
+
+    std::vector<int> ids;
+
+    for (Element* ptr = rq.drain(); ptr; ptr = ptr->next) {
+        ids.push_back(ptr->id);
+    }
+
+    CHECK(ids == std::vector<int>{0, 1, 2});
+    CHECK(rq.drain() == nullptr);
+}
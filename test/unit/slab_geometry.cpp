@@ -0,0 +1,71 @@
+/*
+ * Slab Geometry Tests
+ *
+ * This file is part of the Hedron hypervisor.
+ *
+ * Hedron is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Hedron is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License version 2 for more details.
+ */
+
+#include "slab_geometry.hpp"
+
+#include <catch2/catch.hpp>
+
+namespace
+{
+constexpr unsigned long HEADER{40};
+} // namespace
+
+TEST_CASE("Small elements fit into single-page slabs", "[slab_geometry]")
+{
+    Slab_geometry const g{Slab_geometry::of(100, 32, HEADER)};
+
+    CHECK(g.order == 0);
+    CHECK(g.size == 104);
+    CHECK(g.buff == 128);
+    CHECK(g.elem == (PAGE_SIZE - HEADER) / 128);
+    CHECK(g.efficient());
+}
+
+TEST_CASE("Large elements get multi-page slabs", "[slab_geometry]")
+{
+    // Two of these fit into a page, which wastes almost a third of it.
+    Slab_geometry const g{Slab_geometry::of(1344, 32, HEADER)};
+
+    CHECK(g.order > 0);
+    CHECK(g.efficient());
+    CHECK(g.header + g.elem * g.buff + g.slack() == g.bytes());
+
+    Slab_geometry const single_page{0, HEADER, g.size, g.buff, (PAGE_SIZE - HEADER) / g.buff};
+
+    CHECK(not single_page.efficient());
+    CHECK(g.utilization() > single_page.utilization());
+}
+
+TEST_CASE("Inefficient elements get the least wasteful slabs", "[slab_geometry]")
+{
+    // These don't fit into one page and waste more than a quarter of larger slabs.
+    Slab_geometry const g{Slab_geometry::of(6000, 8, HEADER)};
+
+    CHECK(not g.efficient());
+    CHECK(g.order == 1);
+    CHECK(g.elem == 1);
+
+    Slab_geometry const larger{2, HEADER, g.size, g.buff, ((PAGE_SIZE << 2) - HEADER) / g.buff};
+
+    CHECK(g.slack() * larger.bytes() < larger.slack() * g.bytes());
+}
+
+TEST_CASE("Slack is used for cache coloring", "[slab_geometry]")
+{
+    Slab_geometry const g{Slab_geometry::of(1344, 32, HEADER)};
+
+    CHECK(g.colors() == g.slack() / Slab_geometry::COLOR_ALIGN + 1);
+    CHECK((g.colors() - 1) * Slab_geometry::COLOR_ALIGN <= g.slack());
+}
@@ -16,6 +16,8 @@
  */
 
 #include "spinlock.hpp"
+#include "rw_spinlock.hpp"
+#include "seqlock.hpp"
 
 #include <algorithm>
 #include <atomic>
@@ -39,6 +41,21 @@ TEST_CASE("Simple spinlock functionality", "[spinlock]")
     CHECK(not l.is_locked());
 }
 
+TEST_CASE("Spinlock try_lock only takes a free lock", "[spinlock]")
+{
+    Spinlock l;
+
+    REQUIRE(l.try_lock());
+    CHECK(l.is_locked());
+    CHECK(not l.try_lock());
+
+    l.unlock();
+    CHECK(not l.is_locked());
+
+    REQUIRE(l.try_lock());
+    l.unlock();
+}
+
 TEST_CASE("Spinlock smoke test", "[spinlock]")
 {
     static unsigned const thread_count{std::thread::hardware_concurrency()};
@@ -86,3 +103,138 @@ TEST_CASE("Spinlock smoke test", "[spinlock]")
 
     CHECK(unsafe_counter.load() == safe_counter.load());
 }
+
+TEST_CASE("Simple reader-writer spinlock functionality", "[spinlock]")
+{
+    Rw_spinlock l;
+
+    CHECK(not l.is_locked());
+    CHECK(not l.is_locked_shared());
+
+    l.lock_shared();
+    l.lock_shared();
+    CHECK(l.is_locked_shared());
+    CHECK(not l.is_locked());
+
+    l.unlock_shared();
+    l.unlock_shared();
+    CHECK(not l.is_locked_shared());
+
+    l.lock();
+    CHECK(l.is_locked());
+    CHECK(not l.is_locked_shared());
+    l.unlock();
+
+    CHECK(not l.is_locked());
+}
+
+TEST_CASE("Reader-writer spinlock smoke test", "[spinlock]")
+{
+    static unsigned const thread_count{std::max(4U, std::thread::hardware_concurrency())};
+
+    // Writers keep both counters equal. Readers must never see them differ.
+    std::atomic<uint64_t> first{0}, second{0};
+    std::atomic<uint64_t> writes{0}, torn_reads{0};
+
+    {
+        Rw_spinlock l;
+        std::atomic<bool> should_exit{false};
+
+        // See above for why this must be declared last.
+        std::vector<std::future<void>> futures;
+
+        for (unsigned i = 0; i < thread_count; i++) {
+            futures.emplace_back(std::async(std::launch::async, [&, writer = i % 4 == 0]() {
+                while (not should_exit.load(std::memory_order_relaxed)) {
+                    if (writer) {
+                        l.lock();
+                        first.store(first.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                        second.store(second.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                        writes++;
+                        l.unlock();
+                    } else {
+                        l.lock_shared();
+                        if (first.load(std::memory_order_relaxed) != second.load(std::memory_order_relaxed)) {
+                            torn_reads++;
+                        }
+                        l.unlock_shared();
+                    }
+                }
+            }));
+        }
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        should_exit = true;
+    }
+
+    CHECK(torn_reads.load() == 0);
+    CHECK(first.load() == writes.load());
+    CHECK(second.load() == writes.load());
+}
+
+TEST_CASE("Simple seqlock functionality", "[spinlock]")
+{
+    Seqlock l;
+
+    CHECK(not l.is_locked());
+
+    unsigned const start{l.read_begin()};
+    CHECK(not l.read_retry(start));
+
+    l.lock();
+    CHECK(l.is_locked());
+    l.unlock();
+
+    CHECK(not l.is_locked());
+
+    // The reader above overlapped with a writer.
+    CHECK(l.read_retry(start));
+    CHECK(not l.read_retry(l.read_begin()));
+}
+
+TEST_CASE("Seqlock smoke test", "[spinlock]")
+{
+    static unsigned const thread_count{std::max(4U, std::thread::hardware_concurrency())};
+
+    // Writers keep both counters equal. Readers must never accept a read where they differ.
+    std::atomic<uint64_t> first{0}, second{0};
+    std::atomic<uint64_t> writes{0}, torn_reads{0};
+
+    {
+        Seqlock l;
+        std::atomic<bool> should_exit{false};
+
+        // See above for why this must be declared last.
+        std::vector<std::future<void>> futures;
+
+        for (unsigned i = 0; i < thread_count; i++) {
+            futures.emplace_back(std::async(std::launch::async, [&, writer = i % 4 == 0]() {
+                while (not should_exit.load(std::memory_order_relaxed)) {
+                    if (writer) {
+                        l.lock();
+                        first.store(first.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                        second.store(second.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                        writes++;
+                        l.unlock();
+                    } else {
+                        // Read in the opposite order of the writer, so torn reads show up as a difference.
+                        auto const values{l.read([&]() {
+                            uint64_t const s{second.load(std::memory_order_relaxed)};
+                            return std::pair{first.load(std::memory_order_relaxed), s};
+                        })};
+
+                        if (values.first != values.second) {
+                            torn_reads++;
+                        }
+                    }
+                }
+            }));
+        }
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        should_exit = true;
+    }
+
+    CHECK(torn_reads.load() == 0);
+    CHECK(first.load() == writes.load());
+}
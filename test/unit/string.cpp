@@ -18,6 +18,7 @@
 #include "string.hpp"
 #include "string_impl.hpp"
 
+#include <algorithm>
 #include <array>
 #include <catch2/catch.hpp>
 
@@ -31,6 +32,32 @@ TEST_CASE("memcpy works", "[string]")
     CHECK(dst_array == src_array);
 }
 
+TEST_CASE("Word-wise memcpy works", "[string]")
+{
+    std::array<char, 20> dst_array{};
+    std::array<char, 20> src_array{};
+
+    for (size_t i{0}; i < src_array.size(); i++) {
+        src_array[i] = static_cast<char>(i + 1);
+    }
+
+    SECTION("Whole words and a tail")
+    {
+        impl_memcpy_words(dst_array.data(), src_array.data(), 19);
+
+        CHECK(std::equal(dst_array.begin(), dst_array.begin() + 19, src_array.begin()));
+        CHECK(dst_array[19] == 0);
+    }
+
+    SECTION("Less than a word")
+    {
+        impl_memcpy_words(dst_array.data() + 1, src_array.data(), 3);
+
+        std::array<char, 5> const expected = {0, 1, 2, 3, 0};
+        CHECK(std::equal(expected.begin(), expected.end(), dst_array.begin()));
+    }
+}
+
 TEST_CASE("memmove works", "[string]")
 {
     std::array<char, 4> array = {0, 1, 2, 0};
@@ -62,6 +89,18 @@ TEST_CASE("memset works", "[string]")
     CHECK(array == expected);
 }
 
+TEST_CASE("Word-wise memset works", "[string]")
+{
+    std::array<char, 20> array{};
+
+    impl_memset_words(array.data() + 1, 0xab, 17);
+
+    CHECK(array[0] == 0);
+    CHECK(std::all_of(array.begin() + 1, array.begin() + 18, [](char c) { return c == char(0xab); }));
+    CHECK(array[18] == 0);
+    CHECK(array[19] == 0);
+}
+
 TEST_CASE("String prefix match", "[string]")
 {
     char const* string{"foo bar"};
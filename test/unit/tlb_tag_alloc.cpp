@@ -0,0 +1,62 @@
+/*
+ * TLB Tag Allocation Tests
+ *
+ * This file is part of the Hedron hypervisor.
+ *
+ * Hedron is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Hedron is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License version 2 for more details.
+ */
+
+#include "tlb_tag_alloc.hpp"
+
+#include <catch2/catch.hpp>
+
+namespace
+{
+using Small_alloc = Tlb_tag_alloc<2>;
+} // namespace
+
+TEST_CASE("TLB tags are assigned once per generation", "[tlb_tag_alloc]")
+{
+    Small_alloc alloc;
+    Small_alloc::tag_t a{0}, b{0};
+
+    CHECK(alloc.assign(a));
+    CHECK(alloc.assign(b));
+
+    CHECK(Small_alloc::id(a) == 1);
+    CHECK(Small_alloc::id(b) == 2);
+
+    CHECK_FALSE(alloc.assign(a));
+    CHECK_FALSE(alloc.assign(b));
+
+    CHECK(Small_alloc::id(a) == 1);
+    CHECK(Small_alloc::id(b) == 2);
+}
+
+TEST_CASE("TLB tags are recycled in the next generation", "[tlb_tag_alloc]")
+{
+    Small_alloc alloc;
+    Small_alloc::tag_t a{0}, b{0}, c{0}, d{0};
+
+    CHECK(alloc.assign(a));
+    CHECK(alloc.assign(b));
+    CHECK(alloc.assign(c));
+
+    // All identifiers except for zero are handed out, so the next one starts a new generation.
+    CHECK(alloc.assign(d));
+    CHECK(Small_alloc::id(d) == 1);
+
+    // Tags of the previous generation lose their identifier.
+    CHECK(alloc.assign(a));
+    CHECK(Small_alloc::id(a) == 2);
+
+    CHECK_FALSE(alloc.assign(d));
+    CHECK_FALSE(alloc.assign(a));
+}
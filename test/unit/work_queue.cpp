@@ -0,0 +1,192 @@
+/*
+ * Deferred Work Queue Tests
+ *
+ * This file is part of the Hedron hypervisor.
+ *
+ * Hedron is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Hedron is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License version 2 for more details.
+ */
+
+#include "work_queue.hpp"
+
+#include <catch2/catch.hpp>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+namespace
+{
+
+struct Test_item {
+    Work_item item;
+    std::vector<int>* log;
+    int id;
+
+    // How often the item queues itself again after it ran.
+    int again{0};
+    Work_queue* queue{nullptr};
+    bool* notified{nullptr};
+
+    Test_item(std::vector<int>* l, int i) : item{run, this}, log(l), id(i) {}
+
+    static void run(void* ctx)
+    {
+        Test_item* const self{static_cast<Test_item*>(ctx)};
+
+        self->log->push_back(self->id);
+
+        if (self->again > 0) {
+            self->again--;
+
+            if (self->queue->push(&self->item)) {
+                *self->notified = true;
+            }
+        }
+    }
+};
+
+// Behave like a busy CPU in Deferred_work::run: Take one item per notification and notify ourselves again
+// while items are left.
+void run_busy(Work_queue& queue, bool& notified)
+{
+    while (notified) {
+        notified = false;
+
+        bool more;
+        Work_item* const item{queue.pop(more)};
+
+        if (item) {
+            item->fn(item->ctx);
+        }
+
+        if (more) {
+            notified = true;
+        }
+    }
+}
+
+} // namespace
+
+TEST_CASE("Work items are taken in the order they were pushed", "[work_queue]")
+{
+    Work_queue queue{};
+    std::vector<int> log;
+    Test_item a{&log, 1}, b{&log, 2}, c{&log, 3};
+    bool more;
+
+    CHECK(queue.push(&a.item));
+    CHECK_FALSE(queue.push(&b.item));
+
+    CHECK(queue.pop(more) == &a.item);
+    CHECK(more);
+
+    // The queue itself is empty again, so the owner is notified about the new item.
+    CHECK(queue.push(&c.item));
+
+    // The notification for the new item may be gone, so the owner has to look again.
+    CHECK(queue.pop(more) == &b.item);
+    CHECK(more);
+    CHECK(queue.pop(more) == &c.item);
+    CHECK_FALSE(more);
+    CHECK(queue.pop(more) == nullptr);
+    CHECK_FALSE(more);
+}
+
+TEST_CASE("A busy owner that takes one item per notification runs all items", "[work_queue]")
+{
+    Work_queue queue{};
+    std::vector<int> log;
+    bool notified{false};
+
+    Test_item a{&log, 1}, b{&log, 2}, c{&log, 3};
+
+    // The first item queues itself twice more, like a PD teardown that continues in pieces.
+    a.again = 2;
+    a.queue = &queue;
+    a.notified = &notified;
+
+    for (Test_item* t : {&a, &b, &c}) {
+        if (queue.push(&t->item)) {
+            notified = true;
+        }
+    }
+
+    run_busy(queue, notified);
+
+    CHECK(log == std::vector<int>{1, 2, 3, 1, 1});
+    CHECK(queue.pop(notified) == nullptr);
+}
+
+TEST_CASE("Items pushed concurrently are not lost", "[work_queue]")
+{
+    constexpr int THREADS{4};
+    constexpr int ITEMS{1000};
+
+    Work_queue queue{};
+    std::atomic<bool> notified{false};
+    std::vector<int> log;
+    std::vector<std::vector<Test_item>> items(THREADS);
+
+    for (int t{0}; t < THREADS; t++) {
+        // The items point to themselves, so they must not move.
+        items[t].reserve(ITEMS);
+
+        for (int i{0}; i < ITEMS; i++) {
+            items[t].emplace_back(&log, t * ITEMS + i);
+        }
+    }
+
+    std::vector<std::thread> threads;
+
+    for (int t{0}; t < THREADS; t++) {
+        threads.emplace_back([&queue, &notified, &items, t] {
+            for (Test_item& item : items[t]) {
+                if (queue.push(&item.item)) {
+                    notified = true;
+                }
+            }
+        });
+    }
+
+    // Only look at the queue when notified, like a busy CPU does.
+    size_t idle_rounds{0};
+
+    while (log.size() < THREADS * ITEMS and idle_rounds < 100000000) {
+        if (not notified.exchange(false)) {
+            idle_rounds++;
+            continue;
+        }
+
+        bool more;
+        Work_item* const item{queue.pop(more)};
+
+        if (item) {
+            item->fn(item->ctx);
+        }
+
+        if (more) {
+            notified = true;
+        }
+    }
+
+    for (std::thread& t : threads) {
+        t.join();
+    }
+
+    REQUIRE(log.size() == THREADS * ITEMS);
+
+    // Items of each thread keep their order.
+    std::vector<int> last(THREADS, -1);
+
+    for (int id : log) {
+        CHECK(id > last[id / ITEMS]);
+        last[id / ITEMS] = id;
+    }
+}